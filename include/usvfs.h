@@ -26,6 +26,7 @@ along with usvfs. If not, see <http://www.gnu.org/licenses/>.
 #endif
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#include <cstdint>
 #include "usvfsparameters.h"
 
 
@@ -37,16 +38,17 @@ along with usvfs. If not, see <http://www.gnu.org/licenses/>.
  *   - link directory (dynamic)
  *   - delete file
  *   - delete directory
+ *   - copy-on-write (USVFSParameters::copyOnWrite, changes to files are done in a copy of the
+ *     file in the create target, the original is kept on disc but hidden)
  * Maybe:
  *   - rename/move (= copy + delete)
- *   - copy-on-write semantics (changes to files are done in a separate copy of the file, the original is kept on disc but hidden)
  */
 
 
 static const unsigned int LINKFLAG_FAILIFEXISTS   = 0x00000001; // if set, linking fails in case of an error
 static const unsigned int LINKFLAG_MONITORCHANGES = 0x00000002; // if set, changes to the source directory after the link operation
                                                                 // will be updated in the virtual fs. only relevant in static
-                                                                // link directory operations
+                                                                // link directory operations with LINKFLAG_RECURSIVE
 static const unsigned int LINKFLAG_CREATETARGET   = 0x00000004; // if set, file creation (including move or copy) operations to
                                                                 // destination will be redirected to the source. Only one createtarget
                                                                 // can be set for a destination folder so this flag will replace
@@ -54,6 +56,99 @@ static const unsigned int LINKFLAG_CREATETARGET   = 0x00000004; // if set, file
                                                                 // If there different create-target have been set for an element and one of its
                                                                 // ancestors, the inner-most create-target is used
 static const unsigned int LINKFLAG_RECURSIVE      = 0x00000008; // if set, directories are linked recursively
+static const unsigned int LINKFLAG_MATERIALIZE    = 0x00000010; // if set, files of a recursive static directory link are hard linked
+                                                                // into a staging directory on the volume of the source
+                                                                // (<volume>\usvfs_staging\<instance name>) and their nodes point at
+                                                                // the links. Writes go through create target and copy-on-write like
+                                                                // for any other node. The hard links are deleted by
+                                                                // ClearVirtualMappings, VirtualApplyMappings and DisconnectVFS, links
+                                                                // a crashed session left behind the next time the staging directory
+                                                                // is used. Ignored together with LINKFLAG_MONITORCHANGES and by
+                                                                // VirtualApplyMappings
+
+static const unsigned int VFSDUMP_TEXT   = 0; // same text as CreateVFSDump
+static const unsigned int VFSDUMP_BINARY = 1; // see CreateVFSDumpStream
+
+static const unsigned int HOOKSTAT_NAME_LENGTH     = 48;
+static const unsigned int HOOKSTAT_LATENCY_BUCKETS = 32;
+
+/**
+ * call statistics of one hook, summed over all processes connected to the vfs
+ */
+struct HookStatistics {
+  char name[HOOKSTAT_NAME_LENGTH];
+  uint64_t calls;
+  uint64_t redirected;       // calls that were rerouted to a different path
+  uint64_t hookNanoseconds;  // total time spent in the hook, including the real call
+  uint64_t realNanoseconds;  // total time spent in the original function
+  uint64_t latency[HOOKSTAT_LATENCY_BUCKETS]; // latency[i] counts calls that took
+                                              // between 2^i and 2^(i+1) ns in the hook
+};
+
+/**
+ * acquisitions of the hook context lock, summed over all processes connected to the vfs
+ */
+struct ContextLockStatistics {
+  uint64_t sharedAcquisitions;
+  uint64_t exclusiveAcquisitions;
+  uint64_t contendedShared;     // shared acquisitions that had to wait
+  uint64_t contendedExclusive;  // exclusive acquisitions that had to wait
+  uint64_t waitNanoseconds;     // total time spent waiting
+  uint64_t maxWaitNanoseconds;  // longest single wait
+};
+
+/**
+ * waits on the hook context lock attributed to the function that held it exclusively
+ * at the time. Waits on shared holders are reported under the name "(shared)"
+ */
+struct ContextLockHolder {
+  char source[HOOKSTAT_NAME_LENGTH];
+  uint64_t contended;
+  uint64_t waitNanoseconds;
+};
+
+/**
+ * memory usage of one of the vfs trees, see GetVFSTreeStatistics
+ */
+struct VFSTreeStatistics {
+  uint64_t directories;
+  uint64_t files;
+  uint64_t nameBytes;     // bytes used by node names
+  uint64_t targetBytes;   // bytes used by link targets
+  uint64_t segmentSize;   // size of the shared memory segment holding the tree
+  uint64_t freeBytes;     // bytes still free in the segment
+  uint64_t overheadBytes; // used bytes not taken by nodes, names or targets: indices,
+                          // allocator bookkeeping and fragmentation
+  uint32_t growthCount;   // number of times the tree was moved to a larger segment
+  uint32_t reserved;
+};
+
+/**
+ * time spent starting a hooked process, see GetStartupTimings
+ */
+struct StartupTimings {
+  // measured by the caller of CreateProcessHooked for the last process it started
+  uint64_t createProcessNanoseconds; // CreateProcessW, the process is still suspended
+  uint64_t injectNanoseconds;        // injecting usvfs, including the proxy or broker
+                                     // for processes of the other bitness
+  uint64_t injectDLLNanoseconds;     // InjectLib::InjectDLL, 0 if a proxy or broker
+                                     // injected
+  // measured by the hooked process while it was started
+  uint64_t initHooksNanoseconds;     // InitHooks as a whole
+  uint64_t attachNanoseconds;        // attaching to the configuration and the trees
+  uint64_t hookNanoseconds;          // installing the hooks
+};
+
+/**
+ * one link of the complete set of links passed to VirtualApplyMappings
+ */
+struct VirtualMapping {
+  LPCWSTR source;
+  LPCWSTR destination;
+  unsigned int flags; // LINKFLAG_* as for VirtualLinkFile and VirtualLinkDirectoryStatic
+  BOOL directory;     // if true the source is linked like VirtualLinkDirectoryStatic does,
+                      // otherwise like VirtualLinkFile does
+};
 
 
 extern "C" {
@@ -63,6 +158,49 @@ extern "C" {
  */
 DLLEXPORT void WINAPI ClearVirtualMappings();
 
+/**
+ * start a batch of link operations. Until CommitVFSBatch is called, VirtualLinkFile,
+ * VirtualLinkDirectoryStatic and ClearVirtualMappings work on a private copy of the
+ * vfs which isn't visible to hooked processes yet.
+ * @return false if no vfs is connected or a batch is already active
+ */
+DLLEXPORT BOOL WINAPI BeginVFSBatch();
+
+/**
+ * publish all link operations made since BeginVFSBatch in one step. The shared tables
+ * are replaced by segments sized to fit the new content.
+ * @note changes hooked processes made to the vfs while the batch was active are lost
+ */
+DLLEXPORT BOOL WINAPI CommitVFSBatch();
+
+/**
+ * store a read-only, compact copy of the current vfs in shared memory. Hooked
+ * processes use it for lookups instead of the regular tree, without locking, as long
+ * as the vfs isn't modified. Any modification invalidates the copy so FreezeVFS has to be called again
+ * after the next change.
+ * @note intended to be called once all mappings are set up, e.g. after CommitVFSBatch
+ */
+DLLEXPORT BOOL WINAPI FreezeVFS();
+
+/**
+ * save the current vfs to a file, together with the directory links made so far and
+ * the last write time of every linked source directory.
+ * @note call this right after setting up the mappings, changes to the source
+ *       directories in between are not detected by LoadVFSSnapshot
+ */
+DLLEXPORT BOOL WINAPI SaveVFSSnapshot(LPCWSTR fileName);
+
+/**
+ * replace the current vfs with one saved by SaveVFSSnapshot. Only source directories
+ * that changed since the snapshot was saved are scanned again, monitored links are
+ * monitored again.
+ * @return false if the file doesn't exist or isn't a valid snapshot. In that case the
+ *         mappings are unchanged and have to be set up from scratch. If loading
+ *         fails later on the vfs is left empty
+ * @note links made with VirtualLinkFile aren't validated
+ */
+DLLEXPORT BOOL WINAPI LoadVFSSnapshot(LPCWSTR fileName);
+
 /**
  * link a file virtually
  * @note: the directory the destination file resides in has to exist - at least virtually.
@@ -76,15 +214,78 @@ DLLEXPORT BOOL WINAPI VirtualLinkFile(LPCWSTR source, LPCWSTR destination, unsig
  */
 DLLEXPORT BOOL WINAPI VirtualLinkDirectoryStatic(LPCWSTR source, LPCWSTR destination, unsigned int flags);
 
+/**
+ * link a directory virtually as a layer on top of all layers linked before. The content is linked
+ * recursively like VirtualLinkDirectoryStatic does, but the layers providing each path are
+ * remembered so layers can be removed or reordered later on in time proportional to the files
+ * involved instead of rebuilding the vfs.
+ * @param layer id of the layer, chosen by the caller
+ * @param flags only LINKFLAG_CREATETARGET is supported
+ * @return false if a layer with that id exists already
+ * @note paths provided by layers are owned by them, they shouldn't be linked by the other functions
+ *       as well. Layers aren't stored in snapshots, ClearVirtualMappings removes them
+ */
+DLLEXPORT BOOL WINAPI VirtualLinkLayer(unsigned int layer, LPCWSTR source, LPCWSTR destination,
+                                       unsigned int flags);
+
+/**
+ * remove a layer. Paths it provided are taken over by the next layer providing them or removed
+ */
+DLLEXPORT BOOL WINAPI RemoveVirtualLayer(unsigned int layer);
+
+/**
+ * change the priority of the layers
+ * @param layers ids of all layers, lowest priority first
+ * @return false if the list doesn't contain every layer exactly once
+ */
+DLLEXPORT BOOL WINAPI SetVirtualLayerOrder(const unsigned int *layers, size_t count);
+
+/**
+ * replace all links with the specified ones. The result is the same as clearing the vfs and
+ * making the links in the listed order, but the new content is compared against the current vfs
+ * and only nodes that are added, removed or linked to a different target are touched. Hooked
+ * processes are notified once, so enabling a single mod costs time proportional to its files
+ * instead of a rebuild of the whole vfs.
+ * @note directory links with LINKFLAG_FAILIFEXISTS whose destination exists are skipped. Layers
+ *       are removed, links made by hooked processes are lost
+ */
+DLLEXPORT BOOL WINAPI VirtualApplyMappings(const VirtualMapping *mappings, size_t count);
+
+/**
+ * project a directory of the vfs into another directory through the windows projected file
+ * system (windows 10 1809 and later, the optional feature has to be enabled). The projection
+ * shows what hooked processes see at the virtual path, built by the same link functions, but
+ * doesn't need hooks: any process can use it and after a file was read once it's accessed at
+ * native speed. Only one projection can be active, starting another one stops the previous.
+ * @param virtualPath directory of the vfs to project
+ * @param projectionRoot directory the projection appears in. Created if it doesn't exist,
+ *        otherwise it has to be empty or a directory projected into before
+ * @return false if the projected file system isn't available or the root can't be used
+ * @note a file is copied from the target it has when it's first read, later changes of its
+ *       link don't affect the copy. Changes made in the projection stay in the projection root
+ *       and aren't applied to the linked directories
+ */
+DLLEXPORT BOOL WINAPI StartVFSProjection(LPCWSTR virtualPath, LPCWSTR projectionRoot);
+
+/**
+ * stop the projection started by StartVFSProjection. Files read so far stay in the root
+ */
+DLLEXPORT void WINAPI StopVFSProjection();
+
 /**
  * connect to a virtual filesystem as a controller, without hooking the calling process. Please note that
  * you can only be connected to one vfs, so this will silently disconnect from a previous vfs.
+ * If logging was initialized with InitLogging, log messages go to the queue of the instance
+ * from here on. Messages not retrieved yet are moved over, but no thread may be blocked in
+ * GetLogMessages while the queue is switched
  */
 DLLEXPORT BOOL WINAPI ConnectVFS(const USVFSParameters *parameters);
 
 /**
  * @brief create a new VFS. This is similar to ConnectVFS except it guarantees
  *   the vfs is reset before use.
+ * @note set parameters->mappingCapacity to the expected number of mappings to have the
+ *   redirection tree created at its final size instead of growing it repeatedly
  */
 DLLEXPORT BOOL WINAPI CreateVFS(const USVFSParameters *parameters);
 
@@ -113,10 +314,19 @@ DLLEXPORT BOOL WINAPI CreateProcessHooked(
 /**
  * retrieve a single log message.
  * FIXME There is currently no way to unblock from the caller side
- * FIXME retrieves log messages from all instances, the logging queue is not separated
+ * Every instance has its own queue, this retrieves the messages of the instance
+ * this process connected to last (or of processes not connected to any instance)
  */
 DLLEXPORT bool WINAPI GetLogMessages(LPSTR buffer, size_t size, bool blocking = false);
 
+/**
+ * retrieve as many log messages as fit into the buffer. The messages are stored
+ * one after another, each terminated by a zero, the list ends with an empty message.
+ * Buffers of less than 1025 bytes can't receive any messages
+ * @return number of messages retrieved
+ */
+DLLEXPORT size_t WINAPI GetLogMessagesBatch(LPSTR buffer, size_t size, bool blocking = false);
+
 /**
  * @brief Used to change parameters which can be changed in runtime
  */
@@ -132,6 +342,77 @@ DLLEXPORT void WINAPI USVFSUpdateParams(LogLevel level, CrashDumpsType type);
  */
 DLLEXPORT BOOL WINAPI CreateVFSDump(LPSTR buffer, size_t *size);
 
+/**
+ * receives the dump in chunks of up to 64kb
+ * @return FALSE to cancel the dump
+ */
+typedef BOOL (WINAPI *VFSDumpCallback)(LPCSTR data, size_t size, LPVOID userData);
+
+/**
+ * walks the vfs tree once and passes the dump to callback piece by piece, so
+ * memory use doesn't depend on the size of the tree.
+ * The binary format (VFSDUMP_BINARY) starts with the 4 bytes "USVD" and a
+ * uint32_t version (1), followed by one record per node in the order of the
+ * text dump: uint16_t depth, uint16_t flags (1 = directory, 2 = linked),
+ * uint16_t name length, uint16_t target length, then the name and the target,
+ * both utf-8 and not zero terminated. Numbers are little-endian
+ * @param format VFSDUMP_TEXT or VFSDUMP_BINARY
+ * @return FALSE if the callback canceled the dump or the format is unknown
+ */
+DLLEXPORT BOOL WINAPI CreateVFSDumpStream(unsigned int format, VFSDumpCallback callback,
+                                          LPVOID userData);
+
+/**
+ * like CreateVFSDumpStream but writes the dump to a file opened for writing
+ */
+DLLEXPORT BOOL WINAPI CreateVFSDumpFile(unsigned int format, HANDLE file);
+
+/**
+ * retrieve memory usage of the redirection tree or the inverse tree. This only reads
+ * counters maintained as the tree changes so it's cheap to call regularly
+ * @param inverse TRUE for the tree of reverse mappings, FALSE for the redirection tree
+ */
+DLLEXPORT BOOL WINAPI GetVFSTreeStatistics(BOOL inverse, VFSTreeStatistics *statistics);
+
+/**
+ * turn recording of hook statistics on or off for all processes connected to the vfs.
+ * Recording is off initially as it adds two timer queries to every hooked call
+ */
+DLLEXPORT BOOL WINAPI EnableHookStatistics(BOOL enable);
+
+/**
+ * retrieve the statistics recorded since the vfs was created or statistics were last
+ * reset
+ * @param statistics buffer to write to, may be null to only determine the count
+ * @param count pointer to the capacity of statistics. After the call this contains
+ *              the number of hooks with statistics, even if that is bigger than
+ *              the capacity
+ */
+DLLEXPORT BOOL WINAPI GetHookStatistics(HookStatistics *statistics, size_t *count);
+
+/**
+ * retrieve the hook context lock statistics recorded while hook statistics were enabled
+ * @param statistics receives the totals, may be null
+ * @param holders buffer for the per-holder breakdown, may be null
+ * @param count pointer to the capacity of holders. After the call this contains the
+ *              number of holders, even if that is bigger than the capacity
+ */
+DLLEXPORT BOOL WINAPI GetContextLockStatistics(ContextLockStatistics *statistics,
+                                               ContextLockHolder *holders, size_t *count);
+
+/**
+ * clear all recorded hook and context lock statistics
+ */
+DLLEXPORT BOOL WINAPI ResetHookStatistics();
+
+/**
+ * retrieve how long starting hooked processes took. In a process injected by usvfs
+ * this covers its own InitHooks, in a process that calls CreateProcessHooked the
+ * injection of the last process it started. Phases that didn't happen in this process
+ * are 0
+ */
+DLLEXPORT BOOL WINAPI GetStartupTimings(StartupTimings *timings);
+
 /**
  * adds an executable to the blacklist so it doesn't get exposed to the virtual
  * file system
@@ -155,6 +436,16 @@ DLLEXPORT VOID WINAPI ForceLoadLibrary(LPWSTR processName, LPWSTR libraryPath);
  */
 DLLEXPORT VOID WINAPI ClearLibraryForceLoads();
 
+/**
+ * set which files get an entry in the inverse table, which maps the real location
+ * of a linked file back to its virtual path for GetModuleFileName. The inverse
+ * table is rebuilt before the next process starts
+ * @param extensions semicolon separated list of extensions, like ".exe;.dll" (the
+ *                   default). An empty string disables the inverse table, nullptr
+ *                   restores the default
+ */
+DLLEXPORT VOID WINAPI SetInverseTableExtensions(LPCWSTR extensions);
+
 /**
  * print debugging info about the vfs. The format is currently not fixed and may
  * change between usvfs versions
@@ -40,6 +40,26 @@ struct USVFSParameters {
   LogLevel logLevel{LogLevel::Debug};
   CrashDumpsType crashDumpsType{CrashDumpsType::None};
   char crashDumpsPath[260];
+  uint32_t mappingCapacity{0}; // expected number of mapped files and directories. If set,
+                               // the redirection tree is created large enough up front
+  uint32_t logSampleInterval{0}; // log every n-th call hooks pass through unchanged,
+                                 // 0 means those calls aren't logged
+  uint32_t logRateLimit{0}; // maximum number of log messages per hook and second for
+                            // passthrough and for rerouted calls each. Calls usvfs
+                            // caused errors in are always logged. 0 means no limit
+  char traceDirectory[260]{}; // utf-8 directory each process writes a trace of all hook
+                              // calls to. empty disables tracing
+  bool iniCache{false}; // answer ini reads on rerouted files from a cache of parsed
+                        // files instead of letting the system parse them every time
+  bool copyOnWrite{false}; // copy mapped files to the create target when they are first
+                           // opened for writing so the mapped originals stay unchanged
+  bool attributeCache{false}; // remember the attributes of rerouted files instead of
+                              // querying them every time. Mapped directories must not
+                              // be changed by processes outside the vfs then
+  char readAheadDirectory[260]{}; // utf-8 directory for the read-ahead profiles of the
+                                  // executables. empty disables read-ahead
+  bool prefaultTree{false}; // map all pages of the redirection tree when a process is
+                            // hooked instead of faulting them in during lookups
 };
 
 }
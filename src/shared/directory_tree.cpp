@@ -34,3 +34,14 @@ void usvfs::shared::advanceIter(fs::path::iterator &iter,
          (iter->wstring() == L"/" || iter->wstring() == L"\\" || iter->wstring() == L"."))
     ++iter;
 }
+
+size_t usvfs::shared::componentToUTF8(const wchar_t *component, size_t length,
+                                      char *buffer, size_t bufferSize) {
+  if (length == 0) {
+    return 0;
+  }
+  int res = ::WideCharToMultiByte(CP_UTF8, 0, component, static_cast<int>(length),
+                                  buffer, static_cast<int>(bufferSize),
+                                  nullptr, nullptr);
+  return res > 0 ? static_cast<size_t>(res) : 0;
+}
@@ -26,26 +26,32 @@ along with usvfs. If not, see <http://www.gnu.org/licenses/>.
 #include "logging.h"
 #include "stringutils.h"
 #include <boost/predef.h>
-#include <boost/lexical_cast.hpp>
 #include <boost/format.hpp>
 #include "exceptionex.h"
+#include "interprocess_lock.h"
+#include "etwprovider.h"
 #include <boost/interprocess/containers/string.hpp>
 #include <boost/interprocess/containers/map.hpp>
 #include <boost/interprocess/containers/vector.hpp>
 #include <boost/multi_index_container.hpp>
 #include <boost/multi_index/ordered_index.hpp>
+#include <boost/multi_index/hashed_index.hpp>
 #include <boost/multi_index/member.hpp>
+#include <boost/multi_index/identity.hpp>
 #include <boost/interprocess/smart_ptr/shared_ptr.hpp>
 #include <boost/interprocess/smart_ptr/weak_ptr.hpp>
 #include <boost/interprocess/smart_ptr/deleter.hpp>
-#include <boost/interprocess/sync/named_mutex.hpp>
 #include <map>
+#include <vector>
 #include <memory>
-#include <regex>
+#include <limits>
 #include <functional>
+#include <algorithm>
 #include <iomanip>
 #include <memory>
 #include <cstdint>
+#include <atomic>
+#include <array>
 #include <codecvt>
 #include <spdlog.h>
 
@@ -85,15 +91,62 @@ template <typename T> T createDataEmpty(const VoidAllocatorT &allocator);
 
 template <typename T> void dataAssign(T &destination, const T &source);
 
+/**
+ * @return bytes of shared memory the data of a node holds on to, for the tree
+ *         statistics. Specialize for data types that own strings
+ */
+template <typename T> size_t dataSize(const T&) { return 0; }
+
 // crappy little workaround for fs::path iterating over path separators
 fs::path::iterator nextIter(const fs::path::iterator &iter,
                             const fs::path::iterator &end);
 
 void advanceIter(fs::path::iterator &iter, const fs::path::iterator &end);
 
+// maximum size in bytes of a single path component in utf-8
+static const size_t MAX_COMPONENT_UTF8 = 1024;
+
+/**
+ * @brief convert a single path component to utf-8 into a caller supplied buffer
+ * @return number of bytes written or 0 if the component couldn't be converted
+ */
+size_t componentToUTF8(const wchar_t *component, size_t length,
+                       char *buffer, size_t bufferSize);
+
 namespace bi = boost::interprocess;
 namespace bmi = boost::multi_index;
 
+/**
+ * @brief counters of the nodes in one shared memory segment. They are updated as
+ *        nodes are created, changed and destroyed so reading them doesn't have to
+ *        walk the tree. Kept as a unique instance in the segment
+ */
+struct TreeCounters {
+  std::atomic<int64_t> directories { 0 };
+  std::atomic<int64_t> files { 0 };
+  std::atomic<int64_t> nameBytes { 0 };
+  std::atomic<int64_t> dataBytes { 0 };
+
+  static TreeCounters *get(SegmentManagerT *manager) {
+    return manager->find_or_construct<TreeCounters>(bi::unique_instance)();
+  }
+};
+
+/**
+ * @brief memory usage of a tree, see TreeContainer::usage
+ */
+struct TreeUsage {
+  uint64_t directories;
+  uint64_t files;
+  uint64_t nameBytes;     // names and their folded keys
+  uint64_t dataBytes;     // strings owned by the node data (link targets)
+  uint64_t segmentSize;
+  uint64_t freeBytes;
+  uint64_t overheadBytes; // used bytes not accounted for by nodes, names and data:
+                          // child indices, allocator bookkeeping and fragmentation
+  uint32_t growthCount;   // number of times the tree moved to a larger segment
+};
+
 typedef uint8_t TreeFlags;
 
 
@@ -126,12 +179,138 @@ template <typename T1, typename T2, typename Alloc> struct mutable_pair {
   mutable T2 second;
 };
 
-template <typename Key, typename T, typename Compare, typename Allocator,
+// tag for the index that keeps children sorted by name, used for enumeration
+struct ByOrder {};
+// tag for the hashed index used to look up children by name
+struct ByName {};
+// tag for the hashed index of children by extension, used for *.ext searches
+struct ByExtension {};
+
+/**
+ * @brief a process-local reference to a name used to look up nodes. The hash is
+ *        calculated once, the name itself is not copied
+ */
+struct NodeName {
+  NodeName(const char *name)
+    : data(name), size(strlen(name)), hash(foldedHash(data, size))
+  {}
+  NodeName(const char *name, size_t length)
+    : data(name), size(length), hash(foldedHash(data, size))
+  {}
+  NodeName(const std::string &name)
+    : data(name.c_str()), size(name.size()), hash(foldedHash(data, size))
+  {}
+  NodeName(const StringT &name)
+    : data(name.c_str()), size(name.size()), hash(foldedHash(data, size))
+  {}
+
+  const char *data;
+  size_t size;
+  uint32_t hash;
+};
+
+/**
+ * @brief bit filter of path prefixes stored along with a tree. Each path added to the
+ *        tree sets the bits of its first DEPTH components so lookups of paths outside
+ *        of the mapped directories can be rejected without walking the tree.
+ *        This may produce false positives but never false negatives
+ */
+struct PrefixFilter {
+  static const int DEPTH = 3;
+  static const uint32_t WORDS = 256; // 8k bits, kept small so tiny segments still fit
+  static const uint32_t SEED = 2166136261U;
+  // root bit for everything that isn't a drive letter, like unc paths
+  static const uint32_t OTHER_ROOT = 0x80000000U;
+
+  PrefixFilter() { reset(); }
+
+  /**
+   * @return the bit representing the root with the specified name in the root mask.
+   *         Drives get a bit each, all other roots share OTHER_ROOT
+   */
+  static uint32_t rootBit(const char *component, size_t size) {
+    if ((size == 2) && (component[1] == ':')) {
+      char letter = foldChar(component[0]);
+      if ((letter >= 'A') && (letter <= 'Z')) {
+        return 1U << (letter - 'A');
+      }
+    }
+    return OTHER_ROOT;
+  }
+
+  void setRoot(uint32_t bit) {
+    roots.fetch_or(bit, std::memory_order_relaxed);
+  }
+
+  /**
+   * @return mask of the roots of all paths added to the tree
+   */
+  uint32_t rootMask() const {
+    return roots.load(std::memory_order_relaxed);
+  }
+
+  static uint32_t combine(uint32_t hash, const char *component, size_t size) {
+    // continue the fnv-1a hash over the folded component, with a separator in front
+    hash = (hash ^ static_cast<unsigned char>('\\')) * 16777619U;
+    for (size_t i = 0; i < size; ++i) {
+      hash = (hash ^ static_cast<unsigned char>(foldChar(component[i]))) * 16777619U;
+    }
+    return hash;
+  }
+
+  void set(uint32_t hash) {
+    for (uint32_t bit : bits(hash)) {
+      words[(bit / 32) % WORDS].fetch_or(1U << (bit % 32), std::memory_order_relaxed);
+    }
+  }
+
+  bool test(uint32_t hash) const {
+    for (uint32_t bit : bits(hash)) {
+      if ((words[(bit / 32) % WORDS].load(std::memory_order_relaxed) & (1U << (bit % 32))) == 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void reset() {
+    for (auto &word : words) {
+      word.store(0, std::memory_order_relaxed);
+    }
+    roots.store(0, std::memory_order_relaxed);
+  }
+
+  void assign(const PrefixFilter &reference) {
+    for (uint32_t i = 0; i < WORDS; ++i) {
+      words[i].store(reference.words[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+    roots.store(reference.rootMask(), std::memory_order_relaxed);
+  }
+
+private:
+  static std::array<uint32_t, 2> bits(uint32_t hash) {
+    // two probes derived from one hash
+    return {{ hash, (hash >> 17) | (hash << 15) }};
+  }
+
+  std::atomic<uint32_t> words[WORDS];
+  std::atomic<uint32_t> roots;
+};
+
+/**
+ * child map of a node. Elements consist of the folded name hash of the child and the
+ * child itself, the child stores the folded key to compare against
+ */
+template <typename Key, typename T, typename Compare, typename Hash,
+          typename Pred, typename ExtensionKey, typename Allocator,
           typename Element = mutable_pair<Key, T, Allocator>>
 using mimap = bmi::multi_index_container<
   Element, bmi::indexed_by<
-    bmi::ordered_unique<
-      bmi::member<Element, Key,&Element::first>, Compare>
+    bmi::ordered_unique<bmi::tag<ByOrder>,
+      bmi::identity<Element>, Compare>,
+    bmi::hashed_unique<bmi::tag<ByName>,
+      bmi::identity<Element>, Hash, Pred>,
+    bmi::hashed_non_unique<bmi::tag<ByExtension>, ExtensionKey>
     >, typename Allocator::template rebind<Element>::other
 >;
 
@@ -147,24 +326,81 @@ class DirectoryTree
 
 protected:
 
+  // map elements and lookup keys are compared through the precomputed folded key
+  // of the child node so comparison never has to fold case again
+
   struct CILess
   {
-    template <typename U, typename V>
-    bool operator() (const U &lhs, const V &rhs) const
+    template <typename Element>
+    bool operator() (const Element &lhs, const Element &rhs) const
     {
-      return _stricmp(getCharPtr(lhs), getCharPtr(rhs)) < 0;
+      return foldedCompare(lhs.second->m_Key.c_str(), lhs.second->m_Key.size(),
+                           rhs.second->m_Key.c_str(), rhs.second->m_Key.size()) < 0;
     }
+  };
 
-  private:
-    const char *getCharPtr(const StringT &s) const {
-      return s.c_str();
+  struct CIEqual
+  {
+    template <typename Element>
+    bool operator() (const Element &lhs, const Element &rhs) const
+    {
+      return (lhs.first == rhs.first) && (lhs.second->m_Key == rhs.second->m_Key);
+    }
+
+    template <typename Element>
+    bool operator() (const NodeName &lhs, const Element &rhs) const
+    {
+      return (lhs.hash == rhs.first) && rhs.second->keyMatches(lhs);
+    }
+
+    template <typename Element>
+    bool operator() (const Element &lhs, const NodeName &rhs) const
+    {
+      return operator()(rhs, lhs);
+    }
+  };
+
+  struct CIHash
+  {
+    template <typename Element>
+    size_t operator() (const Element &value) const
+    {
+      return value.first;
+    }
+
+    size_t operator() (const NodeName &value) const
+    {
+      return value.hash;
+    }
+  };
+
+  // compares the keys of children to a folded prefix, for range lookups in the
+  // ordered index
+  struct PrefixLess
+  {
+    template <typename Element>
+    bool operator() (const Element &lhs, const std::string &rhs) const
+    {
+      return foldedCompare(lhs.second->m_Key.c_str(), lhs.second->m_Key.size(),
+                           rhs.c_str(), rhs.size()) < 0;
     }
 
-    const char *getCharPtr(const std::string &s) const {
-      return s.c_str();
+    template <typename Element>
+    bool operator() (const std::string &lhs, const Element &rhs) const
+    {
+      return foldedCompare(lhs.c_str(), lhs.size(),
+                           rhs.second->m_Key.c_str(), rhs.second->m_Key.size()) < 0;
     }
-    const char *getCharPtr(const char *s) const {
-      return s;
+  };
+
+  struct ExtensionOf
+  {
+    typedef uint32_t result_type;
+
+    template <typename Element>
+    uint32_t operator() (const Element &value) const
+    {
+      return value.second->m_ExtensionHash;
     }
   };
 
@@ -177,9 +413,11 @@ public:
   typedef bi::shared_ptr<NodeT, VoidAllocatorT, DeleterT> NodePtrT;
   typedef bi::weak_ptr<NodeT, VoidAllocatorT, DeleterT> WeakPtrT;
 
-  typedef bi::allocator<std::pair<const StringT, NodePtrT>, SegmentManagerT> NodeEntryAllocatorT;
+  typedef bi::allocator<std::pair<const uint32_t, NodePtrT>, SegmentManagerT> NodeEntryAllocatorT;
 
-  typedef mimap<StringT, NodePtrT, CILess, NodeEntryAllocatorT> NodeMapT;
+  typedef mimap<uint32_t, NodePtrT, CILess, CIHash, CIEqual, ExtensionOf,
+                NodeEntryAllocatorT> NodeMapT;
+  typedef typename NodeMapT::template index<ByName>::type NodeLookupT;
   typedef typename NodeMapT::iterator file_iterator;
   typedef typename NodeMapT::const_iterator const_file_iterator;
 
@@ -199,12 +437,16 @@ public:
                 , const NodePtrT &parent
                 , const NodeDataT &data
                 , const VoidAllocatorT &allocator)
-    : m_Parent(parent)
+    : m_Flags(flags)
+    , m_OwnsNodes(false)
+    , m_Parent(parent.get())
     , m_Name(name.c_str(), allocator)
+    , m_Key(allocator)
     , m_Data(data)
-    , m_Nodes(allocator)
-    , m_Flags(flags)
+    , m_Nodes(emptyNodes(allocator.get_segment_manager()))
   {
+    updateKey();
+    account(1);
   }
 
   /**
@@ -214,7 +456,11 @@ public:
   DirectoryTree(NodeT &&reference) = delete;
 
   ~DirectoryTree() {
-    m_Nodes.clear();
+    account(-1);
+    if (m_OwnsNodes) {
+      clear();
+      m_Name.get_allocator().get_segment_manager()->destroy_ptr(m_Nodes.get());
+    }
   }
 
   /**
@@ -225,21 +471,57 @@ public:
   /**
    * @return parent node
    */
-  NodePtrT parent() const { return m_Parent.lock(); }
+  NodePtrT parent() const {
+    return m_Parent.get() != nullptr ? m_Parent->m_Self.lock() : NodePtrT();
+  }
 
   /**
    * @return the full path to the node
    */
   fs::path path() const {
-    if (m_Parent.lock().get() == nullptr) {
-      if (m_Name.size() == 0) {
-        return fs::path();
-      } else {
-        return fs::path(m_Name.c_str()) / "\\";
+    return fs::path(pathString());
+  }
+
+  /**
+   * @return the full path to the node, utf-8 encoded like the node names
+   */
+  std::string pathString() const {
+    std::string result(pathLength(), '\0');
+    if (!result.empty()) {
+      path(&result[0], result.size() + 1);
+    }
+    return result;
+  }
+
+  /**
+   * @brief write the full path to the node into a caller provided buffer. The parents
+   *        are visited twice, once to determine the length and once to copy the names
+   *        back to front, nothing is allocated
+   * @param buffer receives the zero-terminated path. Left untouched if it's too small
+   * @param size size of the buffer in characters
+   * @return length of the path without the terminating zero. If this isn't smaller
+   *         than size the buffer was too small
+   */
+  size_t path(char *buffer, size_t size) const {
+    size_t length = pathLength();
+    if (length >= size) {
+      return length;
+    }
+    char *pos = buffer + length;
+    *pos = '\0';
+    for (const DirectoryTree *node = this; node != nullptr; node = node->m_Parent.get()) {
+      size_t nameLength = node->m_Name.size();
+      if (nameLength == 0) {
+        continue;
       }
-    } else {
-      return m_Parent.lock()->path() / m_Name.c_str();
+      if ((pos != buffer + length) || (nameLength + 1 == length)) {
+        // in front of the name written before or behind a drive on its own
+        *--pos = '\\';
+      }
+      pos -= nameLength;
+      std::copy(node->m_Name.c_str(), node->m_Name.c_str() + nameLength, pos);
     }
+    return length;
   }
 
   /**
@@ -254,15 +536,38 @@ public:
    */
   std::string name() const { return m_Name.c_str(); }
 
+  /**
+   * @return name of this node without copying it
+   */
+  const StringT &nameRef() const { return m_Name; }
+
+  /**
+   * @return upper-cased (ascii only) name of this node, used for case-insensitive
+   *         comparisons by byte
+   */
+  const StringT &key() const { return m_Key; }
+
+  /**
+   * @return hash of the key of this node
+   */
+  uint32_t keyHash() const { return m_KeyHash; }
+
   /**
    * @brief setFlag change a flag for this node
    * @param enabled new state for the specified flag
    */
   void setFlag(TreeFlags flag, bool enabled = true)
   {
+    account(-1);
     m_Flags = enabled ? m_Flags | flag : m_Flags & ~flag;
+    account(1);
   }
 
+  /**
+   * @return all flags of this node
+   */
+  TreeFlags flags() const { return m_Flags; }
+
   /**
    * @return true if the specified flag is set, false otherwise
    */
@@ -276,14 +581,14 @@ public:
   /**
    * @return the number of subnodes (directly) below this one
    */
-  size_t numNodes() const { return m_Nodes.size(); }
+  size_t numNodes() const { return m_Nodes->size(); }
 
   /**
    * @return number of nodes in this (sub-)tree including this one
    */
   size_t numNodesRecursive() const {
     size_t result { numNodes() + 1 };
-    for (const auto &node : m_Nodes) {
+    for (const auto &node : *m_Nodes) {
       result += node.second->numNodesRecursive();
     }
     return result;
@@ -309,6 +614,94 @@ public:
     return findNode(path, iter);
   }
 
+  /**
+   * @brief find a node by its path without constructing a fs::path. The path is split
+   *        at backslashes and slashes in place, "." components are skipped
+   * @param path the path to look up, doesn't need to be zero-terminated
+   * @param length length of the path in characters
+   * @return a pointer to the node or a null ptr
+   */
+  NodePtrT findNode(const wchar_t *path, size_t length) const {
+    const NodePtrT *result = findNodeRef(path, length);
+    return result != nullptr ? *result : NodePtrT();
+  }
+
+  /**
+   * @brief like findNode but returns a borrowed pointer to the node, avoiding the
+   *        update of the reference count in shared memory
+   * @note the pointer is only valid as long as the tree isn't modified, so only while
+   *       the hook context is locked
+   * @return pointer to the node or nullptr
+   */
+  const DirectoryTree *findNodeRaw(const wchar_t *path, size_t length) const {
+    const NodePtrT *result = findNodeRef(path, length);
+    return result != nullptr ? result->get().get() : nullptr;
+  }
+
+  /**
+   * @brief like findNodeRaw but returns a borrowed reference to the pointer stored in
+   *        the parent. Copying it is the only step that touches the reference count
+   * @return pointer to the node pointer or nullptr
+   */
+  const NodePtrT *findNodeRef(const wchar_t *path, size_t length) const {
+    return walkPath(path, length, [](const DirectoryTree&, const wchar_t*) {});
+  }
+
+  /**
+   * @brief everything a single walk along a path found, see resolvePath. Nodes are
+   *        borrowed like in findNodeRaw
+   */
+  struct PathResolution {
+    // the node for the complete path or nullptr if it isn't in the tree
+    const NodePtrT *node{nullptr};
+    // the deepest node along the path that is in the tree
+    const DirectoryTree *deepest{nullptr};
+    // the deepest node along the path, including the node itself, with the flag set
+    const DirectoryTree *flagged{nullptr};
+    // the part of the path below flagged without leading separators. Points into
+    // the path passed to resolvePath
+    const wchar_t *remainder{nullptr};
+    size_t remainderLength{0};
+  };
+
+  /**
+   * @brief look up a path and the deepest node along it with a flag in the same walk.
+   *        Split like findNode(const wchar_t*, size_t)
+   * @param flag the flag to look for, usually the one marking create targets
+   */
+  PathResolution resolvePath(const wchar_t *path, size_t length, TreeFlags flag) const {
+    PathResolution result;
+    result.node = walkPath(path, length,
+        [&](const DirectoryTree &node, const wchar_t *componentEnd) {
+          result.deepest = &node;
+          if (node.hasFlag(flag)) {
+            result.flagged   = &node;
+            result.remainder = componentEnd;
+          }
+        });
+    if (result.flagged != nullptr) {
+      const wchar_t *end = path + length;
+      while ((result.remainder < end)
+             && ((*result.remainder == L'\\') || (*result.remainder == L'/'))) {
+        ++result.remainder;
+      }
+      result.remainderLength = end - result.remainder;
+    }
+    return result;
+  }
+
+  /**
+   * @brief visit the nodes along the specified path (in order) calling the visitor for
+   *        each. Split like findNode(const wchar_t*, size_t), nodes are passed as
+   *        borrowed references which are valid only while the tree isn't modified
+   * @param visitor functor called as visitor(const DirectoryTree &node)
+   */
+  template <typename Visitor>
+  void visitPath(const wchar_t *path, size_t length, Visitor &&visitor) const {
+    walkPath(path, length,
+             [&](const DirectoryTree &node, const wchar_t*) { visitor(node); });
+  }
+
   /**
    * @brief visit the nodes along the specified path (in order) calling the visitor for each
    * @param path the path to visit
@@ -322,11 +715,13 @@ public:
   /**
    * @brief retrieve a node by the specified name
    * @param name name of the node
-   * @return the node found or an empty pointer if no such node was found
+   * @return the node found
+   * @throws node_missing_error if there is no such node. Throwing is expensive,
+   *         code where a missing node is a regular outcome should use node(name)
    */
   NodePtrT node(const char *name, MissingThrowT) const {
-    auto iter = m_Nodes.find(name);
-    if (iter != m_Nodes.end()) {
+    auto iter = lookup().find(NodeName(name));
+    if (iter != lookup().end()) {
       return iter->second;
     } else {
       USVFS_THROW_EXCEPTION(node_missing_error());
@@ -339,8 +734,8 @@ public:
    * @return the node found or an empty pointer if no such node was found
    */
   NodePtrT node(const char *name) {
-    auto iter = m_Nodes.find(name);
-    if (iter != m_Nodes.end()) {
+    auto iter = lookup().find(NodeName(name));
+    if (iter != lookup().end()) {
       return iter->second;
     } else {
       return NodePtrT();
@@ -350,11 +745,12 @@ public:
   /**
    * @brief retrieve a node by the specified name
    * @param name name of the node
-   * @return the node found or an empty pointer if no such node was found
+   * @return the node found
+   * @throws node_missing_error if there is no such node
    */
   const NodePtrT node(const char *name, MissingThrowT) {
-    auto iter = m_Nodes.find(name);
-    if (iter != m_Nodes.end()) {
+    auto iter = lookup().find(NodeName(name));
+    if (iter != lookup().end()) {
       return iter->second;
     } else {
       USVFS_THROW_EXCEPTION(node_missing_error());
@@ -367,8 +763,8 @@ public:
    * @return the node found or an empty pointer if no such node was found
    */
   const NodePtrT node(const char *name) const {
-    auto iter = m_Nodes.find(name);
-    if (iter != m_Nodes.end()) {
+    auto iter = lookup().find(NodeName(name));
+    if (iter != lookup().end()) {
       return iter->second;
     } else {
       return NodePtrT();
@@ -381,7 +777,7 @@ public:
    * @return true if the node exists, false otherwise
    */
   bool exists(const char *name) const {
-    return m_Nodes.find(name) != m_Nodes.end();
+    return lookup().find(NodeName(name)) != lookup().end();
   }
 
   /**
@@ -412,45 +808,128 @@ public:
     return result;
   }
 
+  /**
+   * @brief find the direct children matching a compiled search pattern
+   * @param matcher the pattern the names of the children are matched against
+   * @return a vector of the found nodes
+   */
+  std::vector<NodePtrT> find(const wildcard::Matcher &matcher) const {
+    typedef wildcard::Matcher::Kind Kind;
+    std::vector<NodePtrT> result;
+
+    auto add = [&] (const NodePtrT &node) {
+      const StringT &name = node->nameRef();
+      // names with leading dots may match without them, those are handled below
+      if (((name.size() == 0) || (name[0] != '.'))
+          && matcher.match(name.c_str(), name.size())) {
+        result.push_back(node);
+      }
+    };
+
+    const std::string &literal = matcher.literal();
+    const auto &ordered = m_Nodes->template get<ByOrder>();
+    switch (matcher.kind()) {
+      case Kind::Everything: {
+        for (auto iter = m_Nodes->begin(); iter != m_Nodes->end(); ++iter) {
+          result.push_back(iter->second);
+        }
+        return result;
+      } break;
+      case Kind::Literal: {
+        auto iter = lookup().find(NodeName(literal));
+        if (iter != lookup().end()) {
+          add(iter->second);
+        }
+      } break;
+      case Kind::Prefix: {
+        for (auto iter = ordered.lower_bound(literal, PrefixLess());
+             (iter != ordered.end()) && hasPrefix(iter->second->m_Key, literal); ++iter) {
+          add(iter->second);
+        }
+      } break;
+      case Kind::Suffix: {
+        if (literal.find('.') == std::string::npos) {
+          for (auto iter = m_Nodes->begin(); iter != m_Nodes->end(); ++iter) {
+            add(iter->second);
+          }
+          break;
+        }
+        // all names ending in a literal with a dot share its extension
+        auto range = m_Nodes->template get<ByExtension>().equal_range(
+            extensionHash(literal.c_str(), literal.size()));
+        for (auto iter = range.first; iter != range.second; ++iter) {
+          add(iter->second);
+        }
+      } break;
+      default: {
+        for (auto iter = m_Nodes->begin(); iter != m_Nodes->end(); ++iter) {
+          add(iter->second);
+        }
+      } break;
+    }
+
+    // names with leading dots sort next to each other
+    static const std::string dot(".");
+    for (auto iter = ordered.lower_bound(dot, PrefixLess());
+         (iter != ordered.end()) && hasPrefix(iter->second->m_Key, dot); ++iter) {
+      const StringT &name = iter->second->nameRef();
+      if (matcher.match(name.c_str(), name.size())) {
+        result.push_back(iter->second);
+      }
+    }
+    return result;
+  }
+
   /**
    * @return an iterator to the first leaf
    **/
-  file_iterator filesBegin() { return m_Nodes.begin(); }
+  file_iterator filesBegin() { return m_Nodes->begin(); }
 
   /**
    * @return a const iterator to the first leaf
    **/
-  const_file_iterator filesBegin() const { return m_Nodes.begin(); }
+  const_file_iterator filesBegin() const { return m_Nodes->begin(); }
 
   /**
    * @return an iterator one past the last leaf
    **/
-  file_iterator filesEnd() { return m_Nodes.end(); }
+  file_iterator filesEnd() { return m_Nodes->end(); }
 
   /**
    * @return a const iterator one past the last leaf
    **/
-  const_file_iterator filesEnd() const { return m_Nodes.end(); }
+  const_file_iterator filesEnd() const { return m_Nodes->end(); }
 
   /**
    * @brief erase the leaf at the specfied iterator
    * @return an iterator to the following file
    **/
-  file_iterator erase(file_iterator iter) { return m_Nodes.erase(iter); }
+  file_iterator erase(file_iterator iter) {
+    iter->second->m_Parent = nullptr;
+    return m_Nodes->erase(iter);
+  }
 
   /**
    * @brief clear all nodes
    */
   void clear() {
-    m_Nodes.clear();
+    if (!m_OwnsNodes) {
+      return;
+    }
+    // nodes referenced from elsewhere may outlive this one
+    for (const auto &node : *m_Nodes) {
+      node.second->m_Parent = nullptr;
+    }
+    m_Nodes->clear();
   }
 
   void removeFromTree() {
     if (auto par = parent()) {
       spdlog::get("usvfs")->info("remove from tree {}", m_Name.c_str());
-      auto self = par->m_Nodes.find(m_Name.c_str());
-      if (self != par->m_Nodes.end()) {
-        par->erase(self);
+      auto self = par->lookup().find(NodeName(m_Name));
+      if (self != par->lookup().end()) {
+        m_Parent = nullptr;
+        par->lookup().erase(self);
       }
       else {
         //trying to remove a node that des not exist, most likely because it was already removed in a lower level call. 
@@ -462,35 +941,165 @@ public:
 
 PRIVATE:
 
-  void set(const StringT &key, const NodePtrT &value) {
-    auto res = m_Nodes.emplace(key, value);
+  void set(const NodePtrT &value) {
+    auto res = ownNodes().emplace(value->m_KeyHash, value);
     if (!res.second) {
+      res.first->second->m_Parent = nullptr;
       res.first->second = value;
     }
   }
 
+  /**
+   * @return the child map of this node, nodes without children share an empty one so
+   *         files don't carry the indices. Insert only through ownNodes
+   */
+  static OffsetPtrT<NodeMapT> emptyNodes(SegmentManagerT *manager) {
+    return manager->find_or_construct<NodeMapT>(bi::unique_instance)(
+        VoidAllocatorT(manager));
+  }
+
+  /**
+   * @return the child map of this node for modification, created on first use
+   */
+  NodeMapT &ownNodes() {
+    if (!m_OwnsNodes) {
+      SegmentManagerT *manager = m_Name.get_allocator().get_segment_manager();
+      m_Nodes = manager->construct<NodeMapT>(bi::anonymous_instance)(VoidAllocatorT(manager));
+      m_OwnsNodes = true;
+    }
+    return *m_Nodes;
+  }
+
+  // swap in a new name and its folded key. Both are allocated by the caller so this
+  // can't run out of space
+  void rename(StringT &name, StringT &key) {
+    account(-1);
+    m_Name.swap(name);
+    m_Key.swap(key);
+    m_KeyHash = foldedHash(m_Name.c_str(), m_Name.size());
+    m_ExtensionHash = extensionHash(m_Key.c_str(), m_Key.size());
+    account(1);
+  }
+
+  void updateKey() {
+    m_Key.resize(m_Name.size());
+    if (!m_Name.empty()) {
+      foldCase(m_Name.c_str(), m_Name.size(), &m_Key[0]);
+    }
+    m_KeyHash = foldedHash(m_Name.c_str(), m_Name.size());
+    m_ExtensionHash = extensionHash(m_Key.c_str(), m_Key.size());
+  }
+
+  // hash of the part of a folded name after the last dot, or of nothing without dots
+  static uint32_t extensionHash(const char *key, size_t size) {
+    const char *end = key + size;
+    const char *iter = end;
+    while ((iter != key) && (*(iter - 1) != '.')) {
+      --iter;
+    }
+    if (iter == key) {
+      return foldedHash(end, 0);
+    }
+    return foldedHash(iter, end - iter);
+  }
+
+  static bool hasPrefix(const StringT &key, const std::string &prefix) {
+    return (key.size() >= prefix.size())
+           && (memcmp(key.c_str(), prefix.c_str(), prefix.size()) == 0);
+  }
+
+  // add (sign 1) or remove (sign -1) this node from the counters of its segment
+  void account(int64_t sign) {
+    TreeCounters *counters = TreeCounters::get(m_Name.get_allocator().get_segment_manager());
+    if (isDirectory()) {
+      counters->directories.fetch_add(sign, std::memory_order_relaxed);
+    } else {
+      counters->files.fetch_add(sign, std::memory_order_relaxed);
+    }
+    counters->nameBytes.fetch_add(sign * static_cast<int64_t>(m_Name.size() + m_Key.size()),
+                                  std::memory_order_relaxed);
+    counters->dataBytes.fetch_add(sign * static_cast<int64_t>(dataSize(m_Data)),
+                                  std::memory_order_relaxed);
+  }
+
+  bool keyMatches(const NodeName &name) const {
+    return (name.size == m_Key.size()) && foldedEquals(name.data, m_Key.c_str(), name.size);
+  }
+
+  /**
+   * @return the hashed index into the child nodes, used for lookup by name
+   */
+  NodeLookupT &lookup() { return m_Nodes->template get<ByName>(); }
+  const NodeLookupT &lookup() const { return m_Nodes->template get<ByName>(); }
+
+  // visitor is called as visitor(node, end of the component the node was found by)
+  template <typename Visitor>
+  const NodePtrT *walkPath(const wchar_t *path, size_t length, Visitor &&visitor) const {
+    char buffer[MAX_COMPONENT_UTF8];
+    const DirectoryTree *current = this;
+    const NodePtrT *result = nullptr;
+
+    const wchar_t *end = path + length;
+    while (path < end) {
+      const wchar_t *separator = path;
+      while ((separator < end) && (*separator != L'\\') && (*separator != L'/')) {
+        ++separator;
+      }
+      size_t componentLength = separator - path;
+      if ((componentLength > 0) && !((componentLength == 1) && (*path == L'.'))) {
+        size_t size = componentToUTF8(path, componentLength, buffer, MAX_COMPONENT_UTF8);
+        if (size == 0) {
+          return nullptr;
+        }
+        auto subNode = current->lookup().find(NodeName(buffer, size));
+        if (subNode == current->lookup().end()) {
+          return nullptr;
+        }
+        result = &subNode->second;
+        current = result->get().get();
+        visitor(*current, separator);
+      }
+      path = separator + 1;
+    }
+    return result;
+  }
+
+  // length of the full path, the components are separated by backslashes and a drive
+  // on its own ends in one, like the paths of the frozen tree
+  size_t pathLength() const
+  {
+    size_t length = 0;
+    size_t components = 0;
+    for (const DirectoryTree *node = this; node != nullptr; node = node->m_Parent.get()) {
+      if (node->m_Name.size() != 0) {
+        length += node->m_Name.size();
+        ++components;
+      }
+    }
+    return (components == 0) ? 0 : length + std::max<size_t>(components - 1, 1);
+  }
+
   WeakPtrT findRoot() const
   {
-    if (m_Parent.lock().get() == nullptr) {
+    if (m_Parent.get() == nullptr) {
       return m_Self;
     } else {
-      return m_Parent.lock()->findRoot();
+      return m_Parent->findRoot();
     }
   }
 
   NodePtrT findNode(const fs::path &name, fs::path::iterator &iter) {
-    std::string l = iter->string();
-    auto subNode = m_Nodes.find(iter->string());
+    auto subNode = lookup().find(NodeName(iter->string()));
     advanceIter(iter, name.end());
     if (iter == name.end()) {
       // last name component, should be a local node
-      if (subNode != m_Nodes.end()) {
+      if (subNode != lookup().end()) {
         return subNode->second;
       } else {
         return NodePtrT();
       }
     } else {
-      if (subNode != m_Nodes.end()) {
+      if (subNode != lookup().end()) {
         return subNode->second->findNode(name, iter);
       } else {
         return NodePtrT();
@@ -500,17 +1109,17 @@ PRIVATE:
 
   const NodePtrT findNode(const fs::path &name,
                           fs::path::iterator &iter) const {
-    auto subNode = m_Nodes.find(iter->string());
+    auto subNode = lookup().find(NodeName(iter->string()));
     advanceIter(iter, name.end());
     if (iter == name.end()) {
       // last name component, should be a local node
-      if (subNode != m_Nodes.end()) {
+      if (subNode != lookup().end()) {
         return subNode->second;
       } else {
         return NodePtrT();
       }
     } else {
-      if (subNode != m_Nodes.end()) {
+      if (subNode != lookup().end()) {
         return subNode->second->findNode(name, iter);
       } else {
         return NodePtrT();
@@ -521,8 +1130,8 @@ PRIVATE:
   void visitPath(const fs::path &path
                  , fs::path::iterator &iter
                  , const VisitorFunction &visitor) const {
-    auto subNode = m_Nodes.find(iter->string());
-    if (subNode != m_Nodes.end()) {
+    auto subNode = lookup().find(NodeName(iter->string()));
+    if (subNode != lookup().end()) {
       visitor(subNode->second);
       advanceIter(iter, path.end());
       if (iter != path.end()) {
@@ -532,7 +1141,7 @@ PRIVATE:
   }
 
   void findLocal(std::vector<NodePtrT> &output, const std::string &pattern) const {
-    for (auto iter = m_Nodes.begin(); iter != m_Nodes.end(); ++iter) {
+    for (auto iter = m_Nodes->begin(); iter != m_Nodes->end(); ++iter) {
       LPCSTR remainder = nullptr;
       if (   pattern.size() > 1
              && (pattern[0] == '*')
@@ -557,15 +1166,55 @@ PRIVATE:
 PRIVATE:
 
   TreeFlags m_Flags;
+  bool m_OwnsNodes; // false while m_Nodes is the shared empty map
 
-  WeakPtrT m_Parent;
+  // parents own their children so a plain pointer is enough. It's reset when the node
+  // is taken out of its parent
+  OffsetPtrT<DirectoryTree> m_Parent;
   WeakPtrT m_Self;
 
   StringT m_Name;
+  StringT m_Key;
+  uint32_t m_KeyHash;
+  uint32_t m_ExtensionHash;
   NodeDataT m_Data;
 
-  NodeMapT m_Nodes;
+  OffsetPtrT<NodeMapT> m_Nodes;
+
+};
+
+
+/**
+ * @brief a node to be added to a tree through TreeContainer::addNodes
+ */
+template <typename T>
+struct TreeInsertion {
+  TreeInsertion(const fs::path &name, const T &data, TreeFlags flags = 0)
+    : name(name), data(data), flags(flags)
+  {}
+
+  fs::path name;
+  T data;
+  TreeFlags flags;
+};
+
+
+/**
+ * @brief number of nodes TreeContainer::applyDiff changed
+ */
+struct TreeDiffResult {
+  size_t added { 0 };
+  size_t removed { 0 }; // removed subtrees are counted once
+  size_t changed { 0 };
+};
+
 
+/**
+ * @brief result of the TreeContainer::tryAdd functions
+ */
+enum class TreeStatus : uint8_t {
+  OK,
+  OUT_OF_SPACE // the segment has to grow before the operation can succeed
 };
 
 
@@ -577,16 +1226,12 @@ PRIVATE:
 template <typename TreeT>
 class TreeContainer {
 
-public:
-
-//  static const char LockName[];
-
 public:
 
   /**
    * @brief Constructor
    * @param SHMName name of the shared memory holding the tree. This should contain the running number
-   * @param size initial size in bytes of the container. since the tree is resized by doubling this should be
+   * @param size initial size in bytes of the container. since small trees are resized by doubling this should be
    *        a power of two. 64k is supposed to be the page size on windows so smaller allocations make little sense
    * @note size can't be too small. If initial allocations fail automatic growing won't work
    */
@@ -594,22 +1239,18 @@ public:
     : m_TreeMeta(nullptr)
     , m_SHMName(SHMName)
   {
-    std::locale global_loc = std::locale();
-    std::locale loc(global_loc, new fs::detail::utf8_codecvt_facet);
-    fs::path::imbue(loc);
-
-    namespace sp = std::placeholders;
-    std::regex pattern(R"exp((.*_)(\d+))exp");
-    std::smatch match;
-    std::string shmName(m_SHMName.c_str());
-    regex_match(shmName, match, pattern);
-    if (match.size() != 3) {
+    imbueUtf8();
+
+    std::string prefix;
+    int count;
+    if (!splitSHMName(m_SHMName, prefix, count)) {
       m_SHMName += "_1";
     }
 
     m_TreeMeta = createOrOpen(m_SHMName.c_str(), size);
+    TreeUsage current = usage();
     spdlog::get("usvfs")->info("attached to {0} with {1} nodes, size {2}",
-                               m_SHMName, m_TreeMeta->tree->numNodesRecursive(),
+                               m_SHMName, current.directories + current.files,
                                m_SHM->get_size());
   }
 
@@ -670,8 +1311,180 @@ public:
     return m_SHMName;
   }
 
+  /**
+   * @brief remove all nodes. Instead of destroying every node in place while other
+   *        processes wait, an empty tree is set up in a new segment of the current
+   *        size. Other users switch to it on their next access and the old segment
+   *        is released as a whole by the last process detaching from it
+   */
   void clear() {
-    m_TreeMeta->tree->clear();
+    moveTo(m_SHM->get_size(), nullptr);
+  }
+
+  /**
+   * @brief remove a node and everything below it from the tree
+   * @param path path of the node to remove. The node is looked up under the write
+   *        lock so a pointer from a segment the tree has since moved away from is
+   *        never dereferenced
+   * @return true if a node was removed
+   */
+  bool removeNode(const fs::path &path) {
+    WriteGuard guard(*this);
+    typename TreeT::NodePtrT current = m_TreeMeta->tree->findNode(path);
+    bool found = current.get() != nullptr;
+    if (found) {
+      current->removeFromTree();
+    }
+    bumpGeneration();
+    return found;
+  }
+
+  /**
+   * @brief move a node and everything below it to a different path without copying
+   *        the subtree. Missing parents of the destination are created as dummy
+   *        directories, a different node at the destination is replaced
+   * @param source path of the node to move
+   * @param destination new path of the node, must not be below source
+   * @param update called as update(data) for the data of the moved node and of every
+   *        node below it, so data that depends on the location (like link targets) can
+   *        be rewritten. Must leave data it already rewrote unchanged since it's called
+   *        again if the tree has to grow in between
+   * @return the moved node or a null ptr if there is no node at source
+   */
+  template <typename Updater>
+  typename TreeT::NodePtrT moveNode(const fs::path &source, const fs::path &destination,
+                                    Updater &&update) {
+    try {
+      WriteGuard guard(*this);
+      typename TreeT::NodePtrT node = m_TreeMeta->tree->findNode(source);
+      typename TreeT::NodePtrT sourceParent;
+      if (node.get() != nullptr) {
+        sourceParent = node->parent();
+      }
+      if ((sourceParent.get() == nullptr) || (destination.begin() == destination.end())
+          || isBelow(destination, source)) {
+        return typename TreeT::NodePtrT();
+      }
+
+      // everything that allocates happens before the node is detached so running out
+      // of space doesn't lose the subtree
+      TreeT *parent = m_TreeMeta->tree.get();
+      fs::path::iterator iter = destination.begin();
+      for (fs::path::iterator next = nextIter(iter, destination.end());
+           next != destination.end(); iter = next, next = nextIter(iter, destination.end())) {
+        parent = subDirectory(parent, iter->string(), allocator());
+      }
+      updateSubtree(node.get().get(), update);
+      std::string nameU8 = iter->string();
+      StringT name(nameU8.c_str(), allocator());
+      StringT key(name.size(), '\0', allocator());
+      if (!name.empty()) {
+        foldCase(name.c_str(), name.size(), &key[0]);
+      }
+      parent->ownNodes();
+      // inserting into the destination allocates an index entry and may rehash, make
+      // sure that fits before anything is detached
+      if (!hasSpaceFor(nodeSpace(nameU8.size()))) {
+        throw bi::bad_alloc();
+      }
+
+      sourceParent->lookup().erase(sourceParent->lookup().find(NodeName(node->m_Name)));
+      typename TreeT::NodePtrT replaced;
+      auto existing = parent->lookup().find(NodeName(nameU8));
+      if (existing != parent->lookup().end()) {
+        replaced = existing->second;
+        parent->lookup().erase(existing);
+      }
+      node->rename(name, key);
+      node->m_Parent = parent;
+      try {
+        parent->set(node);
+      } catch (const bi::bad_alloc &) {
+        // put everything back where it was, the entries just released make room for
+        // that. name and key hold the old ones after the swap in rename
+        node->rename(name, key);
+        node->m_Parent = sourceParent.get();
+        sourceParent->set(node);
+        if (replaced.get() != nullptr) {
+          parent->set(replaced);
+        }
+        throw;
+      }
+      if (replaced.get() != nullptr) {
+        replaced->m_Parent = nullptr;
+      }
+
+      addToFilter(destination);
+      int depth = 0;
+      for (auto component = destination.begin(); component != destination.end();
+           advanceIter(component, destination.end())) {
+        ++depth;
+      }
+      addSubtreeToFilter(node.get().get(), destination, depth);
+      bumpGeneration();
+      return node;
+    } catch (const bi::bad_alloc &) {
+      reassign();
+      return moveNode(source, destination, update);
+    }
+  }
+
+  /**
+   * @return counter that changes whenever the tree is modified. This can be used to
+   *         invalidate process-local caches of lookup results
+   */
+  long generation() const {
+    return m_TreeMeta->generation.load(std::memory_order_acquire);
+  }
+
+  /**
+   * @brief signal a modification of the tree that didn't go through the container,
+   *        i.e. removing a node directly
+   */
+  void bumpGeneration() const {
+    ++m_TreeMeta->generation;
+  }
+
+  /**
+   * @brief test a path against the prefix filter of the tree. The filter contains the
+   *        first FILTER_DEPTH components of every path added to the tree
+   * @param path the path to test, split the same way findNode does
+   * @param length length of the path in characters
+   * @return false if the path definitively isn't in the tree, true if it may be
+   */
+  bool mayContain(const wchar_t *path, size_t length) const {
+    char buffer[MAX_COMPONENT_UTF8];
+    uint32_t hash = PrefixFilter::SEED;
+    int depth = 0;
+
+    const wchar_t *end = path + length;
+    while ((path < end) && (depth < PrefixFilter::DEPTH)) {
+      const wchar_t *separator = path;
+      while ((separator < end) && (*separator != L'\\') && (*separator != L'/')) {
+        ++separator;
+      }
+      size_t componentLength = separator - path;
+      if ((componentLength > 0) && !((componentLength == 1) && (*path == L'.'))) {
+        size_t size = componentToUTF8(path, componentLength, buffer, MAX_COMPONENT_UTF8);
+        if (size == 0) {
+          // can't tell, let the regular lookup deal with it
+          return true;
+        }
+        hash = PrefixFilter::combine(hash, buffer, size);
+        ++depth;
+      }
+      path = separator + 1;
+    }
+    return (depth == 0) || m_TreeMeta->filter.test(hash);
+  }
+
+  /**
+   * @brief test whether any path in the tree starts at one of the specified roots
+   * @param rootBits roots as calculated by PrefixFilter::rootBit
+   * @return false if no path below the roots can be in the tree
+   */
+  bool mayContainRoot(uint32_t rootBits) const {
+    return (m_TreeMeta->filter.rootMask() & rootBits) != 0;
   }
 
   /**
@@ -688,14 +1501,26 @@ public:
                                    , const T &data
                                    , TreeFlags flags = 0
                                    , bool overwrite = true) {
-    namespace sp = std::placeholders;
-    try {
-      return addNode(m_TreeMeta->tree.get(), name, name.begin(),
-                     data, overwrite, flags, allocator());
-    } catch (const bi::bad_alloc&) {
+    typename TreeT::NodePtrT result;
+    while (tryAddFile(name, data, flags, overwrite, &result) == TreeStatus::OUT_OF_SPACE) {
       reassign();
-      return addFile(name, data, flags, overwrite);
     }
+    return result;
+  }
+
+  /**
+   * @brief like addFile but instead of growing the tree this reports when there isn't
+   *        enough space left. The free space is checked before anything is allocated
+   *        so running out of space doesn't involve an exception unless the segment is
+   *        too fragmented for the estimate
+   *
+   * @param node if not null, receives the new node or a null ptr
+   * @return OUT_OF_SPACE if the tree has to grow first, the call can then be repeated
+   **/
+  template <typename T>
+  TreeStatus tryAddFile(const fs::path &name, const T &data, TreeFlags flags = 0,
+                        bool overwrite = true, typename TreeT::NodePtrT *node = nullptr) {
+    return tryAddNode(name, data, flags, overwrite, node);
   }
 
   /**
@@ -712,14 +1537,180 @@ public:
                                         const T &data, TreeFlags flags = 0,
                                         bool overwrite = true)
   {
-    using namespace std::placeholders;
+    typename TreeT::NodePtrT result;
+    while (tryAddDirectory(name, data, flags, overwrite, &result)
+           == TreeStatus::OUT_OF_SPACE) {
+      reassign();
+    }
+    return result;
+  }
+
+  /**
+   * @brief like addDirectory but reports when the tree has to grow, see tryAddFile
+   **/
+  template <typename T>
+  TreeStatus tryAddDirectory(const fs::path &name, const T &data, TreeFlags flags = 0,
+                             bool overwrite = true,
+                             typename TreeT::NodePtrT *node = nullptr) {
+    return tryAddNode(name, data, flags | FLAG_DIRECTORY, overwrite, node);
+  }
+
+  /**
+   * @brief add many nodes at once. Unlike repeated calls to addFile/addDirectory this
+   *        takes the write lock and bumps the generation only once for the whole batch
+   *
+   * @param nodes the nodes to add. Directories need FLAG_DIRECTORY in their flags.
+   *              Missing parents are created as dummies, a parent added later in the
+   *              same batch replaces the dummy without losing its children
+   * @param overwrite if true, existing nodes that compare as "equal" are overwritten
+   **/
+  template <typename T>
+  void addNodes(const std::vector<TreeInsertion<T>> &nodes, bool overwrite = true) {
+    while (tryAddNodes(nodes, overwrite) == TreeStatus::OUT_OF_SPACE) {
+      reassign();
+    }
+  }
+
+  /**
+   * @brief like addNodes but reports when the tree has to grow, see tryAddFile. The
+   *        space for the whole batch is checked up front, assuming parents are either
+   *        in the tree already or part of the batch. If the estimate turns out too low
+   *        some of the nodes may have been added, repeating the call after growing the
+   *        tree just updates those
+   **/
+  template <typename T>
+  TreeStatus tryAddNodes(const std::vector<TreeInsertion<T>> &nodes, bool overwrite = true) {
+    size_t required = 0;
+    for (const TreeInsertion<T> &node : nodes) {
+      required += nodeSpace(node.name.filename().native().size());
+    }
+    WriteGuard guard(*this);
+    if (!hasSpaceFor(required)) {
+      return TreeStatus::OUT_OF_SPACE;
+    }
     try {
-      return addNode(m_TreeMeta->tree.get(), name, name.begin(), data,
-                     overwrite, flags | FLAG_DIRECTORY, allocator());
+      for (const TreeInsertion<T> &node : nodes) {
+        addNode(m_TreeMeta->tree.get(), node.name, node.name.begin(),
+                node.data, overwrite, node.flags, allocator());
+        addToFilter(node.name);
+      }
+      bumpGeneration();
+      return TreeStatus::OK;
     } catch (const bi::bad_alloc &) {
-      reassign();
-      return addDirectory(name, data, flags, overwrite);
+      bumpGeneration();
+      return TreeStatus::OUT_OF_SPACE;
+    }
+  }
+
+  /**
+   * @brief make the tree contain exactly the specified nodes. The new content is
+   *        compared against the tree in one walk over the sorted children of each
+   *        directory and only nodes that were added, removed or whose data or flags
+   *        changed are touched, all under one write lock and with one generation bump
+   *
+   * @param nodes the complete new content. Directories need FLAG_DIRECTORY in their
+   *              flags. Missing parents are created as dummies, existing directories
+   *              that are only parents of listed nodes are kept as they are. If a path
+   *              is listed more than once the last entry is used
+   * @param equal called as equal(existing, data) with the data of an existing node and
+   *              the data listed for it, returns true if the node can stay as it is
+   * @return number of nodes added, removed and changed
+   **/
+  template <typename T, typename Equal>
+  TreeDiffResult applyDiff(const std::vector<TreeInsertion<T>> &nodes, Equal &&equal) {
+    std::vector<DiffNode<T>> desired = buildDiffTree(nodes);
+    TreeDiffResult result;
+    applyDiffTree(desired, equal, result);
+    return result;
+  }
+
+  /**
+   * @brief replace the content of this tree with a copy of a different tree. The copy
+   *        is made into a new shared memory segment that is created large enough for
+   *        the source so this never has to grow in between. Other users of the tree
+   *        switch to the new segment on their next access
+   * @param source the tree to copy
+   */
+  void replaceWith(const TreeContainer &source) {
+    moveTo(source.usedSize() + source.usedSize() / 4, source.m_TreeMeta);
+    spdlog::get("usvfs")->info("tree {0} replaced, size now {1} bytes",
+                               m_SHMName, m_SHM->get_size());
+  }
+
+  /**
+   * @brief ensure the shared memory segment is at least the specified size. If it's
+   *        smaller, the tree is moved to a new segment of sufficient size right away
+   *        instead of doubling repeatedly as nodes get added
+   * @param size the required segment size in bytes
+   */
+  void reserve(size_t size) {
+    if (m_SHM->get_size() < size) {
+      moveTo(size, m_TreeMeta);
+      spdlog::get("usvfs")->info("tree {0} reserved, size now {1} bytes",
+                                 m_SHMName, m_SHM->get_size());
+    }
+  }
+
+  /**
+   * @brief move the tree to a larger segment ahead of time if less than an eighth of the
+   *        current one is free. Meant to be called away from the hooked threads so
+   *        writers rarely have to grow the tree themselves, they only switch over to
+   *        the new segment
+   * @return true if the tree was grown
+   */
+  bool growIfLow() {
+    // catch up if another process grew the tree in the meantime
+    get();
+    if (m_SHM->get_free_memory() >= m_SHM->get_size() / 8) {
+      return false;
     }
+    reassign();
+    return true;
+  }
+
+  /**
+   * @return size of the segment the tree moves to when a segment of the specified size
+   *        runs full. Small segments double, large ones only grow by GROWTH_STEP so
+   *        processes with a fragmented address space (32-bit games in particular)
+   *        don't have to find room for a view twice the size
+   */
+  static size_t grownSize(size_t size) {
+    return (size < GROWTH_STEP) ? size * 2 : size + GROWTH_STEP;
+  }
+
+  /**
+   * @return number of times the tree was moved to a larger segment since it was created
+   */
+  uint32_t growthCount() const {
+    return m_TreeMeta->growthCount;
+  }
+
+  /**
+   * @return number of bytes currently allocated in the shared memory segment
+   */
+  size_t usedSize() const {
+    return m_SHM->get_size() - m_SHM->get_free_memory();
+  }
+
+  /**
+   * @brief memory usage of the current segment, read from counters maintained
+   *        as the tree changes
+   */
+  TreeUsage usage() const {
+    const TreeCounters *counters = TreeCounters::get(m_SHM->get_segment_manager());
+    TreeUsage result;
+    result.directories = static_cast<uint64_t>(std::max<int64_t>(counters->directories.load(), 0));
+    result.files = static_cast<uint64_t>(std::max<int64_t>(counters->files.load(), 0));
+    result.nameBytes = static_cast<uint64_t>(std::max<int64_t>(counters->nameBytes.load(), 0));
+    result.dataBytes = static_cast<uint64_t>(std::max<int64_t>(counters->dataBytes.load(), 0));
+    result.segmentSize = m_SHM->get_size();
+    result.freeBytes = m_SHM->get_free_memory();
+    uint64_t accounted = (result.directories + result.files) * sizeof(TreeT)
+                         + result.nameBytes + result.dataBytes;
+    uint64_t used = result.segmentSize - result.freeBytes;
+    result.overheadBytes = used > accounted ? used - accounted : 0;
+    result.growthCount = m_TreeMeta->growthCount;
+    return result;
   }
 
   void getBuffer(void *&buffer, size_t &bufferSize) const {
@@ -729,6 +1720,8 @@ public:
 
 private:
 
+  static const size_t GROWTH_STEP = 32 * 1024 * 1024;
+
   struct TreeMeta {
     TreeMeta(const typename TreeT::DataT &data, SegmentManagerT *segmentManager)
       : tree(segmentManager->construct<TreeT>(bi::anonymous_instance)(
@@ -737,12 +1730,136 @@ private:
     OffsetPtrT<TreeT> tree;
     long referenceCount { 0 }; // reference count only set on top level node
     bool outdated { false };
+    std::atomic<long> generation { 0 }; // incremented on every modification
+    PrefixFilter filter;
+    uint32_t growthCount { 0 }; // number of times the tree was moved to a new segment
 
     bi::interprocess_mutex mutex;
+    InterprocessLock writeLock; // held by any process modifying the tree
+  };
+
+  /**
+   * holds the write lock of the current segment while it exists
+   */
+  class WriteGuard {
+  public:
+    WriteGuard(const TreeContainer &container)
+      : m_Container(container)
+      , m_Meta(container.lockWrite())
+    {}
+    ~WriteGuard() { m_Container.unlockWrite(m_Meta); }
+  private:
+    const TreeContainer &m_Container;
+    TreeMeta *m_Meta;
+  };
+
+  // orders folded names the same way the children of a node are ordered
+  struct FoldedLess {
+    bool operator()(const std::string &lhs, const std::string &rhs) const {
+      return foldedCompare(lhs.c_str(), lhs.size(), rhs.c_str(), rhs.size()) < 0;
+    }
+  };
+
+  /**
+   * process-local node of the content passed to applyDiff. The nodes are stored in a
+   * vector, children are referenced by index
+   */
+  template <typename T>
+  struct DiffNode {
+    std::string name;
+    const TreeInsertion<T> *insertion { nullptr }; // null for parents that aren't listed
+    std::map<std::string, size_t, FoldedLess> children; // by folded name
   };
 
 private:
 
+  template <typename T>
+  TreeStatus tryAddNode(const fs::path &name, const T &data, TreeFlags flags,
+                        bool overwrite, typename TreeT::NodePtrT *node) {
+    WriteGuard guard(*this);
+    if (!hasSpaceFor(spaceFor(name))) {
+      return TreeStatus::OUT_OF_SPACE;
+    }
+    try {
+      auto result = addNode(m_TreeMeta->tree.get(), name, name.begin(), data,
+                            overwrite, flags, allocator());
+      addToFilter(name);
+      bumpGeneration();
+      if (node != nullptr) {
+        *node = result;
+      }
+      return TreeStatus::OK;
+    } catch (const bi::bad_alloc &) {
+      // parents may have been added already
+      bumpGeneration();
+      return TreeStatus::OUT_OF_SPACE;
+    }
+  }
+
+  // estimated number of bytes a node takes: the node itself, its shared_ptr control
+  // block, the entries in the indices of its parent, name and key and the data, which
+  // for the trees used here is about as long as the name
+  static size_t nodeSpace(size_t nameLength) {
+    return 2 * sizeof(TreeT) + 256 + 3 * nameLength;
+  }
+
+  // estimated number of bytes adding a path takes if none of its parents exist yet
+  static size_t spaceFor(const fs::path &name) {
+    size_t result = 0;
+    for (auto iter = name.begin(); iter != name.end(); advanceIter(iter, name.end())) {
+      result += nodeSpace(iter->native().size());
+    }
+    return result;
+  }
+
+  bool hasSpaceFor(size_t bytes) const {
+    // keep some headroom for rehashing the indices of large directories
+    return m_SHM->get_free_memory() >= bytes + m_SHM->get_size() / 32;
+  }
+
+  void addToFilter(const fs::path &name) {
+    // every prefix up to the filter depth is added so that lookups of paths shorter
+    // than the filter depth can be tested as well
+    uint32_t hash = PrefixFilter::SEED;
+    int depth = 0;
+    for (auto iter = name.begin(); (iter != name.end()) && (depth < PrefixFilter::DEPTH);
+         advanceIter(iter, name.end())) {
+      std::string component = iter->string();
+      if (depth == 0) {
+        m_TreeMeta->filter.setRoot(PrefixFilter::rootBit(component.c_str(), component.size()));
+      }
+      hash = PrefixFilter::combine(hash, component.c_str(), component.size());
+      m_TreeMeta->filter.set(hash);
+      ++depth;
+    }
+  }
+
+  /**
+   * @brief move on to a new segment of at least the required size
+   * @param copyFrom tree to copy into the new segment, if null it starts out empty
+   */
+  void moveTo(size_t required, const TreeMeta *copyFrom) {
+    size_t size = m_SHM->get_size();
+    while (size < required) {
+      size = grownSize(size);
+    }
+
+    markOutdated();
+
+    for (;;) {
+      std::string nextName = followupName();
+      bool created = false;
+      m_TreeMeta = createOrOpen(nextName.c_str(), size, copyFrom, &created);
+      if (created) {
+        break;
+      } else if (!m_TreeMeta->outdated) {
+        // someone else already grew the tree, that segment doesn't contain the
+        // expected content so skip it as well
+        markOutdated();
+      }
+    }
+  }
+
   typename TreeT::DataT createEmpty() {
     return createDataEmpty<typename TreeT::DataT>(allocator());
   }
@@ -779,42 +1896,227 @@ private:
                                    , unsigned int flags
                                    , const VoidAllocatorT &allocator) {
     fs::path::iterator next = nextIter(iter, name.end());
-    StringT iterString(iter->string().c_str(), allocator);
+    std::string iterString = iter->string();
     if (next == name.end()) {
-      typename TreeT::NodePtrT newNode = base->node(iter->string().c_str());
+      typename TreeT::NodePtrT newNode = base->node(iterString.c_str());
 
       if (newNode.get() == nullptr) {
         // last name component, should be the filename
-        TreeT *node = createSubNode(allocator, iter->string(), flags, data);
+        TreeT *node = createSubNode(allocator, iterString, flags, data);
         newNode = createSubPtr(node);
         newNode->m_Self = TreeT::WeakPtrT(newNode);
-        newNode->m_Parent = base->m_Self;
-        base->set(iterString, newNode);
+        newNode->m_Parent = base;
+        base->set(newNode);
         return newNode;
       } else if (overwrite) {
+        newNode->account(-1);
         newNode->m_Data = createData<TreeT::DataT, T>(data, allocator);
         newNode->m_Flags = static_cast<usvfs::shared::TreeFlags>(flags);
+        newNode->account(1);
         return newNode;
       } else {
-        auto res = base->m_Nodes.insert(std::make_pair(iterString, newNode));
+        auto res = base->ownNodes().emplace(newNode->m_KeyHash, newNode);
         return res.second ? newNode : TreeT::NodePtrT();
       }
     } else {
       // not last component, continue search in child node
-      auto subNode = base->m_Nodes.find(iterString);
-      if (subNode == base->m_Nodes.end()) {
-        typename TreeT::NodePtrT newNode = createSubPtr(createSubNode(allocator
-                                                                      , iter->string()
-                                                                      , FLAG_DIRECTORY | FLAG_DUMMY
-                                                                      , createEmpty()));
-        subNode = base->m_Nodes.insert(std::make_pair(iterString, newNode)).first;
-        subNode->second->m_Self = TreeT::WeakPtrT(subNode->second);
-        subNode->second->m_Parent = base->m_Self;
+      return addNode(subDirectory(base, iterString, allocator), name, next, data,
+                     overwrite, flags, allocator);
+    }
+  }
+
+  // the child of base with the specified name, created as a dummy directory if missing
+  TreeT *subDirectory(TreeT *base, const std::string &name, const VoidAllocatorT &allocator) {
+    auto subNode = base->lookup().find(NodeName(name));
+    if (subNode != base->lookup().end()) {
+      return subNode->second.get().get();
+    }
+    typename TreeT::NodePtrT newNode = createSubPtr(createSubNode(allocator
+                                                                  , name
+                                                                  , FLAG_DIRECTORY | FLAG_DUMMY
+                                                                  , createEmpty()));
+    newNode->m_Self = TreeT::WeakPtrT(newNode);
+    newNode->m_Parent = base;
+    base->set(newNode);
+    return newNode.get().get();
+  }
+
+  template <typename Updater>
+  void updateSubtree(TreeT *node, Updater &update) {
+    node->account(-1);
+    update(node->m_Data);
+    node->account(1);
+    for (const auto &kv : *node->m_Nodes) {
+      updateSubtree(kv.second.get().get(), update);
+    }
+  }
+
+  // the filter only covers the first components, so only shallow subtrees add anything
+  void addSubtreeToFilter(const TreeT *node, const fs::path &path, int depth) {
+    if (depth >= PrefixFilter::DEPTH) {
+      return;
+    }
+    for (const auto &kv : *node->m_Nodes) {
+      fs::path subPath = path / kv.second->m_Name.c_str();
+      addToFilter(subPath);
+      addSubtreeToFilter(kv.second.get().get(), subPath, depth + 1);
+    }
+  }
+
+  // the nodes of the content passed to applyDiff as a tree, the root is at index 0
+  template <typename T>
+  static std::vector<DiffNode<T>> buildDiffTree(const std::vector<TreeInsertion<T>> &nodes) {
+    std::vector<DiffNode<T>> result(1);
+    for (const TreeInsertion<T> &node : nodes) {
+      size_t current = 0;
+      for (auto iter = node.name.begin(); iter != node.name.end();
+           advanceIter(iter, node.name.end())) {
+        std::string name = iter->string();
+        std::string key(name.size(), '\0');
+        if (!name.empty()) {
+          foldCase(name.c_str(), name.size(), &key[0]);
+        }
+        auto child = result[current].children.find(key);
+        if (child != result[current].children.end()) {
+          current = child->second;
+        } else {
+          // the vector may reallocate, so don't keep iterators into the children
+          size_t index = result.size();
+          result[current].children.emplace(key, index);
+          result.emplace_back();
+          result.back().name = name;
+          current = index;
+        }
       }
-      return addNode(subNode->second.get().get(), name, next, data, overwrite, flags, allocator);
+      if (current != 0) {
+        result[current].insertion = &node;
+      }
+    }
+    return result;
+  }
+
+  template <typename T, typename Equal>
+  void applyDiffTree(const std::vector<DiffNode<T>> &desired, Equal &equal,
+                     TreeDiffResult &result) {
+    try {
+      WriteGuard guard(*this);
+      applyDiff(m_TreeMeta->tree.get(), desired, 0, equal, result);
+      bumpGeneration();
+    } catch (const bi::bad_alloc &) {
+      // the changes made so far were copied to the new segment, the next walk finds
+      // them in place and doesn't count them again
+      reassign();
+      applyDiffTree(desired, equal, result);
     }
   }
 
+  // merge the sorted children of base with those of desired[index]
+  template <typename T, typename Equal>
+  void applyDiff(TreeT *base, const std::vector<DiffNode<T>> &desired, size_t index,
+                 Equal &equal, TreeDiffResult &result) {
+    const auto &children = desired[index].children;
+    auto wanted = children.begin();
+    if (children.empty() && (base->numNodes() == 0)) {
+      return;
+    }
+    // the iterators have to stay valid while children are added
+    typename TreeT::NodeMapT &nodes = base->ownNodes();
+    auto existing = nodes.begin();
+    while ((existing != nodes.end()) || (wanted != children.end())) {
+      int order;
+      if (existing == nodes.end()) {
+        order = 1;
+      } else if (wanted == children.end()) {
+        order = -1;
+      } else {
+        const StringT &key = existing->second->m_Key;
+        order = foldedCompare(key.c_str(), key.size(), wanted->first.c_str(), wanted->first.size());
+      }
+
+      if (order < 0) {
+        existing->second->m_Parent = nullptr;
+        existing = nodes.erase(existing);
+        ++result.removed;
+      } else if (order > 0) {
+        // inserting doesn't invalidate the iterator to the existing node
+        TreeT *node = addDiffNode(base, desired[wanted->second]);
+        ++result.added;
+        applyDiff(node, desired, wanted->second, equal, result);
+        ++wanted;
+      } else {
+        TreeT *node = existing->second.get().get();
+        if (updateDiffNode(node, desired[wanted->second], equal)) {
+          ++result.changed;
+        }
+        applyDiff(node, desired, wanted->second, equal, result);
+        ++existing;
+        ++wanted;
+      }
+    }
+  }
+
+  template <typename T>
+  TreeT *addDiffNode(TreeT *base, const DiffNode<T> &node) {
+    TreeT *newNode = node.insertion != nullptr
+        ? createSubNode(allocator(), node.name, node.insertion->flags, node.insertion->data)
+        : createSubNode(allocator(), node.name, FLAG_DIRECTORY | FLAG_DUMMY, createEmpty());
+    typename TreeT::NodePtrT newPtr = createSubPtr(newNode);
+    newPtr->m_Self = TreeT::WeakPtrT(newPtr);
+    newPtr->m_Parent = base;
+    base->set(newPtr);
+    if (node.insertion != nullptr) {
+      addToFilter(node.insertion->name);
+    }
+    return newNode;
+  }
+
+  // @return true if the node had to be changed
+  template <typename T, typename Equal>
+  bool updateDiffNode(TreeT *node, const DiffNode<T> &wanted, Equal &equal) {
+    if (wanted.insertion == nullptr) {
+      // only a parent, any directory will do
+      if (node->isDirectory()) {
+        return false;
+      }
+      typename TreeT::DataT data = createEmpty();
+      node->account(-1);
+      node->m_Data = std::move(data);
+      node->m_Flags = static_cast<TreeFlags>(FLAG_DIRECTORY | FLAG_DUMMY);
+      node->account(1);
+      return true;
+    }
+
+    if ((node->m_Flags == wanted.insertion->flags)
+        && equal(static_cast<const typename TreeT::DataT&>(node->m_Data), wanted.insertion->data)) {
+      return false;
+    }
+    // allocate before touching the node so running out of space leaves it intact
+    typename TreeT::DataT data = createData<TreeT::DataT, T>(wanted.insertion->data, allocator());
+    node->account(-1);
+    node->m_Data = std::move(data);
+    node->m_Flags = wanted.insertion->flags;
+    node->account(1);
+    return true;
+  }
+
+  // true if path is strictly below base
+  static bool isBelow(const fs::path &path, const fs::path &base) {
+    fs::path::iterator pathIter = path.begin();
+    for (fs::path::iterator baseIter = base.begin(); baseIter != base.end();
+         advanceIter(baseIter, base.end())) {
+      if (pathIter == path.end()) {
+        return false;
+      }
+      std::string lhs = pathIter->string();
+      std::string rhs = baseIter->string();
+      if ((lhs.size() != rhs.size()) || !foldedEquals(lhs.c_str(), rhs.c_str(), lhs.size())) {
+        return false;
+      }
+      advanceIter(pathIter, path.end());
+    }
+    return pathIter != path.end();
+  }
+
   /**
    * @brief copy content of one tree to a different tree (in a different shared memory segment
    * @param destination
@@ -824,18 +2126,21 @@ private:
    */
   void copyTree(TreeT *destination, const TreeT *reference) {
     VoidAllocatorT allocator = VoidAllocatorT(m_SHM->get_segment_manager());
+    destination->account(-1);
     destination->m_Flags = reference->m_Flags;
     dataAssign(destination->m_Data, reference->m_Data);
     destination->m_Name.assign(reference->m_Name.c_str());
-    for (const auto &kv : reference->m_Nodes) {
+    destination->updateKey();
+    destination->account(1);
+    for (const auto &kv : *reference->m_Nodes) {
       TreeT *newNode = createSubNode(allocator, "", true, createEmpty());
       typename TreeT::NodePtrT newNodePtr = createSubPtr(newNode);
       // need to set self BEFORE recursively copying the subtree, otherwise how would we assign parent pointers?
       newNode->m_Self = newNodePtr;
       TreeT *source = reinterpret_cast<TreeT*>(kv.second.get().get());
       copyTree(newNode, source);
-      destination->set(newNode->m_Name, newNodePtr);
-      newNode->m_Parent = destination->m_Self;
+      destination->set(newNodePtr);
+      newNode->m_Parent = destination;
     }
   }
 
@@ -849,10 +2154,31 @@ private:
     return --treeMeta->referenceCount;
   }
 
-  TreeMeta *createOrOpen(const char *SHMName, size_t size)
+  /**
+   * @param minimumSize if the view of a new segment of the requested size can't be
+   *        mapped, smaller sizes down to this one are tried. 0 to only try the
+   *        requested size
+   */
+  TreeMeta *createOrOpen(const char *SHMName, size_t size,
+                         const TreeMeta *copyFrom = nullptr, bool *created = nullptr,
+                         size_t minimumSize = 0)
   {
-//    bi::named_mutex mutex(bi::open_or_create, LockName);
-//    bi::scoped_lock<bi::named_mutex> lock(mutex, boost::get_system_time() + boost::posix_time::seconds(1));
+    // serialize creation of segments of this tree across processes, otherwise two
+    // processes growing the tree at the same time may both try to create (or one may
+    // open the segment before the other has copied the tree into it)
+    std::string baseName(SHMName);
+    baseName.erase(baseName.find_last_not_of("0123456789") + 1);
+    HANDLE mutex = ::CreateMutexA(nullptr, FALSE, (baseName + "creation").c_str());
+    if (mutex != nullptr) {
+      // WAIT_ABANDONED also means we own the mutex now
+      ::WaitForSingleObject(mutex, INFINITE);
+    }
+    ON_BLOCK_EXIT([mutex]() {
+      if (mutex != nullptr) {
+        ::ReleaseMutex(mutex);
+        ::CloseHandle(mutex);
+      }
+    });
 
     SharedMemoryT *newSHM;
     try {
@@ -860,14 +2186,41 @@ private:
       spdlog::get("usvfs")->info("{} opened in process {}",
                                  SHMName, ::GetCurrentProcessId());
     } catch (const bi::interprocess_exception&) {
-      newSHM = new SharedMemoryT(bi::create_only, SHMName, static_cast<unsigned int>(size));
-      spdlog::get("usvfs")->info("{} created in process {}",
-                                 SHMName, ::GetCurrentProcessId());
+      newSHM = createSegment(SHMName, size, minimumSize);
+      spdlog::get("usvfs")->info("{} created in process {} ({} bytes)",
+                                 SHMName, ::GetCurrentProcessId(), newSHM->get_size());
     }
-    return activateSHM(newSHM, SHMName);
+    return activateSHM(newSHM, SHMName, copyFrom, created);
   }
 
-  TreeMeta *activateSHM(SharedMemoryT *shm, const char *SHMName)
+  /**
+   * @brief create a segment, halving the growth down to the minimum size while the
+   *        view doesn't fit into the address space of this process
+   */
+  static SharedMemoryT *createSegment(const char *SHMName, size_t size, size_t minimumSize)
+  {
+    for (;;) {
+      try {
+        return new SharedMemoryT(bi::create_only, SHMName, static_cast<unsigned int>(size));
+      } catch (const bi::interprocess_exception &e) {
+        if ((minimumSize == 0) || (size <= minimumSize + 64 * 1024)) {
+          throw;
+        }
+        spdlog::get("usvfs")->warn("failed to create {} with {} bytes: {}",
+                                   SHMName, size, e.what());
+        size = minimumSize + (size - minimumSize) / 2;
+      }
+    }
+  }
+
+  /**
+   * @brief switch to a different shared memory segment
+   * @param copyFrom tree to copy into the segment if it doesn't contain one yet. If
+   *        this is null the segment gets an empty tree
+   * @param created if not null, this is set to true if the tree was copied
+   */
+  TreeMeta *activateSHM(SharedMemoryT *shm, const char *SHMName,
+                        const TreeMeta *copyFrom, bool *created)
   {
     std::shared_ptr<SharedMemoryT> oldSHM = m_SHM;
 
@@ -879,8 +2232,20 @@ private:
       if (res.first == nullptr) {
         USVFS_THROW_EXCEPTION(bi::bad_alloc());
       }
-      if (m_TreeMeta != nullptr) {
-        copyTree(res.first->tree.get(), m_TreeMeta->tree.get());
+      if (copyFrom != nullptr) {
+        copyTree(res.first->tree.get(), copyFrom->tree.get());
+        // continue counting so caches don't consider the new tree to be unchanged
+        long generation = (std::max)(copyFrom->generation.load(),
+                                     m_TreeMeta != nullptr ? m_TreeMeta->generation.load() : 0L);
+        res.first->generation = generation + 1;
+        res.first->filter.assign(copyFrom->filter);
+        res.first->growthCount = (m_TreeMeta != nullptr ? m_TreeMeta->growthCount : 0) + 1;
+      } else if (m_TreeMeta != nullptr) {
+        res.first->generation = m_TreeMeta->generation.load() + 1;
+        res.first->growthCount = m_TreeMeta->growthCount;
+      }
+      if (created != nullptr) {
+        *created = true;
       }
     }
     increaseRefCount(res.first);
@@ -901,16 +2266,53 @@ private:
 
   std::string followupName() const
   {
-    std::regex pattern(R"exp((.*_)(\d+))exp");
-    std::string shmName(m_SHMName.c_str()); // need to copy because the regex result will be iterators into this string
-    std::smatch match;
-    regex_match(shmName, match, pattern);
-    if (match.size() != 3) {
+    std::string prefix;
+    int count;
+    if (!splitSHMName(m_SHMName, prefix, count)
+        || (count == std::numeric_limits<int>::max())) {
       USVFS_THROW_EXCEPTION(usage_error() << ex_msg("shared memory name invalid"));
     }
-    int count = boost::lexical_cast<int>(match[2]);
 
-    return match[1].str() + std::to_string(count + 1);
+    return prefix + std::to_string(count + 1);
+  }
+
+  /**
+   * @brief split a shm name into everything up to and including the last underscore
+   *        and the running number behind it
+   * @return false if the name doesn't end in _<number>
+   */
+  static bool splitSHMName(const std::string &name, std::string &prefix, int &count)
+  {
+    size_t separator = name.rfind('_');
+    if ((separator == std::string::npos) || (separator + 1 == name.size())) {
+      return false;
+    }
+    int result = 0;
+    for (size_t i = separator + 1; i < name.size(); ++i) {
+      char ch = name[i];
+      if ((ch < '0') || (ch > '9')
+          || (result > (std::numeric_limits<int>::max() - 9) / 10)) {
+        return false;
+      }
+      result = result * 10 + (ch - '0');
+    }
+    prefix = name.substr(0, separator + 1);
+    count = result;
+    return true;
+  }
+
+  /**
+   * @brief make boost::filesystem convert paths as utf-8. The locale is global so
+   *        this only has to happen once per process, not for every container
+   */
+  static void imbueUtf8()
+  {
+    static bool imbued = []() {
+      std::locale loc(std::locale(), new fs::detail::utf8_codecvt_facet);
+      fs::path::imbue(loc);
+      return true;
+    }();
+    (void)imbued;
   }
 
   bool unassign(const std::shared_ptr<SharedMemoryT> &shm, TreeMeta *tree)
@@ -926,6 +2328,46 @@ private:
     }
   }
 
+  /**
+   * @return name of the event waiters on the write lock of the current segment use
+   */
+  std::string writeLockName() const {
+    return m_SHMName + "_write";
+  }
+
+  /**
+   * @brief acquire the write lock, moving on to the current segment first if another
+   *        process has grown the tree in the meantime
+   * @return the meta data whose lock is held
+   */
+  TreeMeta *lockWrite() const {
+    for (;;) {
+      TreeMeta *meta = m_TreeMeta;
+      meta->writeLock.lock(writeLockName().c_str());
+      if (!meta->outdated) {
+        return meta;
+      }
+      meta->writeLock.unlock(writeLockName().c_str());
+      reassign();
+    }
+  }
+
+  void unlockWrite(TreeMeta *meta) const {
+    meta->writeLock.unlock(writeLockName().c_str());
+  }
+
+  /**
+   * @brief flag the current segment as outdated, waiting for modifications in progress
+   *        in other processes. Once this returns the segment doesn't change anymore
+   */
+  void markOutdated() const {
+    TreeMeta *meta = m_TreeMeta;
+    meta->writeLock.lock(writeLockName().c_str());
+    meta->outdated = true;
+    bumpGeneration();
+    meta->writeLock.unlock(writeLockName().c_str());
+  }
+
   void reassign() const
   {
     // TODO evil const cast. We need to be able to reassign, even if the user only
@@ -933,19 +2375,24 @@ private:
     // This is not the solution
     auto *self = const_cast<TreeContainer<TreeT>*>(this);
 
-    self->m_TreeMeta->outdated = true;
+    uint64_t start = etw::now();
+    self->markOutdated();
 
+    // the copy has to fit with some room to spare or the tree would grow again right away
+    size_t minimumSize = m_SHM->get_size() + m_SHM->get_size() / 8;
     for (;;) {
       std::string nextName = followupName();
       self->m_TreeMeta = self->createOrOpen(nextName.c_str(),
-                                            m_SHM->get_size() * 2);
+                                            grownSize(m_SHM->get_size()), m_TreeMeta,
+                                            nullptr, minimumSize);
 
       if (!m_TreeMeta->outdated) {
         break;
       }
     }
-    spdlog::get("usvfs")->info("tree {0} size now {1} bytes",
-                               m_SHMName, m_SHM->get_size());
+    spdlog::get("usvfs")->info("tree {0} size now {1} bytes (grown {2} times)",
+                               m_SHMName, m_SHM->get_size(), m_TreeMeta->growthCount);
+    etw::treeGrown(m_SHMName.c_str(), m_SHM->get_size(), m_TreeMeta->growthCount, start);
   }
 
 private:
@@ -957,11 +2404,6 @@ private:
 };
 
 
-/*
-template<typename NodeDataT>
-const char TreeContainer<NodeDataT>::LockName[] = "tree_creation_lock";
-*/
-
 template <typename NodeDataT>
 void dumpTree(std::ostream &stream, const DirectoryTree<NodeDataT> &tree,
               int level = 0)
@@ -0,0 +1,155 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "etwprovider.h"
+#include <TraceLoggingProvider.h>
+#include <winmeta.h>
+#include <algorithm>
+#include <climits>
+#include <cwchar>
+
+
+TRACELOGGING_DEFINE_PROVIDER(usvfsProvider, "usvfs",
+    (0x928476cd, 0x40ba, 0x473a, 0xa9, 0xe3, 0x7a, 0xef, 0x34, 0x90, 0x3e, 0x3d));
+
+
+namespace usvfs {
+
+namespace shared {
+
+namespace etw {
+
+static uint64_t toMicroseconds(uint64_t ticks)
+{
+  static const uint64_t frequency = [] () {
+    LARGE_INTEGER result;
+    QueryPerformanceFrequency(&result);
+    return static_cast<uint64_t>(result.QuadPart);
+  }();
+  return (ticks / frequency) * 1000000 + ((ticks % frequency) * 1000000) / frequency;
+}
+
+static uint64_t elapsedMicroseconds(uint64_t startTicks)
+{
+  return toMicroseconds(now() - startTicks);
+}
+
+void registerProvider()
+{
+  TraceLoggingRegister(usvfsProvider);
+}
+
+void unregisterProvider()
+{
+  TraceLoggingUnregister(usvfsProvider);
+}
+
+bool enabled(Keyword keyword)
+{
+  return TraceLoggingProviderEnabled(usvfsProvider, WINEVENT_LEVEL_VERBOSE, keyword);
+}
+
+uint64_t now()
+{
+  LARGE_INTEGER result;
+  QueryPerformanceCounter(&result);
+  return static_cast<uint64_t>(result.QuadPart);
+}
+
+void hookEnter(const char *function)
+{
+  TraceLoggingWrite(usvfsProvider, "HookEnter",
+                    TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+                    TraceLoggingKeyword(KEYWORD_HOOKS),
+                    TraceLoggingString(function, "Function"));
+}
+
+void hookExit(const char *function, uint64_t startTicks, uint64_t realTicks,
+              bool redirected)
+{
+  TraceLoggingWrite(usvfsProvider, "HookExit",
+                    TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+                    TraceLoggingKeyword(KEYWORD_HOOKS),
+                    TraceLoggingString(function, "Function"),
+                    TraceLoggingUInt64(elapsedMicroseconds(startTicks), "DurationUs"),
+                    TraceLoggingUInt64(toMicroseconds(realTicks), "RealCallUs"),
+                    TraceLoggingBoolean(redirected, "Redirected"));
+}
+
+void reroute(const wchar_t *path, size_t length, const wchar_t *target, bool redirected)
+{
+  TraceLoggingWrite(usvfsProvider, "Reroute",
+                    TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+                    TraceLoggingKeyword(KEYWORD_REROUTE),
+                    TraceLoggingCountedWideString(
+                        path != nullptr ? path : L"",
+                        static_cast<USHORT>(path != nullptr ? std::min<size_t>(length, USHRT_MAX) : 0),
+                        "Path"),
+                    TraceLoggingWideString(redirected && (target != nullptr) ? target : L"",
+                                           "Target"),
+                    TraceLoggingBoolean(redirected, "Redirected"));
+}
+
+void reroute(const wchar_t *path, const wchar_t *target, bool redirected)
+{
+  if (enabled(KEYWORD_REROUTE)) {
+    reroute(path, path != nullptr ? wcslen(path) : 0, target, redirected);
+  }
+}
+
+void treeGrown(const char *name, uint64_t size, uint32_t growthCount,
+               uint64_t startTicks)
+{
+  TraceLoggingWrite(usvfsProvider, "TreeGrown",
+                    TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+                    TraceLoggingKeyword(KEYWORD_TREE),
+                    TraceLoggingString(name, "Name"),
+                    TraceLoggingUInt64(size, "Size"),
+                    TraceLoggingUInt32(growthCount, "GrowthCount"),
+                    TraceLoggingUInt64(elapsedMicroseconds(startTicks), "DurationUs"));
+}
+
+void lockWait(DWORD ownerId, uint64_t startTicks, bool stolen)
+{
+  TraceLoggingWrite(usvfsProvider, "LockWait",
+                    TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+                    TraceLoggingKeyword(KEYWORD_LOCKS),
+                    TraceLoggingUInt32(ownerId, "OwnerThread"),
+                    TraceLoggingUInt64(elapsedMicroseconds(startTicks), "WaitUs"),
+                    TraceLoggingBoolean(stolen, "Stolen"));
+}
+
+void processInjected(DWORD processId, bool sameBitness, bool success,
+                     uint64_t startTicks)
+{
+  TraceLoggingWrite(usvfsProvider, "ProcessInjected",
+                    TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+                    TraceLoggingKeyword(KEYWORD_INJECTION),
+                    TraceLoggingUInt32(processId, "ProcessId"),
+                    TraceLoggingBoolean(sameBitness, "SameBitness"),
+                    TraceLoggingBoolean(success, "Success"),
+                    TraceLoggingUInt64(elapsedMicroseconds(startTicks), "DurationUs"));
+}
+
+} // namespace etw
+
+} // namespace shared
+
+} // namespace usvfs
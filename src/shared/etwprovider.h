@@ -0,0 +1,86 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include "windows_sane.h"
+#include <cstdint>
+
+namespace usvfs {
+
+namespace shared {
+
+/**
+ * @brief ETW provider "usvfs" (TraceLogging) for correlating usvfs overhead with
+ *        other system activity in WPA/xperf. Provider guid
+ *        {928476cd-40ba-473a-a9e3-7aef34903e3d}.
+ *        All functions are cheap no-ops while no session has the event enabled or
+ *        while the provider isn't registered in the module
+ */
+namespace etw {
+
+enum Keyword : uint64_t {
+  KEYWORD_HOOKS     = 0x01, // hook entry and exit
+  KEYWORD_REROUTE   = 0x02, // reroute decisions
+  KEYWORD_TREE      = 0x04, // growth of the shared trees
+  KEYWORD_LOCKS     = 0x08, // contended waits on usvfs locks
+  KEYWORD_INJECTION = 0x10  // injection into new processes
+};
+
+/**
+ * @brief register the provider for the calling module. Has to be paired with
+ *        unregisterProvider before the module unloads
+ */
+void registerProvider();
+void unregisterProvider();
+
+/**
+ * @return true if a session listens to events with the keyword
+ */
+bool enabled(Keyword keyword);
+
+/**
+ * @return timestamp to pass as the start of durations, QueryPerformanceCounter ticks
+ */
+uint64_t now();
+
+void hookEnter(const char *function);
+void hookExit(const char *function, uint64_t startTicks, uint64_t realTicks,
+              bool redirected);
+
+/**
+ * @param target the path the call was redirected to, may be nullptr if it wasn't
+ */
+void reroute(const wchar_t *path, size_t length, const wchar_t *target, bool redirected);
+void reroute(const wchar_t *path, const wchar_t *target, bool redirected);
+
+void treeGrown(const char *name, uint64_t size, uint32_t growthCount,
+               uint64_t startTicks);
+
+void lockWait(DWORD ownerId, uint64_t startTicks, bool stolen);
+
+void processInjected(DWORD processId, bool sameBitness, bool success,
+                     uint64_t startTicks);
+
+} // namespace etw
+
+} // namespace shared
+
+} // namespace usvfs
@@ -0,0 +1,211 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "flattree.h"
+#include <cstring>
+
+namespace usvfs {
+
+namespace shared {
+
+FlatTree::FlatTree(const void *buffer, size_t size)
+{
+  if ((buffer == nullptr) || (size < sizeof(FlatTreeHeader))) {
+    return;
+  }
+  const FlatTreeHeader *header = static_cast<const FlatTreeHeader*>(buffer);
+  size_t expected = sizeof(FlatTreeHeader)
+                    + static_cast<size_t>(header->nodeCount) * sizeof(FlatTreeNode)
+                    + header->stringBytes;
+  if ((header->magic != FlatTreeHeader::MAGIC) || (header->nodeCount == 0)
+      || (expected > size)) {
+    return;
+  }
+  m_Header  = header;
+  m_Nodes   = reinterpret_cast<const FlatTreeNode*>(header + 1);
+  m_Strings = reinterpret_cast<const char*>(m_Nodes + header->nodeCount);
+}
+
+uint32_t FlatTree::findChild(uint32_t parent, const NodeName &name, const char *&chain) const
+{
+  const FlatTreeNode *begin = m_Nodes + m_Nodes[parent].firstChild;
+  const FlatTreeNode *end   = begin + m_Nodes[parent].childCount;
+  const FlatTreeNode *iter  = std::lower_bound(
+      begin, end, name.hash,
+      [](const FlatTreeNode &node, uint32_t hash) { return node.hash < hash; });
+  for (; (iter != end) && (iter->hash == name.hash); ++iter) {
+    const char *key = string(iter->key);
+    size_t i = 0;
+    for (; (i < name.size) && (key[i] == foldChar(name.data[i])); ++i) {
+    }
+    if (i != name.size) {
+      continue;
+    }
+    if (key[i] == '\0') {
+      chain = nullptr;
+      return static_cast<uint32_t>(iter - m_Nodes);
+    } else if ((key[i] == '\\') && ((iter->flags & FlatTreeNode::FLAG_CHAIN) != 0)) {
+      chain = key + i + 1;
+      return static_cast<uint32_t>(iter - m_Nodes);
+    }
+  }
+  return NOT_FOUND;
+}
+
+uint32_t FlatTree::find(const wchar_t *path, size_t length) const
+{
+  Match match = lookup(path, length);
+  return match.chainComponents == 0 ? match.node : NOT_FOUND;
+}
+
+FlatTree::Match FlatTree::lookup(const wchar_t *path, size_t length) const
+{
+  char buffer[MAX_COMPONENT_UTF8];
+  uint32_t current = 0;
+  bool found = false;
+  // the part of the key of a chain still to be matched, components of the path
+  // are matched against it instead of looking up children
+  const char *chain = nullptr;
+  uint32_t chainComponents = 0;
+
+  const wchar_t *end = path + length;
+  while (path < end) {
+    const wchar_t *separator = path;
+    while ((separator < end) && (*separator != L'\\') && (*separator != L'/')) {
+      ++separator;
+    }
+    size_t componentLength = separator - path;
+    if ((componentLength > 0) && !((componentLength == 1) && (*path == L'.'))) {
+      size_t size = componentToUTF8(path, componentLength, buffer, MAX_COMPONENT_UTF8);
+      if (size == 0) {
+        return Match();
+      }
+      if (chain != nullptr) {
+        size_t i = 0;
+        for (; (i < size) && (chain[i] == foldChar(buffer[i])); ++i) {
+        }
+        if ((i != size) || ((chain[i] != '\0') && (chain[i] != '\\'))) {
+          return Match();
+        }
+        chain = (chain[i] == '\\') ? chain + i + 1 : nullptr;
+        ++chainComponents;
+      } else {
+        current = findChild(current, NodeName(buffer, size), chain);
+        if (current == NOT_FOUND) {
+          return Match();
+        }
+        chainComponents = 1;
+      }
+      found = true;
+    }
+    path = separator + 1;
+  }
+
+  Match result;
+  if (found) {
+    result.node = current;
+    result.chainComponents = (chain != nullptr) ? chainComponents : 0;
+  }
+  return result;
+}
+
+std::string FlatTree::path(uint32_t node) const
+{
+  if (node == 0) {
+    return std::string();
+  }
+  uint32_t parent = m_Nodes[node].parent;
+  if (parent == 0) {
+    // a drive, unless it's a chain starting at one
+    return ((m_Nodes[node].flags & FlatTreeNode::FLAG_CHAIN) != 0)
+               ? std::string(name(node))
+               : std::string(name(node)) + "\\";
+  }
+  std::string result = path(parent);
+  if (result.back() != '\\') {
+    result.push_back('\\');
+  }
+  return result + name(node);
+}
+
+std::string FlatTree::path(const Match &match) const
+{
+  if (match.chainComponents == 0) {
+    return path(match.node);
+  }
+
+  // the first components of the chain
+  const char *chainName = name(match.node);
+  const char *end = chainName;
+  for (uint32_t i = 0; i < match.chainComponents; ++i) {
+    end = strchr(end, '\\') + 1;
+  }
+  std::string components(chainName, end - 1);
+
+  uint32_t parent = m_Nodes[match.node].parent;
+  if (parent == 0) {
+    return (match.chainComponents == 1) ? components + "\\" : components;
+  }
+  std::string result = path(parent);
+  if (result.back() != '\\') {
+    result.push_back('\\');
+  }
+  return result + components;
+}
+
+std::string FlatTreeSegment::nameFor(const std::string &treeName, long generation)
+{
+  return treeName + "_snapshot" + std::to_string(generation);
+}
+
+FlatTreeSegment::FlatTreeSegment(bi::windows_shared_memory &&shm, bi::mode_t mode)
+  : m_SHM(std::move(shm))
+  , m_Region(m_SHM, mode)
+  , m_Tree(m_Region.get_address(), m_Region.get_size())
+{
+}
+
+std::unique_ptr<FlatTreeSegment> FlatTreeSegment::create(const std::string &name,
+                                                         const std::vector<char> &image)
+{
+  bi::windows_shared_memory shm(bi::create_only, name.c_str(), bi::read_write, image.size());
+  std::unique_ptr<FlatTreeSegment> result(new FlatTreeSegment(std::move(shm), bi::read_write));
+  memcpy(result->m_Region.get_address(), image.data(), image.size());
+  result->m_Tree = FlatTree(result->m_Region.get_address(), result->m_Region.get_size());
+  return result;
+}
+
+std::unique_ptr<FlatTreeSegment> FlatTreeSegment::open(const std::string &name)
+{
+  try {
+    bi::windows_shared_memory shm(bi::open_only, name.c_str(), bi::read_only);
+    std::unique_ptr<FlatTreeSegment> result(new FlatTreeSegment(std::move(shm), bi::read_only));
+    if (!result->m_Tree.valid()) {
+      return std::unique_ptr<FlatTreeSegment>();
+    }
+    return result;
+  } catch (const bi::interprocess_exception&) {
+    return std::unique_ptr<FlatTreeSegment>();
+  }
+}
+
+} // namespace shared
+
+} // namespace usvfs
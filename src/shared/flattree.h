@@ -0,0 +1,280 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include "directory_tree.h"
+#include <boost/interprocess/windows_shared_memory.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace usvfs {
+
+namespace shared {
+
+/**
+ * Layout of a frozen tree: a FlatTreeHeader followed by nodeCount FlatTreeNodes
+ * followed by the string pool. The root is node 0 and the children of every node are
+ * stored consecutively, sorted by hash. All references are 32-bit offsets so the same
+ * image can be used by 32-bit and 64-bit processes.
+ * In a compressed image a dummy directory with a single child is merged into the child.
+ * The resulting chain node has FLAG_CHAIN set, its name and key list the names of all
+ * merged nodes separated by backslashes and its hash is that of the first one.
+ */
+struct FlatTreeHeader {
+  static const uint32_t MAGIC = 0x45455254; // "TREE"
+
+  uint32_t magic;
+  uint32_t nodeCount;
+  uint32_t stringBytes;
+  int32_t generation;
+};
+
+struct FlatTreeNode {
+  // set in flags for nodes that chain several path components, above the tree flags
+  static const uint32_t FLAG_CHAIN = 0x100;
+
+  uint32_t hash;
+  uint32_t name;   // offset of the name in the string pool
+  uint32_t key;    // offset of the folded name in the string pool
+  uint32_t target; // offset of the link target in the string pool, 0 if there is none
+  uint32_t parent;
+  uint32_t firstChild;
+  uint32_t childCount;
+  uint32_t flags;
+};
+
+
+/**
+ * read-only view of a frozen tree. Lookups don't allocate and don't touch any
+ * reference counts
+ */
+class FlatTree {
+public:
+  static const uint32_t NOT_FOUND = 0xFFFFFFFF;
+
+  /**
+   * @brief result of lookup. If the path ends inside a chain, node is the chain and
+   *        chainComponents the number of its components the path covers. The directory
+   *        found that way has no node of its own, it's a dummy without target
+   */
+  struct Match {
+    uint32_t node { NOT_FOUND };
+    uint32_t chainComponents { 0 };
+  };
+
+  FlatTree(const void *buffer, size_t size);
+
+  /**
+   * @return true if the buffer contained a valid tree image
+   */
+  bool valid() const { return m_Header != nullptr; }
+
+  /**
+   * @return generation of the tree this was frozen from
+   */
+  long generation() const { return m_Header->generation; }
+
+  uint32_t numNodes() const { return m_Header->nodeCount; }
+
+  /**
+   * @brief find a node by its path, split the same way DirectoryTree::findNode does
+   * @return index of the node or NOT_FOUND. Also NOT_FOUND for directories inside a chain
+   */
+  uint32_t find(const wchar_t *path, size_t length) const;
+
+  /**
+   * @brief like find but also finds directories inside chains
+   */
+  Match lookup(const wchar_t *path, size_t length) const;
+
+  // for chains this lists the names of all components
+  const char *name(uint32_t node) const { return string(m_Nodes[node].name); }
+  const char *target(uint32_t node) const { return string(m_Nodes[node].target); }
+  uint32_t parent(uint32_t node) const { return m_Nodes[node].parent; }
+  TreeFlags flags(uint32_t node) const { return static_cast<TreeFlags>(m_Nodes[node].flags); }
+  bool isDirectory(uint32_t node) const { return (flags(node) & FLAG_DIRECTORY) != 0; }
+
+  /**
+   * @return full path of the node in the same format DirectoryTree::path uses (utf-8)
+   */
+  std::string path(uint32_t node) const;
+
+  /**
+   * @return full path of a lookup result, which may be a directory inside a chain
+   */
+  std::string path(const Match &match) const;
+
+private:
+  const char *string(uint32_t offset) const { return m_Strings + offset; }
+
+  // chain is set to the rest of the key if the child found is a chain, to null otherwise
+  uint32_t findChild(uint32_t parent, const NodeName &name, const char *&chain) const;
+
+private:
+  const FlatTreeHeader *m_Header{nullptr};
+  const FlatTreeNode *m_Nodes{nullptr};
+  const char *m_Strings{nullptr};
+};
+
+
+/**
+ * @brief compile a tree into the flat format
+ * @param tree root of the tree to compile
+ * @param generation generation of the tree, stored in the image
+ * @param getTarget functor returning the link target (utf-8) for a node
+ * @param compress if true, chains of dummy directories with a single child are merged
+ *        into one node. That takes less space and fewer steps to look up but the image
+ *        no longer has a node for every node of the tree
+ * @return the image
+ */
+template <typename TreeT, typename TargetFunc>
+std::vector<char> buildFlatTree(const TreeT &tree, long generation, const TargetFunc &getTarget,
+                                bool compress = false)
+{
+  std::vector<FlatTreeNode> nodes;
+  std::string strings(1, '\0');
+
+  auto addString = [&strings](const std::string &value) -> uint32_t {
+    if (value.empty()) {
+      return 0;
+    }
+    uint32_t offset = static_cast<uint32_t>(strings.size());
+    strings.append(value);
+    strings.push_back('\0');
+    return offset;
+  };
+
+  // directories only there to hold a single node
+  auto chainable = [&](const TreeT &node) {
+    return compress && (node.flags() == (FLAG_DIRECTORY | FLAG_DUMMY))
+           && (node.numNodes() == 1) && getTarget(node).empty();
+  };
+
+  // last receives the node at the end of the chain, whose children follow
+  auto makeNode = [&](const TreeT &node, uint32_t parent, const TreeT *&last) {
+    std::string name = node.name();
+    std::string key = node.key().c_str();
+    last = &node;
+    while (chainable(*last)) {
+      last = last->filesBegin()->second.get().get();
+      name.append("\\").append(last->name());
+      key.append("\\").append(last->key().c_str());
+    }
+
+    FlatTreeNode result;
+    result.hash       = node.keyHash();
+    result.name       = addString(name);
+    result.key        = addString(key);
+    result.target     = addString(getTarget(*last));
+    result.parent     = parent;
+    result.firstChild = 0;
+    result.childCount = 0;
+    result.flags      = last->flags();
+    if (last != &node) {
+      result.flags |= FlatTreeNode::FLAG_CHAIN;
+    }
+    return result;
+  };
+
+  // breadth-first so the children of each node end up next to each other. The
+  // index in the queue is the index of the node in the output
+  std::vector<const TreeT*> queue;
+  // the root is never a dummy so it doesn't start a chain
+  const TreeT *root = nullptr;
+  nodes.push_back(makeNode(tree, 0, root));
+  queue.push_back(root);
+
+  for (size_t i = 0; i < queue.size(); ++i) {
+    std::vector<const TreeT*> children;
+    for (auto iter = queue[i]->filesBegin(); iter != queue[i]->filesEnd(); ++iter) {
+      children.push_back(iter->second.get().get());
+    }
+    std::sort(children.begin(), children.end(), [](const TreeT *lhs, const TreeT *rhs) {
+      return lhs->keyHash() < rhs->keyHash();
+    });
+
+    nodes[i].firstChild = static_cast<uint32_t>(nodes.size());
+    nodes[i].childCount = static_cast<uint32_t>(children.size());
+    for (const TreeT *child : children) {
+      const TreeT *last = nullptr;
+      nodes.push_back(makeNode(*child, static_cast<uint32_t>(i), last));
+      queue.push_back(last);
+    }
+  }
+
+  FlatTreeHeader header;
+  header.magic       = FlatTreeHeader::MAGIC;
+  header.nodeCount   = static_cast<uint32_t>(nodes.size());
+  header.stringBytes = static_cast<uint32_t>(strings.size());
+  header.generation  = static_cast<int32_t>(generation);
+
+  std::vector<char> image(sizeof(FlatTreeHeader) + nodes.size() * sizeof(FlatTreeNode)
+                          + strings.size());
+  char *pos = image.data();
+  memcpy(pos, &header, sizeof(FlatTreeHeader));
+  pos += sizeof(FlatTreeHeader);
+  memcpy(pos, nodes.data(), nodes.size() * sizeof(FlatTreeNode));
+  pos += nodes.size() * sizeof(FlatTreeNode);
+  memcpy(pos, strings.data(), strings.size());
+  return image;
+}
+
+
+/**
+ * named shared memory holding a frozen tree
+ */
+class FlatTreeSegment {
+public:
+  /**
+   * @return name of the segment holding the snapshot of the specified tree generation
+   */
+  static std::string nameFor(const std::string &treeName, long generation);
+
+  /**
+   * @brief create a new segment containing the image
+   */
+  static std::unique_ptr<FlatTreeSegment> create(const std::string &name,
+                                                 const std::vector<char> &image);
+
+  /**
+   * @brief open an existing segment
+   * @return the segment or a null pointer if it doesn't exist or is invalid
+   */
+  static std::unique_ptr<FlatTreeSegment> open(const std::string &name);
+
+  const FlatTree &tree() const { return m_Tree; }
+
+private:
+  FlatTreeSegment(bi::windows_shared_memory &&shm, bi::mode_t mode);
+
+private:
+  bi::windows_shared_memory m_SHM;
+  bi::mapped_region m_Region;
+  FlatTree m_Tree;
+};
+
+} // namespace shared
+
+} // namespace usvfs
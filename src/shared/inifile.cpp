@@ -0,0 +1,141 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "inifile.h"
+#include <cstring>
+#include "stringcast.h"
+#include "stringutils.h"
+
+namespace usvfs {
+
+namespace shared {
+
+static bool isBlank(wchar_t ch)
+{
+  return (ch == L' ') || (ch == L'\t');
+}
+
+static void trim(const wchar_t *&begin, const wchar_t *&end)
+{
+  while ((begin < end) && isBlank(*begin)) {
+    ++begin;
+  }
+  while ((end > begin) && isBlank(*(end - 1))) {
+    --end;
+  }
+}
+
+std::wstring IniFile::foldedName(const std::wstring &name)
+{
+  const wchar_t *begin = name.c_str();
+  const wchar_t *end   = begin + name.size();
+  trim(begin, end);
+  return to_upper(std::wstring(begin, end));
+}
+
+bool IniFile::parse(const char *data, size_t size)
+{
+  std::wstring text;
+  if ((size >= 2) && (data[0] == '\xff') && (data[1] == '\xfe')) {
+    text.assign(reinterpret_cast<const wchar_t *>(data + 2), (size - 2) / sizeof(wchar_t));
+  } else if ((size >= 2) && (data[0] == '\xfe') && (data[1] == '\xff')) {
+    return false;
+  } else if ((size >= 3) && (memcmp(data, "\xef\xbb\xbf", 3) == 0)) {
+    text = string_cast<std::wstring>(data + 3, CodePage::UTF8, size - 3);
+  } else {
+    text = string_cast<std::wstring>(data, CodePage::LOCAL, size);
+  }
+
+  m_Sections.clear();
+  // entries before the first section header can't be read by name
+  Section *current = nullptr;
+  const wchar_t *pos = text.c_str();
+  const wchar_t *textEnd = pos + text.size();
+  while (pos < textEnd) {
+    const wchar_t *lineEnd = pos;
+    while ((lineEnd < textEnd) && (*lineEnd != L'\r') && (*lineEnd != L'\n')) {
+      ++lineEnd;
+    }
+    const wchar_t *begin = pos;
+    const wchar_t *end   = lineEnd;
+    pos = lineEnd + 1;
+    trim(begin, end);
+    if (begin == end) {
+      continue;
+    }
+
+    if (*begin == L'[') {
+      const wchar_t *close = end;
+      while ((close > begin) && (*(close - 1) != L']')) {
+        --close;
+      }
+      const wchar_t *nameEnd = (close > begin + 1) ? close - 1 : end;
+      std::wstring name = foldedName(std::wstring(begin + 1, nameEnd));
+      auto inserted = m_Sections.emplace(name, Section());
+      current = inserted.second ? &inserted.first->second : nullptr;
+    } else if ((current != nullptr) && (*begin != L';')) {
+      const wchar_t *equals = begin;
+      while ((equals < end) && (*equals != L'=')) {
+        ++equals;
+      }
+      const wchar_t *keyEnd = equals;
+      trim(begin, keyEnd);
+      current->entries.append(begin, keyEnd);
+      if (equals < end) {
+        const wchar_t *valueBegin = equals + 1;
+        const wchar_t *valueEnd   = end;
+        trim(valueBegin, valueEnd);
+        current->entries.push_back(L'=');
+        current->entries.append(valueBegin, valueEnd);
+
+        if ((valueEnd - valueBegin >= 2)
+            && ((*valueBegin == L'"') || (*valueBegin == L'\''))
+            && (*(valueEnd - 1) == *valueBegin)) {
+          ++valueBegin;
+          --valueEnd;
+        }
+        current->values.emplace(foldedName(std::wstring(begin, keyEnd)),
+                                std::wstring(valueBegin, valueEnd));
+      }
+      current->entries.push_back(L'\0');
+    }
+  }
+  return true;
+}
+
+const std::wstring *IniFile::value(const std::wstring &section, const std::wstring &key) const
+{
+  auto sectionIter = m_Sections.find(foldedName(section));
+  if (sectionIter == m_Sections.end()) {
+    return nullptr;
+  }
+  auto valueIter = sectionIter->second.values.find(foldedName(key));
+  return (valueIter != sectionIter->second.values.end()) ? &valueIter->second : nullptr;
+}
+
+const std::wstring *IniFile::entries(const std::wstring &section) const
+{
+  auto iter = m_Sections.find(foldedName(section));
+  return (iter != m_Sections.end()) ? &iter->second.entries : nullptr;
+}
+
+} // namespace shared
+
+} // namespace usvfs
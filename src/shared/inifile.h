@@ -0,0 +1,77 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <unordered_map>
+
+namespace usvfs {
+
+namespace shared {
+
+/**
+ * @brief an ini file parsed the way GetPrivateProfileString and
+ *        GetPrivateProfileSection read it, so reads can be answered from memory.
+ *        Section and key names compare case-insensitively and surrounding whitespace
+ *        is ignored. If a section or a key appears more than once, the first one wins
+ */
+class IniFile {
+public:
+
+  /**
+   * @brief parse the content of an ini file. Utf-16 and utf-8 files are recognized by
+   *        their byte order mark, everything else is read in the ansi code page
+   * @return false if the encoding isn't supported (big-endian utf-16)
+   */
+  bool parse(const char *data, size_t size);
+
+  /**
+   * @return the value of a key with a pair of enclosing quotes removed. nullptr if the
+   *         section or the key doesn't exist or the key has no '='
+   */
+  const std::wstring *value(const std::wstring &section, const std::wstring &key) const;
+
+  /**
+   * @return the entries of a section as GetPrivateProfileSection reports them, each
+   *         "key=value" string followed by a null character. nullptr if the section
+   *         doesn't exist
+   */
+  const std::wstring *entries(const std::wstring &section) const;
+
+private:
+
+  struct Section {
+    std::wstring entries;
+    // keyed by the folded key name
+    std::unordered_map<std::wstring, std::wstring> values;
+  };
+
+  static std::wstring foldedName(const std::wstring &name);
+
+  // keyed by the folded section name
+  std::unordered_map<std::wstring, Section> m_Sections;
+
+};
+
+} // namespace shared
+
+} // namespace usvfs
@@ -0,0 +1,102 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "interprocess_lock.h"
+#include "scopeguard.h"
+#include "windows_sane.h"
+#include <spdlog.h>
+
+namespace usvfs {
+
+namespace shared {
+
+static const int SPIN_COUNT = 200;
+static const DWORD WAIT_TIMEOUT_MS = 1000;
+
+static bool processAlive(DWORD pid)
+{
+  HANDLE process = ::OpenProcess(SYNCHRONIZE, FALSE, pid);
+  if (process == nullptr) {
+    // either gone or we can't tell, access denied means it's still there
+    return ::GetLastError() == ERROR_ACCESS_DENIED;
+  }
+  ON_BLOCK_EXIT([process]() { ::CloseHandle(process); });
+  return ::WaitForSingleObject(process, 0) == WAIT_TIMEOUT;
+}
+
+void InterprocessLock::lock(const char *name)
+{
+  int32_t expected = 0;
+  if (!m_State.compare_exchange_strong(expected, 1)) {
+    wait(name);
+  }
+  m_Owner.store(::GetCurrentProcessId());
+}
+
+void InterprocessLock::unlock(const char *name)
+{
+  m_Owner.store(0);
+  if (m_State.exchange(0) == 2) {
+    HANDLE event = ::OpenEventA(EVENT_MODIFY_STATE, FALSE, name);
+    if (event != nullptr) {
+      ::SetEvent(event);
+      ::CloseHandle(event);
+    }
+  }
+}
+
+void InterprocessLock::wait(const char *name)
+{
+  for (int i = 0; i < SPIN_COUNT; ++i) {
+    int32_t expected = 0;
+    if ((m_State.load(std::memory_order_relaxed) == 0)
+        && m_State.compare_exchange_weak(expected, 1)) {
+      return;
+    }
+    YieldProcessor();
+  }
+
+  // the event has to exist before the state announces a waiter, otherwise the
+  // owner might not find anything to signal
+  HANDLE event = ::CreateEventA(nullptr, FALSE, FALSE, name);
+  ON_BLOCK_EXIT([event]() {
+    if (event != nullptr) {
+      ::CloseHandle(event);
+    }
+  });
+
+  while (m_State.exchange(2) != 0) {
+    DWORD res = event != nullptr ? ::WaitForSingleObject(event, WAIT_TIMEOUT_MS)
+                                 : (::Sleep(1), WAIT_TIMEOUT);
+    if (res == WAIT_TIMEOUT) {
+      DWORD owner = m_Owner.load();
+      if ((owner != 0) && !processAlive(owner)) {
+        spdlog::get("usvfs")->error("process {} never released the lock {}", owner, name);
+        m_Owner.compare_exchange_strong(owner, 0);
+        int32_t expected = 2;
+        m_State.compare_exchange_strong(expected, 0);
+      }
+    }
+  }
+}
+
+} // namespace shared
+
+} // namespace usvfs
@@ -0,0 +1,60 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+namespace usvfs {
+
+namespace shared {
+
+/**
+ * mutex that can be placed in shared memory to synchronize processes. The
+ * uncontended case is a single interlocked operation, only waiters create a named
+ * event to sleep on. If the owning process dies without releasing the lock, waiters
+ * take it over after a timeout.
+ * All users of one lock have to pass the same name, which must be unique system-wide
+ * and mustn't collide with other named kernel objects.
+ * @note not recursive
+ */
+class InterprocessLock {
+public:
+  InterprocessLock() = default;
+
+  InterprocessLock(const InterprocessLock&) = delete;
+  InterprocessLock &operator=(const InterprocessLock&) = delete;
+
+  void lock(const char *name);
+  void unlock(const char *name);
+
+private:
+  void wait(const char *name);
+
+private:
+  // 0 = free, 1 = locked, 2 = locked with (possible) waiters
+  std::atomic<int32_t> m_State{0};
+  std::atomic<uint32_t> m_Owner{0};
+};
+
+} // namespace shared
+
+} // namespace usvfs
@@ -0,0 +1,235 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "layerindex.h"
+#include <algorithm>
+#include <unordered_set>
+#include "stringutils.h"
+
+namespace usvfs {
+
+namespace shared {
+
+bool LayerIndex::contains(uint32_t layer) const
+{
+  return m_Layers.find(layer) != m_Layers.end();
+}
+
+bool LayerIndex::addLayer(uint32_t layer, const std::wstring &source,
+                          const std::wstring &destination,
+                          const std::vector<Entry> &entries, std::vector<Change> &changes)
+{
+  if (contains(layer)) {
+    return false;
+  }
+
+  Layer &added = m_Layers[layer];
+  added.source = source;
+  added.destination = destination;
+  added.rank = static_cast<uint32_t>(m_Order.size());
+  added.keys.reserve(entries.size());
+  m_Order.push_back(layer);
+
+  size_t first = changes.size();
+  for (const Entry &entry : entries) {
+    std::wstring path = virtualPath(destination, entry.relativePath);
+    std::wstring key = to_upper(path);
+    auto iter = m_Paths.find(key);
+    if (iter == m_Paths.end()) {
+      Path newPath;
+      newPath.virtualPath = path;
+      newPath.hasWinner = false;
+      iter = m_Paths.emplace(key, std::move(newPath)).first;
+    } else if (std::any_of(iter->second.providers.begin(), iter->second.providers.end(),
+                           [layer](const Provider &provider) {
+                             return provider.layer == layer;
+                           })) {
+      // listed twice
+      continue;
+    }
+    iter->second.providers.push_back(Provider{ layer, entry.directory });
+    added.keys.push_back(key);
+    updateWinner(key, changes);
+  }
+  sortChanges(changes, first);
+  return true;
+}
+
+bool LayerIndex::removeLayer(uint32_t layer, std::vector<Change> &changes)
+{
+  auto removed = m_Layers.find(layer);
+  if (removed == m_Layers.end()) {
+    return false;
+  }
+
+  size_t first = changes.size();
+  for (const std::wstring &key : removed->second.keys) {
+    auto iter = m_Paths.find(key);
+    if (iter == m_Paths.end()) {
+      continue;
+    }
+    std::vector<Provider> &providers = iter->second.providers;
+    providers.erase(std::remove_if(providers.begin(), providers.end(),
+                                   [layer](const Provider &provider) {
+                                     return provider.layer == layer;
+                                   }),
+                    providers.end());
+    updateWinner(key, changes);
+  }
+
+  // the layers above move down one step, that doesn't change any winner
+  uint32_t rank = removed->second.rank;
+  m_Order.erase(m_Order.begin() + rank);
+  for (size_t i = rank; i < m_Order.size(); ++i) {
+    m_Layers[m_Order[i]].rank = static_cast<uint32_t>(i);
+  }
+  m_Layers.erase(removed);
+  sortChanges(changes, first);
+  return true;
+}
+
+bool LayerIndex::setOrder(const std::vector<uint32_t> &order, std::vector<Change> &changes)
+{
+  if (order.size() != m_Order.size()) {
+    return false;
+  }
+  std::unordered_set<uint32_t> listed;
+  for (uint32_t layer : order) {
+    if (!contains(layer) || !listed.insert(layer).second) {
+      return false;
+    }
+  }
+
+  // layers on a longest increasing run of their previous ranks keep their order
+  // relative to each other, a winner can only change where one of the other layers
+  // provides the path as well
+  size_t count = order.size();
+  std::vector<size_t> tails;        // index in order of the last layer of each run length
+  std::vector<size_t> previous(count, count);
+  for (size_t i = 0; i < count; ++i) {
+    uint32_t rank = m_Layers[order[i]].rank;
+    auto pos = std::lower_bound(tails.begin(), tails.end(), rank,
+                                [this, &order](size_t index, uint32_t value) {
+                                  return m_Layers[order[index]].rank < value;
+                                });
+    if (pos != tails.begin()) {
+      previous[i] = *(pos - 1);
+    }
+    if (pos == tails.end()) {
+      tails.push_back(i);
+    } else {
+      *pos = i;
+    }
+  }
+  std::vector<bool> kept(count, false);
+  for (size_t i = tails.empty() ? count : tails.back(); i != count; i = previous[i]) {
+    kept[i] = true;
+  }
+
+  m_Order = order;
+  for (size_t i = 0; i < count; ++i) {
+    m_Layers[order[i]].rank = static_cast<uint32_t>(i);
+  }
+
+  size_t first = changes.size();
+  for (size_t i = 0; i < count; ++i) {
+    if (!kept[i]) {
+      for (const std::wstring &key : m_Layers[order[i]].keys) {
+        updateWinner(key, changes);
+      }
+    }
+  }
+  sortChanges(changes, first);
+  return true;
+}
+
+void LayerIndex::clear()
+{
+  m_Order.clear();
+  m_Layers.clear();
+  m_Paths.clear();
+}
+
+void LayerIndex::updateWinner(const std::wstring &key, std::vector<Change> &changes)
+{
+  auto iter = m_Paths.find(key);
+  if (iter == m_Paths.end()) {
+    return;
+  }
+  Path &path = iter->second;
+
+  if (path.providers.empty()) {
+    if (path.hasWinner) {
+      changes.push_back(Change{ path.virtualPath, std::wstring(),
+                                targetOf(path, path.winner), path.winner.layer,
+                                path.winner.directory, false });
+    }
+    m_Paths.erase(iter);
+    return;
+  }
+
+  const Provider *best = nullptr;
+  uint32_t bestRank = 0;
+  for (const Provider &provider : path.providers) {
+    uint32_t rank = m_Layers.at(provider.layer).rank;
+    if ((best == nullptr) || (rank > bestRank)) {
+      best = &provider;
+      bestRank = rank;
+    }
+  }
+
+  if (!path.hasWinner || (path.winner.layer != best->layer)
+      || (path.winner.directory != best->directory)) {
+    changes.push_back(Change{ path.virtualPath, targetOf(path, *best),
+                              path.hasWinner ? targetOf(path, path.winner) : std::wstring(),
+                              best->layer, best->directory,
+                              path.hasWinner && (path.winner.directory != best->directory) });
+    path.winner = *best;
+    path.hasWinner = true;
+  }
+}
+
+std::wstring LayerIndex::targetOf(const Path &path, const Provider &provider) const
+{
+  // the relative part is spelled the way the first layer providing the path spelled
+  // it, which is fine for the case-insensitive file systems usvfs is used on
+  const Layer &layer = m_Layers.at(provider.layer);
+  return layer.source + path.virtualPath.substr(layer.destination.size());
+}
+
+std::wstring LayerIndex::virtualPath(const std::wstring &destination,
+                                     const std::wstring &relativePath)
+{
+  return relativePath.empty() ? destination : destination + L"\\" + relativePath;
+}
+
+void LayerIndex::sortChanges(std::vector<Change> &changes, size_t first)
+{
+  // parents are shorter than their children so they come first, that way directories
+  // exist before anything is added below them
+  std::stable_sort(changes.begin() + first, changes.end(),
+                   [](const Change &lhs, const Change &rhs) {
+                     return lhs.virtualPath.size() < rhs.virtualPath.size();
+                   });
+}
+
+} // namespace shared
+
+} // namespace usvfs
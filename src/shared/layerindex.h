@@ -0,0 +1,161 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace usvfs {
+
+namespace shared {
+
+/**
+ * @brief ordered layers of directories overlaid on virtual paths. For every virtual
+ *        path the layers providing it are kept along with the winner, the provider
+ *        of the layer with the highest priority. Adding, removing or reordering
+ *        layers reports the paths whose winner changed, so the redirection tree can
+ *        be updated without rebuilding it. The work done is proportional to the
+ *        number of entries in the layers involved, not to the size of the vfs
+ */
+class LayerIndex {
+public:
+
+  /**
+   * @brief an entry of a layer
+   */
+  struct Entry {
+    std::wstring relativePath; // relative to the destination of the layer, empty
+                               // for the destination itself
+    bool directory;
+  };
+
+  /**
+   * @brief a virtual path whose winner changed
+   */
+  struct Change {
+    std::wstring virtualPath;
+    std::wstring target;  // real path of the new winner, empty if no layer provides
+                          // the path anymore
+    std::wstring previousTarget; // real path of the previous winner, empty if the path
+                                 // is new
+    uint32_t layer;       // the layer of the new winner, of the previous one if no
+                          // layer provides the path anymore
+    bool directory;
+    bool kindChanged;     // the previous winner was a file and this is a directory or
+                          // the other way around
+  };
+
+  /**
+   * @return true if a layer with the id exists
+   */
+  bool contains(uint32_t layer) const;
+
+  /**
+   * @return ids of all layers, lowest priority first
+   */
+  const std::vector<uint32_t> &order() const { return m_Order; }
+
+  /**
+   * @return number of virtual paths provided by any layer
+   */
+  size_t numPaths() const { return m_Paths.size(); }
+
+  /**
+   * @brief add a layer with a higher priority than all existing ones
+   * @param source real directory of the layer, without trailing backslash
+   * @param destination virtual directory the layer is overlaid on, without trailing
+   *        backslash
+   * @param changes receives the paths the new layer wins
+   * @return false if a layer with the id exists already
+   */
+  bool addLayer(uint32_t layer, const std::wstring &source, const std::wstring &destination,
+                const std::vector<Entry> &entries, std::vector<Change> &changes);
+
+  /**
+   * @brief remove a layer
+   * @param changes receives the paths the layer won, with the provider taking over
+   *        or without target if there is none
+   * @return false if there is no layer with the id
+   */
+  bool removeLayer(uint32_t layer, std::vector<Change> &changes);
+
+  /**
+   * @brief change the priority of the layers
+   * @param order every existing layer exactly once, lowest priority first
+   * @param changes receives the paths whose winner changed
+   * @return false if the order doesn't list exactly the existing layers
+   */
+  bool setOrder(const std::vector<uint32_t> &order, std::vector<Change> &changes);
+
+  void clear();
+
+private:
+
+  struct Layer {
+    std::wstring source;
+    std::wstring destination;
+    uint32_t rank;
+    std::vector<std::wstring> keys; // folded virtual paths of all entries
+  };
+
+  struct Provider {
+    uint32_t layer;
+    bool directory;
+  };
+
+  struct Path {
+    std::wstring virtualPath;
+    // providers in the order they were added. Layers mostly provide disjoint files
+    // so this is short and the winner is simply searched for
+    std::vector<Provider> providers;
+    bool hasWinner;
+    Provider winner;
+  };
+
+  /**
+   * @brief determine the winner of a path again and report it if it changed. Paths
+   *        no layer provides anymore are removed
+   */
+  void updateWinner(const std::wstring &key, std::vector<Change> &changes);
+
+  std::wstring targetOf(const Path &path, const Provider &provider) const;
+
+  static std::wstring virtualPath(const std::wstring &destination,
+                                  const std::wstring &relativePath);
+
+  // sort the changes from first on so parents precede their children
+  static void sortChanges(std::vector<Change> &changes, size_t first);
+
+private:
+
+  // lowest priority first
+  std::vector<uint32_t> m_Order;
+  std::unordered_map<uint32_t, Layer> m_Layers;
+  // keyed by the folded virtual path
+  std::unordered_map<std::wstring, Path> m_Paths;
+
+};
+
+} // namespace shared
+
+} // namespace usvfs
@@ -155,6 +155,68 @@ std::ostream &usvfs::log::operator<<(std::ostream &os, const Wrap<std::wstring>
   return os;
 }
 
+std::atomic<bool> usvfs::log::detail::callLogging(false);
+
+void usvfs::log::updateCallLogging()
+{
+  std::shared_ptr<spdlog::logger> log = spdlog::get("hooks");
+  detail::callLogging.store((log.get() != nullptr) && log->should_log(spdlog::level::debug),
+                            std::memory_order_relaxed);
+}
+
+static std::atomic<uint32_t> callSampleInterval(0);
+static std::atomic<uint32_t> callRateLimit(0);
+static thread_local uint32_t skippedCalls = 0;
+
+void usvfs::log::setCallSampling(uint32_t sampleInterval, uint32_t rateLimit)
+{
+  callSampleInterval.store(sampleInterval, std::memory_order_relaxed);
+  callRateLimit.store(rateLimit, std::memory_order_relaxed);
+}
+
+uint32_t usvfs::log::detail::takeSkippedCalls()
+{
+  uint32_t result = skippedCalls;
+  skippedCalls = 0;
+  return result;
+}
+
+bool usvfs::log::CallSampler::accept(CallClass callClass)
+{
+  if (callClass != CallClass::Failed) {
+    if (callClass == CallClass::Passthrough) {
+      uint32_t interval = callSampleInterval.load(std::memory_order_relaxed);
+      if (interval == 0) {
+        // passthrough calls aren't logged at all, nothing to report
+        return false;
+      }
+      if (m_Passthroughs.fetch_add(1, std::memory_order_relaxed) % interval != 0) {
+        m_Skipped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+    }
+
+    uint32_t limit = callRateLimit.load(std::memory_order_relaxed);
+    if (limit != 0) {
+      // the windows are only approximate if several threads start a new second
+      // at the same time, that's good enough for what they are used for
+      Window &window = m_Windows[callClass == CallClass::Passthrough ? 0 : 1];
+      uint32_t now = ::GetTickCount() / 1000;
+      if (window.second.load(std::memory_order_relaxed) != now) {
+        window.second.store(now, std::memory_order_relaxed);
+        window.count.store(0, std::memory_order_relaxed);
+      }
+      if (window.count.fetch_add(1, std::memory_order_relaxed) >= limit) {
+        m_Skipped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+    }
+  }
+
+  skippedCalls = m_Skipped.exchange(0, std::memory_order_relaxed);
+  return true;
+}
+
 spdlog::level::level_enum usvfs::log::ConvertLogLevel(LogLevel level)
 {
   switch (level) {
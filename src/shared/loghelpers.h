@@ -24,7 +24,9 @@ along with usvfs. If not, see <http://www.gnu.org/licenses/>.
 #include "dllimport.h"
 #include <boost/current_function.hpp>
 #include <sstream>
+#include <atomic>
 #include "shmlogger.h"
+#include "logrecord.h"
 #include "stringutils.h"
 #include "ntdll_declarations.h"
 
@@ -45,6 +47,69 @@ enum class DisplayStyle : uint8_t {
 };
 
 
+namespace detail {
+extern std::atomic<bool> callLogging;
+}
+
+/**
+ * @return true if hook calls are logged, that is if the hooks logger accepts
+ *         debug messages
+ */
+inline bool callLoggingEnabled()
+{
+  return detail::callLogging.load(std::memory_order_relaxed);
+}
+
+/**
+ * @brief has to be called whenever the level of the hooks logger changes
+ */
+void updateCallLogging();
+
+/**
+ * @brief how a hooked call went, decides which of its log messages are sampled
+ */
+enum class CallClass : uint8_t {
+  Passthrough, // usvfs didn't change the call
+  Handled,     // the call was rerouted or otherwise changed by usvfs
+  Failed       // usvfs caused or changed an error, these are always logged
+};
+
+/**
+ * @brief configure sampling of hook call logs (see LOG_CALL_SAMPLED)
+ * @param sampleInterval log every n-th passthrough call of a hook. 0 means
+ *        passthrough calls aren't logged
+ * @param rateLimit maximum number of passthrough and of handled calls logged per
+ *        hook and second. 0 means no limit
+ */
+void setCallSampling(uint32_t sampleInterval, uint32_t rateLimit);
+
+/**
+ * @brief decides which calls of one hook are logged. Calls that aren't logged
+ *        are counted and reported with the next call that is
+ */
+class CallSampler {
+public:
+  bool accept(CallClass callClass);
+
+private:
+  struct Window {
+    std::atomic<uint32_t> second{0};
+    std::atomic<uint32_t> count{0};
+  };
+
+  std::atomic<uint32_t> m_Passthroughs{0};
+  std::atomic<uint32_t> m_Skipped{0};
+  Window m_Windows[2]; // passthrough and handled calls
+};
+
+namespace detail {
+/**
+ * @return the number of calls skipped before the last call a sampler accepted
+ *         on this thread. The count is reset
+ */
+uint32_t takeSkippedCalls();
+}
+
 class CallLoggerDummy {
 public:
   template <typename T>
@@ -54,26 +119,41 @@ public:
 class CallLogger {
 public:
   explicit CallLogger(const char *function)
+    : m_Record(m_Buffer, sizeof(m_Buffer), LogLevel::Debug, stripNamespace(function))
   {
-    const char *namespaceend = strrchr(function, ':');
-    if (namespaceend != nullptr) {
-      function = namespaceend + 1;
+    uint32_t skipped = detail::takeSkippedCalls();
+    if (skipped != 0) {
+      m_Record.addUnsigned("skipped", skipped, false);
     }
-    m_Message << function;
   }
   ~CallLogger()
   {
     try {
       static std::shared_ptr<spdlog::logger> log = spdlog::get("hooks");
-      log->debug("{}", m_Message.str());
+      if (SHMLogger::isInstantiated()) {
+        // the record is only formatted by whoever reads the queue
+        SHMLogger::instance().logRecord(m_Record.data(), m_Record.size());
+      } else {
+        char message[SHMLogger::MESSAGE_SIZE * 2];
+        formatRecord(m_Record.data(), m_Record.size(), message, sizeof(message), false);
+        log->debug("{}", message);
+      }
     } catch (...) {
       // suppress all exceptions in destructor
     }
   }
 
+  CallLogger(const CallLogger &reference) = delete;
+  CallLogger &operator=(const CallLogger &reference) = delete;
+
   template <typename T>
   CallLogger &addParam(const char *name, const T &value, uint8_t style = 0);
 private:
+  static const char *stripNamespace(const char *function) {
+    const char *namespaceend = strrchr(function, ':');
+    return namespaceend != nullptr ? namespaceend + 1 : function;
+  }
+
   template <typename T>
   void outputParam(std::ostream &stream, const T &value, std::false_type) {
     stream << value;
@@ -88,29 +168,17 @@ private:
     }
   }
 private:
-  std::ostringstream m_Message;
+  char m_Buffer[SHMLogger::MESSAGE_SIZE];
+  RecordWriter m_Record;
 };
 
+/**
+ * turns a CallLogger expression into void so LOG_CALL can skip it in a conditional
+ */
+struct CallLoggerVoidify {
+  void operator&(const CallLogger&) {}
+};
 
-template <typename T>
-CallLogger &CallLogger::addParam(const char *name, const T &value, uint8_t style)
-{
-  static bool enabled = spdlog::get("hooks")->should_log(spdlog::level::debug);
-  typedef std::underlying_type<DisplayStyle>::type DSType;
-  if (enabled) {
-    m_Message << " [" << name << "=";
-    if (style & static_cast<DSType>(DisplayStyle::Hex)) {
-      m_Message << std::hex;
-    } else {
-      m_Message << std::dec;
-    }
-
-    outputParam(m_Message, value, std::is_pointer<T>());
-
-    m_Message << "]";
-  }
-  return *this;
-}
 
 /**
  * a small helper class to wrap any object. The whole point is to give us a way
@@ -143,6 +211,149 @@ std::ostream &operator<<(std::ostream &os, const Wrap<NTSTATUS> &status);
 std::ostream &operator<<(std::ostream &os, const Wrap<DWORD> &value);
 
 
+namespace detail {
+
+/**
+ * writes parameters of the types hooks commonly log to a record as binary
+ * fields. write returns false for everything else, those parameters are
+ * formatted as text right away
+ */
+template <typename T, typename Enable = void>
+struct RecordField {
+  static bool write(RecordWriter&, const char*, const T&, bool) { return false; }
+};
+
+template <typename T>
+struct RecordField<T, typename std::enable_if<std::is_integral<T>::value
+                                              || std::is_enum<T>::value>::type> {
+  static bool write(RecordWriter &record, const char *name, const T &value, bool hex) {
+    typedef typename std::conditional<std::is_enum<T>::value, std::underlying_type<T>,
+                                      std::common_type<T>>::type::type IntT;
+    IntT intValue = static_cast<IntT>(value);
+    if (hex || !std::is_signed<IntT>::value) {
+      record.addUnsigned(name, static_cast<typename std::make_unsigned<IntT>::type>(intValue), hex);
+    } else {
+      record.addSigned(name, intValue);
+    }
+    return true;
+  }
+};
+
+template <>
+struct RecordField<bool> {
+  static bool write(RecordWriter &record, const char *name, bool value, bool) {
+    record.addUnsigned(name, value ? 1 : 0, false);
+    return true;
+  }
+};
+
+// handles and other untyped pointers. Typed pointers may have a stream operator
+// of their own so they are formatted as text
+struct PointerField {
+  static bool write(RecordWriter &record, const char *name, const void *value, bool) {
+    if (value == nullptr) {
+      record.addNull(name);
+    } else {
+      record.addPointer(name, value);
+    }
+    return true;
+  }
+};
+
+template <> struct RecordField<void*> : PointerField {};
+template <> struct RecordField<const void*> : PointerField {};
+
+template <typename CharT>
+struct StringField {
+  static bool write(RecordWriter &record, const char *name, const CharT *value, bool) {
+    if (value == nullptr) {
+      record.addNull(name);
+    } else {
+      add(record, name, value, std::char_traits<CharT>::length(value));
+    }
+    return true;
+  }
+
+  static void add(RecordWriter &record, const char *name, const char *value, size_t length) {
+    record.addNarrow(name, value, length);
+  }
+
+  static void add(RecordWriter &record, const char *name, const wchar_t *value, size_t length) {
+    record.addWide(name, value, length);
+  }
+};
+
+template <> struct RecordField<char*> : StringField<char> {};
+template <> struct RecordField<const char*> : StringField<char> {};
+template <> struct RecordField<wchar_t*> : StringField<wchar_t> {};
+template <> struct RecordField<const wchar_t*> : StringField<wchar_t> {};
+
+template <typename CharT>
+struct RecordField<std::basic_string<CharT>> {
+  static bool write(RecordWriter &record, const char *name,
+                    const std::basic_string<CharT> &value, bool) {
+    StringField<CharT>::add(record, name, value.c_str(), value.size());
+    return true;
+  }
+};
+
+template <typename T>
+struct RecordField<Wrap<T>> {
+  static bool write(RecordWriter &record, const char *name, const Wrap<T> &value, bool hex) {
+    return RecordField<T>::write(record, name, value.data(), hex);
+  }
+};
+
+template <>
+struct RecordField<Wrap<DWORD>> {
+  static bool write(RecordWriter &record, const char *name, const Wrap<DWORD> &value, bool) {
+    record.addUnsigned(name, value.data(), true);
+    return true;
+  }
+};
+
+template <>
+struct RecordField<Wrap<NTSTATUS>> {
+  static bool write(RecordWriter &record, const char *name, const Wrap<NTSTATUS> &value, bool) {
+    record.addStatus(name, static_cast<uint32_t>(value.data()));
+    return true;
+  }
+};
+
+template <>
+struct RecordField<Wrap<PUNICODE_STRING>> {
+  static bool write(RecordWriter &record, const char *name,
+                    const Wrap<PUNICODE_STRING> &value, bool) {
+    if (value.data() == nullptr) {
+      record.addNull(name);
+    } else {
+      record.addWide(name, value.data()->Buffer, value.data()->Length / sizeof(WCHAR));
+    }
+    return true;
+  }
+};
+
+} // namespace detail
+
+
+template <typename T>
+CallLogger &CallLogger::addParam(const char *name, const T &value, uint8_t style)
+{
+  typedef std::underlying_type<DisplayStyle>::type DSType;
+  bool hex = (style & static_cast<DSType>(DisplayStyle::Hex)) != 0;
+  if (!detail::RecordField<T>::write(m_Record, name, value, hex)) {
+    std::ostringstream stream;
+    if (hex) {
+      stream << std::hex;
+    }
+    outputParam(stream, value, std::is_pointer<T>());
+    std::string text = stream.str();
+    m_Record.addNarrow(name, text.c_str(), text.size());
+  }
+  return *this;
+}
+
+
 spdlog::level::level_enum ConvertLogLevel(LogLevel level);
 LogLevel ConvertLogLevel(spdlog::level::level_enum level);
 
@@ -159,9 +370,23 @@ LogLevel ConvertLogLevel(spdlog::level::level_enum level);
 #define __MYFUNC__ BOOST_CURRENT_FUNCTION
 #endif
 
-#define LOG_CALL() usvfs::log::CallLogger(__MYFUNC__)
+// when call logging is disabled neither the logger is constructed nor are the
+// parameters evaluated
+#define LOG_CALL() \
+  !usvfs::log::callLoggingEnabled() ? (void)0 \
+    : usvfs::log::CallLoggerVoidify() & usvfs::log::CallLogger(__MYFUNC__)
 //#define LOG_CALL() usvfs::log::CallLoggerDummy()
 
+// like LOG_CALL but subject to sampling and rate limits. Every use has a sampler
+// of its own
+#define LOG_CALL_SAMPLED(callClass) \
+  (!usvfs::log::callLoggingEnabled() \
+   || !([]() -> usvfs::log::CallSampler & { \
+          static usvfs::log::CallSampler sampler; \
+          return sampler; \
+        }()).accept(callClass)) ? (void)0 \
+    : usvfs::log::CallLoggerVoidify() & usvfs::log::CallLogger(__MYFUNC__)
+
 #define PARAM(val) addParam(#val, val)
 #define PARAMHEX(val) addParam(#val, val, static_cast<uint8_t>(usvfs::log::DisplayStyle::Hex))
 #define PARAMWRAP(val) addParam(#val, usvfs::log::wrap(val))
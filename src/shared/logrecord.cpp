@@ -0,0 +1,355 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "logrecord.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+namespace usvfs {
+
+namespace log {
+
+// record:  marker, level, pid (4), tid (4), time (8, FILETIME utc),
+//          function name length (1), function name
+// field:   type (1), name length (1), payload length (2), name, payload
+// All numbers are little endian and unaligned
+
+static const size_t FIELD_HEADER_SIZE = 4;
+
+RecordWriter::RecordWriter(char *buffer, size_t bufferSize, LogLevel level,
+                           const char *function)
+  : m_Buffer(buffer), m_Capacity(bufferSize), m_Size(0)
+{
+  uint8_t header[2] = { static_cast<uint8_t>(MARKER), static_cast<uint8_t>(level) };
+  uint32_t pid = ::GetCurrentProcessId();
+  uint32_t tid = ::GetCurrentThreadId();
+  FILETIME now;
+  ::GetSystemTimeAsFileTime(&now);
+  uint64_t time = (static_cast<uint64_t>(now.dwHighDateTime) << 32) | now.dwLowDateTime;
+  uint8_t functionLength = static_cast<uint8_t>(std::min<size_t>(strlen(function), 64));
+
+  write(header, sizeof(header));
+  write(&pid, sizeof(pid));
+  write(&tid, sizeof(tid));
+  write(&time, sizeof(time));
+  write(&functionLength, sizeof(functionLength));
+  write(function, functionLength);
+}
+
+void RecordWriter::write(const void *data, size_t size)
+{
+  size = std::min(size, m_Capacity - m_Size);
+  memcpy(m_Buffer + m_Size, data, size);
+  m_Size += size;
+}
+
+uint8_t *RecordWriter::beginField(FieldType type, const char *name,
+                                  size_t payloadSize, size_t &available)
+{
+  size_t nameLength = std::min<size_t>(strlen(name), 64);
+  if (m_Size + FIELD_HEADER_SIZE + nameLength > m_Capacity) {
+    return nullptr;
+  }
+  available = std::min<size_t>(payloadSize, m_Capacity - m_Size - FIELD_HEADER_SIZE - nameLength);
+  uint8_t *field = reinterpret_cast<uint8_t*>(m_Buffer + m_Size);
+  field[0] = static_cast<uint8_t>(type);
+  field[1] = static_cast<uint8_t>(nameLength);
+  uint16_t length = static_cast<uint16_t>(available);
+  memcpy(field + 2, &length, sizeof(length));
+  memcpy(field + FIELD_HEADER_SIZE, name, nameLength);
+  m_Size += FIELD_HEADER_SIZE + nameLength;
+  return field;
+}
+
+void RecordWriter::addSigned(const char *name, int64_t value)
+{
+  size_t available;
+  if ((beginField(FieldType::Signed, name, sizeof(value), available) != nullptr)
+      && (available == sizeof(value))) {
+    write(&value, sizeof(value));
+  }
+}
+
+void RecordWriter::addUnsigned(const char *name, uint64_t value, bool hex)
+{
+  size_t available;
+  if ((beginField(hex ? FieldType::Hex : FieldType::Unsigned, name, sizeof(value), available) != nullptr)
+      && (available == sizeof(value))) {
+    write(&value, sizeof(value));
+  }
+}
+
+void RecordWriter::addPointer(const char *name, const void *value)
+{
+  // the payload length tells the reader whether this was a 32- or 64-bit pointer
+  size_t available;
+  if ((beginField(FieldType::Pointer, name, sizeof(value), available) != nullptr)
+      && (available == sizeof(value))) {
+    write(&value, sizeof(value));
+  }
+}
+
+void RecordWriter::addStatus(const char *name, uint32_t status)
+{
+  size_t available;
+  if ((beginField(FieldType::Status, name, sizeof(status), available) != nullptr)
+      && (available == sizeof(status))) {
+    write(&status, sizeof(status));
+  }
+}
+
+void RecordWriter::addNull(const char *name)
+{
+  size_t available;
+  beginField(FieldType::Null, name, 0, available);
+}
+
+void RecordWriter::addNarrow(const char *name, const char *value, size_t length)
+{
+  size_t available;
+  uint8_t *field = beginField(FieldType::Narrow, name, length, available);
+  if (field != nullptr) {
+    if (available < length) {
+      field[0] |= TRUNCATED;
+    }
+    write(value, available);
+  }
+}
+
+void RecordWriter::addWide(const char *name, const wchar_t *value, size_t length)
+{
+  // most paths are pure ascii, those are stored as narrow strings which halves
+  // their size and saves the reader the conversion
+  const wchar_t *end = value + length;
+  if (std::find_if(value, end, [](wchar_t ch) { return ch >= 0x80; }) == end) {
+    size_t available;
+    uint8_t *field = beginField(FieldType::Narrow, name, length, available);
+    if (field != nullptr) {
+      if (available < length) {
+        field[0] |= TRUNCATED;
+      }
+      char *out = m_Buffer + m_Size;
+      for (size_t i = 0; i < available; ++i) {
+        out[i] = static_cast<char>(value[i]);
+      }
+      m_Size += available;
+    }
+  } else {
+    size_t available;
+    uint8_t *field = beginField(FieldType::Wide, name, length * sizeof(wchar_t), available);
+    if (field != nullptr) {
+      if (available < length * sizeof(wchar_t)) {
+        field[0] |= TRUNCATED;
+        // don't cut a character in half
+        available &= ~static_cast<size_t>(1);
+        uint16_t shortened = static_cast<uint16_t>(available);
+        memcpy(field + 2, &shortened, sizeof(shortened));
+      }
+      write(value, available);
+    }
+  }
+}
+
+
+namespace {
+
+class TextBuffer {
+public:
+  TextBuffer(char *buffer, size_t size) : m_Buffer(buffer), m_Capacity(size), m_Size(0)
+  {
+    m_Buffer[0] = '\0';
+  }
+
+  void append(const char *text, size_t length)
+  {
+    length = std::min(length, m_Capacity - m_Size - 1);
+    memcpy(m_Buffer + m_Size, text, length);
+    m_Size += length;
+    m_Buffer[m_Size] = '\0';
+  }
+
+  void append(const char *text) { append(text, strlen(text)); }
+
+  template <typename... Args>
+  void appendf(const char *format, Args... args)
+  {
+    char temp[64];
+    int length = _snprintf_s(temp, sizeof(temp), _TRUNCATE, format, args...);
+    append(temp, length < 0 ? strlen(temp) : static_cast<size_t>(length));
+  }
+
+  void appendWide(const wchar_t *text, size_t length)
+  {
+    if ((length == 0) || (m_Size + 1 >= m_Capacity)) {
+      return;
+    }
+    int written = ::WideCharToMultiByte(CP_UTF8, 0, text, static_cast<int>(length),
+                                        m_Buffer + m_Size,
+                                        static_cast<int>(m_Capacity - m_Size - 1),
+                                        nullptr, nullptr);
+    if (written == 0) {
+      // doesn't fit, convert into a temporary and cut that
+      char temp[1024];
+      written = ::WideCharToMultiByte(CP_UTF8, 0, text, static_cast<int>(length),
+                                      temp, sizeof(temp), nullptr, nullptr);
+      append(temp, static_cast<size_t>(written));
+    } else {
+      m_Size += written;
+      m_Buffer[m_Size] = '\0';
+    }
+  }
+
+  size_t size() const { return m_Size; }
+
+private:
+  char *m_Buffer;
+  size_t m_Capacity;
+  size_t m_Size;
+};
+
+const char *levelName(uint8_t level)
+{
+  switch (static_cast<LogLevel>(level)) {
+    case LogLevel::Debug: return "D";
+    case LogLevel::Info: return "I";
+    case LogLevel::Warning: return "W";
+    case LogLevel::Error: return "E";
+    default: return "?";
+  }
+}
+
+void formatStatus(TextBuffer &text, uint32_t status)
+{
+  switch (status) {
+    case 0x00000000: text.append("ok"); break;
+    case 0xC0000022: text.append("access denied"); break;
+    case 0xC0000035: text.append("exists already"); break;
+    default: text.appendf("err %x", status); break;
+  }
+}
+
+template <typename T>
+T readValue(const uint8_t *data)
+{
+  T result;
+  memcpy(&result, data, sizeof(T));
+  return result;
+}
+
+}
+
+size_t formatRecord(const char *record, size_t recordSize, char *buffer,
+                    size_t bufferSize, bool withPrefix)
+{
+  if (bufferSize == 0) {
+    return 0;
+  }
+  TextBuffer text(buffer, bufferSize);
+
+  const uint8_t *pos = reinterpret_cast<const uint8_t*>(record);
+  const uint8_t *end = pos + recordSize;
+  static const size_t HEADER_SIZE = 2 + 4 + 4 + 8 + 1;
+  if (!isRecord(record, recordSize) || (recordSize < HEADER_SIZE)) {
+    text.append("invalid log record");
+    return text.size();
+  }
+
+  if (withPrefix) {
+    FILETIME utc, local;
+    uint64_t time = readValue<uint64_t>(pos + 10);
+    utc.dwLowDateTime  = static_cast<DWORD>(time);
+    utc.dwHighDateTime = static_cast<DWORD>(time >> 32);
+    SYSTEMTIME st;
+    if (!::FileTimeToLocalFileTime(&utc, &local) || !::FileTimeToSystemTime(&local, &st)) {
+      memset(&st, 0, sizeof(st));
+    }
+    text.appendf("%02u:%02u:%02u.%03u ", st.wHour, st.wMinute, st.wSecond, st.wMilliseconds);
+    text.appendf("<%u:%u> ", readValue<uint32_t>(pos + 2), readValue<uint32_t>(pos + 6));
+    text.appendf("[%s] ", levelName(pos[1]));
+  }
+
+  size_t functionLength = std::min<size_t>(pos[18], end - pos - HEADER_SIZE);
+  text.append(reinterpret_cast<const char*>(pos + HEADER_SIZE), functionLength);
+  pos += HEADER_SIZE + functionLength;
+
+  while (end - pos >= static_cast<ptrdiff_t>(FIELD_HEADER_SIZE)) {
+    uint8_t type        = pos[0];
+    size_t nameLength   = pos[1];
+    size_t payloadSize  = readValue<uint16_t>(pos + 2);
+    const uint8_t *name = pos + FIELD_HEADER_SIZE;
+    if (static_cast<size_t>(end - name) < nameLength + payloadSize) {
+      break;
+    }
+    const uint8_t *payload = name + nameLength;
+    pos = payload + payloadSize;
+
+    text.append(" [");
+    text.append(reinterpret_cast<const char*>(name), nameLength);
+    text.append("=");
+    switch (static_cast<RecordWriter::FieldType>(type & ~RecordWriter::TRUNCATED)) {
+      case RecordWriter::FieldType::Signed: {
+        text.appendf("%lld", readValue<int64_t>(payload));
+      } break;
+      case RecordWriter::FieldType::Unsigned: {
+        text.appendf("%llu", readValue<uint64_t>(payload));
+      } break;
+      case RecordWriter::FieldType::Hex: {
+        text.appendf("%llx", readValue<uint64_t>(payload));
+      } break;
+      case RecordWriter::FieldType::Pointer: {
+        if (payloadSize == sizeof(uint32_t)) {
+          text.appendf("%08X", readValue<uint32_t>(payload));
+        } else {
+          text.appendf("%016llX", readValue<uint64_t>(payload));
+        }
+      } break;
+      case RecordWriter::FieldType::Status: {
+        formatStatus(text, readValue<uint32_t>(payload));
+      } break;
+      case RecordWriter::FieldType::Null: {
+        text.append("<null>");
+      } break;
+      case RecordWriter::FieldType::Narrow: {
+        text.append(reinterpret_cast<const char*>(payload), payloadSize);
+      } break;
+      case RecordWriter::FieldType::Wide: {
+        // the payload isn't necessarily aligned
+        wchar_t temp[MAX_PATH];
+        size_t count = std::min<size_t>(payloadSize / sizeof(wchar_t), MAX_PATH);
+        memcpy(temp, payload, count * sizeof(wchar_t));
+        text.appendWide(temp, count);
+      } break;
+      default: {
+        text.append("?");
+      } break;
+    }
+    if ((type & RecordWriter::TRUNCATED) != 0) {
+      text.append("...");
+    }
+    text.append("]");
+  }
+
+  return text.size();
+}
+
+} // namespace log
+
+} // namespace usvfs
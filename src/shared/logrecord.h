@@ -0,0 +1,102 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include "logging.h"
+#include <cstddef>
+#include <cstdint>
+
+namespace usvfs {
+
+namespace log {
+
+/**
+ * @brief writer for binary call records. Hooks send these through the log queue
+ *        instead of formatted text so the hooked process doesn't have to convert
+ *        and format anything, the reader of the queue turns them into text
+ *        (see formatRecord)
+ * @note the layout doesn't depend on the architecture, a 64-bit reader has to
+ *       understand the records of 32-bit processes
+ */
+class RecordWriter {
+public:
+  /// first byte of every record. Formatted text messages never start with it
+  static const char MARKER = '\x1e';
+
+  enum class FieldType : uint8_t {
+    Signed,
+    Unsigned,
+    Hex,
+    Pointer,
+    Status,
+    Null,
+    Narrow,
+    Wide,
+  };
+
+  /// set on string fields that didn't fit into the record
+  static const uint8_t TRUNCATED = 0x80;
+
+public:
+  RecordWriter(char *buffer, size_t bufferSize, LogLevel level, const char *function);
+
+  void addSigned(const char *name, int64_t value);
+  void addUnsigned(const char *name, uint64_t value, bool hex);
+  void addPointer(const char *name, const void *value);
+  void addStatus(const char *name, uint32_t status);
+  void addNull(const char *name);
+  void addNarrow(const char *name, const char *value, size_t length);
+  void addWide(const char *name, const wchar_t *value, size_t length);
+
+  const char *data() const { return m_Buffer; }
+  size_t size() const { return m_Size; }
+
+private:
+  uint8_t *beginField(FieldType type, const char *name, size_t payloadSize,
+                      size_t &available);
+  void write(const void *data, size_t size);
+
+private:
+  char *m_Buffer;
+  size_t m_Capacity;
+  size_t m_Size;
+};
+
+/**
+ * @return true if the message received from the log queue is a binary record
+ */
+inline bool isRecord(const char *message, size_t size)
+{
+  return (size > 0) && (message[0] == RecordWriter::MARKER);
+}
+
+/**
+ * @brief format a binary record the way the hooks logger formats text messages
+ * @param withPrefix if true the record is preceded by its time, process id,
+ *        thread id and level like the pattern of the hooks logger
+ * @return length of the text written to buffer, not counting the terminating zero
+ */
+size_t formatRecord(const char *record, size_t recordSize, char *buffer,
+                    size_t bufferSize, bool withPrefix = true);
+
+} // namespace log
+
+} // namespace usvfs
@@ -0,0 +1,261 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "logring.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace bi = boost::interprocess;
+
+namespace usvfs {
+
+namespace shared {
+
+static size_t ringSize()
+{
+  return 4096 + LogRing::SLOT_COUNT * (LogRing::SLOT_SIZE + 8);
+}
+
+static bi::windows_shared_memory openMemory(const std::string &name, bool create)
+{
+  if (create) {
+    try {
+      return bi::windows_shared_memory(bi::create_only, name.c_str(), bi::read_write,
+                                       ringSize());
+    } catch (const bi::interprocess_exception&) {
+      // another owner created it already, share theirs
+    }
+  }
+  return bi::windows_shared_memory(bi::open_only, name.c_str(), bi::read_write);
+}
+
+static bool processEnded(uint32_t processId)
+{
+  HANDLE process = ::OpenProcess(SYNCHRONIZE, FALSE, processId);
+  if (process == nullptr) {
+    // no access means it's still running
+    return ::GetLastError() == ERROR_INVALID_PARAMETER;
+  }
+  bool ended = ::WaitForSingleObject(process, 0) != WAIT_TIMEOUT;
+  ::CloseHandle(process);
+  return ended;
+}
+
+LogRing::LogRing(const std::string &name, bool create)
+  : m_Memory(openMemory(name, create))
+  , m_Region(m_Memory, bi::read_write)
+  , m_Producer(static_cast<int>(PRODUCER_COUNT))
+  , m_StalePosition(0)
+  , m_StaleSince(0)
+{
+  static_assert(sizeof(Header) < 4096, "header doesn't fit in front of the slots");
+  static_assert((SLOT_COUNT & (SLOT_COUNT - 1)) == 0, "slot count has to be a power of 2");
+
+  m_Header = static_cast<Header*>(m_Region.get_address());
+  m_Slots  = reinterpret_cast<Slot*>(static_cast<char*>(m_Region.get_address()) + 4096);
+  if (m_Header->magic == 0) {
+    if (!create) {
+      throw std::runtime_error("log ring not initialized");
+    }
+    initialize();
+  } else if ((m_Header->magic != MAGIC) || (m_Header->slotCount != SLOT_COUNT)
+             || (m_Header->slotSize != SLOT_SIZE)
+             || (m_Header->producerCount != PRODUCER_COUNT)) {
+    throw std::runtime_error("incompatible log ring");
+  }
+  m_Producer = claimProducer();
+}
+
+void LogRing::initialize()
+{
+  // fresh pages are zeroed so there is nothing else to reset
+  for (uint32_t i = 0; i < SLOT_COUNT; ++i) {
+    m_Slots[i].sequence.store(i, std::memory_order_relaxed);
+  }
+  m_Header->slotCount     = SLOT_COUNT;
+  m_Header->slotSize      = SLOT_SIZE;
+  m_Header->producerCount = PRODUCER_COUNT;
+  std::atomic_thread_fence(std::memory_order_release);
+  m_Header->magic = MAGIC;
+}
+
+LogRing::Slot &LogRing::slot(uint32_t position) const
+{
+  return m_Slots[position & (SLOT_COUNT - 1)];
+}
+
+bool LogRing::push(const char *message, size_t size, unsigned int timeoutMS)
+{
+  ULONGLONG deadline = 0;
+  uint32_t position = m_Header->head.load(std::memory_order_relaxed);
+  for (;;) {
+    Slot &target = slot(position);
+    uint32_t sequence = target.sequence.load(std::memory_order_acquire);
+    int32_t diff = static_cast<int32_t>(sequence - position);
+    if (diff == 0) {
+      if (m_Header->head.compare_exchange_weak(position, position + 1,
+                                               std::memory_order_relaxed)) {
+        target.size = static_cast<uint32_t>(std::min<size_t>(size, SLOT_SIZE));
+        memcpy(target.data, message, target.size);
+        // fails only if the consumer gave up on this slot because we took too long
+        uint32_t claimed = position;
+        if (target.sequence.compare_exchange_strong(claimed, position + 1,
+                                                    std::memory_order_release)) {
+          return true;
+        }
+        break;
+      }
+      // position was updated by the failed exchange
+    } else if (diff < 0) {
+      // the consumer hasn't read this slot yet, the ring is full
+      if (timeoutMS == 0) {
+        break;
+      }
+      ULONGLONG now = ::GetTickCount64();
+      if (deadline == 0) {
+        deadline = now + timeoutMS;
+      } else if (now >= deadline) {
+        break;
+      }
+      ::Sleep(1);
+      position = m_Header->head.load(std::memory_order_relaxed);
+    } else {
+      // another producer claimed the slot in between
+      position = m_Header->head.load(std::memory_order_relaxed);
+    }
+  }
+
+  countDropped();
+  return false;
+}
+
+bool LogRing::pop(char *buffer, size_t &size)
+{
+  uint32_t position = m_Header->tail.load(std::memory_order_relaxed);
+  for (;;) {
+    Slot &source = slot(position);
+    uint32_t sequence = source.sequence.load(std::memory_order_acquire);
+    int32_t diff = static_cast<int32_t>(sequence - (position + 1));
+    if (diff == 0) {
+      if (m_Header->tail.compare_exchange_weak(position, position + 1,
+                                               std::memory_order_relaxed)) {
+        size = std::min<size_t>(source.size, SLOT_SIZE);
+        memcpy(buffer, source.data, size);
+        source.sequence.store(position + SLOT_COUNT, std::memory_order_release);
+        return true;
+      }
+    } else if (diff < 0) {
+      // empty, unless a producer claimed the slot and never published it
+      if (m_Header->head.load(std::memory_order_relaxed) == position) {
+        m_StaleSince = 0;
+        return false;
+      }
+      ULONGLONG now = ::GetTickCount64();
+      if ((m_StaleSince == 0) || (m_StalePosition != position)) {
+        m_StalePosition = position;
+        m_StaleSince = now;
+        return false;
+      }
+      if (now - m_StaleSince < STALE_SLOT_TIMEOUT) {
+        return false;
+      }
+      // the producer most likely died. If it's merely slow its publish fails and it
+      // counts the message as dropped itself
+      uint32_t claimed = position;
+      if (source.sequence.compare_exchange_strong(claimed, position + SLOT_COUNT,
+                                                  std::memory_order_release)) {
+        m_Header->tail.compare_exchange_strong(position, position + 1,
+                                               std::memory_order_relaxed);
+        m_Header->otherDropped.fetch_add(1, std::memory_order_relaxed);
+      }
+      m_StaleSince = 0;
+      position = m_Header->tail.load(std::memory_order_relaxed);
+    } else {
+      position = m_Header->tail.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+int LogRing::claimProducer()
+{
+  uint32_t processId = ::GetCurrentProcessId();
+  for (uint32_t i = 0; i < PRODUCER_COUNT; ++i) {
+    uint32_t owner = m_Header->producers[i].processId.load(std::memory_order_relaxed);
+    if (owner == processId) {
+      return static_cast<int>(i);
+    } else if (owner == 0) {
+      uint32_t expected = 0;
+      if (m_Header->producers[i].processId.compare_exchange_strong(expected, processId)
+          || (expected == processId)) {
+        return static_cast<int>(i);
+      }
+    }
+  }
+
+  // the table is full, take over the counter of a process that ended. What it
+  // dropped and the consumer didn't report yet is kept without the process id
+  for (uint32_t i = 0; i < PRODUCER_COUNT; ++i) {
+    DropCounter &counter = m_Header->producers[i];
+    uint32_t owner = counter.processId.load(std::memory_order_relaxed);
+    if ((owner != 0) && processEnded(owner)
+        && counter.processId.compare_exchange_strong(owner, processId)) {
+      uint32_t dropped = counter.dropped.exchange(0, std::memory_order_relaxed);
+      if (dropped != 0) {
+        m_Header->otherDropped.fetch_add(dropped, std::memory_order_relaxed);
+      }
+      return static_cast<int>(i);
+    }
+  }
+  return static_cast<int>(PRODUCER_COUNT);
+}
+
+void LogRing::countDropped()
+{
+  if (m_Producer < static_cast<int>(PRODUCER_COUNT)) {
+    m_Header->producers[m_Producer].dropped.fetch_add(1, std::memory_order_relaxed);
+  } else {
+    m_Header->otherDropped.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+bool LogRing::takeDropped(uint32_t &processId, uint32_t &count)
+{
+  for (uint32_t i = 0; i < PRODUCER_COUNT; ++i) {
+    DropCounter &counter = m_Header->producers[i];
+    if (counter.dropped.load(std::memory_order_relaxed) != 0) {
+      processId = counter.processId.load(std::memory_order_relaxed);
+      count     = counter.dropped.exchange(0, std::memory_order_relaxed);
+      if (count != 0) {
+        return true;
+      }
+    }
+  }
+  if (m_Header->otherDropped.load(std::memory_order_relaxed) != 0) {
+    processId = 0;
+    count     = m_Header->otherDropped.exchange(0, std::memory_order_relaxed);
+    return count != 0;
+  }
+  return false;
+}
+
+} // namespace shared
+
+} // namespace usvfs
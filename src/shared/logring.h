@@ -0,0 +1,139 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include "windows_sane.h"
+#include <boost/interprocess/windows_shared_memory.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+namespace usvfs {
+
+namespace shared {
+
+/**
+ * @brief lock-free ring of fixed size message slots in shared memory. Any number
+ *        of processes write to it, usually one reads from it.
+ *        Every slot carries a sequence number that tells producers and the consumer
+ *        whose turn it is, so neither side ever takes a lock. Producers that find
+ *        the ring full count the message as dropped in a counter of their own which
+ *        the consumer reports (see takeDropped). Counters of processes that ended
+ *        are taken over by new producers once the table is full.
+ *        A producer that dies after claiming a slot but before publishing it would
+ *        stall the consumer at that slot, so the consumer skips slots that stay
+ *        unpublished for STALE_SLOT_TIMEOUT and counts them as dropped
+ * @note all of the layout is fixed-width, 32-bit and 64-bit processes share the ring
+ */
+class LogRing {
+public:
+  static const uint32_t SLOT_COUNT = 1024;
+  static const uint32_t SLOT_SIZE  = 512;
+  static const uint32_t PRODUCER_COUNT = 64;
+  // time in milliseconds a claimed slot may stay unpublished before the consumer
+  // skips it
+  static const uint32_t STALE_SLOT_TIMEOUT = 10000;
+
+public:
+  /**
+   * @param create if true the ring is created (or reused if it exists already),
+   *        otherwise an existing ring is opened
+   */
+  LogRing(const std::string &name, bool create);
+
+  LogRing(const LogRing &reference) = delete;
+  LogRing &operator=(const LogRing &reference) = delete;
+
+  /**
+   * @brief queue a message, messages longer than SLOT_SIZE are cut off
+   * @param timeoutMS how long to wait for the consumer to make room if the ring
+   *        is full. 0 means the message is dropped right away
+   * @return true if the message was queued, false if it was dropped
+   */
+  bool push(const char *message, size_t size, unsigned int timeoutMS = 0);
+
+  /**
+   * @brief take the oldest message from the ring
+   * @param buffer receives the message, has to be at least SLOT_SIZE bytes
+   * @return true if a message was available
+   * @note not thread-safe with respect to other pop calls on the same object
+   */
+  bool pop(char *buffer, size_t &size);
+
+  /**
+   * @brief take the drop counter of one process that dropped messages. The
+   *        counter is reset
+   * @return true if there was a process with dropped messages
+   */
+  bool takeDropped(uint32_t &processId, uint32_t &count);
+
+private:
+  struct Slot {
+    std::atomic<uint32_t> sequence;
+    uint32_t size;
+    char data[SLOT_SIZE];
+  };
+
+  struct DropCounter {
+    std::atomic<uint32_t> processId;
+    std::atomic<uint32_t> dropped;
+  };
+
+  struct Header {
+    uint32_t magic;
+    uint32_t slotCount;
+    uint32_t slotSize;
+    uint32_t producerCount;
+    // producers and the consumer write to these all the time, keep them on
+    // separate cache lines
+    alignas(64) std::atomic<uint32_t> head;
+    alignas(64) std::atomic<uint32_t> tail;
+    alignas(64) std::atomic<uint32_t> otherDropped;
+    DropCounter producers[PRODUCER_COUNT];
+  };
+
+  static const uint32_t MAGIC = 0x55534c52; // USLR
+
+private:
+  void initialize();
+  Slot &slot(uint32_t position) const;
+  // find the drop counter of this process, claiming a free one or one of a process
+  // that ended
+  int claimProducer();
+  void countDropped();
+
+private:
+  boost::interprocess::windows_shared_memory m_Memory;
+  boost::interprocess::mapped_region m_Region;
+  Header *m_Header;
+  Slot *m_Slots;
+  // the drop counter of this process, PRODUCER_COUNT if the table is full. Claimed
+  // in the constructor and not changed afterwards so logging threads only read it
+  int m_Producer;
+  // unpublished slot the consumer is waiting on and since when
+  uint32_t m_StalePosition;
+  ULONGLONG m_StaleSince;
+};
+
+} // namespace shared
+
+} // namespace usvfs
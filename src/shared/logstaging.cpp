@@ -0,0 +1,175 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "logstaging.h"
+#include <algorithm>
+#include <cstring>
+
+namespace usvfs {
+
+namespace shared {
+
+namespace {
+
+std::atomic<uint32_t> stagingGeneration(0);
+
+// the buffer of the current thread. Holding a reference here releases the
+// buffer when the thread ends, the flush thread frees it once it's drained
+template <typename BufferT>
+struct LocalBuffer {
+  uint32_t generation{0};
+  std::shared_ptr<BufferT> buffer;
+};
+
+}
+
+LogStaging::LogStaging(LogRing &ring, unsigned int intervalMS)
+  : m_Ring(ring)
+  , m_IntervalMS(intervalMS)
+  , m_Generation(stagingGeneration.fetch_add(1) + 1)
+{
+}
+
+LogStaging::~LogStaging()
+{
+  stop();
+}
+
+void LogStaging::start()
+{
+  std::lock_guard<std::mutex> lock(m_StopMutex);
+  if (!m_Thread.joinable()) {
+    m_Stop   = false;
+    m_Thread = std::thread([this]() { run(); });
+    m_Active.store(true, std::memory_order_release);
+  }
+}
+
+void LogStaging::stop()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_StopMutex);
+    if (!m_Thread.joinable()) {
+      return;
+    }
+    m_Active.store(false, std::memory_order_seq_cst);
+    m_Stop = true;
+  }
+  m_StopCondition.notify_all();
+  m_Thread.join();
+  flush();
+}
+
+std::shared_ptr<LogStaging::ThreadBuffer> LogStaging::threadBuffer()
+{
+  thread_local LocalBuffer<ThreadBuffer> local;
+  if (local.generation != m_Generation) {
+    local.buffer = std::make_shared<ThreadBuffer>();
+    local.generation = m_Generation;
+    std::lock_guard<std::mutex> lock(m_BuffersMutex);
+    m_Buffers.push_back(local.buffer);
+  }
+  return local.buffer;
+}
+
+void LogStaging::stage(const char *message, size_t size, unsigned int timeoutMS)
+{
+  if (!m_Active.load(std::memory_order_acquire)) {
+    m_Ring.push(message, size, timeoutMS);
+    return;
+  }
+
+  std::shared_ptr<ThreadBuffer> buffer = threadBuffer();
+  uint32_t head = buffer->head.load(std::memory_order_relaxed);
+  if (head - buffer->tail.load(std::memory_order_acquire) >= THREAD_BUFFER_SIZE) {
+    // the flush thread is behind. Pushing this message directly would overtake
+    // the staged ones so make room instead
+    std::lock_guard<std::mutex> lock(m_FlushMutex);
+    drainBuffer(*buffer);
+  }
+
+  Entry &entry = buffer->entries[head % THREAD_BUFFER_SIZE];
+  entry.size      = static_cast<uint32_t>(std::min<size_t>(size, LogRing::SLOT_SIZE));
+  entry.timeoutMS = timeoutMS;
+  memcpy(entry.data, message, entry.size);
+  buffer->head.store(head + 1, std::memory_order_seq_cst);
+
+  // stop() may have done its final flush since staging was tested above. Either
+  // that flush saw the message or this sees staging ended and flushes it
+  if (!m_Active.load(std::memory_order_seq_cst)) {
+    flush();
+  }
+}
+
+void LogStaging::flush()
+{
+  std::lock_guard<std::mutex> lock(m_FlushMutex);
+  flushBuffers();
+}
+
+void LogStaging::flushBuffers()
+{
+  std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+  {
+    std::lock_guard<std::mutex> lock(m_BuffersMutex);
+    buffers = m_Buffers;
+  }
+
+  for (const std::shared_ptr<ThreadBuffer> &buffer : buffers) {
+    drainBuffer(*buffer);
+  }
+  buffers.clear();
+
+  // buffers of threads that ended are only referenced from here now
+  std::lock_guard<std::mutex> lock(m_BuffersMutex);
+  m_Buffers.erase(std::remove_if(m_Buffers.begin(), m_Buffers.end(),
+                                 [](const std::shared_ptr<ThreadBuffer> &buffer) {
+                                   return (buffer.use_count() == 1)
+                                       && (buffer->head.load(std::memory_order_acquire)
+                                           == buffer->tail.load(std::memory_order_relaxed));
+                                 }),
+                  m_Buffers.end());
+}
+
+void LogStaging::drainBuffer(ThreadBuffer &buffer)
+{
+  uint32_t tail = buffer.tail.load(std::memory_order_relaxed);
+  uint32_t head = buffer.head.load(std::memory_order_seq_cst);
+  for (; tail != head; ++tail) {
+    const Entry &entry = buffer.entries[tail % THREAD_BUFFER_SIZE];
+    m_Ring.push(entry.data, entry.size, entry.timeoutMS);
+    buffer.tail.store(tail + 1, std::memory_order_release);
+  }
+}
+
+void LogStaging::run()
+{
+  std::unique_lock<std::mutex> lock(m_StopMutex);
+  while (!m_Stop) {
+    m_StopCondition.wait_for(lock, std::chrono::milliseconds(m_IntervalMS));
+    lock.unlock();
+    flush();
+    lock.lock();
+  }
+}
+
+} // namespace shared
+
+} // namespace usvfs
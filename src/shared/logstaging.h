@@ -0,0 +1,123 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include "logring.h"
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace usvfs {
+
+namespace shared {
+
+/**
+ * @brief stages log messages in a small buffer per thread and moves them to the
+ *        log ring on a background thread. The thread that logs only copies the
+ *        message, waiting for room in the ring (warnings and errors) is left
+ *        to the flush thread so a reader that can't keep up doesn't slow down the
+ *        calls being logged until the buffer of the thread is full
+ */
+class LogStaging {
+public:
+  static const uint32_t THREAD_BUFFER_SIZE = 32;
+
+public:
+  /**
+   * @param ring the ring messages are flushed to, has to outlive the staging
+   * @param intervalMS how often staged messages are flushed
+   */
+  LogStaging(LogRing &ring, unsigned int intervalMS = 20);
+
+  ~LogStaging();
+
+  LogStaging(const LogStaging &reference) = delete;
+  LogStaging &operator=(const LogStaging &reference) = delete;
+
+  /**
+   * @brief start the flush thread. Until then messages go to the ring directly
+   */
+  void start();
+
+  /**
+   * @brief stop the flush thread and flush everything still staged. Messages
+   *        logged afterwards go to the ring directly again
+   */
+  void stop();
+
+  /**
+   * @brief stage a message for the ring. If the buffer of the calling thread is
+   *        full the calling thread flushes it first so messages stay in order
+   * @param timeoutMS how long to wait for room in the ring. While staging is
+   *        active only the flush thread waits, unless the buffer was full
+   */
+  void stage(const char *message, size_t size, unsigned int timeoutMS);
+
+  /**
+   * @brief move all staged messages to the ring now
+   */
+  void flush();
+
+private:
+  struct Entry {
+    uint32_t size;
+    uint32_t timeoutMS;
+    char data[LogRing::SLOT_SIZE];
+  };
+
+  // single producer (the owning thread), single consumer (whoever holds m_FlushMutex)
+  struct ThreadBuffer {
+    std::atomic<uint32_t> head{0};
+    std::atomic<uint32_t> tail{0};
+    Entry entries[THREAD_BUFFER_SIZE];
+  };
+
+private:
+  std::shared_ptr<ThreadBuffer> threadBuffer();
+  void run();
+  void flushBuffers();
+  // move the messages of one buffer to the ring, m_FlushMutex has to be held
+  void drainBuffer(ThreadBuffer &buffer);
+
+private:
+  LogRing &m_Ring;
+  unsigned int m_IntervalMS;
+  // identifies this staging in the thread-local buffer cache
+  uint32_t m_Generation;
+
+  std::mutex m_BuffersMutex;
+  std::vector<std::shared_ptr<ThreadBuffer>> m_Buffers;
+
+  std::mutex m_FlushMutex;
+
+  std::atomic<bool> m_Active{false};
+  std::mutex m_StopMutex;
+  std::condition_variable m_StopCondition;
+  bool m_Stop{false};
+  std::thread m_Thread;
+};
+
+} // namespace shared
+
+} // namespace usvfs
@@ -27,6 +27,7 @@ NtQueryDirectoryFile_type NtQueryDirectoryFile;
 NtQueryDirectoryFileEx_type NtQueryDirectoryFileEx;
 NtQueryFullAttributesFile_type NtQueryFullAttributesFile;
 NtQueryAttributesFile_type NtQueryAttributesFile;
+NtQueryInformationByName_type NtQueryInformationByName;
 NtOpenFile_type NtOpenFile;
 NtCreateFile_type NtCreateFile;
 NtClose_type NtClose;
@@ -46,6 +47,9 @@ void ntdll_declarations_init() {
     LOAD_EXT(ntDLLMod, NtQueryDirectoryFileEx);
     LOAD_EXT(ntDLLMod, NtQueryFullAttributesFile);
     LOAD_EXT(ntDLLMod, NtQueryAttributesFile);
+    // not exported by older windows versions
+    NtQueryInformationByName = reinterpret_cast<NtQueryInformationByName_type>(
+        ::GetProcAddress(ntDLLMod, "NtQueryInformationByName"));
     LOAD_EXT(ntDLLMod, NtCreateFile);
     LOAD_EXT(ntDLLMod, NtOpenFile);
     LOAD_EXT(ntDLLMod, NtClose);
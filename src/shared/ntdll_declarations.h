@@ -294,6 +294,10 @@ typedef NTSTATUS(WINAPI *NtQueryFullAttributesFile_type)(
 typedef NTSTATUS(WINAPI *NtQueryAttributesFile_type)(POBJECT_ATTRIBUTES,
                                                      PFILE_BASIC_INFORMATION);
 
+// single call stat, windows 10 1709 and later
+typedef NTSTATUS(WINAPI *NtQueryInformationByName_type)(
+    POBJECT_ATTRIBUTES, PIO_STATUS_BLOCK, PVOID, ULONG, FILE_INFORMATION_CLASS);
+
 typedef NTSTATUS(WINAPI *NtOpenFile_type)(PHANDLE, ACCESS_MASK,
                                           POBJECT_ATTRIBUTES, PIO_STATUS_BLOCK,
                                           ULONG, ULONG);
@@ -321,6 +325,7 @@ extern NtQueryDirectoryFile_type NtQueryDirectoryFile;
 extern NtQueryDirectoryFileEx_type NtQueryDirectoryFileEx;
 extern NtQueryFullAttributesFile_type NtQueryFullAttributesFile;
 extern NtQueryAttributesFile_type NtQueryAttributesFile;
+extern NtQueryInformationByName_type NtQueryInformationByName; // null if not available
 extern NtOpenFile_type NtOpenFile;
 extern NtCreateFile_type NtCreateFile;
 extern NtClose_type NtClose;
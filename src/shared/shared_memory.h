@@ -68,5 +68,9 @@ typedef VoidAllocatorT::rebind<char>::other CharAllocatorT;
 
 typedef bi::basic_string<char, std::char_traits<char>, CharAllocatorT> StringT;
 
+typedef VoidAllocatorT::rebind<wchar_t>::other WCharAllocatorT;
+
+typedef bi::basic_string<wchar_t, std::char_traits<wchar_t>, WCharAllocatorT> WStringT;
+
 }
 }
@@ -22,12 +22,13 @@ along with usvfs. If not, see <http://www.gnu.org/licenses/>.
 #pragma warning(disable : 4503)
 #pragma warning(push, 3)
 #include "shmlogger.h"
-#include <boost/interprocess/ipc/message_queue.hpp>
+#include "logrecord.h"
 #include <boost/format.hpp>
 #include <boost/algorithm/string.hpp>
 #include <boost/filesystem/operations.hpp>
 #include <limits>
 #include <algorithm>
+#include <vector>
 #include <ShlObj.h>
 #include <comutil.h>
 #pragma warning(pop)
@@ -45,8 +46,8 @@ SHMLogger::client_t SHMLogger::client;
 
 SHMLogger::SHMLogger(owner_t, const std::string &queueName)
   : m_QueueName(queueName)
-  , m_LogQueue(create_only, queueName.c_str(), MESSAGE_COUNT, MESSAGE_SIZE)
-  , m_DroppedMessages(0)
+  , m_LogRing(queueName, true)
+  , m_Staging(m_LogRing)
 {
   if (s_Instance != nullptr) {
     throw std::runtime_error("duplicate shm logger instantiation");
@@ -57,8 +58,8 @@ SHMLogger::SHMLogger(owner_t, const std::string &queueName)
 
 SHMLogger::SHMLogger(client_t, const std::string &queueName)
   : m_QueueName(queueName)
-  , m_LogQueue(open_only, queueName.c_str())
-  , m_DroppedMessages(0)
+  , m_LogRing(queueName, false)
+  , m_Staging(m_LogRing)
 {
   if (s_Instance != nullptr) {
     throw std::runtime_error("duplicate shm logger instantiation");
@@ -70,7 +71,6 @@ SHMLogger::SHMLogger(client_t, const std::string &queueName)
 SHMLogger::~SHMLogger()
 {
   s_Instance = nullptr;
-  message_queue_interop::remove(m_QueueName.c_str());
 }
 
 SHMLogger &SHMLogger::create(const char *instanceName)
@@ -78,9 +78,7 @@ SHMLogger &SHMLogger::create(const char *instanceName)
   if (s_Instance != nullptr) {
     throw std::runtime_error("duplicate shm logger instantiation");
   } else {
-    std::string queueName = std::string("__shm_sink_") + instanceName;
-    message_queue::remove(queueName.c_str());
-    new SHMLogger(owner, queueName);
+    new SHMLogger(owner, std::string("__shm_sink_") + instanceName);
     atexit([]() { delete s_Instance; });
   }
   return *s_Instance;
@@ -96,6 +94,31 @@ SHMLogger &SHMLogger::open(const char *instanceName)
   return *s_Instance;
 }
 
+SHMLogger &SHMLogger::rename(const char *instanceName)
+{
+  std::string queueName = std::string("__shm_sink_") + instanceName;
+  if (s_Instance == nullptr) {
+    return create(instanceName);
+  } else if (s_Instance->m_QueueName == queueName) {
+    return *s_Instance;
+  }
+
+  std::vector<std::string> pending;
+  char message[MESSAGE_SIZE];
+  size_t size;
+  while (s_Instance->m_LogRing.pop(message, size)) {
+    pending.push_back(std::string(message, size));
+  }
+
+  // the atexit handler registered by create deletes whichever instance exists then
+  delete s_Instance;
+  new SHMLogger(owner, queueName);
+  for (const std::string &msg : pending) {
+    s_Instance->m_LogRing.push(msg.c_str(), msg.size());
+  }
+  return *s_Instance;
+}
+
 void SHMLogger::free()
 {
   if (s_Instance != nullptr) {
@@ -105,29 +128,89 @@ void SHMLogger::free()
   }
 }
 
+void SHMLogger::logRecord(const char *record, size_t size)
+{
+  m_Staging.stage(record, size, 0);
+}
+
+void SHMLogger::send(const char *message, size_t size, unsigned int timeoutMS)
+{
+  m_Staging.stage(message, size, timeoutMS);
+}
+
+void SHMLogger::startStaging()
+{
+  m_Staging.start();
+}
+
+void SHMLogger::stopStaging()
+{
+  m_Staging.stop();
+}
+
+void SHMLogger::convertMessage(const char *message, size_t messageSize,
+                               char *buffer, size_t bufferSize)
+{
+  if (usvfs::log::isRecord(message, messageSize)) {
+    usvfs::log::formatRecord(message, messageSize, buffer, bufferSize);
+  } else {
+    size_t length = std::min(bufferSize - 1, messageSize);
+    memcpy(buffer, message, length);
+    buffer[length] = '\0';
+  }
+}
+
 bool SHMLogger::tryGet(char *buffer, size_t bufferSize)
 {
-  message_queue_interop::size_type receivedSize;
-  unsigned int prio;
-  bool res = m_LogQueue.try_receive(
-      buffer, static_cast<unsigned int>(bufferSize), receivedSize, prio);
+  uint32_t processId, dropped;
+  if (m_LogRing.takeDropped(processId, dropped)) {
+    _snprintf_s(buffer, bufferSize, _TRUNCATE,
+                "%u messages dropped by process %u", dropped, processId);
+    return true;
+  }
+
+  char message[MESSAGE_SIZE];
+  size_t receivedSize;
+  bool res = m_LogRing.pop(message, receivedSize);
   if (res) {
-    buffer[std::min(bufferSize - 1, static_cast<size_t>(receivedSize))] = '\0';
+    convertMessage(message, receivedSize, buffer, bufferSize);
   }
   return res;
 }
 
 void SHMLogger::get(char *buffer, size_t bufferSize)
 {
-  message_queue_interop::size_type receivedSize;
-  unsigned int prio;
-  m_LogQueue.receive(buffer, static_cast<unsigned int>(bufferSize),
-                     receivedSize, prio);
-  buffer[std::min(bufferSize - 1, static_cast<size_t>(receivedSize))] = '\0';
+  while (!tryGet(buffer, bufferSize)) {
+    ::Sleep(1);
+  }
+}
+
+size_t SHMLogger::getBatch(char *buffer, size_t bufferSize, bool blocking)
+{
+  // a formatted record can be up to about twice as long as the record
+  static const size_t MAX_TEXT_SIZE = 2 * MESSAGE_SIZE;
+
+  size_t count = 0;
+  size_t offset = 0;
+  for (;;) {
+    while ((bufferSize - offset > MAX_TEXT_SIZE)
+           && tryGet(buffer + offset, MAX_TEXT_SIZE)) {
+      offset += strlen(buffer + offset) + 1;
+      ++count;
+    }
+    if ((count > 0) || !blocking || (bufferSize <= MAX_TEXT_SIZE)) {
+      break;
+    }
+    ::Sleep(1);
+  }
+  if (offset < bufferSize) {
+    buffer[offset] = '\0';
+  }
+  return count;
 }
 
 spdlog::sinks::shm_sink::shm_sink(const char *queueName)
-  : m_LogQueue(open_only, (std::string("__shm_sink_") + queueName).c_str()), m_DroppedMessages(0)
+  : m_LogRing(std::string("__shm_sink_") + queueName, false)
 {
 }
 
@@ -137,16 +220,6 @@ void spdlog::sinks::shm_sink::flush()
 
 void spdlog::sinks::shm_sink::log(const details::log_msg &msg)
 {
-  int droppedMessages = m_DroppedMessages.load(std::memory_order_relaxed);
-  if (droppedMessages > 0) {
-    std::string dropMessage
-        = fmt::format("{} debug messages dropped", droppedMessages);
-    if (m_LogQueue.try_send(dropMessage.c_str(),
-                            static_cast<unsigned int>(dropMessage.size()), 0)) {
-      m_DroppedMessages.store(0, std::memory_order_relaxed);
-    }
-  }
-
   std::string message = msg.formatted.str();
 
   if (message.length() > SHMLogger::MESSAGE_SIZE) {
@@ -164,37 +237,34 @@ void spdlog::sinks::shm_sink::log(const details::log_msg &msg)
 void spdlog::sinks::shm_sink::output(level::level_enum lev,
                                      const std::string &message)
 {
-  bool sent = true;
-
   // spdlog auto-append line breaks which we don't need. Probably would be
   // better to not write the breaks to begin with?
   size_t count = std::min(message.find_last_not_of("\r\n") + 1,
-                          static_cast<size_t>(m_LogQueue.get_max_msg_size()));
+                          static_cast<size_t>(SHMLogger::MESSAGE_SIZE));
 
   // depending on the log level, drop less important messages if the receiver
-  // can't keep up
+  // can't keep up. Dropped messages are counted by the ring
+  unsigned int timeoutMS;
   switch (lev) {
     case level::trace:
     case level::debug:
     case level::info: {
-      // m_LogQueue.send(message.c_str(), count, 0);
-      sent = m_LogQueue.try_send(message.c_str(),
-                                 static_cast<unsigned int>(count), 0);
+      timeoutMS = 0;
     } break;
     case level::err:
     case level::critical: {
-      m_LogQueue.send(message.c_str(), static_cast<unsigned int>(count), 0);
+      timeoutMS = 2000;
     } break;
     default: {
-      boost::posix_time::ptime time = microsec_clock::universal_time()
-                                      + boost::posix_time::milliseconds(200);
-      sent = m_LogQueue.timed_send(message.c_str(),
-                                   static_cast<unsigned int>(count), 0, time);
+      timeoutMS = 200;
     } break;
   }
 
-  if (!sent) {
-    m_DroppedMessages.fetch_add(1, std::memory_order_relaxed);
+  if (SHMLogger::isInstantiated()) {
+    // goes through the staging of this process if there is one
+    SHMLogger::instance().send(message.c_str(), count, timeoutMS);
+  } else {
+    m_LogRing.push(message.c_str(), count, timeoutMS);
   }
 }
 
@@ -23,21 +23,18 @@ along with usvfs. If not, see <http://www.gnu.org/licenses/>.
 #include "logging.h"
 #include "windows_sane.h"
 #include "shared_memory.h"
-#include <boost/interprocess/ipc/message_queue.hpp>
+#include "logring.h"
+#include "logstaging.h"
 #include <boost/format.hpp>
 #include <atomic>
 #include <spdlog.h>
 #include <fmt/ostr.h>
 #include <cstdint>
 
-typedef boost::interprocess::message_queue_t<usvfs::shared::VoidPointerT> message_queue_interop;
-
 namespace spdlog {
 namespace sinks {
 class shm_sink : public sink {
-  message_queue_interop m_LogQueue;
-
-  std::atomic<int> m_DroppedMessages;
+  usvfs::shared::LogRing m_LogRing;
 
 public:
   shm_sink(const char *queueName);
@@ -52,14 +49,21 @@ public:
 class SHMLogger {
 
 public:
-  static const size_t MESSAGE_COUNT = 1024;
-  static const size_t MESSAGE_SIZE  = 512;
+  static const size_t MESSAGE_COUNT = usvfs::shared::LogRing::SLOT_COUNT;
+  static const size_t MESSAGE_SIZE  = usvfs::shared::LogRing::SLOT_SIZE;
 
 public:
   static SHMLogger &create(const char *instanceName);
   static SHMLogger &open(const char *instanceName);
   static void free();
 
+  /**
+   * @brief move the queue created by this process to a different name. Messages
+   *        nobody retrieved yet are carried over
+   * @note the shm_sinks writing to the old queue have to be replaced by the caller
+   */
+  static SHMLogger &rename(const char *instanceName);
+
   static bool isInstantiated() {
     return s_Instance != nullptr;
   }
@@ -73,9 +77,43 @@ public:
 
   void log(LogLevel logLevel, const std::string &message);
 
+  /**
+   * @brief send a binary call record (see usvfs::log::RecordWriter). Like debug
+   *        text messages records are dropped if the reader can't keep up
+   */
+  void logRecord(const char *record, size_t size);
+
+  /**
+   * @brief send a formatted message
+   * @param timeoutMS how long to wait for the reader to make room
+   */
+  void send(const char *message, size_t size, unsigned int timeoutMS);
+
+  /**
+   * @brief from here on messages are staged per thread and moved to the queue
+   *        on a background thread (see usvfs::shared::LogStaging)
+   */
+  void startStaging();
+
+  /**
+   * @brief flush staged messages and stop the background thread
+   */
+  void stopStaging();
+
   bool tryGet(char *buffer, size_t bufferSize);
   void get(char *buffer, size_t bufferSize);
 
+  /**
+   * @brief retrieve as many messages as fit into buffer, each terminated by a zero
+   * @param blocking if true, wait until there is at least one message
+   * @return the number of messages written to buffer
+   */
+  size_t getBatch(char *buffer, size_t bufferSize, bool blocking);
+
+private:
+  void convertMessage(const char *message, size_t messageSize, char *buffer,
+                      size_t bufferSize);
+
 private:
   static struct owner_t {
   } owner;
@@ -95,11 +133,10 @@ private:
 private:
   static SHMLogger *s_Instance;
 
-  message_queue_interop m_LogQueue;
-
   std::string m_SHMName;
   std::string m_LockName;
   std::string m_QueueName;
 
-  std::atomic<int> m_DroppedMessages;
+  usvfs::shared::LogRing m_LogRing;
+  usvfs::shared::LogStaging m_Staging;
 };
@@ -28,6 +28,12 @@ along with usvfs. If not, see <http://www.gnu.org/licenses/>.
 #include "windows_sane.h"
 #include "windows_error.h"
 
+#if defined(_M_IX86) || defined(_M_X64)
+#define USVFS_FOLD_SSE2
+#include <emmintrin.h>
+#include <intrin.h>
+#endif
+
 #pragma warning ( disable : 4996 )
 
 void usvfs::shared::strncpy_sz(char *dest, const char *src, size_t destSize)
@@ -130,8 +136,242 @@ std::string usvfs::shared::to_hex(void *bufferIn, size_t bufferSize)
 std::wstring usvfs::shared::to_upper(const std::wstring &input) {
   std::wstring result;
   result.resize(input.size());
-  ::LCMapStringW(LOCALE_INVARIANT, LCMAP_UPPERCASE, input.c_str(),
-                 static_cast<int>(input.size()), &result[0],
-                 static_cast<int>(result.size()));
+  if (!input.empty()) {
+    foldCase(input.c_str(), input.size(), &result[0]);
+  }
   return result;
 }
+
+namespace {
+
+const uint32_t FNV_OFFSET = 2166136261U;
+const uint32_t FNV_PRIME  = 16777619U;
+
+// names are folded in chunks of this size where a temporary copy is needed
+const size_t FOLD_CHUNK = 64;
+
+inline int lowerChar(char ch)
+{
+  unsigned char value = static_cast<unsigned char>(ch);
+  return ((value >= 'A') && (value <= 'Z')) ? value + ('a' - 'A') : value;
+}
+
+// upper-case with the invariant locale. This may be called in-place, LCMapStringEx
+// doesn't support that so the result goes through a stack buffer
+void foldUnicode(const wchar_t *input, size_t length, wchar_t *output)
+{
+  wchar_t buffer[FOLD_CHUNK];
+  while (length > 0) {
+    int chunk = static_cast<int>(length < FOLD_CHUNK ? length : FOLD_CHUNK);
+    if (::LCMapStringEx(LOCALE_NAME_INVARIANT, LCMAP_UPPERCASE, input, chunk,
+                        buffer, chunk, nullptr, nullptr, 0) == chunk) {
+      memcpy(output, buffer, chunk * sizeof(wchar_t));
+    } else {
+      // the mapping would change the length, which never happens for the
+      // characters valid in file names. Fold only the ascii part then
+      for (int i = 0; i < chunk; ++i) {
+        output[i] = input[i] < 0x80 ? usvfs::shared::foldChar(input[i]) : input[i];
+      }
+    }
+    input  += chunk;
+    output += chunk;
+    length -= chunk;
+  }
+}
+
+#ifdef USVFS_FOLD_SSE2
+
+inline __m128i load(const void *address)
+{
+  return _mm_loadu_si128(static_cast<const __m128i*>(address));
+}
+
+inline bool allSet(__m128i mask)
+{
+  return _mm_movemask_epi8(mask) == 0xFFFF;
+}
+
+// upper-case the ascii letters in 16 bytes. Bytes above 0x7f compare as negative
+// so utf-8 sequences are left alone
+inline __m128i foldBytes(__m128i block)
+{
+  __m128i isLower = _mm_and_si128(_mm_cmpgt_epi8(block, _mm_set1_epi8('a' - 1)),
+                                  _mm_cmplt_epi8(block, _mm_set1_epi8('z' + 1)));
+  return _mm_sub_epi8(block, _mm_and_si128(isLower, _mm_set1_epi8('a' - 'A')));
+}
+
+inline __m128i lowerBytes(__m128i block)
+{
+  __m128i isUpper = _mm_and_si128(_mm_cmpgt_epi8(block, _mm_set1_epi8('A' - 1)),
+                                  _mm_cmplt_epi8(block, _mm_set1_epi8('Z' + 1)));
+  return _mm_add_epi8(block, _mm_and_si128(isUpper, _mm_set1_epi8('a' - 'A')));
+}
+
+// true if all 8 wide characters are ascii
+inline bool isAscii(__m128i block)
+{
+  return allSet(_mm_cmpeq_epi16(_mm_and_si128(block, _mm_set1_epi16(static_cast<short>(0xFF80))),
+                                _mm_setzero_si128()));
+}
+
+// upper-case 8 wide characters, only valid if isAscii is true for the block
+inline __m128i foldWide(__m128i block)
+{
+  __m128i isLower = _mm_and_si128(_mm_cmpgt_epi16(block, _mm_set1_epi16(L'a' - 1)),
+                                  _mm_cmplt_epi16(block, _mm_set1_epi16(L'z' + 1)));
+  return _mm_sub_epi16(block, _mm_and_si128(isLower, _mm_set1_epi16(L'a' - L'A')));
+}
+
+#endif // USVFS_FOLD_SSE2
+
+} // namespace
+
+wchar_t usvfs::shared::foldCharUnicode(wchar_t ch)
+{
+  wchar_t result;
+  if (::LCMapStringEx(LOCALE_NAME_INVARIANT, LCMAP_UPPERCASE, &ch, 1, &result, 1,
+                      nullptr, nullptr, 0) != 1) {
+    return ch;
+  }
+  return result;
+}
+
+void usvfs::shared::foldCase(const char *input, size_t length, char *output)
+{
+  size_t i = 0;
+#ifdef USVFS_FOLD_SSE2
+  for (; i + 16 <= length; i += 16) {
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(output + i), foldBytes(load(input + i)));
+  }
+#endif
+  for (; i < length; ++i) {
+    output[i] = foldChar(input[i]);
+  }
+}
+
+void usvfs::shared::foldCase(const wchar_t *input, size_t length, wchar_t *output)
+{
+  size_t i = 0;
+#ifdef USVFS_FOLD_SSE2
+  for (; i + 8 <= length; i += 8) {
+    __m128i block = load(input + i);
+    if (!isAscii(block)) {
+      break;
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(output + i), foldWide(block));
+  }
+#endif
+  for (; (i < length) && (input[i] < 0x80); ++i) {
+    output[i] = foldChar(input[i]);
+  }
+  if (i < length) {
+    foldUnicode(input + i, length - i, output + i);
+  }
+}
+
+uint32_t usvfs::shared::foldedHash(const char *name, size_t length)
+{
+  char buffer[FOLD_CHUNK];
+  uint32_t hash = FNV_OFFSET;
+  while (length > 0) {
+    size_t chunk = length < FOLD_CHUNK ? length : FOLD_CHUNK;
+    foldCase(name, chunk, buffer);
+    for (size_t i = 0; i < chunk; ++i) {
+      hash = (hash ^ static_cast<unsigned char>(buffer[i])) * FNV_PRIME;
+    }
+    name   += chunk;
+    length -= chunk;
+  }
+  return hash;
+}
+
+uint32_t usvfs::shared::foldedHash(const wchar_t *name, size_t length)
+{
+  wchar_t buffer[FOLD_CHUNK];
+  uint32_t hash = FNV_OFFSET;
+  while (length > 0) {
+    size_t chunk = length < FOLD_CHUNK ? length : FOLD_CHUNK;
+    foldCase(name, chunk, buffer);
+    for (size_t i = 0; i < chunk; ++i) {
+      hash = (hash ^ static_cast<uint32_t>(buffer[i])) * FNV_PRIME;
+    }
+    name   += chunk;
+    length -= chunk;
+  }
+  return hash;
+}
+
+bool usvfs::shared::foldedEquals(const char *lhs, const char *rhs, size_t length)
+{
+  size_t i = 0;
+#ifdef USVFS_FOLD_SSE2
+  for (; i + 16 <= length; i += 16) {
+    __m128i left  = load(lhs + i);
+    __m128i right = load(rhs + i);
+    if (!allSet(_mm_cmpeq_epi8(left, right))
+        && !allSet(_mm_cmpeq_epi8(foldBytes(left), foldBytes(right)))) {
+      return false;
+    }
+  }
+#endif
+  for (; i < length; ++i) {
+    if ((lhs[i] != rhs[i]) && (foldChar(lhs[i]) != foldChar(rhs[i]))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool usvfs::shared::foldedEquals(const wchar_t *lhs, const wchar_t *rhs, size_t length)
+{
+  size_t i = 0;
+#ifdef USVFS_FOLD_SSE2
+  for (; i + 8 <= length; i += 8) {
+    __m128i left  = load(lhs + i);
+    __m128i right = load(rhs + i);
+    if (allSet(_mm_cmpeq_epi16(left, right))) {
+      continue;
+    }
+    if (!isAscii(_mm_or_si128(left, right))) {
+      // compare the rest character by character
+      break;
+    }
+    if (!allSet(_mm_cmpeq_epi16(foldWide(left), foldWide(right)))) {
+      return false;
+    }
+  }
+#endif
+  for (; i < length; ++i) {
+    if ((lhs[i] != rhs[i]) && (foldChar(lhs[i]) != foldChar(rhs[i]))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int usvfs::shared::foldedCompare(const char *lhs, size_t lhsLength,
+                                 const char *rhs, size_t rhsLength)
+{
+  size_t length = lhsLength < rhsLength ? lhsLength : rhsLength;
+  size_t i = 0;
+#ifdef USVFS_FOLD_SSE2
+  for (; i + 16 <= length; i += 16) {
+    int equal = _mm_movemask_epi8(
+        _mm_cmpeq_epi8(lowerBytes(load(lhs + i)), lowerBytes(load(rhs + i))));
+    if (equal != 0xFFFF) {
+      // continue below at the first difference
+      unsigned long index;
+      _BitScanForward(&index, static_cast<unsigned long>(~equal & 0xFFFF));
+      i += index;
+      break;
+    }
+  }
+#endif
+  for (; i < length; ++i) {
+    int diff = lowerChar(lhs[i]) - lowerChar(rhs[i]);
+    if (diff != 0) {
+      return diff;
+    }
+  }
+  return lhsLength < rhsLength ? -1 : (lhsLength > rhsLength ? 1 : 0);
+}
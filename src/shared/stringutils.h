@@ -22,6 +22,7 @@ along with usvfs. If not, see <http://www.gnu.org/licenses/>.
 
 #include <string>
 #include <ios>
+#include <cstdint>
 
 #if 1
 #include <boost/filesystem.hpp>
@@ -53,6 +54,60 @@ std::string to_hex(void *bufferIn, size_t bufferSize);
 ///
 std::wstring to_upper(const std::wstring &input);
 
+// Case folding for comparing names the way the file system does. All folding,
+// hashing and comparing of names has to go through these functions so the tree,
+// the trackers and the directory listings agree on what is the same name.
+// Ascii is handled inline and in vector registers, everything else is upper-cased
+// locale invariant
+
+/**
+ * @brief upper-case a non-ascii character (locale invariant)
+ */
+wchar_t foldCharUnicode(wchar_t ch);
+
+/**
+ * @brief ascii upper-case a single character. This folds the same characters
+ *        _stricmp does in the "C" locale. Utf-8 sequences are left alone
+ */
+inline char foldChar(char ch)
+{
+  return ((ch >= 'a') && (ch <= 'z')) ? static_cast<char>(ch - ('a' - 'A')) : ch;
+}
+
+inline wchar_t foldChar(wchar_t ch)
+{
+  if (ch < 0x80)
+    return ((ch >= L'a') && (ch <= L'z')) ? static_cast<wchar_t>(ch - (L'a' - L'A')) : ch;
+  return foldCharUnicode(ch);
+}
+
+/**
+ * @brief write the folded version of a name to output, which has to have room for
+ *        length characters. input and output may be the same buffer
+ */
+void foldCase(const char *input, size_t length, char *output);
+void foldCase(const wchar_t *input, size_t length, wchar_t *output);
+
+/**
+ * @brief FNV-1a hash over the folded name
+ * @note this is deliberately 32 bits wide on all architectures since 32-bit and
+ *       64-bit processes share the same tree and have to agree on hash buckets
+ */
+uint32_t foldedHash(const char *name, size_t length);
+uint32_t foldedHash(const wchar_t *name, size_t length);
+
+/**
+ * @return true if the two names of equal length only differ in case
+ */
+bool foldedEquals(const char *lhs, const char *rhs, size_t length);
+bool foldedEquals(const wchar_t *lhs, const wchar_t *rhs, size_t length);
+
+/**
+ * @brief case insensitive ordering of utf-8 names, consistent with _stricmp
+ * @return a value less than, equal to or greater than 0 like strcmp
+ */
+int foldedCompare(const char *lhs, size_t lhsLength, const char *rhs, size_t rhsLength);
+
 class FormatGuard {
   std::ostream &m_Stream;
   std::ios::fmtflags m_Flags;
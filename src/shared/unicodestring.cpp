@@ -71,6 +71,17 @@ UnicodeString &UnicodeString::appendPath(PUNICODE_STRING path) {
   return *this;
 }
 
+UnicodeString &UnicodeString::append(const wchar_t *string, size_t length) {
+  if (length > 0) {
+    auto appendAt = size();
+    m_Buffer.resize(m_Buffer.size() + length);
+    memcpy(&m_Buffer[appendAt], string, length * sizeof(wchar_t));
+    m_Buffer.back() = L'\0';
+    update();
+  }
+  return *this;
+}
+
 void UnicodeString::update() {
   m_Data.Length = static_cast<USHORT>(size() * sizeof(WCHAR));
   m_Data.MaximumLength = static_cast<USHORT>((m_Buffer.capacity()-1) * sizeof(WCHAR));
@@ -21,7 +21,8 @@ along with usvfs. If not, see <http://www.gnu.org/licenses/>.
 #pragma once
 
 #include <sstream>
-#include <vector>
+#include <boost/container/small_vector.hpp>
+#include <boost/utility/string_view.hpp>
 #include "windows_sane.h"
 #include "ntdll_declarations.h"
 #include <cassert>
@@ -31,7 +32,8 @@ along with usvfs. If not, see <http://www.gnu.org/licenses/>.
 namespace usvfs {
 
 /**
- * @brief C++ wrapper for the windows UNICODE_STRING structure
+ * @brief C++ wrapper for the windows UNICODE_STRING structure. Paths up to MAX_PATH
+ *        characters are stored inline, only longer ones are allocated
  */
 class UnicodeString {
   friend std::ostream &operator<<(std::ostream &os, const UnicodeString &str);
@@ -41,14 +43,22 @@ public:
 
   UnicodeString(const std::wstring& string);
   UnicodeString(LPCWSTR string, size_t length = std::string::npos);
+  explicit UnicodeString(boost::wstring_view string) : UnicodeString(string.data(), string.size()) {}
 
   UnicodeString(const UnicodeString& other) : m_Buffer(other.m_Buffer) { update(); }
-  UnicodeString(UnicodeString&& other) : m_Buffer(std::move(other.m_Buffer)) { update(); }
+  UnicodeString(UnicodeString&& other) : m_Buffer(std::move(other.m_Buffer)) { update(); other.reset(); }
 
   UnicodeString& operator=(const std::wstring& string);
 
   UnicodeString& operator=(const UnicodeString& other) { m_Buffer = other.m_Buffer; update(); return *this; }
-  UnicodeString& operator=(UnicodeString&& other) { m_Buffer = std::move(other.m_Buffer); update(); return *this; }
+  UnicodeString& operator=(UnicodeString&& other) {
+    if (this != &other) {
+      m_Buffer = std::move(other.m_Buffer);
+      update();
+      other.reset();
+    }
+    return *this;
+  }
 
   /**
    * @brief convert to a WinNt Api-style unicode string. This is only valid as long
@@ -69,13 +79,29 @@ public:
 
   wchar_t operator[](size_t pos) const { return m_Buffer[pos]; }
 
+  /**
+   * @return the string without zero termination. This is only valid as long as the
+   *         string isn't modified
+   */
+  boost::wstring_view view() const { return boost::wstring_view(m_Buffer.data(), size()); }
+
   UnicodeString &appendPath(PUNICODE_STRING path);
 
+  /**
+   * @brief append characters without inserting a separator
+   */
+  UnicodeString &append(const wchar_t *string, size_t length);
+
 private:
+  static const size_t INLINE_SIZE = MAX_PATH;
+
   void update();
 
+  // a moved-from string becomes empty
+  void reset() { m_Buffer.assign(1, L'\0'); update(); }
+
   UNICODE_STRING m_Data;
-  std::vector<wchar_t> m_Buffer;
+  boost::container::small_vector<wchar_t, INLINE_SIZE> m_Buffer;
 };
 
 }
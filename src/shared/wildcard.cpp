@@ -21,59 +21,232 @@ along with usvfs. If not, see <http://www.gnu.org/licenses/>.
 #include "wildcard.h"
 #include "windows_sane.h"
 #include "logging.h"
+#include "stringutils.h"
 #include <string>
 #include <cstring>
+#include <vector>
 
 
+namespace usvfs {
 
+namespace shared {
 
-bool IsInnerMatch(LPCWSTR pszString, LPCWSTR pszMatch)
+namespace wildcard {
+
+template <typename CharT>
+static bool isWildcard(CharT ch)
 {
-  while (*pszMatch != L'\0') {
-    if ((*pszMatch==L'?') || (*pszMatch==L'>')) {
-      if (!*pszString) {
-        // ? must match exactly one character
-        return false;
-      }
+  return (ch == '*') || (ch == '?') || (ch == '<') || (ch == '>') || (ch == '"');
+}
 
-      ++pszString;
-      ++pszMatch;
-    } else if ((*pszMatch==L'*') || (*pszMatch==L'<')) {
-      if (IsInnerMatch(pszString, pszMatch + 1)) {
-        // * may match empty string or we may have matched something already
-        return true;
-      }
+template <typename CharT>
+BasicMatcher<CharT>::BasicMatcher()
+  : m_Kind(Kind::Everything)
+{
+}
+
+template <typename CharT>
+BasicMatcher<CharT>::BasicMatcher(const CharT *pattern)
+  : BasicMatcher(pattern, std::char_traits<CharT>::length(pattern))
+{
+}
 
-      return *pszString && IsInnerMatch(pszString + 1, pszMatch);
+template <typename CharT>
+BasicMatcher<CharT>::BasicMatcher(const CharT *pattern, size_t length)
+  : m_Kind(Kind::General)
+  , m_Pattern(pattern, length)
+{
+  foldCase(m_Pattern.c_str(), m_Pattern.size(), &m_Pattern[0]);
 
-      // the rest of the string can't be matched
-    } else {
-      if (CharUpperW(MAKEINTRESOURCEW(MAKELONG(*pszString++, 0)))
-          !=CharUpperW(MAKEINTRESOURCEW(MAKELONG(*pszMatch++, 0)))) {
-        // regular chars compare
-        return false;
-      }
+  if ((m_Pattern.size() > 2) && (m_Pattern[m_Pattern.size() - 2] == '.')
+      && (m_Pattern.back() == '*')) {
+    // cmd.exe seems to completely ignore .* at the end, so it may match nothing.
+    // That is what a dos dot does
+    m_Pattern[m_Pattern.size() - 2] = '"';
+  }
+
+  size_t wildcards = 0;
+  for (CharT ch : m_Pattern) {
+    if (isWildcard(ch)) {
+      ++wildcards;
     }
   }
 
-  return !*pszString && !*pszMatch;
+  if (m_Pattern.empty() || (m_Pattern == StringT(1, '*'))
+      || (m_Pattern == StringT{'*', '"', '*'})) {
+    m_Kind = Kind::Everything;
+  } else if (wildcards == 0) {
+    m_Kind = Kind::Literal;
+    m_Literal = m_Pattern;
+  } else if (wildcards == 1) {
+    if (m_Pattern.back() == '*') {
+      m_Kind = Kind::Prefix;
+      m_Literal = m_Pattern.substr(0, m_Pattern.size() - 1);
+    } else if (m_Pattern.front() == '*') {
+      m_Kind = Kind::Suffix;
+      m_Literal = m_Pattern.substr(1);
+    }
+  }
 }
 
+template <typename CharT>
+bool BasicMatcher<CharT>::match(const CharT *name, size_t length) const
+{
+  if (m_Kind == Kind::Everything) {
+    return true;
+  }
+  if (matchName(name, length)) {
+    return true;
+  }
+  // cmd.exe seems to ignore dots at the start
+  while ((length > 0) && (*name == '.')) {
+    ++name;
+    --length;
+    if (matchName(name, length)) {
+      return true;
+    }
+  }
+  return false;
+}
 
-bool usvfs::shared::wildcard::Match(LPCWSTR pszString, LPCWSTR pszMatch)
+template <typename CharT>
+bool BasicMatcher<CharT>::matchName(const CharT *name, size_t length) const
 {
-  if (*pszString == L'.') {
-    // cmd.exe seems to ignore
-    return Match(pszString + 1, pszMatch);
-  } else {
-    size_t len = wcslen(pszMatch);
-    if ((len > 2) && (wcscmp(pszMatch + len - 2, L".*") == 0)) {
-      // cmd.exe seems to completely ignore .* at the end.
-      std::wstring temp(pszMatch, pszMatch + len - 2);
-      return IsInnerMatch(pszString, temp.c_str());
+  switch (m_Kind) {
+    case Kind::Everything:
+      return true;
+    case Kind::Literal:
+      return (length == m_Literal.size())
+             && foldedEquals(name, m_Literal.c_str(), length);
+    case Kind::Prefix:
+      return (length >= m_Literal.size())
+             && foldedEquals(name, m_Literal.c_str(), m_Literal.size());
+    case Kind::Suffix:
+      return (length >= m_Literal.size())
+             && foldedEquals(name + length - m_Literal.size(), m_Literal.c_str(),
+                             m_Literal.size());
+    default:
+      return matchGeneral(name, length);
+  }
+}
+
+template <typename CharT>
+bool BasicMatcher<CharT>::matchGeneral(const CharT *name, size_t length) const
+{
+  // simulate the pattern as a nondeterministic automaton: states are positions in
+  // the pattern and all of them advance together one character of the name at a
+  // time, so nothing is ever backtracked
+  const size_t stateCount = m_Pattern.size() + 1;
+
+  static const size_t STACK_STATES = 128;
+  uint8_t stackStates[2 * STACK_STATES];
+  std::vector<uint8_t> heapStates;
+  uint8_t *current = stackStates;
+  if (stateCount > STACK_STATES) {
+    heapStates.resize(2 * stateCount);
+    current = heapStates.data();
+  }
+  uint8_t *next = current + stateCount;
+
+  size_t lastDot = length;
+  for (size_t i = 0; i < length; ++i) {
+    if (name[i] == '.') {
+      lastDot = i;
     }
-    return IsInnerMatch(pszString, pszMatch);
   }
+
+  // follow the transitions that don't consume a character at the specified position
+  // of the name. They only lead forward so a single pass suffices
+  auto closure = [&](uint8_t *states, size_t pos) {
+    for (size_t p = 0; p < m_Pattern.size(); ++p) {
+      if (!states[p]) {
+        continue;
+      }
+      switch (m_Pattern[p]) {
+        case '*':
+        case '<':
+          states[p + 1] = 1;
+          break;
+        case '>':
+          if ((pos == length) || (name[pos] == '.')) {
+            states[p + 1] = 1;
+          }
+          break;
+        case '"':
+          if (pos == length) {
+            states[p + 1] = 1;
+          }
+          break;
+      }
+    }
+  };
+
+  memset(current, 0, stateCount);
+  current[0] = 1;
+  for (size_t i = 0; i < length; ++i) {
+    closure(current, i);
+    memset(next, 0, stateCount);
+    CharT ch = name[i];
+    CharT folded = foldChar(ch);
+    bool any = false;
+    for (size_t p = 0; p < m_Pattern.size(); ++p) {
+      if (!current[p]) {
+        continue;
+      }
+      CharT token = m_Pattern[p];
+      switch (token) {
+        case '*':
+          next[p] = 1;
+          break;
+        case '<':
+          // a dos star never consumes the last dot
+          if ((ch != '.') || (i != lastDot)) {
+            next[p] = 1;
+          }
+          break;
+        case '?':
+          next[p + 1] = 1;
+          break;
+        case '>':
+          if (ch != '.') {
+            next[p + 1] = 1;
+          }
+          break;
+        case '"':
+          if (ch == '.') {
+            next[p + 1] = 1;
+          }
+          break;
+        default:
+          if (token == folded) {
+            next[p + 1] = 1;
+          }
+          break;
+      }
+      any = any || next[p] || next[p + 1];
+    }
+    if (!any) {
+      return false;
+    }
+    std::swap(current, next);
+  }
+  closure(current, length);
+  return current[m_Pattern.size()] != 0;
+}
+
+template class BasicMatcher<char>;
+template class BasicMatcher<wchar_t>;
+
+} // namespace wildcard
+
+} // namespace shared
+
+} // namespace usvfs
+
+
+bool usvfs::shared::wildcard::Match(LPCWSTR pszString, LPCWSTR pszMatch)
+{
+  return WMatcher(pszMatch).match(pszString, wcslen(pszString));
 }
 
 
@@ -154,21 +327,7 @@ LPCSTR InnerMatch(LPCSTR pszString, LPCSTR pszMatch)
 
 bool usvfs::shared::wildcard::Match(LPCSTR pszString, LPCSTR pszMatch)
 {
-  if (*pszString == '.') {
-    // cmd.exe seems to ignore
-    return Match(pszString + 1, pszMatch);
-  } else {
-    size_t len = strlen(pszMatch);
-    LPCSTR res = nullptr;
-    if ((len > 2) && (strcmp(pszMatch + len - 2, ".*") == 0)) {
-      // cmd.exe seems to completely ignore .* at the end.
-      std::string temp(pszMatch, pszMatch + len - 2);
-      res = InnerMatch(pszString, temp.c_str());
-    } else {
-      res = InnerMatch(pszString, pszMatch);
-    }
-    return ((res != nullptr) && (*res == '\0'));
-  }
+  return Matcher(pszMatch).match(pszString, strlen(pszString));
 }
 
 LPCSTR usvfs::shared::wildcard::PartialMatch(LPCSTR pszString, LPCSTR pszMatch)
@@ -194,3 +353,4 @@ LPCSTR usvfs::shared::wildcard::PartialMatch(LPCSTR pszString, LPCSTR pszMatch)
     return InnerMatch(pszString, pszMatch);
   }
 }
+
@@ -25,6 +25,8 @@ along with usvfs. If not, see <http://www.gnu.org/licenses/>.
 #pragma once
 
 #include "windows_sane.h"
+#include <string>
+#include <cstdint>
 
 namespace usvfs {
 
@@ -68,6 +70,78 @@ bool Match(LPCSTR pszString, LPCSTR pszMatch);
  */
 LPCSTR PartialMatch(LPCSTR pszString, LPCSTR pszMatch);
 
+
+/**
+ * @brief a search pattern compiled for matching many names against it, as done for
+ *        every entry of a directory search. Supports * and ? as well as the dos
+ *        wildcards < (star up to the last dot), > (question mark that may match nothing
+ *        in front of a dot or the end) and " (dot that may match the end) the way the
+ *        file system interprets them. Like Match, a ".*" at the end of the pattern may
+ *        match nothing and names starting with dots also match without them.
+ *        Characters are compared caseless. Matching takes time linear in the name for
+ *        the common shapes ("*", literal names, "prefix*", "*.ext") and at most
+ *        proportional to name length times pattern length otherwise
+ * @note the char version works on utf-8 bytes, wildcards match single bytes
+ */
+template <typename CharT>
+class BasicMatcher
+{
+public:
+
+  typedef std::basic_string<CharT> StringT;
+
+  enum class Kind : uint8_t {
+    Everything, // only stars
+    Literal,    // no wildcards at all
+    Prefix,     // literal followed by a single star
+    Suffix,     // a single star followed by a literal, like *.ext
+    General
+  };
+
+  /**
+   * @brief construct a matcher that matches every name
+   */
+  BasicMatcher();
+
+  explicit BasicMatcher(const CharT *pattern);
+  BasicMatcher(const CharT *pattern, size_t length);
+
+  /**
+   * @return true if the name of the specified length matches the pattern
+   */
+  bool match(const CharT *name, size_t length) const;
+
+  bool match(const StringT &name) const { return match(name.c_str(), name.size()); }
+
+  /**
+   * @return the shape of the pattern, lets callers with indexed names pick candidates
+   *         for Literal, Prefix and Suffix patterns without matching every name
+   */
+  Kind kind() const { return m_Kind; }
+
+  /**
+   * @return the folded literal part of Literal, Prefix and Suffix patterns
+   */
+  const StringT &literal() const { return m_Literal; }
+
+private:
+
+  bool matchName(const CharT *name, size_t length) const;
+  bool matchGeneral(const CharT *name, size_t length) const;
+
+private:
+
+  Kind m_Kind;
+  // folded pattern. The trailing ".*" is stored as dos dot followed by a star
+  StringT m_Pattern;
+  // the literal part for the Literal, Prefix and Suffix shapes
+  StringT m_Literal;
+
+};
+
+typedef BasicMatcher<char> Matcher;
+typedef BasicMatcher<wchar_t> WMatcher;
+
 } // namespace wildcard
 
 } // namespace shared
@@ -26,6 +26,7 @@ along with usvfs. If not, see <http://www.gnu.org/licenses/>.
 #include "unicodestring.h"
 #include "scopeguard.h"
 #include <Psapi.h>
+#include <winioctl.h>
 #include <algorithm>
 #include <spdlog.h>
 #include <fmt/format.h>
@@ -389,9 +390,65 @@ std::wstring getSectionName(PVOID addressIn, HANDLE process)
 std::vector<FileResult> quickFindFiles(LPCWSTR directoryName, LPCWSTR pattern)
 {
   std::vector<FileResult> result;
+  quickFindFiles(directoryName, pattern, [&result](const FileEntry &entry) {
+    result.push_back(FileResult{ entry.fileName.to_string(), entry.attributes });
+  });
+  return result;
+}
+
+namespace {
+
+// large enough that most directories are listed in a single call
+static const ULONG QUICKFIND_BUFFER_SIZE = 64 * 1024;
+
+// query buffer of the calling thread, allocated on first use
+class QuickFindBuffer {
+public:
+  QuickFindBuffer()
+    : m_Owned(!s_InUse)
+  {
+    if (m_Owned) {
+      if (!s_Buffer) {
+        s_Buffer.reset(new uint8_t[QUICKFIND_BUFFER_SIZE]);
+      }
+      m_Buffer = s_Buffer.get();
+      s_InUse  = true;
+    } else {
+      // nested call from within a callback, the thread buffer is still in use
+      m_Local.reset(new uint8_t[QUICKFIND_BUFFER_SIZE]);
+      m_Buffer = m_Local.get();
+    }
+  }
+
+  ~QuickFindBuffer()
+  {
+    if (m_Owned) {
+      s_InUse = false;
+    }
+  }
+
+  QuickFindBuffer(const QuickFindBuffer &) = delete;
+  QuickFindBuffer &operator=(const QuickFindBuffer &) = delete;
+
+  uint8_t *get() const { return m_Buffer; }
 
-  static const unsigned int BUFFER_SIZE = 1024;
+private:
+  static thread_local std::unique_ptr<uint8_t[]> s_Buffer;
+  static thread_local bool s_InUse;
 
+  bool m_Owned;
+  std::unique_ptr<uint8_t[]> m_Local;
+  uint8_t *m_Buffer;
+};
+
+thread_local std::unique_ptr<uint8_t[]> QuickFindBuffer::s_Buffer;
+thread_local bool QuickFindBuffer::s_InUse = false;
+
+}
+
+bool quickFindFiles(LPCWSTR directoryName, LPCWSTR pattern,
+                    const std::function<void(const FileEntry&)> &callback)
+{
   HANDLE hdl = CreateFileW(directoryName
                            , GENERIC_READ
                            , FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE
@@ -399,12 +456,16 @@ std::vector<FileResult> quickFindFiles(LPCWSTR directoryName, LPCWSTR pattern)
                            , OPEN_EXISTING
                            , FILE_FLAG_BACKUP_SEMANTICS
                            , nullptr);
+  if (hdl == INVALID_HANDLE_VALUE) {
+    return false;
+  }
 
   ON_BLOCK_EXIT([hdl] () {
     CloseHandle(hdl);
   });
 
-  uint8_t buffer[BUFFER_SIZE];
+  QuickFindBuffer buffer;
+  usvfs::UnicodeString patternU(pattern);
 
   NTSTATUS res = STATUS_SUCCESS; // status success
   while (res == STATUS_SUCCESS) {
@@ -415,21 +476,21 @@ std::vector<FileResult> quickFindFiles(LPCWSTR directoryName, LPCWSTR pattern)
                                , nullptr
                                , nullptr
                                , &status
-                               , buffer
-                               , BUFFER_SIZE
+                               , buffer.get()
+                               , QUICKFIND_BUFFER_SIZE
                                , FileFullDirectoryInformation
                                , FALSE
-                               , static_cast<PUNICODE_STRING>(usvfs::UnicodeString(pattern))
+                               , static_cast<PUNICODE_STRING>(patternU)
                                , FALSE);
     if (res == STATUS_SUCCESS) {
-      FILE_FULL_DIR_INFORMATION *info = reinterpret_cast<FILE_FULL_DIR_INFORMATION*>(buffer);
-      void *endPos = buffer + status.Information;
+      FILE_FULL_DIR_INFORMATION *info = reinterpret_cast<FILE_FULL_DIR_INFORMATION*>(buffer.get());
+      void *endPos = buffer.get() + status.Information;
       while (info < endPos) {
-        FileResult file;
-        file.fileName = std::wstring(info->FileName, info->FileNameLength / sizeof(wchar_t));
-        file.attributes = info->FileAttributes;
+        FileEntry entry;
+        entry.fileName = boost::wstring_view(info->FileName, info->FileNameLength / sizeof(wchar_t));
+        entry.attributes = info->FileAttributes;
+        callback(entry);
 
-        result.push_back(file);
         if (info->NextEntryOffset == 0) {
           break;
         } else {
@@ -439,7 +500,7 @@ std::vector<FileResult> quickFindFiles(LPCWSTR directoryName, LPCWSTR pattern)
     }
   }
 
-  return result;
+  return true;
 }
 
 bool createPath(boost::filesystem::path path, LPSECURITY_ATTRIBUTES securityAttributes)
@@ -470,6 +531,129 @@ bool createPath(boost::filesystem::path path, LPSECURITY_ATTRIBUTES securityAttr
   return true;
 }
 
+#ifndef FILE_SUPPORTS_BLOCK_REFCOUNTING
+#define FILE_SUPPORTS_BLOCK_REFCOUNTING 0x08000000
+#endif
+
+// clone the clusters of source into a new file at destination
+static bool cloneExtents(HANDLE source, LPCWSTR destination)
+{
+  // a single duplication can't cover 4GB, stay well below
+  static const LONGLONG CHUNK_SIZE = 1LL << 30;
+
+  FILE_BASIC_INFO basicInfo;
+  FILE_STANDARD_INFO standardInfo;
+  FSCTL_GET_INTEGRITY_INFORMATION_BUFFER integrity;
+  DWORD bytes = 0;
+  if (!::GetFileInformationByHandleEx(source, FileBasicInfo, &basicInfo, sizeof(basicInfo))
+      || !::GetFileInformationByHandleEx(source, FileStandardInfo, &standardInfo,
+                                         sizeof(standardInfo))
+      || !::DeviceIoControl(source, FSCTL_GET_INTEGRITY_INFORMATION, nullptr, 0,
+                            &integrity, sizeof(integrity), &bytes, nullptr)) {
+    return false;
+  }
+
+  HANDLE target = ::CreateFileW(destination, GENERIC_READ | GENERIC_WRITE | DELETE, 0,
+                                nullptr, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (target == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  ON_BLOCK_EXIT([target] () { ::CloseHandle(target); });
+
+  bool success = true;
+  // the clone has to match the source in sparseness and integrity streams
+  if ((basicInfo.FileAttributes & FILE_ATTRIBUTE_SPARSE_FILE) != 0) {
+    success = ::DeviceIoControl(target, FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0,
+                                &bytes, nullptr) != FALSE;
+  }
+  if (success) {
+    FSCTL_SET_INTEGRITY_INFORMATION_BUFFER setIntegrity = {
+      integrity.ChecksumAlgorithm, integrity.Reserved, integrity.Flags };
+    success = ::DeviceIoControl(target, FSCTL_SET_INTEGRITY_INFORMATION, &setIntegrity,
+                                sizeof(setIntegrity), nullptr, 0, &bytes, nullptr) != FALSE;
+  }
+  if (success) {
+    FILE_END_OF_FILE_INFO endOfFile;
+    endOfFile.EndOfFile = standardInfo.EndOfFile;
+    success = ::SetFileInformationByHandle(target, FileEndOfFileInfo, &endOfFile,
+                                           sizeof(endOfFile)) != FALSE;
+  }
+
+  // ranges have to be cluster aligned, the last one may extend past the end of file
+  LONGLONG clusterSize = integrity.ClusterSizeInBytes;
+  LONGLONG size = (standardInfo.EndOfFile.QuadPart + clusterSize - 1) & ~(clusterSize - 1);
+  for (LONGLONG offset = 0; success && (offset < size); offset += CHUNK_SIZE) {
+    DUPLICATE_EXTENTS_DATA duplicate;
+    duplicate.FileHandle = source;
+    duplicate.SourceFileOffset.QuadPart = offset;
+    duplicate.TargetFileOffset.QuadPart = offset;
+    duplicate.ByteCount.QuadPart = std::min(CHUNK_SIZE, size - offset);
+    success = ::DeviceIoControl(target, FSCTL_DUPLICATE_EXTENTS_TO_FILE, &duplicate,
+                                sizeof(duplicate), nullptr, 0, &bytes, nullptr) != FALSE;
+  }
+
+  if (success) {
+    success = ::SetFileInformationByHandle(target, FileBasicInfo, &basicInfo,
+                                           sizeof(basicInfo)) != FALSE;
+  }
+
+  if (!success) {
+    DWORD error = ::GetLastError();
+    FILE_DISPOSITION_INFO disposition = { TRUE };
+    ::SetFileInformationByHandle(target, FileDispositionInfo, &disposition,
+                                 sizeof(disposition));
+    ::SetLastError(error);
+  }
+  return success;
+}
+
+bool cloneFile(LPCWSTR source, LPCWSTR destination)
+{
+  HANDLE sourceFile = ::CreateFileW(source, GENERIC_READ,
+                                    FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                    nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (sourceFile == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  ON_BLOCK_EXIT([sourceFile] () { ::CloseHandle(sourceFile); });
+
+  if (::GetFileAttributesW(destination) != INVALID_FILE_ATTRIBUTES) {
+    ::SetLastError(ERROR_FILE_EXISTS);
+    return false;
+  }
+
+  // the copy is made under a name only this thread uses and then renamed, so the
+  // destination is either complete or doesn't exist. Concurrent clones to the same
+  // destination end up with one of them, the others fail with ERROR_FILE_EXISTS
+  wchar_t suffix[32];
+  swprintf_s(suffix, L".usvfs-%lx-%lx", ::GetCurrentProcessId(), ::GetCurrentThreadId());
+  std::wstring temporary = std::wstring(destination) + suffix;
+
+  DWORD flags = 0;
+  bool success = ::GetVolumeInformationByHandleW(sourceFile, nullptr, 0, nullptr, nullptr,
+                                                 &flags, nullptr, 0)
+                 && ((flags & FILE_SUPPORTS_BLOCK_REFCOUNTING) != 0)
+                 && cloneExtents(sourceFile, temporary.c_str());
+  if (!success) {
+    // also taken if the destination is on a different volume than the source
+    success = ::CopyFileExW(source, temporary.c_str(), nullptr, nullptr, nullptr, 0) != FALSE;
+  }
+  if (!success) {
+    DWORD error = ::GetLastError();
+    ::DeleteFileW(temporary.c_str());
+    ::SetLastError(error);
+    return false;
+  }
+
+  if (!::MoveFileExW(temporary.c_str(), destination, 0)) {
+    DWORD error = ::GetLastError();
+    ::DeleteFileW(temporary.c_str());
+    ::SetLastError(error == ERROR_ALREADY_EXISTS ? ERROR_FILE_EXISTS : error);
+    return false;
+  }
+  return true;
+}
+
 std::wstring getWindowsBuildLab(bool ex)
 {
   HKEY hKey = nullptr;
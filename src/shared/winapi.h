@@ -33,9 +33,11 @@ along with usvfs. If not, see <http://www.gnu.org/licenses/>.
 #include <limits>
 #include <sstream>
 #include <utility>
+#include <functional>
 #include <shlobj.h>
 
 #include <boost/filesystem.hpp>
+#include <boost/utility/string_view.hpp>
 
 
 #define ALIAS(alias, original) template <typename... Args>\
@@ -469,6 +471,28 @@ namespace ex {
      */
     std::vector<FileResult> quickFindFiles(LPCWSTR directoryName, LPCWSTR pattern);
 
+    /**
+     * @brief entry reported by the streaming variant of quickFindFiles
+     * @note fileName points into the query buffer and is only valid during the callback
+     */
+    struct FileEntry {
+      boost::wstring_view fileName;
+      ULONG attributes;
+    };
+
+    /**
+     * @brief streaming variant of quickFindFiles which doesn't copy the entries. Each
+     *        thread reuses one large query buffer so big directories take few syscalls
+     * @param directoryName name of the directory to search in
+     * @param pattern name pattern that needs to match
+     * @param callback called for every entry found
+     * @return false if the directory couldn't be opened
+     * @note the callback may call quickFindFiles itself, nested calls use a buffer of
+     *       their own
+     */
+    bool quickFindFiles(LPCWSTR directoryName, LPCWSTR pattern,
+                        const std::function<void(const FileEntry&)>& callback);
+
     /**
      * @brief create the specified directory including all intermediate
      * directories
@@ -487,6 +511,20 @@ namespace ex {
       return createPath(boost::filesystem::path(path), securityAttributes);
     }
 
+    /**
+     * @brief create a copy of a file that doesn't share data with the source. On volumes
+     *        that support block cloning (ReFS) the copy shares the source's clusters
+     *        until either is written to, so no data is copied. Elsewhere this falls
+     *        back to a regular copy
+     * @param source the file to copy
+     * @param destination path of the copy. The copy appears there complete or not at
+     *        all, even with concurrent calls for the same destination
+     * @return false on failure, the error is available through GetLastError. It's
+     *         ERROR_FILE_EXISTS if the destination exists, including when a concurrent
+     *         call finished first
+     */
+    bool cloneFile(LPCWSTR source, LPCWSTR destination);
+
     std::wstring getWindowsBuildLab(bool ex = false);
   }
 }
@@ -19,6 +19,10 @@ You should have received a copy of the GNU General Public License
 along with usvfs. If not, see <http://www.gnu.org/licenses/>.
 */
 #include <map>
+#include <vector>
+#include <limits>
+#include <cstring>
+#include <mutex>
 #include <boost/predef.h>
 #include <boost/format.hpp>
 #include "udis86wrapper.h"
@@ -32,6 +36,7 @@ along with usvfs. If not, see <http://www.gnu.org/licenses/>.
 #include <addrtools.h>
 #include <windows_error.h>
 #include <winapi.h>
+#include <TlHelp32.h>
 
 #if BOOST_ARCH_X86_64
 #pragma message("64bit build")
@@ -58,6 +63,11 @@ struct THookInfo {
   LPVOID trampoline; // code fragment that decides whether the replacement function or detour is executed (preventing endless loops)
   std::vector<uint8_t> preamble; // part of the detour that needs to be re-inserted into the original function to return it to vanilla state
   bool stub;         // if this is true, the trampoline calls the "replacement"-function that before the original function, not instead of it
+  LPVOID returnAddress; // where the trampoline continues to if no code was moved to it
+  LPBYTE jumpAddress;   // the jump to the trampoline (the pointer to it for TYPE_RIPINDIRECT)
+  int lazyId;           // index in s_LazyHooks if installed by InstallLazyHook, -1 otherwise
+  bool pending;         // true as long as a lazy hook only jumps to its lazy stub
+  bool suppressible;    // the trampoline is skipped on threads that suppress hooks
   enum {
     TYPE_HOTPATCH,   // official hot-patch variant as used on 32-bit windows
     TYPE_WIN64PATCH, // custom patch variant used on 64-bit windows
@@ -74,14 +84,236 @@ UDis86Wrapper &disasm() {
 }
 
 
+// threads suspended by PauseOtherThreads. Pausing nests, only the outermost
+// call suspends and only the matching outermost resume lets them run again
+static std::vector<HANDLE> s_PausedThreads;
+static int s_PauseDepth = 0;
+
+// patches queued between BeginHookBatch and EndHookBatch
+struct TPatch {
+  LPBYTE address;
+  std::vector<uint8_t> code;
+};
+
+static bool s_Batching = false;
+static std::vector<TPatch> s_PendingPatches;
+
+
 void PauseOtherThreads()
 {
-  // TODO: implement me!
+  if (s_PauseDepth++ > 0) {
+    return;
+  }
+
+  // collect all thread ids before suspending anything. A suspended thread may
+  // hold the heap lock so nothing between here and ResumePausedThreads may
+  // allocate, this includes logging
+  std::vector<DWORD> threadIds;
+  HANDLE snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+  if (snapshot == INVALID_HANDLE_VALUE) {
+    spdlog::get("usvfs")->warn("failed to enumerate threads, not pausing: {}",
+                               ::GetLastError());
+    return;
+  }
+
+  DWORD processId = GetCurrentProcessId();
+  DWORD threadId = GetCurrentThreadId();
+  THREADENTRY32 entry;
+  entry.dwSize = sizeof(entry);
+  for (BOOL more = Thread32First(snapshot, &entry); more;
+       more = Thread32Next(snapshot, &entry)) {
+    if ((entry.th32OwnerProcessID == processId)
+        && (entry.th32ThreadID != threadId)) {
+      threadIds.push_back(entry.th32ThreadID);
+    }
+  }
+  CloseHandle(snapshot);
+
+  s_PausedThreads.clear();
+  s_PausedThreads.reserve(threadIds.size());
+  for (DWORD id : threadIds) {
+    HANDLE thread = OpenThread(THREAD_SUSPEND_RESUME, FALSE, id);
+    if (thread == nullptr) {
+      // thread ended since the snapshot was taken
+      continue;
+    }
+    if (SuspendThread(thread) == static_cast<DWORD>(-1)) {
+      CloseHandle(thread);
+      continue;
+    }
+    s_PausedThreads.push_back(thread);
+  }
 }
 
 void ResumePausedThreads()
 {
-  // TODO: implement me! should resume only the threads paused by PauseOtherThreads
+  if ((s_PauseDepth == 0) || (--s_PauseDepth > 0)) {
+    return;
+  }
+
+  for (HANDLE thread : s_PausedThreads) {
+    ResumeThread(thread);
+    CloseHandle(thread);
+  }
+  s_PausedThreads.clear();
+}
+
+
+///
+/// \brief write code to the specified address. While a batch is active the
+///        write is only queued and gets applied in EndHookBatch
+///
+void WriteCode(LPBYTE address, const uint8_t *code, size_t size)
+{
+  if (s_Batching) {
+    s_PendingPatches.push_back(TPatch{ address, std::vector<uint8_t>(code, code + size) });
+    return;
+  }
+
+  DWORD oldProtect = 0;
+  // Set the target function to copy on write, so we don't modify code for other processes
+  if (!VirtualProtect(address, size, PAGE_EXECUTE_WRITECOPY, &oldProtect)) {
+    throw std::runtime_error("failed to change virtual protection");
+  }
+
+  PauseOtherThreads();
+  memcpy(address, code, size);
+  ResumePausedThreads();
+
+  // restore old memory protection
+  if (!VirtualProtect(address, size, oldProtect, &oldProtect)) {
+    throw std::runtime_error("failed to change virtual protection");
+  }
+  FlushInstructionCache(GetCurrentProcess(), address, size);
+}
+
+
+///
+/// \brief change code other threads may be executing without pausing them. This is
+///        only possible if the changed bytes lie within one aligned 8-byte word, which
+///        is then replaced with a single interlocked store so other threads see either
+///        the old or the new code. Queued like WriteCode while a batch is active
+/// \return false if the bytes span two words, nothing is written then
+///
+bool WriteCodeAtomic(LPBYTE address, const uint8_t *code, size_t size)
+{
+  uintptr_t begin = reinterpret_cast<uintptr_t>(address);
+  uintptr_t word = begin & ~static_cast<uintptr_t>(7);
+  if (begin + size > word + 8) {
+    return false;
+  }
+  if (s_Batching) {
+    WriteCode(address, code, size);
+    return true;
+  }
+
+  DWORD oldProtect = 0;
+  if (!VirtualProtect(reinterpret_cast<LPVOID>(word), 8, PAGE_EXECUTE_WRITECOPY, &oldProtect)) {
+    throw std::runtime_error("failed to change virtual protection");
+  }
+
+  volatile LONGLONG *target = reinterpret_cast<volatile LONGLONG*>(word);
+  LONGLONG expected = *target;
+  for (;;) {
+    LONGLONG desired = expected;
+    memcpy(reinterpret_cast<uint8_t*>(&desired) + (begin - word), code, size);
+    LONGLONG previous = InterlockedCompareExchange64(target, desired, expected);
+    if (previous == expected) {
+      break;
+    }
+    expected = previous;
+  }
+
+  if (!VirtualProtect(reinterpret_cast<LPVOID>(word), 8, oldProtect, &oldProtect)) {
+    throw std::runtime_error("failed to change virtual protection");
+  }
+  FlushInstructionCache(GetCurrentProcess(), address, size);
+  return true;
+}
+
+
+///
+/// \brief apply all queued patches inside a single pause of the other threads.
+///        Every page touched is made writable once, before the pause, and its
+///        protection restored once afterwards
+/// \return number of patches applied
+///
+size_t FlushPendingPatches()
+{
+  if (s_PendingPatches.empty()) {
+    return 0;
+  }
+
+  SYSTEM_INFO sysInfo;
+  GetSystemInfo(&sysInfo);
+  uintptr_t pageMask = ~static_cast<uintptr_t>(sysInfo.dwPageSize - 1);
+
+  std::map<uintptr_t, DWORD> pages;
+  for (const TPatch &patch : s_PendingPatches) {
+    uintptr_t begin = reinterpret_cast<uintptr_t>(patch.address) & pageMask;
+    uintptr_t end = reinterpret_cast<uintptr_t>(patch.address) + patch.code.size();
+    for (uintptr_t page = begin; page < end; page += sysInfo.dwPageSize) {
+      pages.insert(std::make_pair(page, 0));
+    }
+  }
+
+  for (auto &page : pages) {
+    if (!VirtualProtect(reinterpret_cast<LPVOID>(page.first), sysInfo.dwPageSize,
+                        PAGE_EXECUTE_WRITECOPY, &page.second)) {
+      DWORD err = ::GetLastError();
+      for (const auto &restore : pages) {
+        if (restore.first == page.first) {
+          break;
+        }
+        DWORD ignore;
+        VirtualProtect(reinterpret_cast<LPVOID>(restore.first), sysInfo.dwPageSize,
+                       restore.second, &ignore);
+      }
+      s_PendingPatches.clear();
+      throw shared::windows_error("failed to change virtual protection", err);
+    }
+  }
+
+  PauseOtherThreads();
+  for (const TPatch &patch : s_PendingPatches) {
+    memcpy(patch.address, patch.code.data(), patch.code.size());
+  }
+  for (const TPatch &patch : s_PendingPatches) {
+    FlushInstructionCache(GetCurrentProcess(), patch.address, patch.code.size());
+  }
+  ResumePausedThreads();
+
+  for (const auto &page : pages) {
+    DWORD ignore;
+    if (!VirtualProtect(reinterpret_cast<LPVOID>(page.first), sysInfo.dwPageSize,
+                        page.second, &ignore)) {
+      spdlog::get("usvfs")->warn("failed to restore protection of {0:x}", page.first);
+    }
+  }
+
+  size_t count = s_PendingPatches.size();
+  s_PendingPatches.clear();
+  return count;
+}
+
+
+///
+/// \brief test if a queued patch touches the code around the specified function.
+///        Hooks are installed based on what the function currently looks like
+///        so a pending patch there has to be applied first
+///
+bool PatchPending(LPBYTE address)
+{
+  // the disassembly looks at the jump space in front of the function and
+  // at most 40 bytes into it, a short jump can point 128 bytes back
+  LPBYTE begin = address - 128 - JUMP_SIZE;
+  LPBYTE end = address + 40;
+  for (const TPatch &patch : s_PendingPatches) {
+    if ((patch.address < end) && (patch.address + patch.code.size() > begin)) {
+      return true;
+    }
+  }
+  return false;
 }
 
 
@@ -104,7 +336,7 @@ size_t GetJumpSize(LPBYTE, LPVOID)
   return 5;
 }
 
-void WriteLongJump(LPBYTE jumpAddr, LPVOID destination)
+void EncodeLongJump(LPBYTE jumpAddr, LPVOID destination, uint8_t *code)
 {
   // TODO: not using asmjit here because I couldn't figure out how to generate
   // a working, space-optimized, relative jump to outside the generated code and
@@ -115,66 +347,104 @@ void WriteLongJump(LPBYTE jumpAddr, LPVOID destination)
 #else
   int32_t distShort = reinterpret_cast<intptr_t>(destination) - (reinterpret_cast<intptr_t>(jumpAddr) + 5);
 #endif
-  *jumpAddr = 0xE9;
-  *reinterpret_cast<int32_t*>(jumpAddr + 1) = distShort;
+  code[0] = 0xE9;
+  memcpy(code + 1, &distShort, sizeof(distShort));
+}
+
+void WriteLongJump(LPBYTE jumpAddr, LPVOID destination)
+{
+  uint8_t code[5];
+  EncodeLongJump(jumpAddr, destination, code);
+  WriteCode(jumpAddr, code, sizeof(code));
 }
 
 
 
 void WriteSingleJump(THookInfo &hookInfo, HookError *error)
 {
-  DWORD oldprotect, ignore;
-  // Set the target function to copy on write, so we don't modify code for other processes
-  if (!VirtualProtect(hookInfo.originalFunction,
-                        JUMP_SIZE,
-                        PAGE_EXECUTE_WRITECOPY,
-                        &oldprotect)) {
-    throw std::runtime_error("failed to change virtual protection");
-  }
-
+  hookInfo.jumpAddress = reinterpret_cast<LPBYTE>(hookInfo.originalFunction);
   WriteLongJump(reinterpret_cast<LPBYTE>(hookInfo.originalFunction), hookInfo.trampoline);
 
-  // restore old memory protection
-  if (!VirtualProtect(hookInfo.originalFunction, JUMP_SIZE, oldprotect, &ignore)) {
-    throw std::runtime_error("failed to change virtual protection");
-  }
-
   if (error != nullptr) {
     *error = ERR_NONE;
   }
 }
 
 
-void WriteShortJump(LPBYTE jumpAddr, const signed char offset)
-{
-  *jumpAddr       = 0xEB;
-  *(jumpAddr + 1) = offset;
-}
-
 void WriteIndirectJump(THookInfo &hookInfo, size_t jumpSize, HookError *error)
 {
-  DWORD oldProtect = 0;
   LPBYTE jumpAddr = reinterpret_cast<LPBYTE>(hookInfo.originalFunction) - jumpSize;
-  // allow write to jump address + the short jump inside the function
-  if (!VirtualProtect(jumpAddr, jumpSize + 2, PAGE_EXECUTE_WRITECOPY, &oldProtect)) {
-    throw std::runtime_error("failed to change virtual protection");
+  hookInfo.jumpAddress = jumpAddr;
+
+  // the long jump in the space before the function directly followed by the
+  // short jump to the long jump, replacing the 2-byte nop. Both are written
+  // while the other threads are paused so nobody sees only half of it
+  std::vector<uint8_t> code(jumpSize + 2, 0x90);
+  EncodeLongJump(jumpAddr, hookInfo.trampoline, code.data());
+  code[jumpSize] = 0xEB;
+  code[jumpSize + 1] = static_cast<uint8_t>(-(static_cast<int8_t>(jumpSize) + 2));
+  WriteCode(jumpAddr, code.data(), code.size());
+
+  if (error != nullptr) {
+    *error = ERR_NONE;
   }
+}
 
-  // insert the long jump first, then the short jump to the long jump, thus
-  // activating the reroute
-  WriteLongJump(jumpAddr, hookInfo.trampoline);
 
-  PauseOtherThreads();
-  WriteShortJump(jumpAddr + jumpSize, -(static_cast<int8_t>(jumpSize) + 2));
-  ResumePausedThreads();
+static LPVOID __stdcall ResolveLazyHook(intptr_t id);
 
-  // restore access protection
-  if (!VirtualProtect(jumpAddr, jumpSize + 2, oldProtect, &oldProtect)) {
-    throw std::runtime_error("failed to change virtual protection");
+///
+/// \brief generate the trampoline (or stub) for a hook that doesn't move code from the
+///        original function. For a lazy hook only the placeholder is generated
+/// \param returnAddress address under which the original functionality can be reached
+///
+void StoreTrampoline(THookInfo &hookInfo, LPVOID returnAddress)
+{
+  hookInfo.returnAddress = returnAddress;
+  if (hookInfo.stub) {
+    hookInfo.trampoline = TrampolinePool::instance().storeStub(hookInfo.replacementFunction
+                                                               , hookInfo.originalFunction
+                                                               , returnAddress);
+  } else if (hookInfo.pending) {
+    hookInfo.trampoline = TrampolinePool::instance().storeLazyStub(hookInfo.originalFunction
+                                                                   , hookInfo.lazyId
+                                                                   , ResolveLazyHook);
+  } else {
+    hookInfo.trampoline = TrampolinePool::instance().storeTrampoline(hookInfo.replacementFunction
+                                                                     , hookInfo.originalFunction
+                                                                     , returnAddress
+                                                                     , hookInfo.suppressible);
   }
-  if (error != nullptr) {
-    *error = ERR_NONE;
+}
+
+///
+/// \brief generate the trampoline (or stub) for a hook that moves the first preambleSize
+///        bytes of the original function to it. For a lazy hook only the placeholder is
+///        generated, hookInfo.preamble has to hold the moved code then
+/// \return offset of the moved code in the trampoline
+///
+size_t StoreTrampoline(THookInfo &hookInfo, size_t preambleSize)
+{
+  size_t rerouteOffset = 0;
+  hookInfo.returnAddress = nullptr;
+  if (hookInfo.stub) {
+    hookInfo.trampoline = TrampolinePool::instance().storeStub(hookInfo.replacementFunction
+                                                               , hookInfo.originalFunction
+                                                               , preambleSize
+                                                               , &rerouteOffset);
+  } else if (hookInfo.pending) {
+    hookInfo.trampoline = TrampolinePool::instance().storeLazyStub(hookInfo.originalFunction
+                                                                   , hookInfo.lazyId
+                                                                   , ResolveLazyHook);
+  } else {
+    hookInfo.trampoline = TrampolinePool::instance().storeTrampoline(hookInfo.replacementFunction
+                                                                     , hookInfo.originalFunction
+                                                                     , preambleSize
+                                                                     , &rerouteOffset
+                                                                     , nullptr
+                                                                     , hookInfo.suppressible);
   }
+  return rerouteOffset;
 }
 
 
@@ -195,15 +465,7 @@ BOOL HookHotPatch(THookInfo &hookInfo, HookError *error)
 {
   LPVOID original = reinterpret_cast<LPVOID>(hookInfo.originalFunction);
 
-  if (hookInfo.stub) {
-    hookInfo.trampoline = TrampolinePool::instance().storeStub(hookInfo.replacementFunction,
-                                                                reinterpret_cast<LPVOID>(hookInfo.originalFunction),
-                                                                shared::AddrAdd(original, 2));
-  } else {
-    hookInfo.trampoline = TrampolinePool::instance().storeTrampoline(hookInfo.replacementFunction,
-                                                                      reinterpret_cast<LPVOID>(hookInfo.originalFunction),
-                                                                      shared::AddrAdd(original, 2));
-  }
+  StoreTrampoline(hookInfo, shared::AddrAdd(original, 2));
 
   WriteIndirectJump(hookInfo, JUMP_SIZE, error);
   hookInfo.type = THookInfo::TYPE_HOTPATCH;
@@ -252,26 +514,12 @@ BOOL HookRIPIndirection(THookInfo &hookInfo, HookError *error)
   }
 
   uintptr_t chainNext = disasm().jumpTarget();
-  if (hookInfo.stub) {
-    hookInfo.trampoline = TrampolinePool::instance().storeStub(hookInfo.replacementFunction
-                                                               , reinterpret_cast<LPVOID>(hookInfo.originalFunction)
-                                                               , reinterpret_cast<LPVOID>(chainNext));
-  } else {
-    hookInfo.trampoline = TrampolinePool::instance().storeTrampoline(hookInfo.replacementFunction
-                                                                     , reinterpret_cast<LPVOID>(hookInfo.originalFunction)
-                                                                     , reinterpret_cast<LPVOID>(chainNext));
-  }
+  StoreTrampoline(hookInfo, reinterpret_cast<LPVOID>(chainNext));
 
-  DWORD oldProtect = 0;
-  if (!VirtualProtect(reinterpret_cast<LPVOID>(res), 2, PAGE_EXECUTE_WRITECOPY, &oldProtect)) {
-    throw std::runtime_error("failed to change virtual protection");
-  }
-
-  *reinterpret_cast<uintptr_t*>(res) = reinterpret_cast<uintptr_t>(hookInfo.trampoline);
-
-  if (!VirtualProtect(reinterpret_cast<LPVOID>(res), 2, oldProtect, &oldProtect)) {
-    throw std::runtime_error("failed to change virtual protection");
-  }
+  hookInfo.jumpAddress = reinterpret_cast<LPBYTE>(res);
+  uintptr_t trampoline = reinterpret_cast<uintptr_t>(hookInfo.trampoline);
+  WriteCode(reinterpret_cast<LPBYTE>(res), reinterpret_cast<const uint8_t*>(&trampoline),
+            sizeof(trampoline));
 
   hookInfo.type = THookInfo::TYPE_RIPINDIRECT;
   hookInfo.detour = reinterpret_cast<LPVOID>(chainNext);
@@ -307,29 +555,11 @@ BOOL HookChainHook(THookInfo &hookInfo, LPBYTE jumpPos, HookError *error)
              shared::string_cast<std::string>(
                  winapi::ex::wide::getSectionName((void *)chainTarget)));
 
-  if (hookInfo.stub) {
-    hookInfo.trampoline = TrampolinePool::instance().storeStub(
-                            hookInfo.replacementFunction
-                            , reinterpret_cast<LPVOID>(hookInfo.originalFunction)
-                            , reinterpret_cast<LPVOID>(chainTarget));
-  } else {
-    hookInfo.trampoline = TrampolinePool::instance().storeTrampoline(
-                            hookInfo.replacementFunction
-                            , reinterpret_cast<LPVOID>(hookInfo.originalFunction)
-                            , reinterpret_cast<LPVOID>(chainTarget));
-  }
-
-  DWORD oldProtect = 0;
-  if (!VirtualProtect(jumpPos, size, PAGE_EXECUTE_WRITECOPY, &oldProtect)) {
-    throw std::runtime_error("failed to change virtual protection");
-  }
+  StoreTrampoline(hookInfo, reinterpret_cast<LPVOID>(chainTarget));
 
+  hookInfo.jumpAddress = jumpPos;
   WriteLongJump(jumpPos, hookInfo.trampoline);
 
-  if (!VirtualProtect(jumpPos, size, oldProtect, &oldProtect)) {
-    throw std::runtime_error("failed to change virtual protection");
-  }
-
   hookInfo.type = THookInfo::TYPE_CHAINPATCH;
   hookInfo.detour = reinterpret_cast<LPVOID>(chainTarget);
 
@@ -369,24 +599,20 @@ BOOL HookChainPatch(THookInfo &hookInfo, HookError *error)
   return HookChainHook(hookInfo, shortTarget, error);
 }
 
-/// implements function hooking by overwriting the first n bytes of the function
-/// with a jump to the replacement function. Since this is destructive to the original
-/// function code the first n bytes of the function need to be copied somewhere else
-/// and that code needs to be called via a detour. This is a lot more complex than
-/// the hotpatch mechanism.
-/// \param hookInfo info about the hook to be installed
+/// determine how the start of a function has to be overwritten for HookDisasm
+/// \param address address of the function
+/// \param jumpspace receives whether there is room for a jump in front of the function
+/// \param size receives the number of bytes that have to be moved to the detour
 /// \param error if the return code is false and this is not null, the referred-to variable is set to an error code
-/// \return true on success, false on error
-BOOL HookDisasm(THookInfo &hookInfo, HookError *error)
+/// \return true on success, false if the function can't be hooked this way
+BOOL AnalyzeDisasm(LPBYTE address, bool &jumpspace, size_t &size, HookError *error)
 {
-  LPBYTE address = reinterpret_cast<LPBYTE>(hookInfo.originalFunction);
   ud_set_input_buffer(disasm(), address, 40);
 
-  size_t jumpSize = GetJumpSize(static_cast<LPBYTE>(hookInfo.originalFunction),
-                                TrampolinePool::instance().currentBufferAddress(hookInfo.originalFunction));
+  size_t jumpSize = GetJumpSize(address, TrampolinePool::instance().currentBufferAddress(address));
 
   // test if we have room for a jump before the function
-  bool jumpspace = true;
+  jumpspace = true;
   for (size_t i = 0; i < jumpSize; ++i) {
     if (*(address - i - 1) != 0x90) {
       jumpspace = false;
@@ -399,7 +625,7 @@ BOOL HookDisasm(THookInfo &hookInfo, HookError *error)
   // iterate over all instructions that overlap with the jump instructions
   // we want to write.
   // TODO right now, this does not test if the function is smaller than the jump.
-  size_t size = 0;
+  size = 0;
   while (size < minSize) {
     if (ud_disassemble(disasm()) == 0) {
       throw std::runtime_error("premature end of file in disassembly");
@@ -434,24 +660,28 @@ BOOL HookDisasm(THookInfo &hookInfo, HookError *error)
     }
   }
 
+  return TRUE;
+}
+
+/// implements function hooking by overwriting the first n bytes of the function
+/// with a jump to the replacement function. Since this is destructive to the original
+/// function code the first n bytes of the function need to be copied somewhere else
+/// and that code needs to be called via a detour. This is a lot more complex than
+/// the hotpatch mechanism.
+/// \param hookInfo info about the hook to be installed
+/// \param jumpspace, size as determined by AnalyzeDisasm
+/// \param error if the return code is false and this is not null, the referred-to variable is set to an error code
+/// \return true on success, false on error
+BOOL HookDisasm(THookInfo &hookInfo, bool jumpspace, size_t size, HookError *error)
+{
+  size_t jumpSize = GetJumpSize(static_cast<LPBYTE>(hookInfo.originalFunction),
+                                TrampolinePool::instance().currentBufferAddress(hookInfo.originalFunction));
+
   // save the original code for the preamble so we can restore it later
   hookInfo.preamble.resize(size);
   memcpy(&hookInfo.preamble[0], hookInfo.originalFunction, size);
 
-  size_t rerouteOffset = 0;
-  if (hookInfo.stub) {
-    hookInfo.trampoline =
-        TrampolinePool::instance().storeStub(hookInfo.replacementFunction
-                                             , hookInfo.originalFunction
-                                             , size
-                                             , &rerouteOffset);
-  } else {
-    hookInfo.trampoline =
-        TrampolinePool::instance().storeTrampoline(hookInfo.replacementFunction
-                                                   , hookInfo.originalFunction
-                                                   , size
-                                                   , &rerouteOffset);
-  }
+  size_t rerouteOffset = StoreTrampoline(hookInfo, size);
 
   if (jumpspace) {
     WriteIndirectJump(hookInfo, jumpSize, error);
@@ -460,8 +690,9 @@ BOOL HookDisasm(THookInfo &hookInfo, HookError *error)
     WriteSingleJump(hookInfo, error);
     hookInfo.type = THookInfo::TYPE_OVERWRITE;
   }
-  hookInfo.detour = reinterpret_cast<LPBYTE>(hookInfo.trampoline)
-                    + rerouteOffset;
+  // a lazy hook gets its detour when the trampoline is generated
+  hookInfo.detour = hookInfo.pending ? nullptr
+                                     : reinterpret_cast<LPBYTE>(hookInfo.trampoline) + rerouteOffset;
 
   return TRUE;
 }
@@ -513,6 +744,91 @@ EPreamble DeterminePreamble(LPBYTE address)
 
 static std::map<HOOKHANDLE, THookInfo> s_Hooks;
 
+// lazy hooks get resolved on whatever thread calls them first so from then on
+// s_Hooks and the trampoline pool may be used concurrently
+static std::recursive_mutex s_HooksMutex;
+
+struct TLazyHook {
+  HOOKHANDLE handle;
+  LPVOID originalFunction;
+};
+
+// indexed by THookInfo::lazyId
+static std::vector<TLazyHook> s_LazyHooks;
+
+///
+/// \brief generate the real trampoline of a lazy hook and redirect the jump in the
+///        original function from the lazy stub to it
+///
+static void MaterializeHook(THookInfo &info)
+{
+  LPVOID trampoline = nullptr;
+  if (info.returnAddress != nullptr) {
+    trampoline = TrampolinePool::instance().storeTrampoline(info.replacementFunction
+                                                            , info.originalFunction
+                                                            , info.returnAddress
+                                                            , info.suppressible);
+  } else {
+    // the start of the function is overwritten already, use the copy
+    size_t rerouteOffset = 0;
+    trampoline = TrampolinePool::instance().storeTrampoline(info.replacementFunction
+                                                            , info.originalFunction
+                                                            , info.preamble.size()
+                                                            , &rerouteOffset
+                                                            , info.preamble.data()
+                                                            , info.suppressible);
+    info.detour = shared::AddrAdd(trampoline, rerouteOffset);
+  }
+
+  // other threads may be calling the function right now. Usually only the jump
+  // target has to change and that can be swapped in one store, pausing all
+  // threads is the fallback if it isn't aligned suitably
+  if (info.type == THookInfo::TYPE_RIPINDIRECT) {
+    uintptr_t pointer = reinterpret_cast<uintptr_t>(trampoline);
+    if (!WriteCodeAtomic(info.jumpAddress, reinterpret_cast<const uint8_t*>(&pointer),
+                         sizeof(pointer))) {
+      WriteCode(info.jumpAddress, reinterpret_cast<const uint8_t*>(&pointer), sizeof(pointer));
+    }
+  } else {
+    // the trampoline is from the same buffer region as the lazy stub so this
+    // is still in range of the 5-byte jump, only its rel32 changes
+    uint8_t code[5];
+    EncodeLongJump(info.jumpAddress, trampoline, code);
+    if (!WriteCodeAtomic(info.jumpAddress + 1, code + 1, sizeof(code) - 1)) {
+      WriteCode(info.jumpAddress, code, sizeof(code));
+    }
+  }
+  info.trampoline = trampoline;
+  info.pending = false;
+}
+
+///
+/// \brief called from a lazy stub on the first call of the hooked function
+/// \return address to continue the call at
+///
+static LPVOID __stdcall ResolveLazyHook(intptr_t id)
+{
+  DWORD lastError = ::GetLastError();
+  LPVOID result = nullptr;
+  {
+    std::lock_guard<std::recursive_mutex> lock(s_HooksMutex);
+    const TLazyHook &lazy = s_LazyHooks[static_cast<size_t>(id)];
+    auto iter = s_Hooks.find(lazy.handle);
+    if (iter == s_Hooks.end()) {
+      // the hook was removed while this call was on its way, the original
+      // function is restored by now
+      result = lazy.originalFunction;
+    } else {
+      if (iter->second.pending) {
+        MaterializeHook(iter->second);
+      }
+      result = iter->second.trampoline;
+    }
+  }
+  ::SetLastError(lastError);
+  return result;
+}
+
 static HOOKHANDLE GenerateHandle()
 {
   static ULONG NextHandle = 1;
@@ -520,10 +836,73 @@ static HOOKHANDLE GenerateHandle()
 }
 
 
+// plans of the hooks of this process, computed here or received via SetHookPlans
+static std::map<uint64_t, HookPlan> s_Plans;
+
+static uint8_t PlanBitness()
+{
+  return static_cast<uint8_t>(sizeof(void*) * 8);
+}
+
+///
+/// \brief find the plan for a function, provided the code it was made for is unchanged
+///
+static const HookPlan *FindPlan(LPBYTE address)
+{
+  auto iter = s_Plans.find(reinterpret_cast<uintptr_t>(address));
+  if (iter == s_Plans.end()) {
+    return nullptr;
+  }
+  const HookPlan &plan = iter->second;
+  if (((plan.preamble != PRE_PATCHFREE) && (plan.preamble != PRE_UNKNOWN))
+      || (plan.preambleSize > sizeof(plan.code))) {
+    return nullptr;
+  }
+  if ((memcmp(address - sizeof(plan.before), plan.before, sizeof(plan.before)) != 0)
+      || (memcmp(address, plan.code, sizeof(plan.code)) != 0)) {
+    // different dll version or someone else modified (hooked) it since
+    return nullptr;
+  }
+  return &plan;
+}
+
+static void RecordPlan(LPBYTE address, EPreamble preamble, bool jumpSpace, size_t size)
+{
+  HookPlan plan;
+  memset(&plan, 0, sizeof(plan));
+  plan.address = reinterpret_cast<uintptr_t>(address);
+  plan.preamble = static_cast<uint8_t>(preamble);
+  plan.jumpSpace = jumpSpace ? 1 : 0;
+  plan.preambleSize = static_cast<uint16_t>(size);
+  plan.bitness = PlanBitness();
+  memcpy(plan.before, address - sizeof(plan.before), sizeof(plan.before));
+  memcpy(plan.code, address, sizeof(plan.code));
+  s_Plans[plan.address] = plan;
+}
+
+
 HOOKHANDLE applyHook(THookInfo info, HookError *error)
 {
-  // apply the correct hook function depending on how the function start looks
-  EPreamble preamble = DeterminePreamble((LPBYTE)info.originalFunction);
+  std::lock_guard<std::recursive_mutex> lock(s_HooksMutex);
+  if (info.pending) {
+    info.lazyId = static_cast<int>(s_LazyHooks.size());
+    s_LazyHooks.push_back(TLazyHook{ INVALID_HOOK, info.originalFunction });
+  }
+
+  LPBYTE address = static_cast<LPBYTE>(info.originalFunction);
+
+  if (s_Batching && PatchPending(address)) {
+    // another hook in this batch modifies this function (or its jump space)
+    FlushPendingPatches();
+  }
+
+  // apply the correct hook function depending on how the function start looks.
+  // Hooking a function by a plan skips analysing its code
+  const HookPlan *plan = FindPlan(address);
+  EPreamble preamble = (plan != nullptr) ? static_cast<EPreamble>(plan->preamble)
+                                         : DeterminePreamble(address);
+  bool jumpSpace = (plan != nullptr) && (plan->jumpSpace != 0);
+  size_t size = (plan != nullptr) ? plan->preambleSize : 0;
 
   BOOL success = FALSE;
   switch (preamble) {
@@ -540,13 +919,29 @@ HOOKHANDLE applyHook(THookInfo info, HookError *error)
       success = HookChainHook(info, error);
     } break;
     default: {
-      success = HookDisasm(info, error);
+      if (plan == nullptr) {
+        success = AnalyzeDisasm(address, jumpSpace, size, error);
+      } else {
+        success = TRUE;
+      }
+      if (success) {
+        success = HookDisasm(info, jumpSpace, size, error);
+      }
     } break;
   }
 
   if (success == TRUE) {
+    // plans are only made for functions we hook first. Chaining depends on the
+    // state of the existing hook so that is always looked at again
+    if ((plan == nullptr)
+        && ((preamble == PRE_PATCHFREE) || (preamble == PRE_UNKNOWN))) {
+      RecordPlan(address, preamble, jumpSpace, size);
+    }
     HOOKHANDLE handle = GenerateHandle();
     s_Hooks[handle] = info;
+    if (info.lazyId >= 0) {
+      s_LazyHooks[info.lazyId].handle = handle;
+    }
     return handle;
   } else {
     return INVALID_HOOK;
@@ -566,6 +961,11 @@ HOOKHANDLE HookLib::InstallStub(LPVOID functionAddress, LPVOID stubAddress, Hook
   info.stub = true;
   info.detour = nullptr;
   info.trampoline = nullptr;
+  info.returnAddress = nullptr;
+  info.jumpAddress = nullptr;
+  info.lazyId = -1;
+  info.pending = false;
+  info.suppressible = true;
   info.type = THookInfo::TYPE_OVERWRITE;
 
   return applyHook(info, error);
@@ -579,7 +979,32 @@ HOOKHANDLE HookLib::InstallStub(HMODULE module, LPCSTR functionName, LPVOID stub
 }
 
 
-HOOKHANDLE HookLib::InstallHook(LPVOID functionAddress, LPVOID hookAddress, HookError *error)
+HOOKHANDLE HookLib::InstallHook(LPVOID functionAddress, LPVOID hookAddress, HookError *error,
+                                bool suppressible)
+{
+  if (functionAddress == nullptr) {
+    if (error != nullptr) *error = ERR_INVALIDPARAMETERS;
+    return INVALID_HOOK;
+  }
+  THookInfo info;
+  info.originalFunction = functionAddress;
+  info.replacementFunction = hookAddress;
+  info.stub = false;
+  info.detour = nullptr;
+  info.trampoline = nullptr;
+  info.returnAddress = nullptr;
+  info.jumpAddress = nullptr;
+  info.lazyId = -1;
+  info.pending = false;
+  info.suppressible = suppressible;
+  info.type = THookInfo::TYPE_OVERWRITE;
+
+  return applyHook(info, error);
+}
+
+
+HOOKHANDLE HookLib::InstallLazyHook(LPVOID functionAddress, LPVOID hookAddress, HookError *error,
+                                    bool suppressible)
 {
   if (functionAddress == nullptr) {
     if (error != nullptr) *error = ERR_INVALIDPARAMETERS;
@@ -591,6 +1016,11 @@ HOOKHANDLE HookLib::InstallHook(LPVOID functionAddress, LPVOID hookAddress, Hook
   info.stub = false;
   info.detour = nullptr;
   info.trampoline = nullptr;
+  info.returnAddress = nullptr;
+  info.jumpAddress = nullptr;
+  info.lazyId = -1;
+  info.pending = true;
+  info.suppressible = suppressible;
   info.type = THookInfo::TYPE_OVERWRITE;
 
   return applyHook(info, error);
@@ -606,6 +1036,7 @@ HOOKHANDLE HookLib::InstallHook(HMODULE module, LPCSTR functionName, LPVOID hook
 
 void HookLib::RemoveHook(HOOKHANDLE handle)
 {
+  std::lock_guard<std::recursive_mutex> lock(s_HooksMutex);
   auto iter = s_Hooks.find(handle);
   if (iter != s_Hooks.end()) {
     THookInfo info = iter->second;
@@ -676,6 +1107,55 @@ void HookLib::RemoveHook(HOOKHANDLE handle)
 }
 
 
+void HookLib::BeginHookBatch()
+{
+  std::lock_guard<std::recursive_mutex> lock(s_HooksMutex);
+  if (s_Batching) {
+    throw std::runtime_error("hook batch already active");
+  }
+  s_Batching = true;
+}
+
+
+size_t HookLib::EndHookBatch()
+{
+  std::lock_guard<std::recursive_mutex> lock(s_HooksMutex);
+  if (!s_Batching) {
+    throw std::runtime_error("no hook batch active");
+  }
+  s_Batching = false;
+  return FlushPendingPatches();
+}
+
+
+void HookLib::SetHookPlans(const std::vector<HookPlan> &plans)
+{
+  for (const HookPlan &plan : plans) {
+    if ((plan.bitness == PlanBitness())
+        && (plan.address <= std::numeric_limits<uintptr_t>::max())) {
+      s_Plans[plan.address] = plan;
+    }
+  }
+}
+
+
+std::vector<HookPlan> HookLib::GetHookPlans()
+{
+  std::vector<HookPlan> result;
+  result.reserve(s_Plans.size());
+  for (const auto &plan : s_Plans) {
+    result.push_back(plan.second);
+  }
+  return result;
+}
+
+
+bool HookLib::SuppressThreadHooks(bool suppressed)
+{
+  return TrampolinePool::setThreadSuppressed(suppressed);
+}
+
+
 const char *HookLib::GetErrorString(HookError err)
 {
   switch (err) {
@@ -692,6 +1172,7 @@ const char *HookLib::GetErrorString(HookError err)
 
 const char *HookLib::GetHookType(HOOKHANDLE handle)
 {
+  std::lock_guard<std::recursive_mutex> lock(s_HooksMutex);
   auto iter = s_Hooks.find(handle);
   if (iter != s_Hooks.end()) {
     THookInfo info = iter->second;
@@ -713,10 +1194,14 @@ const char *HookLib::GetHookType(HOOKHANDLE handle)
 
 LPVOID HookLib::GetDetour(HOOKHANDLE handle)
 {
+  std::lock_guard<std::recursive_mutex> lock(s_HooksMutex);
   auto iter = s_Hooks.find(handle);
   if (iter != s_Hooks.end()) {
-    THookInfo info = iter->second;
-    return info.detour;
+    if (iter->second.pending && (iter->second.detour == nullptr)) {
+      // the detour is part of the trampoline that doesn't exist yet
+      MaterializeHook(iter->second);
+    }
+    return iter->second.detour;
   }
   return nullptr;
 }
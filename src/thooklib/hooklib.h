@@ -22,6 +22,8 @@ along with usvfs. If not, see <http://www.gnu.org/licenses/>.
 
 #include <windows_sane.h>
 #include <map>
+#include <vector>
+#include <cstdint>
 
 namespace HookLib {
 
@@ -37,6 +39,26 @@ enum HookError {
 typedef ULONG HOOKHANDLE;
 static const HOOKHANDLE INVALID_HOOK = (HOOKHANDLE)-1;
 
+///
+/// \brief result of analysing a function for hooking. System dlls are mapped to the
+///        same address in all processes of a session so a plan made in one process lets
+///        others hook the function without disassembling it again. A plan is only used
+///        if the code around the function is still identical to when it was made.
+///        The layout is fixed since plans are exchanged between 32-bit and 64-bit
+///        processes
+///
+struct HookPlan {
+  uint64_t address;      // address of the function
+  uint8_t preamble;      // how the function start looked (internal to hooklib)
+  uint8_t jumpSpace;     // 1 if there is room for a jump in front of the function
+  uint16_t preambleSize; // number of bytes moved to the detour
+  uint8_t bitness;       // 32 or 64, plans only apply to processes of the same bitness
+  uint8_t reserved[3];
+  uint8_t before[16];    // code in front of the function
+  uint8_t code[24];      // code at the start of the function
+};
+static_assert(sizeof(HookPlan) == 56, "hook plans are shared between 32-bit and 64-bit processes");
+
 ///
 /// \brief install a stub (function to be called before the target function)
 /// \param functionAddress address of the function to stub
@@ -63,9 +85,25 @@ HOOKHANDLE InstallStub(HMODULE module, LPCSTR functionName, LPVOID stubAddress,
 /// \param functionAddress address of the function to hook
 /// \param hookAddress address of the replacement function. This function has to have the exact same signature as the replaced function
 /// \param error (optional) if set, the referenced variable will receive an error code describing the problem (if any)
+/// \param suppressible if false the hook is also entered on threads that called SuppressThreadHooks
 /// \return a handle to reference the hook in later operations or INVALID_HOOK on error
 ///
-HOOKHANDLE InstallHook(LPVOID functionAddress, LPVOID hookAddress, HookError *error = nullptr);
+HOOKHANDLE InstallHook(LPVOID functionAddress, LPVOID hookAddress, HookError *error = nullptr,
+                       bool suppressible = true);
+
+///
+/// \brief install a hook whose trampoline is only generated on the first call of the function.
+///        Until then the function jumps to a small placeholder. This is meant for functions
+///        that many processes never call
+/// \param functionAddress address of the function to hook
+/// \param hookAddress address of the replacement function. This function has to have the exact same signature as the replaced function
+/// \param error (optional) if set, the referenced variable will receive an error code describing the problem (if any)
+/// \param suppressible if false the hook is also entered on threads that called SuppressThreadHooks
+/// \return a handle to reference the hook in later operations or INVALID_HOOK on error
+/// \note on x86 only stdcall and cdecl functions can be hooked lazily
+///
+HOOKHANDLE InstallLazyHook(LPVOID functionAddress, LPVOID hookAddress, HookError *error = nullptr,
+                           bool suppressible = true);
 
 ///
 /// \brief install a hook (function replacing the existing functionality of the function)
@@ -96,6 +134,44 @@ const char *GetHookType(HOOKHANDLE handle);
 ///
 LPVOID GetDetour(HOOKHANDLE handle);
 
+///
+/// \brief start installing hooks as a batch. Until EndHookBatch is called, hooks are
+///        prepared (targets disassembled, trampolines generated) but the functions
+///        themselves aren't patched yet. Batches can't be nested
+///
+void BeginHookBatch();
+
+///
+/// \brief apply all hooks installed since BeginHookBatch. Every affected page has its
+///        protection changed once and all other threads of the process are suspended
+///        a single time while the patches are written
+/// \return number of code locations patched
+/// \note threads created after the batch ends see all hooks, threads created while
+///       it's applied may not be suspended
+///
+size_t EndHookBatch();
+
+///
+/// \brief make plans (usually from another process) available for hooks installed from
+///        now on. Plans for another bitness are ignored
+///
+void SetHookPlans(const std::vector<HookPlan> &plans);
+
+///
+/// \brief retrieve the plans of all functions hooked so far, including those hooked
+///        by a plan passed to SetHookPlans
+///
+std::vector<HookPlan> GetHookPlans();
+
+///
+/// \brief suppress the hooks on the calling thread. While suppressed, calls to functions
+///        hooked as suppressible (the default) go straight to the original code, the
+///        replacement functions aren't entered at all
+/// \param suppressed the new state
+/// \return the previous state
+///
+bool SuppressThreadHooks(bool suppressed);
+
 ///
 /// \brief resolve an error code to a descriptive string
 /// \param err the error code to resolve
@@ -39,6 +39,8 @@ namespace HookLib {
 
 
 TrampolinePool *TrampolinePool::s_Instance = nullptr;
+thread_local bool TrampolinePool::s_ThreadSuppressed = false;
+thread_local LPVOID TrampolinePool::s_ThreadGuards[TrampolinePool::MAX_BARRIERS] = {};
 
 
 TrampolinePool::TrampolinePool()
@@ -50,7 +52,10 @@ TrampolinePool::TrampolinePool()
   SYSTEM_INFO sysInfo;
   ::ZeroMemory(&sysInfo, sizeof(SYSTEM_INFO));
   GetSystemInfo(&sysInfo);
-  m_BufferSize = sysInfo.dwPageSize;
+  // one slab per allocation granule. VirtualAlloc reserves whole granules anyway
+  // so anything smaller only wastes address space and adds more regions to probe
+  m_BufferSize = sysInfo.dwAllocationGranularity;
+  m_Granularity = sysInfo.dwAllocationGranularity;
 
   // if search range = ffffff then addressmask = ffffffffff000000
   // => all jumps between xxxxxxxxxx000000 and xxxxxxxxxxffffff will use the same buffer
@@ -72,66 +77,70 @@ void TrampolinePool::initialize()
 
 void TrampolinePool::setBlock(bool block) {
   m_FullBlock = block;
-  if (m_ThreadGuards.get() == nullptr) {
-    m_ThreadGuards.reset(new TThreadMap());
-  }
 }
 
 #if BOOST_ARCH_X86_64
-// push all registers (except rax) and flags to the stack
-static void pushAll(X86Assembler &assembler)
+// barrier, release and stubs are regular compiled functions so they preserve
+// the non-volatile registers themselves. Only the argument registers of the
+// hooked function have to survive calls to them. This is used at the start of
+// the trampoline where rsp is 8 off the 16 byte alignment, the frame holds
+// xmm0-xmm3, the shadow space and 8 bytes to align rsp for the call
+static const int ARGUMENT_FRAME = 4 * 16 + 32 + 8;
+
+static void saveArguments(X86Assembler &assembler, int frame = ARGUMENT_FRAME)
 {
-  assembler.pushf();
   assembler.push(rcx);
   assembler.push(rdx);
-  assembler.push(rbx);
-  assembler.push(rbp);
-  assembler.push(rsi);
-  assembler.push(rdi);
   assembler.push(r8);
   assembler.push(r9);
-  assembler.push(r10);
-  assembler.push(r11);
-  assembler.push(r12);
-  assembler.push(r13);
-  assembler.push(r14);
-  assembler.push(r15);
+  assembler.sub(rsp, frame);
+  assembler.movdqu(ptr(rsp, 32), xmm0);
+  assembler.movdqu(ptr(rsp, 48), xmm1);
+  assembler.movdqu(ptr(rsp, 64), xmm2);
+  assembler.movdqu(ptr(rsp, 80), xmm3);
 }
 
-// pop all registers (except rax) and flags from stack
-static void popAll(X86Assembler &assembler)
+static void restoreArguments(X86Assembler &assembler, int frame = ARGUMENT_FRAME)
 {
-  assembler.pop(r15);
-  assembler.pop(r14);
-  assembler.pop(r13);
-  assembler.pop(r12);
-  assembler.pop(r11);
-  assembler.pop(r10);
+  assembler.movdqu(xmm3, ptr(rsp, 80));
+  assembler.movdqu(xmm2, ptr(rsp, 64));
+  assembler.movdqu(xmm1, ptr(rsp, 48));
+  assembler.movdqu(xmm0, ptr(rsp, 32));
+  assembler.add(rsp, frame);
   assembler.pop(r9);
   assembler.pop(r8);
-  assembler.pop(rdi);
-  assembler.pop(rsi);
-  assembler.pop(rbp);
-  assembler.pop(rbx);
   assembler.pop(rdx);
   assembler.pop(rcx);
-  assembler.popf();
 }
+
+// after the replacement function returned only its result needs to survive the
+// call to release. rax is already pushed at that point so rsp is 8 off the
+// alignment, the frame holds xmm0, the shadow space and 8 bytes
+static const int RESULT_FRAME = 16 + 32 + 8;
 #endif // BOOST_ARCH_X86_64
 
 
-void TrampolinePool::addBarrier(LPVOID rerouteAddr, LPVOID original, X86Assembler &assembler)
+void TrampolinePool::addBarrier(LPVOID rerouteAddr, LPVOID, X86Assembler &assembler,
+                                bool suppressible)
 {
   Label skipLabel = assembler.newLabel();
 
+  // the barrier functions identify the trampoline by its slot in the guard array,
+  // whether thread suppression applies to it is decided here once
+  if (m_NextBarrier >= MAX_BARRIERS) {
+    throw std::runtime_error("too many trampolines with barrier");
+  }
+  intptr_t slot = m_NextBarrier++;
+  if (suppressible) {
+    slot |= SUPPRESSIBLE_SLOT;
+  }
+
 #if BOOST_ARCH_X86_64
-  pushAll(assembler);
-  assembler.mov(rcx, imm(reinterpret_cast<int64_t>(original))); // set call parameter for call to barrier function
+  saveArguments(assembler);
+  assembler.mov(rcx, imm(static_cast<int64_t>(slot))); // set call parameter for call to barrier function
   assembler.mov(rax, imm((intptr_t)(void*)barrier));
-  assembler.sub(rsp, 32);
   assembler.call(rax);
-  assembler.add(rsp, 32);
-  popAll(assembler);
+  restoreArguments(assembler);
   // test barrier
   assembler.cmp(rax, 0);                                // test if the barrier is locked
   assembler.jz(skipLabel);                              // skip if barrier was locked
@@ -147,19 +156,19 @@ void TrampolinePool::addBarrier(LPVOID rerouteAddr, LPVOID original, X86Assemble
   assembler.push(rax);                                  // save away result
 
   // open the barrier again
-  pushAll(assembler);
-  assembler.mov(rcx, imm(reinterpret_cast<int64_t>(original)));
+  assembler.sub(rsp, RESULT_FRAME);
+  assembler.movdqu(ptr(rsp, 32), xmm0);                 // in case the result is a floating point value
+  assembler.mov(rcx, imm(static_cast<int64_t>(slot)));
   assembler.mov(rax, imm((intptr_t)(void*)release));
-  assembler.sub(rsp, 32);
   assembler.call(rax);
-  assembler.add(rsp, 32);
-  popAll(assembler);
+  assembler.movdqu(xmm0, ptr(rsp, 32));
+  assembler.add(rsp, RESULT_FRAME);
   assembler.pop(r10);                                   // get the result from the replacement function to a register
   assembler.push(rax);                                  // push the original return address back on the stack
   assembler.mov(rax, r10);                              // move result of actual call to rax
   assembler.ret();                                      // return, using the original return address
 #else // BOOST_ARCH_X86_64
-  assembler.push(imm(void_ptr_cast<int32_t>(original)));      // push original function, as parameter to barrier
+  assembler.push(imm(static_cast<int32_t>(slot)));     // push the guard slot, as parameter to barrier
   assembler.mov(ecx, (Ptr)static_cast<void*>(TrampolinePool::barrier));
   assembler.call(ecx);                                  // call barrier function
   assembler.cmp(eax, 0);
@@ -174,7 +183,7 @@ void TrampolinePool::addBarrier(LPVOID rerouteAddr, LPVOID original, X86Assemble
                                                         // (this function gets the parameters that were on the stack already and cleans
                                                         //  them up itself (stdcall convention))
   assembler.push(eax);                                  // save away result
-  assembler.push(imm(void_ptr_cast<int32_t>(original))); // open the barrier again
+  assembler.push(imm(static_cast<int32_t>(slot)));     // open the barrier again
   assembler.mov(eax, (Ptr)static_cast<void*>(TrampolinePool::release));
   assembler.call(eax);
   assembler.pop(ecx);                                   // pop the result from the actual call to ecx
@@ -188,6 +197,12 @@ void TrampolinePool::addBarrier(LPVOID rerouteAddr, LPVOID original, X86Assemble
 }
 
 
+uintptr_t TrampolinePool::alignUp(uintptr_t address) const
+{
+  return (address + m_Granularity - 1) & ~static_cast<uintptr_t>(m_Granularity - 1);
+}
+
+
 LPVOID TrampolinePool::roundAddress(LPVOID address) const
 {
   return reinterpret_cast<LPVOID>(reinterpret_cast<intptr_t>(address) & m_AddressMask);
@@ -257,7 +272,8 @@ LPVOID TrampolinePool::storeStub(LPVOID reroute, LPVOID original, LPVOID returnA
 }
 
 
-LPVOID TrampolinePool::storeTrampoline(LPVOID reroute, LPVOID original, LPVOID returnAddress)
+LPVOID TrampolinePool::storeTrampoline(LPVOID reroute, LPVOID original, LPVOID returnAddress,
+                                       bool suppressible)
 {
   BufferList &bufferList = getBufferList(original);
   // first test to increase likelyhood we don't have to reallocate later
@@ -274,10 +290,9 @@ LPVOID TrampolinePool::storeTrampoline(LPVOID reroute, LPVOID original, LPVOID r
 
   JitRuntime runtime;
   X86Assembler assembler(&runtime);
-  addBarrier(reroute, original, assembler);
+  addBarrier(reroute, original, assembler, suppressible);
 #if BOOST_ARCH_X86_64
-  assembler.mov(rax, imm((intptr_t)(void*)(returnAddress)));
-  assembler.jmp(rax);
+  addAbsoluteJump(assembler, reinterpret_cast<uint64_t>(returnAddress));
 #else
   assembler.mov(eax, imm((intptr_t)(void*)(returnAddress)));
   assembler.jmp(eax);
@@ -292,7 +307,7 @@ LPVOID TrampolinePool::storeTrampoline(LPVOID reroute, LPVOID original, LPVOID r
     // can't place function in buffer, allocate another and try again
     allocateBuffer(original);
     // we could relocate the code and the data but this is simpler
-    return storeTrampoline(reroute, original, returnAddress);
+    return storeTrampoline(reroute, original, returnAddress, suppressible);
   }
 
   // adjust relative jumps for move to buffer
@@ -308,11 +323,12 @@ LPVOID TrampolinePool::storeTrampoline(LPVOID reroute, LPVOID original, LPVOID r
 
 
 #if BOOST_ARCH_X86_64
-void TrampolinePool::copyCode(X86Assembler &assembler, LPVOID source, size_t numBytes)
+void TrampolinePool::copyCode(X86Assembler &assembler, const void *source, size_t numBytes, LPVOID address)
 {
   static UDis86Wrapper disasm;
 
-  disasm.setInputBuffer(static_cast<const uint8_t*>(source), numBytes);
+  disasm.setInputBuffer(static_cast<const uint8_t*>(source), numBytes,
+                        reinterpret_cast<uint64_t>(address));
 
   size_t offset = 0;
 
@@ -338,13 +354,11 @@ void TrampolinePool::copyCode(X86Assembler &assembler, LPVOID source, size_t num
 void TrampolinePool::addCallToStub(X86Assembler &assembler, LPVOID original, LPVOID reroute)
 {
 #if BOOST_ARCH_X86_64
-  pushAll(assembler);
+  saveArguments(assembler);
   assembler.mov(rcx, imm(reinterpret_cast<int64_t>(original)));
   assembler.mov(rax, imm((intptr_t)(LPVOID)reroute));
-  assembler.sub(rsp, 32);
   assembler.call(rax);
-  assembler.add(rsp, 32);
-  popAll(assembler);
+  restoreArguments(assembler);
 #else // BOOST_ARCH_X86_64
   assembler.push(reinterpret_cast<int64_t>(original));
   assembler.mov(ecx, imm((intptr_t)(LPVOID)reroute));
@@ -357,12 +371,11 @@ void TrampolinePool::addCallToStub(X86Assembler &assembler, LPVOID original, LPV
 void TrampolinePool::addAbsoluteJump(X86Assembler &assembler, uint64_t destination)
 {
 #if BOOST_ARCH_X86_64
-  assembler.push(rax);
-  assembler.push(rax);
-  assembler.mov(rax, imm(destination));
-  assembler.mov(ptr(rsp, 8), rax);
-  assembler.pop(rax);
-  assembler.ret();
+  // jmp qword ptr [rip], followed by the destination. Modifies no register and
+  // unlike push/ret doesn't throw off the return address prediction
+  uint8_t code[14] = { 0xFF, 0x25, 0x00, 0x00, 0x00, 0x00 };
+  memcpy(code + 6, &destination, sizeof(destination));
+  assembler.embed(code, sizeof(code));
 #else // BOOST_ARCH_X86_64
   assembler.push(imm(destination));
   assembler.ret();
@@ -390,7 +403,7 @@ LPVOID TrampolinePool::storeStub(LPVOID reroute, LPVOID original, size_t preambl
 #if BOOST_ARCH_X86_64
   // insert backup code
   *rerouteOffset = assembler.getCodeSize();
-  copyCode(assembler, original, preambleSize);
+  copyCode(assembler, original, preambleSize, original);
 #else // BOOST_ARCH_X86_64
   assembler.embed(original, preambleSize);
 #endif // BOOST_ARCH_X86_64
@@ -418,8 +431,13 @@ LPVOID TrampolinePool::storeStub(LPVOID reroute, LPVOID original, size_t preambl
 }
 
 
-LPVOID TrampolinePool::storeTrampoline(LPVOID reroute, LPVOID original, size_t preambleSize, size_t *rerouteOffset)
+LPVOID TrampolinePool::storeTrampoline(LPVOID reroute, LPVOID original, size_t preambleSize, size_t *rerouteOffset,
+                                       const void *preamble, bool suppressible)
 {
+  if (preamble == nullptr) {
+    preamble = original;
+  }
+
   BufferList &bufferList = getBufferList(original);
   // first test to increase likelyhood we don't have to reallocate later
   if (bufferList.offset + m_MaxTrampolineSize > m_BufferSize) {
@@ -435,10 +453,10 @@ LPVOID TrampolinePool::storeTrampoline(LPVOID reroute, LPVOID original, size_t p
 
   JitRuntime runtime;
   X86Assembler assembler(&runtime);
-  addBarrier(reroute, original, assembler);
+  addBarrier(reroute, original, assembler, suppressible);
   // insert backup code
   *rerouteOffset = assembler.getCodeSize();
-  assembler.embed(original, static_cast<uint32_t>(preambleSize));
+  assembler.embed(preamble, static_cast<uint32_t>(preambleSize));
   addAbsoluteJump(assembler, reinterpret_cast<uint64_t>(original) + preambleSize);
 
   // adjust relative jumps for move to buffer
@@ -456,7 +474,8 @@ LPVOID TrampolinePool::storeTrampoline(LPVOID reroute, LPVOID original, size_t p
     // can't place function in buffer, allocate another and try again
     allocateBuffer(original);
     // we could relocate the code and the data but this is simpler
-    return storeTrampoline(reroute, original, preambleSize, rerouteOffset);
+    return storeTrampoline(reroute, original, preambleSize, rerouteOffset, preamble,
+                           suppressible);
   }
 
   // copy code to buffer
@@ -467,6 +486,79 @@ LPVOID TrampolinePool::storeTrampoline(LPVOID reroute, LPVOID original, size_t p
   return spot;
 }
 
+LPVOID TrampolinePool::storeLazyResolver(LPVOID addressNear, LazyResolveFunc resolve)
+{
+  JitRuntime runtime;
+  X86Assembler assembler(&runtime);
+#if BOOST_ARCH_X86_64
+  // the lazy stub pushed the id on top of the return address so rsp is aligned here
+  static const int RESOLVER_FRAME = ARGUMENT_FRAME - 8;
+  saveArguments(assembler, RESOLVER_FRAME);
+  assembler.mov(rcx, ptr(rsp, RESOLVER_FRAME + 32));    // the id pushed by the stub
+  assembler.mov(rax, imm((intptr_t)(void*)resolve));
+  assembler.call(rax);
+  restoreArguments(assembler, RESOLVER_FRAME);
+  assembler.add(rsp, 8);                               // drop the id
+  assembler.jmp(rax);                                  // continue at the real trampoline
+#else // BOOST_ARCH_X86_64
+  // the id pushed by the stub is the parameter, resolve is stdcall so it removes it
+  assembler.mov(eax, (Ptr)static_cast<void*>(resolve));
+  assembler.call(eax);
+  assembler.jmp(eax);                                  // continue at the real trampoline
+#endif // BOOST_ARCH_X86_64
+
+  size_t codeSize = assembler.getCodeSize();
+  BufferList &bufferList = getBufferList(addressNear);
+  if ((bufferList.offset + codeSize) > m_BufferSize) {
+    allocateBuffer(addressNear);
+  }
+  LPVOID spot = AddrAdd(*bufferList.buffers.rbegin(), bufferList.offset);
+  codeSize = static_cast<size_t>(assembler.relocCode(spot));
+  bufferList.offset += codeSize;
+  return spot;
+}
+
+LPVOID TrampolinePool::storeLazyStub(LPVOID original, intptr_t id, LazyResolveFunc resolve)
+{
+  if (m_LazyResolver == nullptr) {
+    m_LazyResolver = storeLazyResolver(original, resolve);
+  }
+
+  // push id, then jump to the resolver. This is written directly since it's
+  // the same few bytes for every stub
+#if BOOST_ARCH_X86_64
+  static const size_t STUB_SIZE = 5 + 14;
+#else
+  static const size_t STUB_SIZE = 5 + 5;
+#endif
+  BufferList &bufferList = getBufferList(original);
+  if ((bufferList.offset + STUB_SIZE) > m_BufferSize) {
+    allocateBuffer(original);
+  }
+  LPBYTE spot = static_cast<LPBYTE>(AddrAdd(*bufferList.buffers.rbegin(), bufferList.offset));
+
+  uint8_t code[STUB_SIZE];
+  int32_t pushedId = static_cast<int32_t>(id);
+  code[0] = 0x68;
+  memcpy(code + 1, &pushedId, sizeof(pushedId));
+#if BOOST_ARCH_X86_64
+  // jmp qword ptr [rip]
+  uint64_t resolver = reinterpret_cast<uint64_t>(m_LazyResolver);
+  code[5] = 0xFF;
+  code[6] = 0x25;
+  memset(code + 7, 0, 4);
+  memcpy(code + 11, &resolver, sizeof(resolver));
+#else
+  int32_t distance = reinterpret_cast<int32_t>(m_LazyResolver)
+                     - reinterpret_cast<int32_t>(spot + STUB_SIZE);
+  code[5] = 0xE9;
+  memcpy(code + 6, &distance, sizeof(distance));
+#endif
+  memcpy(spot, code, STUB_SIZE);
+  bufferList.offset += STUB_SIZE;
+  return spot;
+}
+
 LPVOID TrampolinePool::currentBufferAddress(LPVOID addressNear)
 {
   LPVOID rounded = roundAddress(addressNear);
@@ -485,11 +577,9 @@ LPVOID TrampolinePool::currentBufferAddress(LPVOID addressNear)
 
 void TrampolinePool::forceUnlockBarrier()
 {
-  if (m_ThreadGuards.get() != nullptr) {
-    for (auto funcId : *m_ThreadGuards) {
-      (*m_ThreadGuards)[funcId.first] = nullptr;
-    }
-  } // else no barriers to unlock
+  for (LPVOID &guard : s_ThreadGuards) {
+    guard = nullptr;
+  }
 }
 
 TrampolinePool::BufferMap::iterator TrampolinePool::allocateBuffer(LPVOID addressNear)
@@ -505,7 +595,7 @@ TrampolinePool::BufferMap::iterator TrampolinePool::allocateBuffer(LPVOID addres
   if (iter->second.buffers.size() > 0) {
     // start searching were we last found a buffer
     lowerEnd = reinterpret_cast<uintptr_t>(*iter->second.buffers.rbegin())
-               + sysInfo.dwPageSize;
+               + m_BufferSize;
   }
 
   uintptr_t start = std::max(
@@ -515,13 +605,21 @@ TrampolinePool::BufferMap::iterator TrampolinePool::allocateBuffer(LPVOID addres
   uintptr_t end = std::min(upperEnd, reinterpret_cast<uintptr_t>(
                                          sysInfo.lpMaximumApplicationAddress));
 
+  // walk the address space region by region instead of probing every granule
+  // with VirtualAlloc, only free regions large enough for a slab are tried
   LPVOID buffer = nullptr;
-  for (uintptr_t cur = start; cur < end; cur += sysInfo.dwPageSize) {
-    buffer = VirtualAlloc(reinterpret_cast<LPVOID>(cur), m_BufferSize,
-                          MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
-    if (buffer != nullptr) {
+  uintptr_t cur = alignUp(start);
+  while ((cur < end) && (buffer == nullptr)) {
+    MEMORY_BASIC_INFORMATION info;
+    if (VirtualQuery(reinterpret_cast<LPVOID>(cur), &info, sizeof(info)) == 0) {
       break;
     }
+    uintptr_t regionEnd = reinterpret_cast<uintptr_t>(info.BaseAddress) + info.RegionSize;
+    if ((info.State == MEM_FREE) && (regionEnd >= cur + m_BufferSize)) {
+      buffer = VirtualAlloc(reinterpret_cast<LPVOID>(cur), m_BufferSize,
+                            MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+    }
+    cur = std::max(alignUp(regionEnd), cur + m_Granularity);
   }
   if (buffer == nullptr) {
     throw std::runtime_error("failed to allocate buffer in range");
@@ -542,59 +640,50 @@ TrampolinePool::BufferMap::iterator TrampolinePool::allocateBuffer(LPVOID addres
   return iter;
 }
 
-LPVOID TrampolinePool::barrier(LPVOID function)
+bool TrampolinePool::setThreadSuppressed(bool suppressed)
 {
-  DWORD err = GetLastError();
-  LPVOID res = instance().barrierInt(function);
-  SetLastError(err);
-  return res;
+  bool previous = s_ThreadSuppressed;
+  s_ThreadSuppressed = suppressed;
+  return previous;
 }
 
-LPVOID TrampolinePool::release(LPVOID function)
+LPVOID TrampolinePool::barrier(intptr_t slot)
 {
-  DWORD err = GetLastError();
-  LPVOID res = instance().releaseInt(function);
-  SetLastError(err);
-  return res;
+  // suppressed threads skip suppressible hooks without touching the guards.
+  // Nothing here calls into the system so the last error stays untouched
+  if (s_ThreadSuppressed && ((slot & SUPPRESSIBLE_SLOT) != 0)) {
+    return nullptr;
+  }
+  return instance().barrierInt(slot & ~SUPPRESSIBLE_SLOT);
+}
+
+LPVOID TrampolinePool::release(intptr_t slot)
+{
+  return instance().releaseInt(slot & ~SUPPRESSIBLE_SLOT);
 }
 
-LPVOID TrampolinePool::barrierInt(LPVOID func)
+LPVOID TrampolinePool::barrierInt(intptr_t slot)
 {
   if (m_FullBlock) {
     return nullptr;
   }
 
-  if (m_ThreadGuards.get() == nullptr) {
-    m_ThreadGuards.reset(new TThreadMap());
-  }
-
-  auto iter = m_ThreadGuards->find(func);
-  if ((iter == m_ThreadGuards->end()) || (iter->second == nullptr)) {
-    (*m_ThreadGuards)[func] = reinterpret_cast<LPVOID>(1);
-    return &(*m_ThreadGuards)[func];
+  // the guard holds the return address of the hooked call while the replacement
+  // function runs, any other call on this thread goes straight to the original
+  LPVOID &guard = s_ThreadGuards[slot];
+  if (guard == nullptr) {
+    guard = reinterpret_cast<LPVOID>(1);
+    return &guard;
   } else {
     return nullptr;
   }
 }
 
-LPVOID TrampolinePool::releaseInt(LPVOID func)
+LPVOID TrampolinePool::releaseInt(intptr_t slot)
 {
-  DWORD lastError = GetLastError();
-  if (m_ThreadGuards.get() == nullptr) {
-    m_ThreadGuards.reset(new TThreadMap());
-  }
-
-  auto iter = m_ThreadGuards->find(func);
-  if (iter == m_ThreadGuards->end()) {
-    spdlog::get("hooks")->error("failed to release barrier for func {}", func);
-    ::SetLastError(lastError);
-    return nullptr;
-  }
-
-  LPVOID res = (*m_ThreadGuards)[func];
-  (*m_ThreadGuards)[func] = nullptr;
-
-  ::SetLastError(lastError);
+  LPVOID &guard = s_ThreadGuards[slot];
+  LPVOID res = guard;
+  guard = nullptr;
   return res;
 }
 
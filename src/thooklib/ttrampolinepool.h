@@ -87,9 +87,11 @@ public:
   /// \param reroute the reroute function
   /// \param original original function
   /// \param returnAddress address under which the original functionality can be reached.
+  /// \param suppressible if false the trampoline ignores setThreadSuppressed
   /// \return address of the trampoline function
   ///
-  LPVOID storeTrampoline(LPVOID reroute, LPVOID original, LPVOID returnAddress);
+  LPVOID storeTrampoline(LPVOID reroute, LPVOID original, LPVOID returnAddress,
+                         bool suppressible = true);
 
   ///
   /// store a trampoline, copying a part of the original function to the trampoline. This
@@ -98,9 +100,28 @@ public:
   /// \param original original function
   /// \param preambleSize number of bytes from the original function to backup. Needs to correspond to complete instructions
   /// \param rerouteOffset offset in bytes from the created trampoline to the preamble that leads us back to the original code
+  /// \param preamble (optional) copy of the start of the original function to use instead of the
+  ///                 function itself, if that has been overwritten already
+  /// \param suppressible if false the trampoline ignores setThreadSuppressed
   /// \return address of the trampoline function
   ///
-  LPVOID storeTrampoline(LPVOID reroute, LPVOID original, size_t preambleSize, size_t *rerouteOffset);
+  LPVOID storeTrampoline(LPVOID reroute, LPVOID original, size_t preambleSize, size_t *rerouteOffset,
+                         const void *preamble = nullptr, bool suppressible = true);
+
+  typedef LPVOID (__stdcall *LazyResolveFunc)(intptr_t id);
+
+  ///
+  /// store a placeholder for a trampoline that is only generated on the first call. The
+  /// placeholder calls resolve with the specified id, which has to generate the real
+  /// trampoline, and continues at the address resolve returns with the original arguments
+  /// \param original the original function
+  /// \param id value passed to resolve
+  /// \param resolve function to call. All lazy stubs share the same resolve function
+  /// \return address of the placeholder
+  /// \note the argument registers are preserved, on x86 ecx and edx aren't so this
+  ///       only supports stdcall and cdecl functions there
+  ///
+  LPVOID storeLazyStub(LPVOID original, intptr_t id, LazyResolveFunc resolve);
 
   ///
   /// \param addressNear used to find a trampoline buffer near the jump instruction
@@ -113,6 +134,14 @@ public:
   ///
   void forceUnlockBarrier();
 
+  ///
+  /// \brief while suppressed, the barrier of every suppressible trampoline is closed for
+  ///        the calling thread so the original code is executed without entering the
+  ///        replacement
+  /// \return the previous state
+  ///
+  static bool setThreadSuppressed(bool suppressed);
+
 private:
 
   struct BufferList {
@@ -138,23 +167,30 @@ private:
    */
   BufferMap::iterator allocateBuffer(LPVOID addressNear);
 
-  void addBarrier(LPVOID rerouteAddr, LPVOID original, asmjit::X86Assembler &assembler);
+  void addBarrier(LPVOID rerouteAddr, LPVOID original, asmjit::X86Assembler &assembler,
+                  bool suppressible);
+
+  // generates the code shared by all lazy stubs
+  LPVOID storeLazyResolver(LPVOID addressNear, LazyResolveFunc resolve);
 
 #if BOOST_ARCH_X86_64
-  void copyCode(asmjit::X86Assembler &assembler, LPVOID source, size_t numBytes);
+  void copyCode(asmjit::X86Assembler &assembler, const void *source, size_t numBytes, LPVOID address);
 #endif // BOOST_ARCH_X86_64
 
   BufferList &getBufferList(LPVOID address);
 
   LPVOID roundAddress(LPVOID address) const;
 
+  // round up to the allocation granularity
+  uintptr_t alignUp(uintptr_t address) const;
+
 public:
 
-  static LPVOID __stdcall barrier(LPVOID function);
-  static LPVOID __stdcall release(LPVOID function);
+  static LPVOID __stdcall barrier(intptr_t slot);
+  static LPVOID __stdcall release(intptr_t slot);
 
-  LPVOID barrierInt(LPVOID function);
-  LPVOID releaseInt(LPVOID function);
+  LPVOID barrierInt(intptr_t slot);
+  LPVOID releaseInt(intptr_t slot);
 
   void addCallToStub(asmjit::X86Assembler &assembler, LPVOID original, LPVOID reroute);
 
@@ -164,7 +200,8 @@ private:
   /// \brief add a jump to an address outside the custom generated asm code (without modifying registers)
   /// \param assembler the assembler generator to write to
   /// \param destination destination address
-  /// \note this currently generates a lot code on x64, may be overly complicated
+  /// \note on x64 this is a rip-relative indirect jump with the destination stored
+  ///       right behind it
   ///
   void addAbsoluteJump(asmjit::X86Assembler &assembler, uint64_t destination);
 
@@ -180,17 +217,38 @@ private:
 
   static TrampolinePool *s_Instance;
 
+  // checked before anything else in the barrier, so it has to stay a plain
+  // thread_local that needs no construction
+  static thread_local bool s_ThreadSuppressed;
+
   bool m_FullBlock {false};
 
   BufferMap m_Buffers;
 
-  typedef std::map<void*, void*> TThreadMap;
-  boost::thread_specific_ptr<TThreadMap> m_ThreadGuards;
+  // maximum number of trampolines with a barrier, each gets a slot in the
+  // per-thread guard array
+  static const int MAX_BARRIERS = 256;
+
+  // set in the slot the trampoline passes to barrier and release if the trampoline
+  // is closed while the thread is suppressed. Fits the 32-bit immediate on x86
+  static const intptr_t SUPPRESSIBLE_SLOT = 0x10000;
+
+  // per thread and trampoline either null (barrier open), 1 (locked) or the
+  // return address of the hooked call. Like s_ThreadSuppressed this needs no
+  // construction and no allocation
+  static thread_local LPVOID s_ThreadGuards[MAX_BARRIERS];
+
+  int m_NextBarrier {0};
+
+  // shared code called by all lazy stubs
+  LPVOID m_LazyResolver {nullptr};
 
   LPVOID m_BarrierAddr;
   LPVOID m_ReleaseAddr;
 
-  DWORD m_BufferSize = { 1024 };
+  // size of a slab, trampolines near the same address are bump-allocated from it
+  DWORD m_BufferSize = { 65536 };
+  DWORD m_Granularity = { 65536 };
   size_t m_SearchRange;
   uint64_t m_AddressMask;
 
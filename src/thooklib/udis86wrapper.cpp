@@ -44,6 +44,13 @@ void UDis86Wrapper::setInputBuffer(const uint8_t *buffer, size_t size)
   ud_set_pc(&m_Obj, reinterpret_cast<uint64_t>(m_Buffer));
 }
 
+void UDis86Wrapper::setInputBuffer(const uint8_t *buffer, size_t size, uint64_t address)
+{
+  m_Buffer = buffer;
+  ud_set_input_buffer(&m_Obj, buffer, size);
+  ud_set_pc(&m_Obj, address);
+}
+
 ud_t &UDis86Wrapper::obj()
 {
   return m_Obj;
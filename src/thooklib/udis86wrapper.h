@@ -33,6 +33,12 @@ public:
 
   void setInputBuffer(const uint8_t *buffer, size_t size);
 
+  ///
+  /// disassemble a copy of code as if it was located at address, so relative jumps
+  /// are resolved against the original location
+  ///
+  void setInputBuffer(const uint8_t *buffer, size_t size, uint64_t address);
+
   ud_t &obj();
 
   operator ud_t*() { return &m_Obj; }
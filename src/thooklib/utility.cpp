@@ -20,62 +20,180 @@ along with usvfs. If not, see <http://www.gnu.org/licenses/>.
 */
 #include "utility.h"
 #include <cstdlib>
+#include <cstdint>
+#include <algorithm>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
 #include <scopeguard.h>
 
 
 namespace HookLib {
 
-FARPROC MyGetProcAddress(HMODULE module, LPCSTR functionName)
+namespace {
+
+// name -> rva table of the exports of one module, built the first time a
+// function of that module is looked up. The names point into the export
+// directory of the module itself
+struct ExportEntry {
+  uint32_t hash;
+  const char *name;
+  DWORD rva;
+  FARPROC forward; // resolved target if the export is forwarded
+  bool forwardResolved;
+};
+
+struct ExportTable {
+  DWORD timeDateStamp;
+  DWORD directoryBegin;
+  DWORD directoryEnd;
+  std::vector<ExportEntry> entries;
+};
+
+std::mutex exportCacheMutex;
+std::unordered_map<HMODULE, ExportTable> exportCache;
+
+uint32_t exportHash(const char *name)
+{
+  uint32_t result = 2166136261u;
+  for (; *name != '\0'; ++name) {
+    result = (result ^ static_cast<uint8_t>(*name)) * 16777619u;
+  }
+  return result;
+}
+
+PIMAGE_NT_HEADERS ntHeaders(HMODULE module)
 {
-  // determine position of the exports of the module
   PIMAGE_DOS_HEADER dosHeader = (PIMAGE_DOS_HEADER)module;
   if (dosHeader->e_magic != IMAGE_DOS_SIGNATURE) {
     return nullptr;
   }
 
-  PIMAGE_NT_HEADERS ntHeaders = (PIMAGE_NT_HEADERS)(((LPBYTE)dosHeader) + dosHeader->e_lfanew);
-  if (ntHeaders->Signature != IMAGE_NT_SIGNATURE) {
+  PIMAGE_NT_HEADERS result = (PIMAGE_NT_HEADERS)(((LPBYTE)dosHeader) + dosHeader->e_lfanew);
+  if (result->Signature != IMAGE_NT_SIGNATURE) {
     return nullptr;
   }
+  return result;
+}
 
-  PIMAGE_OPTIONAL_HEADER optionalHeader = &ntHeaders->OptionalHeader;
+bool buildExportTable(HMODULE module, PIMAGE_NT_HEADERS headers, ExportTable &table)
+{
+  // determine position of the exports of the module
+  PIMAGE_OPTIONAL_HEADER optionalHeader = &headers->OptionalHeader;
   if (optionalHeader->NumberOfRvaAndSizes <= IMAGE_DIRECTORY_ENTRY_EXPORT) {
-    return nullptr;
+    return false;
   }
   PIMAGE_DATA_DIRECTORY dataDirectory = &optionalHeader->DataDirectory[IMAGE_DIRECTORY_ENTRY_EXPORT];
-  PIMAGE_EXPORT_DIRECTORY exportDirectory = (PIMAGE_EXPORT_DIRECTORY)((LPBYTE)dosHeader + dataDirectory->VirtualAddress);
+  if (dataDirectory->VirtualAddress == 0) {
+    return false;
+  }
+  PIMAGE_EXPORT_DIRECTORY exportDirectory = (PIMAGE_EXPORT_DIRECTORY)((LPBYTE)module + dataDirectory->VirtualAddress);
 
   ULONG *addressOfNames = (ULONG*)((LPBYTE) module + exportDirectory->AddressOfNames);
   ULONG *funcAddr = (ULONG*)((LPBYTE) module + exportDirectory->AddressOfFunctions);
+  USHORT *nameOrdinals = (USHORT*)((LPBYTE) module + exportDirectory->AddressOfNameOrdinals);
 
-  // search exports for the specified name
+  table.timeDateStamp = headers->FileHeader.TimeDateStamp;
+  table.directoryBegin = dataDirectory->VirtualAddress;
+  table.directoryEnd = dataDirectory->VirtualAddress + dataDirectory->Size;
+  table.entries.clear();
+  table.entries.reserve(exportDirectory->NumberOfNames);
   for (DWORD i = 0; i < exportDirectory->NumberOfNames; ++i) {
-    char *curFunctionName = (char*)((LPBYTE) module + addressOfNames[i]);
-    USHORT *nameOrdinals = (USHORT*)((LPBYTE) module + exportDirectory->AddressOfNameOrdinals);
-    if (strcmp(functionName, curFunctionName) == 0) {
-      if (funcAddr[nameOrdinals[i]] >= dataDirectory->VirtualAddress &&
-          funcAddr[nameOrdinals[i]] < dataDirectory->VirtualAddress + dataDirectory->Size) {
-        char *forwardLibName  = _strdup((LPSTR)module + funcAddr[nameOrdinals[i]]);
-        ON_BLOCK_EXIT([forwardLibName] () {
-          free(forwardLibName);
-        });
-        char *forwardFunctionName = strchr(forwardLibName, '.');
-        *forwardFunctionName = 0;
-        ++forwardFunctionName;
-
-        HMODULE forwardLib = LoadLibraryA(forwardLibName);
-        FARPROC forward = nullptr;
-        if (forwardLib != nullptr) {
-          forward = MyGetProcAddress(forwardLib, forwardFunctionName);
-          FreeLibrary(forwardLib);
-        }
-
-        return forward;
+    const char *name = (const char*)((LPBYTE) module + addressOfNames[i]);
+    table.entries.push_back(ExportEntry{ exportHash(name), name, funcAddr[nameOrdinals[i]],
+                                         nullptr, false });
+  }
+  std::sort(table.entries.begin(), table.entries.end(),
+            [](const ExportEntry &lhs, const ExportEntry &rhs) {
+              return lhs.hash < rhs.hash;
+            });
+  return true;
+}
+
+FARPROC resolveForward(HMODULE module, DWORD rva)
+{
+  char *forwardLibName  = _strdup((LPSTR)module + rva);
+  ON_BLOCK_EXIT([forwardLibName] () {
+    free(forwardLibName);
+  });
+  char *forwardFunctionName = strchr(forwardLibName, '.');
+  if (forwardFunctionName == nullptr) {
+    return nullptr;
+  }
+  *forwardFunctionName = 0;
+  ++forwardFunctionName;
+
+  HMODULE forwardLib = LoadLibraryA(forwardLibName);
+  FARPROC forward = nullptr;
+  if (forwardLib != nullptr) {
+    forward = MyGetProcAddress(forwardLib, forwardFunctionName);
+    FreeLibrary(forwardLib);
+  }
+
+  return forward;
+}
+
+}
+
+FARPROC MyGetProcAddress(HMODULE module, LPCSTR functionName)
+{
+  PIMAGE_NT_HEADERS headers = ntHeaders(module);
+  if (headers == nullptr) {
+    return nullptr;
+  }
+
+  // the lock is released while a forward gets resolved, that looks up another
+  // module through this function
+  DWORD forwardRva = 0;
+  size_t forwardIndex = 0;
+  {
+    std::lock_guard<std::mutex> lock(exportCacheMutex);
+    ExportTable &table = exportCache[module];
+    if (table.entries.empty()
+        || (table.timeDateStamp != headers->FileHeader.TimeDateStamp)) {
+      // not indexed yet or a different module got loaded to the same address
+      if (!buildExportTable(module, headers, table)) {
+        exportCache.erase(module);
+        return nullptr;
       }
-      return (FARPROC)((LPBYTE)module + funcAddr[nameOrdinals[i]]);
+    }
+
+    uint32_t hash = exportHash(functionName);
+    auto iter = std::lower_bound(table.entries.begin(), table.entries.end(), hash,
+                                 [](const ExportEntry &entry, uint32_t value) {
+                                   return entry.hash < value;
+                                 });
+    for (; (iter != table.entries.end()) && (iter->hash == hash); ++iter) {
+      if (strcmp(functionName, iter->name) != 0) {
+        continue;
+      }
+      if ((iter->rva < table.directoryBegin) || (iter->rva >= table.directoryEnd)) {
+        return (FARPROC)((LPBYTE)module + iter->rva);
+      }
+      if (iter->forwardResolved) {
+        return iter->forward;
+      }
+      forwardRva = iter->rva;
+      forwardIndex = iter - table.entries.begin();
+      break;
+    }
+  }
+
+  if (forwardRva == 0) {
+    return nullptr;
+  }
+
+  FARPROC forward = resolveForward(module, forwardRva);
+  if (forward != nullptr) {
+    std::lock_guard<std::mutex> lock(exportCacheMutex);
+    auto table = exportCache.find(module);
+    if ((table != exportCache.end()) && (forwardIndex < table->second.entries.size())
+        && (table->second.entries[forwardIndex].rva == forwardRva)) {
+      table->second.entries[forwardIndex].forward = forward;
+      table->second.entries[forwardIndex].forwardResolved = true;
     }
   }
-  return nullptr;
+  return forward;
 }
 
 } // namespace HookLib
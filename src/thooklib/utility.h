@@ -28,6 +28,8 @@ namespace HookLib {
 /// \param module handle to the module that contains the function or variable
 /// \param functionName function to retrieve the address of
 /// \return address of the exported function
+/// \note the export directory of each module is indexed on the first lookup, later
+///       lookups in the same module are a hash search. Resolved forwards are cached too
 FARPROC MyGetProcAddress(HMODULE module, LPCSTR functionName);
 
 }
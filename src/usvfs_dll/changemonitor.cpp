@@ -0,0 +1,265 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "changemonitor.h"
+#include <windows_error.h>
+#include <scopeguard.h>
+#include <stringcast.h>
+#include <spdlog.h>
+
+namespace ush = usvfs::shared;
+
+namespace usvfs {
+
+// ReadDirectoryChangesW fails on network shares with buffers larger than this
+static const DWORD CHANGE_BUFFER_SIZE = 64 * 1024;
+
+struct ChangeMonitor::Watch {
+  ChangeMonitor *monitor;
+  int id;
+  std::wstring directory;
+  HANDLE handle;
+  bool recursive;
+  bool active;
+  OVERLAPPED overlapped;
+  std::vector<DWORD> buffer; // FILE_NOTIFY_INFORMATION has to be DWORD aligned
+};
+
+namespace {
+
+struct ClearRequest {
+  ChangeMonitor *monitor;
+  HANDLE done;
+};
+
+}
+
+
+ChangeMonitor::ChangeMonitor(const Handler &handler)
+  : m_Handler(handler)
+{
+  m_Thread = std::thread([this] () { run(); });
+}
+
+ChangeMonitor::~ChangeMonitor()
+{
+  try {
+    queue(&ChangeMonitor::onStop, reinterpret_cast<ULONG_PTR>(this));
+    m_Thread.join();
+  } catch (const std::exception &e) {
+    spdlog::get("usvfs")->error("failed to stop change monitor: {}", e.what());
+    m_Thread.detach();
+  }
+}
+
+bool ChangeMonitor::watch(int id, const std::wstring &directory, bool recursive)
+{
+  HANDLE handle = ::CreateFileW(directory.c_str(), FILE_LIST_DIRECTORY,
+                                FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                nullptr, OPEN_EXISTING,
+                                FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED,
+                                nullptr);
+  if (handle == INVALID_HANDLE_VALUE) {
+    spdlog::get("usvfs")->warn("can't monitor {}: {}",
+                               ush::string_cast<std::string>(directory, ush::CodePage::UTF8),
+                               ::GetLastError());
+    return false;
+  }
+
+  std::unique_ptr<Watch> watch(new Watch);
+  watch->monitor   = this;
+  watch->id        = id;
+  watch->directory = directory;
+  watch->handle    = handle;
+  watch->recursive = recursive;
+  watch->active    = true;
+  watch->buffer.resize(CHANGE_BUFFER_SIZE / sizeof(DWORD));
+  memset(&watch->overlapped, 0, sizeof(OVERLAPPED));
+  // completion routines don't use the event, it carries the watch instead
+  watch->overlapped.hEvent = watch.get();
+
+  try {
+    queue(&ChangeMonitor::onAdd, reinterpret_cast<ULONG_PTR>(watch.get()));
+  } catch (const std::exception &) {
+    ::CloseHandle(handle);
+    throw;
+  }
+  // owned by the monitor thread from here on
+  watch.release();
+  return true;
+}
+
+void ChangeMonitor::clear()
+{
+  if (std::this_thread::get_id() == m_Thread.get_id()) {
+    cancelAll();
+    return;
+  }
+
+  ClearRequest request { this, ::CreateEventW(nullptr, TRUE, FALSE, nullptr) };
+  if (request.done == nullptr) {
+    throw ush::windows_error("failed to create event");
+  }
+  ON_BLOCK_EXIT([&request] () { ::CloseHandle(request.done); });
+
+  queue(&ChangeMonitor::onClear, reinterpret_cast<ULONG_PTR>(&request));
+  ::WaitForSingleObject(request.done, INFINITE);
+}
+
+void ChangeMonitor::queue(PAPCFUNC function, ULONG_PTR parameter)
+{
+  if (::QueueUserAPC(function, m_Thread.native_handle(), parameter) == 0) {
+    throw ush::windows_error("failed to queue request to change monitor");
+  }
+}
+
+void ChangeMonitor::run()
+{
+  while (!m_Stop) {
+    ::SleepEx(INFINITE, TRUE);
+  }
+  cancelAll();
+}
+
+bool ChangeMonitor::issue(Watch *watch)
+{
+  if (!::ReadDirectoryChangesW(watch->handle, watch->buffer.data(),
+                               static_cast<DWORD>(watch->buffer.size() * sizeof(DWORD)),
+                               watch->recursive ? TRUE : FALSE,
+                               FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME,
+                               nullptr, &watch->overlapped,
+                               &ChangeMonitor::onCompletion)) {
+    spdlog::get("usvfs")->warn("failed to monitor {}: {}",
+                               ush::string_cast<std::string>(watch->directory,
+                                                             ush::CodePage::UTF8),
+                               ::GetLastError());
+    watch->active = false;
+    return false;
+  }
+  ++m_Pending;
+  return true;
+}
+
+void ChangeMonitor::cancelAll()
+{
+  // requests arriving while waiting for the cancellation are part of what's cleared
+  m_Cancelling = true;
+  ON_BLOCK_EXIT([this] () { m_Cancelling = false; });
+  for (const std::unique_ptr<Watch> &watch : m_Watches) {
+    watch->active = false;
+    ::CancelIoEx(watch->handle, &watch->overlapped);
+  }
+  // the buffers have to stay around until the aborted reads have completed
+  while (m_Pending > 0) {
+    ::SleepEx(INFINITE, TRUE);
+  }
+  for (const std::unique_ptr<Watch> &watch : m_Watches) {
+    ::CloseHandle(watch->handle);
+  }
+  m_Watches.clear();
+}
+
+void CALLBACK ChangeMonitor::onCompletion(DWORD errorCode, DWORD bytesTransferred,
+                                          LPOVERLAPPED overlapped)
+{
+  Watch *watch = static_cast<Watch*>(overlapped->hEvent);
+  ChangeMonitor *self = watch->monitor;
+  --self->m_Pending;
+
+  if (!watch->active || (errorCode == ERROR_OPERATION_ABORTED)) {
+    return;
+  }
+
+  std::vector<Change> changes;
+  if ((errorCode == ERROR_NOTIFY_ENUM_DIR)
+      || ((errorCode == ERROR_SUCCESS) && (bytesTransferred == 0))) {
+    // the buffer overflowed, individual changes are lost
+    changes.push_back(Change{ ChangeType::Rescan, std::wstring() });
+  } else if (errorCode != ERROR_SUCCESS) {
+    spdlog::get("usvfs")->warn("stopped monitoring {}: {}",
+                               ush::string_cast<std::string>(watch->directory,
+                                                             ush::CodePage::UTF8),
+                               errorCode);
+    watch->active = false;
+    return;
+  } else {
+    const char *buffer = reinterpret_cast<const char*>(watch->buffer.data());
+    for (;;) {
+      const FILE_NOTIFY_INFORMATION *info
+          = reinterpret_cast<const FILE_NOTIFY_INFORMATION*>(buffer);
+      std::wstring path(info->FileName, info->FileNameLength / sizeof(WCHAR));
+      switch (info->Action) {
+        case FILE_ACTION_ADDED:
+        case FILE_ACTION_RENAMED_NEW_NAME:
+          changes.push_back(Change{ ChangeType::Added, std::move(path) });
+          break;
+        case FILE_ACTION_REMOVED:
+        case FILE_ACTION_RENAMED_OLD_NAME:
+          changes.push_back(Change{ ChangeType::Removed, std::move(path) });
+          break;
+        default:
+          // modifications don't affect the redirection
+          break;
+      }
+      if (info->NextEntryOffset == 0) {
+        break;
+      }
+      buffer += info->NextEntryOffset;
+    }
+  }
+
+  // the buffer was copied, so listen for the next batch before handling this one
+  self->issue(watch);
+
+  if (!changes.empty()) {
+    try {
+      self->m_Handler(watch->id, changes);
+    } catch (const std::exception &e) {
+      spdlog::get("usvfs")->error("failed to apply changes to {}: {}",
+                                  ush::string_cast<std::string>(watch->directory,
+                                                                ush::CodePage::UTF8),
+                                  e.what());
+    }
+  }
+}
+
+void CALLBACK ChangeMonitor::onAdd(ULONG_PTR parameter)
+{
+  Watch *watch = reinterpret_cast<Watch*>(parameter);
+  ChangeMonitor *self = watch->monitor;
+  self->m_Watches.emplace_back(watch);
+  if (!self->m_Stop && !self->m_Cancelling) {
+    self->issue(watch);
+  }
+}
+
+void CALLBACK ChangeMonitor::onClear(ULONG_PTR parameter)
+{
+  ClearRequest *request = reinterpret_cast<ClearRequest*>(parameter);
+  request->monitor->cancelAll();
+  ::SetEvent(request->done);
+}
+
+void CALLBACK ChangeMonitor::onStop(ULONG_PTR parameter)
+{
+  reinterpret_cast<ChangeMonitor*>(parameter)->m_Stop = true;
+}
+
+}
@@ -0,0 +1,109 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <windows_sane.h>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace usvfs {
+
+/**
+ * @brief watches directories for changes on a single background thread. Every watch
+ *        issues an overlapped ReadDirectoryChangesW whose completion routine runs on
+ *        that thread, so the number of directories isn't limited by
+ *        WaitForMultipleObjects. Changes are reported to the handler in batches, in
+ *        the order the file system reported them
+ */
+class ChangeMonitor
+{
+public:
+
+  enum class ChangeType {
+    Added,   // created or renamed into the watched directory
+    Removed, // deleted or renamed out of the watched directory
+    Rescan   // events were lost, the whole watched directory has to be rescanned
+  };
+
+  struct Change {
+    ChangeType type;
+    std::wstring path; // relative to the watched directory, empty for Rescan
+  };
+
+  /**
+   * @brief called on the monitor thread
+   * @param id the id the watch was registered with
+   * @param changes changes that happened since the last call for this watch
+   */
+  typedef std::function<void(int id, const std::vector<Change> &changes)> Handler;
+
+  explicit ChangeMonitor(const Handler &handler);
+  ~ChangeMonitor();
+
+  ChangeMonitor(const ChangeMonitor&) = delete;
+  ChangeMonitor &operator=(const ChangeMonitor&) = delete;
+
+  /**
+   * @brief start watching a directory
+   * @param id identifier to pass to the handler for changes of this directory
+   * @param directory the directory to watch
+   * @param recursive if true, the whole subtree is watched
+   * @return false if the directory couldn't be opened
+   */
+  bool watch(int id, const std::wstring &directory, bool recursive);
+
+  /**
+   * @brief stop all watches. The handler won't be called anymore once this returns
+   */
+  void clear();
+
+private:
+
+  struct Watch;
+
+  static void CALLBACK onCompletion(DWORD errorCode, DWORD bytesTransferred,
+                                    LPOVERLAPPED overlapped);
+  static void CALLBACK onAdd(ULONG_PTR parameter);
+  static void CALLBACK onClear(ULONG_PTR parameter);
+  static void CALLBACK onStop(ULONG_PTR parameter);
+
+  void run();
+  bool issue(Watch *watch);
+  void cancelAll();
+  void queue(PAPCFUNC function, ULONG_PTR parameter);
+
+private:
+
+  Handler m_Handler;
+  std::thread m_Thread;
+
+  // only accessed on the monitor thread
+  bool m_Stop { false };
+  bool m_Cancelling { false };
+  std::vector<std::unique_ptr<Watch>> m_Watches;
+  size_t m_Pending { 0 }; // number of reads whose completion routine hasn't run yet
+
+};
+
+}
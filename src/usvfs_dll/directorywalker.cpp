@@ -0,0 +1,219 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "directorywalker.h"
+#include <winapi.h>
+#include <stringutils.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <system_error>
+#include <mutex>
+#include <thread>
+
+namespace ush = usvfs::shared;
+
+namespace usvfs {
+
+namespace {
+
+// there is little to gain beyond this number of queries in flight and each worker
+// holds a query buffer
+static const unsigned int MAX_WALKER_THREADS = 16;
+
+struct WorkQueue {
+  std::mutex mutex;
+  std::deque<std::wstring> directories;
+};
+
+class WalkState
+{
+public:
+
+  WalkState(const std::wstring &root, const DirectoryWalker::Filter &filter,
+            unsigned int threads)
+    : m_Root(root)
+    , m_Filter(filter)
+    , m_Queues(threads)
+    , m_Results(threads)
+  {
+    m_Queues[0].directories.push_back(std::wstring());
+  }
+
+  void work(size_t index)
+  {
+    try {
+      std::wstring directory;
+      while (m_Pending.load(std::memory_order_acquire) > 0) {
+        if (m_Failed.load(std::memory_order_relaxed)) {
+          return;
+        }
+        if (pop(index, directory) || steal(index, directory)) {
+          list(index, directory);
+          m_Pending.fetch_sub(1, std::memory_order_acq_rel);
+        } else {
+          std::this_thread::yield();
+        }
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(m_ErrorMutex);
+      if (!m_Error) {
+        m_Error = std::current_exception();
+      }
+      m_Failed.store(true, std::memory_order_relaxed);
+    }
+  }
+
+  std::vector<std::vector<DirectoryWalker::Directory>> &results() { return m_Results; }
+
+  void rethrow() const
+  {
+    if (m_Error) {
+      std::rethrow_exception(m_Error);
+    }
+  }
+
+private:
+
+  bool pop(size_t index, std::wstring &directory)
+  {
+    WorkQueue &queue = m_Queues[index];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.directories.empty()) {
+      return false;
+    }
+    directory = std::move(queue.directories.back());
+    queue.directories.pop_back();
+    return true;
+  }
+
+  bool steal(size_t index, std::wstring &directory)
+  {
+    for (size_t offset = 1; offset < m_Queues.size(); ++offset) {
+      WorkQueue &queue = m_Queues[(index + offset) % m_Queues.size()];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      if (!queue.directories.empty()) {
+        directory = std::move(queue.directories.front());
+        queue.directories.pop_front();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void list(size_t index, const std::wstring &directory)
+  {
+    std::wstring path = directory.empty() ? m_Root : m_Root + L"\\" + directory;
+    if ((path.length() >= MAX_PATH) && !ush::startswith(path.c_str(), LR"(\\?\)")) {
+      path = LR"(\\?\)" + path;
+    }
+
+    std::vector<std::wstring> subDirectories;
+    DirectoryWalker::Directory result;
+    result.path = directory;
+
+    winapi::ex::wide::quickFindFiles(path.c_str(), L"*",
+        [&](const winapi::ex::wide::FileEntry &file) {
+      if (file.attributes & FILE_ATTRIBUTE_DIRECTORY) {
+        if ((file.fileName != L".") && (file.fileName != L"..")) {
+          subDirectories.push_back(file.fileName.to_string());
+        }
+      } else {
+        result.files.push_back(file.fileName.to_string());
+      }
+    });
+
+    m_Results[index].push_back(std::move(result));
+
+    if (subDirectories.empty()) {
+      return;
+    }
+
+    std::wstring prefix = directory.empty() ? std::wstring() : directory + L"\\";
+    std::vector<std::wstring> accepted;
+    accepted.reserve(subDirectories.size());
+    for (const std::wstring &subDirectory : subDirectories) {
+      std::wstring subPath = prefix + subDirectory;
+      if (!m_Filter || m_Filter(subPath)) {
+        accepted.push_back(std::move(subPath));
+      }
+    }
+
+    // count the new work before it becomes visible so the walk can't be considered
+    // complete in between
+    m_Pending.fetch_add(accepted.size(), std::memory_order_acq_rel);
+    WorkQueue &queue = m_Queues[index];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    for (std::wstring &subPath : accepted) {
+      queue.directories.push_back(std::move(subPath));
+    }
+  }
+
+private:
+
+  const std::wstring &m_Root;
+  const DirectoryWalker::Filter &m_Filter;
+  std::vector<WorkQueue> m_Queues;
+  std::vector<std::vector<DirectoryWalker::Directory>> m_Results;
+  std::atomic<size_t> m_Pending { 1 };
+  std::atomic<bool> m_Failed { false };
+  std::mutex m_ErrorMutex;
+  std::exception_ptr m_Error;
+
+};
+
+}
+
+
+DirectoryWalker::DirectoryWalker(unsigned int threads)
+  : m_Threads(threads)
+{
+  if (m_Threads == 0) {
+    m_Threads = std::thread::hardware_concurrency() * 2;
+  }
+  m_Threads = std::min(std::max(m_Threads, 1u), MAX_WALKER_THREADS);
+}
+
+
+std::vector<std::vector<DirectoryWalker::Directory>> DirectoryWalker::walk(
+    const std::wstring &root, const Filter &filter) const
+{
+  WalkState state(root, filter, m_Threads);
+
+  std::vector<std::thread> workers;
+  workers.reserve(m_Threads - 1);
+  try {
+    for (unsigned int i = 1; i < m_Threads; ++i) {
+      workers.emplace_back([&state, i] () { state.work(i); });
+    }
+  } catch (const std::system_error &) {
+    // couldn't start another thread, the ones we have will handle the work
+  }
+  state.work(0);
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+
+  state.rethrow();
+  return std::move(state.results());
+}
+
+}
@@ -0,0 +1,78 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace usvfs {
+
+/**
+ * @brief enumerates a directory tree on a pool of threads. Every worker owns a queue
+ *        of directories still to be listed, subdirectories it finds go to its own
+ *        queue and idle workers steal from the other end of someone else's queue.
+ *        Since listing a directory is dominated by the latency of the file system,
+ *        having several queries in flight speeds up scans of deep trees considerably
+ */
+class DirectoryWalker
+{
+public:
+
+  /**
+   * @brief a directory that was listed
+   */
+  struct Directory {
+    std::wstring path; // relative to the root, empty for the root itself
+    std::vector<std::wstring> files; // names of the regular files in the directory
+  };
+
+  /**
+   * @brief called from the worker threads for every subdirectory found
+   * @param path path of the subdirectory relative to the root
+   * @return false to leave the directory and everything below it out of the result
+   */
+  typedef std::function<bool(const std::wstring &path)> Filter;
+
+  /**
+   * @param threads number of worker threads, 0 picks one based on the cpu count
+   */
+  explicit DirectoryWalker(unsigned int threads = 0);
+
+  /**
+   * @brief list the root and all its subdirectories
+   * @param root the directory to walk, without trailing backslash
+   * @param filter optional filter for subdirectories, has to be thread-safe
+   * @return listed directories, one buffer per worker. The order within a buffer is
+   *         the order in which that worker listed them, parents always precede their
+   *         children only within the same buffer
+   * @note directories that can't be opened are reported without files
+   */
+  std::vector<std::vector<Directory>> walk(const std::wstring &root,
+                                           const Filter &filter = Filter()) const;
+
+private:
+
+  unsigned int m_Threads;
+
+};
+
+}
@@ -0,0 +1,191 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include "stringutils.h"
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace usvfs {
+
+// case folding shared with the redirection tree and the trackers
+using shared::foldChar;
+using shared::foldedHash;
+using shared::foldedEquals;
+
+/**
+ * @brief set of file names comparing case-insensitively, used to filter duplicates
+ *        while merging directory listings. This is a flat open-addressing table on
+ *        the folded hash, the names themselves are stored in an arena owned by the set
+ *        so inserting doesn't allocate per name. Not thread-safe
+ */
+class FoldedNameSet {
+public:
+  FoldedNameSet() = default;
+
+  FoldedNameSet(const FoldedNameSet& reference) {
+    *this = reference;
+  }
+
+  FoldedNameSet& operator=(const FoldedNameSet& reference) {
+    if (this != &reference) {
+      clear();
+      reserve(reference.m_Size);
+      for (const Slot& slot : reference.m_Slots) {
+        if (slot.name != nullptr)
+          insertSlot(slot.hash, slot.name, slot.length);
+      }
+    }
+    return *this;
+  }
+
+  FoldedNameSet(FoldedNameSet&&) = default;
+  FoldedNameSet& operator=(FoldedNameSet&&) = default;
+
+  size_t size() const { return m_Size; }
+  bool empty() const { return m_Size == 0; }
+
+  /**
+   * @brief add a name to the set
+   * @return true if the name was added, false if it (or a name differing only in case)
+   *         was already in the set
+   */
+  bool insert(const wchar_t* name, size_t length) {
+    return insertSlot(foldedHash(name, length), name, length);
+  }
+
+  bool insert(const std::wstring& name) {
+    return insert(name.c_str(), name.size());
+  }
+
+  bool contains(const wchar_t* name, size_t length) const {
+    if (m_Slots.empty())
+      return false;
+    uint32_t hash = foldedHash(name, length);
+    size_t mask = m_Slots.size() - 1;
+    for (size_t i = hash & mask; m_Slots[i].name != nullptr; i = (i + 1) & mask) {
+      if (matches(m_Slots[i], hash, name, length))
+        return true;
+    }
+    return false;
+  }
+
+  bool contains(const std::wstring& name) const {
+    return contains(name.c_str(), name.size());
+  }
+
+  /**
+   * @brief remove all names. The memory for the table and the first arena block is
+   *        kept for reuse
+   */
+  void clear() {
+    for (Slot& slot : m_Slots)
+      slot = Slot();
+    if (m_Blocks.size() > 1)
+      m_Blocks.resize(1);
+    m_BlockUsed = 0;
+    m_Size = 0;
+  }
+
+  void reserve(size_t count) {
+    size_t required = MIN_SLOTS;
+    while (required * MAX_LOAD_NUM < count * MAX_LOAD_DEN)
+      required *= 2;
+    if (required > m_Slots.size())
+      rehash(required);
+  }
+
+private:
+  static const size_t MIN_SLOTS = 64;
+  static const size_t BLOCK_CHARS = 16384;
+  // grow when the table is more than 70% filled
+  static const size_t MAX_LOAD_NUM = 7;
+  static const size_t MAX_LOAD_DEN = 10;
+
+  struct Slot {
+    const wchar_t* name{nullptr};
+    uint32_t hash{0};
+    uint32_t length{0};
+  };
+
+  static bool matches(const Slot& slot, uint32_t hash, const wchar_t* name, size_t length) {
+    return (slot.hash == hash) && (slot.length == length) && foldedEquals(slot.name, name, length);
+  }
+
+  bool insertSlot(uint32_t hash, const wchar_t* name, size_t length) {
+    if ((m_Size + 1) * MAX_LOAD_DEN > m_Slots.size() * MAX_LOAD_NUM)
+      rehash(m_Slots.empty() ? MIN_SLOTS : m_Slots.size() * 2);
+
+    size_t mask = m_Slots.size() - 1;
+    size_t i = hash & mask;
+    for (; m_Slots[i].name != nullptr; i = (i + 1) & mask) {
+      if (matches(m_Slots[i], hash, name, length))
+        return false;
+    }
+    m_Slots[i].name = store(name, length);
+    m_Slots[i].hash = hash;
+    m_Slots[i].length = static_cast<uint32_t>(length);
+    ++m_Size;
+    return true;
+  }
+
+  void rehash(size_t slotCount) {
+    std::vector<Slot> old(slotCount);
+    old.swap(m_Slots);
+    size_t mask = m_Slots.size() - 1;
+    for (const Slot& slot : old) {
+      if (slot.name != nullptr) {
+        size_t i = slot.hash & mask;
+        while (m_Slots[i].name != nullptr)
+          i = (i + 1) & mask;
+        m_Slots[i] = slot;
+      }
+    }
+  }
+
+  // copies the name into the arena. Names longer than a block get a block of their own
+  const wchar_t* store(const wchar_t* name, size_t length) {
+    if (m_Blocks.empty() || (m_BlockUsed + length > m_Blocks.back().size)) {
+      size_t size = length > BLOCK_CHARS ? length : BLOCK_CHARS;
+      m_Blocks.push_back(Block{ std::unique_ptr<wchar_t[]>(new wchar_t[size]), size });
+      m_BlockUsed = 0;
+    }
+    wchar_t* result = m_Blocks.back().data.get() + m_BlockUsed;
+    memcpy(result, name, length * sizeof(wchar_t));
+    m_BlockUsed += length;
+    return result;
+  }
+
+  struct Block {
+    std::unique_ptr<wchar_t[]> data;
+    size_t size;
+  };
+
+  std::vector<Slot> m_Slots;
+  std::vector<Block> m_Blocks;
+  size_t m_BlockUsed{0};
+  size_t m_Size{0};
+};
+
+} // namespace usvfs
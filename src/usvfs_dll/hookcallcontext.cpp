@@ -19,51 +19,66 @@ You should have received a copy of the GNU General Public License
 along with usvfs. If not, see <http://www.gnu.org/licenses/>.
 */
 #include "hookcallcontext.h"
-#include <boost/thread.hpp>
 #include <logging.h>
-#include <bitset>
-#include <thread>
+#include <cstdint>
+#include <cwchar>
 #include "hookcontext.h"
+#include "hookstatistics.h"
+#include "hooktrace.h"
+#include <hooklib.h>
+#include <etwprovider.h>
 
 
 namespace usvfs {
 
+static_assert(static_cast<size_t>(MutExHookGroup::LAST) <= 32,
+              "active hook groups have to fit the thread-local mask");
+
+// tracks which hook groups are active on the calling thread. The mask is a
+// plain thread_local integer: it needs no construction or cleanup, so access
+// never allocates and, unlike a TlsGetValue, doesn't change the last error.
+// While ALL_GROUPS is active every grouped hook would only forward to the
+// original function, so the trampolines of grouped hooks are told to skip them
+// entirely. Hooks without a group (HOOK_START) are installed as not suppressible
+// and still run, see HookManager::installHook
 class HookStack {
 public:
-  static HookStack &instance() {
-    PreserveGetLastError boostChangesGetLastError;
-    if (s_Instance.get() == nullptr) {
-      s_Instance.reset(new HookStack());
-    }
-    return *s_Instance.get();
-  }
-
-  bool setGroup(MutExHookGroup group) {
-    if (m_ActiveGroups.test(static_cast<size_t>(group))
-        || m_ActiveGroups.test(static_cast<size_t>(MutExHookGroup::ALL_GROUPS))) {
+  static bool setGroup(MutExHookGroup group) {
+    uint32_t bit = groupBit(group);
+    if ((s_ActiveGroups & (bit | groupBit(MutExHookGroup::ALL_GROUPS))) != 0) {
       return false;
     } else {
-      m_ActiveGroups.set(static_cast<size_t>(group), true);
+      s_ActiveGroups |= bit;
+      if (group == MutExHookGroup::ALL_GROUPS) {
+        HookLib::SuppressThreadHooks(true);
+      }
       return true;
     }
   }
 
-  void unsetGroup(MutExHookGroup group) {
-    m_ActiveGroups.set(static_cast<size_t>(group), false);
+  static void unsetGroup(MutExHookGroup group) {
+    s_ActiveGroups &= ~groupBit(group);
+    if (group == MutExHookGroup::ALL_GROUPS) {
+      HookLib::SuppressThreadHooks(false);
+    }
   }
 
 private:
 
-  HookStack() {
-
+  static uint32_t groupBit(MutExHookGroup group) {
+    return 1u << static_cast<uint32_t>(group);
   }
 
 private:
-  static boost::thread_specific_ptr<HookStack> s_Instance;
-  std::bitset<static_cast<size_t>(MutExHookGroup::LAST)> m_ActiveGroups;
+  static thread_local uint32_t s_ActiveGroups;
 };
 
-boost::thread_specific_ptr<HookStack> HookStack::s_Instance;
+thread_local uint32_t HookStack::s_ActiveGroups = 0;
+
+// path a hook on this thread is calling the original function with, see
+// HookCallContext::handOffPath. Plain thread_locals like the group mask
+static thread_local const wchar_t *s_HandOffPath = nullptr;
+static thread_local size_t s_HandOffLength = 0;
 
 
 HookCallContext::HookCallContext()
@@ -74,21 +89,123 @@ HookCallContext::HookCallContext()
 }
 
 HookCallContext::HookCallContext(MutExHookGroup group)
-  : m_Active(HookStack::instance().setGroup(group))
+  : m_Active(HookStack::setGroup(group))
   , m_Group(group)
 {
   updateLastError();
 }
 
 
+HookCallContext::HookCallContext(HookStatsSlot &slot)
+  : HookCallContext()
+{
+  startTiming(slot);
+}
+
+HookCallContext::HookCallContext(MutExHookGroup group, HookStatsSlot &slot)
+  : HookCallContext(group)
+{
+  startTiming(slot);
+}
+
+
 HookCallContext::~HookCallContext()
 {
+  endHandOff();
   if (m_Active && (m_Group != MutExHookGroup::NO_GROUP)) {
-    HookStack::instance().unsetGroup(m_Group);
+    HookStack::unsetGroup(m_Group);
+  }
+  if (m_Start != 0) {
+    uint64_t end = HookStatsTable::now();
+    if (HookStatsTable::enabled()) {
+      HookStatsTable::record(*m_Slot, end - m_Start, m_RealTicks, m_Redirected);
+    }
+    if (HookTrace::enabled()) {
+      HookTrace::record(*m_Slot, m_Start, end, m_RealTicks, m_PathHash, m_Redirected);
+    }
+    shared::etw::hookExit(m_Slot->function(), m_Start, m_RealTicks, m_Redirected);
   }
   SetLastError(m_LastError);
 }
 
+void HookCallContext::startTiming(HookStatsSlot &slot)
+{
+  // nested calls from within usvfs are not counted, they'd count the time
+  // of the outer hook twice
+  if (m_Active && (HookStatsTable::enabled() || HookTrace::enabled()
+                   || shared::etw::enabled(shared::etw::KEYWORD_HOOKS))) {
+    m_Slot = &slot;
+    m_Start = HookStatsTable::now();
+    shared::etw::hookEnter(slot.function());
+  }
+}
+
+void HookCallContext::beginRealCall()
+{
+  if (m_Start != 0) {
+    m_RealStart = HookStatsTable::now();
+  }
+}
+
+void HookCallContext::endRealCall()
+{
+  if (m_RealStart != 0) {
+    m_RealTicks += HookStatsTable::now() - m_RealStart;
+    m_RealStart = 0;
+  }
+  endHandOff();
+}
+
+void HookCallContext::handOffPath(const wchar_t *path)
+{
+  if (!m_Active || m_HandedOff || (path == nullptr)) {
+    return;
+  }
+  if (wcsncmp(path, LR"(\\?\)", 4) == 0) {
+    path += 4;
+  }
+  m_OuterHandOff = s_HandOffPath;
+  m_OuterHandOffLength = s_HandOffLength;
+  s_HandOffPath = path;
+  s_HandOffLength = wcslen(path);
+  m_HandedOff = true;
+}
+
+void HookCallContext::endHandOff()
+{
+  if (m_HandedOff) {
+    s_HandOffPath = m_OuterHandOff;
+    s_HandOffLength = m_OuterHandOffLength;
+    m_HandedOff = false;
+  }
+}
+
+bool HookCallContext::handedOff(const wchar_t *path, size_t length)
+{
+  if ((s_HandOffPath == nullptr) || (path == nullptr)) {
+    return false;
+  }
+  if ((length >= 4) && (wcsncmp(path, LR"(\??\)", 4) == 0)) {
+    path += 4;
+    length -= 4;
+  }
+  return (length == s_HandOffLength) && (_wcsnicmp(path, s_HandOffPath, length) == 0);
+}
+
+void HookCallContext::tracePath(const wchar_t *path, size_t length) const
+{
+  if ((m_Start != 0) && HookTrace::enabled() && (path != nullptr)) {
+    m_PathHash = HookTrace::internPath(path, length);
+  }
+}
+
+void HookCallContext::tracePath(const wchar_t *path) const
+{
+  if ((m_Start != 0) && HookTrace::enabled() && (path != nullptr)) {
+    m_PathHash = HookTrace::internPath(path, wcslen(path));
+  }
+}
+
 void HookCallContext::restoreLastError()
 {
   SetLastError(m_LastError);
@@ -108,12 +225,12 @@ bool HookCallContext::active() const
 FunctionGroupLock::FunctionGroupLock(MutExHookGroup group)
   : m_Group(group)
 {
-  m_Active = HookStack::instance().setGroup(m_Group);
+  m_Active = HookStack::setGroup(m_Group);
 }
 
 FunctionGroupLock::~FunctionGroupLock() {
   if (m_Active) {
-    HookStack::instance().unsetGroup(m_Group);
+    HookStack::unsetGroup(m_Group);
   }
 }
 
@@ -23,10 +23,13 @@ along with usvfs. If not, see <http://www.gnu.org/licenses/>.
 #include "windows_sane.h"
 
 #include <vector>
+#include <cstdint>
 
 
 namespace usvfs {
 
+class HookStatsSlot;
+
 /**
  * @brief groups of hooks which may be used to implement each other, so only the first call should be
  *    to one should be manipulated
@@ -57,6 +60,12 @@ public:
 
   HookCallContext();
   HookCallContext(MutExHookGroup group);
+  /**
+   * @param slot statistics entry of the calling hook, the call is timed if
+   *        statistics are enabled
+   */
+  HookCallContext(HookStatsSlot &slot);
+  HookCallContext(MutExHookGroup group, HookStatsSlot &slot);
   ~HookCallContext();
 
   HookCallContext(const HookCallContext &reference) = delete;
@@ -70,12 +79,64 @@ public:
 
   bool active() const;
 
+  /**
+   * @brief called before and after the original function is invoked so the time
+   *        spent in it can be told apart from the hook overhead
+   */
+  void beginRealCall();
+  void endRealCall();
+
+  /**
+   * @brief hand the path the original function is about to be called with on to the
+   *        hooks nested in it. Until endRealCall those on the same thread take the
+   *        path as resolved instead of rerouting it again. The path has to stay valid
+   *        until then
+   */
+  void handOffPath(const wchar_t *path);
+
+  /**
+   * @return true if a hook further up on this thread handed off the path. A \??\
+   *         prefix of nt paths is ignored
+   */
+  static bool handedOff(const wchar_t *path, size_t length);
+
+  /**
+   * @brief note that the call is rerouted, for the hook statistics
+   */
+  void markRedirected(bool redirected = true) const
+  {
+    m_Redirected = m_Redirected || redirected;
+  }
+
+  /**
+   * @brief note the path the call works on, for the hook trace
+   */
+  void tracePath(const wchar_t *path, size_t length) const;
+  void tracePath(const wchar_t *path) const;
+
+private:
+
+  void startTiming(HookStatsSlot &slot);
+
+  void endHandOff();
+
 private:
 
   DWORD m_LastError;
   bool m_Active;
   MutExHookGroup m_Group;
 
+  HookStatsSlot *m_Slot{nullptr};
+  uint64_t m_Start{0};
+  uint64_t m_RealStart{0};
+  uint64_t m_RealTicks{0};
+  mutable bool m_Redirected{false};
+  mutable uint32_t m_PathHash{0};
+
+  bool m_HandedOff{false};
+  const wchar_t *m_OuterHandOff{nullptr};
+  size_t m_OuterHandOffLength{0};
+
 };
 
 class FunctionGroupLock {
@@ -25,8 +25,10 @@ along with usvfs. If not, see <http://www.gnu.org/licenses/>.
 #include <winapi.h>
 #include <usvfsparameters.h>
 #include <shared_memory.h>
+#include <stringcast.h>
+#include <scopeguard.h>
 #include "loghelpers.h"
-#include <boost/algorithm/string/predicate.hpp>
+#include <algorithm>
 
 namespace bi = boost::interprocess;
 using usvfs::shared::SharedMemoryT;
@@ -64,10 +66,112 @@ USVFSParameters SharedParameters::makeLocal() const
                          currentInverseSHMName.c_str(),
                          debugMode, logLevel, crashDumpsType,
                          crashDumpsPath.c_str());
+  result.logSampleInterval = logSampleInterval;
+  result.logRateLimit      = logRateLimit;
+  strncpy_s(result.traceDirectory, traceDirectory.c_str(), _TRUNCATE);
+  result.iniCache          = iniCache;
+  result.copyOnWrite       = copyOnWrite;
+  result.attributeCache    = attributeCache;
+  strncpy_s(result.readAheadDirectory, readAheadDirectory.c_str(), _TRUNCATE);
+  result.prefaultTree      = prefaultTree;
   return result;
 }
 
 
+/**
+ * holds the lock of the process list in the shared parameters. The list is modified
+ * by every process connecting or disconnecting and pruned by process list queries
+ */
+class ProcessListGuard {
+public:
+  explicit ProcessListGuard(SharedParameters &parameters)
+    : m_Parameters(parameters)
+    , m_Name(std::string(parameters.instanceName.c_str()) + "_processes")
+  {
+    m_Parameters.processLock.lock(m_Name.c_str());
+  }
+
+  ~ProcessListGuard() {
+    m_Parameters.processLock.unlock(m_Name.c_str());
+  }
+
+  ProcessListGuard(const ProcessListGuard&) = delete;
+  ProcessListGuard &operator=(const ProcessListGuard&) = delete;
+
+private:
+  SharedParameters &m_Parameters;
+  std::string m_Name;
+};
+
+
+// folded utf-8 file name of a path, the key blacklist entries and forced libraries
+// are stored under
+static std::string foldedFileName(const wchar_t *path, size_t length)
+{
+  const wchar_t *name = path;
+  for (size_t i = 0; i < length; ++i) {
+    if ((path[i] == L'\\') || (path[i] == L'/')) {
+      name = path + i + 1;
+    }
+  }
+  std::wstring folded(name, path + length);
+  ush::foldCase(folded.c_str(), folded.size(), &folded[0]);
+  return ush::string_cast<std::string>(folded, ush::CodePage::UTF8);
+}
+
+void SharedParameters::blacklistExecutable(const std::wstring &executableName)
+{
+  std::string key = foldedFileName(executableName.c_str(), executableName.size());
+  processBlacklist.insert(shared::StringT(key.c_str(), processBlacklist.get_allocator()));
+}
+
+bool SharedParameters::executableBlacklisted(LPCWSTR applicationName,
+                                             LPCWSTR commandLine) const
+{
+  if (processBlacklist.empty()) {
+    return false;
+  }
+
+  if ((applicationName != nullptr)
+      && (processBlacklist.find(foldedFileName(applicationName, wcslen(applicationName)))
+          != processBlacklist.end())) {
+    return true;
+  }
+
+  if (commandLine != nullptr) {
+    // the executable is the first token, quoted if it contains spaces
+    const wchar_t *begin = commandLine;
+    while ((*begin == L' ') || (*begin == L'\t')) {
+      ++begin;
+    }
+    const wchar_t *end;
+    if (*begin == L'"') {
+      ++begin;
+      end = wcschr(begin, L'"');
+      if (end == nullptr) {
+        end = begin + wcslen(begin);
+      }
+    } else {
+      end = wcspbrk(begin, L" \t");
+      if (end == nullptr) {
+        end = begin + wcslen(begin);
+      }
+    }
+    std::string key = foldedFileName(begin, end - begin);
+    if (processBlacklist.find(key) != processBlacklist.end()) {
+      return true;
+    }
+    // CreateProcess appends .exe to a command line executable without extension
+    if ((key.find('.') == std::string::npos)
+        && (processBlacklist.find(key + ".EXE") != processBlacklist.end())) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
 void usvfs::USVFSInitParametersInt(USVFSParameters *parameters,
                                    const char *instanceName,
                                    const char *currentSHMName,
@@ -87,12 +191,33 @@ void usvfs::USVFSInitParametersInt(USVFSParameters *parameters,
 }
 
 
-HookContext::HookContext(const USVFSParameters &params, HMODULE module)
-  : m_ConfigurationSHM(bi::open_or_create, params.instanceName, 8192)
-  , m_Parameters(retrieveParameters(params))
-  , m_Tree(m_Parameters->currentSHMName.c_str(), 65536)
+// rough estimate of shared memory used per node: the node itself, the child map
+// entry and the name and link target strings
+static const size_t BYTES_PER_MAPPING = 384;
+
+static const size_t MAX_INITIAL_TREE_SIZE = 512 * 1024 * 1024;
+
+static size_t initialTreeSize(const USVFSParameters &params)
+{
+  uint64_t required = static_cast<uint64_t>(params.mappingCapacity) * BYTES_PER_MAPPING;
+  size_t size = 65536;
+  while ((size < required) && (size < MAX_INITIAL_TREE_SIZE)) {
+    size *= 2;
+  }
+  return size;
+}
+
+
+HookContext::HookContext(const USVFSParameters &params, HMODULE module,
+                         SharedMemoryT *configuration, SharedParameters *parameters)
+  : m_ConfigurationSHM(configuration != nullptr
+                           ? std::move(*configuration)
+                           : SharedMemoryT(bi::open_or_create, params.instanceName, 8192))
+  , m_Parameters(parameters != nullptr ? parameters : retrieveParameters(params))
+  , m_Tree(m_Parameters->currentSHMName.c_str(), initialTreeSize(params))
   , m_InverseTree(m_Parameters->currentInverseSHMName.c_str(), 65536)
   , m_DebugMode(params.debugMode)
+  , m_CopyOnWrite(params.copyOnWrite)
   , m_DLLModule(module)
 {
   if (s_Instance != nullptr) {
@@ -111,6 +236,12 @@ HookContext::HookContext(const USVFSParameters &params, HMODULE module)
     USVFS_THROW_EXCEPTION(usage_error() << ex_msg("shm not found")
                                         << ex_msg(params.instanceName));
   }
+  try {
+    HookStatsTable::open(params.instanceName);
+  } catch (const bi::interprocess_exception &e) {
+    // statistics are optional, everything else works without them
+    spdlog::get("usvfs")->warn("failed to open hook statistics: {}", e.what());
+  }
 }
 
 void HookContext::remove(const char *instanceName)
@@ -121,7 +252,10 @@ void HookContext::remove(const char *instanceName)
 HookContext::~HookContext()
 {
   spdlog::get("usvfs")->info("releasing hook context");
+  // background tasks may refer to the context
+  WorkerPool::instance().stop();
   s_Instance = nullptr;
+  HookStatsTable::close();
 
   if (--m_Parameters->userCount == 0) {
     spdlog::get("usvfs")
@@ -130,6 +264,37 @@ HookContext::~HookContext()
   } else {
     spdlog::get("usvfs")->info("{} users left", m_Parameters->userCount);
   }
+
+  for (size_t i = 0; i < MAX_CUSTOM_DATA; ++i) {
+    void *data = m_CustomData[i].load();
+    if (data != nullptr) {
+      m_CustomDataDeleters[i](data);
+    }
+  }
+}
+
+size_t HookContext::allocateCustomSlot()
+{
+  static std::atomic<size_t> nextSlot{0};
+  size_t slot = nextSlot++;
+  if (slot >= MAX_CUSTOM_DATA) {
+    USVFS_THROW_EXCEPTION(usage_error() << ex_msg("out of custom data slots"));
+  }
+  return slot;
+}
+
+void *HookContext::createCustomData(size_t slot, void *(*create)(),
+                                    void (*destroy)(void*)) const
+{
+  // readers may get here concurrently
+  std::lock_guard<std::mutex> lock(m_CustomDataMutex);
+  void *data = m_CustomData[slot].load(std::memory_order_relaxed);
+  if (data == nullptr) {
+    data = create();
+    m_CustomDataDeleters[slot] = destroy;
+    m_CustomData[slot].store(data, std::memory_order_release);
+  }
+  return data;
 }
 
 SharedParameters *HookContext::retrieveParameters(const USVFSParameters &params)
@@ -148,27 +313,64 @@ SharedParameters *HookContext::retrieveParameters(const USVFSParameters &params)
     spdlog::get("usvfs")
         ->info("access existing config in {}", ::GetCurrentProcessId());
   }
-  spdlog::get("usvfs")->info("{} processes - {}", res.first->processList.size(), (int)res.first->logLevel);
+  size_t processCount;
+  {
+    ProcessListGuard guard(*res.first);
+    processCount = res.first->processList.size();
+  }
+  spdlog::get("usvfs")->info("{} processes - {}", processCount, (int)res.first->logLevel);
   return res.first;
 }
 
-HookContext::ConstPtr HookContext::readAccess(const char*)
+HookContext::ConstPtr HookContext::readAccess(const char *source)
 {
   BOOST_ASSERT(s_Instance != nullptr);
 
-  // TODO: this should be a shared mutex!
-  s_Instance->m_Mutex.wait(200);
+  s_Instance->lockShared(source);
   return ConstPtr(s_Instance, unlockShared);
 }
 
-HookContext::Ptr HookContext::writeAccess(const char*)
+HookContext::Ptr HookContext::writeAccess(const char *source)
 {
   BOOST_ASSERT(s_Instance != nullptr);
 
-  s_Instance->m_Mutex.wait(200);
+  s_Instance->lock(source);
   return Ptr(s_Instance, unlock);
 }
 
+void HookContext::lockShared(const char*) const
+{
+  if (!HookStatsTable::enabled()) {
+    m_Mutex.lockShared();
+  } else if (m_Mutex.tryLockShared()) {
+    HookStatsTable::recordLock(false, 0, nullptr);
+  } else {
+    const char *holder = m_ExclusiveSource.load(std::memory_order_relaxed);
+    uint64_t start = HookStatsTable::now();
+    m_Mutex.lockShared();
+    HookStatsTable::recordLock(false, std::max<uint64_t>(HookStatsTable::now() - start, 1),
+                               holder);
+  }
+}
+
+void HookContext::lock(const char *source)
+{
+  if (!HookStatsTable::enabled()) {
+    m_Mutex.lock();
+  } else if (m_Mutex.tryLock()) {
+    HookStatsTable::recordLock(true, 0, nullptr);
+  } else {
+    const char *holder = m_ExclusiveSource.load(std::memory_order_relaxed);
+    uint64_t start = HookStatsTable::now();
+    m_Mutex.lock();
+    HookStatsTable::recordLock(true, std::max<uint64_t>(HookStatsTable::now() - start, 1),
+                               holder);
+  }
+  if (m_Mutex.exclusiveDepth() == 1) {
+    m_ExclusiveSource.store(source, std::memory_order_relaxed);
+  }
+}
+
 void HookContext::setLogLevel(LogLevel level)
 {
   m_Parameters->logLevel = level;
@@ -183,6 +385,8 @@ void HookContext::updateParameters() const
 {
   m_Parameters->currentSHMName = m_Tree.shmName().c_str();
   m_Parameters->currentInverseSHMName = m_InverseTree.shmName().c_str();
+  m_Parameters->inverseGeneration.store(m_InverseTree.generation());
+  retireStaleSnapshot();
 }
 
 USVFSParameters HookContext::callParameters() const
@@ -191,6 +395,116 @@ USVFSParameters HookContext::callParameters() const
   return m_Parameters->makeLocal();
 }
 
+uint64_t HookContext::parametersHandle() const
+{
+  return static_cast<uint64_t>(m_ConfigurationSHM.get_handle_from_address(m_Parameters));
+}
+
+std::string HookContext::snapshotName(long generation) const
+{
+  return shared::FlatTreeSegment::nameFor(m_Parameters->instanceName.c_str(), generation);
+}
+
+std::shared_ptr<const shared::FlatTreeSegment> HookContext::redirectionSnapshot() const
+{
+  long generation = m_Tree.generation();
+  std::lock_guard<std::mutex> lock(m_SnapshotMutex);
+  if (m_Snapshot && (m_Snapshot->tree().generation() == generation)) {
+    return m_Snapshot;
+  }
+  std::shared_ptr<const shared::FlatTreeSegment> retired = std::move(m_Snapshot);
+  m_Snapshot.reset();
+  if (m_Parameters->snapshotGeneration.load() == generation) {
+    std::shared_ptr<const shared::FlatTreeSegment> snapshot(
+        shared::FlatTreeSegment::open(snapshotName(generation)));
+    if (snapshot && (snapshot->tree().generation() == generation)) {
+      m_Snapshot = snapshot;
+    }
+  }
+  m_Published.store(m_Snapshot.get());
+  if (retired) {
+    // lock-free readers may still be using the old snapshot. Waiting for them doesn't
+    // have to hold up this thread, the task keeps the snapshot mapped until they left
+    WorkerPool::instance().submit([this, retired] () { m_Epoch.synchronize(); });
+  }
+  return m_Snapshot;
+}
+
+void HookContext::publishSnapshot(long generation)
+{
+  m_Parameters->snapshotGeneration.store(generation);
+  // a hooked process may have modified the table since the snapshot was taken
+  retireStaleSnapshot();
+}
+
+void HookContext::retireStaleSnapshot() const
+{
+  long published = m_Parameters->snapshotGeneration.load();
+  if ((published != -1) && (published != m_Tree.generation())) {
+    m_Parameters->snapshotGeneration.compare_exchange_strong(published, -1);
+  }
+}
+
+bool HookContext::snapshotPublished()
+{
+  return (s_Instance != nullptr) && (s_Instance->m_Parameters->snapshotGeneration.load() != -1);
+}
+
+long HookContext::inverseGeneration()
+{
+  const HookContext *instance = s_Instance;
+  return (instance != nullptr) ? instance->m_Parameters->inverseGeneration.load() : -1;
+}
+
+bool HookContext::snapshotLookup(const wchar_t *path, size_t length, bool &rerouted,
+                                 std::wstring &reroutePath)
+{
+  const HookContext *instance = s_Instance;
+  if (instance == nullptr) {
+    return false;
+  }
+  long published = instance->m_Parameters->snapshotGeneration.load();
+  if (published == -1) {
+    return false;
+  }
+
+  unsigned int token = instance->m_Epoch.enter();
+  ON_BLOCK_EXIT([instance, token]() { instance->m_Epoch.leave(token); });
+  const shared::FlatTreeSegment *snapshot = instance->m_Published.load();
+  if ((snapshot == nullptr) || (snapshot->tree().generation() != published)) {
+    // not opened in this process yet, happens on the next locked lookup
+    return false;
+  }
+  rerouted = rerouteFromSnapshot(snapshot->tree(), path, length, reroutePath);
+  return true;
+}
+
+bool usvfs::rerouteFromSnapshot(const shared::FlatTree &tree, const wchar_t *path, size_t length,
+                                std::wstring &reroutePath)
+{
+  shared::FlatTree::Match match = tree.lookup(path, length);
+  if (match.node == shared::FlatTree::NOT_FOUND) {
+    return false;
+  }
+  if (match.chainComponents != 0) {
+    // a dummy directory merged into a chain
+    reroutePath = shared::string_cast<std::wstring>(tree.path(match).c_str(),
+                                                    shared::CodePage::UTF8);
+    return true;
+  }
+  uint32_t node = match.node;
+  const char *target = tree.target(node);
+  if (*target != '\0') {
+    reroutePath = shared::string_cast<std::wstring>(target, shared::CodePage::UTF8);
+  } else if (tree.isDirectory(node)) {
+    reroutePath = shared::string_cast<std::wstring>(tree.path(node).c_str(),
+                                                    shared::CodePage::UTF8);
+  } else {
+    return false;
+  }
+  return true;
+}
+
 std::wstring HookContext::dllPath() const
 {
   std::wstring path = winapi::wide::getModuleFileName(m_DLLModule);
@@ -199,15 +513,14 @@ std::wstring HookContext::dllPath() const
 
 void HookContext::registerProcess(DWORD pid)
 {
+  ProcessListGuard guard(*m_Parameters);
   m_Parameters->processList.insert(pid);
+  ++m_Parameters->processGeneration;
 }
 
 void HookContext::blacklistExecutable(const std::wstring &executableName)
 {
-  m_Parameters->processBlacklist.insert(shared::StringT(
-      shared::string_cast<std::string>(executableName, shared::CodePage::UTF8)
-          .c_str(),
-      m_Parameters->processBlacklist.get_allocator()));
+  m_Parameters->blacklistExecutable(executableName);
 }
 
 void HookContext::clearExecutableBlacklist()
@@ -217,39 +530,23 @@ void HookContext::clearExecutableBlacklist()
 
 BOOL HookContext::executableBlacklisted(LPCWSTR lpApplicationName, LPCWSTR lpCommandLine) const
 {
-  BOOL blacklisted = FALSE;
-
-  if (lpApplicationName) {
-    std::string appName = ush::string_cast<std::string>(lpApplicationName, ush::CodePage::UTF8);
-    for (shared::StringT item : m_Parameters->processBlacklist) {
-      if (boost::algorithm::iends_with(appName, std::string(item.data(), item.size()))) {
-        spdlog::get("usvfs")->info("application {} is blacklisted", appName);
-        blacklisted = TRUE;
-        break;
-      }
-    }
-  }
-
-  if (lpCommandLine) {
-    std::string cmdLine = ush::string_cast<std::string>(lpCommandLine, ush::CodePage::UTF8);
-    for (shared::StringT item : m_Parameters->processBlacklist) {
-      if (boost::algorithm::icontains(cmdLine, std::string(item.data(), item.size()))) {
-        spdlog::get("usvfs")->info("command line {} is blacklisted", cmdLine);
-        blacklisted = TRUE;
-        break;
-      }
-    }
+  if (m_Parameters->executableBlacklisted(lpApplicationName, lpCommandLine)) {
+    spdlog::get("usvfs")->info("application {} is blacklisted",
+                               ush::string_cast<std::string>(
+                                   lpApplicationName != nullptr ? lpApplicationName
+                                                                : lpCommandLine,
+                                   ush::CodePage::UTF8));
+    return TRUE;
   }
-
-  return blacklisted;
+  return FALSE;
 }
 
 void HookContext::forceLoadLibrary(const std::wstring &processName, const std::wstring &libraryPath)
 {
-  m_Parameters->forcedLibraries.push_front(ForcedLibrary(
-    shared::string_cast<std::string>(processName, shared::CodePage::UTF8).c_str(),
-    shared::string_cast<std::string>(libraryPath, shared::CodePage::UTF8).c_str(),
-    m_Parameters->forcedLibraries.get_allocator()));
+  std::string key = foldedFileName(processName.c_str(), processName.size());
+  m_Parameters->forcedLibraries.emplace(
+      shared::StringT(key.c_str(), m_Parameters->forcedLibraries.get_allocator()),
+      shared::WStringT(libraryPath.c_str(), m_Parameters->forcedLibraries.get_allocator()));
 }
 
 void HookContext::clearLibraryForceLoads()
@@ -257,52 +554,87 @@ void HookContext::clearLibraryForceLoads()
   m_Parameters->forcedLibraries.clear();
 }
 
-std::vector<std::wstring> HookContext::librariesToForceLoad(const std::wstring &processName)
+std::vector<std::wstring> HookContext::librariesToForceLoad(const std::wstring &processName) const
 {
   std::vector<std::wstring> results;
-  for (auto library : m_Parameters->forcedLibraries) {
-    std::string processNameString = shared::string_cast<std::string>(processName, shared::CodePage::UTF8);
-    if (stricmp(processNameString.c_str(), library.processName.c_str()) == 0) {
-      std::wstring libraryPathString = shared::string_cast<std::wstring>(library.libraryPath.c_str(), shared::CodePage::UTF8);
-      results.push_back(libraryPathString);
-    }
+  auto range = m_Parameters->forcedLibraries.equal_range(
+      foldedFileName(processName.c_str(), processName.size()));
+  for (auto iter = range.first; iter != range.second; ++iter) {
+    results.push_back(std::wstring(iter->second.data(), iter->second.size()));
   }
   return results;
 }
 
 void HookContext::unregisterCurrentProcess()
 {
-  auto iter = m_Parameters->processList.find(::GetCurrentProcessId());
-  m_Parameters->processList.erase(iter);
+  ProcessListGuard guard(*m_Parameters);
+  m_Parameters->processList.erase(::GetCurrentProcessId());
+  ++m_Parameters->processGeneration;
+}
+
+std::vector<HookLib::HookPlan> HookContext::hookPlans() const
+{
+  return std::vector<HookLib::HookPlan>(m_Parameters->hookPlans.begin(),
+                                        m_Parameters->hookPlans.end());
+}
+
+void HookContext::storeHookPlans(const std::vector<HookLib::HookPlan> &plans)
+{
+  auto &shared = m_Parameters->hookPlans;
+  for (const HookLib::HookPlan &plan : plans) {
+    auto iter = std::find_if(shared.begin(), shared.end(),
+                             [&plan](const HookLib::HookPlan &existing) {
+                               return (existing.address == plan.address)
+                                      && (existing.bitness == plan.bitness);
+                             });
+    if (iter == shared.end()) {
+      shared.push_back(plan);
+    } else if (memcmp(&*iter, &plan, sizeof(plan)) != 0) {
+      *iter = plan;
+    }
+  }
 }
 
 std::vector<DWORD> HookContext::registeredProcesses() const
 {
   std::vector<DWORD> result;
+  ProcessListGuard guard(*m_Parameters);
   for (DWORD procId : m_Parameters->processList) {
     result.push_back(procId);
   }
   return result;
 }
 
-void HookContext::registerDelayed(std::future<int> delayed)
+uint32_t HookContext::processGeneration() const
 {
-  m_Futures.push_back(std::move(delayed));
+  return m_Parameters->processGeneration.load();
 }
 
-std::vector<std::future<int>> &HookContext::delayed()
+void HookContext::unregisterProcesses(const std::vector<DWORD> &pids)
 {
-  return m_Futures;
+  ProcessListGuard guard(*m_Parameters);
+  for (DWORD pid : pids) {
+    m_Parameters->processList.erase(pid);
+  }
+}
+
+void HookContext::registerDelayed(WorkerPool::Task task)
+{
+  WorkerPool::instance().submit(std::move(task));
 }
 
 void HookContext::unlock(HookContext *instance)
 {
-  instance->m_Mutex.signal();
+  instance->retireStaleSnapshot();
+  if (instance->m_Mutex.exclusiveDepth() == 1) {
+    instance->m_ExclusiveSource.store(nullptr, std::memory_order_relaxed);
+  }
+  instance->m_Mutex.unlock();
 }
 
 void HookContext::unlockShared(const HookContext *instance)
 {
-  instance->m_Mutex.signal();
+  instance->m_Mutex.unlockShared();
 }
 
 extern "C" DLLEXPORT HookContext *__cdecl CreateHookContext(const USVFSParameters &params, HMODULE module)
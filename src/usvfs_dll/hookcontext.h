@@ -23,20 +23,32 @@ along with usvfs. If not, see <http://www.gnu.org/licenses/>.
 #include "redirectiontree.h"
 #include "dllimport.h"
 #include "semaphore.h"
+#include "hookstatistics.h"
+#include "workerpool.h"
 #include <usvfsparameters.h>
 #include <directory_tree.h>
+#include <flattree.h>
 #include <exceptionex.h>
+#include <interprocess_lock.h>
 #include <winapi.h>
-#include <boost/any.hpp>
+#include <hooklib.h>
 #include <boost/filesystem/path.hpp>
 #include <boost/thread/shared_mutex.hpp>
 #include <boost/thread/shared_lock_guard.hpp>
 #include <boost/interprocess/containers/string.hpp>
 #include <boost/interprocess/containers/flat_set.hpp>
-#include <boost/interprocess/containers/slist.hpp>
+#include <boost/interprocess/containers/flat_map.hpp>
+#include <boost/interprocess/containers/vector.hpp>
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/hashed_index.hpp>
+#include <boost/multi_index/identity.hpp>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstring>
 #include <memory>
+#include <mutex>
 #include <set>
-#include <future>
 #include <windows_sane.h>
 
 namespace usvfs
@@ -55,19 +67,56 @@ void USVFSInitParametersInt(USVFSParameters *parameters,
 typedef shared::VoidAllocatorT::rebind<DWORD>::other DWORDAllocatorT;
 typedef shared::VoidAllocatorT::rebind<shared::StringT>::other StringAllocatorT;
 
-struct ForcedLibrary {
-  ForcedLibrary(const char *processName, const char *libraryPath,
-                const shared::VoidAllocatorT &allocator)
-    : processName(processName, allocator)
-    , libraryPath(libraryPath, allocator)
+typedef shared::VoidAllocatorT::rebind<HookLib::HookPlan>::other HookPlanAllocatorT;
+
+/**
+ * blacklist entries are stored as folded utf-8 file names so lookups compare bytes.
+ * The hash is the same 32-bit one on both bitnesses since they share the table
+ */
+struct FoldedNameHash {
+  template <typename StringT>
+  size_t operator()(const StringT &name) const
   {
+    return shared::foldedHash(name.data(), name.size());
   }
+};
 
-  shared::StringT processName;
-  shared::StringT libraryPath;
+struct FoldedNameEqual {
+  template <typename LHS, typename RHS>
+  bool operator()(const LHS &lhs, const RHS &rhs) const
+  {
+    return (lhs.size() == rhs.size())
+        && (memcmp(lhs.data(), rhs.data(), lhs.size()) == 0);
+  }
 };
 
-typedef shared::VoidAllocatorT::rebind<ForcedLibrary>::other ForcedLibraryAllocatorT;
+typedef boost::multi_index_container<
+  shared::StringT, boost::multi_index::indexed_by<
+    boost::multi_index::hashed_unique<boost::multi_index::identity<shared::StringT>,
+                                      FoldedNameHash, FoldedNameEqual>
+  >, StringAllocatorT> ExecutableBlacklistT;
+
+/**
+ * orders folded names bytewise, transparent so lookups don't have to copy the key
+ * into shared memory
+ */
+struct FoldedNameLess {
+  typedef void is_transparent;
+
+  template <typename LHS, typename RHS>
+  bool operator()(const LHS &lhs, const RHS &rhs) const
+  {
+    int res = memcmp(lhs.data(), rhs.data(), std::min<size_t>(lhs.size(), rhs.size()));
+    return (res < 0) || ((res == 0) && (lhs.size() < rhs.size()));
+  }
+};
+
+typedef std::pair<shared::StringT, shared::WStringT> ForcedLibraryT;
+typedef shared::VoidAllocatorT::rebind<ForcedLibraryT>::other ForcedLibraryAllocatorT;
+
+// libraries to force load keyed by the folded name of the process executable
+typedef boost::container::flat_multimap<shared::StringT, shared::WStringT, FoldedNameLess,
+                                        ForcedLibraryAllocatorT> ForcedLibrariesT;
 
 struct SharedParameters {
 
@@ -86,15 +135,40 @@ struct SharedParameters {
     , logLevel(reference.logLevel)
     , crashDumpsType(reference.crashDumpsType)
     , crashDumpsPath(reference.crashDumpsPath, allocator)
+    , logSampleInterval(reference.logSampleInterval)
+    , logRateLimit(reference.logRateLimit)
+    , traceDirectory(reference.traceDirectory, allocator)
+    , iniCache(reference.iniCache)
+    , copyOnWrite(reference.copyOnWrite)
+    , attributeCache(reference.attributeCache)
+    , readAheadDirectory(reference.readAheadDirectory, allocator)
+    , prefaultTree(reference.prefaultTree)
     , userCount(1)
     , processBlacklist(allocator)
     , processList(allocator)
+    , processGeneration(0)
     , forcedLibraries(allocator)
+    , hookPlans(allocator)
+    , snapshotGeneration(-1)
+    , inverseGeneration(-1)
   {
   }
 
   DLLEXPORT USVFSParameters makeLocal() const;
 
+  /**
+   * @brief add an executable to the blacklist. Only the file name of the path is kept
+   */
+  DLLEXPORT void blacklistExecutable(const std::wstring &executableName);
+
+  /**
+   * @brief test whether a process created from these parameters would run a
+   *        blacklisted executable. Only the file name of the application and of the
+   *        first token of the command line are looked up, either may be null
+   */
+  DLLEXPORT bool executableBlacklisted(LPCWSTR applicationName,
+                                       LPCWSTR commandLine) const;
+
   shared::StringT instanceName;
   shared::StringT currentSHMName;
   shared::StringT currentInverseSHMName;
@@ -102,14 +176,40 @@ struct SharedParameters {
   LogLevel logLevel;
   CrashDumpsType crashDumpsType;
   shared::StringT crashDumpsPath;
+  uint32_t logSampleInterval;
+  uint32_t logRateLimit;
+  shared::StringT traceDirectory;
+  bool iniCache;
+  bool copyOnWrite;
+  bool attributeCache;
+  shared::StringT readAheadDirectory;
+  bool prefaultTree;
   uint32_t userCount;
-  boost::container::flat_set<shared::StringT, std::less<shared::StringT>,
-                             StringAllocatorT> processBlacklist;
+  ExecutableBlacklistT processBlacklist;
   boost::container::flat_set<DWORD, std::less<DWORD>, DWORDAllocatorT> processList;
-  boost::container::slist<ForcedLibrary, ForcedLibraryAllocatorT> forcedLibraries;
+  // held by any process reading or modifying processList
+  shared::InterprocessLock processLock;
+  // changed whenever a process registers or unregisters itself
+  std::atomic<uint32_t> processGeneration;
+  ForcedLibrariesT forcedLibraries;
+  // how the system functions were hooked, for both bitnesses
+  boost::container::vector<HookLib::HookPlan, HookPlanAllocatorT> hookPlans;
+  // generation of the published frozen redirection table, -1 if there is none
+  std::atomic<long> snapshotGeneration;
+  // generation of the inverse table as of the last updateParameters, -1 if unknown
+  std::atomic<long> inverseGeneration;
 };
 
 
+/**
+ * @brief look up a path in a frozen redirection table
+ * @param reroutePath receives the path the lookup is redirected to (not normalized)
+ * @return true if the path is redirected
+ */
+bool rerouteFromSnapshot(const shared::FlatTree &tree, const wchar_t *path, size_t length,
+                         std::wstring &reroutePath);
+
+
 /**
  * @brief context available to hooks. This is protected by a many-reader
  * single-writer mutex
@@ -121,10 +221,19 @@ public:
   typedef std::unique_ptr<const HookContext, void (*)(const HookContext *)>
       ConstPtr;
   typedef std::unique_ptr<HookContext, void (*)(HookContext *)> Ptr;
-  typedef unsigned int DataIDT;
+
+  // number of distinct custom data slots available to the hooks
+  static const size_t MAX_CUSTOM_DATA = 32;
 
 public:
-  HookContext(const USVFSParameters &params, HMODULE module);
+  /**
+   * @param configuration if set, the already opened configuration shm. It's moved into
+   *                      the context
+   * @param parameters the shared parameters inside configuration, required if it's set
+   */
+  HookContext(const USVFSParameters &params, HMODULE module,
+              shared::SharedMemoryT *configuration = nullptr,
+              SharedParameters *parameters = nullptr);
 
   HookContext(const HookContext &reference) = delete;
 
@@ -174,11 +283,58 @@ public:
     return m_InverseTree;
   }
 
+  /**
+   * @return name of the segment holding the frozen redirection table of the
+   *         specified generation
+   */
+  std::string snapshotName(long generation) const;
+
+  /**
+   * @brief frozen copy of the redirection table, see FreezeVFS
+   * @return the snapshot or a null pointer if there is none for the current
+   *         generation of the redirection table
+   */
+  std::shared_ptr<const shared::FlatTreeSegment> redirectionSnapshot() const;
+
+  /**
+   * @brief make the snapshot of the specified generation available to all processes.
+   *        Has no effect if the redirection table has changed in the meantime
+   */
+  void publishSnapshot(long generation);
+
+  /**
+   * @return true if a frozen redirection table is published
+   */
+  static bool snapshotPublished();
+
+  /**
+   * @return generation of the inverse table as it was last published by
+   *         updateParameters. Doesn't lock the context, -1 if it's unknown
+   */
+  static long inverseGeneration();
+
+  /**
+   * @brief look up a path in the published frozen redirection table without locking
+   *        the context
+   * @param rerouted set to true if the path is redirected
+   * @param reroutePath receives the path the lookup is redirected to
+   * @return false if there is no up-to-date snapshot, the caller has to use the
+   *         redirection table then
+   */
+  static bool snapshotLookup(const wchar_t *path, size_t length, bool &rerouted,
+                             std::wstring &reroutePath);
+
   /**
    * @return the parameters passed in on dll initialisation
    */
   USVFSParameters callParameters() const;
 
+  /**
+   * @return handle of the shared parameters in the configuration shm, passed on to
+   *         injected children so they don't have to look them up
+   */
+  uint64_t parametersHandle() const;
+
   /**
    * @return true if usvfs is running in debug mode
    */
@@ -187,33 +343,47 @@ public:
     return m_DebugMode;
   }
 
+  /**
+   * @return true if mapped files are copied to the create target before they are
+   *         opened for writing
+   */
+  bool copyOnWrite() const
+  {
+    return m_CopyOnWrite;
+  }
+
   /**
    * @return path to the calling library itself
    */
   std::wstring dllPath() const;
 
   /**
-   * @brief get access to custom data
+   * @brief get access to custom data. Every combination of type and tag (declared with
+   *        DATA_ID) gets a slot of its own on first use, from then on this is a
+   *        plain array access without lookup or type check
    * @note the caller gains write access to the data, independent on the lock on
    * the context
    *       as a whole. The caller himself has to ensure thread safety
    */
-  template <typename T> T &customData(DataIDT id) const
+  template <typename T, typename Tag> T &customData() const
   {
-    auto iter = m_CustomData.find(id);
-    if (iter == m_CustomData.end()) {
-      iter = m_CustomData.insert(std::make_pair(id, T())).first;
+    static const size_t slot = allocateCustomSlot();
+    void *data = m_CustomData[slot].load(std::memory_order_acquire);
+    if (data == nullptr) {
+      data = createCustomData(slot, []() -> void* { return new T(); },
+                              [](void *data) { delete static_cast<T*>(data); });
     }
-    // std::map is supposed to not invalidate any iterators when elements are
-    // added
-    // so it should be safe to return a pointer here
-    T *res = boost::any_cast<T>(&iter->second);
-    return *res;
+    return *static_cast<T*>(data);
   }
 
   void registerProcess(DWORD pid);
   void unregisterCurrentProcess();
   std::vector<DWORD> registeredProcesses() const;
+  uint32_t processGeneration() const;
+  /**
+   * @brief remove processes that ended without unregistering from the process list
+   */
+  void unregisterProcesses(const std::vector<DWORD> &pids);
 
   void blacklistExecutable(const std::wstring &executableName);
   void clearExecutableBlacklist();
@@ -221,23 +391,47 @@ public:
 
   void forceLoadLibrary(const std::wstring &processName, const std::wstring &libraryPath);
   void clearLibraryForceLoads();
-  std::vector<std::wstring> librariesToForceLoad(const std::wstring &processName);
+  std::vector<std::wstring> librariesToForceLoad(const std::wstring &processName) const;
+
+  /**
+   * @return the hook plans published by processes hooked before
+   */
+  std::vector<HookLib::HookPlan> hookPlans() const;
+
+  /**
+   * @brief publish hook plans for the processes hooked after this one. Replaces
+   *        existing plans for the same function
+   */
+  void storeHookPlans(const std::vector<HookLib::HookPlan> &plans);
 
   void setLogLevel(LogLevel level);
   void setCrashDumpsType(CrashDumpsType type);
 
   void updateParameters() const;
 
-  void registerDelayed(std::future<int> delayed);
-
-  std::vector<std::future<int>> &delayed();
+  /**
+   * @brief run a task on the worker pool. Tasks are completed before the process exits
+   */
+  void registerDelayed(WorkerPool::Task task);
 
 private:
   static void unlock(HookContext *instance);
   static void unlockShared(const HookContext *instance);
 
+  // acquire the mutex, recording contention if hook statistics are enabled
+  void lockShared(const char *source) const;
+  void lock(const char *source);
+
   SharedParameters *retrieveParameters(const USVFSParameters &params);
 
+  void retireStaleSnapshot() const;
+
+  // exported since customData is instantiated by the callers
+  DLLEXPORT static size_t allocateCustomSlot();
+  // create the data of a slot unless another thread was faster
+  DLLEXPORT void *createCustomData(size_t slot, void *(*create)(),
+                                   void (*destroy)(void*)) const;
+
 private:
   static HookContext *s_Instance;
 
@@ -247,16 +441,24 @@ private:
   RedirectionTreeContainer m_Tree;
   RedirectionTreeContainer m_InverseTree;
 
-  std::vector<std::future<int>> m_Futures;
+  mutable std::mutex m_SnapshotMutex;
+  mutable std::shared_ptr<const shared::FlatTreeSegment> m_Snapshot;
+  // m_Snapshot as seen by lock-free readers, protected by m_Epoch
+  mutable std::atomic<const shared::FlatTreeSegment*> m_Published{nullptr};
+  mutable EpochDomain m_Epoch;
 
-  mutable std::map<DataIDT, boost::any> m_CustomData;
+  mutable std::array<std::atomic<void*>, MAX_CUSTOM_DATA> m_CustomData{};
+  mutable std::array<void (*)(void*), MAX_CUSTOM_DATA> m_CustomDataDeleters{};
 
   bool m_DebugMode{false};
+  bool m_CopyOnWrite{false};
 
   HMODULE m_DLLModule;
 
-  //  mutable std::recursive_mutex m_Mutex;
-  mutable RecursiveBenaphore m_Mutex;
+  mutable RecursiveSharedMutex m_Mutex;
+  // function that currently holds m_Mutex exclusively, for the lock statistics
+  std::atomic<const char*> m_ExclusiveSource{nullptr};
+  mutable std::mutex m_CustomDataMutex;
 };
 }
 
@@ -273,9 +475,10 @@ private:
   DWORD m_err;
 };
 
-// declare an identifier that is guaranteed to be unique across the application
+// declare a tag for HookContext::customData. Tags are types so they are unique across
+// the application, unlike counters that start over in every translation unit
 #define DATA_ID(name)                                                          \
-  static const usvfs::HookContext::DataIDT name = __COUNTER__
+  struct name
 
 // set of macros. These ensure a call context is created but most of all these
 // ensure exceptions are caught.
@@ -285,11 +488,13 @@ private:
 
 #define HOOK_START_GROUP(group)                                                \
   try {                                                                        \
-    HookCallContext callContext(group);
+    static usvfs::HookStatsSlot hookStatsSlot(__MYFUNC__);                     \
+    HookCallContext callContext(group, hookStatsSlot);
 
 #define HOOK_START                                                             \
   try {                                                                        \
-    HookCallContext callContext;
+    static usvfs::HookStatsSlot hookStatsSlot(__MYFUNC__);                     \
+    HookCallContext callContext(hookStatsSlot);
 
 #define HOOK_END                                                               \
   }                                                                            \
@@ -309,5 +514,8 @@ private:
     logExtInfo(e);                                                             \
   }
 
-#define PRE_REALCALL callContext.restoreLastError();
-#define POST_REALCALL callContext.updateLastError();
+// single expressions so they still work as the body of an unbraced if
+#define PRE_REALCALL                                                           \
+  (callContext.beginRealCall(), callContext.restoreLastError());
+#define POST_REALCALL                                                          \
+  (callContext.updateLastError(), callContext.endRealCall());
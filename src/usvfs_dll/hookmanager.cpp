@@ -46,9 +46,15 @@ namespace usvfs {
 HookManager *HookManager::s_Instance = nullptr;
 
 
-HookManager::HookManager(const USVFSParameters &params, HMODULE module)
-  : m_Context(params, module)
+HookManager::HookManager(const USVFSParameters &params, HMODULE module,
+                         shared::SharedMemoryT *configuration,
+                         SharedParameters *parameters)
+  : m_Created(std::chrono::steady_clock::now())
+  , m_Context(params, module, configuration, parameters)
 {
+  m_AttachTime = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - m_Created);
+
   if (s_Instance != nullptr) {
     throw std::runtime_error("singleton duplicate instantiation (HookManager)");
   }
@@ -63,7 +69,10 @@ HookManager::HookManager(const USVFSParameters &params, HMODULE module)
                              version.major, version.minor, version.build, version.servicpack, version.platformid,
                              shared::string_cast<std::string>(winapi::ex::wide::getWindowsBuildLab(true)).c_str());
 
+  auto hookStart = std::chrono::steady_clock::now();
   initHooks();
+  m_HookTime = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - hookStart);
 
   if (params.debugMode) {
     MessageBoxA(nullptr, "Hooks initialized", "Pause", MB_OK);
@@ -131,7 +140,7 @@ void HookManager::logStub(LPVOID address)
   }
 }
 
-void HookManager::installHook(HMODULE module1, HMODULE module2, const std::string &functionName, LPVOID hook, LPVOID* fillFuncAddr = nullptr)
+void HookManager::installHook(HMODULE module1, HMODULE module2, const std::string &functionName, LPVOID hook, LPVOID* fillFuncAddr = nullptr, bool lazy = false, bool grouped = true)
 {
   BOOST_ASSERT(hook != nullptr);
   HOOKHANDLE handle = INVALID_HOOK;
@@ -142,7 +151,8 @@ void HookManager::installHook(HMODULE module1, HMODULE module2, const std::strin
   if (module1 != nullptr) {
     funcAddr = MyGetProcAddress(module1, functionName.c_str());
     if (funcAddr != nullptr) {
-      handle = InstallHook(funcAddr, hook, &err);
+      handle = lazy ? InstallLazyHook(funcAddr, hook, &err, grouped)
+                    : InstallHook(funcAddr, hook, &err, grouped);
     }
     if (handle != INVALID_HOOK) usedModule = module1;
   }
@@ -150,7 +160,8 @@ void HookManager::installHook(HMODULE module1, HMODULE module2, const std::strin
   if ((handle == INVALID_HOOK) && (module2 != nullptr)) {
     funcAddr = MyGetProcAddress(module2, functionName.c_str());
     if (funcAddr != nullptr) {
-      handle = InstallHook(funcAddr, hook, &err);
+      handle = lazy ? InstallLazyHook(funcAddr, hook, &err, grouped)
+                    : InstallHook(funcAddr, hook, &err, grouped);
     }
     if (handle != INVALID_HOOK) usedModule = module2;
   }
@@ -165,8 +176,9 @@ void HookManager::installHook(HMODULE module1, HMODULE module2, const std::strin
     m_Stubs.insert(make_pair(funcAddr, functionName));
     m_Hooks.insert(make_pair(std::string(functionName), handle));
     spdlog::get("usvfs")->info(
-        "hooked {0} ({1}) in {2} type {3}", functionName, funcAddr,
-        winapi::ansi::getModuleFileName(usedModule), GetHookType(handle));
+        "hooked {0} ({1}) in {2} type {3}{4}", functionName, funcAddr,
+        winapi::ansi::getModuleFileName(usedModule), GetHookType(handle),
+        lazy ? " (lazy)" : "");
   }
 }
 
@@ -227,39 +239,50 @@ void HookManager::initHooks()
   HMODULE kbaseMod = GetModuleHandleA("kernelbase.dll");
   spdlog::get("usvfs")->debug("kernelbase.dll at {0:x}", reinterpret_cast<uintptr_t>(kbaseMod));
 
+  // processes hooked before published how they hooked each function, as long as
+  // the code is unchanged we don't have to analyse it again
+  std::vector<HookLib::HookPlan> plans = m_Context.hookPlans();
+  HookLib::SetHookPlans(plans);
+
+  // all hooks go live at the same time at the end, with other threads paused only
+  // once instead of once per hook
+  HookLib::BeginHookBatch();
+
   installHook(kbaseMod, k32Mod, "GetFileAttributesExW", hook_GetFileAttributesExW);
   installHook(kbaseMod, k32Mod, "GetFileAttributesW", hook_GetFileAttributesW);
   installHook(kbaseMod, k32Mod, "SetFileAttributesW", hook_SetFileAttributesW);
 
-  installHook(kbaseMod, k32Mod, "CreateDirectoryW", hook_CreateDirectoryW);
+  installHook(kbaseMod, k32Mod, "CreateDirectoryW", hook_CreateDirectoryW, nullptr, false, false);
   installHook(kbaseMod, k32Mod, "RemoveDirectoryW", hook_RemoveDirectoryW);
   installHook(kbaseMod, k32Mod, "DeleteFileW", hook_DeleteFileW);
-  installHook(kbaseMod, k32Mod, "GetCurrentDirectoryA", hook_GetCurrentDirectoryA);
-  installHook(kbaseMod, k32Mod, "GetCurrentDirectoryW", hook_GetCurrentDirectoryW);
+  installHook(kbaseMod, k32Mod, "GetCurrentDirectoryA", hook_GetCurrentDirectoryA, nullptr, false, false);
+  installHook(kbaseMod, k32Mod, "GetCurrentDirectoryW", hook_GetCurrentDirectoryW, nullptr, false, false);
   installHook(kbaseMod, k32Mod, "SetCurrentDirectoryA", hook_SetCurrentDirectoryA);
-  installHook(kbaseMod, k32Mod, "SetCurrentDirectoryW", hook_SetCurrentDirectoryW);
+  installHook(kbaseMod, k32Mod, "SetCurrentDirectoryW", hook_SetCurrentDirectoryW, nullptr, false, false);
 
-  installHook(kbaseMod, k32Mod, "ExitProcess", hook_ExitProcess);
+  installHook(kbaseMod, k32Mod, "ExitProcess", hook_ExitProcess, nullptr, false, false);
 
-  installHook(kbaseMod, k32Mod, "CreateProcessInternalW", hook_CreateProcessInternalW, reinterpret_cast<LPVOID*>(&CreateProcessInternalW));
+  // hooks passing true for lazy are for functions many processes never call,
+  // their trampolines are only generated on the first call
+  installHook(kbaseMod, k32Mod, "CreateProcessInternalW", hook_CreateProcessInternalW, reinterpret_cast<LPVOID*>(&CreateProcessInternalW), true);
 
-  installHook(kbaseMod, k32Mod, "MoveFileA", hook_MoveFileA);
+  installHook(kbaseMod, k32Mod, "MoveFileA", hook_MoveFileA, nullptr, false, false);
   installHook(kbaseMod, k32Mod, "MoveFileW", hook_MoveFileW);
-  installHook(kbaseMod, k32Mod, "MoveFileExA", hook_MoveFileExA);
+  installHook(kbaseMod, k32Mod, "MoveFileExA", hook_MoveFileExA, nullptr, false, false);
   installHook(kbaseMod, k32Mod, "MoveFileExW", hook_MoveFileExW);
-  installHook(kbaseMod, k32Mod, "MoveFileWithProgressA", hook_MoveFileWithProgressA);
-  installHook(kbaseMod, k32Mod, "MoveFileWithProgressW", hook_MoveFileWithProgressW);
+  installHook(kbaseMod, k32Mod, "MoveFileWithProgressA", hook_MoveFileWithProgressA, nullptr, true, false);
+  installHook(kbaseMod, k32Mod, "MoveFileWithProgressW", hook_MoveFileWithProgressW, nullptr, true);
 
   installHook(kbaseMod, k32Mod, "CopyFileExW", hook_CopyFileExW);
   if (IsWindows8OrGreater())
-    installHook(kbaseMod, k32Mod, "CopyFile2", hook_CopyFile2, reinterpret_cast<LPVOID*>(&CopyFile2));
+    installHook(kbaseMod, k32Mod, "CopyFile2", hook_CopyFile2, reinterpret_cast<LPVOID*>(&CopyFile2), true);
 
-  installHook(kbaseMod, k32Mod, "GetPrivateProfileStringA", hook_GetPrivateProfileStringA);
-  installHook(kbaseMod, k32Mod, "GetPrivateProfileStringW", hook_GetPrivateProfileStringW);
-  installHook(kbaseMod, k32Mod, "GetPrivateProfileSectionA", hook_GetPrivateProfileSectionA);
-  installHook(kbaseMod, k32Mod, "GetPrivateProfileSectionW", hook_GetPrivateProfileSectionW);
-  installHook(kbaseMod, k32Mod, "WritePrivateProfileStringA", hook_WritePrivateProfileStringA);
-  installHook(kbaseMod, k32Mod, "WritePrivateProfileStringW", hook_WritePrivateProfileStringW);
+  installHook(kbaseMod, k32Mod, "GetPrivateProfileStringA", hook_GetPrivateProfileStringA, nullptr, true);
+  installHook(kbaseMod, k32Mod, "GetPrivateProfileStringW", hook_GetPrivateProfileStringW, nullptr, true);
+  installHook(kbaseMod, k32Mod, "GetPrivateProfileSectionA", hook_GetPrivateProfileSectionA, nullptr, true);
+  installHook(kbaseMod, k32Mod, "GetPrivateProfileSectionW", hook_GetPrivateProfileSectionW, nullptr, true);
+  installHook(kbaseMod, k32Mod, "WritePrivateProfileStringA", hook_WritePrivateProfileStringA, nullptr, true);
+  installHook(kbaseMod, k32Mod, "WritePrivateProfileStringW", hook_WritePrivateProfileStringW, nullptr, true);
 
   installHook(kbaseMod, k32Mod, "GetFullPathNameA", hook_GetFullPathNameA);
   installHook(kbaseMod, k32Mod, "GetFullPathNameW", hook_GetFullPathNameW);
@@ -270,19 +293,25 @@ void HookManager::initHooks()
   spdlog::get("usvfs")->debug("ntdll.dll at {0:x}", reinterpret_cast<uintptr_t>(ntdllMod));
   installHook(ntdllMod, nullptr, "NtQueryFullAttributesFile", hook_NtQueryFullAttributesFile);
   installHook(ntdllMod, nullptr, "NtQueryAttributesFile", hook_NtQueryAttributesFile);
+  // GetFileInformationByName and the stat of newer runtimes end up here
+  if (::NtQueryInformationByName != nullptr)
+    installHook(ntdllMod, nullptr, "NtQueryInformationByName", hook_NtQueryInformationByName);
   installHook(ntdllMod, nullptr, "NtQueryDirectoryFile", hook_NtQueryDirectoryFile);
   installHook(ntdllMod, nullptr, "NtQueryDirectoryFileEx", hook_NtQueryDirectoryFileEx);
   installHook(ntdllMod, nullptr, "NtOpenFile", hook_NtOpenFile);
   installHook(ntdllMod, nullptr, "NtCreateFile", hook_NtCreateFile);
   installHook(ntdllMod, nullptr, "NtClose", hook_NtClose);
-  installHook(ntdllMod, nullptr, "NtTerminateProcess", hook_NtTerminateProcess);
+  installHook(ntdllMod, nullptr, "NtTerminateProcess", hook_NtTerminateProcess, nullptr, false, false);
 
   installHook(kbaseMod, k32Mod, "LoadLibraryExW", hook_LoadLibraryExW);
 
   // install this hook late as usvfs is calling it itself for debugging purposes
   installHook(kbaseMod, k32Mod, "GetModuleFileNameW", hook_GetModuleFileNameW);
 
-  spdlog::get("usvfs")->debug("hooks installed");
+  size_t patched = HookLib::EndHookBatch();
+  spdlog::get("usvfs")->debug("hooks installed ({} locations patched)", patched);
+  m_Context.storeHookPlans(HookLib::GetHookPlans());
+  spdlog::get("usvfs")->debug("{} hook plans received", plans.size());
   HookLib::TrampolinePool::instance().setBlock(false);
 }
 
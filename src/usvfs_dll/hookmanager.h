@@ -23,6 +23,7 @@ along with usvfs. If not, see <http://www.gnu.org/licenses/>.
 #include "hookcontext.h"
 #include <usvfsparameters.h>
 #include <hooklib.h>
+#include <chrono>
 #include <map>
 
 
@@ -32,7 +33,9 @@ class HookManager
 {
 public:
 
-  HookManager(const USVFSParameters &params, HMODULE module);
+  HookManager(const USVFSParameters &params, HMODULE module,
+              shared::SharedMemoryT *configuration = nullptr,
+              SharedParameters *parameters = nullptr);
   ~HookManager();
 
   HookManager(const HookManager &reference) = delete;
@@ -45,6 +48,16 @@ public:
 
   HookContext *context() { return &m_Context; }
 
+  ///
+  /// \brief time the constructor spent attaching the context to the shared trees
+  ///
+  std::chrono::nanoseconds attachTime() const { return m_AttachTime; }
+
+  ///
+  /// \brief time the constructor spent installing the hooks
+  ///
+  std::chrono::nanoseconds hookTime() const { return m_HookTime; }
+
   ///
   /// \brief retrieve address of the detour of a function
   /// \param functionName name of the function to look up
@@ -66,7 +79,9 @@ private:
   void logStubInt(LPVOID address);
   static void logStub(LPVOID address);
 
-  void installHook(HMODULE module1, HMODULE module2, const std::string &functionName, LPVOID hook, LPVOID* fillFuncAddr);
+  // grouped is false for hooks that don't use a hook group (HOOK_START), those are
+  // entered even while ALL_GROUPS suppresses the hooks of the thread
+  void installHook(HMODULE module1, HMODULE module2, const std::string &functionName, LPVOID hook, LPVOID* fillFuncAddr, bool lazy, bool grouped);
   void installStub(HMODULE module1, HMODULE module2, const std::string &functionName);
   void initHooks();
   void removeHooks();
@@ -79,8 +94,13 @@ private:
 
   std::map<LPVOID, std::string> m_Stubs;
 
+  // initialized before the context so its construction can be timed
+  std::chrono::steady_clock::time_point m_Created;
   HookContext m_Context;
 
+  std::chrono::nanoseconds m_AttachTime;
+  std::chrono::nanoseconds m_HookTime;
+
 };
 
 } // namespace usvfs
@@ -5,6 +5,8 @@
 #include "../hookcontext.h"
 #include "../hookcallcontext.h"
 #include "../maptracker.h"
+#include "../inicache.h"
+#include "../readahead.h"
 
 #include <usvfs.h>
 #include <inject.h>
@@ -13,6 +15,7 @@
 #include <shellapi.h>
 #include <stringutils.h>
 #include <stringcast.h>
+#include <map>
 #include <set>
 #include <sstream>
 #include <shlwapi.h>
@@ -35,6 +38,12 @@ using ush::CodePage;
 namespace usvfs {
 MapTracker k32DeleteTracker;
 MapTracker k32FakeDirTracker;
+MapTracker k32KnownDirTracker;
+MapTracker k32VirtualDirTracker;
+RerouteCache rerouteCache;
+ModulePathCache modulePathCache;
+IniCache iniCache;
+AttributeCache attributeCache;
 } // namespace usvfs
 
 class CurrentDirectoryTracker {
@@ -131,6 +140,53 @@ static inline bool pathsOnDifferentDrives(LPCWSTR path1, LPCWSTR path2)
   return drive1 && drive2 && towupper(drive1) != towupper(drive2);
 }
 
+// serial numbers of volumes by the root they are mounted at, so telling whether a move
+// stays on one volume doesn't query the volume every time
+class VolumeIdCache {
+public:
+  // serial number of the volume path is on, 0 if it can't be determined
+  DWORD volumeId(LPCWSTR path)
+  {
+    wchar_t root[MAX_PATH];
+    if (!path || !::GetVolumePathNameW(path, root, MAX_PATH))
+      return 0;
+    const std::wstring key = ush::to_upper(root);
+
+    {
+      std::shared_lock<std::shared_mutex> lock(m_mutex);
+      auto iter = m_ids.find(key);
+      if (iter != m_ids.end())
+        return iter->second;
+    }
+
+    DWORD serial = 0;
+    if (!::GetVolumeInformationW(root, nullptr, 0, &serial, nullptr, nullptr, nullptr, 0))
+      return 0;
+
+    std::unique_lock<std::shared_mutex> lock(m_mutex);
+    m_ids[key] = serial;
+    return serial;
+  }
+
+private:
+  std::shared_mutex m_mutex;
+  std::map<std::wstring, DWORD> m_ids;
+};
+
+VolumeIdCache k32VolumeIdCache;
+
+// unlike pathsOnDifferentDrives this also knows about volumes mounted into directories
+// and different drive letters for the same volume. Falls back to comparing the drive
+// letters if the volume of a path can't be determined
+static inline bool pathsOnDifferentVolumes(LPCWSTR path1, LPCWSTR path2)
+{
+  DWORD volume1 = k32VolumeIdCache.volumeId(path1);
+  DWORD volume2 = k32VolumeIdCache.volumeId(path2);
+  if (!volume1 || !volume2)
+    return pathsOnDifferentDrives(path1, path2);
+  return volume1 != volume2;
+}
+
 
 
 HMODULE WINAPI usvfs::hook_LoadLibraryExW(LPCWSTR lpFileName, HANDLE hFile,
@@ -141,7 +197,7 @@ HMODULE WINAPI usvfs::hook_LoadLibraryExW(LPCWSTR lpFileName, HANDLE hFile,
   HOOK_START_GROUP(MutExHookGroup::LOAD_LIBRARY)
   // Why is the usual if (!callContext.active()... check missing?
 
-  RerouteW reroute = RerouteW::create(READ_CONTEXT(), callContext, lpFileName);
+  RerouteW reroute = RerouteW::create(callContext, lpFileName);
   PRE_REALCALL
   res = ::LoadLibraryExW(reroute.fileName(), hFile, dwFlags);
   POST_REALCALL
@@ -227,6 +283,7 @@ BOOL WINAPI usvfs::hook_CreateProcessInternalW(
 
   std::wstring dllPath;
   USVFSParameters callParameters;
+  uint64_t parametersHandle = 0;
 
   { // scope for context lock
     auto context = READ_CONTEXT();
@@ -247,6 +304,8 @@ BOOL WINAPI usvfs::hook_CreateProcessInternalW(
         auto old_cend = *cend;
         *cend = 0;
         cmdReroute = RerouteW::create(context, callContext, lpCommandLine + 1);
+        // the command line is restored below, the name has to stay cut off
+        cmdReroute.ownFileName();
         *cend = old_cend;
         if (old_cend == '"')
           ++cend;
@@ -262,6 +321,7 @@ BOOL WINAPI usvfs::hook_CreateProcessInternalW(
           auto old_cend = *cend;
           *cend = 0;
           cmdReroute = RerouteW::create(context, callContext, lpCommandLine);
+          cmdReroute.ownFileName();
           *cend = old_cend;
           if (cmdReroute.wasRerouted() || pathIsFile(cmdReroute.fileName()))
             break;
@@ -283,6 +343,7 @@ BOOL WINAPI usvfs::hook_CreateProcessInternalW(
 
     dllPath        = context->dllPath();
     callParameters = context->callParameters();
+    parametersHandle = context->parametersHandle();
   }
 
   std::wstring cmdline;
@@ -320,7 +381,7 @@ BOOL WINAPI usvfs::hook_CreateProcessInternalW(
   {
     if (!blacklisted) {
       try {
-        injectProcess(dllPath, callParameters, *lpProcessInformation);
+        injectProcess(dllPath, callParameters, *lpProcessInformation, parametersHandle);
       } catch (const std::exception &e) {
         spdlog::get("hooks")
             ->error("failed to inject into {0}: {1}",
@@ -363,10 +424,11 @@ BOOL WINAPI usvfs::hook_GetFileAttributesExW(
     return res;
   }
 
-  fs::path canonicalFile = RerouteW::canonizePath(RerouteW::absolutePath(lpFileName));
+  fs::path canonicalFile = RerouteW::lookupPath(lpFileName);
 
-  RerouteW reroute = RerouteW::create(READ_CONTEXT(), callContext, canonicalFile.c_str());
+  RerouteW reroute = RerouteW::create(callContext, canonicalFile.c_str());
 
+  callContext.handOffPath(reroute.fileName());
   PRE_REALCALL
   res = ::GetFileAttributesExW(reroute.fileName(), fInfoLevelId,
                                lpFileInformation);
@@ -390,7 +452,7 @@ BOOL WINAPI usvfs::hook_GetFileAttributesExW(
       fixedError = ERROR_FILE_NOT_FOUND;
     else {
       // now query the rerouted path for parent (which can be different from the parent of the rerouted path)
-      RerouteW rerouteParent = RerouteW::create(READ_CONTEXT(), callContext, originalParent.c_str());
+      RerouteW rerouteParent = RerouteW::create(callContext, originalParent.c_str());
       if (rerouteParent.wasRerouted()
         && ::GetFileAttributesExW(rerouteParent.fileName(), GetFileExInfoStandard, &parentAttr)
         && (parentAttr.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
@@ -432,10 +494,11 @@ DWORD WINAPI usvfs::hook_GetFileAttributesW(LPCWSTR lpFileName)
     return res;
   }
 
-  fs::path canonicalFile = RerouteW::canonizePath(RerouteW::absolutePath(lpFileName));
+  fs::path canonicalFile = RerouteW::lookupPath(lpFileName);
 
-  RerouteW reroute = RerouteW::create(READ_CONTEXT(), callContext, canonicalFile.c_str());
+  RerouteW reroute = RerouteW::create(callContext, canonicalFile.c_str());
 
+  callContext.handOffPath(reroute.fileName());
   if (reroute.wasRerouted())
   PRE_REALCALL
   res = ::GetFileAttributesW(reroute.fileName());
@@ -459,7 +522,7 @@ DWORD WINAPI usvfs::hook_GetFileAttributesW(LPCWSTR lpFileName)
       fixedError = ERROR_FILE_NOT_FOUND;
     else {
       // now query the rerouted path for parent (which can be different from the parent of the rerouted path)
-      RerouteW rerouteParent = RerouteW::create(READ_CONTEXT(), callContext, originalParent.c_str());
+      RerouteW rerouteParent = RerouteW::create(callContext, originalParent.c_str());
       if (rerouteParent.wasRerouted()
         && (attr = ::GetFileAttributesW(rerouteParent.fileName())) != INVALID_FILE_ATTRIBUTES
         && (attr & FILE_ATTRIBUTE_DIRECTORY))
@@ -491,7 +554,8 @@ DWORD WINAPI usvfs::hook_SetFileAttributesW(
   HOOK_START_GROUP(MutExHookGroup::FILE_ATTRIBUTES)
   // Why is the usual if (!callContext.active()... check missing?
 
-  RerouteW reroute = RerouteW::create(READ_CONTEXT(), callContext, lpFileName);
+  RerouteW reroute = RerouteW::create(callContext, lpFileName);
+  callContext.handOffPath(reroute.fileName());
   PRE_REALCALL
   res = ::SetFileAttributesW(reroute.fileName(), dwFileAttributes);
   POST_REALCALL
@@ -512,8 +576,9 @@ BOOL WINAPI usvfs::hook_DeleteFileW(LPCWSTR lpFileName)
   HOOK_START_GROUP(MutExHookGroup::DELETE_FILE)
   // Why is the usual if (!callContext.active()... check missing?
 
-  RerouteW reroute = RerouteW::create(READ_CONTEXT(), callContext, lpFileName);
+  RerouteW reroute = RerouteW::create(callContext, lpFileName);
 
+  callContext.handOffPath(reroute.wasRerouted() ? reroute.fileName() : lpFileName);
   PRE_REALCALL
   if (reroute.wasRerouted()) {
     res = ::DeleteFileW(reroute.fileName());
@@ -522,7 +587,7 @@ BOOL WINAPI usvfs::hook_DeleteFileW(LPCWSTR lpFileName)
   }
   POST_REALCALL
 
-  reroute.removeMapping(READ_CONTEXT());
+  reroute.removeMapping(WRITE_CONTEXT());
   if (reroute.wasRerouted())
     LOG_CALL().PARAMWRAP(lpFileName).PARAMWRAP(reroute.fileName()).PARAM(res).PARAM(callContext.lastError());
 
@@ -535,7 +600,7 @@ BOOL rewriteChangedDrives(LPCWSTR lpExistingFileName, LPCWSTR lpNewFileName,
   const usvfs::RerouteW& readReroute, const usvfs::CreateRerouter& writeReroute)
 {
   return ((readReroute.wasRerouted() || writeReroute.wasRerouted())
-    && pathsOnDifferentDrives(readReroute.fileName(), writeReroute.fileName())
+    && pathsOnDifferentVolumes(readReroute.fileName(), writeReroute.fileName())
     && !pathsOnDifferentDrives(lpExistingFileName, lpNewFileName));
 }
 
@@ -631,8 +696,8 @@ BOOL WINAPI usvfs::hook_MoveFileW(LPCWSTR lpExistingFileName,
 
     writeReroute.updateResult(callContext, res);
 
-    if (res) {
-      readReroute.removeMapping(READ_CONTEXT(), isDirectory); // Updating the rerouteCreate to check deleted file entries should make this okay
+    if (res && !readReroute.moveMapping(WRITE_CONTEXT(), writeReroute.reroute(), isDirectory)) {
+      readReroute.removeMapping(WRITE_CONTEXT(), isDirectory); // Updating the rerouteCreate to check deleted file entries should make this okay
 
       if (writeReroute.newReroute()) {
         if (isDirectory)
@@ -747,8 +812,8 @@ BOOL WINAPI usvfs::hook_MoveFileExW(LPCWSTR lpExistingFileName,
 
     writeReroute.updateResult(callContext, res);
 
-    if (res) {
-      readReroute.removeMapping(READ_CONTEXT(), isDirectory); // Updating the rerouteCreate to check deleted file entries should make this okay
+    if (res && !readReroute.moveMapping(WRITE_CONTEXT(), writeReroute.reroute(), isDirectory)) {
+      readReroute.removeMapping(WRITE_CONTEXT(), isDirectory); // Updating the rerouteCreate to check deleted file entries should make this okay
 
       if (writeReroute.newReroute()) {
         if (isDirectory)
@@ -866,10 +931,10 @@ BOOL WINAPI usvfs::hook_MoveFileWithProgressW(LPCWSTR lpExistingFileName, LPCWST
 
   writeReroute.updateResult(callContext, res);
 
-  if (res) {
+  if (res && !readReroute.moveMapping(WRITE_CONTEXT(), writeReroute.reroute(), isDirectory)) {
     //TODO: this call causes the node to be removed twice in case of MOVEFILE_COPY_ALLOWED as the deleteFile hook lower level already takes care of it,
     //but deleteFile can't be disabled since we are relying on it in case of MOVEFILE_REPLACE_EXISTING for the destination file. 
-    readReroute.removeMapping(READ_CONTEXT(), isDirectory); // Updating the rerouteCreate to check deleted file entries should make this okay (not related to comments above)
+    readReroute.removeMapping(WRITE_CONTEXT(), isDirectory); // Updating the rerouteCreate to check deleted file entries should make this okay (not related to comments above)
 
     if (writeReroute.newReroute()) {
       if (isDirectory)
@@ -1020,7 +1085,7 @@ BOOL WINAPI usvfs::hook_SetCurrentDirectoryW(LPCWSTR lpPathName)
 
   HOOK_START
 
-  const fs::path& realPath = RerouteW::canonizePath(RerouteW::absolutePath(lpPathName));
+  const fs::path& realPath = RerouteW::lookupPath(lpPathName);
   const std::wstring& realPathStr = realPath.wstring();
   std::wstring finalRoute;
   BOOL found = FALSE;
@@ -1033,7 +1098,8 @@ BOOL WINAPI usvfs::hook_SetCurrentDirectoryW(LPCWSTR lpPathName)
       WCHAR processName[MAX_PATH];
       ::GetModuleFileNameW(NULL, processName, MAX_PATH);
       fs::path routedName = realPath / processName;
-      RerouteW rerouteTest = RerouteW::create(READ_CONTEXT(), callContext, routedName.wstring().c_str());
+      const std::wstring routedNameStr = routedName.wstring();
+      RerouteW rerouteTest = RerouteW::create(callContext, routedNameStr.c_str());
       if (rerouteTest.wasRerouted()) {
         std::wstring reroutedPath = rerouteTest.fileName();
         if (routedName.wstring().find(processDir) != std::string::npos) {
@@ -1045,7 +1111,7 @@ BOOL WINAPI usvfs::hook_SetCurrentDirectoryW(LPCWSTR lpPathName)
     }
 
     if (!found) {
-      RerouteW reroute = RerouteW::create(READ_CONTEXT(), callContext, realPathStr.c_str());
+      RerouteW reroute = RerouteW::create(callContext, realPathStr.c_str());
       finalRoute = reroute.fileName();
     }
   }
@@ -1054,6 +1120,9 @@ BOOL WINAPI usvfs::hook_SetCurrentDirectoryW(LPCWSTR lpPathName)
   res = ::SetCurrentDirectoryW(finalRoute.c_str());
   POST_REALCALL
 
+  if (res)
+    setCurrentDirectory(realPathStr);
+
   if (res)
     if (!k32CurrentDirectoryTracker.set(realPathStr))
       spdlog::get("usvfs")->warn("Updating actual current directory failed: {} ?!", string_cast<std::string>(realPathStr));
@@ -1080,10 +1149,13 @@ DLLEXPORT BOOL WINAPI usvfs::hook_CreateDirectoryW(
 
   RerouteW reroute = RerouteW::createOrNew(READ_CONTEXT(), callContext, lpPathName);
 
+  callContext.handOffPath(reroute.fileName());
   PRE_REALCALL
   res = ::CreateDirectoryW(reroute.fileName(), lpSecurityAttributes);
   POST_REALCALL
 
+  if (res)
+    k32VirtualDirTracker.clear();
   if (res && reroute.newReroute())
     reroute.insertMapping(WRITE_CONTEXT(), true);
 
@@ -1104,8 +1176,9 @@ DLLEXPORT BOOL WINAPI usvfs::hook_RemoveDirectoryW(
   HOOK_START_GROUP(MutExHookGroup::DELETE_FILE)
   // Why is the usual if (!callContext.active()... check missing?
 
-  RerouteW reroute = RerouteW::create(READ_CONTEXT(), callContext, lpPathName);
+  RerouteW reroute = RerouteW::create(callContext, lpPathName);
 
+  callContext.handOffPath(reroute.wasRerouted() ? reroute.fileName() : lpPathName);
   PRE_REALCALL
   if (reroute.wasRerouted()) {
     res = ::RemoveDirectoryW(reroute.fileName());
@@ -1115,7 +1188,7 @@ DLLEXPORT BOOL WINAPI usvfs::hook_RemoveDirectoryW(
   }
   POST_REALCALL
 
-  reroute.removeMapping(READ_CONTEXT(), true);
+  reroute.removeMapping(WRITE_CONTEXT(), true);
   if (reroute.wasRerouted())
     LOG_CALL().PARAMWRAP(lpPathName).PARAMWRAP(reroute.fileName()).PARAM(res).PARAM(callContext.lastError());
 
@@ -1231,10 +1304,24 @@ DWORD WINAPI usvfs::hook_GetModuleFileNameW(HMODULE hModule,
       full_res = ::GetModuleFileNameW(hModule, buf.data(), buf_size);
     }
 
-    RerouteW reroute
-        = RerouteW::create(READ_CONTEXT(), callContext, buf.empty() ? lpFilename : buf.data(), true);
-    if (reroute.wasRerouted()) {
-      DWORD reroutedSize = static_cast<DWORD>(wcslen(reroute.fileName()));
+    // module paths only change when modules are loaded or the links change, so the
+    // inverse lookup is cached per module
+    const wchar_t *realPath = buf.empty() ? lpFilename : buf.data();
+    long generation = HookContext::inverseGeneration();
+    bool rerouted = false;
+    std::wstring virtualPath;
+    if (modulePathCache.lookup(hModule, generation, realPath, full_res, rerouted, virtualPath)) {
+      callContext.markRedirected(rerouted);
+    } else {
+      RerouteW reroute = RerouteW::create(callContext, realPath, true);
+      rerouted = reroute.wasRerouted();
+      if (rerouted) {
+        virtualPath = reroute.fileName();
+      }
+      modulePathCache.insert(hModule, generation, realPath, full_res, rerouted, virtualPath);
+    }
+    if (rerouted) {
+      DWORD reroutedSize = static_cast<DWORD>(virtualPath.size());
       if (reroutedSize >= nSize) {
         reroutedSize = nSize - 1;
         callContext.updateLastError(ERROR_INSUFFICIENT_BUFFER);
@@ -1242,7 +1329,7 @@ DWORD WINAPI usvfs::hook_GetModuleFileNameW(HMODULE hModule,
       }
       else
         res = reroutedSize;
-      memcpy(lpFilename, reroute.fileName(), reroutedSize * sizeof(lpFilename[0]));
+      memcpy(lpFilename, virtualPath.c_str(), reroutedSize * sizeof(lpFilename[0]));
       lpFilename[reroutedSize] = 0;
 
       LOG_CALL()
@@ -1277,38 +1364,48 @@ HANDLE WINAPI usvfs::hook_FindFirstFileExW(LPCWSTR lpFileName, FINDEX_INFO_LEVEL
   bool usedRewrite = false;
 
   // We need to do some trickery here, since we only want to use the hooked NtQueryDirectoryFile for rerouted locations we need to check if the Directory path has been routed instead of the full path.
-  originalPath = RerouteW::canonizePath(RerouteW::absolutePath(lpFileName));
-  PRE_REALCALL
-    res = ::FindFirstFileExW(originalPath.c_str(), fInfoLevelId, lpFindFileData, fSearchOp, lpSearchFilter, dwAdditionalFlags);
-  POST_REALCALL
+  originalPath = RerouteW::lookupPath(lpFileName);
+  fs::path searchPath = originalPath.filename();
+  fs::path parentPath = originalPath.parent_path();
+  std::wstring findPath = parentPath.wstring();
+  while (findPath.find(L"*?<>\"", 0, 1) != std::wstring::npos) {
+    searchPath = parentPath.filename() / searchPath;
+    parentPath = parentPath.parent_path();
+    findPath = parentPath.wstring();
+  }
+
+  // the tree decides up front whether the directory is rerouted at all. The real
+  // search still comes first for rerouted directories that exist on disk, the hooked
+  // NtQueryDirectoryFile merges the virtual entries into that
+  reroute = RerouteW::create(callContext, parentPath.c_str());
+  if (reroute.wasRerouted()) {
+    finalPath = reroute.fileName();
+    finalPath /= searchPath.wstring();
+  }
+  bool virtualOnly = !finalPath.empty() && k32VirtualDirTracker.contains(findPath);
 
-  if (res == INVALID_HANDLE_VALUE) {
-    fs::path searchPath = originalPath.filename();
-    fs::path parentPath = originalPath.parent_path();
-    std::wstring findPath = parentPath.wstring();
-    while (findPath.find(L"*?<>\"", 0, 1) != std::wstring::npos) {
-      searchPath = parentPath.filename() / searchPath;
-      parentPath = parentPath.parent_path();
-      findPath = parentPath.wstring();
-    }
-    reroute = RerouteW::create(READ_CONTEXT(), callContext, parentPath.c_str());
-    if (reroute.wasRerouted()) {
-      finalPath = reroute.fileName();
-      finalPath /= searchPath.wstring();
-    }
-    if (!finalPath.empty()) {
-      PRE_REALCALL
-        usedRewrite = true;
-        res = ::FindFirstFileExW(finalPath.c_str(), fInfoLevelId, lpFindFileData, fSearchOp, lpSearchFilter, dwAdditionalFlags);
-      POST_REALCALL
+  DWORD originalError = ERROR_SUCCESS;
+  if (!virtualOnly) {
+    PRE_REALCALL
+      res = ::FindFirstFileExW(originalPath.c_str(), fInfoLevelId, lpFindFileData, fSearchOp, lpSearchFilter, dwAdditionalFlags);
+    POST_REALCALL
+    originalError = callContext.lastError();
+  }
+
+  if ((res == INVALID_HANDLE_VALUE) && !finalPath.empty()) {
+    PRE_REALCALL
+      usedRewrite = true;
+      res = ::FindFirstFileExW(finalPath.c_str(), fInfoLevelId, lpFindFileData, fSearchOp, lpSearchFilter, dwAdditionalFlags);
+    POST_REALCALL
+    if ((res != INVALID_HANDLE_VALUE) && (originalError == ERROR_PATH_NOT_FOUND)) {
+      // the directory only exists in the vfs
+      k32VirtualDirTracker.insert(findPath, std::wstring());
     }
   }
 
   if (res != INVALID_HANDLE_VALUE) {
   // store the original search path for use during iteration
-  WRITE_CONTEXT()
-      ->customData<SearchHandleMap>(SearchHandles)[res]
-      = lpFileName;
+  searchHandles.insert(res, PathPool::instance().intern(lpFileName));
   }
 
   //LOG_CALL().PARAMWRAP(lpFileName).PARAMWRAP(tempPathStr.c_str());
@@ -1383,12 +1480,31 @@ DWORD WINAPI usvfs::hook_GetPrivateProfileStringA(LPCSTR lpAppName, LPCSTR lpKey
     return res;
   }
 
-  RerouteW reroute = RerouteW::create(READ_CONTEXT(), callContext, ush::string_cast<std::wstring>(lpFileName).c_str());
+  const std::wstring fileName = ush::string_cast<std::wstring>(lpFileName);
+  RerouteW reroute = RerouteW::create(callContext, fileName.c_str());
 
-  PRE_REALCALL
-  res =
-    ::GetPrivateProfileStringA(lpAppName, lpKeyName, lpDefault, lpReturnedString, nSize, ush::string_cast<std::string>(reroute.fileName()).c_str());
-  POST_REALCALL
+  // enumerating sections or keys is left to the system
+  std::shared_ptr<const ush::IniFile> ini;
+  if (reroute.wasRerouted() && iniCache.enabled() && (lpAppName != nullptr)
+      && (lpKeyName != nullptr) && (lpReturnedString != nullptr)) {
+    ini = iniCache.get(reroute.fileName());
+  }
+
+  if (ini != nullptr) {
+    std::wstring value;
+    DWORD error;
+    profileString(*ini, ush::string_cast<std::wstring>(lpAppName).c_str(),
+                  ush::string_cast<std::wstring>(lpKeyName).c_str(),
+                  (lpDefault != nullptr) ? ush::string_cast<std::wstring>(lpDefault).c_str() : nullptr,
+                  value, error);
+    res = copyProfileString(ush::string_cast<std::string>(value), lpReturnedString, nSize, error);
+    callContext.updateLastError(error);
+  } else {
+    PRE_REALCALL
+    res =
+      ::GetPrivateProfileStringA(lpAppName, lpKeyName, lpDefault, lpReturnedString, nSize, ush::string_cast<std::string>(reroute.fileName()).c_str());
+    POST_REALCALL
+  }
 
   if (reroute.wasRerouted()) {
     LOG_CALL()
@@ -1417,12 +1533,27 @@ DWORD WINAPI usvfs::hook_GetPrivateProfileStringW(LPCWSTR lpAppName, LPCWSTR lpK
     return res;
   }
 
-  RerouteW reroute = RerouteW::create(READ_CONTEXT(), callContext, lpFileName);
+  RerouteW reroute = RerouteW::create(callContext, lpFileName);
 
-  PRE_REALCALL
-  res =
-    ::GetPrivateProfileStringW(lpAppName, lpKeyName, lpDefault, lpReturnedString, nSize, reroute.fileName());
-  POST_REALCALL
+  // enumerating sections or keys is left to the system
+  std::shared_ptr<const ush::IniFile> ini;
+  if (reroute.wasRerouted() && iniCache.enabled() && (lpAppName != nullptr)
+      && (lpKeyName != nullptr) && (lpReturnedString != nullptr)) {
+    ini = iniCache.get(reroute.fileName());
+  }
+
+  if (ini != nullptr) {
+    std::wstring value;
+    DWORD error;
+    profileString(*ini, lpAppName, lpKeyName, lpDefault, value, error);
+    res = copyProfileString(value, lpReturnedString, nSize, error);
+    callContext.updateLastError(error);
+  } else {
+    PRE_REALCALL
+    res =
+      ::GetPrivateProfileStringW(lpAppName, lpKeyName, lpDefault, lpReturnedString, nSize, reroute.fileName());
+    POST_REALCALL
+  }
 
   if (reroute.wasRerouted()) {
     LOG_CALL()
@@ -1451,12 +1582,32 @@ DWORD WINAPI usvfs::hook_GetPrivateProfileSectionA(LPCSTR lpAppName, LPSTR lpRet
     return res;
   }
 
-  RerouteW reroute = RerouteW::create(READ_CONTEXT(), callContext, ush::string_cast<std::wstring>(lpFileName).c_str());
+  const std::wstring fileName = ush::string_cast<std::wstring>(lpFileName);
+  RerouteW reroute = RerouteW::create(callContext, fileName.c_str());
 
-  PRE_REALCALL
-  res =
-    ::GetPrivateProfileSectionA(lpAppName, lpReturnedString, nSize, ush::string_cast<std::string>(reroute.fileName()).c_str());
-  POST_REALCALL
+  std::shared_ptr<const ush::IniFile> ini;
+  if (reroute.wasRerouted() && iniCache.enabled() && (lpAppName != nullptr)
+      && (lpReturnedString != nullptr) && (nSize >= 2)) {
+    ini = iniCache.get(reroute.fileName());
+  }
+
+  if (ini != nullptr) {
+    std::wstring entries;
+    DWORD error;
+    profileSection(*ini, ush::string_cast<std::wstring>(lpAppName).c_str(), entries, error);
+    // the conversion drops the null terminating the last entry
+    std::string entriesA = ush::string_cast<std::string>(entries.c_str(), CodePage::LOCAL, entries.size());
+    if (!entries.empty()) {
+      entriesA.push_back('\0');
+    }
+    res = copyProfileSection(entriesA, lpReturnedString, nSize);
+    callContext.updateLastError(error);
+  } else {
+    PRE_REALCALL
+    res =
+      ::GetPrivateProfileSectionA(lpAppName, lpReturnedString, nSize, ush::string_cast<std::string>(reroute.fileName()).c_str());
+    POST_REALCALL
+  }
 
   if (reroute.wasRerouted()) {
     LOG_CALL()
@@ -1484,12 +1635,26 @@ DWORD WINAPI usvfs::hook_GetPrivateProfileSectionW(LPCWSTR lpAppName, LPWSTR lpR
     return res;
   }
 
-  RerouteW reroute = RerouteW::create(READ_CONTEXT(), callContext, lpFileName);
+  RerouteW reroute = RerouteW::create(callContext, lpFileName);
 
-  PRE_REALCALL
-  res =
-    ::GetPrivateProfileSectionW(lpAppName, lpReturnedString, nSize, reroute.fileName());
-  POST_REALCALL
+  std::shared_ptr<const ush::IniFile> ini;
+  if (reroute.wasRerouted() && iniCache.enabled() && (lpAppName != nullptr)
+      && (lpReturnedString != nullptr) && (nSize >= 2)) {
+    ini = iniCache.get(reroute.fileName());
+  }
+
+  if (ini != nullptr) {
+    std::wstring entries;
+    DWORD error;
+    profileSection(*ini, lpAppName, entries, error);
+    res = copyProfileSection(entries, lpReturnedString, nSize);
+    callContext.updateLastError(error);
+  } else {
+    PRE_REALCALL
+    res =
+      ::GetPrivateProfileSectionW(lpAppName, lpReturnedString, nSize, reroute.fileName());
+    POST_REALCALL
+  }
 
   if (reroute.wasRerouted()) {
     LOG_CALL()
@@ -1517,9 +1682,10 @@ BOOL WINAPI usvfs::hook_WritePrivateProfileStringA(LPCSTR lpAppName, LPCSTR lpKe
     return res;
   }
 
+  const std::wstring fileName = ush::string_cast<std::wstring>(lpFileName);
   CreateRerouter reroute;
   bool callOriginal = reroute.rerouteNew(READ_CONTEXT(), callContext,
-      ush::string_cast<std::wstring>(lpFileName).c_str(), true, "hook_WritePrivateProfileStringA");
+      fileName.c_str(), true, "hook_WritePrivateProfileStringA");
 
   if (callOriginal)
   {
@@ -1528,6 +1694,9 @@ BOOL WINAPI usvfs::hook_WritePrivateProfileStringA(LPCSTR lpAppName, LPCSTR lpKe
     POST_REALCALL
     reroute.updateResult(callContext, res);
 
+    if (res && iniCache.enabled())
+      iniCache.invalidate(reroute.fileName());
+
     if (res && reroute.newReroute())
       reroute.insertMapping(WRITE_CONTEXT());
 
@@ -1570,6 +1739,9 @@ BOOL WINAPI usvfs::hook_WritePrivateProfileStringW(LPCWSTR lpAppName, LPCWSTR lp
     POST_REALCALL
     reroute.updateResult(callContext, res);
 
+    if (res && iniCache.enabled())
+      iniCache.invalidate(reroute.fileName());
+
     if (res && reroute.newReroute())
       reroute.insertMapping(WRITE_CONTEXT());
 
@@ -1593,19 +1765,10 @@ VOID WINAPI usvfs::hook_ExitProcess(UINT exitCode)
 {
   HOOK_START
 
-  {
-    HookContext::Ptr context = WRITE_CONTEXT();
-
-    std::vector<std::future<int>> &delayed = context->delayed();
-
-    if (!delayed.empty()) {
-      // ensure all delayed tasks are completed before we exit the process
-      for (std::future<int> &delayedOp : delayed) {
-        delayedOp.get();
-      }
-      delayed.clear();
-    }
-  }
+  // pending read-ahead is of no use anymore
+  ReadAhead::close();
+  // ensure all delayed tasks are completed before we exit the process
+  WorkerPool::instance().stop();
 
   // exitprocess doesn't return so logging the call after the real call doesn't
   // make much sense.
@@ -4,6 +4,8 @@
 #include "../hookcontext.h"
 #include "../hookcallcontext.h"
 #include "../maptracker.h"
+#include "../foldednameset.h"
+#include "../readahead.h"
 #include "../stringcast_boost.h"
 #include <usvfs.h>
 #pragma warning(push, 3)
@@ -13,11 +15,10 @@
 //#include <boost/thread/mutex.hpp>
 #pragma warning(pop)
 #include <string>
-#include <deque>
-#include <queue>
+#include <unordered_map>
 #include <vector>
-#include <set>
 #include <map>
+#include <algorithm>
 #include <cstdint>
 #include <cwctype>
 #include <codecvt>
@@ -28,6 +29,7 @@
 #include <scopeguard.h>
 #include <addrtools.h>
 #include <unicodestring.h>
+#include <etwprovider.h>
 #include <windows.h>
 #include <fileapi.h>
 #include <mutex>
@@ -50,9 +52,6 @@ using usvfs::UnicodeString;
 #define FILE_OVERWRITE_IF 0x00000005
 #define FILE_MAXIMUM_DISPOSITION 0x00000005
 
-template <typename T>
-using unique_ptr_deleter = std::unique_ptr<T, void (*)(T *)>;
-
 class RedirectionInfo {
 public:
   UnicodeString path;
@@ -60,41 +59,46 @@ public:
 
   RedirectionInfo() {}
   RedirectionInfo(UnicodeString path, bool redirected)
-    : path(path)
+    : path(std::move(path))
     , redirected(redirected)
   {}
 };
 
+// maps open handles to the path they were opened with. Paths are kept in the
+// PathPool, so a lookup only copies a reference under the shard lock and callers
+// that just read the path don't copy it at all
 class HandleTracker {
 public:
   using handle_type = HANDLE;
   using info_type = UnicodeString;
+  using info_ptr = usvfs::PathPool::Ref;
 
   HandleTracker() { insert_current_directory(); }
 
-  info_type lookup(handle_type handle) const {
+  // the path the handle was opened with or an empty reference if not tracked
+  info_ptr find(handle_type handle) const {
+    info_ptr result;
     if (valid_handle(handle))
-    {
-      std::shared_lock<std::shared_mutex> lock(m_mutex);
-      auto find = m_map.find(handle);
-      if (find != m_map.end())
-        return find->second;
-    }
-    return info_type();
+      m_map.find(handle, result);
+    return result;
   }
 
-  void insert(handle_type handle, const info_type& info) {
+  info_type lookup(handle_type handle) const {
+    info_ptr result = find(handle);
+    return result ? info_type(result.c_str(), result.size()) : info_type();
+  }
+
+  void insert(handle_type handle, const info_type &info) {
     if (!valid_handle(handle))
       return;
-    std::unique_lock<std::shared_mutex> lock(m_mutex);
-    m_map[handle] = info;
+    m_map.insert(handle, usvfs::PathPool::instance().intern(static_cast<LPCWSTR>(info),
+                                                            info.size()));
   }
 
   void erase(handle_type handle)
   {
     if (!valid_handle(handle))
       return;
-    std::unique_lock<std::shared_mutex> lock(m_mutex);
     m_map.erase(handle);
   }
 
@@ -122,8 +126,7 @@ private:
     }
   }
 
-  mutable std::shared_mutex m_mutex;
-  std::unordered_map<handle_type, info_type> m_map;
+  usvfs::ShardedHandleMap<info_ptr, 64> m_map;
 };
 
 HandleTracker ntdllHandleTracker;
@@ -161,6 +164,66 @@ std::ostream &operator<<(std::ostream &os, POBJECT_ATTRIBUTES attr)
   return operator<<(os, *attr->ObjectName);
 }
 
+namespace usvfs {
+namespace log {
+namespace detail {
+
+// the paths of the hot hooks go into log records without being converted
+
+template <>
+struct RecordField<POBJECT_ATTRIBUTES> {
+  static bool write(RecordWriter &record, const char *name, POBJECT_ATTRIBUTES attr, bool)
+  {
+    record.addWide(name, attr->ObjectName->Buffer, attr->ObjectName->Length / sizeof(WCHAR));
+    return true;
+  }
+};
+
+template <>
+struct RecordField<UnicodeString> {
+  static bool write(RecordWriter &record, const char *name, const UnicodeString &str, bool)
+  {
+    boost::wstring_view view = str.view();
+    record.addWide(name, view.data(), view.size());
+    return true;
+  }
+};
+
+}
+}
+}
+
+static void setReroutePath(RedirectionInfo &result, std::wstring reroutePath,
+                           LPCWSTR lookupPath, size_t lookupLength)
+{
+  if ((*reroutePath.rbegin() == L'\\') && (lookupPath[lookupLength - 1] != L'\\')) {
+    reroutePath.resize(reroutePath.size() - 1);
+  }
+  std::replace(reroutePath.begin(), reroutePath.end(), L'/', L'\\');
+  if (reroutePath[1] == L'\\')
+    reroutePath[1] = L'?';
+  result.path = UnicodeString(LR"(\??\)", 4);
+  result.path.append(reroutePath.c_str(), reroutePath.size());
+  result.redirected = true;
+}
+
+/**
+ * @return the root bit (see PrefixFilter::rootBit) of an nt path. Only \??\X: paths
+ *         are on a drive, everything else like \Device\ or \??\UNC\ counts as
+ *         another root
+ */
+static uint32_t ntPathRootBit(const UnicodeString &path)
+{
+  LPCWSTR buffer = static_cast<LPCWSTR>(path);
+  if ((path.size() >= 6) && (wcsncmp(buffer, LR"(\??\)", 4) == 0) && (buffer[5] == L':')) {
+    wchar_t letter = ush::foldChar(buffer[4]);
+    if ((letter >= L'A') && (letter <= L'Z')) {
+      return 1U << (letter - L'A');
+    }
+  }
+  return usvfs::shared::PrefixFilter::OTHER_ROOT;
+}
+
 RedirectionInfo
 applyReroute(const usvfs::HookContext::ConstPtr &context,
              const usvfs::HookCallContext &callContext,
@@ -169,40 +232,101 @@ applyReroute(const usvfs::HookContext::ConstPtr &context,
   RedirectionInfo result;
   result.path  = inPath;
   result.redirected = false;
-
-  if (callContext.active()) {
-    // see if the file exists in the redirection tree
-    std::string lookupPath = ush::string_cast<std::string>(
-        static_cast<LPCWSTR>(result.path) + 4, ush::CodePage::UTF8);
-    auto node = context->redirectionTable()->findNode(lookupPath.c_str());
-    // if so, replace the file name with the path to the mapped file
-    if ((node.get() != nullptr) && (!node->data().linkTarget.empty() || node->isDirectory())) {
-      std::wstring reroutePath;
-
-      if (node->data().linkTarget.length() > 0)
-      {
-        reroutePath = ush::string_cast<std::wstring>(
-          node->data().linkTarget.c_str(), ush::CodePage::UTF8);
-      }
-      else
-      {
-        reroutePath = ush::string_cast<std::wstring>(
-          node->path().c_str(),
-          ush::CodePage::UTF8);
+  callContext.tracePath(static_cast<LPCWSTR>(inPath), inPath.size());
+
+  if (callContext.active() && (inPath.size() > 4)
+      && context->redirectionTable().mayContainRoot(ntPathRootBit(inPath))
+      && context->redirectionTable().mayContain(static_cast<LPCWSTR>(inPath) + 4,
+                                                inPath.size() - 4)) {
+    long generation = context->redirectionTable().generation();
+    std::wstring cachedPath;
+    if (usvfs::rerouteCache.lookup(static_cast<LPCWSTR>(inPath), inPath.size(), generation,
+                                   result.redirected, cachedPath)) {
+      if (result.redirected) {
+        result.path = cachedPath;
       }
-      if ((*reroutePath.rbegin() == L'\\') && (*lookupPath.rbegin() != '\\')) {
-        reroutePath.resize(reroutePath.size() - 1);
+      ush::etw::reroute(static_cast<LPCWSTR>(inPath), inPath.size(),
+                        static_cast<LPCWSTR>(result.path), result.redirected);
+      callContext.markRedirected(result.redirected);
+      return result;
+    }
+
+    // see if the file exists in the redirection tree. A frozen snapshot of the
+    // current generation, if available, answers the same question without
+    // touching the shared memory tree
+    LPCWSTR lookupPath = static_cast<LPCWSTR>(inPath) + 4;
+    size_t lookupLength = inPath.size() - 4;
+    bool found = false;
+    std::wstring reroutePath;
+    auto snapshot = context->redirectionSnapshot();
+    if (snapshot) {
+      found = usvfs::rerouteFromSnapshot(snapshot->tree(), lookupPath, lookupLength, reroutePath);
+    } else {
+      const usvfs::RedirectionTree *node
+          = context->redirectionTable()->findNodeRaw(lookupPath, lookupLength);
+      // if so, replace the file name with the path to the mapped file
+      if ((node != nullptr) && (node->data().hasTarget() || node->isDirectory())) {
+        found = true;
+        if (node->data().hasTarget())
+        {
+          reroutePath = node->data().wideTarget();
+        }
+        else
+        {
+          reroutePath = usvfs::widePath(*node);
+        }
       }
-      std::replace(reroutePath.begin(), reroutePath.end(), L'/', L'\\');
-      if (reroutePath[1] == L'\\')
-        reroutePath[1] = L'?';
-      result.path = LR"(\??\)" + reroutePath;
-      result.redirected = true;
     }
+    if (found) {
+      setReroutePath(result, reroutePath, lookupPath, lookupLength);
+    }
+    usvfs::rerouteCache.insert(static_cast<LPCWSTR>(inPath), inPath.size(), generation,
+                               result.redirected,
+                               result.redirected ? static_cast<LPCWSTR>(result.path) : nullptr);
+    ush::etw::reroute(static_cast<LPCWSTR>(inPath), inPath.size(),
+                      static_cast<LPCWSTR>(result.path), result.redirected);
   }
+  callContext.markRedirected(result.redirected);
   return result;
 }
 
+/**
+ * like applyReroute above but answers from the published frozen redirection table
+ * without locking the context if possible
+ */
+RedirectionInfo
+applyReroute(const usvfs::HookCallContext &callContext, const UnicodeString &inPath)
+{
+  if (callContext.active() && (inPath.size() > 4)) {
+    LPCWSTR lookupPath = static_cast<LPCWSTR>(inPath) + 4;
+    size_t lookupLength = inPath.size() - 4;
+    if (usvfs::HookCallContext::handedOff(static_cast<LPCWSTR>(inPath), inPath.size())) {
+      // a kernel32 hook this call is nested in already rerouted the path
+      RedirectionInfo result;
+      result.path = inPath;
+      result.redirected = false;
+      callContext.tracePath(lookupPath, lookupLength);
+      return result;
+    }
+    bool rerouted = false;
+    std::wstring reroutePath;
+    if (usvfs::HookContext::snapshotLookup(lookupPath, lookupLength, rerouted, reroutePath)) {
+      RedirectionInfo result;
+      result.path = inPath;
+      result.redirected = false;
+      if (rerouted) {
+        setReroutePath(result, reroutePath, lookupPath, lookupLength);
+      }
+      callContext.tracePath(lookupPath, lookupLength);
+      ush::etw::reroute(static_cast<LPCWSTR>(inPath), inPath.size(),
+                        static_cast<LPCWSTR>(result.path), rerouted);
+      callContext.markRedirected(rerouted);
+      return result;
+    }
+  }
+  return applyReroute(usvfs::HookContext::readAccess(__MYFUNC__), callContext, inPath);
+}
+
 RedirectionInfo
 applyReroute(const usvfs::CreateRerouter &rerouter)
 {
@@ -218,22 +342,13 @@ applyReroute(const usvfs::CreateRerouter &rerouter)
         (reroutePath[1] == L'?') &&
         (reroutePath[2] == L'?') &&
         (reroutePath[3] == L'\\'))) {
-    result.path = LR"(\??\)" + reroutePath;
+    result.path = UnicodeString(LR"(\??\)", 4);
+    result.path.append(reroutePath.c_str(), reroutePath.size());
   }
 
   return result;
 }
 
-struct FindCreateTarget {
-  usvfs::RedirectionTree::NodePtrT target;
-  void operator()(usvfs::RedirectionTree::NodePtrT node)
-  {
-    if (node->hasFlag(usvfs::shared::FLAG_CREATETARGET)) {
-      target = node;
-    }
-  }
-};
-
 std::pair<UnicodeString, UnicodeString>
 findCreateTarget(const usvfs::HookContext::ConstPtr &context,
                  const UnicodeString &inPath)
@@ -242,21 +357,20 @@ findCreateTarget(const usvfs::HookContext::ConstPtr &context,
   result.first  = inPath;
   result.second = UnicodeString();
 
-  std::string lookupPath = ush::string_cast<std::string>(
-      static_cast<LPCWSTR>(result.first) + 4, ush::CodePage::UTF8);
-  FindCreateTarget visitor;
-  usvfs::RedirectionTree::VisitorFunction visitorWrapper =
-      [&](const usvfs::RedirectionTree::NodePtrT &node) { visitor(node); };
-  context->redirectionTable()->visitPath(lookupPath, visitorWrapper);
-  if (visitor.target.get() != nullptr) {
-    bfs::path relativePath
-        = ush::make_relative(visitor.target->path(), bfs::path(lookupPath));
-
-    bfs::path target(visitor.target->data().linkTarget.c_str());
-    target /= relativePath;
-
-    result.second = UnicodeString(target.wstring().c_str());
-    winapi::ex::wide::createPath(target.parent_path());
+  LPCWSTR lookupPathW = static_cast<LPCWSTR>(result.first) + 4;
+  size_t lookupLength = result.first.size() - 4;
+  auto resolution = context->redirectionTable()->resolvePath(
+      lookupPathW, lookupLength, usvfs::shared::FLAG_CREATETARGET);
+  if (resolution.flagged != nullptr) {
+    bfs::path target(resolution.flagged->data().wideTarget());
+    target /= std::wstring(resolution.remainder, resolution.remainderLength);
+
+    result.second = UnicodeString(target.wstring());
+    bfs::path directory = target.parent_path();
+    if (!usvfs::k32KnownDirTracker.contains(directory.native())) {
+      winapi::ex::wide::createPath(directory);
+      usvfs::k32KnownDirTracker.insert(directory.native(), std::wstring());
+    }
   }
   return result;
 }
@@ -293,51 +407,54 @@ ULONG StructMinSize(FILE_INFORMATION_CLASS infoClass)
   }
 }
 
-void GetInfoData(LPCVOID address, FILE_INFORMATION_CLASS infoClass,
-                 ULONG &offset, std::wstring &fileName)
+// like GetInfoData but returns the name in place, without copying it
+void GetInfoName(LPCVOID address, FILE_INFORMATION_CLASS infoClass,
+                 ULONG &offset, LPCWSTR &fileName, size_t &fileNameLength)
 {
+  fileName       = nullptr;
+  fileNameLength = 0;
   switch (infoClass) {
     case FileBothDirectoryInformation: {
       const FILE_BOTH_DIR_INFORMATION *info
           = reinterpret_cast<const FILE_BOTH_DIR_INFORMATION *>(address);
       offset = info->NextEntryOffset;
-      fileName
-          = std::wstring(info->FileName, info->FileNameLength / sizeof(WCHAR));
+      fileName       = info->FileName;
+      fileNameLength = info->FileNameLength / sizeof(WCHAR);
     } break;
     case FileDirectoryInformation: {
       const FILE_DIRECTORY_INFORMATION *info
           = reinterpret_cast<const FILE_DIRECTORY_INFORMATION *>(address);
       offset = info->NextEntryOffset;
-      fileName
-          = std::wstring(info->FileName, info->FileNameLength / sizeof(WCHAR));
+      fileName       = info->FileName;
+      fileNameLength = info->FileNameLength / sizeof(WCHAR);
     } break;
     case FileNamesInformation: {
       const FILE_NAMES_INFORMATION *info
           = reinterpret_cast<const FILE_NAMES_INFORMATION *>(address);
       offset = info->NextEntryOffset;
-      fileName
-          = std::wstring(info->FileName, info->FileNameLength / sizeof(WCHAR));
+      fileName       = info->FileName;
+      fileNameLength = info->FileNameLength / sizeof(WCHAR);
     } break;
     case FileIdFullDirectoryInformation: {
       const FILE_ID_FULL_DIR_INFORMATION *info
           = reinterpret_cast<const FILE_ID_FULL_DIR_INFORMATION *>(address);
       offset = info->NextEntryOffset;
-      fileName
-          = std::wstring(info->FileName, info->FileNameLength / sizeof(WCHAR));
+      fileName       = info->FileName;
+      fileNameLength = info->FileNameLength / sizeof(WCHAR);
     } break;
     case FileFullDirectoryInformation: {
       const FILE_FULL_DIR_INFORMATION *info
           = reinterpret_cast<const FILE_FULL_DIR_INFORMATION *>(address);
       offset = info->NextEntryOffset;
-      fileName
-          = std::wstring(info->FileName, info->FileNameLength / sizeof(WCHAR));
+      fileName       = info->FileName;
+      fileNameLength = info->FileNameLength / sizeof(WCHAR);
     } break;
     case FileIdBothDirectoryInformation: {
       const FILE_ID_BOTH_DIR_INFORMATION *info
           = reinterpret_cast<const FILE_ID_BOTH_DIR_INFORMATION *>(address);
       offset = info->NextEntryOffset;
-      fileName
-          = std::wstring(info->FileName, info->FileNameLength / sizeof(WCHAR));
+      fileName       = info->FileName;
+      fileNameLength = info->FileNameLength / sizeof(WCHAR);
     } break;
     case FileObjectIdInformation: {
       offset = sizeof(FILE_OBJECTID_INFORMATION);
@@ -351,79 +468,13 @@ void GetInfoData(LPCVOID address, FILE_INFORMATION_CLASS infoClass,
   }
 }
 
-template <typename T>
-void SetInfoFilenameImpl(T *info, const std::wstring &fileName)
-{
-  // not sure if the filename is supposed to be zero terminated but I did get
-  // invalid
-  // filenames when the buffer wasn't zeroed
-  memset(info->FileName, L'\0', info->FileNameLength);
-
-  info->FileNameLength = static_cast<ULONG>(fileName.length() * sizeof(WCHAR));
-  memcpy(info->FileName, fileName.c_str(), info->FileNameLength + 1);
-}
-
-// like wcsrchr except that the position to start searching can be specified and
-// the string doesn't
-// need to be 0-terminated
-const wchar_t *wcsrevsearch(const wchar_t *cur, const wchar_t *start,
-                            wchar_t ch)
-{
-  for (; cur > start; --cur) {
-    if (*cur == ch) {
-      return cur;
-    }
-  }
-  return nullptr;
-}
-
-template <typename T>
-void SetInfoFilenameImplSN(T *info, const std::wstring &fileName)
-{
-  memset(info->FileName, L'\0', info->FileNameLength);
-  info->FileNameLength = static_cast<ULONG>(fileName.length() * sizeof(WCHAR));
-  memcpy(info->FileName, fileName.c_str(),
-         info->FileNameLength); // doesn't need to be 0-terminated
-
-  if (info->ShortNameLength > 0) {
-    info->ShortNameLength = static_cast<CCHAR>(
-        GetShortPathNameW(fileName.c_str(), info->ShortName, 8));
-  }
-}
-
-void SetInfoFilename(LPVOID address, FILE_INFORMATION_CLASS infoClass,
-                     const std::wstring &fileName)
+void GetInfoData(LPCVOID address, FILE_INFORMATION_CLASS infoClass,
+                 ULONG &offset, std::wstring &fileName)
 {
-  switch (infoClass) {
-    case FileBothDirectoryInformation: {
-      SetInfoFilenameImplSN(
-          reinterpret_cast<FILE_BOTH_DIR_INFORMATION *>(address), fileName);
-    } break;
-    case FileDirectoryInformation: {
-      SetInfoFilenameImpl(
-          reinterpret_cast<FILE_DIRECTORY_INFORMATION *>(address), fileName);
-    } break;
-    case FileNamesInformation: {
-      SetInfoFilenameImpl(reinterpret_cast<FILE_NAMES_INFORMATION *>(address),
-                          fileName);
-    } break;
-    case FileIdFullDirectoryInformation: {
-      SetInfoFilenameImpl(
-          reinterpret_cast<FILE_ID_FULL_DIR_INFORMATION *>(address), fileName);
-    } break;
-    case FileFullDirectoryInformation: {
-      SetInfoFilenameImpl(
-          reinterpret_cast<FILE_FULL_DIR_INFORMATION *>(address), fileName);
-    } break;
-    case FileIdBothDirectoryInformation: {
-      SetInfoFilenameImplSN(
-          reinterpret_cast<FILE_ID_BOTH_DIR_INFORMATION *>(address),
-          fileName);
-    } break;
-    default: {
-      // NOP
-    } break;
-  }
+  LPCWSTR name;
+  size_t length;
+  GetInfoName(address, infoClass, offset, name, length);
+  fileName = name != nullptr ? std::wstring(name, length) : std::wstring();
 }
 
 void SetInfoOffset(LPVOID address, FILE_INFORMATION_CLASS infoClass,
@@ -460,158 +511,146 @@ void SetInfoOffset(LPVOID address, FILE_INFORMATION_CLASS infoClass,
   }
 }
 
-int NextDividableBy(int number, int divider)
+ULONG NextDividableBy(ULONG number, ULONG divider)
 {
-  return static_cast<int>(
-      ceilf(static_cast<float>(number) / static_cast<float>(divider))
-      * divider);
+  return (number + divider - 1) / divider * divider;
 }
 
-std::string toHex(PVOID buffer, ULONG size)
-{
-  fmt::MemoryWriter stream;
-  unsigned char *bufferChar = reinterpret_cast<unsigned char *>(buffer);
-  for (size_t i = 0; i < size; ++i) {
-    stream << fmt::pad(fmt::hex(bufferChar[i]), 2, '0');
-    if (i < size - 1) {
-      stream << ((i % 16 == 15) ? "\n" : " ");
-    }
-  }
-
-  return stream.str();
-}
+struct Searches {
+  // a virtual entry of the searched directory
+  struct SourceEntry {
+    // name of the file/directory in the directory where it actually is
+    std::wstring realName;
+    // upper-cased realName, used to match the entries reported for the source
+    std::wstring realKey;
+    // virtual filename (only filename since it has to be within the searched
+    // directory)
+    // this is left empty when a folder with all its content is mapped to the
+    // search directory
+    std::wstring virtualName;
+  };
 
-NTSTATUS addNtSearchData(HANDLE hdl, PUNICODE_STRING FileName,
-                         const std::wstring &fakeName,
-                         FILE_INFORMATION_CLASS FileInformationClass,
-                         PVOID &buffer, ULONG &bufferSize,
-                         std::set<std::wstring> &foundFiles, HANDLE event,
-                         PIO_APC_ROUTINE apcRoutine, PVOID apcContext,
-                         BOOLEAN returnSingleEntry)
-{
-  NTSTATUS res = STATUS_NO_SUCH_FILE;
-  if (hdl != INVALID_HANDLE_VALUE) {
-    PVOID lastValidRecord = nullptr;
-    PVOID bufferInit = buffer;
-    IO_STATUS_BLOCK status;
-    res = NtQueryDirectoryFile(hdl, event, apcRoutine, apcContext, &status,
-                               buffer, bufferSize, FileInformationClass,
-                               returnSingleEntry, FileName, FALSE);
-
-    if ((res != STATUS_SUCCESS) || (status.Information <= 0)) {
-      bufferSize = 0UL;
-    } else {
-      ULONG totalOffset   = 0;
-      PVOID lastSkipPos   = nullptr;
-
-      while (totalOffset < status.Information) {
-        ULONG offset;
-        std::wstring fileName;
-        GetInfoData(buffer, FileInformationClass, offset, fileName);
-        // in case this is a single-file search result and the specified
-        // filename differs from the file name found, replace it in the
-        // information structure
-        if ((totalOffset == 0) && (offset == 0) && (fakeName.length() > 0)) {
-          // if the fake name is larger than what is in the buffer and there is
-          // not enough room, that's a buffer overflow
-          if ((fakeName.length() > fileName.length())
-              && ((fakeName.length() - fileName.length())
-                  > (bufferSize - status.Information))) {
-            res = STATUS_BUFFER_OVERFLOW;
-            break;
-          }
-          // WARNING for the case where the fake name is longer this needs to
-          // move back all further results and update the offset first
-          SetInfoFilename(buffer, FileInformationClass, fakeName);
-          fileName = fakeName;
-        }
-        bool add = true;
-        if (fileName.length() > 0) {
-          auto insertRes = foundFiles.insert(ush::to_upper(fileName));
-          add      = insertRes.second; // add only if we didn't find this file before
-        }
-        if (!add) {
-          if (lastSkipPos == nullptr) {
-            lastSkipPos = buffer;
-          }
-        } else {
-          if (lastSkipPos != nullptr) {
-            memmove(lastSkipPos, buffer, status.Information - totalOffset);
-            ULONG delta = static_cast<ULONG>(ush::AddrDiff(buffer, lastSkipPos));
-            totalOffset -= delta;
-
-            buffer = lastSkipPos;
-            lastSkipPos = nullptr;
-          }
-          lastValidRecord = buffer;
-        }
+  // virtual entries grouped by the real directory they reside in so each
+  // source directory has to be queried only once per search
+  struct SourceDirectory {
+    std::wstring path;
+    std::vector<SourceEntry> entries;
+  };
 
-        if (offset == 0) {
-          offset = static_cast<ULONG>(status.Information) - totalOffset;
-        }
-        buffer = ush::AddrAdd(buffer, offset);
-        totalOffset += offset;
-      }
+  // the virtual entries of a directory for one search pattern. These only
+  // depend on the redirection tree so searches share them as long as the tree
+  // generation doesn't change
+  struct VirtualListing {
+    std::vector<SourceDirectory> sources;
+    // names of the matches, used to skip real entries they hide
+    usvfs::FoldedNameSet names;
+    // the directory has no counterpart on disk and the tree lists all of its
+    // content, see FLAG_VIRTUALONLY
+    bool virtualOnly{false};
+  };
+  typedef std::shared_ptr<const VirtualListing> ListingPtr;
 
-      if (lastSkipPos != nullptr) {
-        buffer = lastSkipPos;
-        bufferSize = static_cast<ULONG>(ush::AddrDiff(buffer, bufferInit));
-        // null out the unused rest if there is some
-        memset(lastSkipPos, 0, status.Information - bufferSize);
-      } else {
-        bufferSize = static_cast<ULONG>(ush::AddrDiff(buffer, bufferInit));
-      }
-    }
-    if (lastValidRecord != nullptr) {
-      SetInfoOffset(lastValidRecord, FileInformationClass, 0);
+  struct Info {
+    Info()
+    {
+      // the end of the last record follows the start of every record
+      recordOffsets.push_back(0);
     }
-  }
-  return res;
-}
 
-DATA_ID(SearchInfo);
+    size_t recordCount() const { return recordOffsets.size() - 1; }
 
-struct Searches {
-  struct Info {
-    struct VirtualMatch {
-      // full path to where the file/directory actually is
-      std::wstring realPath;
-      // virtual filename (only filename since it has to be within the searched
-      // directory)
-      // this is left empty when a folder with all its content is mapped to the
-      // search directory
-      std::wstring virtualName;
-    };
-
-    Info() : currentSearchHandle(INVALID_HANDLE_VALUE)
+    // append a record of the specified size (a multiple of 8) to the listing
+    char *appendRecord(size_t size)
+    {
+      size_t offset = records.size();
+      records.resize(offset + size, '\0');
+      recordOffsets.push_back(records.size());
+      return records.data() + offset;
+    }
+
+    void clearRecords()
     {
+      records.clear();
+      recordOffsets.assign(1, 0);
+      virtualCount = 0;
     }
-    std::set<std::wstring> foundFiles;
-    HANDLE currentSearchHandle;
-    std::queue<VirtualMatch> virtualMatches;
+
+    ListingPtr virtualListing;
+    // merged listing: the regular entries followed by the virtual ones. Every
+    // record is padded to 8 bytes and its NextEntryOffset points to the next
+    // one, so consecutive records can be returned with a single copy
+    std::vector<char> records;
+    std::vector<size_t> recordOffsets;
+    FILE_INFORMATION_CLASS infoClass{static_cast<FILE_INFORMATION_CLASS>(0)};
+    // index of the next record to return
+    size_t cursor{0};
+    size_t virtualCount{0};
     UnicodeString searchPattern;
-    bool regularComplete{false};
   };
 
-  Searches() = default;
+  typedef std::shared_ptr<Info> Ptr;
+};
+
+/**
+ * @brief process-local cache of virtual directory listings keyed on the
+ *        directory and search pattern. Like the RerouteCache it is dropped as
+ *        a whole whenever the generation of the redirection tree changes. It's
+ *        kept as custom data of the hook context so a vfs connected later
+ *        doesn't see listings of a previous tree with the same generation
+ */
+class VirtualListingCache {
+public:
+  static const size_t MAX_ENTRIES = 1024;
+
+  Searches::ListingPtr lookup(const std::wstring &key, long generation) const
+  {
+    std::shared_lock<std::shared_mutex> lock(m_Mutex);
+    if (generation != m_Generation) {
+      return Searches::ListingPtr();
+    }
+    auto iter = m_Map.find(key);
+    return iter != m_Map.end() ? iter->second : Searches::ListingPtr();
+  }
 
-  // must provide a special copy constructor because boost::mutex is
-  // non-copyable
-  Searches(const Searches &reference) : info(reference.info)
+  void insert(const std::wstring &key, long generation,
+              const Searches::ListingPtr &listing)
   {
+    std::unique_lock<std::shared_mutex> lock(m_Mutex);
+    if ((generation != m_Generation) || (m_Map.size() >= MAX_ENTRIES)) {
+      m_Map.clear();
+      m_Generation = generation;
+    }
+    m_Map[key] = listing;
   }
 
-  Searches &operator=(const Searches &) = delete;
+private:
+  mutable std::shared_mutex m_Mutex;
+  long m_Generation{-1};
+  std::unordered_map<std::wstring, Searches::ListingPtr> m_Map;
+};
 
-  std::recursive_mutex queryMutex;
+DATA_ID(VirtualListingCacheData);
 
-  std::map<HANDLE, Info> info;
-};
+// running searches by directory handle. Kept outside the hook context so
+// NtClose and NtQueryDirectoryFile don't need exclusive access to it
+usvfs::ShardedHandleMap<Searches::Ptr> activeSearches;
 
-void gatherVirtualEntries(const UnicodeString &dirName,
-                          const usvfs::RedirectionTreeContainer &redir,
-                          PUNICODE_STRING FileName, Searches::Info &info)
+SearchHandleMap searchHandles;
+
+// ends the search associated with the handle, if there is one
+static bool endSearch(HANDLE handle)
+{
+  return activeSearches.erase(handle);
+}
+
+Searches::ListingPtr gatherVirtualEntries(const UnicodeString &dirName,
+                                          const HookContext &context,
+                                          PUNICODE_STRING FileName)
 {
+  const usvfs::RedirectionTreeContainer &redir = context.redirectionTable();
+  VirtualListingCache &virtualListingCache
+      = context.customData<VirtualListingCache, VirtualListingCacheData>();
+
   LPCWSTR dirNameW = static_cast<LPCWSTR>(dirName);
   // fix directory name. I'd love to know why microsoft sometimes uses "\??\" vs
   // "\\?\"
@@ -619,246 +658,585 @@ void gatherVirtualEntries(const UnicodeString &dirName,
       || (wcsncmp(dirNameW, LR"(\??\)", 4) == 0)) {
     dirNameW += 4;
   }
+
+  // the generation is read before walking the tree so a concurrent
+  // modification can only cause the result to be cached for a stale generation
+  long generation = redir.generation();
+  std::wstring cacheKey = ush::to_upper(dirNameW);
+  cacheKey.push_back(L'|');
+  if (FileName != nullptr) {
+    cacheKey.append(FileName->Buffer, FileName->Length / sizeof(WCHAR));
+  }
+  Searches::ListingPtr cached = virtualListingCache.lookup(cacheKey, generation);
+  if (cached) {
+    return cached;
+  }
+
+  auto listing = std::make_shared<Searches::VirtualListing>();
+  // index into listing->sources by upper-cased directory path
+  std::unordered_map<std::wstring, size_t> sourceIndices;
   auto node = redir->findNode(boost::filesystem::path(dirNameW));
   if (node.get() != nullptr) {
-    std::string searchPattern = FileName != nullptr
-                                    ? ush::string_cast<std::string>(
-                                          FileName->Buffer, ush::CodePage::UTF8)
-                                    : "*.*";
-
-    boost::replace_all(searchPattern, "\"", ".");
+    listing->virtualOnly = node->hasFlag(usvfs::shared::FLAG_VIRTUALONLY);
+    // compiled once per search, search patterns never contain directories
+    usvfs::shared::wildcard::Matcher matcher;
+    if (FileName != nullptr) {
+      std::string searchPattern = ush::string_cast<std::string>(
+          FileName->Buffer, ush::CodePage::UTF8, FileName->Length / sizeof(WCHAR));
+      matcher = usvfs::shared::wildcard::Matcher(searchPattern.c_str(),
+                                                 searchPattern.size());
+    }
 
-    for (const auto &subNode : node->find(searchPattern)) {
-      if (((subNode->data().linkTarget.length() > 0) || subNode->isDirectory())
+    for (const auto &subNode : node->find(matcher)) {
+      if ((subNode->data().hasTarget() || subNode->isDirectory())
           && !subNode->hasFlag(usvfs::shared::FLAG_DUMMY)) {
         std::wstring vName = ush::string_cast<std::wstring>(
             subNode->name(), ush::CodePage::UTF8);
 
-        Searches::Info::VirtualMatch m;
-        if (subNode->data().linkTarget.length() > 0)
+        std::wstring realPath;
+        if (subNode->data().hasTarget())
         {
-          m = { ush::string_cast<std::wstring>(subNode->data().linkTarget.c_str(),
-                                         ush::CodePage::UTF8), vName };
+          realPath = subNode->data().wideTarget();
         }
         else
         {
-          m = { ush::string_cast<std::wstring>(subNode->path().c_str(),
-            ush::CodePage::UTF8), vName };
+          realPath = usvfs::widePath(*subNode);
         }
 
-        info.virtualMatches.push(m);
-        info.foundFiles.insert(ush::to_upper(vName));
+        bfs::path fullPath(realPath);
+        if (fullPath.filename().wstring() == L".") {
+          fullPath = fullPath.parent_path();
+        }
+        std::wstring sourcePath = fullPath.parent_path().wstring();
+        std::wstring realName = fullPath.filename().wstring();
+
+        auto inserted = sourceIndices.insert(
+            std::make_pair(ush::to_upper(sourcePath), listing->sources.size()));
+        if (inserted.second) {
+          listing->sources.push_back(Searches::SourceDirectory{ sourcePath, {} });
+        }
+        listing->sources[inserted.first->second].entries.push_back(
+            Searches::SourceEntry{ realName, ush::to_upper(realName), vName });
+        listing->names.insert(vName);
       }
     }
   }
+
+  virtualListingCache.insert(cacheKey, generation, listing);
+  return listing;
+}
+
+// sources with at most this many virtual entries are queried with one
+// filtered search per entry, larger ones are listed once and filtered here
+static const size_t MAX_FILTERED_QUERIES = 4;
+static const ULONG SOURCE_QUERY_BUFFER_SIZE = 64 * 1024;
+
+template <typename T>
+T *CopyInfoRecordImpl(LPCVOID address, const std::wstring &fileName,
+                      Searches::Info &info)
+{
+  ULONG nameOffset = FIELD_OFFSET(T, FileName);
+  ULONG nameLength = static_cast<ULONG>(fileName.length() * sizeof(WCHAR));
+  ULONG size = NextDividableBy(nameOffset + nameLength, 8);
+  char *record = info.appendRecord(size);
+  memcpy(record, address, nameOffset);
+
+  T *result = reinterpret_cast<T *>(record);
+  result->NextEntryOffset = size;
+  result->FileNameLength  = nameLength;
+  memcpy(result->FileName, fileName.c_str(), nameLength);
+  return result;
+}
+
+template <typename T>
+void CopyInfoRecordImplSN(LPCVOID address, const std::wstring &fileName,
+                          bool renamed, Searches::Info &info)
+{
+  T *result = CopyInfoRecordImpl<T>(address, fileName, info);
+  if (renamed) {
+    // the short name of the real file doesn't belong to the virtual name
+    result->ShortNameLength = 0;
+    memset(result->ShortName, 0, sizeof(result->ShortName));
+  }
 }
 
 /**
- * @brief insert a virtual entry into the search result
- * @param FileInformation
- * @param FileInformationClass
- * @param info
- * @param realPath path were the actual file resides
- * @param virtualName virtual file name (without path). will often be the same
- *        as the name component of realpath
- * @param ReturnSingleEntry
- * @param dataRead
- * @return true if a virtual result was added, false if the search handle in the
- *         info object yields no more results
+ * @brief append a copy of a single FILE_*_INFORMATION record to the listing
+ *        of a search, replacing its file name
+ * @param address the record to copy
+ * @param fileName name to put into the copy
+ * @param renamed true if fileName differs from the name in the record
  */
-bool addVirtualSearchResult(PVOID &FileInformation,
-                            FILE_INFORMATION_CLASS FileInformationClass,
-                            Searches::Info &info, const std::wstring &realPath,
-                            const std::wstring &virtualName,
-                            BOOLEAN ReturnSingleEntry, ULONG &dataRead)
+void CopyInfoRecord(LPCVOID address, FILE_INFORMATION_CLASS infoClass,
+                    const std::wstring &fileName, bool renamed,
+                    Searches::Info &info)
 {
-  // this opens a search in the real location, then copies the information about
-  // files we care about (the ones being mapped) to the result we intend to
-  // return
-  bfs::path fullPath(realPath);
-  if (fullPath.filename().wstring() == L".") {
-    fullPath = fullPath.parent_path();
-  }
-  if (info.currentSearchHandle == INVALID_HANDLE_VALUE) {
-    std::wstring dirName     = fullPath.parent_path().wstring();
-    if (dirName.length() >= MAX_PATH && !ush::startswith(dirName.c_str(), LR"(\\?\)"))
-      dirName = LR"(\\?\)" + dirName;
-    info.currentSearchHandle = CreateFileW(
-        dirName.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
-        nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
-  }
-  std::wstring fileName = ush::string_cast<std::wstring>(
-      fullPath.filename().string(), ush::CodePage::UTF8);
-  NTSTATUS subRes = addNtSearchData(
-      info.currentSearchHandle,
-      (fileName != L".")
-          ? static_cast<PUNICODE_STRING>(UnicodeString(fileName.c_str()))
-          : nullptr,
-      virtualName, FileInformationClass, FileInformation, dataRead,
-      info.foundFiles, nullptr, nullptr, nullptr, ReturnSingleEntry);
-  if (subRes == STATUS_SUCCESS) {
-    return true;
-  } else {
-    // STATUS_NO_MORE_FILES merely means the search ended, everything else is an
-    // error message. Either way, the search here is finished and we should
-    // resume in the next mapped directory
-    if (subRes != STATUS_NO_MORE_FILES) {
-      spdlog::get("hooks")->warn("error reported listing files in {0}: {1:x}",
-                                 fullPath.string(),
-                                 static_cast<uint32_t>(subRes));
+  switch (infoClass) {
+    case FileBothDirectoryInformation: {
+      CopyInfoRecordImplSN<FILE_BOTH_DIR_INFORMATION>(address, fileName,
+                                                      renamed, info);
+    } break;
+    case FileDirectoryInformation: {
+      CopyInfoRecordImpl<FILE_DIRECTORY_INFORMATION>(address, fileName, info);
+    } break;
+    case FileNamesInformation: {
+      CopyInfoRecordImpl<FILE_NAMES_INFORMATION>(address, fileName, info);
+    } break;
+    case FileIdFullDirectoryInformation: {
+      CopyInfoRecordImpl<FILE_ID_FULL_DIR_INFORMATION>(address, fileName, info);
+    } break;
+    case FileFullDirectoryInformation: {
+      CopyInfoRecordImpl<FILE_FULL_DIR_INFORMATION>(address, fileName, info);
+    } break;
+    case FileIdBothDirectoryInformation: {
+      CopyInfoRecordImplSN<FILE_ID_BOTH_DIR_INFORMATION>(address, fileName,
+                                                         renamed, info);
+    } break;
+    default: {
+      // classes without a file name are copied as they are
+      ULONG size = NextDividableBy(StructMinSize(infoClass), 8);
+      char *record = info.appendRecord(size);
+      memcpy(record, address, StructMinSize(infoClass));
+      SetInfoOffset(record, infoClass, size);
+    } break;
+  }
+}
+
+/**
+ * @brief wait for a directory query on a handle opened for asynchronous I/O
+ */
+static NTSTATUS completeQuery(HANDLE handle, NTSTATUS res, IO_STATUS_BLOCK &status)
+{
+  if (res == STATUS_PENDING) {
+    ::WaitForSingleObject(handle, INFINITE);
+    res = status.Status;
+  }
+  return res;
+}
+
+static HANDLE openSourceDirectory(const std::wstring &path)
+{
+  std::wstring dirName = path;
+  if (dirName.length() >= MAX_PATH && !ush::startswith(dirName.c_str(), LR"(\\?\)"))
+    dirName = LR"(\\?\)" + dirName;
+  return CreateFileW(dirName.c_str(), GENERIC_READ,
+                     FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                     OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+}
+
+/**
+ * @brief append the records reported for a source directory to the listing
+ *        of the search
+ * @param wanted the virtual entries to look for, by upper-cased real name
+ */
+static void addSourceEntries(
+    Searches::Info &info, FILE_INFORMATION_CLASS infoClass, LPCVOID buffer,
+    ULONG size,
+    const std::unordered_multimap<std::wstring, const Searches::SourceEntry *> &wanted,
+    usvfs::FoldedNameSet &foundFiles)
+{
+  ULONG totalOffset = 0;
+  while (totalOffset < size) {
+    LPCVOID current = ush::AddrAdd(const_cast<LPVOID>(buffer), totalOffset);
+    ULONG offset;
+    std::wstring fileName;
+    GetInfoData(current, infoClass, offset, fileName);
+
+    auto range = wanted.equal_range(ush::to_upper(fileName));
+    for (auto iter = range.first; iter != range.second; ++iter) {
+      const Searches::SourceEntry &entry = *iter->second;
+      const std::wstring &name = entry.virtualName.empty() ? fileName : entry.virtualName;
+      // add only if we didn't find this file before
+      if (foundFiles.insert(name)) {
+        CopyInfoRecord(current, infoClass, name, name != fileName, info);
+        ++info.virtualCount;
+      }
     }
-    return false;
+
+    if (offset == 0) {
+      break;
+    }
+    totalOffset += offset;
   }
 }
 
-NTSTATUS WINAPI usvfs::hook_NtQueryDirectoryFile(
-    HANDLE FileHandle, HANDLE Event, PIO_APC_ROUTINE ApcRoutine,
-    PVOID ApcContext, PIO_STATUS_BLOCK IoStatusBlock, PVOID FileInformation,
-    ULONG Length, FILE_INFORMATION_CLASS FileInformationClass,
-    BOOLEAN ReturnSingleEntry, PUNICODE_STRING FileName, BOOLEAN RestartScan)
+/**
+ * @brief query the virtual entries residing in one source directory. Small
+ *        groups use a filtered search per entry, larger ones list the
+ *        directory once with a large buffer instead of opening it per entry
+ */
+static void querySource(Searches::Info &info,
+                        FILE_INFORMATION_CLASS infoClass,
+                        const Searches::SourceDirectory &source,
+                        usvfs::FoldedNameSet &foundFiles)
 {
-  PreserveGetLastError ntFunctionsDoNotChangeGetLastError;
+  std::unique_ptr<char[]> buffer(new char[SOURCE_QUERY_BUFFER_SIZE]);
+  IO_STATUS_BLOCK status;
 
-  // this is quite messy...
-  // first, this will gather the virtual locations mapping to the iterated one
-  // then we return results from the real location, skipping those that exist
-  //   in the virtual locations, as those take precedence
-  // finally the virtual results are returned, adding each result to a skip
-  //   list, so they don't get added twice
-  //
-  // if we don't add the regular files first, "." and ".." wouldn't be in the
-  //   first search result of wildcard searches which may confuse the caller
-  NTSTATUS res = STATUS_NO_MORE_FILES;
-  HOOK_START_GROUP(MutExHookGroup::FIND_FILES)
-  if (!callContext.active()) {
-    return ::NtQueryDirectoryFile(FileHandle, Event, ApcRoutine, ApcContext,
-                                  IoStatusBlock, FileInformation, Length,
-                                  FileInformationClass, ReturnSingleEntry,
-                                  FileName, RestartScan);
+  auto reportError = [&source](NTSTATUS res) {
+    // STATUS_NO_MORE_FILES merely means the search ended, everything else is
+    // an error message
+    if ((res != STATUS_NO_MORE_FILES) && (res != STATUS_NO_SUCH_FILE)) {
+      spdlog::get("hooks")->warn("error reported listing files in {0}: {1:x}",
+                                 ush::string_cast<std::string>(source.path),
+                                 static_cast<uint32_t>(res));
+    }
+  };
+
+  if (source.entries.size() <= MAX_FILTERED_QUERIES) {
+    for (const Searches::SourceEntry &entry : source.entries) {
+      HANDLE handle = openSourceDirectory(source.path);
+      if (handle == INVALID_HANDLE_VALUE) {
+        continue;
+      }
+      ON_BLOCK_EXIT([handle]() { ::CloseHandle(handle); });
+
+      NTSTATUS res = NtQueryDirectoryFile(
+          handle, nullptr, nullptr, nullptr, &status, buffer.get(),
+          SOURCE_QUERY_BUFFER_SIZE, infoClass, TRUE,
+          static_cast<PUNICODE_STRING>(UnicodeString(entry.realName.c_str())),
+          TRUE);
+      if (res == STATUS_SUCCESS) {
+        std::unordered_multimap<std::wstring, const Searches::SourceEntry *> wanted;
+        wanted.emplace(entry.realKey, &entry);
+        addSourceEntries(info, infoClass, buffer.get(),
+                         static_cast<ULONG>(status.Information), wanted,
+                         foundFiles);
+      } else {
+        reportError(res);
+      }
+    }
+    return;
   }
 
-//  std::unique_lock<std::recursive_mutex> queryLock;
-  std::map<HANDLE, Searches::Info>::iterator infoIter;
-  bool firstSearch = false;
+  std::unordered_multimap<std::wstring, const Searches::SourceEntry *> wanted;
+  for (const Searches::SourceEntry &entry : source.entries) {
+    wanted.emplace(entry.realKey, &entry);
+  }
 
-  { // scope to limit context lifetime
-    HookContext::ConstPtr context = READ_CONTEXT();
-    Searches &activeSearches = context->customData<Searches>(SearchInfo);
-//    queryLock = std::unique_lock<std::recursive_mutex>(activeSearches.queryMutex);
+  HANDLE handle = openSourceDirectory(source.path);
+  if (handle == INVALID_HANDLE_VALUE) {
+    return;
+  }
+  ON_BLOCK_EXIT([handle]() { ::CloseHandle(handle); });
+
+  BOOLEAN restart = TRUE;
+  for (;;) {
+    NTSTATUS res = NtQueryDirectoryFile(
+        handle, nullptr, nullptr, nullptr, &status, buffer.get(),
+        SOURCE_QUERY_BUFFER_SIZE, infoClass, FALSE, nullptr, restart);
+    if (res != STATUS_SUCCESS) {
+      reportError(res);
+      break;
+    }
+    restart = FALSE;
+    addSourceEntries(info, infoClass, buffer.get(),
+                     static_cast<ULONG>(status.Information), wanted,
+                     foundFiles);
+  }
+}
 
-    if (RestartScan) {
-      auto iter = activeSearches.info.find(FileHandle);
-      if (iter != activeSearches.info.end()) {
-        activeSearches.info.erase(iter);
+/**
+ * @brief append the regular entries of the searched directory to the listing,
+ *        skipping those hidden by virtual entries
+ * @param foundFiles names to skip, receives the names added
+ */
+static void addRegularEntries(Searches::Info &info, HANDLE handle,
+                              PUNICODE_STRING FileName,
+                              FILE_INFORMATION_CLASS infoClass,
+                              usvfs::FoldedNameSet &foundFiles)
+{
+  IO_STATUS_BLOCK status;
+
+  BOOLEAN restart = TRUE;
+  for (;;) {
+    // the records are queried straight into the tail of the listing, hidden
+    // ones are then squeezed out in place. The last record isn't necessarily
+    // padded by the query so leave room to align it past the queried data
+    size_t base = info.records.size();
+    info.records.resize(base + SOURCE_QUERY_BUFFER_SIZE + 8);
+    NTSTATUS res = completeQuery(
+        handle,
+        NtQueryDirectoryFile(handle, nullptr, nullptr, nullptr, &status,
+                             info.records.data() + base,
+                             SOURCE_QUERY_BUFFER_SIZE, infoClass, FALSE,
+                             FileName, restart),
+        status);
+    if ((res != STATUS_SUCCESS) || (status.Information == 0)) {
+      info.records.resize(base);
+      break;
+    }
+    restart = FALSE;
+
+    size_t end = base;
+    ULONG totalOffset = 0;
+    while (totalOffset < status.Information) {
+      char *current = info.records.data() + base + totalOffset;
+      ULONG offset;
+      LPCWSTR fileName;
+      size_t fileNameLength;
+      GetInfoName(current, infoClass, offset, fileName, fileNameLength);
+      ULONG size = offset != 0
+                       ? offset
+                       : static_cast<ULONG>(status.Information) - totalOffset;
+
+      // add only if we didn't find this file before
+      if ((fileNameLength == 0) || foundFiles.insert(fileName, fileNameLength)) {
+        ULONG paddedSize = NextDividableBy(size, 8);
+        char *record = info.records.data() + end;
+        if (record != current) {
+          memmove(record, current, size);
+        }
+        memset(record + size, 0, paddedSize - size);
+        SetInfoOffset(record, infoClass, paddedSize);
+        end += paddedSize;
+        info.recordOffsets.push_back(end);
       }
+
+      if (offset == 0) {
+        break;
+      }
+      totalOffset += offset;
+    }
+    info.records.resize(end);
+  }
+}
+
+/**
+ * @brief append only the "." and ".." entries of the directory. They are
+ *        reported first so this takes at most two single entry queries instead
+ *        of listing the whole directory
+ */
+static void addDotEntries(Searches::Info &info, HANDLE handle,
+                          PUNICODE_STRING FileName,
+                          FILE_INFORMATION_CLASS infoClass)
+{
+  // large enough for any record of a dot entry
+  alignas(8) char buffer[1024];
+  IO_STATUS_BLOCK status;
+
+  BOOLEAN restart = TRUE;
+  for (int i = 0; i < 2; ++i) {
+    NTSTATUS res = completeQuery(
+        handle,
+        NtQueryDirectoryFile(handle, nullptr, nullptr, nullptr, &status,
+                             buffer, sizeof(buffer), infoClass, TRUE,
+                             FileName, restart),
+        status);
+    if ((res != STATUS_SUCCESS) || (status.Information == 0)) {
+      break;
+    }
+    restart = FALSE;
+
+    ULONG offset;
+    LPCWSTR fileName;
+    size_t fileNameLength;
+    GetInfoName(buffer, infoClass, offset, fileName, fileNameLength);
+    if ((fileName == nullptr) || (fileNameLength == 0) || (fileNameLength > 2)
+        || (fileName[0] != L'.')
+        || ((fileNameLength == 2) && (fileName[1] != L'.'))) {
+      break;
     }
+    CopyInfoRecord(buffer, infoClass, std::wstring(fileName, fileNameLength),
+                   false, info);
+  }
+}
+
+/**
+ * @brief precompute the merged listing of a search. Regular entries come
+ *        first, otherwise "." and ".." wouldn't be in the first result of
+ *        wildcard searches which may confuse the caller
+ * @param handle handle of the directory to list the regular entries of
+ */
+static void buildListing(Searches::Info &info, HANDLE handle,
+                         PUNICODE_STRING FileName,
+                         FILE_INFORMATION_CLASS infoClass)
+{
+  info.clearRecords();
+  info.infoClass = infoClass;
 
-    // see if we already have a running search
-    infoIter = activeSearches.info.find(FileHandle);
-    firstSearch = (infoIter == activeSearches.info.end());
+  if (info.virtualListing->virtualOnly) {
+    // the handle refers to the directory the search was rerouted to, all of
+    // whose entries are in the tree as well
+    addDotEntries(info, handle, FileName, infoClass);
+  } else {
+    // the virtual entries take precedence over regular ones of the same name
+    usvfs::FoldedNameSet hidden = info.virtualListing->names;
+    addRegularEntries(info, handle, FileName, infoClass, hidden);
   }
 
-  if (firstSearch) {
-    HookContext::Ptr context = WRITE_CONTEXT();
-    Searches &activeSearches = context->customData<Searches>(SearchInfo);
+  usvfs::FoldedNameSet foundFiles;
+  for (const Searches::SourceDirectory &source : info.virtualListing->sources) {
+    querySource(info, infoClass, source, foundFiles);
+  }
+}
+
+/**
+ * @brief copy records from the cursor of a search into the caller's buffer
+ * @param dataRead receives the number of bytes written to FileInformation
+ * @return STATUS_SUCCESS if entries were returned, STATUS_NO_MORE_FILES at the
+ *         end of the listing and STATUS_BUFFER_OVERFLOW if the next entry
+ *         doesn't fit into the buffer
+ */
+static NTSTATUS copyListing(Searches::Info &info, PVOID FileInformation,
+                            ULONG Length, bool returnSingleEntry,
+                            ULONG &dataRead)
+{
+  dataRead = 0;
+  if (info.cursor >= info.recordCount()) {
+    return STATUS_NO_MORE_FILES;
+  }
+
+  size_t begin = info.recordOffsets[info.cursor];
+  if (info.recordOffsets[info.cursor + 1] - begin > Length) {
+    return STATUS_BUFFER_OVERFLOW;
+  }
+
+  // index of the first record that doesn't fit anymore
+  size_t end = info.cursor + 1;
+  if (!returnSingleEntry) {
+    auto limit = std::upper_bound(info.recordOffsets.begin() + info.cursor + 1,
+                                  info.recordOffsets.end(), begin + Length);
+    end = static_cast<size_t>(limit - info.recordOffsets.begin()) - 1;
+  }
+
+  size_t size = info.recordOffsets[end] - begin;
+  memcpy(FileInformation, info.records.data() + begin, size);
+  SetInfoOffset(ush::AddrAdd(FileInformation,
+                             static_cast<ULONG>(info.recordOffsets[end - 1] - begin)),
+                info.infoClass, 0);
+  info.cursor = end;
+  dataRead = static_cast<ULONG>(size);
+  return STATUS_SUCCESS;
+}
+
+/**
+ * @brief the enumeration engine behind NtQueryDirectoryFile and
+ *        NtQueryDirectoryFileEx. The first call on a handle gathers the
+ *        regular and virtual entries into one listing, every call then returns
+ *        records from the cursor of the handle. Restarting a scan with the same
+ *        pattern only resets the cursor
+ * @param virtualCount receives the number of virtual entries in the listing
+ */
+static NTSTATUS queryDirectory(HANDLE FileHandle, HANDLE Event,
+                               PIO_STATUS_BLOCK IoStatusBlock,
+                               PVOID FileInformation, ULONG Length,
+                               FILE_INFORMATION_CLASS FileInformationClass,
+                               bool returnSingleEntry, PUNICODE_STRING FileName,
+                               bool restartScan, size_t &virtualCount)
+{
+  Searches::Ptr info;
+  bool found = activeSearches.find(FileHandle, info);
+  if (found && restartScan) {
+    if ((FileName != nullptr) && (FileName->Length > 0)
+        && ((FileName->Length != info->searchPattern.size() * sizeof(WCHAR))
+            || !ush::foldedEquals(FileName->Buffer, info->searchPattern.view().data(),
+                                  info->searchPattern.size()))) {
+      // a new pattern makes this a different search
+      endSearch(FileHandle);
+      found = false;
+    } else {
+      info->cursor = 0;
+    }
+  }
+  bool firstSearch = !found || restartScan;
+
+  if (!found) {
     // tradeoff time: we store this search status even if no virtual results
     // were found. This causes a little extra cost here and in NtClose every
     // time a non-virtual dir is being searched. However if we don't,
     // whenever NtQueryDirectoryFile is called another time on the same handle,
     // this (expensive) block would be run again.
-    infoIter = activeSearches.info.insert(std::make_pair(FileHandle,
-                                                         Searches::Info()))
-                   .first;
-    infoIter->second.searchPattern.appendPath(FileName);
-
-    SearchHandleMap &searchMap
-        = context->customData<SearchHandleMap>(SearchHandles);
-    SearchHandleMap::iterator iter = searchMap.find(FileHandle);
+    info = std::make_shared<Searches::Info>();
+    info->searchPattern.appendPath(FileName);
+  }
 
+  if (!found || (info->infoClass != FileInformationClass)) {
+    usvfs::PathPool::Ref originalPath;
     UnicodeString searchPath;
-    if (iter != searchMap.end()) {
-      searchPath = UnicodeString(iter->second.c_str());
-      infoIter->second.currentSearchHandle =
-          CreateFileW(iter->second.c_str(), GENERIC_READ,
-                      FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
-                      OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
-    } else {
+    bool rerouted = searchHandles.find(FileHandle, originalPath);
+    if (rerouted) {
+      searchPath = UnicodeString(originalPath.c_str(), originalPath.size());
+    } else if (!found) {
       searchPath = ntdllHandleTracker.lookup(FileHandle);
     }
-    gatherVirtualEntries(searchPath, context->redirectionTable(), FileName,
-                         infoIter->second);
-  }
 
-  ULONG dataRead = Length;
-  PVOID FileInformationCurrent = FileInformation;
-
-  // add regular search results, skipping those files we have in a virtual
-  // location
-  bool moreRegular  = !infoIter->second.regularComplete;
-  bool dataReturned = false;
-  while (moreRegular && !dataReturned) {
-    dataRead        = Length;
+    if (!found) {
+      HookContext::ConstPtr context = READ_CONTEXT();
+      info->virtualListing = gatherVirtualEntries(searchPath, *context, FileName);
+    }
 
-    HANDLE handle = infoIter->second.currentSearchHandle;
-    if (handle == INVALID_HANDLE_VALUE) {
-      handle = FileHandle;
+    // a virtual-only directory can't be opened at its original path
+    HANDLE searchHandle = INVALID_HANDLE_VALUE;
+    if (rerouted && !info->virtualListing->virtualOnly) {
+      searchHandle = CreateFileW(originalPath.c_str(), GENERIC_READ,
+                                 FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                                 OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS,
+                                 nullptr);
     }
-    NTSTATUS subRes = addNtSearchData(
-        handle, FileName, L"", FileInformationClass, FileInformationCurrent,
-        dataRead, infoIter->second.foundFiles, Event, ApcRoutine, ApcContext,
-        ReturnSingleEntry);
-    moreRegular = subRes == STATUS_SUCCESS;
-    if (moreRegular) {
-      dataReturned = dataRead != 0;
-    } else {
-      infoIter->second.regularComplete = true;
-      infoIter->second.foundFiles.clear();
-      if (infoIter->second.currentSearchHandle != INVALID_HANDLE_VALUE) {
-        ::CloseHandle(infoIter->second.currentSearchHandle);
-        infoIter->second.currentSearchHandle = INVALID_HANDLE_VALUE;
-      }
-    }
-  }
-  if (!moreRegular) {
-    // add virtual results
-    while (!dataReturned && infoIter->second.virtualMatches.size() > 0) {
-      auto match = infoIter->second.virtualMatches.front();
-      if (match.realPath.size() != 0) {
-        dataRead = Length;
-        if (addVirtualSearchResult(FileInformationCurrent, FileInformationClass,
-                                   infoIter->second, match.realPath,
-                                   match.virtualName, ReturnSingleEntry,
-                                   dataRead)) {
-          // a positive result here means the call returned data and there may
-          // be further objects to be retrieved by repeating the call
-          dataReturned = true;
-        } else {
-          // proceed to next search handle
-
-          // TODO: doesn't append search results from more than one redirection
-          // per call. This is bad for performance but otherwise we'd need to
-          // re-write the offsets between information objects
-          infoIter->second.virtualMatches.pop();
-          CloseHandle(infoIter->second.currentSearchHandle);
-          infoIter->second.currentSearchHandle = INVALID_HANDLE_VALUE;
-        }
+    ON_BLOCK_EXIT([searchHandle]() {
+      if (searchHandle != INVALID_HANDLE_VALUE) {
+        ::CloseHandle(searchHandle);
       }
+    });
+
+    // a query with a different information class than before lists again and
+    // continues at the same position
+    size_t cursor = info->cursor;
+    buildListing(*info,
+                 searchHandle != INVALID_HANDLE_VALUE ? searchHandle : FileHandle,
+                 info->searchPattern.size() > 0
+                     ? static_cast<PUNICODE_STRING>(info->searchPattern)
+                     : nullptr,
+                 FileInformationClass);
+    info->cursor = std::min(cursor, info->recordCount());
+
+    if (!found) {
+      activeSearches.insert(FileHandle, info);
     }
   }
 
-  if (!dataReturned) {
-    if (firstSearch) {
-      res = STATUS_NO_SUCH_FILE;
-    } else {
-      res = STATUS_NO_MORE_FILES;
-    }
-  } else {
-    res = STATUS_SUCCESS;
+  ULONG dataRead = 0;
+  NTSTATUS res = copyListing(*info, FileInformation, Length,
+                             returnSingleEntry, dataRead);
+  if ((res == STATUS_NO_MORE_FILES) && firstSearch) {
+    res = STATUS_NO_SUCH_FILE;
   }
   IoStatusBlock->Status      = res;
   IoStatusBlock->Information = dataRead;
 
-  size_t numVirtualFiles = infoIter->second.virtualMatches.size();
+  // the request completes synchronously, but a caller waiting on the event
+  // still expects it to be signaled
+  if ((Event != nullptr) && (res == STATUS_SUCCESS)) {
+    ::SetEvent(Event);
+  }
+
+  virtualCount = info->virtualCount;
+  return res;
+}
+
+NTSTATUS WINAPI usvfs::hook_NtQueryDirectoryFile(
+    HANDLE FileHandle, HANDLE Event, PIO_APC_ROUTINE ApcRoutine,
+    PVOID ApcContext, PIO_STATUS_BLOCK IoStatusBlock, PVOID FileInformation,
+    ULONG Length, FILE_INFORMATION_CLASS FileInformationClass,
+    BOOLEAN ReturnSingleEntry, PUNICODE_STRING FileName, BOOLEAN RestartScan)
+{
+  PreserveGetLastError ntFunctionsDoNotChangeGetLastError;
+
+  NTSTATUS res = STATUS_NO_MORE_FILES;
+  HOOK_START_GROUP(MutExHookGroup::FIND_FILES)
+  if (!callContext.active()) {
+    return ::NtQueryDirectoryFile(FileHandle, Event, ApcRoutine, ApcContext,
+                                  IoStatusBlock, FileInformation, Length,
+                                  FileInformationClass, ReturnSingleEntry,
+                                  FileName, RestartScan);
+  }
+
+  size_t numVirtualFiles = 0;
+  res = queryDirectory(FileHandle, Event, IoStatusBlock, FileInformation,
+                       Length, FileInformationClass, ReturnSingleEntry != FALSE,
+                       FileName, RestartScan != FALSE, numVirtualFiles);
+
   if ((numVirtualFiles > 0)) {
     LOG_CALL()
         .addParam("path", ntdllHandleTracker.lookup(FileHandle))
@@ -885,17 +1263,8 @@ NTSTATUS WINAPI usvfs::hook_NtQueryDirectoryFileEx(
     PUNICODE_STRING FileName)
 {
   PreserveGetLastError ntFunctionsDoNotChangeGetLastError;
-  NTSTATUS res = STATUS_NO_MORE_FILES;
 
-  // this is quite messy...
-  // first, this will gather the virtual locations mapping to the iterated one
-  // then we return results from the real location, skipping those that exist
-  //   in the virtual locations, as those take precedence
-  // finally the virtual results are returned, adding each result to a skip
-  //   list, so they don't get added twice
-  //
-  // if we don't add the regular files first, "." and ".." wouldn't be in the
-  //   first search result of wildcard searches which may confuse the caller
+  NTSTATUS res = STATUS_NO_MORE_FILES;
   HOOK_START_GROUP(MutExHookGroup::FIND_FILES)
   if (!callContext.active()) {
     return ::NtQueryDirectoryFileEx(FileHandle, Event, ApcRoutine, ApcContext,
@@ -903,133 +1272,12 @@ NTSTATUS WINAPI usvfs::hook_NtQueryDirectoryFileEx(
       FileInformationClass, QueryFlags, FileName);
   }
 
-  //  std::unique_lock<std::recursive_mutex> queryLock;
-  std::map<HANDLE, Searches::Info>::iterator infoIter;
-  bool firstSearch = false;
-
-  { // scope to limit context lifetime
-    HookContext::ConstPtr context = READ_CONTEXT();
-    Searches &activeSearches = context->customData<Searches>(SearchInfo);
-    //    queryLock = std::unique_lock<std::recursive_mutex>(activeSearches.queryMutex);
-
-    if (QueryFlags & SL_RESTART_SCAN) {
-      auto iter = activeSearches.info.find(FileHandle);
-      if (iter != activeSearches.info.end()) {
-        activeSearches.info.erase(iter);
-      }
-    }
-
-    // see if we already have a running search
-    infoIter = activeSearches.info.find(FileHandle);
-    firstSearch = (infoIter == activeSearches.info.end());
-  }
-
-  if (firstSearch) {
-    HookContext::Ptr context = WRITE_CONTEXT();
-    Searches &activeSearches = context->customData<Searches>(SearchInfo);
-    // tradeoff time: we store this search status even if no virtual results
-    // were found. This causes a little extra cost here and in NtClose every
-    // time a non-virtual dir is being searched. However if we don't,
-    // whenever NtQueryDirectoryFile is called another time on the same handle,
-    // this (expensive) block would be run again.
-    infoIter = activeSearches.info.insert(std::make_pair(FileHandle,
-      Searches::Info()))
-      .first;
-    infoIter->second.searchPattern.appendPath(FileName);
-
-    SearchHandleMap &searchMap
-      = context->customData<SearchHandleMap>(SearchHandles);
-    SearchHandleMap::iterator iter = searchMap.find(FileHandle);
-
-    UnicodeString searchPath;
-    if (iter != searchMap.end()) {
-      searchPath = UnicodeString(iter->second.c_str());
-      infoIter->second.currentSearchHandle =
-        CreateFileW(iter->second.c_str(), GENERIC_READ,
-          FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
-          OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
-    }
-    else {
-      searchPath = ntdllHandleTracker.lookup(FileHandle);
-    }
-    gatherVirtualEntries(searchPath, context->redirectionTable(), FileName,
-      infoIter->second);
-  }
-
-  ULONG dataRead = Length;
-  PVOID FileInformationCurrent = FileInformation;
-
-  // add regular search results, skipping those files we have in a virtual
-  // location
-  bool moreRegular = !infoIter->second.regularComplete;
-  bool dataReturned = false;
-  while (moreRegular && !dataReturned) {
-    dataRead = Length;
+  size_t numVirtualFiles = 0;
+  res = queryDirectory(FileHandle, Event, IoStatusBlock, FileInformation,
+                       Length, FileInformationClass,
+                       (QueryFlags & SL_RETURN_SINGLE_ENTRY) != 0, FileName,
+                       (QueryFlags & SL_RESTART_SCAN) != 0, numVirtualFiles);
 
-    HANDLE handle = infoIter->second.currentSearchHandle;
-    if (handle == INVALID_HANDLE_VALUE) {
-      handle = FileHandle;
-    }
-    NTSTATUS subRes = addNtSearchData(
-      handle, FileName, L"", FileInformationClass, FileInformationCurrent,
-      dataRead, infoIter->second.foundFiles, Event, ApcRoutine, ApcContext,
-      QueryFlags & SL_RETURN_SINGLE_ENTRY);
-    moreRegular = subRes == STATUS_SUCCESS;
-    if (moreRegular) {
-      dataReturned = dataRead != 0;
-    }
-    else {
-      infoIter->second.regularComplete = true;
-      infoIter->second.foundFiles.clear();
-      if (infoIter->second.currentSearchHandle != INVALID_HANDLE_VALUE) {
-        ::CloseHandle(infoIter->second.currentSearchHandle);
-        infoIter->second.currentSearchHandle = INVALID_HANDLE_VALUE;
-      }
-    }
-  }
-  if (!moreRegular) {
-    // add virtual results
-    while (!dataReturned && infoIter->second.virtualMatches.size() > 0) {
-      auto match = infoIter->second.virtualMatches.front();
-      if (match.realPath.size() != 0) {
-        dataRead = Length;
-        if (addVirtualSearchResult(FileInformationCurrent, FileInformationClass,
-          infoIter->second, match.realPath,
-          match.virtualName, QueryFlags & SL_RETURN_SINGLE_ENTRY,
-          dataRead)) {
-          // a positive result here means the call returned data and there may
-          // be further objects to be retrieved by repeating the call
-          dataReturned = true;
-        }
-        else {
-          // proceed to next search handle
-
-          // TODO: doesn't append search results from more than one redirection
-          // per call. This is bad for performance but otherwise we'd need to
-          // re-write the offsets between information objects
-          infoIter->second.virtualMatches.pop();
-          CloseHandle(infoIter->second.currentSearchHandle);
-          infoIter->second.currentSearchHandle = INVALID_HANDLE_VALUE;
-        }
-      }
-    }
-  }
-
-  if (!dataReturned) {
-    if (firstSearch) {
-      res = STATUS_NO_SUCH_FILE;
-    }
-    else {
-      res = STATUS_NO_MORE_FILES;
-    }
-  }
-  else {
-    res = STATUS_SUCCESS;
-  }
-  IoStatusBlock->Status = res;
-  IoStatusBlock->Information = dataRead;
-
-  size_t numVirtualFiles = infoIter->second.virtualMatches.size();
   if ((numVirtualFiles > 0)) {
     LOG_CALL()
       .addParam("path", ntdllHandleTracker.lookup(FileHandle))
@@ -1044,24 +1292,61 @@ NTSTATUS WINAPI usvfs::hook_NtQueryDirectoryFileEx(
   return res;
 }
 
-unique_ptr_deleter<OBJECT_ATTRIBUTES>
-makeObjectAttributes(RedirectionInfo &redirInfo,
-                     POBJECT_ATTRIBUTES attributeTemplate)
+// access that can change the content of a file. In copy-on-write mode mapped files
+// opened with any of these are copied first
+static const ACCESS_MASK WRITE_DATA_ACCESS
+    = FILE_WRITE_DATA | FILE_APPEND_DATA | GENERIC_WRITE | GENERIC_ALL;
+
+// access that can change the attributes of a file or remove it. Cached attributes of
+// files opened with any of these are dropped
+static const ACCESS_MASK MODIFY_ACCESS
+    = WRITE_DATA_ACCESS | FILE_WRITE_ATTRIBUTES | FILE_WRITE_EA | DELETE;
+
+static std::wstring attributeCacheKey(const UnicodeString &path)
+{
+  return ush::to_upper(std::wstring(static_cast<LPCWSTR>(path), path.size()));
+}
+
+/**
+ * @brief tell the attribute cache about a file opened with the specified access
+ */
+static void noteFileAccess(const UnicodeString &path, ACCESS_MASK access)
 {
-  if (redirInfo.redirected) {
-    unique_ptr_deleter<OBJECT_ATTRIBUTES> result(
-        new OBJECT_ATTRIBUTES, [](OBJECT_ATTRIBUTES *ptr) { delete ptr; });
-    memcpy(result.get(), attributeTemplate, sizeof(OBJECT_ATTRIBUTES));
-    result->RootDirectory = nullptr;
-    result->ObjectName    = static_cast<PUNICODE_STRING>(redirInfo.path);
-    return result;
-  } else {
-    // just reuse the template with a dummy deleter
-    return unique_ptr_deleter<OBJECT_ATTRIBUTES>(attributeTemplate,
-                                                 [](OBJECT_ATTRIBUTES *) {});
+  if (usvfs::attributeCache.enabled() && ((access & MODIFY_ACCESS) != 0)) {
+    usvfs::attributeCache.markModified(attributeCacheKey(path),
+                                       (access & (DELETE | GENERIC_ALL)) != 0);
   }
 }
 
+/**
+ * @brief the OBJECT_ATTRIBUTES to pass on for a possibly rerouted call. If the path
+ *        was rerouted a copy of the template referring to the new path is kept
+ *        inline, otherwise the template is used as is. The path of the
+ *        redirection info has to outlive this
+ */
+class AdjustedAttributes {
+public:
+  AdjustedAttributes(RedirectionInfo &redirInfo, POBJECT_ATTRIBUTES attributeTemplate)
+    : m_Result(attributeTemplate)
+  {
+    if (redirInfo.redirected) {
+      memcpy(&m_Attributes, attributeTemplate, sizeof(OBJECT_ATTRIBUTES));
+      m_Attributes.RootDirectory = nullptr;
+      m_Attributes.ObjectName    = static_cast<PUNICODE_STRING>(redirInfo.path);
+      m_Result = &m_Attributes;
+    }
+  }
+
+  AdjustedAttributes(const AdjustedAttributes &) = delete;
+  AdjustedAttributes &operator=(const AdjustedAttributes &) = delete;
+
+  POBJECT_ATTRIBUTES get() const { return m_Result; }
+
+private:
+  OBJECT_ATTRIBUTES m_Attributes;
+  POBJECT_ATTRIBUTES m_Result;
+};
+
 NTSTATUS ntdll_mess_NtOpenFile(PHANDLE FileHandle,
                                          ACCESS_MASK DesiredAccess,
                                          POBJECT_ATTRIBUTES ObjectAttributes,
@@ -1090,17 +1375,13 @@ NTSTATUS ntdll_mess_NtOpenFile(PHANDLE FileHandle,
 
   UnicodeString fullName = CreateUnicodeString(ObjectAttributes);
 
-  UnicodeString Path = ntdllHandleTracker.lookup(ObjectAttributes->RootDirectory);
-
-  std::wstring checkpath = ush::string_cast<std::wstring>(
-    static_cast<LPCWSTR>(Path), ush::CodePage::UTF8);
-
   if ((fullName.size() == 0)
       || (GetFileSize(ObjectAttributes->RootDirectory, nullptr)
           != INVALID_FILE_SIZE)) {
 	  //	//relative paths that we don't have permission over will fail here due that we can't get the filesize of the root directory
 	  //	//We should try again to see if it is a directory using another method
-	  if ((fullName.size() == 0) || (GetFileAttributesW((LPCWSTR)checkpath.c_str()) == INVALID_FILE_ATTRIBUTES)) {
+	  HandleTracker::info_ptr rootPath = ntdllHandleTracker.find(ObjectAttributes->RootDirectory);
+	  if ((fullName.size() == 0) || !rootPath || (GetFileAttributesW(rootPath.c_str()) == INVALID_FILE_ATTRIBUTES)) {
           return ::NtOpenFile(FileHandle, DesiredAccess, ObjectAttributes,
                         IoStatusBlock, ShareAccess, OpenOptions);
 	  }
@@ -1108,9 +1389,17 @@ NTSTATUS ntdll_mess_NtOpenFile(PHANDLE FileHandle,
 
   try {
     RedirectionInfo redir
-        = applyReroute(READ_CONTEXT(), callContext, fullName);
-    unique_ptr_deleter<OBJECT_ATTRIBUTES> adjustedAttributes
-        = makeObjectAttributes(redir, ObjectAttributes);
+        = applyReroute(callContext, fullName);
+    if (redir.redirected && ((DesiredAccess & WRITE_DATA_ACCESS) != 0)
+        && ((OpenOptions & FILE_DIRECTORY_FILE) == 0)) {
+      RerouteW copy = RerouteW::copyOnWrite(callContext, static_cast<LPCWSTR>(fullName),
+                                            static_cast<LPCWSTR>(redir.path));
+      if (copy.wasRerouted()) {
+        setReroutePath(redir, copy.fileName(), copy.fileName(), wcslen(copy.fileName()));
+      }
+    }
+    noteFileAccess(redir.path, DesiredAccess);
+    AdjustedAttributes adjustedAttributes(redir, ObjectAttributes);
 
     PRE_REALCALL
     res = ::NtOpenFile(FileHandle, DesiredAccess, adjustedAttributes.get(),
@@ -1118,9 +1407,9 @@ NTSTATUS ntdll_mess_NtOpenFile(PHANDLE FileHandle,
     POST_REALCALL
     if (SUCCEEDED(res) && storePath) {
       // store the original search path for use during iteration
-      READ_CONTEXT()
-          ->customData<SearchHandleMap>(SearchHandles)[*FileHandle]
-          = static_cast<LPCWSTR>(fullName);
+      searchHandles.insert(*FileHandle,
+                           usvfs::PathPool::instance().intern(
+                               static_cast<LPCWSTR>(fullName), fullName.size()));
 #pragma message("need to clean up this handle in CloseHandle call")
     }
 
@@ -1208,8 +1497,10 @@ NTSTATUS ntdll_mess_NtCreateFile(
 
   ULONG originalDisposition = CreateDisposition;
   CreateRerouter rerouter;
-  if (rerouter.rerouteCreate(READ_CONTEXT(), callContext, inPathW, convertedDisposition,
-                             convertedAccess, (LPSECURITY_ATTRIBUTES)ObjectAttributes->SecurityDescriptor)) {
+  if (!HookCallContext::handedOff(inPathW, inPath.size())
+      && rerouter.rerouteCreate(READ_CONTEXT(), callContext, inPathW, convertedDisposition,
+                                convertedAccess,
+                                (LPSECURITY_ATTRIBUTES)ObjectAttributes->SecurityDescriptor)) {
     switch(convertedDisposition) {
       case CREATE_NEW: CreateDisposition = FILE_CREATE; break;
       case CREATE_ALWAYS: if (CreateDisposition != FILE_SUPERSEDE) CreateDisposition = FILE_OVERWRITE_IF; break;
@@ -1218,10 +1509,17 @@ NTSTATUS ntdll_mess_NtCreateFile(
       case TRUNCATE_EXISTING: CreateDisposition = FILE_OVERWRITE; break;
     }
 
+    if ((DesiredAccess & WRITE_DATA_ACCESS) != 0)
+      rerouter.copyOnWrite(callContext, inPathW);
+
     RedirectionInfo redir = applyReroute(rerouter);
+    noteFileAccess(redir.path, ((CreateDisposition == FILE_SUPERSEDE)
+                                || (CreateDisposition == FILE_OVERWRITE)
+                                || (CreateDisposition == FILE_OVERWRITE_IF))
+                                   ? (DesiredAccess | FILE_WRITE_DATA)
+                                   : DesiredAccess);
 
-    unique_ptr_deleter<OBJECT_ATTRIBUTES> adjustedAttributes
-      = makeObjectAttributes(redir, ObjectAttributes);
+    AdjustedAttributes adjustedAttributes(redir, ObjectAttributes);
 
     PRE_REALCALL
       res = ::NtCreateFile(FileHandle, DesiredAccess, adjustedAttributes.get(),
@@ -1235,27 +1533,34 @@ NTSTATUS ntdll_mess_NtCreateFile(
       if (rerouter.newReroute())
         rerouter.insertMapping(WRITE_CONTEXT());
 
+      if (ReadAhead::enabled() && rerouter.wasRerouted() && !rerouter.isDir()
+          && ((DesiredAccess & WRITE_DATA_ACCESS) == 0)) {
+        ReadAhead::record(static_cast<LPCWSTR>(redir.path), redir.path.size());
+      }
+
       if (rerouter.isDir() && rerouter.wasRerouted() && ((FileAttributes & FILE_OPEN_FOR_BACKUP_INTENT) == FILE_OPEN_FOR_BACKUP_INTENT)) {
         // store the original search path for use during iteration
-        WRITE_CONTEXT()
-          ->customData<SearchHandleMap>(SearchHandles)[*FileHandle] = inPathW;
+        searchHandles.insert(*FileHandle,
+                             usvfs::PathPool::instance().intern(inPathW, inPath.size()));
       }
     }
 
-    if (rerouter.wasRerouted() || rerouter.changedError() || originalDisposition != CreateDisposition) {
-      LOG_CALL()
-        .PARAMWRAP(inPathW)
-        .PARAMWRAP(rerouter.fileName())
-        .PARAMHEX(DesiredAccess)
-        .PARAMHEX(originalDisposition)
-        .PARAMHEX(CreateDisposition)
-        .PARAMHEX(FileAttributes)
-        .PARAMHEX(res)
-        .PARAMHEX(*FileHandle)
-        .PARAM(rerouter.originalError())
-        .PARAM(rerouter.error());
-    }
+    LOG_CALL_SAMPLED(rerouter.changedError() ? usvfs::log::CallClass::Failed
+                     : (rerouter.wasRerouted() || (originalDisposition != CreateDisposition))
+                         ? usvfs::log::CallClass::Handled
+                         : usvfs::log::CallClass::Passthrough)
+      .PARAMWRAP(inPathW)
+      .PARAMWRAP(rerouter.fileName())
+      .PARAMHEX(DesiredAccess)
+      .PARAMHEX(originalDisposition)
+      .PARAMHEX(CreateDisposition)
+      .PARAMHEX(FileAttributes)
+      .PARAMHEX(res)
+      .PARAMHEX(*FileHandle)
+      .PARAM(rerouter.originalError())
+      .PARAM(rerouter.error());
   } else {
+    noteFileAccess(inPath, DesiredAccess);
     // make the original call to set up the proper errors and return statuses
     PRE_REALCALL
       res = ::NtCreateFile(FileHandle, DesiredAccess, ObjectAttributes,
@@ -1292,44 +1597,25 @@ NTSTATUS WINAPI usvfs::hook_NtClose(HANDLE Handle)
   HOOK_START_GROUP(MutExHookGroup::ALL_GROUPS)
   bool log = false;
 
-  if ((::GetFileType(Handle) == FILE_TYPE_DISK)) {
-    HookContext::Ptr context = WRITE_CONTEXT();
-
-    { // clean up search data associated with this handle part 1
-      Searches &activeSearches = context->customData<Searches>(SearchInfo);
-//      std::lock_guard<std::recursive_mutex> lock(activeSearches.queryMutex);
-      auto iter = activeSearches.info.find(Handle);
-      if (iter != activeSearches.info.end()) {
-        if (iter->second.currentSearchHandle != INVALID_HANDLE_VALUE) {
-          ::CloseHandle(iter->second.currentSearchHandle);
-        }
-
-        activeSearches.info.erase(iter);
-        log = true;
-      }
-    }
-
-    {
-      SearchHandleMap &searchHandles
-          = context->customData<SearchHandleMap>(SearchHandles);
-      auto iter = searchHandles.find(Handle);
-      if (iter != searchHandles.end()) {
-        searchHandles.erase(iter);
-        log = true;
-      }
-    }
+  // the handle is no longer valid after the call so its type has to be
+  // determined up front
+  bool isDisk = ::GetFileType(Handle) == FILE_TYPE_DISK;
+  if (isDisk) {
+    // clean up search data associated with this handle
+    log = endSearch(Handle);
+    log = searchHandles.erase(Handle) || log;
   }
 
   PRE_REALCALL
   res = ::NtClose(Handle);
   POST_REALCALL
 
-  if (GetFileType(Handle) == FILE_TYPE_DISK)
+  if (isDisk)
     ntdllHandleTracker.erase(Handle);
 
-  if (log) {
-    LOG_CALL().PARAM(Handle).PARAMWRAP(res);
-  }
+  LOG_CALL_SAMPLED(log ? usvfs::log::CallClass::Handled : usvfs::log::CallClass::Passthrough)
+    .PARAM(Handle)
+    .PARAMWRAP(res);
 
   HOOK_END
 
@@ -1350,21 +1636,41 @@ NTSTATUS WINAPI usvfs::hook_NtQueryAttributesFile(
   UnicodeString inPath = CreateUnicodeString(ObjectAttributes);
 
   RedirectionInfo redir
-      = applyReroute(READ_CONTEXT(), callContext, inPath);
-  unique_ptr_deleter<OBJECT_ATTRIBUTES> adjustedAttributes
-      = makeObjectAttributes(redir, ObjectAttributes);
-
-  PRE_REALCALL
-  res = ::NtQueryAttributesFile(adjustedAttributes.get(), FileInformation);
-  POST_REALCALL
-
-  if (redir.redirected) {
-    LOG_CALL()
-        .addParam("source", ObjectAttributes)
-        .addParam("rerouted", adjustedAttributes.get())
-        .PARAMWRAP(res);
+      = applyReroute(callContext, inPath);
+  AdjustedAttributes adjustedAttributes(redir, ObjectAttributes);
+
+  if (redir.redirected && usvfs::attributeCache.enabled() && (FileInformation != nullptr)) {
+    // query the full attributes so the entry also serves NtQueryFullAttributesFile
+    std::wstring cacheKey = attributeCacheKey(redir.path);
+    FILE_NETWORK_OPEN_INFORMATION info;
+    if (usvfs::attributeCache.lookup(cacheKey, info)) {
+      res = STATUS_SUCCESS;
+    } else {
+      PRE_REALCALL
+      res = ::NtQueryFullAttributesFile(adjustedAttributes.get(), &info);
+      POST_REALCALL
+      if (SUCCEEDED(res))
+        usvfs::attributeCache.insert(cacheKey, info);
+    }
+    if (SUCCEEDED(res)) {
+      FileInformation->CreationTime   = info.CreationTime;
+      FileInformation->LastAccessTime = info.LastAccessTime;
+      FileInformation->LastWriteTime  = info.LastWriteTime;
+      FileInformation->ChangeTime     = info.ChangeTime;
+      FileInformation->FileAttributes = info.FileAttributes;
+    }
+  } else {
+    PRE_REALCALL
+    res = ::NtQueryAttributesFile(adjustedAttributes.get(), FileInformation);
+    POST_REALCALL
   }
 
+  LOG_CALL_SAMPLED(redir.redirected ? usvfs::log::CallClass::Handled
+                                    : usvfs::log::CallClass::Passthrough)
+      .addParam("source", ObjectAttributes)
+      .addParam("rerouted", adjustedAttributes.get())
+      .PARAMWRAP(res);
+
   HOOK_END
 
   return res;
@@ -1392,20 +1698,77 @@ NTSTATUS WINAPI usvfs::hook_NtQueryFullAttributesFile(
   }
 
   RedirectionInfo redir
-      = applyReroute(READ_CONTEXT(), callContext, inPath);
-  unique_ptr_deleter<OBJECT_ATTRIBUTES> adjustedAttributes
-      = makeObjectAttributes(redir, ObjectAttributes);
+      = applyReroute(callContext, inPath);
+  AdjustedAttributes adjustedAttributes(redir, ObjectAttributes);
+
+  std::wstring cacheKey;
+  if (redir.redirected && usvfs::attributeCache.enabled() && (FileInformation != nullptr)) {
+    cacheKey = attributeCacheKey(redir.path);
+  }
+  if (!cacheKey.empty() && usvfs::attributeCache.lookup(cacheKey, *FileInformation)) {
+    res = STATUS_SUCCESS;
+  } else {
+    PRE_REALCALL
+    res = ::NtQueryFullAttributesFile(adjustedAttributes.get(), FileInformation);
+    POST_REALCALL
+    if (!cacheKey.empty() && SUCCEEDED(res))
+      usvfs::attributeCache.insert(cacheKey, *FileInformation);
+  }
+
+  LOG_CALL_SAMPLED(redir.redirected ? usvfs::log::CallClass::Handled
+                                    : usvfs::log::CallClass::Passthrough)
+      .addParam("source", ObjectAttributes)
+      .addParam("rerouted", adjustedAttributes.get())
+      .PARAMWRAP(res);
+
+  HOOK_END
+
+  return res;
+}
+
+NTSTATUS WINAPI usvfs::hook_NtQueryInformationByName(
+    POBJECT_ATTRIBUTES ObjectAttributes,
+    PIO_STATUS_BLOCK IoStatusBlock,
+    PVOID FileInformation,
+    ULONG Length,
+    FILE_INFORMATION_CLASS FileInformationClass)
+{
+  PreserveGetLastError ntFunctionsDoNotChangeGetLastError;
+
+  NTSTATUS res = STATUS_SUCCESS;
+
+  HOOK_START_GROUP(MutExHookGroup::FILE_ATTRIBUTES)
+
+  if (!callContext.active()) {
+    return ::NtQueryInformationByName(ObjectAttributes, IoStatusBlock, FileInformation,
+                                      Length, FileInformationClass);
+  }
+
+  UnicodeString inPath;
+  try {
+    inPath = CreateUnicodeString(ObjectAttributes);
+  } catch (const std::exception &) {
+    return ::NtQueryInformationByName(ObjectAttributes, IoStatusBlock, FileInformation,
+                                      Length, FileInformationClass);
+  }
+
+  // unlike open, query and close this is a single reroute, whatever information
+  // class is requested
+  RedirectionInfo redir
+      = applyReroute(callContext, inPath);
+  AdjustedAttributes adjustedAttributes(redir, ObjectAttributes);
 
   PRE_REALCALL
-  res = ::NtQueryFullAttributesFile(adjustedAttributes.get(), FileInformation);
+  res = ::NtQueryInformationByName(adjustedAttributes.get(), IoStatusBlock,
+                                   FileInformation, Length, FileInformationClass);
   POST_REALCALL
 
-  if (redir.redirected) {
-    LOG_CALL()
-        .addParam("source", ObjectAttributes)
-        .addParam("rerouted", adjustedAttributes.get())
-        .PARAMWRAP(res);
-  }
+  LOG_CALL_SAMPLED(redir.redirected ? usvfs::log::CallClass::Handled
+                                    : usvfs::log::CallClass::Passthrough)
+      .addParam("source", ObjectAttributes)
+      .addParam("rerouted", adjustedAttributes.get())
+      .PARAM(FileInformationClass)
+      .PARAMWRAP(res);
 
   HOOK_END
 
@@ -18,6 +18,13 @@ DLLEXPORT NTSTATUS WINAPI
 hook_NtQueryAttributesFile(POBJECT_ATTRIBUTES      ObjectAttributes,
                       PFILE_BASIC_INFORMATION FileInformation);
 
+DLLEXPORT NTSTATUS WINAPI
+hook_NtQueryInformationByName(POBJECT_ATTRIBUTES ObjectAttributes,
+                              PIO_STATUS_BLOCK IoStatusBlock,
+                              PVOID FileInformation,
+                              ULONG Length,
+                              FILE_INFORMATION_CLASS FileInformationClass);
+
 DLLEXPORT NTSTATUS WINAPI
 hook_NtQueryDirectoryFile(HANDLE FileHandle,
                      HANDLE Event,
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "../hookcontext.h"
+#include "../maptracker.h"
 
 /*
 template <typename KeyT, typename ValueT>
@@ -27,9 +28,9 @@ private:
 };
 */
 
-typedef std::map<HANDLE, std::wstring> SearchHandleMap;
+typedef usvfs::ShardedHandleMap<usvfs::PathPool::Ref> SearchHandleMap;
 
 
 // maps handles opened for searching to the original search path, which is
 // necessary if the handle creation was rerouted
-DATA_ID(SearchHandles);
+extern SearchHandleMap searchHandles;
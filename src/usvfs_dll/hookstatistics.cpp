@@ -0,0 +1,320 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "hookstatistics.h"
+#include <boost/interprocess/windows_shared_memory.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <algorithm>
+#include <intrin.h>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+namespace bi = boost::interprocess;
+
+
+namespace usvfs {
+
+HookStatsTable::Layout *HookStatsTable::s_Table = nullptr;
+double HookStatsTable::s_NanosecondsPerTick = 0.0;
+
+// incremented whenever a table is mapped so slots resolved against a previous
+// table are looked up again
+static std::atomic<int> s_TableEpoch{0};
+
+static std::unique_ptr<bi::windows_shared_memory> s_SHM;
+static std::unique_ptr<bi::mapped_region> s_Region;
+
+// slot indices are cached together with the epoch they were resolved in, the
+// low 8 bits hold the index + 1 so 0 means there is no entry
+static const int INDEX_BITS = 8;
+
+int HookStatsSlot::index()
+{
+  int epoch = s_TableEpoch.load(std::memory_order_acquire);
+  int packed = m_Index.load(std::memory_order_relaxed);
+  if ((packed == UNRESOLVED) || ((packed >> INDEX_BITS) != epoch)) {
+    if (HookStatsTable::s_Table == nullptr) {
+      return -1;
+    }
+    int index = HookStatsTable::registerHook(m_Function);
+    packed = (epoch << INDEX_BITS) | (index + 1);
+    m_Index.store(packed, std::memory_order_relaxed);
+  }
+  return (packed & ((1 << INDEX_BITS) - 1)) - 1;
+}
+
+void HookStatsTable::open(const std::string &instanceName)
+{
+  close();
+  std::string name = instanceName + "_hookstats";
+  s_SHM.reset(new bi::windows_shared_memory(bi::open_or_create, name.c_str(),
+                                            bi::read_write, sizeof(Layout)));
+  s_Region.reset(new bi::mapped_region(*s_SHM, bi::read_write));
+
+  LARGE_INTEGER frequency;
+  QueryPerformanceFrequency(&frequency);
+  s_NanosecondsPerTick = 1e9 / static_cast<double>(frequency.QuadPart);
+
+  s_Table = static_cast<Layout*>(s_Region->get_address());
+  ++s_TableEpoch;
+}
+
+void HookStatsTable::close()
+{
+  s_Table = nullptr;
+  s_Region.reset();
+  s_SHM.reset();
+}
+
+void HookStatsTable::setEnabled(bool enabled)
+{
+  if (s_Table != nullptr) {
+    s_Table->enabled.store(enabled ? 1 : 0, std::memory_order_relaxed);
+  }
+}
+
+// hook functions are named usvfs::hook_<api>, only the api name is stored
+static const char *displayName(const char *function)
+{
+  const char *prefix = "usvfs::hook_";
+  size_t prefixLength = strlen(prefix);
+  return strncmp(function, prefix, prefixLength) == 0 ? function + prefixLength
+                                                      : function;
+}
+
+int HookStatsTable::registerName(Entry *entries, const char *name)
+{
+  for (uint32_t i = 0; i < MAX_HOOKS; ++i) {
+    Entry &entry = entries[i];
+    if ((entry.state.load(std::memory_order_acquire) == 2)
+        && (strncmp(entry.name, name, HOOKSTAT_NAME_LENGTH - 1) == 0)) {
+      return static_cast<int>(i);
+    }
+  }
+  // not registered yet. If another process registers the same name concurrently
+  // it ends up in two entries, collecting merges those
+  for (uint32_t i = 0; i < MAX_HOOKS; ++i) {
+    Entry &entry = entries[i];
+    uint32_t expected = 0;
+    if (entry.state.compare_exchange_strong(expected, 1)) {
+      strncpy_s(entry.name, name, _TRUNCATE);
+      entry.state.store(2, std::memory_order_release);
+      return static_cast<int>(i);
+    }
+  }
+  return -1;
+}
+
+int HookStatsTable::registerHook(const char *function)
+{
+  return registerName(s_Table->entries, displayName(function));
+}
+
+static uint32_t latencyBucket(uint64_t nanoseconds)
+{
+  unsigned long bit = 0;
+  uint32_t high = static_cast<uint32_t>(nanoseconds >> 32);
+  if (high != 0) {
+    _BitScanReverse(&bit, high);
+    bit += 32;
+  } else if (!_BitScanReverse(&bit, static_cast<uint32_t>(nanoseconds))) {
+    bit = 0;
+  }
+  return bit < HOOKSTAT_LATENCY_BUCKETS ? bit : HOOKSTAT_LATENCY_BUCKETS - 1;
+}
+
+void HookStatsTable::record(HookStatsSlot &slot, uint64_t hookTicks,
+                            uint64_t realTicks, bool redirected)
+{
+  int index = slot.index();
+  if ((index < 0) || (s_Table == nullptr)) {
+    return;
+  }
+  Lane &lane = s_Table->lanes[index][GetCurrentThreadId() % LANES];
+  uint64_t hookNanoseconds = static_cast<uint64_t>(hookTicks * s_NanosecondsPerTick);
+  uint64_t realNanoseconds = static_cast<uint64_t>(realTicks * s_NanosecondsPerTick);
+
+  lane.calls.fetch_add(1, std::memory_order_relaxed);
+  if (redirected) {
+    lane.redirected.fetch_add(1, std::memory_order_relaxed);
+  }
+  lane.hookNanoseconds.fetch_add(hookNanoseconds, std::memory_order_relaxed);
+  lane.realNanoseconds.fetch_add(realNanoseconds, std::memory_order_relaxed);
+  lane.latency[latencyBucket(hookNanoseconds)].fetch_add(1, std::memory_order_relaxed);
+}
+
+bool HookStatsTable::collect(HookStatistics *statistics, size_t *count)
+{
+  if (s_Table == nullptr) {
+    return false;
+  }
+
+  std::vector<HookStatistics> merged;
+  for (uint32_t i = 0; i < MAX_HOOKS; ++i) {
+    const Entry &entry = s_Table->entries[i];
+    if (entry.state.load(std::memory_order_acquire) != 2) {
+      continue;
+    }
+    auto iter = std::find_if(merged.begin(), merged.end(),
+                             [&entry](const HookStatistics &stats) {
+                               return strcmp(stats.name, entry.name) == 0;
+                             });
+    if (iter == merged.end()) {
+      HookStatistics stats;
+      memset(&stats, 0, sizeof(HookStatistics));
+      strncpy_s(stats.name, entry.name, _TRUNCATE);
+      iter = merged.insert(merged.end(), stats);
+    }
+    for (uint32_t l = 0; l < LANES; ++l) {
+      const Lane &lane = s_Table->lanes[i][l];
+      iter->calls += lane.calls.load(std::memory_order_relaxed);
+      iter->redirected += lane.redirected.load(std::memory_order_relaxed);
+      iter->hookNanoseconds += lane.hookNanoseconds.load(std::memory_order_relaxed);
+      iter->realNanoseconds += lane.realNanoseconds.load(std::memory_order_relaxed);
+      for (uint32_t b = 0; b < HOOKSTAT_LATENCY_BUCKETS; ++b) {
+        iter->latency[b] += lane.latency[b].load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  if (statistics != nullptr) {
+    size_t copyCount = std::min(*count, merged.size());
+    std::copy(merged.begin(), merged.begin() + copyCount, statistics);
+  }
+  *count = merged.size();
+  return true;
+}
+
+void HookStatsTable::recordLock(bool exclusive, uint64_t waitTicks, const char *holder)
+{
+  Layout *table = s_Table;
+  if (table == nullptr) {
+    return;
+  }
+  LockLane &lane = table->lockLanes[GetCurrentThreadId() % LANES];
+  (exclusive ? lane.exclusiveAcquisitions : lane.sharedAcquisitions)
+      .fetch_add(1, std::memory_order_relaxed);
+  if (waitTicks == 0) {
+    return;
+  }
+
+  uint64_t waitNanoseconds = static_cast<uint64_t>(waitTicks * s_NanosecondsPerTick);
+  (exclusive ? lane.contendedExclusive : lane.contendedShared)
+      .fetch_add(1, std::memory_order_relaxed);
+  lane.waitNanoseconds.fetch_add(waitNanoseconds, std::memory_order_relaxed);
+  uint64_t max = lane.maxWaitNanoseconds.load(std::memory_order_relaxed);
+  while ((waitNanoseconds > max)
+         && !lane.maxWaitNanoseconds.compare_exchange_weak(max, waitNanoseconds)) {
+  }
+
+  // this is only reached after waiting, so a linear search doesn't matter
+  int index = registerName(table->holders, holder != nullptr ? displayName(holder)
+                                                             : "(shared)");
+  if (index >= 0) {
+    table->holderCounters[index].contended.fetch_add(1, std::memory_order_relaxed);
+    table->holderCounters[index].waitNanoseconds.fetch_add(waitNanoseconds,
+                                                           std::memory_order_relaxed);
+  }
+}
+
+bool HookStatsTable::collectLock(ContextLockStatistics *statistics,
+                                 ContextLockHolder *holders, size_t *count)
+{
+  if (s_Table == nullptr) {
+    return false;
+  }
+
+  if (statistics != nullptr) {
+    memset(statistics, 0, sizeof(ContextLockStatistics));
+    for (uint32_t l = 0; l < LANES; ++l) {
+      const LockLane &lane = s_Table->lockLanes[l];
+      statistics->sharedAcquisitions += lane.sharedAcquisitions.load(std::memory_order_relaxed);
+      statistics->exclusiveAcquisitions += lane.exclusiveAcquisitions.load(std::memory_order_relaxed);
+      statistics->contendedShared += lane.contendedShared.load(std::memory_order_relaxed);
+      statistics->contendedExclusive += lane.contendedExclusive.load(std::memory_order_relaxed);
+      statistics->waitNanoseconds += lane.waitNanoseconds.load(std::memory_order_relaxed);
+      statistics->maxWaitNanoseconds = std::max(
+          statistics->maxWaitNanoseconds, lane.maxWaitNanoseconds.load(std::memory_order_relaxed));
+    }
+  }
+
+  std::vector<ContextLockHolder> merged;
+  for (uint32_t i = 0; i < MAX_HOOKS; ++i) {
+    const Entry &entry = s_Table->holders[i];
+    if (entry.state.load(std::memory_order_acquire) != 2) {
+      continue;
+    }
+    auto iter = std::find_if(merged.begin(), merged.end(),
+                             [&entry](const ContextLockHolder &holder) {
+                               return strcmp(holder.source, entry.name) == 0;
+                             });
+    if (iter == merged.end()) {
+      ContextLockHolder holder;
+      memset(&holder, 0, sizeof(ContextLockHolder));
+      strncpy_s(holder.source, entry.name, _TRUNCATE);
+      iter = merged.insert(merged.end(), holder);
+    }
+    iter->contended += s_Table->holderCounters[i].contended.load(std::memory_order_relaxed);
+    iter->waitNanoseconds
+        += s_Table->holderCounters[i].waitNanoseconds.load(std::memory_order_relaxed);
+  }
+
+  if (count != nullptr) {
+    if (holders != nullptr) {
+      size_t copyCount = std::min(*count, merged.size());
+      std::copy(merged.begin(), merged.begin() + copyCount, holders);
+    }
+    *count = merged.size();
+  }
+  return true;
+}
+
+void HookStatsTable::reset()
+{
+  if (s_Table == nullptr) {
+    return;
+  }
+  for (uint32_t i = 0; i < MAX_HOOKS; ++i) {
+    for (uint32_t l = 0; l < LANES; ++l) {
+      Lane &lane = s_Table->lanes[i][l];
+      lane.calls.store(0, std::memory_order_relaxed);
+      lane.redirected.store(0, std::memory_order_relaxed);
+      lane.hookNanoseconds.store(0, std::memory_order_relaxed);
+      lane.realNanoseconds.store(0, std::memory_order_relaxed);
+      for (uint32_t b = 0; b < HOOKSTAT_LATENCY_BUCKETS; ++b) {
+        lane.latency[b].store(0, std::memory_order_relaxed);
+      }
+    }
+    s_Table->holderCounters[i].contended.store(0, std::memory_order_relaxed);
+    s_Table->holderCounters[i].waitNanoseconds.store(0, std::memory_order_relaxed);
+  }
+  for (uint32_t l = 0; l < LANES; ++l) {
+    LockLane &lane = s_Table->lockLanes[l];
+    lane.sharedAcquisitions.store(0, std::memory_order_relaxed);
+    lane.exclusiveAcquisitions.store(0, std::memory_order_relaxed);
+    lane.contendedShared.store(0, std::memory_order_relaxed);
+    lane.contendedExclusive.store(0, std::memory_order_relaxed);
+    lane.waitNanoseconds.store(0, std::memory_order_relaxed);
+    lane.maxWaitNanoseconds.store(0, std::memory_order_relaxed);
+  }
+}
+
+} // namespace usvfs
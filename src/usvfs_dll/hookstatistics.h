@@ -0,0 +1,183 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include "windows_sane.h"
+#include <usvfs.h>
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+
+namespace usvfs {
+
+/**
+ * @brief identifies one hook function in the statistics table. Each hook holds
+ *        a function-local static of this type, the matching entry in shared memory
+ *        is looked up the first time statistics are recorded for it
+ */
+class HookStatsSlot {
+public:
+  explicit HookStatsSlot(const char *function) : m_Function(function) {}
+
+  /**
+   * @return index of the entry in the statistics table or -1 if there is no table
+   *         or it's full
+   */
+  int index();
+
+  const char *function() const { return m_Function; }
+
+  /**
+   * @brief id of the hook in the trace file, managed by HookTrace
+   */
+  std::atomic<int> &traceId() { return m_TraceId; }
+
+private:
+  static const int UNRESOLVED = -2;
+
+  const char *m_Function;
+  std::atomic<int> m_Index{UNRESOLVED};
+  std::atomic<int> m_TraceId{0};
+};
+
+
+/**
+ * @brief call counters and latency histograms of all hooks, shared by all
+ *        processes connected to the same vfs instance. Each entry is split into
+ *        lanes chosen by thread id so concurrent calls rarely write to the same
+ *        cache line. Recording is off until enabled through EnableHookStatistics
+ */
+class HookStatsTable {
+public:
+  static const uint32_t MAX_HOOKS = 64;
+  static const uint32_t LANES = 8;
+
+  /**
+   * @brief map the table of the specified vfs instance, creating it if necessary
+   */
+  static void open(const std::string &instanceName);
+
+  static void close();
+
+  static bool enabled()
+  {
+    return (s_Table != nullptr)
+        && (s_Table->enabled.load(std::memory_order_relaxed) != 0);
+  }
+
+  static void setEnabled(bool enabled);
+
+  /**
+   * @return a timestamp for measuring hook latency
+   */
+  static uint64_t now()
+  {
+    LARGE_INTEGER result;
+    QueryPerformanceCounter(&result);
+    return static_cast<uint64_t>(result.QuadPart);
+  }
+
+  /**
+   * @brief add one call to the statistics of a hook
+   * @param hookTicks time between entering and leaving the hook, in now() units
+   * @param realTicks time spent in the original function, in now() units
+   */
+  static void record(HookStatsSlot &slot, uint64_t hookTicks, uint64_t realTicks,
+                     bool redirected);
+
+  /**
+   * @brief sum up all lanes. Entries registered with the same name by different
+   *        processes are merged
+   * @param count capacity of statistics. Receives the number of hooks with
+   *        statistics, which may be larger than the capacity
+   * @return false if there is no table
+   */
+  static bool collect(HookStatistics *statistics, size_t *count);
+
+  /**
+   * @brief add one acquisition of the hook context lock
+   * @param waitTicks time spent waiting in now() units, 0 if the lock was free
+   * @param holder source of the exclusive holder when the wait started, nullptr if
+   *        only shared holders were in the way
+   */
+  static void recordLock(bool exclusive, uint64_t waitTicks, const char *holder);
+
+  /**
+   * @brief sum up the lock statistics
+   * @param count capacity of holders. Receives the number of holders
+   * @return false if there is no table
+   */
+  static bool collectLock(ContextLockStatistics *statistics, ContextLockHolder *holders,
+                          size_t *count);
+
+  static void reset();
+
+private:
+  friend class HookStatsSlot;
+
+  struct Entry {
+    // 0 = free, 1 = being claimed, 2 = name is valid
+    std::atomic<uint32_t> state;
+    char name[HOOKSTAT_NAME_LENGTH];
+  };
+
+  struct alignas(64) Lane {
+    std::atomic<uint64_t> calls;
+    std::atomic<uint64_t> redirected;
+    std::atomic<uint64_t> hookNanoseconds;
+    std::atomic<uint64_t> realNanoseconds;
+    std::atomic<uint64_t> latency[HOOKSTAT_LATENCY_BUCKETS];
+  };
+
+  struct alignas(64) LockLane {
+    std::atomic<uint64_t> sharedAcquisitions;
+    std::atomic<uint64_t> exclusiveAcquisitions;
+    std::atomic<uint64_t> contendedShared;
+    std::atomic<uint64_t> contendedExclusive;
+    std::atomic<uint64_t> waitNanoseconds;
+    std::atomic<uint64_t> maxWaitNanoseconds;
+  };
+
+  struct HolderCounters {
+    std::atomic<uint64_t> contended;
+    std::atomic<uint64_t> waitNanoseconds;
+  };
+
+  // the segment is zero-filled on creation, which is a valid empty table
+  struct Layout {
+    std::atomic<uint32_t> enabled;
+    Entry entries[MAX_HOOKS];
+    Lane lanes[MAX_HOOKS][LANES];
+    LockLane lockLanes[LANES];
+    Entry holders[MAX_HOOKS];
+    HolderCounters holderCounters[MAX_HOOKS];
+  };
+
+  static int registerName(Entry *entries, const char *name);
+  static int registerHook(const char *function);
+
+private:
+  static Layout *s_Table;
+  static double s_NanosecondsPerTick;
+};
+
+} // namespace usvfs
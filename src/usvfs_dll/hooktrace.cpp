@@ -0,0 +1,228 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "hooktrace.h"
+#include "hookstatistics.h"
+#include "hookcallcontext.h"
+#include <stringutils.h>
+#include <stringcast.h>
+#include <algorithm>
+#include <cstring>
+#include <spdlog.h>
+
+namespace ush = usvfs::shared;
+
+
+namespace usvfs {
+
+HookTrace::Header *HookTrace::s_Header = nullptr;
+
+static const uint32_t RECORD_CAPACITY = 1024 * 1024;
+static const uint32_t STRING_CAPACITY = 8 * 1024 * 1024;
+// placed in front of the records, rounded up to a page
+static const size_t HEADER_SIZE = 8192;
+
+static_assert(sizeof(HookTrace::Record) == 32, "trace records are meant to be 32 bytes");
+static_assert(sizeof(HookTrace::Header) <= HEADER_SIZE, "trace header doesn't fit");
+
+static HANDLE s_File = INVALID_HANDLE_VALUE;
+static HANDLE s_Mapping = nullptr;
+static HookTrace::Record *s_Records = nullptr;
+static char *s_Strings = nullptr;
+
+// incremented whenever a trace is opened so hook ids resolved against a previous
+// trace are assigned again
+static std::atomic<int> s_TraceEpoch{0};
+
+// hashes of the paths already in the string section, open addressing. 0 is free
+static const uint32_t INTERNED_SIZE = 64 * 1024;
+static const uint32_t INTERNED_PROBES = 8;
+static std::atomic<uint32_t> s_Interned[INTERNED_SIZE];
+
+// the view stays mapped after close because hooks that are still running may write
+// a last record, it's only released when the next trace is opened
+static void releaseFile()
+{
+  if (s_Records != nullptr) {
+    ::UnmapViewOfFile(reinterpret_cast<char*>(s_Records) - HEADER_SIZE);
+    s_Records = nullptr;
+    s_Strings = nullptr;
+  }
+  if (s_Mapping != nullptr) {
+    ::CloseHandle(s_Mapping);
+    s_Mapping = nullptr;
+  }
+  if (s_File != INVALID_HANDLE_VALUE) {
+    ::CloseHandle(s_File);
+    s_File = INVALID_HANDLE_VALUE;
+  }
+}
+
+bool HookTrace::open(const std::wstring &directory)
+{
+  close();
+  releaseFile();
+
+  // the trace file must not end up in the vfs
+  FunctionGroupLock lock(MutExHookGroup::ALL_GROUPS);
+
+  std::wstring path = directory;
+  if (!path.empty() && (path.back() != L'\\') && (path.back() != L'/')) {
+    path.push_back(L'\\');
+  }
+  path += L"usvfs_" + std::to_wstring(::GetCurrentProcessId()) + L"_"
+          + std::to_wstring(::GetTickCount64()) + L".usvfstrace";
+
+  uint64_t size = HEADER_SIZE + static_cast<uint64_t>(RECORD_CAPACITY) * sizeof(Record)
+                  + STRING_CAPACITY;
+
+  s_File = ::CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ,
+                         nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (s_File == INVALID_HANDLE_VALUE) {
+    spdlog::get("usvfs")->error("failed to create trace file: {}", ::GetLastError());
+    return false;
+  }
+  s_Mapping = ::CreateFileMappingW(s_File, nullptr, PAGE_READWRITE,
+                                   static_cast<DWORD>(size >> 32),
+                                   static_cast<DWORD>(size), nullptr);
+  char *base = s_Mapping != nullptr
+      ? static_cast<char*>(::MapViewOfFile(s_Mapping, FILE_MAP_WRITE, 0, 0, 0))
+      : nullptr;
+  if (base == nullptr) {
+    spdlog::get("usvfs")->error("failed to map trace file: {}", ::GetLastError());
+    releaseFile();
+    return false;
+  }
+
+  for (std::atomic<uint32_t> &hash : s_Interned) {
+    hash.store(0, std::memory_order_relaxed);
+  }
+
+  // the file is zero-filled
+  Header *header = reinterpret_cast<Header*>(base);
+  LARGE_INTEGER frequency;
+  QueryPerformanceFrequency(&frequency);
+  header->magic          = MAGIC;
+  header->version        = VERSION;
+  header->headerSize     = static_cast<uint32_t>(HEADER_SIZE);
+  header->recordSize     = sizeof(Record);
+  header->ticksPerSecond = static_cast<uint64_t>(frequency.QuadPart);
+  header->processId      = ::GetCurrentProcessId();
+  header->recordCapacity = RECORD_CAPACITY;
+  header->stringCapacity = STRING_CAPACITY;
+
+  s_Records = reinterpret_cast<Record*>(base + HEADER_SIZE);
+  s_Strings = base + HEADER_SIZE + static_cast<size_t>(RECORD_CAPACITY) * sizeof(Record);
+  ++s_TraceEpoch;
+  s_Header = header;
+
+  spdlog::get("usvfs")->info("tracing hooks to {}",
+                             ush::string_cast<std::string>(path, ush::CodePage::UTF8));
+  return true;
+}
+
+void HookTrace::close()
+{
+  Header *header = s_Header;
+  s_Header = nullptr;
+  if (header != nullptr) {
+    ::FlushViewOfFile(header, 0);
+    ::FlushFileBuffers(s_File);
+  }
+}
+
+uint16_t HookTrace::hookId(Header *header, HookStatsSlot &slot)
+{
+  // the id is cached in the slot together with the epoch it was assigned in,
+  // the low 8 bits hold the id + 1
+  int epoch = s_TraceEpoch.load(std::memory_order_acquire);
+  int packed = slot.traceId().load(std::memory_order_relaxed);
+  if ((packed == 0) || ((packed >> 8) != epoch)) {
+    uint32_t id = header->hookCount.fetch_add(1, std::memory_order_relaxed);
+    if (id < MAX_HOOKS) {
+      strncpy_s(header->hookNames[id], slot.function(), _TRUNCATE);
+    } else {
+      id = MAX_HOOKS;
+    }
+    packed = (epoch << 8) | static_cast<int>(id + 1);
+    slot.traceId().store(packed, std::memory_order_relaxed);
+  }
+  return static_cast<uint16_t>((packed & 0xff) - 1);
+}
+
+void HookTrace::record(HookStatsSlot &slot, uint64_t entryTicks, uint64_t exitTicks,
+                       uint64_t realTicks, uint32_t pathHash, bool redirected)
+{
+  Header *header = s_Header;
+  if (header == nullptr) {
+    return;
+  }
+  uint64_t index = header->recordCount.fetch_add(1, std::memory_order_relaxed);
+  if (index >= RECORD_CAPACITY) {
+    return;
+  }
+  Record &record    = s_Records[index];
+  record.entryTicks = entryTicks;
+  record.exitTicks  = exitTicks;
+  record.realTicks  = static_cast<uint32_t>(std::min<uint64_t>(realTicks, UINT32_MAX));
+  record.pathHash   = pathHash;
+  record.hookId     = hookId(header, slot);
+  record.flags      = redirected ? REDIRECTED : 0;
+  record.threadId   = ::GetCurrentThreadId();
+}
+
+uint32_t HookTrace::internPath(const wchar_t *path, size_t length)
+{
+  uint32_t hash = ush::foldedHash(path, length);
+  if (hash == 0) {
+    hash = 1;
+  }
+  Header *header = s_Header;
+  if (header == nullptr) {
+    return hash;
+  }
+
+  for (uint32_t probe = 0; probe < INTERNED_PROBES; ++probe) {
+    std::atomic<uint32_t> &entry = s_Interned[(hash + probe) % INTERNED_SIZE];
+    uint32_t existing = entry.load(std::memory_order_relaxed);
+    if (existing == hash) {
+      return hash;
+    }
+    if ((existing == 0) && entry.compare_exchange_strong(existing, hash)) {
+      uint16_t bytes = static_cast<uint16_t>(
+          std::min<size_t>(length * sizeof(wchar_t), 0xfffe));
+      uint32_t entrySize = (sizeof(uint32_t) + sizeof(uint16_t) + bytes + 3) & ~3U;
+      uint32_t offset = header->stringBytes.fetch_add(entrySize, std::memory_order_relaxed);
+      if (offset + entrySize <= STRING_CAPACITY) {
+        char *target = s_Strings + offset;
+        memcpy(target, &hash, sizeof(hash));
+        memcpy(target + sizeof(hash), &bytes, sizeof(bytes));
+        memcpy(target + sizeof(hash) + sizeof(bytes), path, bytes);
+      }
+      return hash;
+    } else if (existing == hash) {
+      return hash;
+    }
+  }
+  // the table is full, the path is traced without its name
+  return hash;
+}
+
+} // namespace usvfs
@@ -0,0 +1,124 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include "windows_sane.h"
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+
+namespace usvfs {
+
+class HookStatsSlot;
+
+/**
+ * @brief records every hooked call of this process into a memory-mapped trace
+ *        file for offline analysis. Records have a fixed size and are written
+ *        without formatting or locking. Paths appear in the records as hashes,
+ *        each path is stored once in the string section of the file along with
+ *        its hash.
+ *        File layout: Header, then Header::recordCapacity Records, then the
+ *        string section of Header::stringCapacity bytes made up of
+ *        { uint32_t hash; uint16_t bytes; wchar_t path[] } padded to 4 bytes.
+ *        Once the file is full further calls are only counted
+ */
+class HookTrace {
+public:
+  static const uint32_t MAGIC = 0x52545355; // USTR
+  static const uint32_t VERSION = 1;
+  static const uint32_t MAX_HOOKS = 128;
+  static const uint32_t NAME_LENGTH = 48;
+
+  enum RecordFlags : uint16_t {
+    REDIRECTED = 0x01
+  };
+
+  struct Record {
+    uint64_t entryTicks; // QueryPerformanceCounter when the hook was entered
+    uint64_t exitTicks;  // QueryPerformanceCounter when the hook returned
+    uint32_t realTicks;  // time spent in the original function, saturated
+    uint32_t pathHash;   // 0 if the hook didn't look at a path
+    uint16_t hookId;     // index into Header::hookNames
+    uint16_t flags;      // RecordFlags
+    uint32_t threadId;
+  };
+
+  struct Header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t headerSize;
+    uint32_t recordSize;
+    uint64_t ticksPerSecond;
+    uint32_t processId;
+    uint32_t recordCapacity;
+    uint32_t stringCapacity;
+    uint32_t reserved;
+    std::atomic<uint64_t> recordCount; // may exceed the capacity, later records are lost
+    std::atomic<uint32_t> stringBytes;
+    std::atomic<uint32_t> hookCount;
+    char hookNames[MAX_HOOKS][NAME_LENGTH];
+  };
+
+public:
+  /**
+   * @brief start tracing into a new file in the specified directory
+   * @return false if the file couldn't be created
+   */
+  static bool open(const std::wstring &directory);
+
+  /**
+   * @brief stop tracing, the file is flushed and closed
+   */
+  static void close();
+
+  static bool enabled()
+  {
+    return s_Header != nullptr;
+  }
+
+  static uint64_t now()
+  {
+    LARGE_INTEGER result;
+    QueryPerformanceCounter(&result);
+    return static_cast<uint64_t>(result.QuadPart);
+  }
+
+  /**
+   * @brief append the record of one call
+   */
+  static void record(HookStatsSlot &slot, uint64_t entryTicks, uint64_t exitTicks,
+                     uint64_t realTicks, uint32_t pathHash, bool redirected);
+
+  /**
+   * @return hash of the path to put in records. The path is added to the string
+   *         section the first time it's seen
+   */
+  static uint32_t internPath(const wchar_t *path, size_t length);
+
+private:
+  static uint16_t hookId(Header *header, HookStatsSlot &slot);
+
+private:
+  static Header *s_Header;
+};
+
+} // namespace usvfs
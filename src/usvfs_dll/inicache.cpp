@@ -0,0 +1,130 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "inicache.h"
+#include <stringutils.h>
+#include <vector>
+
+namespace usvfs {
+
+std::wstring IniCache::key(const wchar_t *path)
+{
+  return shared::to_upper(path);
+}
+
+std::shared_ptr<const shared::IniFile> IniCache::read(const wchar_t *path, uint64_t size)
+{
+  HANDLE file = ::CreateFileW(path, GENERIC_READ,
+                              FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                              nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    return nullptr;
+  }
+
+  std::vector<char> buffer(static_cast<size_t>(size));
+  DWORD read = 0;
+  BOOL res = buffer.empty()
+      || ::ReadFile(file, buffer.data(), static_cast<DWORD>(buffer.size()), &read, nullptr);
+  ::CloseHandle(file);
+  if (!res) {
+    return nullptr;
+  }
+
+  auto ini = std::make_shared<shared::IniFile>();
+  if (!ini->parse(buffer.data(), read)) {
+    return nullptr;
+  }
+  return ini;
+}
+
+std::shared_ptr<const shared::IniFile> IniCache::get(const wchar_t *path)
+{
+  WIN32_FILE_ATTRIBUTE_DATA attributes;
+  if (!::GetFileAttributesExW(path, GetFileExInfoStandard, &attributes)
+      || ((attributes.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0)) {
+    return nullptr;
+  }
+  uint64_t size = (static_cast<uint64_t>(attributes.nFileSizeHigh) << 32)
+                  | attributes.nFileSizeLow;
+  if (size > MAX_FILE_SIZE) {
+    return nullptr;
+  }
+
+  std::wstring cacheKey = key(path);
+  {
+    std::shared_lock<std::shared_mutex> lock(m_Mutex);
+    auto iter = m_Entries.find(cacheKey);
+    if ((iter != m_Entries.end())
+        && (::CompareFileTime(&iter->second.lastWrite, &attributes.ftLastWriteTime) == 0)
+        && (iter->second.size == size)) {
+      return iter->second.ini;
+    }
+  }
+
+  std::shared_ptr<const shared::IniFile> ini = read(path, size);
+  if (ini == nullptr) {
+    return nullptr;
+  }
+
+  std::unique_lock<std::shared_mutex> lock(m_Mutex);
+  if ((m_Entries.size() >= MAX_ENTRIES) && (m_Entries.find(cacheKey) == m_Entries.end())) {
+    m_Entries.clear();
+  }
+  m_Entries[cacheKey] = Entry{ attributes.ftLastWriteTime, size, ini };
+  return ini;
+}
+
+void IniCache::invalidate(const wchar_t *path)
+{
+  std::wstring cacheKey = key(path);
+  std::unique_lock<std::shared_mutex> lock(m_Mutex);
+  m_Entries.erase(cacheKey);
+}
+
+
+void profileString(const shared::IniFile &ini, LPCWSTR section, LPCWSTR key,
+                   LPCWSTR defaultValue, std::wstring &result, DWORD &error)
+{
+  const std::wstring *value = ini.value(section, key);
+  if (value != nullptr) {
+    result = *value;
+    error = ERROR_SUCCESS;
+  } else {
+    result = (defaultValue != nullptr) ? defaultValue : L"";
+    size_t end = result.find_last_not_of(L' ');
+    result.resize((end != std::wstring::npos) ? end + 1 : 0);
+    error = ERROR_FILE_NOT_FOUND;
+  }
+}
+
+void profileSection(const shared::IniFile &ini, LPCWSTR section,
+                    std::wstring &result, DWORD &error)
+{
+  const std::wstring *entries = ini.entries(section);
+  if (entries != nullptr) {
+    result = *entries;
+    error = ERROR_SUCCESS;
+  } else {
+    result.clear();
+    error = ERROR_FILE_NOT_FOUND;
+  }
+}
+
+}
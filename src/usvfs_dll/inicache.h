@@ -0,0 +1,148 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <windows_sane.h>
+#include <inifile.h>
+#include <atomic>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+
+namespace usvfs {
+
+/**
+ * @brief process-local cache of parsed ini files, used to answer
+ *        GetPrivateProfileString and GetPrivateProfileSection on rerouted files
+ *        without having the system parse the file again on every call.
+ *        Entries are keyed by the rerouted path and validated against the file's
+ *        last write time and size on each lookup. Writes through the hooks drop the
+ *        entry, a change by another process that keeps both time and size the same
+ *        goes unnoticed, which is why the cache is off by default
+ */
+class IniCache
+{
+public:
+
+  // files larger than this aren't cached
+  static const uint64_t MAX_FILE_SIZE = 1024 * 1024;
+  static const size_t MAX_ENTRIES = 64;
+
+  void setEnabled(bool enabled) { m_Enabled = enabled; }
+  bool enabled() const { return m_Enabled; }
+
+  /**
+   * @brief retrieve the parsed content of an ini file, reading it if it isn't
+   *        cached or has changed
+   * @return nullptr if the file can't be read or parsed, the caller should let the
+   *         system handle the call then
+   */
+  std::shared_ptr<const shared::IniFile> get(const wchar_t *path);
+
+  /**
+   * @brief drop a file from the cache, called after it was written to
+   */
+  void invalidate(const wchar_t *path);
+
+private:
+
+  struct Entry {
+    FILETIME lastWrite;
+    uint64_t size;
+    std::shared_ptr<const shared::IniFile> ini;
+  };
+
+  static std::wstring key(const wchar_t *path);
+
+  static std::shared_ptr<const shared::IniFile> read(const wchar_t *path, uint64_t size);
+
+private:
+
+  std::atomic<bool> m_Enabled { false };
+
+  std::shared_mutex m_Mutex;
+  // keyed by the folded path
+  std::unordered_map<std::wstring, Entry> m_Entries;
+
+};
+
+extern IniCache iniCache;
+
+/**
+ * @brief answer GetPrivateProfileString from a parsed ini file
+ * @param result receives the value or the default with trailing blanks removed
+ * @param error receives the error code the system would have set
+ */
+void profileString(const shared::IniFile &ini, LPCWSTR section, LPCWSTR key,
+                   LPCWSTR defaultValue, std::wstring &result, DWORD &error);
+
+/**
+ * @brief answer GetPrivateProfileSection from a parsed ini file
+ * @param result receives the null-separated entries of the section
+ * @param error receives the error code the system would have set
+ */
+void profileSection(const shared::IniFile &ini, LPCWSTR section,
+                    std::wstring &result, DWORD &error);
+
+/**
+ * @brief copy a profile string into the caller's buffer, truncating it like
+ *        GetPrivateProfileString does
+ * @return the number of characters copied, not including the terminating null
+ */
+template <typename CharT>
+DWORD copyProfileString(const std::basic_string<CharT> &value, CharT *buffer,
+                        DWORD size, DWORD &error)
+{
+  if (size == 0) {
+    return 0;
+  }
+  DWORD length = static_cast<DWORD>(value.size());
+  if (length >= size) {
+    length = size - 1;
+    error = ERROR_MORE_DATA;
+  }
+  value.copy(buffer, length);
+  buffer[length] = CharT();
+  return length;
+}
+
+/**
+ * @brief copy section entries into the caller's buffer, the list is terminated by
+ *        a second null. Truncated like GetPrivateProfileSection, size must be at
+ *        least 2
+ * @return the number of characters copied, not including the final null
+ */
+template <typename CharT>
+DWORD copyProfileSection(const std::basic_string<CharT> &entries, CharT *buffer,
+                         DWORD size)
+{
+  DWORD length = static_cast<DWORD>(entries.size());
+  if (length > size - 2) {
+    length = size - 2;
+  }
+  entries.copy(buffer, length);
+  buffer[length] = CharT();
+  buffer[length + 1] = CharT();
+  return length;
+}
+
+}
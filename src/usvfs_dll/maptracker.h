@@ -2,13 +2,25 @@
 
 #include "windows_sane.h"
 
+#include <atomic>
+#include <cstring>
+#include <cwctype>
+#include <memory>
 #include <string>
 #include <shared_mutex>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include "hookcontext.h"
 #include "hookcallcontext.h"
+#include "foldednameset.h"
+#include "pathnormalizer.h"
+#include "pathpool.h"
 #include "stringcast_basic.h"
+#include <winapi.h>
+#include <etwprovider.h>
+#include <ntdll_declarations.h>
 
 namespace usvfs {
 
@@ -44,88 +56,495 @@ static inline bool pathDirectlyAvailable(LPCWSTR pathName)
   return attrib == INVALID_FILE_ATTRIBUTES && GetLastError() == ERROR_FILE_NOT_FOUND;
 }
 
+// process-local map from path to path. Paths compare case-insensitively like the
+// file system does. Entries are spread over independently locked stripes by the
+// hash of the folded path and lookups take the path as pointer and length so
+// no temporary key is built. While the map is empty, which is the normal state
+// of the delete tracker, no lock is taken at all. The paths themselves are kept
+// in the PathPool so trackers and handle maps share them
 class MapTracker {
 public:
-  std::wstring lookup(const std::wstring& fromPath) const {
-    if (!fromPath.empty())
+  bool empty() const {
+    return m_size.load(std::memory_order_acquire) == 0;
+  }
+
+  std::wstring lookup(const wchar_t* fromPath, size_t length) const {
+    std::wstring result;
+    if ((length != 0) && !empty())
     {
-      std::shared_lock<std::shared_mutex> lock(m_mutex);
-      auto find = m_map.find(fromPath);
-      if (find != m_map.end())
-        return find->second;
+      size_t hash = hashPath(fromPath, length);
+      const Stripe& s = stripe(hash);
+      std::shared_lock<std::shared_mutex> lock(s.mutex);
+      auto find = s.find(hash, fromPath, length);
+      if (find != s.map.end())
+        result = find->second.toPath.str();
     }
-    return std::wstring();
+    return result;
   }
 
-  bool contains(const std::wstring& fromPath) const {
-    if (!fromPath.empty())
+  std::wstring lookup(const std::wstring& fromPath) const {
+    return lookup(fromPath.c_str(), fromPath.size());
+  }
+
+  bool contains(const wchar_t* fromPath, size_t length) const {
+    if ((length != 0) && !empty())
     {
-      std::shared_lock<std::shared_mutex> lock(m_mutex);
-      auto find = m_map.find(fromPath);
-      if (find != m_map.end())
-        return true;
+      size_t hash = hashPath(fromPath, length);
+      const Stripe& s = stripe(hash);
+      std::shared_lock<std::shared_mutex> lock(s.mutex);
+      return s.find(hash, fromPath, length) != s.map.end();
     }
     return false;
   }
 
+  bool contains(const std::wstring& fromPath) const {
+    return contains(fromPath.c_str(), fromPath.size());
+  }
+
   void insert(const std::wstring& fromPath, const std::wstring& toPath) {
     if (fromPath.empty())
       return;
-    std::unique_lock<std::shared_mutex> lock(m_mutex);
-    m_map[fromPath] = toPath;
+    PathPool::Ref from = PathPool::instance().intern(fromPath);
+    PathPool::Ref to = PathPool::instance().intern(toPath);
+    size_t hash = from.hash();
+    Stripe& s = stripe(hash);
+    std::unique_lock<std::shared_mutex> lock(s.mutex);
+    auto find = s.find(hash, fromPath.c_str(), fromPath.size());
+    if (find != s.map.end()) {
+      find->second.toPath = std::move(to);
+    } else {
+      s.map.emplace(hash, Entry{ std::move(from), std::move(to) });
+      m_size.fetch_add(1, std::memory_order_release);
+    }
   }
 
   bool erase(const std::wstring& fromPath)
   {
-    if (fromPath.empty())
+    if (fromPath.empty() || empty())
       return false;
-    std::unique_lock<std::shared_mutex> lock(m_mutex);
-    return m_map.erase(fromPath);
+    size_t hash = hashPath(fromPath.c_str(), fromPath.size());
+    Stripe& s = stripe(hash);
+    std::unique_lock<std::shared_mutex> lock(s.mutex);
+    auto find = s.find(hash, fromPath.c_str(), fromPath.size());
+    if (find == s.map.end())
+      return false;
+    s.map.erase(find);
+    m_size.fetch_sub(1, std::memory_order_release);
+    return true;
+  }
+
+  void clear()
+  {
+    if (empty())
+      return;
+    for (Stripe& s : m_stripes) {
+      std::unique_lock<std::shared_mutex> lock(s.mutex);
+      m_size.fetch_sub(s.map.size(), std::memory_order_release);
+      s.map.clear();
+    }
   }
 
 private:
-  mutable std::shared_mutex m_mutex;
-  std::unordered_map<std::wstring, std::wstring> m_map;
+  static constexpr size_t STRIPE_COUNT = 16;
+
+  struct Entry {
+    PathPool::Ref fromPath;
+    PathPool::Ref toPath;
+  };
+
+  // the key already is the hash
+  struct IdentityHash {
+    size_t operator()(size_t hash) const { return hash; }
+  };
+
+  typedef std::unordered_multimap<size_t, Entry, IdentityHash> MapT;
+
+  struct alignas(64) Stripe {
+    mutable std::shared_mutex mutex;
+    MapT map;
+
+    MapT::iterator find(size_t hash, const wchar_t* path, size_t length) {
+      auto range = map.equal_range(hash);
+      for (auto iter = range.first; iter != range.second; ++iter) {
+        if (iter->second.fromPath.foldedEquals(path, length))
+          return iter;
+      }
+      return map.end();
+    }
+
+    MapT::const_iterator find(size_t hash, const wchar_t* path, size_t length) const {
+      return const_cast<Stripe*>(this)->find(hash, path, length);
+    }
+  };
+
+  // the low bits select the bucket inside the stripe, so pick stripes by the high
+  // bits to keep buckets usable
+  Stripe& stripe(size_t hash) {
+    return m_stripes[(hash >> 16) % STRIPE_COUNT];
+  }
+
+  const Stripe& stripe(size_t hash) const {
+    return m_stripes[(hash >> 16) % STRIPE_COUNT];
+  }
+
+  static size_t hashPath(const wchar_t* path, size_t length) {
+    return foldedHash(path, length);
+  }
+
+  Stripe m_stripes[STRIPE_COUNT];
+  std::atomic<size_t> m_size{0};
 };
 
 extern MapTracker k32DeleteTracker;
 extern MapTracker k32FakeDirTracker;
+// real directories known to exist, so creating files below create targets doesn't
+// have to check the parent directories every time. Cleared whenever a directory
+// is removed or moved through the hooks
+extern MapTracker k32KnownDirTracker;
+// virtual directories found not to exist on disk, so searches in them can go to the
+// reroute target right away instead of starting with a real search that is bound to
+// fail. Cleared whenever a real directory is created through the hooks
+extern MapTracker k32VirtualDirTracker;
+
+// process-local map keyed by handle, split into independently locked shards so
+// unrelated handles never contend. Checking a handle that has no entry (which
+// is what nearly every NtClose does) takes no lock at all while the map is empty
+// and a single shard lock otherwise
+template <typename ValueT, size_t SHARD_COUNT = 16>
+class ShardedHandleMap {
+public:
+  bool empty() const {
+    return m_size.load(std::memory_order_acquire) == 0;
+  }
+
+  bool find(HANDLE handle, ValueT& value) const {
+    if (empty())
+      return false;
+    const Shard& s = shard(handle);
+    std::shared_lock<std::shared_mutex> lock(s.mutex);
+    auto find = s.map.find(handle);
+    if (find == s.map.end())
+      return false;
+    value = find->second;
+    return true;
+  }
+
+  void insert(HANDLE handle, const ValueT& value) {
+    Shard& s = shard(handle);
+    std::unique_lock<std::shared_mutex> lock(s.mutex);
+    auto res = s.map.emplace(handle, value);
+    if (res.second)
+      m_size.fetch_add(1, std::memory_order_release);
+    else
+      res.first->second = value;
+  }
+
+  // removes the entry for the handle, moving its value to removed if requested
+  bool erase(HANDLE handle, ValueT* removed = nullptr)
+  {
+    if (empty())
+      return false;
+    Shard& s = shard(handle);
+    std::unique_lock<std::shared_mutex> lock(s.mutex);
+    auto find = s.map.find(handle);
+    if (find == s.map.end())
+      return false;
+    if (removed != nullptr)
+      *removed = std::move(find->second);
+    s.map.erase(find);
+    m_size.fetch_sub(1, std::memory_order_release);
+    return true;
+  }
+
+private:
+  struct alignas(64) Shard {
+    mutable std::shared_mutex mutex;
+    std::unordered_map<HANDLE, ValueT> map;
+  };
+
+  // kernel handles are multiples of 4 so the low bits carry no information
+  Shard& shard(HANDLE handle) {
+    return m_shards[(reinterpret_cast<uintptr_t>(handle) >> 2) % SHARD_COUNT];
+  }
+
+  const Shard& shard(HANDLE handle) const {
+    return m_shards[(reinterpret_cast<uintptr_t>(handle) >> 2) % SHARD_COUNT];
+  }
+
+  Shard m_shards[SHARD_COUNT];
+  std::atomic<size_t> m_size{0};
+};
+
+// process-local cache of redirection table lookups. Entries are only valid for the
+// tree generation they were recorded with. Like ShardedHandleMap the entries are
+// spread over shards with their own locks, keyed by the folded hash of the path.
+// Each shard has a fixed number of slots and a new entry only replaces the one in
+// its slot, so the cache never has to be dropped as a whole
+class RerouteCache {
+public:
+  static const size_t MAX_ENTRIES = 8192;
+
+  bool lookup(const wchar_t* fromPath, size_t length, long generation, bool& rerouted,
+              std::wstring& toPath) const {
+    uint32_t hash = shared::foldedHash(fromPath, length);
+    const Shard& s = m_shards[hash % SHARD_COUNT];
+    std::shared_lock<std::shared_mutex> lock(s.mutex);
+    if (s.slots.empty())
+      return false;
+    const Slot& slot = s.slots[(hash / SHARD_COUNT) % SLOTS_PER_SHARD];
+    if ((slot.generation != generation) || (slot.hash != hash)
+        || (slot.fromPath.size() != length)
+        || !shared::foldedEquals(slot.fromPath.c_str(), fromPath, length))
+      return false;
+    rerouted = slot.rerouted;
+    toPath = slot.toPath;
+    return true;
+  }
+
+  void insert(const wchar_t* fromPath, size_t length, long generation, bool rerouted,
+              const wchar_t* toPath = nullptr) {
+    if (length == 0)
+      return;
+    uint32_t hash = shared::foldedHash(fromPath, length);
+    Shard& s = m_shards[hash % SHARD_COUNT];
+    std::unique_lock<std::shared_mutex> lock(s.mutex);
+    if (s.slots.empty())
+      s.slots.resize(SLOTS_PER_SHARD);
+    // the strings keep their capacity, replacing an entry rarely allocates
+    Slot& slot = s.slots[(hash / SHARD_COUNT) % SLOTS_PER_SHARD];
+    slot.generation = generation;
+    slot.hash = hash;
+    slot.rerouted = rerouted;
+    slot.fromPath.assign(fromPath, length);
+    if (toPath != nullptr)
+      slot.toPath.assign(toPath);
+    else
+      slot.toPath.clear();
+  }
+
+private:
+  static const size_t SHARD_COUNT = 16;
+  static const size_t SLOTS_PER_SHARD = MAX_ENTRIES / SHARD_COUNT;
+
+  struct Slot {
+    long generation{ -1 };
+    uint32_t hash{ 0 };
+    bool rerouted{ false };
+    std::wstring fromPath;
+    std::wstring toPath;
+  };
+
+  // slots are allocated on first use so processes that never look anything up
+  // don't pay for them
+  struct alignas(64) Shard {
+    mutable std::shared_mutex mutex;
+    std::vector<Slot> slots;
+  };
+
+  Shard m_shards[SHARD_COUNT];
+};
+
+extern RerouteCache rerouteCache;
+
+// process-local cache of the virtual paths GetModuleFileName reports for modules.
+// Entries remember the real path of the module so a different module loaded at the
+// same address after an unload isn't mistaken for the old one, and they are only
+// valid for the inverse table generation they were recorded with
+class ModulePathCache {
+public:
+  static const size_t MAX_ENTRIES = 1024;
+
+  bool lookup(HMODULE module, long generation, const wchar_t* realPath, size_t length,
+              bool& rerouted, std::wstring& virtualPath) const {
+    std::shared_lock<std::shared_mutex> lock(m_mutex);
+    if ((generation == -1) || (generation != m_generation))
+      return false;
+    auto find = m_map.find(module);
+    if ((find == m_map.end())
+        || (find->second.realPath.compare(0, std::wstring::npos, realPath, length) != 0))
+      return false;
+    rerouted = find->second.rerouted;
+    virtualPath = find->second.virtualPath;
+    return true;
+  }
+
+  void insert(HMODULE module, long generation, const wchar_t* realPath, size_t length,
+              bool rerouted, const std::wstring& virtualPath) {
+    if (generation == -1)
+      return;
+    std::unique_lock<std::shared_mutex> lock(m_mutex);
+    if ((generation != m_generation) || (m_map.size() >= MAX_ENTRIES)) {
+      m_map.clear();
+      m_generation = generation;
+    }
+    m_map[module] = Entry{ std::wstring(realPath, length), rerouted, virtualPath };
+  }
+
+private:
+  struct Entry {
+    std::wstring realPath;
+    bool rerouted;
+    std::wstring virtualPath;
+  };
+
+  mutable std::shared_mutex m_mutex;
+  long m_generation{ -1 };
+  std::unordered_map<HMODULE, Entry> m_map;
+};
+
+extern ModulePathCache modulePathCache;
+
+// process-local cache of the attributes NtQuery(Full)AttributesFile reports for
+// rerouted files, keyed by the folded nt path the query was rerouted to. Mapped
+// directories are expected not to be changed from outside the vfs, changes from
+// inside this process are noticed when a file is opened for modification. Such
+// files are never cached again since their handles may still be in use
+class AttributeCache {
+public:
+  static const size_t MAX_ENTRIES = 8192;
+
+  void setEnabled(bool enabled) { m_enabled = enabled; }
+  bool enabled() const { return m_enabled; }
+
+  bool lookup(const std::wstring& path, FILE_NETWORK_OPEN_INFORMATION& info) const {
+    std::shared_lock<std::shared_mutex> lock(m_mutex);
+    auto find = m_map.find(path);
+    if (find == m_map.end())
+      return false;
+    info = find->second;
+    return true;
+  }
+
+  void insert(const std::wstring& path, const FILE_NETWORK_OPEN_INFORMATION& info) {
+    if (path.empty())
+      return;
+    std::unique_lock<std::shared_mutex> lock(m_mutex);
+    if (m_modified.find(path) != m_modified.end())
+      return;
+    if (m_map.size() >= MAX_ENTRIES)
+      m_map.clear();
+    m_map[path] = info;
+  }
+
+  // a file is about to be written, deleted or renamed. A rename can also replace
+  // the file at its destination so all entries are dropped then
+  void markModified(const std::wstring& path, bool renameOrDelete) {
+    std::unique_lock<std::shared_mutex> lock(m_mutex);
+    if (m_modified.size() >= MAX_ENTRIES) {
+      // start over rather than grow without bound. Files still being written
+      // through old handles may be cached again, like after a restart
+      m_modified.clear();
+      m_map.clear();
+    }
+    m_modified.insert(path);
+    if (renameOrDelete)
+      m_map.clear();
+    else
+      m_map.erase(path);
+  }
+
+private:
+  std::atomic<bool> m_enabled{ false };
+  mutable std::shared_mutex m_mutex;
+  std::unordered_map<std::wstring, FILE_NETWORK_OPEN_INFORMATION> m_map;
+  std::unordered_set<std::wstring> m_modified;
+};
+
+extern AttributeCache attributeCache;
+
+// a path with room for MAX_PATH characters inline, longer ones are stored on the
+// heap. One of these is filled for nearly every hooked call so the common case
+// must not allocate
+class PathBuffer
+{
+public:
+  PathBuffer() { m_Inline[0] = L'\0'; }
+
+  PathBuffer(PathBuffer &&reference) { *this = std::move(reference); }
+
+  PathBuffer &operator=(PathBuffer &&reference)
+  {
+    if (reference.m_Heap) {
+      m_Heap = std::move(reference.m_Heap);
+      m_Size = reference.m_Size;
+    } else {
+      assign(reference.m_Inline, reference.m_Size);
+    }
+    reference.clear();
+    return *this;
+  }
+
+  PathBuffer(const PathBuffer &) = delete;
+  PathBuffer &operator=(const PathBuffer &) = delete;
+
+  void assign(const wchar_t *path, size_t length)
+  {
+    wchar_t *target = m_Inline;
+    if (length >= INLINE_SIZE) {
+      m_Heap.reset(new wchar_t[length + 1]);
+      target = m_Heap.get();
+    } else {
+      m_Heap.reset();
+    }
+    memcpy(target, path, length * sizeof(wchar_t));
+    target[length] = L'\0';
+    m_Size = length;
+  }
+
+  void clear()
+  {
+    m_Heap.reset();
+    m_Inline[0] = L'\0';
+    m_Size = 0;
+  }
+
+  const wchar_t *c_str() const { return m_Heap ? m_Heap.get() : m_Inline; }
+  size_t size() const { return m_Size; }
+  bool empty() const { return m_Size == 0; }
+  std::wstring str() const { return std::wstring(c_str(), m_Size); }
+
+private:
+  static const size_t INLINE_SIZE = MAX_PATH;
+
+  wchar_t m_Inline[INLINE_SIZE];
+  std::unique_ptr<wchar_t[]> m_Heap;
+  size_t m_Size{0};
+};
 
 class RerouteW
 {
+  // the rerouted path, empty if the name of the caller is used as it is
   std::wstring m_Buffer{};
-  std::wstring m_RealPath{};
+  PathBuffer m_RealPath{};
   bool m_Rerouted{false};
+  // either points into m_Buffer or borrows the string passed in by the caller
   LPCWSTR m_FileName{nullptr};
   bool m_PathCreated{false};
   bool m_NewReroute{false};
-
-  RedirectionTree::NodePtrT m_FileNode;
+  // whether the lookup already walked the tree for a create target and found one
+  bool m_CreateTargetChecked{false};
+  bool m_UnderCreateTarget{false};
 
 public:
   RerouteW() = default;
 
   RerouteW(RerouteW &&reference)
-    : m_Buffer(std::move(reference.m_Buffer))
-    , m_RealPath(std::move(reference.m_RealPath))
-    , m_Rerouted(reference.m_Rerouted)
-    , m_PathCreated(reference.m_PathCreated)
-    , m_NewReroute(reference.m_NewReroute)
-    , m_FileNode(std::move(reference.m_FileNode))
-  {
-    m_FileName = reference.m_FileName != nullptr ? m_Buffer.c_str() : nullptr;
-    reference.m_FileName = nullptr;
+  {
+    *this = std::move(reference);
   }
 
   RerouteW &operator=(RerouteW &&reference)
   {
+    bool owned = reference.ownsFileName();
     m_Buffer   = std::move(reference.m_Buffer);
     m_RealPath = std::move(reference.m_RealPath);
     m_Rerouted = reference.m_Rerouted;
     m_PathCreated = reference.m_PathCreated;
     m_NewReroute = reference.m_NewReroute;
-    m_FileName = reference.m_FileName != nullptr ? m_Buffer.c_str() : nullptr;
-    m_FileNode = std::move(reference.m_FileNode);
+    m_CreateTargetChecked = reference.m_CreateTargetChecked;
+    m_UnderCreateTarget = reference.m_UnderCreateTarget;
+    m_FileName = owned ? m_Buffer.c_str() : reference.m_FileName;
+    reference.m_FileName = nullptr;
     return *this;
   }
 
@@ -137,9 +556,16 @@ public:
     return m_FileName;
   }
 
-  const std::wstring &buffer() const
+  /**
+   * @brief copy the file name if it's borrowed from the caller, for callers that
+   *        modify or free the string they passed in while this is still in use
+   */
+  void ownFileName()
   {
-    return m_Buffer;
+    if ((m_FileName != nullptr) && !ownsFileName()) {
+      m_Buffer   = m_FileName;
+      m_FileName = m_Buffer.c_str();
+    }
   }
 
   bool wasRerouted() const
@@ -152,11 +578,21 @@ public:
     return m_NewReroute;
   }
 
+  /**
+   * @return true if the lookup established that the path is neither rerouted (which
+   *         includes deleted files) nor below a create target, so createNew wouldn't
+   *         reroute it either
+   */
+  bool outsideCreateTarget() const
+  {
+    return !m_Rerouted && m_CreateTargetChecked && !m_UnderCreateTarget;
+  }
+
   void insertMapping(const HookContext::Ptr &context, bool directory = false)
   {
     if (directory)
     {
-      addDirectoryMapping(context, m_RealPath, m_FileName);
+      addDirectoryMapping(context, fs::path(m_RealPath.c_str()), m_FileName);
 
       // In case we have just created a "fake" directory, it is no longer fake and need to remove it and all its
       // parent folders from the fake map:
@@ -170,17 +606,25 @@ public:
       //addDirectoryMapping(context, fs::path(m_RealPath).parent_path(), fs::path(m_FileName).parent_path());
 
       spdlog::get("hooks")->info("mapping file in vfs: {}, {}",
-        shared::string_cast<std::string>(m_RealPath, shared::CodePage::UTF8),
+        shared::string_cast<std::string>(m_RealPath.c_str(), shared::CodePage::UTF8),
         shared::string_cast<std::string>(m_FileName, shared::CodePage::UTF8));
-      m_FileNode =
-        context->redirectionTable().addFile(m_RealPath, RedirectionDataLocal(shared::string_cast<std::string>(m_FileName, shared::CodePage::UTF8)));
+      context->redirectionTable().addFile(fs::path(m_RealPath.c_str()), RedirectionDataLocal(shared::string_cast<std::string>(m_FileName, shared::CodePage::UTF8)));
 
-      k32DeleteTracker.erase(m_RealPath);
+      k32DeleteTracker.erase(m_RealPath.str());
     }
   }
 
-  void removeMapping(const HookContext::ConstPtr &readContext, bool directory = false)
+  /**
+   * @param keepNode if true the node was already taken care of (i.e. by moveMapping),
+   *        only the trackers are updated
+   */
+  void removeMapping(const HookContext::Ptr &context, bool directory = false, bool keepNode = false)
   {
+    if (directory) {
+      // the directory, or parents removed with it below, may be cached as existing
+      k32KnownDirTracker.clear();
+    }
+
     bool addToDelete = false;
     bool dontAddToDelete = false;
 
@@ -188,20 +632,17 @@ public:
     // a virtualized mapped folder on top of it). Since we don't want to add, *every* file which is deleted we check this:
     bool found = wasRerouted();
     if (!found) {
-      FindCreateTarget visitor;
-      RedirectionTree::VisitorFunction visitorWrapper =
-        [&](const RedirectionTree::NodePtrT &node) { visitor(node); };
-      readContext->redirectionTable()->visitPath(m_RealPath, visitorWrapper);
-      if (visitor.target.get())
-        found = true;
+      if (m_CreateTargetChecked)
+        found = m_UnderCreateTarget;
+      else
+        found = context->redirectionTable()->resolvePath(
+          m_RealPath.c_str(), m_RealPath.size(), shared::FLAG_CREATETARGET).flagged != nullptr;
     }
     if (found)
       addToDelete = true;
 
     if (wasRerouted()) {
-      if (m_FileNode.get())
-        m_FileNode->removeFromTree();
-      else
+      if (!keepNode && (m_RealPath.empty() || !context->redirectionTable().removeNode(fs::path(m_RealPath.c_str()))))
         spdlog::get("usvfs")->warn("Node not removed: {}", shared::string_cast<std::string>(m_FileName));
 
       if (!directory)
@@ -231,21 +672,80 @@ public:
       }
     }
     if (addToDelete && !dontAddToDelete) {
-      k32DeleteTracker.insert(m_RealPath, m_FileName);
+      k32DeleteTracker.insert(m_RealPath.str(), m_FileName);
     }
   }
 
+  /**
+   * @brief update the tree after the rerouted file or directory was moved on disk to
+   *        the new reroute of destination. The node is moved within the tree and the
+   *        link targets below it are rewritten, instead of removing the mapping and
+   *        mapping the moved directory again from disk
+   * @return false if the tree can't be updated this way, the caller has to remove and
+   *         insert the mapping then
+   */
+  bool moveMapping(const HookContext::Ptr &context, const RerouteW &destination, bool directory)
+  {
+    if (!wasRerouted() || !destination.newReroute() || m_RealPath.empty()
+        || destination.m_RealPath.empty())
+      return false;
+
+    const std::string sourceU8 = shared::string_cast<std::string>(m_FileName, shared::CodePage::UTF8);
+    const std::string destinationU8
+      = shared::string_cast<std::string>(destination.m_FileName, shared::CodePage::UTF8);
+
+    if (directory) {
+      // a directory merged from several sources was only moved on disk for one of them
+      auto node = context->redirectionTable()->findNode(fs::path(m_RealPath.c_str()));
+      if (!node.get() || !targetsBelow(*node, sourceU8))
+        return false;
+      // mapped directories need a mapped parent, addDirectoryMapping would have to add
+      // it from disk
+      auto parent = context->redirectionTable()->findNode(
+        fs::path(destination.m_RealPath.c_str()).parent_path());
+      if (!parent.get() || !parent->data().hasTarget())
+        return false;
+    }
+
+    auto moved = context->redirectionTable().moveNode(
+      fs::path(m_RealPath.c_str()), fs::path(destination.m_RealPath.c_str()),
+      [&](RedirectionData &data) {
+        if (data.hasTarget()) {
+          std::string target = data.target();
+          if (pathBelow(target, sourceU8))
+            data.setTarget((destinationU8 + target.substr(sourceU8.size())).c_str());
+        }
+      });
+    if (moved.get() == nullptr)
+      return false;
+
+    spdlog::get("hooks")->info("moved mapping in vfs: {} -> {}",
+      shared::string_cast<std::string>(m_RealPath.c_str(), shared::CodePage::UTF8),
+      shared::string_cast<std::string>(destination.m_RealPath.c_str(), shared::CodePage::UTF8));
+
+    removeMapping(context, directory, true);
+    if (!directory)
+      k32DeleteTracker.erase(destination.m_RealPath.str());
+    return true;
+  }
+
   static bool createFakePath(fs::path path, LPSECURITY_ATTRIBUTES securityAttributes)
   {
     // sanity and guaranteed recursion end:
     if (!path.has_relative_path())
       throw shared::windows_error("createFakePath() refusing to create non-existing top level path: " + path.string());
 
+    const std::wstring &pathW = path.native();
+    if (k32KnownDirTracker.contains(pathW))
+      return false;
+
     DWORD attr = GetFileAttributesW(path.c_str());
     DWORD err = GetLastError();
     if (attr != INVALID_FILE_ATTRIBUTES) {
-      if (attr & FILE_ATTRIBUTE_DIRECTORY)
+      if (attr & FILE_ATTRIBUTE_DIRECTORY) {
+        k32KnownDirTracker.insert(pathW, std::wstring());
         return false; // if directory already exists all is good
+      }
       else
         throw shared::windows_error("createFakePath() called on a file: " + path.string());
     }
@@ -256,8 +756,11 @@ public:
       createFakePath(path.parent_path(), securityAttributes); // otherwise create parent directory (recursively)
 
     BOOL res = CreateDirectoryW(path.c_str(), securityAttributes);
-    if (res)
+    if (res) {
       k32FakeDirTracker.insert(path.wstring(), std::wstring());
+      k32KnownDirTracker.insert(path.wstring(), std::wstring());
+      k32VirtualDirTracker.clear();
+    }
     else {
       err = GetLastError();
       throw shared::windows_error("createFakePath() CreateDirectoryW failed on: " + path.string(), err);
@@ -265,6 +768,26 @@ public:
     return true;
   }
 
+  // true if path is root or below it
+  static bool pathBelow(const std::string &path, const std::string &root)
+  {
+    return (path.size() >= root.size())
+      && shared::foldedEquals(path.c_str(), root.c_str(), root.size())
+      && ((path.size() == root.size()) || (path[root.size()] == '\\')
+          || (path[root.size()] == '/') || root.empty() || (root.back() == '\\'));
+  }
+
+  // true if the targets of node and all nodes below it are below root
+  static bool targetsBelow(const RedirectionTree &node, const std::string &root)
+  {
+    if (node.data().hasTarget() && !pathBelow(node.data().target(), root))
+      return false;
+    for (auto iter = node.filesBegin(); iter != node.filesEnd(); ++iter)
+      if (!targetsBelow(*iter->second, root))
+        return false;
+    return true;
+  }
+
   static bool addDirectoryMapping(const HookContext::Ptr &context, const fs::path& originalPath, const fs::path& reroutedPath)
   {
     if (originalPath.empty() || reroutedPath.empty()) {
@@ -275,7 +798,7 @@ public:
     }
 
     auto lookupParent = context->redirectionTable()->findNode(originalPath.parent_path());
-    if (!lookupParent.get() || lookupParent->data().linkTarget.empty()) {
+    if (!lookupParent.get() || !lookupParent->data().hasTarget()) {
       if (!addDirectoryMapping(context, originalPath.parent_path(), reroutedPath.parent_path()))
       {
         spdlog::get("hooks")->error("RerouteW::addDirectoryMapping failed: {}, {}",
@@ -331,9 +854,45 @@ public:
       && ((inPath[2] == 'd' || inPath[2] == 'D'))
       && inPath[3] == '#')
       return false;
+    // ignore the console
+    if (equalsAscii(inPath, "CONIN$") || equalsAscii(inPath, "CONOUT$"))
+      return false;
     return true;
   }
 
+  // case insensitive comparison against an upper-case ascii string
+  template <class char_t>
+  static bool equalsAscii(const char_t *inPath, const char *upper)
+  {
+    for (; *upper != '\0'; ++inPath, ++upper) {
+      char_t ch = *inPath;
+      if ((ch >= 'a') && (ch <= 'z'))
+        ch -= 'a' - 'A';
+      if (ch != static_cast<char_t>(*upper))
+        return false;
+    }
+    return *inPath == 0;
+  }
+
+  /**
+   * @return the root bit (see PrefixFilter::rootBit) of the root inPath refers to
+   */
+  static uint32_t rootBit(const wchar_t *inPath)
+  {
+    wchar_t drive = pathDrive(inPath);
+    return drive != L'\0' ? 1U << (drive - L'A') : shared::PrefixFilter::OTHER_ROOT;
+  }
+
+  /**
+   * @return false if inPath can't be virtualized by the table because nothing is
+   *         mapped on its drive. Files deleted from the vfs are tracked separately,
+   *         as long as there are any every path needs to go through the lookup
+   */
+  static bool mayReroute(const RedirectionTreeContainer &table, const wchar_t *inPath)
+  {
+    return !k32DeleteTracker.empty() || table.mayContainRoot(rootBit(inPath));
+  }
+
   static bool interestingPath(const char* inPath) { return interestingPathImpl(inPath); }
   static bool interestingPath(const wchar_t* inPath) { return interestingPathImpl(inPath); }
 
@@ -371,62 +930,136 @@ public:
     return p.make_preferred();
   }
 
+  /**
+   * @brief the path inPath is looked up as in the redirection tree, the same as
+   *        canonizePath(absolutePath(inPath)) but without going through fs::path
+   *        for the common forms
+   */
+  static void lookupPath(const wchar_t *inPath, PathBuffer &result)
+  {
+    boost::wstring_view normalized;
+    if (normalizePath(inPath, normalized)) {
+      result.assign(normalized.data(), normalized.size());
+    } else {
+      std::wstring path = canonizePath(absolutePath(inPath)).wstring();
+      result.assign(path.c_str(), path.size());
+    }
+  }
+
+  static fs::path lookupPath(const wchar_t *inPath)
+  {
+    boost::wstring_view normalized;
+    if (normalizePath(inPath, normalized))
+      return fs::path(normalized.begin(), normalized.end());
+    return canonizePath(absolutePath(inPath));
+  }
+
   static RerouteW create(const HookContext::ConstPtr &context,
     const HookCallContext &callContext,
     const wchar_t *inPath, bool inverse = false)
   {
     RerouteW result;
 
-    if (interestingPath(inPath) && callContext.active())
+    const RedirectionTreeContainer &table
+      = inverse ? context->inverseTable() : context->redirectionTable();
+    if (interestingPath(inPath) && callContext.active() && !mayReroute(table, inPath))
+    {
+      // nothing mapped on that drive, so nothing to normalize or look up
+      if (!inverse)
+        result.setCreateTarget(false);
+      result.m_FileName = inPath;
+    }
+    else if (interestingPath(inPath) && callContext.active())
     {
-      const auto& lookupPath = canonizePath(absolutePath(inPath));
-      result.m_RealPath = lookupPath.wstring();
+      lookupPath(inPath, result.m_RealPath);
 
-      result.m_Buffer = k32DeleteTracker.lookup(result.m_RealPath);
+      result.m_Buffer = k32DeleteTracker.lookup(result.m_RealPath.c_str(), result.m_RealPath.size());
       bool found = !result.m_Buffer.empty();
       if (found) {
         spdlog::get("hooks")->info("Rerouting file open to location of deleted file: {}",
           shared::string_cast<std::string>(result.m_Buffer));
         result.m_NewReroute = true;
       } else {
-        const RedirectionTreeContainer &table
-          = inverse ? context->inverseTable() : context->redirectionTable();
-        result.m_FileNode = table->findNode(lookupPath);
+        // only misses are cached here since rerouted results need the node
+        long generation = table.generation();
+        bool cachedRerouted = false;
+        std::wstring cachedPath;
+        bool cachedMiss = !table.mayContain(result.m_RealPath.c_str(), result.m_RealPath.size())
+          || (!inverse
+              && rerouteCache.lookup(result.m_RealPath.c_str(), result.m_RealPath.size(),
+                                     generation, cachedRerouted, cachedPath)
+              && !cachedRerouted);
+        const RedirectionTree::NodePtrT *node = nullptr;
+        if (!cachedMiss) {
+          // the create target is looked up in the same walk so createNew and
+          // removeMapping don't have to walk again
+          auto resolution = table->resolvePath(result.m_RealPath.c_str(), result.m_RealPath.size(),
+                                               shared::FLAG_CREATETARGET);
+          node = resolution.node;
+          if (!inverse)
+            result.setCreateTarget(resolution.flagged != nullptr);
+        }
 
-        if (result.m_FileNode.get()
-          && (!result.m_FileNode->data().linkTarget.empty() || result.m_FileNode->isDirectory()))
+        if ((node != nullptr)
+          && ((*node)->data().hasTarget() || (*node)->isDirectory()))
         {
-          if (!result.m_FileNode->data().linkTarget.empty()) {
-            result.m_Buffer = shared::string_cast<std::wstring>(
-              result.m_FileNode->data().linkTarget.c_str(), shared::CodePage::UTF8);
+          if ((*node)->data().hasTarget()) {
+            result.m_Buffer = (*node)->data().wideTarget();
           }
           else
           {
-            result.m_Buffer = result.m_FileNode->path().wstring();
+            result.m_Buffer = widePath(**node);
           }
           found = true;
         }
+        else if (!inverse && !cachedMiss)
+          rerouteCache.insert(result.m_RealPath.c_str(), result.m_RealPath.size(), generation, false);
       }
-      if (found) {
-        result.m_Rerouted = true;
-
-        wchar_t inIt = inPath[wcslen(inPath) - 1];
-        std::wstring::iterator outIt = result.m_Buffer.end() - 1;
-        if ((*outIt == L'\\' || *outIt == L'/') && !(inIt == L'\\' || inIt == L'/'))
-          result.m_Buffer.erase(outIt);
-        std::replace(result.m_Buffer.begin(), result.m_Buffer.end(), L'/', L'\\');
-      }
-      else
-        result.m_Buffer = inPath;
+      result.setRerouted(inPath, found);
     }
-    else if (inPath)
-      result.m_Buffer = inPath;
+    else
+      result.m_FileName = inPath;
 
-    if (inPath)
-      result.m_FileName = result.m_Buffer.c_str();
+    callContext.tracePath(inPath);
+    shared::etw::reroute(inPath, result.fileName(), result.wasRerouted());
+    callContext.markRedirected(result.wasRerouted());
     return result;
   }
 
+  /**
+   * like create above but answers from the published frozen redirection table
+   * without locking the context if possible
+   */
+  static RerouteW create(const HookCallContext &callContext, const wchar_t *inPath,
+                         bool inverse = false)
+  {
+    if (!inverse && HookContext::snapshotPublished()
+        && interestingPath(inPath) && callContext.active())
+    {
+      RerouteW result;
+      lookupPath(inPath, result.m_RealPath);
+      // deleted files take precedence over the tree, leave them to the regular path
+      if (!k32DeleteTracker.contains(result.m_RealPath.c_str(), result.m_RealPath.size())) {
+        bool rerouted = false;
+        if (HookContext::snapshotLookup(result.m_RealPath.c_str(), result.m_RealPath.size(),
+                                        rerouted, result.m_Buffer)) {
+          // there is no node to keep here, removeMapping looks it up when needed
+          result.setRerouted(inPath, rerouted);
+          callContext.tracePath(inPath);
+          shared::etw::reroute(inPath, result.fileName(), rerouted);
+          callContext.markRedirected(rerouted);
+          return result;
+        }
+      }
+    }
+    auto context = HookContext::readAccess(__MYFUNC__);
+    if (HookContext::snapshotPublished()) {
+      // opens the current snapshot in this process for the next lookup
+      context->redirectionSnapshot();
+    }
+    return create(context, callContext, inPath, inverse);
+  }
+
   static RerouteW createNew(const HookContext::ConstPtr &context,
     const HookCallContext &callContext,
     LPCWSTR inPath, bool createPath = true,
@@ -434,29 +1067,31 @@ public:
   {
     RerouteW result;
 
-    if (interestingPath(inPath) && callContext.active())
+    if (interestingPath(inPath) && callContext.active()
+        && mayReroute(context->redirectionTable(), inPath))
     {
-      const auto& lookupPath = canonizePath(absolutePath(inPath));
-      result.m_RealPath = lookupPath.wstring();
+      lookupPath(inPath, result.m_RealPath);
 
-      result.m_Buffer = k32DeleteTracker.lookup(result.m_RealPath);
+      result.m_Buffer = k32DeleteTracker.lookup(result.m_RealPath.c_str(), result.m_RealPath.size());
       bool found = !result.m_Buffer.empty();
       if (found)
         spdlog::get("hooks")->info("Rerouting file creation to original location of deleted file: {}",
           shared::string_cast<std::string>(result.m_Buffer));
       else
       {
-        FindCreateTarget visitor;
-        RedirectionTree::VisitorFunction visitorWrapper =
-          [&](const RedirectionTree::NodePtrT &node) { visitor(node); };
-        context->redirectionTable()->visitPath(lookupPath, visitorWrapper);
-        if (visitor.target.get()) {
-          // the visitor has found the last (deepest in the directory hierarchy)
-          // create-target
-          fs::path relativePath
-            = shared::make_relative(visitor.target->path(), lookupPath);
-          result.m_Buffer =
-            (fs::path(visitor.target->data().linkTarget.c_str()) / relativePath).wstring();
+        auto resolution = context->redirectionTable()->resolvePath(
+          result.m_RealPath.c_str(), result.m_RealPath.size(), shared::FLAG_CREATETARGET);
+        result.setCreateTarget(resolution.flagged != nullptr);
+        if (resolution.flagged != nullptr) {
+          // the last (deepest in the directory hierarchy) create-target, the rest
+          // of the path is appended to its target
+          result.m_Buffer = resolution.flagged->data().wideTarget();
+          if (resolution.remainderLength > 0) {
+            wchar_t last = result.m_Buffer.empty() ? L'\0' : result.m_Buffer.back();
+            if ((last != L'\\') && (last != L'/'))
+              result.m_Buffer.push_back(L'\\');
+            result.m_Buffer.append(resolution.remainder, resolution.remainderLength);
+          }
           found = true;
         }
       }
@@ -482,15 +1117,75 @@ public:
         std::replace(result.m_Buffer.begin(), result.m_Buffer.end(), L'/', L'\\');
         result.m_Rerouted = true;
         result.m_NewReroute = true;
+        result.m_FileName = result.m_Buffer.c_str();
       }
       else
-        result.m_Buffer = inPath;
+        result.m_FileName = inPath;
     }
-    else if (inPath)
-      result.m_Buffer = inPath;
+    else
+      result.m_FileName = inPath;
 
-    if (inPath)
-      result.m_FileName = result.m_Buffer.c_str();
+    callContext.tracePath(inPath);
+    shared::etw::reroute(inPath, result.fileName(), result.wasRerouted());
+    callContext.markRedirected(result.wasRerouted());
+    return result;
+  }
+
+  /**
+   * @brief copy-on-write: if inPath is mapped to a file outside of its create target,
+   *        copy that file into the create target and map inPath to the copy. Done
+   *        before the file is opened for writing so the original stays unchanged
+   * @param inPath the path the caller asked for
+   * @param reroutedPath the path inPath is currently mapped to
+   * @return the reroute to the copy, not rerouted if nothing was copied
+   */
+  static RerouteW copyOnWrite(const HookCallContext &callContext, LPCWSTR inPath,
+                              LPCWSTR reroutedPath)
+  {
+    if ((wcsncmp(reroutedPath, LR"(\??\)", 4) == 0) || (wcsncmp(reroutedPath, LR"(\\?\)", 4) == 0))
+      reroutedPath += 4;
+
+    RerouteW result;
+    {
+      auto context = READ_CONTEXT();
+      if (!context->copyOnWrite())
+        return noReroute(inPath);
+      result = createNew(context, callContext, inPath, true);
+    }
+    // already writing to the create target
+    if (!result.wasRerouted() || (_wcsicmp(result.fileName(), reroutedPath) == 0))
+      return noReroute(inPath);
+
+    {
+      FunctionGroupLock lock(MutExHookGroup::ALL_GROUPS);
+      DWORD attributes = GetFileAttributesW(reroutedPath);
+      if ((attributes == INVALID_FILE_ATTRIBUTES) || ((attributes & FILE_ATTRIBUTE_DIRECTORY) != 0))
+        return noReroute(inPath);
+      if (winapi::ex::wide::cloneFile(reroutedPath, result.fileName())) {
+        spdlog::get("hooks")->info("copied on write: {} -> {}",
+          shared::string_cast<std::string>(reroutedPath, shared::CodePage::UTF8),
+          shared::string_cast<std::string>(result.fileName(), shared::CodePage::UTF8));
+      } else {
+        DWORD error = GetLastError();
+        // a concurrent write-open made the copy first or an earlier session left one
+        // in the create target, either is the copy to use
+        DWORD existing = GetFileAttributesW(result.fileName());
+        if ((error != ERROR_FILE_EXISTS) || (existing == INVALID_FILE_ATTRIBUTES)
+            || ((existing & FILE_ATTRIBUTE_DIRECTORY) != 0)) {
+          spdlog::get("hooks")->warn("copy on write failed, writing to the original: {} -> {}, error={}",
+            shared::string_cast<std::string>(reroutedPath, shared::CodePage::UTF8),
+            shared::string_cast<std::string>(result.fileName(), shared::CodePage::UTF8), error);
+          return noReroute(inPath);
+        }
+        spdlog::get("hooks")->info("copy on write found an existing copy: {}",
+          shared::string_cast<std::string>(result.fileName(), shared::CodePage::UTF8));
+      }
+    }
+
+    // the copy is identical so it can be mapped before the caller's open succeeds.
+    // Racing callers all map the same copy
+    result.insertMapping(WRITE_CONTEXT());
+    result.m_NewReroute = false;
     return result;
   }
 
@@ -517,15 +1212,35 @@ public:
   }
 
 private:
-  struct FindCreateTarget {
-    RedirectionTree::NodePtrT target;
-    void operator()(RedirectionTree::NodePtrT node)
-    {
-      if (node->hasFlag(shared::FLAG_CREATETARGET)) {
-        target = node;
-      }
+  bool ownsFileName() const
+  {
+    return m_FileName == m_Buffer.c_str();
+  }
+
+  void setRerouted(const wchar_t *inPath, bool found)
+  {
+    if (found) {
+      m_Rerouted = true;
+
+      wchar_t inIt = inPath[wcslen(inPath) - 1];
+      std::wstring::iterator outIt = m_Buffer.end() - 1;
+      if ((*outIt == L'\\' || *outIt == L'/') && !(inIt == L'\\' || inIt == L'/'))
+        m_Buffer.erase(outIt);
+      std::replace(m_Buffer.begin(), m_Buffer.end(), L'/', L'\\');
+      m_FileName = m_Buffer.c_str();
     }
-  };
+    else {
+      // nothing to change, borrow the name of the caller
+      m_Buffer.clear();
+      m_FileName = inPath;
+    }
+  }
+
+  void setCreateTarget(bool found)
+  {
+    m_CreateTargetChecked = true;
+    m_UnderCreateTarget = found;
+  }
 };
 
 class CreateRerouter {
@@ -586,7 +1301,9 @@ public:
 
     if (!m_isDir && !isFile && !m_reroute.wasRerouted() && (open == Open::create || open == Open::empty))
     {
-      m_reroute = RerouteW::createNew(context, callContext, lpFileName, true, lpSecurityAttributes);
+      // create already walked the tree, only try again if there is a create target
+      if (!m_reroute.outsideCreateTarget())
+        m_reroute = RerouteW::createNew(context, callContext, lpFileName, true, lpSecurityAttributes);
 
       bool newFile = !m_reroute.wasRerouted() && pathDirectlyAvailable(m_reroute.fileName());
       if (newFile && open == Open::empty)
@@ -636,6 +1353,20 @@ public:
   bool newReroute() const { return m_reroute.newReroute(); }
   bool wasRerouted() const { return m_reroute.wasRerouted(); }
   LPCWSTR fileName() const { return m_reroute.fileName(); }
+  const RerouteW &reroute() const { return m_reroute; }
+
+  /**
+   * @brief in copy-on-write mode, switch an existing mapped file to a copy in the
+   *        create target. See RerouteW::copyOnWrite
+   */
+  void copyOnWrite(const HookCallContext &callContext, LPCWSTR lpFileName)
+  {
+    if (m_isDir || !m_reroute.wasRerouted() || m_reroute.newReroute())
+      return;
+    RerouteW copy = RerouteW::copyOnWrite(callContext, lpFileName, m_reroute.fileName());
+    if (copy.wasRerouted())
+      m_reroute = std::move(copy);
+  }
 
   void insertMapping(const HookContext::Ptr &context, bool directory = false) { m_reroute.insertMapping(context, directory); }
 
@@ -0,0 +1,258 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "pathnormalizer.h"
+#include <windows_sane.h>
+#include <winternl.h>
+#include <cwchar>
+#include <cwctype>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace usvfs {
+
+namespace {
+
+// the current directory shared by all threads. Every change bumps the version,
+// threads keep a copy of the version they last saw so reading the directory
+// takes no lock unless it changed in between. The directory handle in the PEB
+// is recorded along with it to notice changes that didn't go through
+// SetCurrentDirectoryW (RtlSetCurrentDirectory_U called directly)
+std::mutex currentDirectoryMutex;
+std::wstring currentDirectory;
+HANDLE currentDirectoryHandle = nullptr;
+bool currentDirectoryValid = false;
+std::atomic<unsigned int> currentDirectoryVersion(1);
+
+struct LocalDirectory {
+  unsigned int version{0};
+  HANDLE handle{nullptr};
+  std::wstring path;
+};
+
+// the handle the current directory of the process is held open with, that is
+// CurrentDirectory.Handle of the process parameters which winternl.h doesn't
+// name. The new directory is opened before the old one is closed so every
+// change yields a different handle
+HANDLE pebDirectoryHandle()
+{
+  return NtCurrentTeb()->ProcessEnvironmentBlock->ProcessParameters->Reserved2[7];
+}
+
+bool isSeparator(wchar_t ch)
+{
+  return (ch == L'\\') || (ch == L'/');
+}
+
+bool isDriveLetter(wchar_t ch)
+{
+  return ((ch >= L'a') && (ch <= L'z')) || ((ch >= L'A') && (ch <= L'Z'));
+}
+
+// the current directory without a trailing separator (except for the root)
+std::wstring queryCurrentDirectory()
+{
+  std::wstring result;
+  DWORD size = ::GetCurrentDirectoryW(0, nullptr);
+  while (size > 0) {
+    result.resize(size);
+    DWORD written = ::GetCurrentDirectoryW(size, &result[0]);
+    if (written < size) {
+      result.resize(written);
+      break;
+    }
+    // the directory changed in between and became longer
+    size = written;
+  }
+  if ((result.size() > 3) && isSeparator(result.back())) {
+    result.pop_back();
+  }
+  return result;
+}
+
+const std::wstring &getCurrentDirectory()
+{
+  thread_local LocalDirectory local;
+  HANDLE handle = pebDirectoryHandle();
+  if ((local.version != currentDirectoryVersion.load(std::memory_order_acquire))
+      || (local.handle != handle)) {
+    std::lock_guard<std::mutex> lock(currentDirectoryMutex);
+    if (!currentDirectoryValid || (currentDirectoryHandle != handle)) {
+      currentDirectory       = queryCurrentDirectory();
+      currentDirectoryHandle = handle;
+      currentDirectoryValid  = true;
+      currentDirectoryVersion.fetch_add(1, std::memory_order_release);
+    }
+    local.path    = currentDirectory;
+    local.handle  = currentDirectoryHandle;
+    local.version = currentDirectoryVersion.load(std::memory_order_relaxed);
+  }
+  return local.path;
+}
+
+/**
+ * appends the components of path to buffer which already holds a drive root
+ * ("X:") and possibly further components. rootSize is the size of the part
+ * ".." components can't remove
+ */
+void appendComponents(std::vector<wchar_t> &buffer, size_t rootSize,
+                      const wchar_t *path)
+{
+  while (*path != L'\0') {
+    while (isSeparator(*path)) {
+      ++path;
+    }
+    const wchar_t *end = path;
+    while ((*end != L'\0') && !isSeparator(*end)) {
+      ++end;
+    }
+    size_t length = end - path;
+    if ((length == 2) && (path[0] == L'.') && (path[1] == L'.')) {
+      while ((buffer.size() > rootSize) && (buffer.back() != L'\\')) {
+        buffer.pop_back();
+      }
+      if (buffer.size() > rootSize) {
+        buffer.pop_back();
+      }
+    } else if ((length > 0) && !((length == 1) && (path[0] == L'.'))) {
+      buffer.push_back(L'\\');
+      buffer.insert(buffer.end(), path, end);
+    }
+    path = end;
+  }
+}
+
+}
+
+wchar_t pathDrive(const wchar_t *inPath)
+{
+  if ((inPath == nullptr) || (inPath[0] == L'\0')) {
+    return L'\0';
+  }
+  const wchar_t *drive = inPath;
+  if (isSeparator(inPath[0]) && isSeparator(inPath[1])) {
+    if (((inPath[2] == L'?') || (inPath[2] == L'.')) && isSeparator(inPath[3])) {
+      // \\?\X: or \\.\X:, anything else is a volume, device or unc path
+      drive = inPath + 4;
+    } else if ((_wcsnicmp(inPath + 2, L"localhost\\", 10) == 0) && (inPath[13] == L'$')) {
+      return isDriveLetter(inPath[12]) ? static_cast<wchar_t>(towupper(inPath[12])) : L'\0';
+    } else if ((_wcsnicmp(inPath + 2, L"127.0.0.1\\", 10) == 0) && (inPath[13] == L'$')) {
+      return isDriveLetter(inPath[12]) ? static_cast<wchar_t>(towupper(inPath[12])) : L'\0';
+    } else {
+      return L'\0';
+    }
+  } else if ((inPath[0] == L'\\') && (inPath[1] == L'?') && (inPath[2] == L'?')
+             && (inPath[3] == L'\\')) {
+    drive = inPath + 4;
+  } else if ((inPath[1] != L':') || !isDriveLetter(inPath[0])) {
+    // relative to the current directory or to its root
+    drive = getCurrentDirectory().c_str();
+  }
+  if (isDriveLetter(drive[0]) && (drive[1] == L':')) {
+    return static_cast<wchar_t>(towupper(drive[0]));
+  }
+  return L'\0';
+}
+
+bool normalizePath(const wchar_t *inPath, boost::wstring_view &result)
+{
+  thread_local std::vector<wchar_t> buffer;
+  buffer.clear();
+
+  if ((inPath == nullptr) || (inPath[0] == L'\0')) {
+    result = boost::wstring_view();
+    return true;
+  }
+
+  if (((inPath[0] == L'\\') && (inPath[1] == L'\\') && (inPath[2] == L'?')
+       && (inPath[3] == L'\\'))
+      || ((inPath[0] == L'\\') && (inPath[1] == L'?') && (inPath[2] == L'?')
+          && (inPath[3] == L'\\'))) {
+    // \\?\X: and \??\X:
+    inPath += 4;
+    if (!isDriveLetter(inPath[0]) || (inPath[1] != L':')) {
+      return false;
+    }
+  } else if (isSeparator(inPath[0]) && isSeparator(inPath[1])
+             && ((_wcsnicmp(inPath + 2, L"localhost", 9) == 0)
+                 || (wcsncmp(inPath + 2, L"127.0.0.1", 9) == 0))
+             && isSeparator(inPath[11]) && isDriveLetter(inPath[12])
+             && (inPath[13] == L'$')) {
+    // \\localhost\X$
+    buffer.push_back(static_cast<wchar_t>(towupper(inPath[12])));
+    buffer.push_back(L':');
+    appendComponents(buffer, 2, inPath + 14);
+  }
+
+  if (!buffer.empty()) {
+    // already resolved above
+  } else if (isDriveLetter(inPath[0]) && (inPath[1] == L':')) {
+    if (!isSeparator(inPath[2])) {
+      // relative to the current directory of that drive
+      return false;
+    }
+    buffer.push_back(inPath[0]);
+    buffer.push_back(L':');
+    appendComponents(buffer, 2, inPath + 2);
+  } else if (isSeparator(inPath[0]) && isSeparator(inPath[1])) {
+    // unc or device path
+    return false;
+  } else {
+    const std::wstring &cwd = getCurrentDirectory();
+    if ((cwd.size() < 2) || !isDriveLetter(cwd[0]) || (cwd[1] != L':')) {
+      // the current directory is a unc path
+      return false;
+    }
+    if (isSeparator(inPath[0])) {
+      // relative to the root of the current drive
+      buffer.insert(buffer.end(), cwd.begin(), cwd.begin() + 2);
+    } else {
+      buffer.insert(buffer.end(), cwd.begin(), cwd.end());
+      if (isSeparator(buffer.back())) {
+        buffer.pop_back();
+      }
+    }
+    appendComponents(buffer, 2, inPath);
+  }
+
+  if (buffer.size() == 2) {
+    // root of the drive
+    buffer.push_back(L'\\');
+  }
+  result = boost::wstring_view(buffer.data(), buffer.size());
+  return true;
+}
+
+void setCurrentDirectory(const std::wstring &directory)
+{
+  std::lock_guard<std::mutex> lock(currentDirectoryMutex);
+  currentDirectory = directory;
+  if ((currentDirectory.size() > 3) && isSeparator(currentDirectory.back())) {
+    currentDirectory.pop_back();
+  }
+  // called after the directory was set so this is the handle of the new one
+  currentDirectoryHandle = pebDirectoryHandle();
+  currentDirectoryValid  = true;
+  currentDirectoryVersion.fetch_add(1, std::memory_order_release);
+}
+
+}
@@ -0,0 +1,60 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <boost/utility/string_view.hpp>
+#include <string>
+
+namespace usvfs {
+
+/**
+ * @brief turn a path into the absolute form used to look it up in the redirection
+ *        tree, in a single pass and without allocating. The \\?\, \??\ and
+ *        \\localhost\C$ prefixes are stripped, relative paths are resolved against
+ *        the current directory, separators become backslashes and "." and ".."
+ *        components are resolved. Trailing separators are dropped except for the
+ *        root of a drive
+ * @param result receives the normalized path. It points into a thread-local
+ *        buffer and stays valid until the next call on the same thread
+ * @return false if the path isn't in a form handled here (UNC and device paths,
+ *         drive-relative paths), the caller has to fall back to GetFullPathName
+ */
+bool normalizePath(const wchar_t *inPath, boost::wstring_view &result);
+
+/**
+ * @brief determine the drive a path refers to without normalizing it. Relative and
+ *        rooted paths refer to the drive of the current directory
+ * @return the upper-case drive letter or L'\0' if the path isn't on a drive (UNC paths,
+ *         volume and device paths)
+ */
+wchar_t pathDrive(const wchar_t *inPath);
+
+/**
+ * @brief set the current directory relative paths are resolved against. This is
+ *        the virtual directory the process asked for, which may differ from the
+ *        directory actually set if it got rerouted. Has to be called after the
+ *        directory was set, it's queried again once the process changes it
+ *        without calling this
+ * @param directory the directory, already normalized
+ */
+void setCurrentDirectory(const std::wstring &directory);
+
+}
@@ -0,0 +1,272 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include "stringutils.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cwchar>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+
+namespace usvfs {
+
+/**
+ * @brief process-local pool of immutable path strings. Every distinct path is stored
+ *        once no matter how many trackers and handle maps refer to it, each entry
+ *        carries a process-unique id and its folded hash so holders can compare
+ *        paths by id and look them up case-insensitively without hashing again.
+ *        Entries are reference counted through Ref and freed with the last reference.
+ *        Paths are pooled case-sensitively, spellings that only differ in case are
+ *        separate entries with the same folded hash
+ */
+class PathPool {
+  struct Entry;
+
+public:
+  /**
+   * @brief counted reference to a pooled path. An empty reference stands for the
+   *        empty path
+   */
+  class Ref {
+    friend class PathPool;
+
+  public:
+    Ref() = default;
+
+    Ref(const Ref& reference) : m_Entry(reference.m_Entry) {
+      if (m_Entry != nullptr)
+        m_Entry->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    Ref(Ref&& reference) : m_Entry(reference.m_Entry) {
+      reference.m_Entry = nullptr;
+    }
+
+    Ref& operator=(const Ref& reference) {
+      Ref(reference).swap(*this);
+      return *this;
+    }
+
+    Ref& operator=(Ref&& reference) {
+      Ref(std::move(reference)).swap(*this);
+      return *this;
+    }
+
+    ~Ref() {
+      if (m_Entry != nullptr)
+        PathPool::release(m_Entry);
+    }
+
+    void swap(Ref& other) { std::swap(m_Entry, other.m_Entry); }
+
+    bool empty() const { return m_Entry == nullptr; }
+    explicit operator bool() const { return m_Entry != nullptr; }
+
+    const wchar_t* c_str() const { return m_Entry != nullptr ? m_Entry->text : L""; }
+    size_t size() const { return m_Entry != nullptr ? m_Entry->length : 0; }
+    std::wstring str() const { return std::wstring(c_str(), size()); }
+
+    /**
+     * @return id of the path, unique in the process while the path is pooled.
+     *         0 for the empty path
+     */
+    uint32_t id() const { return m_Entry != nullptr ? m_Entry->id : 0; }
+
+    /**
+     * @return shared::foldedHash of the path
+     */
+    uint32_t hash() const { return m_Entry != nullptr ? m_Entry->hash : 0; }
+
+    /**
+     * @return true if this is the same path, differing at most in case
+     */
+    bool foldedEquals(const wchar_t* path, size_t length) const {
+      return (size() == length) && shared::foldedEquals(c_str(), path, length);
+    }
+
+    // a path is pooled only once so equal paths are the same entry
+    bool operator==(const Ref& other) const { return m_Entry == other.m_Entry; }
+    bool operator!=(const Ref& other) const { return m_Entry != other.m_Entry; }
+
+  private:
+    explicit Ref(Entry* entry) : m_Entry(entry) {}
+
+    Entry* m_Entry{nullptr};
+  };
+
+public:
+  PathPool() = default;
+  PathPool(const PathPool&) = delete;
+  PathPool& operator=(const PathPool&) = delete;
+
+  /**
+   * @brief all references have to be released before the pool is destroyed
+   */
+  ~PathPool() {
+    for (Stripe& s : m_stripes) {
+      for (auto& iter : s.map)
+        destroy(iter.second);
+    }
+  }
+
+  /**
+   * @brief the pool shared by all trackers of the process
+   * @note this is never destroyed so global trackers can release their references
+   *       during shutdown in any order
+   */
+  static PathPool& instance() {
+    static PathPool* pool = new PathPool();
+    return *pool;
+  }
+
+  Ref intern(const wchar_t* path, size_t length) {
+    if ((path == nullptr) || (length == 0))
+      return Ref();
+    uint32_t hash = shared::foldedHash(path, length);
+    Stripe& s = stripe(hash);
+    {
+      std::shared_lock<std::shared_mutex> lock(s.mutex);
+      Entry* entry = s.find(hash, path, length);
+      if (entry != nullptr)
+        return acquire(entry);
+    }
+    std::unique_lock<std::shared_mutex> lock(s.mutex);
+    Entry* entry = s.find(hash, path, length);
+    if (entry != nullptr)
+      return acquire(entry);
+    entry = create(hash, path, length);
+    s.map.emplace(hash, entry);
+    m_size.fetch_add(1, std::memory_order_relaxed);
+    return Ref(entry);
+  }
+
+  Ref intern(const wchar_t* path) {
+    return intern(path, path != nullptr ? wcslen(path) : 0);
+  }
+
+  Ref intern(const std::wstring& path) {
+    return intern(path.c_str(), path.size());
+  }
+
+  /**
+   * @return number of distinct paths currently pooled
+   */
+  size_t size() const { return m_size.load(std::memory_order_relaxed); }
+
+private:
+  static constexpr size_t STRIPE_COUNT = 16;
+
+  struct Entry {
+    PathPool* pool;
+    std::atomic<long> refs;
+    uint32_t id;
+    uint32_t hash;
+    size_t length;
+    wchar_t text[1];
+  };
+
+  struct IdentityHash {
+    size_t operator()(uint32_t hash) const { return hash; }
+  };
+
+  typedef std::unordered_multimap<uint32_t, Entry*, IdentityHash> MapT;
+
+  struct alignas(64) Stripe {
+    mutable std::shared_mutex mutex;
+    MapT map;
+
+    Entry* find(uint32_t hash, const wchar_t* path, size_t length) const {
+      auto range = map.equal_range(hash);
+      for (auto iter = range.first; iter != range.second; ++iter) {
+        Entry* entry = iter->second;
+        if ((entry->length == length) && (wmemcmp(entry->text, path, length) == 0))
+          return entry;
+      }
+      return nullptr;
+    }
+  };
+
+  Stripe& stripe(uint32_t hash) {
+    return m_stripes[(hash >> 16) % STRIPE_COUNT];
+  }
+
+  Entry* create(uint32_t hash, const wchar_t* path, size_t length) {
+    void* memory = ::operator new(offsetof(Entry, text) + (length + 1) * sizeof(wchar_t));
+    Entry* entry = new (memory) Entry;
+    entry->pool = this;
+    entry->refs.store(1, std::memory_order_relaxed);
+    entry->id = m_nextId.fetch_add(1, std::memory_order_relaxed);
+    entry->hash = hash;
+    entry->length = length;
+    wmemcpy(entry->text, path, length);
+    entry->text[length] = L'\0';
+    return entry;
+  }
+
+  static void destroy(Entry* entry) {
+    entry->~Entry();
+    ::operator delete(entry);
+  }
+
+  // only called with the stripe lock held, that keeps the entry from being removed
+  static Ref acquire(Entry* entry) {
+    entry->refs.fetch_add(1, std::memory_order_relaxed);
+    return Ref(entry);
+  }
+
+  static void release(Entry* entry) {
+    // once the count drops to 0 another thread may revive and release the entry
+    // again, so everything needed for the removal is read up front and the entry is
+    // looked up again under the lock before it's freed
+    PathPool* pool = entry->pool;
+    uint32_t hash = entry->hash;
+    if (entry->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+      pool->remove(hash, entry);
+  }
+
+  void remove(uint32_t hash, Entry* entry) {
+    Stripe& s = stripe(hash);
+    std::unique_lock<std::shared_mutex> lock(s.mutex);
+    auto range = s.map.equal_range(hash);
+    for (auto iter = range.first; iter != range.second; ++iter) {
+      if (iter->second == entry) {
+        if (entry->refs.load(std::memory_order_acquire) == 0) {
+          s.map.erase(iter);
+          m_size.fetch_sub(1, std::memory_order_relaxed);
+          destroy(entry);
+        }
+        return;
+      }
+    }
+  }
+
+  Stripe m_stripes[STRIPE_COUNT];
+  std::atomic<size_t> m_size{0};
+  std::atomic<uint32_t> m_nextId{1};
+};
+
+} // namespace usvfs
@@ -0,0 +1,151 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "processregistry.h"
+#include "hookcontext.h"
+#include <spdlog.h>
+#include <algorithm>
+
+namespace usvfs {
+
+struct ProcessRegistry::Entry {
+  ProcessRegistry *registry;
+  DWORD pid;
+  HANDLE process;
+  HANDLE wait;
+  bool exited;
+};
+
+
+ProcessRegistry::~ProcessRegistry()
+{
+  // waits for callbacks in progress, m_Mutex mustn't be held here
+  for (auto &iter : m_Entries) {
+    Entry *entry = iter.second.get();
+    if (entry->wait != nullptr) {
+      ::UnregisterWaitEx(entry->wait, INVALID_HANDLE_VALUE);
+    }
+    ::CloseHandle(entry->process);
+  }
+}
+
+VOID CALLBACK ProcessRegistry::onExit(PVOID parameter, BOOLEAN)
+{
+  Entry *entry = reinterpret_cast<Entry*>(parameter);
+  std::lock_guard<std::mutex> lock(entry->registry->m_Mutex);
+  entry->exited = true;
+  entry->registry->m_Exited.push_back(entry->pid);
+}
+
+bool ProcessRegistry::watch(DWORD pid)
+{
+  HANDLE process = ::OpenProcess(SYNCHRONIZE | PROCESS_QUERY_LIMITED_INFORMATION,
+                                 FALSE, pid);
+  if (process == nullptr) {
+    return false;
+  }
+  if (::WaitForSingleObject(process, 0) != WAIT_TIMEOUT) {
+    ::CloseHandle(process);
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  std::unique_ptr<Entry> entry(new Entry{ this, pid, process, nullptr, false });
+  if (!::RegisterWaitForSingleObject(&entry->wait, process, &onExit, entry.get(),
+                                     INFINITE, WT_EXECUTEONLYONCE)) {
+    // the process is still listed, it just won't be noticed when it ends
+    spdlog::get("usvfs")->warn("failed to wait for process {}: {}", pid,
+                               ::GetLastError());
+    entry->wait = nullptr;
+  }
+  m_Entries[pid] = std::move(entry);
+  return true;
+}
+
+std::vector<DWORD> ProcessRegistry::liveProcesses(HookContext &context)
+{
+  std::lock_guard<std::mutex> queryLock(m_QueryMutex);
+
+  uint32_t generation = context.processGeneration();
+  bool changed = !m_Synced || (generation != m_Generation);
+
+  std::vector<std::unique_ptr<Entry>> exited;
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    for (DWORD pid : m_Exited) {
+      auto iter = m_Entries.find(pid);
+      exited.push_back(std::move(iter->second));
+      m_Entries.erase(iter);
+    }
+    m_Exited.clear();
+  }
+
+  std::vector<DWORD> registered;
+  if (changed) {
+    registered = context.registeredProcesses();
+    std::sort(registered.begin(), registered.end());
+  }
+
+  std::vector<DWORD> ended;
+  for (const auto &entry : exited) {
+    // the wait has fired so this doesn't have to block
+    ::UnregisterWaitEx(entry->wait, nullptr);
+    ::CloseHandle(entry->process);
+    // the pid may have been reused by a process that registered since the last query
+    bool reused = changed
+        && std::binary_search(registered.begin(), registered.end(), entry->pid)
+        && watch(entry->pid);
+    if (!reused) {
+      ended.push_back(entry->pid);
+    }
+  }
+
+  if (changed) {
+    for (DWORD pid : registered) {
+      bool known;
+      {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        known = m_Entries.find(pid) != m_Entries.end();
+      }
+      if (!known && !watch(pid)) {
+        ended.push_back(pid);
+      }
+    }
+    m_Generation = generation;
+    m_Synced = true;
+  }
+
+  if (!ended.empty()) {
+    spdlog::get("usvfs")->debug("removing {} ended processes", ended.size());
+    context.unregisterProcesses(ended);
+  }
+
+  std::vector<DWORD> result;
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  result.reserve(m_Entries.size());
+  for (const auto &iter : m_Entries) {
+    if (!iter.second->exited) {
+      result.push_back(iter.first);
+    }
+  }
+  return result;
+}
+
+}
@@ -0,0 +1,82 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <windows_sane.h>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace usvfs {
+
+class HookContext;
+
+/**
+ * @brief keeps track of which of the processes registered in the shared parameters
+ *        are still running. Every registered process gets a handle with a wait on it
+ *        registered at the thread pool, exits are noted when the wait fires instead
+ *        of polling every process on each query. Processes that ended without
+ *        unregistering (crashed or were killed) are removed from the shared list
+ *        on the next query
+ */
+class ProcessRegistry
+{
+public:
+
+  ProcessRegistry() = default;
+  ~ProcessRegistry();
+
+  ProcessRegistry(const ProcessRegistry&) = delete;
+  ProcessRegistry &operator=(const ProcessRegistry&) = delete;
+
+  /**
+   * @brief list the registered processes that are still running. Processes that
+   *        registered since the last call are opened here, otherwise no system
+   *        calls are made
+   */
+  std::vector<DWORD> liveProcesses(HookContext &context);
+
+private:
+
+  struct Entry;
+
+  static VOID CALLBACK onExit(PVOID parameter, BOOLEAN timedOut);
+
+  // start waiting on a process, false if it's already gone
+  bool watch(DWORD pid);
+
+private:
+
+  // serializes queries
+  std::mutex m_QueryMutex;
+  bool m_Synced { false };
+  uint32_t m_Generation { 0 };
+
+  // protects the entries and exits, also taken by the wait callbacks
+  std::mutex m_Mutex;
+  std::map<DWORD, std::unique_ptr<Entry>> m_Entries;
+  std::vector<DWORD> m_Exited;
+
+};
+
+}
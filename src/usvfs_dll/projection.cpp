@@ -0,0 +1,608 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "projection.h"
+#include "hookcontext.h"
+#include "redirectiontree.h"
+#include <loghelpers.h>
+#include <windows_error.h>
+#include <scopeguard.h>
+#include <stringcast.h>
+#include <stringutils.h>
+#include <algorithm>
+#include <type_traits>
+#include <spdlog.h>
+
+namespace ush = usvfs::shared;
+
+
+namespace usvfs {
+
+// the parts of projectedfslib.h (windows sdk 10.0.17763 and up) used here. The library
+// is loaded at runtime so the dll still loads on systems without the feature
+
+static const UINT32 PRJ_CB_DATA_FLAG_ENUM_RESTART_SCAN = 0x01;
+
+struct PrjPlaceholderVersionInfo {
+  UINT8 providerId[128];
+  UINT8 contentId[128];
+};
+
+struct PrjCallbackData {
+  UINT32 size;
+  UINT32 flags;
+  void *namespaceVirtualizationContext;
+  INT32 commandId;
+  GUID fileId;
+  GUID dataStreamId;
+  PCWSTR filePathName;
+  PrjPlaceholderVersionInfo *versionInfo;
+  UINT32 triggeringProcessId;
+  PCWSTR triggeringProcessImageFileName;
+  void *instanceContext;
+};
+
+struct PrjFileBasicInfo {
+  BOOLEAN isDirectory;
+  INT64 fileSize;
+  LARGE_INTEGER creationTime;
+  LARGE_INTEGER lastAccessTime;
+  LARGE_INTEGER lastWriteTime;
+  LARGE_INTEGER changeTime;
+  UINT32 fileAttributes;
+};
+
+struct PrjPlaceholderInfo {
+  PrjFileBasicInfo fileBasicInfo;
+  UINT32 eaBufferSize;
+  UINT32 offsetToFirstEa;
+  UINT32 securityBufferSize;
+  UINT32 offsetToSecurityDescriptor;
+  UINT32 streamsInfoBufferSize;
+  UINT32 offsetToFirstStreamInfo;
+  PrjPlaceholderVersionInfo versionInfo;
+  UINT8 variableData[1];
+};
+
+struct PrjCallbacks {
+  HRESULT (CALLBACK *startDirectoryEnumeration)(const PrjCallbackData*, const GUID*);
+  HRESULT (CALLBACK *endDirectoryEnumeration)(const PrjCallbackData*, const GUID*);
+  HRESULT (CALLBACK *getDirectoryEnumeration)(const PrjCallbackData*, const GUID*, PCWSTR,
+                                              void*);
+  HRESULT (CALLBACK *getPlaceholderInfo)(const PrjCallbackData*);
+  HRESULT (CALLBACK *getFileData)(const PrjCallbackData*, UINT64, UINT32);
+  void *queryFileName;
+  void *notification;
+  void *cancelCommand;
+};
+
+struct ProjFS {
+  HRESULT (WINAPI *markDirectoryAsPlaceholder)(PCWSTR, PCWSTR, const PrjPlaceholderVersionInfo*,
+                                               const GUID*);
+  HRESULT (WINAPI *startVirtualizing)(PCWSTR, const PrjCallbacks*, const void*, const void*,
+                                      void**);
+  void (WINAPI *stopVirtualizing)(void*);
+  HRESULT (WINAPI *fillDirEntryBuffer)(PCWSTR, PrjFileBasicInfo*, void*);
+  HRESULT (WINAPI *writePlaceholderInfo)(void*, PCWSTR, const PrjPlaceholderInfo*, UINT32);
+  void *(WINAPI *allocateAlignedBuffer)(void*, size_t);
+  void (WINAPI *freeAlignedBuffer)(void*);
+  HRESULT (WINAPI *writeFileData)(void*, const GUID*, void*, UINT64, UINT32);
+  BOOLEAN (WINAPI *fileNameMatch)(PCWSTR, PCWSTR);
+  int (WINAPI *fileNameCompare)(PCWSTR, PCWSTR);
+};
+
+// file data is copied in pieces of this size
+static const UINT32 DATA_CHUNK_SIZE = 1024 * 1024;
+
+/**
+ * @return the functions of the projected file system or null if it isn't available
+ */
+static const ProjFS *projFS()
+{
+  static const ProjFS *result = [] () -> const ProjFS* {
+    HMODULE module = ::LoadLibraryExW(L"ProjectedFSLib.dll", nullptr,
+                                      LOAD_LIBRARY_SEARCH_SYSTEM32);
+    if (module == nullptr) {
+      return nullptr;
+    }
+    static ProjFS functions;
+    bool complete = true;
+    auto load = [module, &complete] (auto &function, const char *name) {
+      function = reinterpret_cast<std::remove_reference_t<decltype(function)>>(
+          ::GetProcAddress(module, name));
+      complete = complete && (function != nullptr);
+    };
+    load(functions.markDirectoryAsPlaceholder, "PrjMarkDirectoryAsPlaceholder");
+    load(functions.startVirtualizing, "PrjStartVirtualizing");
+    load(functions.stopVirtualizing, "PrjStopVirtualizing");
+    load(functions.fillDirEntryBuffer, "PrjFillDirEntryBuffer");
+    load(functions.writePlaceholderInfo, "PrjWritePlaceholderInfo");
+    load(functions.allocateAlignedBuffer, "PrjAllocateAlignedBuffer");
+    load(functions.freeAlignedBuffer, "PrjFreeAlignedBuffer");
+    load(functions.writeFileData, "PrjWriteFileData");
+    load(functions.fileNameMatch, "PrjFileNameMatch");
+    load(functions.fileNameCompare, "PrjFileNameCompare");
+    return complete ? &functions : nullptr;
+  }();
+  return result;
+}
+
+static LARGE_INTEGER toLargeInteger(const FILETIME &time)
+{
+  LARGE_INTEGER result;
+  result.LowPart = time.dwLowDateTime;
+  result.HighPart = static_cast<LONG>(time.dwHighDateTime);
+  return result;
+}
+
+static PrjFileBasicInfo basicInfo(DWORD attributes, const FILETIME &creationTime,
+                                  const FILETIME &lastAccessTime,
+                                  const FILETIME &lastWriteTime, DWORD sizeHigh,
+                                  DWORD sizeLow)
+{
+  PrjFileBasicInfo result;
+  result.isDirectory = (attributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+  result.fileSize = result.isDirectory
+      ? 0 : (static_cast<INT64>(sizeHigh) << 32) | sizeLow;
+  result.creationTime = toLargeInteger(creationTime);
+  result.lastAccessTime = toLargeInteger(lastAccessTime);
+  result.lastWriteTime = toLargeInteger(lastWriteTime);
+  result.changeTime = result.lastWriteTime;
+  // placeholders can't be reparse points, sparse, compressed or encrypted
+  result.fileAttributes = attributes & (FILE_ATTRIBUTE_READONLY | FILE_ATTRIBUTE_HIDDEN
+                                        | FILE_ATTRIBUTE_SYSTEM | FILE_ATTRIBUTE_DIRECTORY
+                                        | FILE_ATTRIBUTE_ARCHIVE);
+  if (result.fileAttributes == 0) {
+    result.fileAttributes = FILE_ATTRIBUTE_NORMAL;
+  }
+  return result;
+}
+
+static PrjFileBasicInfo basicInfo(const WIN32_FIND_DATAW &findData)
+{
+  return basicInfo(findData.dwFileAttributes, findData.ftCreationTime,
+                   findData.ftLastAccessTime, findData.ftLastWriteTime,
+                   findData.nFileSizeHigh, findData.nFileSizeLow);
+}
+
+/**
+ * @brief information about the real file behind an entry of the vfs. Directories that
+ *        only exist in the vfs get empty times
+ */
+static PrjFileBasicInfo queryInfo(const std::wstring &realPath, bool directory)
+{
+  WIN32_FILE_ATTRIBUTE_DATA data;
+  if (::GetFileAttributesExW(realPath.c_str(), GetFileExInfoStandard, &data)) {
+    return basicInfo(data.dwFileAttributes, data.ftCreationTime, data.ftLastAccessTime,
+                     data.ftLastWriteTime, data.nFileSizeHigh, data.nFileSizeLow);
+  }
+  PrjFileBasicInfo result;
+  memset(&result, 0, sizeof(PrjFileBasicInfo));
+  result.isDirectory = directory;
+  result.fileAttributes = directory ? FILE_ATTRIBUTE_DIRECTORY : FILE_ATTRIBUTE_NORMAL;
+  return result;
+}
+
+/**
+ * @brief the real path a vfs path shows through a directory link, for content that
+ *        isn't in the tree itself. Non-recursive directory links only have a node for
+ *        the directory, its content is read from the target
+ * @return the path below the target of the closest linked directory at or above path,
+ *         empty if there is none
+ */
+static std::wstring linkedPath(const RedirectionTreeContainer &table, const std::wstring &path)
+{
+  std::wstring remainder;
+  std::wstring prefix = path;
+  while (!prefix.empty()) {
+    const RedirectionTree *node = table->findNodeRaw(prefix.c_str(), prefix.size());
+    if ((node != nullptr) && node->isDirectory() && node->data().hasTarget()) {
+      std::wstring result = node->data().wideTarget();
+      while (!result.empty() && (result.back() == L'\\')) {
+        result.pop_back();
+      }
+      return result + remainder;
+    }
+    size_t separator = prefix.rfind(L'\\');
+    if (separator == std::wstring::npos) {
+      break;
+    }
+    remainder = prefix.substr(separator) + remainder;
+    prefix.resize(separator);
+  }
+  return std::wstring();
+}
+
+
+struct Projection::Entry {
+  std::wstring name;
+  std::wstring realPath;
+  PrjFileBasicInfo info;
+};
+
+struct Projection::Enumeration {
+  std::vector<Entry> entries;
+  size_t next{0};
+  bool started{false};
+  std::wstring expression;
+};
+
+
+Projection::Projection(const std::wstring &virtualPath, const std::wstring &root)
+  : m_VirtualPath(virtualPath)
+  , m_Root(root)
+{
+  while (!m_VirtualPath.empty()
+         && ((m_VirtualPath.back() == L'\\') || (m_VirtualPath.back() == L'/'))) {
+    m_VirtualPath.pop_back();
+  }
+
+  const ProjFS *api = projFS();
+  if (api == nullptr) {
+    throw ush::windows_error("projected file system not available", ERROR_NOT_SUPPORTED);
+  }
+
+  bool created = ::CreateDirectoryW(m_Root.c_str(), nullptr) != FALSE;
+  if (!created && (::GetLastError() != ERROR_ALREADY_EXISTS)) {
+    throw ush::windows_error("failed to create projection root");
+  }
+
+  // a directory projected into before keeps the instance id it was marked with, marking
+  // it again fails
+  GUID instanceId;
+  ::CoCreateGuid(&instanceId);
+  HRESULT result = api->markDirectoryAsPlaceholder(m_Root.c_str(), nullptr, nullptr,
+                                                   &instanceId);
+  if (FAILED(result) && created) {
+    throw ush::windows_error("failed to mark projection root", result);
+  }
+
+  PrjCallbacks callbacks;
+  memset(&callbacks, 0, sizeof(PrjCallbacks));
+  callbacks.startDirectoryEnumeration = &Projection::startEnumeration;
+  callbacks.endDirectoryEnumeration = &Projection::endEnumeration;
+  callbacks.getDirectoryEnumeration = &Projection::getEnumeration;
+  callbacks.getPlaceholderInfo = &Projection::getPlaceholderInfo;
+  callbacks.getFileData = &Projection::getFileData;
+
+  result = api->startVirtualizing(m_Root.c_str(), &callbacks, this, nullptr, &m_Context);
+  if (FAILED(result)) {
+    throw ush::windows_error("failed to start projection", result);
+  }
+
+  spdlog::get("usvfs")->info("projecting {} into {}",
+                             ush::string_cast<std::string>(m_VirtualPath, ush::CodePage::UTF8),
+                             ush::string_cast<std::string>(m_Root, ush::CodePage::UTF8));
+}
+
+Projection::~Projection()
+{
+  // waits for callbacks that are still running
+  projFS()->stopVirtualizing(m_Context);
+}
+
+bool Projection::available()
+{
+  return projFS() != nullptr;
+}
+
+std::wstring Projection::virtualPath(LPCWSTR relativePath) const
+{
+  return (*relativePath == L'\0') ? m_VirtualPath : m_VirtualPath + L"\\" + relativePath;
+}
+
+std::vector<Projection::Entry> Projection::list(LPCWSTR relativePath) const
+{
+  std::wstring directory = virtualPath(relativePath);
+
+  bool virtualOnly = false;
+  std::wstring target;
+  std::vector<Entry> linked;
+  {
+    auto context = HookContext::readAccess(__MYFUNC__);
+    target = linkedPath(context->redirectionTable(), directory);
+    const RedirectionTree *node = context->redirectionTable()->findNodeRaw(
+        directory.c_str(), directory.size());
+    if (node != nullptr) {
+      virtualOnly = node->hasFlag(shared::FLAG_VIRTUALONLY);
+      for (auto iter = node->filesBegin(); iter != node->filesEnd(); ++iter) {
+        const RedirectionTree *child = iter->second.get().get();
+        if (child->hasFlag(shared::FLAG_DUMMY)
+            || (!child->data().hasTarget() && !child->isDirectory())) {
+          continue;
+        }
+        Entry entry;
+        entry.name = ush::string_cast<std::wstring>(child->name(), ush::CodePage::UTF8);
+        entry.realPath = child->data().hasTarget() ? child->data().wideTarget()
+                                                   : directory + L"\\" + entry.name;
+        entry.info.isDirectory = child->isDirectory();
+        linked.push_back(std::move(entry));
+      }
+    }
+  }
+
+  // keyed by the folded name, entries of the vfs replace the real ones
+  std::map<std::wstring, Entry> entries;
+  auto listReal = [&entries] (const std::wstring &realDirectory) {
+    WIN32_FIND_DATAW findData;
+    HANDLE search = ::FindFirstFileExW((realDirectory + L"\\*").c_str(), FindExInfoBasic,
+                                       &findData, FindExSearchNameMatch, nullptr,
+                                       FIND_FIRST_EX_LARGE_FETCH);
+    if (search == INVALID_HANDLE_VALUE) {
+      return;
+    }
+    ON_BLOCK_EXIT([search] () { ::FindClose(search); });
+    do {
+      if ((wcscmp(findData.cFileName, L".") == 0)
+          || (wcscmp(findData.cFileName, L"..") == 0)) {
+        continue;
+      }
+      Entry entry;
+      entry.name = findData.cFileName;
+      entry.realPath = realDirectory + L"\\" + entry.name;
+      entry.info = basicInfo(findData);
+      entries[ush::to_upper(entry.name)] = std::move(entry);
+    } while (::FindNextFileW(search, &findData));
+  };
+  if (!virtualOnly) {
+    listReal(directory);
+  }
+  // content of a directory link that has no nodes of its own, the nodes in the tree
+  // take precedence
+  if (!target.empty()) {
+    listReal(target);
+  }
+  for (Entry &entry : linked) {
+    // the real files are queried without holding the lock
+    entry.info = queryInfo(entry.realPath, entry.info.isDirectory != FALSE);
+    entries[ush::to_upper(entry.name)] = std::move(entry);
+  }
+
+  std::vector<Entry> result;
+  result.reserve(entries.size());
+  for (auto &entry : entries) {
+    result.push_back(std::move(entry.second));
+  }
+  const ProjFS *api = projFS();
+  std::sort(result.begin(), result.end(), [api] (const Entry &lhs, const Entry &rhs) {
+    return api->fileNameCompare(lhs.name.c_str(), rhs.name.c_str()) < 0;
+  });
+  return result;
+}
+
+bool Projection::lookup(LPCWSTR relativePath, Entry &entry) const
+{
+  std::wstring path = virtualPath(relativePath);
+
+  bool linked = false;
+  std::wstring target;
+  {
+    auto context = HookContext::readAccess(__MYFUNC__);
+    const RedirectionTree *node = context->redirectionTable()->findNodeRaw(
+        path.c_str(), path.size());
+    if ((node != nullptr) && !node->hasFlag(shared::FLAG_DUMMY)
+        && (node->data().hasTarget() || node->isDirectory())) {
+      entry.name = ush::string_cast<std::wstring>(node->name(), ush::CodePage::UTF8);
+      entry.realPath = node->data().hasTarget() ? node->data().wideTarget() : path;
+      entry.info.isDirectory = node->isDirectory();
+      linked = true;
+    } else {
+      target = linkedPath(context->redirectionTable(), path);
+    }
+  }
+  if (linked) {
+    entry.info = queryInfo(entry.realPath, entry.info.isDirectory != FALSE);
+    return true;
+  }
+
+  // not in the tree, the file in the target of a linked directory above it or else
+  // the real file at the path shows through
+  for (const std::wstring &realPath : { target, path }) {
+    if (realPath.empty()) {
+      continue;
+    }
+    WIN32_FIND_DATAW findData;
+    HANDLE search = ::FindFirstFileExW(realPath.c_str(), FindExInfoBasic, &findData,
+                                       FindExSearchNameMatch, nullptr, 0);
+    if (search == INVALID_HANDLE_VALUE) {
+      continue;
+    }
+    ::FindClose(search);
+    entry.name = findData.cFileName;
+    entry.realPath = realPath;
+    entry.info = basicInfo(findData);
+    return true;
+  }
+  return false;
+}
+
+HRESULT CALLBACK Projection::startEnumeration(const PrjCallbackData *callbackData,
+                                              const GUID *enumerationId)
+{
+  Projection *self = static_cast<Projection*>(callbackData->instanceContext);
+  try {
+    std::unique_ptr<Enumeration> enumeration(new Enumeration);
+    enumeration->entries = self->list(callbackData->filePathName);
+    std::lock_guard<std::mutex> lock(self->m_EnumerationsMutex);
+    self->m_Enumerations[*enumerationId] = std::move(enumeration);
+    return S_OK;
+  } catch (const std::exception &e) {
+    spdlog::get("usvfs")->error("failed to list projected directory {}: {}",
+                                ush::string_cast<std::string>(callbackData->filePathName,
+                                                              ush::CodePage::UTF8),
+                                e.what());
+    return E_FAIL;
+  }
+}
+
+HRESULT CALLBACK Projection::endEnumeration(const PrjCallbackData *callbackData,
+                                            const GUID *enumerationId)
+{
+  Projection *self = static_cast<Projection*>(callbackData->instanceContext);
+  std::lock_guard<std::mutex> lock(self->m_EnumerationsMutex);
+  self->m_Enumerations.erase(*enumerationId);
+  return S_OK;
+}
+
+HRESULT CALLBACK Projection::getEnumeration(const PrjCallbackData *callbackData,
+                                            const GUID *enumerationId,
+                                            LPCWSTR searchExpression, void *entryBuffer)
+{
+  Projection *self = static_cast<Projection*>(callbackData->instanceContext);
+  // calls for one enumeration don't overlap, the lock only protects the map
+  Enumeration *enumeration = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(self->m_EnumerationsMutex);
+    auto iter = self->m_Enumerations.find(*enumerationId);
+    if (iter == self->m_Enumerations.end()) {
+      return E_INVALIDARG;
+    }
+    enumeration = iter->second.get();
+  }
+
+  try {
+    if ((callbackData->flags & PRJ_CB_DATA_FLAG_ENUM_RESTART_SCAN) != 0) {
+      enumeration->entries = self->list(callbackData->filePathName);
+      enumeration->next = 0;
+      enumeration->started = false;
+    }
+  } catch (const std::exception &e) {
+    spdlog::get("usvfs")->error("failed to list projected directory {}: {}",
+                                ush::string_cast<std::string>(callbackData->filePathName,
+                                                              ush::CodePage::UTF8),
+                                e.what());
+    return E_FAIL;
+  }
+  if (!enumeration->started) {
+    // the expression of the first call applies to the whole enumeration
+    enumeration->expression = ((searchExpression != nullptr) && (*searchExpression != L'\0'))
+                                  ? searchExpression : L"*";
+    enumeration->started = true;
+  }
+
+  const ProjFS *api = projFS();
+  bool added = false;
+  for (; enumeration->next < enumeration->entries.size(); ++enumeration->next) {
+    Entry &entry = enumeration->entries[enumeration->next];
+    if (!api->fileNameMatch(entry.name.c_str(), enumeration->expression.c_str())) {
+      continue;
+    }
+    HRESULT result = api->fillDirEntryBuffer(entry.name.c_str(), &entry.info, entryBuffer);
+    if (FAILED(result)) {
+      // the buffer is full, the rest is returned by the next call
+      return added ? S_OK : result;
+    }
+    added = true;
+  }
+  return S_OK;
+}
+
+HRESULT CALLBACK Projection::getPlaceholderInfo(const PrjCallbackData *callbackData)
+{
+  Projection *self = static_cast<Projection*>(callbackData->instanceContext);
+  Entry entry;
+  try {
+    if (!self->lookup(callbackData->filePathName, entry)) {
+      return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
+    }
+  } catch (const std::exception &e) {
+    spdlog::get("usvfs")->error("failed to look up projected file {}: {}",
+                                ush::string_cast<std::string>(callbackData->filePathName,
+                                                              ush::CodePage::UTF8),
+                                e.what());
+    return E_FAIL;
+  }
+
+  // the name may only differ from the requested one in case
+  std::wstring name = callbackData->filePathName;
+  size_t separator = name.find_last_of(L'\\');
+  name.erase(separator == std::wstring::npos ? 0 : separator + 1);
+  name += entry.name;
+
+  PrjPlaceholderInfo info;
+  memset(&info, 0, sizeof(PrjPlaceholderInfo));
+  info.fileBasicInfo = entry.info;
+  return projFS()->writePlaceholderInfo(callbackData->namespaceVirtualizationContext,
+                                        name.c_str(), &info, sizeof(PrjPlaceholderInfo));
+}
+
+HRESULT CALLBACK Projection::getFileData(const PrjCallbackData *callbackData,
+                                         UINT64 byteOffset, UINT32 length)
+{
+  Projection *self = static_cast<Projection*>(callbackData->instanceContext);
+  Entry entry;
+  try {
+    if (!self->lookup(callbackData->filePathName, entry)) {
+      return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
+    }
+  } catch (const std::exception &e) {
+    spdlog::get("usvfs")->error("failed to look up projected file {}: {}",
+                                ush::string_cast<std::string>(callbackData->filePathName,
+                                                              ush::CodePage::UTF8),
+                                e.what());
+    return E_FAIL;
+  }
+  if (length == 0) {
+    return S_OK;
+  }
+
+  HANDLE file = ::CreateFileW(entry.realPath.c_str(), GENERIC_READ,
+                              FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                              nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    return HRESULT_FROM_WIN32(::GetLastError());
+  }
+  ON_BLOCK_EXIT([file] () { ::CloseHandle(file); });
+
+  const ProjFS *api = projFS();
+  UINT32 chunkSize = std::min(length, DATA_CHUNK_SIZE);
+  void *buffer = api->allocateAlignedBuffer(callbackData->namespaceVirtualizationContext,
+                                            chunkSize);
+  if (buffer == nullptr) {
+    return E_OUTOFMEMORY;
+  }
+  ON_BLOCK_EXIT([api, buffer] () { api->freeAlignedBuffer(buffer); });
+
+  UINT64 end = byteOffset + length;
+  for (UINT64 offset = byteOffset; offset < end; ) {
+    UINT32 size = static_cast<UINT32>(std::min<UINT64>(chunkSize, end - offset));
+    OVERLAPPED position;
+    memset(&position, 0, sizeof(OVERLAPPED));
+    position.Offset = static_cast<DWORD>(offset);
+    position.OffsetHigh = static_cast<DWORD>(offset >> 32);
+    DWORD read = 0;
+    if (!::ReadFile(file, buffer, size, &read, &position)) {
+      return HRESULT_FROM_WIN32(::GetLastError());
+    }
+    if (read != size) {
+      // the file shrank since its placeholder was written
+      return HRESULT_FROM_WIN32(ERROR_HANDLE_EOF);
+    }
+    HRESULT result = api->writeFileData(callbackData->namespaceVirtualizationContext,
+                                        &callbackData->dataStreamId, buffer, offset, size);
+    if (FAILED(result)) {
+      return result;
+    }
+    offset += size;
+  }
+  return S_OK;
+}
+
+} // namespace usvfs
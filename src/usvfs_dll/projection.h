@@ -0,0 +1,114 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <windows_sane.h>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+namespace usvfs {
+
+struct PrjCallbackData;
+
+/**
+ * @brief projects a directory of the vfs into another directory through the windows
+ *        projected file system (windows 10 1809 and up, the optional feature has to
+ *        be enabled). Listings and placeholders are served from the redirection tree
+ *        and the real directory below it, the way the hooks would present them. A
+ *        file's data is copied from its current target the first time it's read,
+ *        afterwards it's accessed at native speed by any process, hooked or not.
+ *        The callbacks run on threads of the projected file system and read the
+ *        tree under the hook context lock
+ */
+class Projection
+{
+public:
+
+  /**
+   * @brief start projecting
+   * @param virtualPath directory of the vfs to project
+   * @param root directory the projection appears in. Created if it doesn't exist,
+   *        otherwise it has to be empty or a directory projected into before
+   * @throw windows_error if the projection can't be started
+   */
+  Projection(const std::wstring &virtualPath, const std::wstring &root);
+
+  /**
+   * @brief stop projecting. Files that were read stay in the root
+   */
+  ~Projection();
+
+  Projection(const Projection&) = delete;
+  Projection &operator=(const Projection&) = delete;
+
+  /**
+   * @return true if the projected file system is available on this system
+   */
+  static bool available();
+
+private:
+
+  struct Entry;
+  struct Enumeration;
+  struct GuidLess {
+    bool operator()(const GUID &lhs, const GUID &rhs) const {
+      return memcmp(&lhs, &rhs, sizeof(GUID)) < 0;
+    }
+  };
+
+  // the callbacks, the instance context is the projection
+  static HRESULT CALLBACK startEnumeration(const PrjCallbackData *callbackData,
+                                           const GUID *enumerationId);
+  static HRESULT CALLBACK endEnumeration(const PrjCallbackData *callbackData,
+                                         const GUID *enumerationId);
+  static HRESULT CALLBACK getEnumeration(const PrjCallbackData *callbackData,
+                                         const GUID *enumerationId, LPCWSTR searchExpression,
+                                         void *entryBuffer);
+  static HRESULT CALLBACK getPlaceholderInfo(const PrjCallbackData *callbackData);
+  static HRESULT CALLBACK getFileData(const PrjCallbackData *callbackData, UINT64 byteOffset,
+                                      UINT32 length);
+
+  // virtual path of a path relative to the root
+  std::wstring virtualPath(LPCWSTR relativePath) const;
+
+  // the entries of a directory, sorted the way the projected file system expects
+  std::vector<Entry> list(LPCWSTR relativePath) const;
+
+  // look up a single entry
+  bool lookup(LPCWSTR relativePath, Entry &entry) const;
+
+private:
+
+  std::wstring m_VirtualPath;
+  std::wstring m_Root;
+  void *m_Context{nullptr};
+
+  std::mutex m_EnumerationsMutex;
+  std::map<GUID, std::unique_ptr<Enumeration>, GuidLess> m_Enumerations;
+
+};
+
+}
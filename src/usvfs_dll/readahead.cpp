@@ -0,0 +1,287 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "readahead.h"
+#include "hookcallcontext.h"
+#include "workerpool.h"
+#include <winapi.h>
+#include <stringutils.h>
+#include <stringcast.h>
+#include <scopeguard.h>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <unordered_set>
+#include <spdlog.h>
+
+namespace ush = usvfs::shared;
+
+
+namespace usvfs {
+
+std::atomic<bool> ReadAhead::s_Recording{false};
+
+// files prefetched per task, between batches the pool may run other work
+static const size_t BATCH_SIZE = 64;
+// the start of a file is read in this many chunks which are all requested at once
+static const size_t CHUNK_COUNT = 4;
+static const size_t CHUNK_SIZE = ReadAhead::PREFETCH_BYTES / CHUNK_COUNT;
+
+// incremented on open and close, batches of an earlier generation stop
+static std::atomic<int> s_Generation{0};
+
+static std::mutex s_Mutex;
+static std::wstring s_ProfilePath;
+static std::vector<std::wstring> s_Order;
+static std::unordered_set<std::wstring> s_Recorded; // folded paths in s_Order
+
+namespace {
+
+class Prefetcher {
+public:
+  Prefetcher()
+    : m_Buffer(ReadAhead::PREFETCH_BYTES)
+  {
+    for (HANDLE &event : m_Events) {
+      event = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    }
+  }
+
+  ~Prefetcher()
+  {
+    for (HANDLE event : m_Events) {
+      if (event != nullptr) {
+        ::CloseHandle(event);
+      }
+    }
+  }
+
+  void prefetch(const std::wstring &path)
+  {
+    // buffered on purpose, unbuffered reads wouldn't leave anything in the file cache
+    HANDLE file = ::CreateFileW(path.c_str(), GENERIC_READ,
+                                FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                nullptr, OPEN_EXISTING,
+                                FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+      // the file was removed or the mod deactivated since the profile was written
+      return;
+    }
+    ON_BLOCK_EXIT([file] () { ::CloseHandle(file); });
+
+    LARGE_INTEGER fileSize;
+    if (!::GetFileSizeEx(file, &fileSize)) {
+      return;
+    }
+    size_t total = static_cast<size_t>(
+        std::min<LONGLONG>(fileSize.QuadPart, ReadAhead::PREFETCH_BYTES));
+
+    OVERLAPPED overlapped[CHUNK_COUNT];
+    bool pending[CHUNK_COUNT] = {};
+    for (size_t i = 0; (i < CHUNK_COUNT) && (i * CHUNK_SIZE < total); ++i) {
+      if (m_Events[i] == nullptr) {
+        break;
+      }
+      memset(&overlapped[i], 0, sizeof(OVERLAPPED));
+      overlapped[i].Offset = static_cast<DWORD>(i * CHUNK_SIZE);
+      overlapped[i].hEvent = m_Events[i];
+      DWORD length = static_cast<DWORD>(std::min(CHUNK_SIZE, total - i * CHUNK_SIZE));
+      if (::ReadFile(file, &m_Buffer[i * CHUNK_SIZE], length, nullptr, &overlapped[i])) {
+        continue;
+      } else if (::GetLastError() == ERROR_IO_PENDING) {
+        pending[i] = true;
+      } else {
+        break;
+      }
+    }
+
+    // the buffer has to stay around until all reads are done
+    for (size_t i = 0; i < CHUNK_COUNT; ++i) {
+      if (pending[i]) {
+        DWORD read = 0;
+        ::GetOverlappedResult(file, &overlapped[i], &read, TRUE);
+      }
+    }
+  }
+
+private:
+  std::vector<char> m_Buffer;
+  HANDLE m_Events[CHUNK_COUNT];
+};
+
+}
+
+static void prefetchBatch(std::shared_ptr<const std::vector<std::wstring>> paths,
+                          size_t first, int generation)
+{
+  // the profile only lists real paths, the reads mustn't be rerouted or recorded
+  FunctionGroupLock lock(MutExHookGroup::ALL_GROUPS);
+
+  Prefetcher prefetcher;
+  size_t end = std::min(first + BATCH_SIZE, paths->size());
+  for (size_t i = first; i < end; ++i) {
+    if (s_Generation.load(std::memory_order_relaxed) != generation) {
+      return;
+    }
+    prefetcher.prefetch((*paths)[i]);
+  }
+
+  if (end < paths->size()) {
+    WorkerPool::instance().submit([paths, end, generation] () {
+      prefetchBatch(paths, end, generation);
+    });
+  }
+}
+
+bool ReadAhead::open(const std::wstring &directory)
+{
+  close();
+
+  // the profile must not end up in the vfs
+  FunctionGroupLock lock(MutExHookGroup::ALL_GROUPS);
+
+  std::wstring executable = winapi::wide::getModuleFileName(nullptr);
+  size_t separator = executable.find_last_of(L"\\/");
+  if (separator != std::wstring::npos) {
+    executable.erase(0, separator + 1);
+  }
+
+  std::wstring path = directory;
+  if (!path.empty() && (path.back() != L'\\') && (path.back() != L'/')) {
+    path.push_back(L'\\');
+  }
+  path += executable + L".usvfsreadahead";
+
+  auto paths = std::make_shared<std::vector<std::wstring>>();
+  {
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+    if (file) {
+      std::ostringstream content;
+      content << file.rdbuf();
+      *paths = parseProfile(content.str());
+    }
+  }
+
+  int generation;
+  {
+    std::lock_guard<std::mutex> recordLock(s_Mutex);
+    s_ProfilePath = path;
+    generation = ++s_Generation;
+  }
+  s_Recording.store(true);
+
+  if (paths->empty()) {
+    spdlog::get("usvfs")->info("recording read-ahead profile {}",
+                               ush::string_cast<std::string>(path, ush::CodePage::UTF8));
+    return false;
+  }
+
+  spdlog::get("usvfs")->info("prefetching {} files from {}", paths->size(),
+                             ush::string_cast<std::string>(path, ush::CodePage::UTF8));
+  WorkerPool::instance().submit([paths, generation] () {
+    prefetchBatch(paths, 0, generation);
+  });
+  return true;
+}
+
+void ReadAhead::close()
+{
+  std::vector<std::wstring> order;
+  std::wstring path;
+  {
+    std::lock_guard<std::mutex> recordLock(s_Mutex);
+    ++s_Generation;
+    if (!s_Recording.exchange(false)) {
+      return;
+    }
+    order.swap(s_Order);
+    path.swap(s_ProfilePath);
+    s_Recorded.clear();
+  }
+
+  if (order.empty()) {
+    return;
+  }
+
+  FunctionGroupLock lock(MutExHookGroup::ALL_GROUPS);
+  std::ofstream file(path, std::ios::out | std::ios::binary | std::ios::trunc);
+  file << serializeProfile(order);
+  if (!file) {
+    spdlog::get("usvfs")->warn("failed to write read-ahead profile {}",
+                               ush::string_cast<std::string>(path, ush::CodePage::UTF8));
+  }
+}
+
+void ReadAhead::record(const wchar_t *path, size_t length)
+{
+  if (!enabled()) {
+    return;
+  }
+
+  std::wstring filePath(path, length);
+  if (filePath.compare(0, 4, L"\\??\\") == 0) {
+    // \??\ to \\?\ so the path can be opened with CreateFile
+    filePath[1] = L'\\';
+  }
+  std::wstring key = ush::to_upper(filePath);
+
+  std::lock_guard<std::mutex> lock(s_Mutex);
+  if (!enabled() || (s_Order.size() >= MAX_FILES) || !s_Recorded.insert(key).second) {
+    return;
+  }
+  s_Order.push_back(std::move(filePath));
+}
+
+std::vector<std::wstring> ReadAhead::parseProfile(const std::string &content)
+{
+  std::vector<std::wstring> result;
+  size_t pos = 0;
+  while (pos < content.size()) {
+    size_t end = content.find('\n', pos);
+    if (end == std::string::npos) {
+      end = content.size();
+    }
+    size_t lineEnd = end;
+    if ((lineEnd > pos) && (content[lineEnd - 1] == '\r')) {
+      --lineEnd;
+    }
+    if (lineEnd > pos) {
+      result.push_back(ush::string_cast<std::wstring>(content.c_str() + pos,
+                                                      ush::CodePage::UTF8, lineEnd - pos));
+    }
+    pos = end + 1;
+  }
+  return result;
+}
+
+std::string ReadAhead::serializeProfile(const std::vector<std::wstring> &paths)
+{
+  std::string result;
+  for (const std::wstring &path : paths) {
+    result += ush::string_cast<std::string>(path, ush::CodePage::UTF8);
+    result += '\n';
+  }
+  return result;
+}
+
+} // namespace usvfs
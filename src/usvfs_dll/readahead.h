@@ -0,0 +1,79 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include "dllimport.h"
+#include <atomic>
+#include <string>
+#include <vector>
+
+
+namespace usvfs {
+
+/**
+ * @brief read-ahead of the rerouted files a program opens during startup. While
+ *        recording, the first open of every rerouted file is remembered in order.
+ *        When the process ends that order is written to a profile named after the
+ *        executable. On the next launch the start of each file in the profile is
+ *        read on the background threads in the same order, so the data is in the
+ *        file cache by the time the program gets to it.
+ *        Profile format: utf-8 text, one path per line
+ */
+class ReadAhead {
+public:
+  // number of bytes read from the start of each file
+  static const size_t PREFETCH_BYTES = 256 * 1024;
+  // files recorded per profile, later first opens are ignored
+  static const size_t MAX_FILES = 4096;
+
+public:
+  /**
+   * @brief prefetch the files from the profile of this executable in the specified
+   *        directory, then start recording
+   * @return false if there was no profile to prefetch from
+   */
+  static bool open(const std::wstring &directory);
+
+  /**
+   * @brief stop prefetching and recording and write the profile. The previous
+   *        profile is kept if nothing was recorded
+   */
+  static void close();
+
+  static bool enabled()
+  {
+    return s_Recording.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief record that a rerouted file was opened
+   * @param path nt path of the real file
+   */
+  static void record(const wchar_t *path, size_t length);
+
+  DLLEXPORT static std::vector<std::wstring> parseProfile(const std::string &content);
+  DLLEXPORT static std::string serializeProfile(const std::vector<std::wstring> &paths);
+
+private:
+  static std::atomic<bool> s_Recording;
+};
+
+} // namespace usvfs
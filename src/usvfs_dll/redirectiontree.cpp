@@ -19,10 +19,74 @@ You should have received a copy of the GNU General Public License
 along with usvfs. If not, see <http://www.gnu.org/licenses/>.
 */
 #include "redirectiontree.h"
+#include <boost/interprocess/containers/set.hpp>
 
 
-std::ostream &usvfs::operator<<(std::ostream &stream, const RedirectionData &data)
+namespace usvfs {
+
+typedef shared::VoidAllocatorT::rebind<shared::StringT>::other LinkBaseAllocatorT;
+typedef boost::interprocess::set<shared::StringT, std::less<shared::StringT>, LinkBaseAllocatorT> LinkBaseSetT;
+
+typedef shared::VoidAllocatorT::rebind<shared::WStringT>::other WideLinkBaseAllocatorT;
+typedef boost::interprocess::set<shared::WStringT, std::less<shared::WStringT>, WideLinkBaseAllocatorT> WideLinkBaseSetT;
+
+static const char LINK_BASES_NAME[] = "LinkBases";
+static const char WIDE_LINK_BASES_NAME[] = "WideLinkBases";
+
+const shared::StringT *internLinkBase(const char *base, const shared::VoidAllocatorT &allocator)
+{
+  // set nodes never move so the address of an entry can be stored in the tree
+  LinkBaseSetT *bases = allocator.get_segment_manager()->find_or_construct<LinkBaseSetT>(
+      LINK_BASES_NAME)(std::less<shared::StringT>(), LinkBaseAllocatorT(allocator));
+  return &*bases->insert(shared::StringT(base, allocator)).first;
+}
+
+const shared::WStringT *internWideLinkBase(const wchar_t *base, const shared::VoidAllocatorT &allocator)
 {
-  stream << data.linkTarget;
+  WideLinkBaseSetT *bases = allocator.get_segment_manager()->find_or_construct<WideLinkBaseSetT>(
+      WIDE_LINK_BASES_NAME)(std::less<shared::WStringT>(), WideLinkBaseAllocatorT(allocator));
+  return &*bases->insert(shared::WStringT(base, allocator)).first;
+}
+
+// WIN32_MEMORY_RANGE_ENTRY, the sdk only declares it when targeting windows 8
+struct MemoryRange {
+  PVOID virtualAddress;
+  SIZE_T numberOfBytes;
+};
+
+typedef BOOL (WINAPI *PrefetchVirtualMemory_type)(HANDLE, ULONG_PTR, MemoryRange*, ULONG);
+
+void prefault(const RedirectionTreeContainer &tree)
+{
+  void *buffer = nullptr;
+  size_t bufferSize = 0;
+  tree.getBuffer(buffer, bufferSize);
+  if (buffer == nullptr) {
+    return;
+  }
+
+  static PrefetchVirtualMemory_type prefetchVirtualMemory
+      = reinterpret_cast<PrefetchVirtualMemory_type>(::GetProcAddress(
+          ::GetModuleHandleW(L"kernel32.dll"), "PrefetchVirtualMemory"));
+  if (prefetchVirtualMemory != nullptr) {
+    MemoryRange range { buffer, bufferSize };
+    prefetchVirtualMemory(::GetCurrentProcess(), 1, &range, 0);
+  }
+
+  // prefetching only brings the pages into memory, they still have to be mapped into
+  // this process
+  SYSTEM_INFO info;
+  ::GetSystemInfo(&info);
+  const volatile char *begin = static_cast<const volatile char*>(buffer);
+  for (size_t offset = 0; offset < bufferSize; offset += info.dwPageSize) {
+    begin[offset];
+  }
+}
+
+std::ostream &operator<<(std::ostream &stream, const RedirectionData &data)
+{
+  stream << data.target();
   return stream;
 }
+
+}
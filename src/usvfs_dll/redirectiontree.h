@@ -23,6 +23,7 @@ along with usvfs. If not, see <http://www.gnu.org/licenses/>.
 #pragma warning (push, 3)
 #pragma warning(disable : 4714)
 #include <directory_tree.h>
+#include <stringcast.h>
 #include <boost/interprocess/containers/string.hpp>
 #include <boost/interprocess/containers/set.hpp>
 #include <boost/interprocess/allocators/allocator.hpp>
@@ -37,6 +38,12 @@ namespace usvfs {
 
 namespace shared {
   static const TreeFlags FLAG_CREATETARGET = FLAG_FIRSTUSERFLAG + 0x00;
+  // directory that didn't exist on disk when it was linked and whose content was
+  // linked completely, listings are made from the tree alone
+  static const TreeFlags FLAG_VIRTUALONLY  = FLAG_FIRSTUSERFLAG << 1;
+  // file whose target is a hard link in the staging directory, see LINKFLAG_MATERIALIZE.
+  // The link belongs to the vfs and is deleted with the mappings
+  static const TreeFlags FLAG_MATERIALIZED = FLAG_FIRSTUSERFLAG << 2;
 }
 
 
@@ -50,26 +57,114 @@ struct RedirectionDataLocal {
     : linkTarget(target)
   {}
 
+  /**
+   * @param base directory prefix shared by many targets, stored only once per tree
+   * @param tail remainder of the target, appended to the base
+   */
+  RedirectionDataLocal(const std::string &base, const std::string &tail)
+    : linkBase(base)
+    , linkTarget(tail)
+  {}
+
+  std::string linkBase;
   std::string linkTarget;
 };
 
 
+/**
+ * @brief intern a link target prefix in the shared memory segment of the allocator
+ * @return pointer to the interned copy, stays valid as long as the segment exists
+ */
+const shared::StringT *internLinkBase(const char *base, const shared::VoidAllocatorT &allocator);
+
+/**
+ * @brief like internLinkBase for the utf-16 copy of a prefix
+ */
+const shared::WStringT *internWideLinkBase(const wchar_t *base, const shared::VoidAllocatorT &allocator);
+
+
 struct RedirectionData {
 
   RedirectionData(const RedirectionData &reference, const shared::VoidAllocatorT &allocator)
-    : linkTarget(reference.linkTarget.c_str(), allocator)
+    : linkBase(reference.linkBase ? internLinkBase(reference.linkBase->c_str(), allocator) : nullptr)
+    , linkTarget(reference.linkTarget.c_str(), allocator)
+    , wideLinkBase(reference.wideLinkBase ? internWideLinkBase(reference.wideLinkBase->c_str(), allocator) : nullptr)
+    , wideLinkTarget(reference.wideLinkTarget.c_str(), allocator)
   {}
 
   RedirectionData(const RedirectionDataLocal &reference, const shared::VoidAllocatorT &allocator)
-    : linkTarget(reference.linkTarget.c_str(), allocator)
+    : linkBase(!reference.linkBase.empty() ? internLinkBase(reference.linkBase.c_str(), allocator) : nullptr)
+    , linkTarget(reference.linkTarget.c_str(), allocator)
+    , wideLinkBase(!reference.linkBase.empty()
+                   ? internWideLinkBase(toWide(reference.linkBase.c_str()).c_str(), allocator)
+                   : nullptr)
+    , wideLinkTarget(toWide(reference.linkTarget.c_str()).c_str(), allocator)
   {}
 
   RedirectionData(const char *target, const shared::VoidAllocatorT &allocator)
     : linkTarget(target, allocator)
+    , wideLinkTarget(toWide(target).c_str(), allocator)
   {}
 
+  /**
+   * @return true if this node is linked to a target
+   */
+  bool hasTarget() const { return linkBase || !linkTarget.empty(); }
+
+  /**
+   * @return the full link target (utf-8)
+   */
+  std::string target() const {
+    if (!linkBase) {
+      return linkTarget.c_str();
+    }
+    std::string result;
+    result.reserve(linkBase->size() + linkTarget.size());
+    result.append(linkBase->c_str(), linkBase->size());
+    result.append(linkTarget.c_str(), linkTarget.size());
+    return result;
+  }
+
+  /**
+   * @return the full link target (utf-16). Unlike target() this doesn't have to
+   *         convert anything so reroutes should use this one
+   */
+  std::wstring wideTarget() const {
+    if (!wideLinkBase) {
+      return std::wstring(wideLinkTarget.c_str(), wideLinkTarget.size());
+    }
+    std::wstring result;
+    result.reserve(wideLinkBase->size() + wideLinkTarget.size());
+    result.append(wideLinkBase->c_str(), wideLinkBase->size());
+    result.append(wideLinkTarget.c_str(), wideLinkTarget.size());
+    return result;
+  }
+
+  /**
+   * @brief replace the link target. The new target isn't split into a shared prefix
+   *        and a remainder
+   */
+  void setTarget(const char *target) {
+    linkBase = nullptr;
+    linkTarget.assign(target);
+    wideLinkBase = nullptr;
+    wideLinkTarget.assign(toWide(target).c_str());
+  }
+
+  static std::wstring toWide(const char *target) {
+    return shared::string_cast<std::wstring>(target, shared::CodePage::UTF8);
+  }
+
+  // interned prefix of the target (shared between nodes) or null. If set, linkTarget
+  // only holds the remainder
+  shared::OffsetPtrT<const shared::StringT> linkBase;
   shared::StringT linkTarget;
 
+  // the same target in utf-16, converted once when the node is added since every
+  // caller of the hooks wants wide paths
+  shared::OffsetPtrT<const shared::WStringT> wideLinkBase;
+  shared::WStringT wideLinkTarget;
+
 };
 
 
@@ -78,7 +173,23 @@ std::ostream &operator<<(std::ostream &stream, const RedirectionData &data);
 
 template <> inline void shared::dataAssign<RedirectionData>(RedirectionData &destination, const RedirectionData &source)
 {
+  // source may live in a different segment, so the base has to be interned again
+  destination.linkBase
+      = source.linkBase ? internLinkBase(source.linkBase->c_str(),
+                                         destination.linkTarget.get_allocator())
+                        : nullptr;
   destination.linkTarget.assign(source.linkTarget.c_str());
+  destination.wideLinkBase
+      = source.wideLinkBase ? internWideLinkBase(source.wideLinkBase->c_str(),
+                                                 destination.linkTarget.get_allocator())
+                            : nullptr;
+  destination.wideLinkTarget.assign(source.wideLinkTarget.c_str());
+}
+
+template <> inline size_t shared::dataSize<RedirectionData>(const RedirectionData &data)
+{
+  // the interned bases are shared between nodes and not counted
+  return data.linkTarget.size() + data.wideLinkTarget.size() * sizeof(wchar_t);
 }
 
 template <> inline RedirectionData shared::createDataEmpty<RedirectionData>(const VoidAllocatorT &allocator)
@@ -105,4 +216,27 @@ typedef shared::DirectoryTree<RedirectionData> RedirectionTree;
 typedef shared::TreeContainer<RedirectionTree> RedirectionTreeContainer;
 
 
+/**
+ * @return the full path of a node (utf-16). Paths of usual length are assembled on
+ *         the stack so only the result is allocated
+ */
+inline std::wstring widePath(const RedirectionTree &node)
+{
+  char buffer[260];
+  size_t length = node.path(buffer, sizeof(buffer));
+  return (length < sizeof(buffer))
+             ? shared::string_cast<std::wstring>(buffer, shared::CodePage::UTF8, length)
+             : shared::string_cast<std::wstring>(node.pathString(), shared::CodePage::UTF8);
+}
+
+/**
+ * @brief map every page of the segment the tree is currently in, so lookups don't
+ *        take a page fault on each page they touch for the first time. The pages are
+ *        read in bulk first where the system supports it (windows 8 and up).
+ *        Only safe while no other thread of the process can switch the tree to a
+ *        new segment
+ */
+void prefault(const RedirectionTreeContainer &tree);
+
+
 }
@@ -1,6 +1,7 @@
 #include "semaphore.h"
 #include <spdlog.h>
 #include <scopeguard.h>
+#include <etwprovider.h>
 
 
 RecursiveBenaphore::RecursiveBenaphore()
@@ -22,6 +23,11 @@ void RecursiveBenaphore::wait(DWORD timeout)
 
   if (::_InterlockedIncrement(&m_Counter) > 1) {
     if (tid != m_OwnerId) {
+      DWORD ownerId = m_OwnerId;
+      uint64_t waitStart = usvfs::shared::etw::enabled(usvfs::shared::etw::KEYWORD_LOCKS)
+                               ? usvfs::shared::etw::now()
+                               : 0;
+      bool stolen = false;
       int tries = 3;
       while (::WaitForSingleObject(m_Semaphore, timeout) != WAIT_OBJECT_0) {
         HANDLE owner = ::OpenThread(SYNCHRONIZE, FALSE, m_OwnerId);
@@ -32,11 +38,15 @@ void RecursiveBenaphore::wait(DWORD timeout)
           m_Recursion = 0;
           spdlog::get("usvfs")
               ->error("thread {} never released the mutex", m_OwnerId);
+          stolen = true;
           break;
         } else {
           --tries;
         }
       }
+      if (waitStart != 0) {
+        usvfs::shared::etw::lockWait(ownerId, waitStart, stolen);
+      }
     }
   }
   m_OwnerId = tid;
@@ -60,3 +70,145 @@ void RecursiveBenaphore::signal()
     }
   }
 }
+
+
+RecursiveSharedMutex::RecursiveSharedMutex()
+  : m_TLSIndex(::TlsAlloc())
+{
+  ::InitializeSRWLock(&m_Lock);
+}
+
+RecursiveSharedMutex::~RecursiveSharedMutex()
+{
+  ::TlsFree(m_TLSIndex);
+}
+
+UINT_PTR RecursiveSharedMutex::state() const
+{
+  // TlsGetValue resets the last error on success
+  DWORD lastError = ::GetLastError();
+  UINT_PTR result = reinterpret_cast<UINT_PTR>(::TlsGetValue(m_TLSIndex));
+  ::SetLastError(lastError);
+  return result;
+}
+
+void RecursiveSharedMutex::setState(UINT_PTR sharedDepth, UINT_PTR exclusiveDepth)
+{
+  ::TlsSetValue(m_TLSIndex, reinterpret_cast<LPVOID>((sharedDepth << DEPTH_BITS) | exclusiveDepth));
+}
+
+void RecursiveSharedMutex::lockShared()
+{
+  UINT_PTR current = state();
+  UINT_PTR sharedDepth = current >> DEPTH_BITS;
+  UINT_PTR exclusiveDepth = current & DEPTH_MASK;
+  if ((sharedDepth == 0) && (exclusiveDepth == 0)) {
+    ::AcquireSRWLockShared(&m_Lock);
+  }
+  setState(sharedDepth + 1, exclusiveDepth);
+}
+
+void RecursiveSharedMutex::unlockShared()
+{
+  UINT_PTR current = state();
+  UINT_PTR sharedDepth = current >> DEPTH_BITS;
+  UINT_PTR exclusiveDepth = current & DEPTH_MASK;
+  if (sharedDepth == 0) {
+    spdlog::get("usvfs")->error("shared unlock without lock");
+    return;
+  }
+  setState(sharedDepth - 1, exclusiveDepth);
+  if ((sharedDepth == 1) && (exclusiveDepth == 0)) {
+    ::ReleaseSRWLockShared(&m_Lock);
+  }
+}
+
+void RecursiveSharedMutex::lock()
+{
+  UINT_PTR current = state();
+  UINT_PTR sharedDepth = current >> DEPTH_BITS;
+  UINT_PTR exclusiveDepth = current & DEPTH_MASK;
+  if (exclusiveDepth == 0) {
+    if (sharedDepth > 0) {
+      // upgrade
+      ::ReleaseSRWLockShared(&m_Lock);
+    }
+    ::AcquireSRWLockExclusive(&m_Lock);
+  }
+  setState(sharedDepth, exclusiveDepth + 1);
+}
+
+void RecursiveSharedMutex::unlock()
+{
+  UINT_PTR current = state();
+  UINT_PTR sharedDepth = current >> DEPTH_BITS;
+  UINT_PTR exclusiveDepth = current & DEPTH_MASK;
+  if (exclusiveDepth == 0) {
+    spdlog::get("usvfs")->error("exclusive unlock without lock");
+    return;
+  }
+  setState(sharedDepth, exclusiveDepth - 1);
+  if (exclusiveDepth == 1) {
+    ::ReleaseSRWLockExclusive(&m_Lock);
+    if (sharedDepth > 0) {
+      // the thread still holds shared access from before the upgrade
+      ::AcquireSRWLockShared(&m_Lock);
+    }
+  }
+}
+
+bool RecursiveSharedMutex::tryLockShared()
+{
+  UINT_PTR current = state();
+  UINT_PTR sharedDepth = current >> DEPTH_BITS;
+  UINT_PTR exclusiveDepth = current & DEPTH_MASK;
+  if ((sharedDepth == 0) && (exclusiveDepth == 0)) {
+    if (!::TryAcquireSRWLockShared(&m_Lock)) {
+      return false;
+    }
+  }
+  setState(sharedDepth + 1, exclusiveDepth);
+  return true;
+}
+
+bool RecursiveSharedMutex::tryLock()
+{
+  UINT_PTR current = state();
+  UINT_PTR sharedDepth = current >> DEPTH_BITS;
+  UINT_PTR exclusiveDepth = current & DEPTH_MASK;
+  if (exclusiveDepth == 0) {
+    if ((sharedDepth > 0) || !::TryAcquireSRWLockExclusive(&m_Lock)) {
+      return false;
+    }
+  }
+  setState(sharedDepth, exclusiveDepth + 1);
+  return true;
+}
+
+
+unsigned int EpochDomain::enter()
+{
+  unsigned int epoch = m_Epoch.load() & 1;
+  // thread ids are multiples of 4 so the low bits carry no information
+  unsigned int slot = (::GetCurrentThreadId() >> 2) % SLOTS;
+  m_Slots[slot].active[epoch].fetch_add(1);
+  return (slot << 1) | epoch;
+}
+
+void EpochDomain::leave(unsigned int token)
+{
+  m_Slots[token >> 1].active[token & 1].fetch_sub(1, std::memory_order_release);
+}
+
+void EpochDomain::synchronize()
+{
+  std::lock_guard<std::mutex> lock(m_WriterMutex);
+  // new readers count towards the other parity from here on, so waiting for the
+  // old parity to drain terminates even with a constant stream of readers
+  unsigned int epoch = m_Epoch.fetch_add(1) & 1;
+  for (const Slot &slot : m_Slots) {
+    while (slot.active[epoch].load() != 0) {
+      ::Sleep(0);
+    }
+  }
+}
@@ -2,6 +2,8 @@
 
 
 #include <windows.h>
+#include <atomic>
+#include <mutex>
 
 
 // based on code by Jeff Preshing
@@ -32,3 +34,89 @@ private:
   HANDLE m_Semaphore;
 
 };
+
+
+// many-reader/single-writer lock that tolerates recursion. A thread holding the
+// lock in either mode can lock it again in either mode. Requesting exclusive access
+// while only holding shared access temporarily releases the shared lock (SRW locks
+// can't be upgraded), so the caller must not rely on state read before that point.
+
+class RecursiveSharedMutex
+{
+
+public:
+  RecursiveSharedMutex();
+  ~RecursiveSharedMutex();
+
+  RecursiveSharedMutex(const RecursiveSharedMutex&) = delete;
+  RecursiveSharedMutex &operator=(const RecursiveSharedMutex&) = delete;
+
+  void lockShared();
+  void unlockShared();
+
+  void lock();
+  void unlock();
+
+  // like lockShared/lock but fail instead of waiting. Recursive requests always
+  // succeed, an upgrade from shared to exclusive access always fails
+  bool tryLockShared();
+  bool tryLock();
+
+  // @return how often the calling thread currently holds exclusive access
+  UINT_PTR exclusiveDepth() const { return state() & DEPTH_MASK; }
+
+private:
+
+  // per-thread state is packed into the tls slot: shared depth in the upper half,
+  // exclusive depth in the lower half
+  static const UINT_PTR DEPTH_BITS = 15;
+  static const UINT_PTR DEPTH_MASK = (1 << DEPTH_BITS) - 1;
+
+  UINT_PTR state() const;
+  void setState(UINT_PTR sharedDepth, UINT_PTR exclusiveDepth);
+
+private:
+
+  SRWLOCK m_Lock;
+  DWORD m_TLSIndex;
+
+};
+
+
+// minimal epoch based reclamation for process-local data published through an
+// atomic pointer. Readers bracket their access with enter/leave which only touch a
+// counter in a slot chosen by thread id, writers call synchronize after unpublishing
+// an object and may free it once that returns.
+// Readers must not call synchronize (or anything waiting on it) inside a section.
+
+class EpochDomain
+{
+
+public:
+  EpochDomain() = default;
+
+  EpochDomain(const EpochDomain&) = delete;
+  EpochDomain &operator=(const EpochDomain&) = delete;
+
+  // @return token to pass to leave
+  unsigned int enter();
+  void leave(unsigned int token);
+
+  // wait until all readers that may have seen a previously published object left
+  void synchronize();
+
+private:
+
+  static const unsigned int SLOTS = 64;
+
+  struct alignas(64) Slot {
+    std::atomic<long> active[2];
+  };
+
+private:
+
+  std::atomic<unsigned int> m_Epoch{0};
+  Slot m_Slots[SLOTS] {};
+  std::mutex m_WriterMutex;
+
+};
@@ -0,0 +1,166 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "treedump.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace usvfs {
+
+namespace {
+
+static const char BINARY_MAGIC[4] = { 'U', 'S', 'V', 'D' };
+static const uint32_t BINARY_VERSION = 1;
+static const uint16_t BINARY_DIRECTORY = 0x01;
+static const uint16_t BINARY_LINKED    = 0x02;
+
+// collects output in a fixed buffer and hands it to the sink whenever it's full
+class ChunkWriter {
+public:
+  static const size_t BUFFER_SIZE = 64 * 1024;
+
+  explicit ChunkWriter(const DumpSinkT &sink)
+    : m_Sink(sink)
+    , m_Buffer(BUFFER_SIZE)
+  {}
+
+  void write(const char *data, size_t size) {
+    while ((size > 0) && !m_Failed) {
+      size_t chunk = std::min(size, BUFFER_SIZE - m_Used);
+      memcpy(&m_Buffer[m_Used], data, chunk);
+      m_Used += chunk;
+      data += chunk;
+      size -= chunk;
+      if (m_Used == BUFFER_SIZE) {
+        flush();
+      }
+    }
+  }
+
+  void fill(char ch, size_t count) {
+    while ((count > 0) && !m_Failed) {
+      size_t chunk = std::min(count, BUFFER_SIZE - m_Used);
+      memset(&m_Buffer[m_Used], ch, chunk);
+      m_Used += chunk;
+      count -= chunk;
+      if (m_Used == BUFFER_SIZE) {
+        flush();
+      }
+    }
+  }
+
+  void writeUInt16(uint16_t value) {
+    char bytes[2] = { static_cast<char>(value & 0xff), static_cast<char>(value >> 8) };
+    write(bytes, sizeof(bytes));
+  }
+
+  void writeUInt32(uint32_t value) {
+    writeUInt16(static_cast<uint16_t>(value & 0xffff));
+    writeUInt16(static_cast<uint16_t>(value >> 16));
+  }
+
+  bool flush() {
+    if (!m_Failed && (m_Used > 0)) {
+      m_Failed = !m_Sink(m_Buffer.data(), m_Used);
+      m_Used = 0;
+    }
+    return !m_Failed;
+  }
+
+  bool failed() const { return m_Failed; }
+
+private:
+  const DumpSinkT &m_Sink;
+  std::vector<char> m_Buffer;
+  size_t m_Used{0};
+  bool m_Failed{false};
+};
+
+void writeTarget(ChunkWriter &writer, const RedirectionData &data, size_t limit)
+{
+  if (data.linkBase) {
+    size_t size = std::min(limit, data.linkBase->size());
+    writer.write(data.linkBase->c_str(), size);
+    limit -= size;
+  }
+  writer.write(data.linkTarget.c_str(), std::min(limit, data.linkTarget.size()));
+}
+
+size_t targetSize(const RedirectionData &data)
+{
+  return (data.linkBase ? data.linkBase->size() : 0) + data.linkTarget.size();
+}
+
+void dumpText(ChunkWriter &writer, const RedirectionTree &node, size_t level)
+{
+  writer.fill(' ', level);
+  writer.write(node.nameRef().c_str(), node.nameRef().size());
+  writer.write(" -> ", 4);
+  writeTarget(writer, node.data(), SIZE_MAX);
+  writer.write("\n", 1);
+  for (auto iter = node.filesBegin(); (iter != node.filesEnd()) && !writer.failed();
+       ++iter) {
+    dumpText(writer, *iter->second, level + 1);
+  }
+}
+
+void dumpBinary(ChunkWriter &writer, const RedirectionTree &node, size_t level)
+{
+  uint16_t flags = 0;
+  if (node.isDirectory()) {
+    flags |= BINARY_DIRECTORY;
+  }
+  if (node.data().hasTarget()) {
+    flags |= BINARY_LINKED;
+  }
+  size_t nameSize = std::min<size_t>(node.nameRef().size(), UINT16_MAX);
+  size_t linkSize = std::min<size_t>(targetSize(node.data()), UINT16_MAX);
+
+  writer.writeUInt16(static_cast<uint16_t>(std::min<size_t>(level, UINT16_MAX)));
+  writer.writeUInt16(flags);
+  writer.writeUInt16(static_cast<uint16_t>(nameSize));
+  writer.writeUInt16(static_cast<uint16_t>(linkSize));
+  writer.write(node.nameRef().c_str(), nameSize);
+  writeTarget(writer, node.data(), linkSize);
+  for (auto iter = node.filesBegin(); (iter != node.filesEnd()) && !writer.failed();
+       ++iter) {
+    dumpBinary(writer, *iter->second, level + 1);
+  }
+}
+
+}
+
+bool dumpRedirectionTree(const RedirectionTree &tree, DumpFormat format,
+                         const DumpSinkT &sink)
+{
+  ChunkWriter writer(sink);
+  if (format == DumpFormat::Binary) {
+    writer.write(BINARY_MAGIC, sizeof(BINARY_MAGIC));
+    writer.writeUInt32(BINARY_VERSION);
+    dumpBinary(writer, tree, 0);
+  } else {
+    dumpText(writer, tree, 0);
+  }
+  return writer.flush();
+}
+
+}
@@ -0,0 +1,48 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include "redirectiontree.h"
+#include <functional>
+
+namespace usvfs {
+
+enum class DumpFormat {
+  Text,  // the readable format of CreateVFSDump
+  Binary // compact format described at CreateVFSDumpStream in usvfs.h
+};
+
+/**
+ * @brief receives a dump piece by piece
+ * @return false to stop the dump
+ */
+typedef std::function<bool (const char *data, size_t size)> DumpSinkT;
+
+/**
+ * @brief walk the tree once and pass the dump to sink in chunks of bounded size.
+ *        Names and targets are written straight from the tree without building
+ *        intermediate strings
+ * @return false if the sink stopped the dump
+ */
+bool dumpRedirectionTree(const RedirectionTree &tree, DumpFormat format,
+                         const DumpSinkT &sink);
+
+}
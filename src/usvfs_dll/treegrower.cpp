@@ -0,0 +1,74 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "treegrower.h"
+#include <spdlog.h>
+#include <memory>
+
+namespace usvfs {
+
+TreeGrower::TreeGrower(const std::vector<std::string> &shmNames,
+                       std::chrono::milliseconds interval)
+  : m_SHMNames(shmNames)
+  , m_Interval(interval)
+{
+  m_Thread = std::thread([this] () { run(); });
+}
+
+TreeGrower::~TreeGrower()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Stop = true;
+  }
+  m_StopRequested.notify_all();
+  m_Thread.join();
+}
+
+void TreeGrower::run()
+{
+  // containers of our own, the ones of the hook context belong to the api threads
+  std::vector<std::unique_ptr<RedirectionTreeContainer>> trees;
+  try {
+    for (const std::string &name : m_SHMNames) {
+      trees.emplace_back(new RedirectionTreeContainer(name));
+    }
+  } catch (const std::exception &e) {
+    spdlog::get("usvfs")->error("failed to attach tree grower: {}", e.what());
+    return;
+  }
+
+  std::unique_lock<std::mutex> lock(m_Mutex);
+  while (!m_StopRequested.wait_for(lock, m_Interval, [this] () { return m_Stop; })) {
+    lock.unlock();
+    for (const auto &tree : trees) {
+      try {
+        if (tree->growIfLow()) {
+          spdlog::get("usvfs")->info("grew {} ahead of time", tree->shmName());
+        }
+      } catch (const std::exception &e) {
+        spdlog::get("usvfs")->warn("failed to grow {}: {}", tree->shmName(), e.what());
+      }
+    }
+    lock.lock();
+  }
+}
+
+}
@@ -0,0 +1,72 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include "redirectiontree.h"
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace usvfs {
+
+/**
+ * @brief grows the trees of the vfs ahead of time on a background thread of the
+ *        controlling process. The thread attaches to the trees on its own and moves
+ *        each to a larger segment once its free space drops below the watermark, so
+ *        hooked calls in the game processes find room for new nodes instead of
+ *        copying the whole tree on the game's thread. Writers in other processes
+ *        only have to switch to the new segment
+ */
+class TreeGrower
+{
+public:
+
+  /**
+   * @param shmNames names of the current segments of the trees to watch
+   * @param interval time between two checks of the free space
+   */
+  TreeGrower(const std::vector<std::string> &shmNames, std::chrono::milliseconds interval);
+  ~TreeGrower();
+
+  TreeGrower(const TreeGrower&) = delete;
+  TreeGrower &operator=(const TreeGrower&) = delete;
+
+private:
+
+  void run();
+
+private:
+
+  std::vector<std::string> m_SHMNames;
+  std::chrono::milliseconds m_Interval;
+
+  std::mutex m_Mutex;
+  std::condition_variable m_StopRequested;
+  bool m_Stop { false };
+
+  std::thread m_Thread;
+
+};
+
+}
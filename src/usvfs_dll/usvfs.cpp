@@ -22,7 +22,20 @@ along with usvfs. If not, see <http://www.gnu.org/licenses/>.
 #include "usvfs_version.h"
 #include "hookmanager.h"
 #include "redirectiontree.h"
+#include "directorywalker.h"
+#include "changemonitor.h"
+#include "processregistry.h"
+#include "projection.h"
+#include "treegrower.h"
+#include "vfssnapshot.h"
+#include "foldednameset.h"
 #include "loghelpers.h"
+#include "hooktrace.h"
+#include "inicache.h"
+#include "maptracker.h"
+#include "readahead.h"
+#include "treedump.h"
+#include "hooks/kernel32.h"
 #include <DbgHelp.h>
 #include <ctime>
 #include <shmlogger.h>
@@ -34,7 +47,11 @@ along with usvfs. If not, see <http://www.gnu.org/licenses/>.
 #include <boost/dll/runtime_symbol_info.hpp>
 #include <ttrampolinepool.h>
 #include <scopeguard.h>
+#include <flattree.h>
+#include <layerindex.h>
 #include <stringcast.h>
+#include <windows_error.h>
+#include <etwprovider.h>
 #include <inject.h>
 #include <spdlog.h>
 #pragma warning (push, 3)
@@ -45,6 +62,9 @@ along with usvfs. If not, see <http://www.gnu.org/licenses/>.
 #include <stdio.h>
 #include <Psapi.h>
 #include <filesystem>
+#include <map>
+#include <set>
+#include <mutex>
 
 
 namespace bfs = boost::filesystem;
@@ -60,10 +80,177 @@ HMODULE dllModule = nullptr;
 PVOID exceptionHandler = nullptr;
 CrashDumpsType usvfs_dump_type = CrashDumpsType::None;
 std::wstring usvfs_dump_path;
+// proxy of our own bitness that writes dumps from outside of the crashed process, empty
+// if it wasn't found
+std::wstring usvfs_dump_proxy;
+// command line of the proxy, built up front up to the parts only known once a thread
+// crashed. The handler appends those in place instead of allocating
+std::vector<wchar_t> usvfs_dump_command;
+size_t usvfs_dump_command_length = 0;
+// set while a crashed thread has the proxy write its dump
+volatile LONG usvfs_dump_active = 0;
+// code section of the usvfs dll. Determined once before the exception handler is
+// installed so the handler doesn't have to parse the pe headers on every exception
+std::pair<uintptr_t, uintptr_t> usvfs_code_range { 0, 0 };
+
+// phases of our own start and of the last CreateProcessHooked, see GetStartupTimings
+static StartupTimings startupTimings = {};
 
 typedef std::codecvt_utf8_utf16<wchar_t> u8u16_convert;
 
-static std::set<std::string> extensions { ".exe", ".dll" };
+// extensions (lower case) of the files entered in the inverse table. It's only
+// consulted by GetModuleFileName so by default it holds executables and libraries
+static std::set<std::string> inverseExtensions { ".exe", ".dll" };
+// set when links were made without entering them in the inverse table, it's rebuilt
+// from the redirection table before a process may need it
+static std::atomic<bool> inverseTableStale { false };
+static std::mutex inverseTableMutex;
+
+// while a batch is active, link operations go to this staging table instead of the
+// shared one. CommitVFSBatch publishes it in one step
+std::unique_ptr<usvfs::RedirectionTreeContainer> batchTable;
+
+static const size_t BATCH_SEGMENT_SIZE = 16 * 1024 * 1024;
+
+// frozen copy of the redirection table created by FreezeVFS. Has to stay open as long
+// as processes may look it up
+std::unique_ptr<usvfs::shared::FlatTreeSegment> frozenTree;
+
+// directory links in the order they were made, later ones take precedence. Stored in
+// snapshots so changed directories can be relinked on load
+static std::vector<usvfs::DirectoryLink> linkHistory;
+
+// hard links created for LINKFLAG_MATERIALIZE in the staging directory, deleted along
+// with the mappings. The file id identifies the link, a file that replaced it in the
+// meantime is left alone
+struct MaterializedLink {
+  std::wstring path;
+  DWORD volumeSerial;
+  DWORD indexHigh;
+  DWORD indexLow;
+};
+static std::vector<MaterializedLink> materializedLinks;
+// staging directories used by this process, leftovers of earlier sessions in them
+// have been removed
+static std::set<std::wstring> stagingDirectories;
+// each materialized directory link gets its own directory below the staging directory
+static unsigned int materializeCount = 0;
+
+// layers added with VirtualLinkLayer and the link flags of each
+static usvfs::shared::LayerIndex layerIndex;
+static std::map<unsigned int, unsigned int> layerFlags;
+
+// directories linked with LINKFLAG_MONITORCHANGES in the order they were linked. The
+// index is the id of the watch
+static std::vector<usvfs::DirectoryLink> monitoredLinks;
+static std::mutex monitoredLinksMutex;
+// not destroyed on unload, joining the monitor thread under the loader lock would hang
+static usvfs::ChangeMonitor *changeMonitor = nullptr;
+
+// grows the trees ahead of time so hooked calls rarely have to. Like the change
+// monitor this isn't destroyed on unload
+static usvfs::TreeGrower *treeGrower = nullptr;
+static const std::chrono::milliseconds TREE_GROWER_INTERVAL(500);
+
+// projection started by StartVFSProjection. Stopping it waits for its callbacks, so it
+// isn't destroyed on unload either
+static usvfs::Projection *projection = nullptr;
+
+// tracks the processes using the vfs, created on the first GetVFSProcessList. Queries
+// keep their own reference so DisconnectVFS can't destroy it while they run
+static std::shared_ptr<usvfs::ProcessRegistry> processes;
+static std::mutex processesMutex;
+
+static std::shared_ptr<usvfs::ProcessRegistry> processRegistry()
+{
+  std::lock_guard<std::mutex> lock(processesMutex);
+  if (!processes) {
+    processes = std::make_shared<usvfs::ProcessRegistry>();
+  }
+  return processes;
+}
+
+static void stopMonitoring(bool shutdown);
+static void removeMaterializedLinks();
+
+static usvfs::RedirectionTreeContainer &linkTable()
+{
+  return batchTable ? *batchTable : context->redirectionTable();
+}
+
+static bool inverseLinked(const std::string &name)
+{
+  return inverseExtensions.find(ba::to_lower_copy(bfs::extension(name)))
+         != inverseExtensions.end();
+}
+
+/**
+ * @brief collect the inverse links of all files below a node of the redirection table
+ * @param pathU8 virtual path of the node
+ */
+static void collectInverseLinks(
+    const usvfs::RedirectionTree &node, const std::string &pathU8,
+    std::vector<usvfs::shared::TreeInsertion<usvfs::RedirectionDataLocal>> &links)
+{
+  for (auto iter = node.filesBegin(); iter != node.filesEnd(); ++iter) {
+    const usvfs::RedirectionTree *child = iter->second.get().get();
+    std::string name = child->name();
+    if (!child->isDirectory() && child->data().hasTarget() && inverseLinked(name)) {
+      links.emplace_back(bfs::path(child->data().target()),
+                         usvfs::RedirectionDataLocal(pathU8 + "\\", name));
+    }
+    if (child->numNodes() != 0) {
+      collectInverseLinks(*child, pathU8.empty() ? name : pathU8 + "\\" + name, links);
+    }
+  }
+}
+
+/**
+ * @brief rebuild the inverse table from the redirection table if links were made
+ *        without entering them
+ */
+static void updateInverseTable()
+{
+  std::lock_guard<std::mutex> lock(inverseTableMutex);
+  if (!inverseTableStale.exchange(false)) {
+    return;
+  }
+  std::vector<usvfs::shared::TreeInsertion<usvfs::RedirectionDataLocal>> links;
+  if (!inverseExtensions.empty()) {
+    collectInverseLinks(*context->redirectionTable().get(), std::string(), links);
+  }
+  usvfs::RedirectionTreeContainer &inverseTable = context->inverseTable();
+  inverseTable.clear();
+  if (!links.empty()) {
+    inverseTable.addNodes(links);
+  }
+  // publishes the new generation of the inverse table to the hooked processes
+  context->updateParameters();
+  spdlog::get("usvfs")->debug("rebuilt inverse table ({} files)", links.size());
+}
+
+/**
+ * @brief the inverse table to enter links into along with the redirection table. As
+ *        long as no process is registered or a batch is active that work is deferred,
+ *        the inverse table is rebuilt once before it's needed instead
+ * @return the inverse table or nullptr if inverse links are deferred
+ */
+static usvfs::RedirectionTreeContainer *linkInverseTable()
+{
+  if (batchTable || inverseExtensions.empty() || context->registeredProcesses().empty()) {
+    inverseTableStale = true;
+    return nullptr;
+  }
+  updateInverseTable();
+  return &context->inverseTable();
+}
+
+static void linksUpdated()
+{
+  if (!batchTable) {
+    context->updateParameters();
+  }
+}
 
 namespace spdlog {
   namespace sinks {
@@ -94,36 +281,75 @@ char *SeverityShort(LogLevel lvl)
 }
 
 
-void InitLoggingInternal(bool toConsole, bool connectExistingSHM)
+// the log queue messages are written to, empty if they go to the console
+static std::string logQueue;
+
+/**
+ * @return name of the log queue of an instance. Processes that aren't connected to an
+ *         instance yet use the default queue
+ */
+static std::string logQueueName(const char *instanceName)
+{
+  return ((instanceName != nullptr) && (instanceName[0] != '\0')) ? instanceName
+                                                                    : "usvfs";
+}
+
+static void createLoggers(bool toConsole, spdlog::level::level_enum level)
+{
+  // replaces the temporary logger or the one of the previous queue
+  spdlog::drop("usvfs");
+  auto logger = toConsole ? spdlog::create<spdlog::sinks::stdout_sink_mt>("usvfs")
+                          : spdlog::create<spdlog::sinks::shm_sink>("usvfs", logQueue.c_str());
+  logger->set_pattern("%H:%M:%S.%e [%L] %v");
+  logger->set_level(level);
+
+  spdlog::drop("hooks");
+  logger = toConsole ? spdlog::create<spdlog::sinks::stdout_sink_mt>("hooks")
+                     : spdlog::create<spdlog::sinks::shm_sink>("hooks", logQueue.c_str());
+  logger->set_pattern("%H:%M:%S.%e <%P:%t> [%L] %v");
+  logger->set_level(level);
+}
+
+/**
+ * @brief send the log messages of this process to the queue of an instance. Does
+ *        nothing if messages go to the console
+ */
+static void useLogQueue(const char *instanceName)
+{
+  std::string queue = logQueueName(instanceName);
+  if (logQueue.empty() || (queue == logQueue)) {
+    return;
+  }
+  try {
+    spdlog::level::level_enum level = spdlog::get("usvfs")->level();
+    SHMLogger::rename(queue.c_str());
+    logQueue = queue;
+    createLoggers(false, level);
+  } catch (const std::exception &e) {
+    if (spdlog::get("usvfs").get() == nullptr) {
+      spdlog::create<spdlog::sinks::null_sink>("usvfs");
+    }
+    if (spdlog::get("hooks").get() == nullptr) {
+      spdlog::create<spdlog::sinks::null_sink>("hooks");
+    }
+    spdlog::get("usvfs")->error("failed to switch to log queue {}: {}", queue, e.what());
+  }
+}
+
+void InitLoggingInternal(bool toConsole, bool connectExistingSHM,
+                         const char *instanceName = nullptr)
 {
   try {
+    std::string queue = logQueueName(instanceName);
     if (!toConsole && !SHMLogger::isInstantiated()) {
       if (connectExistingSHM) {
-        SHMLogger::open("usvfs");
+        SHMLogger::open(queue.c_str());
       } else {
-        SHMLogger::create("usvfs");
+        SHMLogger::create(queue.c_str());
       }
     }
-
-    // a temporary logger was created in DllMain
-    spdlog::drop("usvfs");
-    #pragma message("need a customized name for the shm")
-    auto logger = spdlog::get("usvfs");
-    if (logger.get() == nullptr) {
-      logger = toConsole ? spdlog::create<spdlog::sinks::stdout_sink_mt>("usvfs")
-                         : spdlog::create<spdlog::sinks::shm_sink>("usvfs", "usvfs");
-      logger->set_pattern("%H:%M:%S.%e [%L] %v");
-    }
-    logger->set_level(spdlog::level::debug);
-
-    spdlog::drop("hooks");
-    logger = spdlog::get("hooks");
-    if (logger.get() == nullptr) {
-      logger = toConsole ? spdlog::create<spdlog::sinks::stdout_sink_mt>("hooks")
-                         : spdlog::create<spdlog::sinks::shm_sink>("hooks", "usvfs");
-      logger->set_pattern("%H:%M:%S.%e <%P:%t> [%L] %v");
-    }
-    logger->set_level(spdlog::level::debug);
+    logQueue = toConsole ? std::string() : queue;
+    createLoggers(toConsole, spdlog::level::debug);
   } catch (const std::exception&) {
     // TODO should really report this
     //OutputDebugStringA((boost::format("init exception: %1%\n") % e.what()).str().c_str());
@@ -135,6 +361,8 @@ void InitLoggingInternal(bool toConsole, bool connectExistingSHM)
     }
   }
 
+  usvfs::log::updateCallLogging();
+
   spdlog::get("usvfs")->info("usvfs dll {} initialized in process {}", USVFS_VERSION_STRING, GetCurrentProcessId());
 }
 
@@ -162,10 +390,24 @@ extern "C" DLLEXPORT bool WINAPI GetLogMessages(char *buffer, size_t size,
   }
 }
 
+extern "C" DLLEXPORT size_t WINAPI GetLogMessagesBatch(char *buffer, size_t size,
+                                                       bool blocking)
+{
+  buffer[0] = '\0';
+  try {
+    return SHMLogger::instance().getBatch(buffer, size, blocking);
+  } catch (const std::exception &e) {
+    _snprintf_s(buffer, size, _TRUNCATE, "Failed to retrieve log messages: %s",
+               e.what());
+    return 0;
+  }
+}
+
 void SetLogLevel(LogLevel level)
 {
   spdlog::get("usvfs")->set_level(ConvertLogLevel(level));
   spdlog::get("hooks")->set_level(ConvertLogLevel(level));
+  usvfs::log::updateCallLogging();
 }
 
 extern "C" void WINAPI USVFSUpdateParams(LogLevel level, CrashDumpsType type)
@@ -264,16 +506,112 @@ int WINAPI CreateMiniDump(PEXCEPTION_POINTERS exceptionPtrs, CrashDumpsType type
   return res;
 }
 
+// how long a crashed thread waits for the proxy to write its dump
+static const DWORD DUMP_PROXY_TIMEOUT = 60000;
+// room left behind the prepared proxy command line for the crash specific arguments
+static const size_t DUMP_COMMAND_RESERVE = 96;
+
+static wchar_t *appendText(wchar_t *pos, const wchar_t *text)
+{
+  while (*text != L'\0') {
+    *pos++ = *text++;
+  }
+  return pos;
+}
+
+static wchar_t *appendNumber(wchar_t *pos, uint64_t value)
+{
+  wchar_t digits[20];
+  int count = 0;
+  do {
+    digits[count++] = static_cast<wchar_t>(L'0' + value % 10);
+    value /= 10;
+  } while (value != 0);
+  while (count > 0) {
+    *pos++ = digits[--count];
+  }
+  return pos;
+}
+
+/**
+ * @brief quote an argument so CommandLineToArgvW reads it back unchanged
+ */
+static std::wstring quoteArgument(const std::wstring &argument)
+{
+  // backslashes are only special in front of a quote, that includes the closing one
+  std::wstring result(L"\"");
+  size_t backslashes = 0;
+  for (wchar_t ch : argument) {
+    if (ch == L'"') {
+      result.append(backslashes + 1, L'\\');
+    }
+    backslashes = ch == L'\\' ? backslashes + 1 : 0;
+    result.push_back(ch);
+  }
+  result.append(backslashes, L'\\');
+  result.push_back(L'"');
+  return result;
+}
+
+/**
+ * @brief have the proxy write the dump of the current process. The crashed thread only
+ *        waits, loading dbghelp and walking the process memory happen in the proxy.
+ *        Runs inside the exception handler so it neither allocates nor goes through
+ *        our hooks
+ * @return true if the proxy wrote the dump
+ */
+static bool createMiniDumpInProxy(PEXCEPTION_POINTERS exceptionPtrs)
+{
+  if (usvfs_dump_command.empty()) {
+    return false;
+  }
+  // the command buffer is shared, further threads crashing meanwhile write their
+  // dumps in-process
+  if (InterlockedCompareExchange(&usvfs_dump_active, 1, 0) != 0) {
+    return false;
+  }
+  ON_BLOCK_EXIT([] () { InterlockedExchange(&usvfs_dump_active, 0); });
+
+  wchar_t *pos = usvfs_dump_command.data() + usvfs_dump_command_length;
+  pos = appendText(pos, L" --tid ");
+  pos = appendNumber(pos, ::GetCurrentThreadId());
+  pos = appendText(pos, L" --exception ");
+  pos = appendNumber(pos, reinterpret_cast<uintptr_t>(exceptionPtrs));
+  *pos = L'\0';
+
+  STARTUPINFOW startupInfo = { sizeof(STARTUPINFOW) };
+  PROCESS_INFORMATION processInfo = {};
+  // once hooked the trampoline calls the original function directly, before that
+  // CreateProcessW isn't hooked yet
+  BOOL created
+      = (manager != nullptr) && (usvfs::CreateProcessInternalW != nullptr)
+            ? usvfs::CreateProcessInternalW(nullptr, usvfs_dump_proxy.c_str(),
+                                            usvfs_dump_command.data(), nullptr, nullptr,
+                                            FALSE, 0, nullptr, nullptr, &startupInfo,
+                                            &processInfo, nullptr)
+            : ::CreateProcessW(usvfs_dump_proxy.c_str(), usvfs_dump_command.data(),
+                               nullptr, nullptr, FALSE, 0, nullptr, nullptr,
+                               &startupInfo, &processInfo);
+  if (!created) {
+    return false;
+  }
+  ::CloseHandle(processInfo.hThread);
+  ON_BLOCK_EXIT([&processInfo] () { ::CloseHandle(processInfo.hProcess); });
+
+  DWORD exitCode = 1;
+  return (WaitForSingleObject(processInfo.hProcess, DUMP_PROXY_TIMEOUT) == WAIT_OBJECT_0)
+         && GetExitCodeProcess(processInfo.hProcess, &exitCode) && (exitCode == 0);
+}
+
 static bool exceptionInUSVFS(PEXCEPTION_POINTERS exceptionPtrs) {
-  if (!dllModule) // shouldn't happend, check just in case
+  if (usvfs_code_range.second == 0) // shouldn't happend, check just in case
     return true;  // create dump to better understand how this could happend
 
-  std::pair<uintptr_t, uintptr_t> range = winapi::ex::getSectionRange(dllModule);
-
   uintptr_t exceptionAddress =
     reinterpret_cast<uintptr_t>(exceptionPtrs->ExceptionRecord->ExceptionAddress);
 
-  return range.first <= exceptionAddress && exceptionAddress < range.second;
+  return usvfs_code_range.first <= exceptionAddress
+         && exceptionAddress < usvfs_code_range.second;
 }
 
 LONG WINAPI VEHandler(PEXCEPTION_POINTERS exceptionPtrs)
@@ -281,6 +619,16 @@ LONG WINAPI VEHandler(PEXCEPTION_POINTERS exceptionPtrs)
   // NOTICE: don't use logger in VEHandler as it can cause another fault causing VEHandler
   // to be called again and so on.
 
+  // VEHandler is called on "first-chance" exceptions which might be caught and handled.
+  // Ideally we would like to use an UnhandledExceptionFilter but that fails to catch crashes
+  // inside our hooks at least on x64, which is the main reason why want a crash collection
+  // from usvfs.
+  // As a workaround/compromise we catch vectored exception but only ones that originate
+  // direactly within the usvfs code. Some games raise exceptions all the time so this is
+  // tested first, against the range cached in InitHooks:
+  if (!exceptionInUSVFS(exceptionPtrs))
+    return EXCEPTION_CONTINUE_SEARCH;
+
   if (   (exceptionPtrs->ExceptionRecord->ExceptionCode  < 0x80000000)      // non-critical
       || (exceptionPtrs->ExceptionRecord->ExceptionCode == 0xe06d7363)) {   // cpp exception
     // don't report non-critical exceptions
@@ -294,15 +642,6 @@ LONG WINAPI VEHandler(PEXCEPTION_POINTERS exceptionPtrs)
   }
   */
 
-  // VEHandler is called on "first-chance" exceptions which might be caught and handled.
-  // Ideally we would like to use an UnhandledExceptionFilter but that fails to catch crashes
-  // inside our hooks at least on x64, which is the main reason why want a crash collection
-  // from usvfs.
-  // As a workaround/compromise we catch vectored exception but only ones that originate
-  // direactly within the usvfs code:
-  if (!exceptionInUSVFS(exceptionPtrs))
-    return EXCEPTION_CONTINUE_SEARCH;
-
   // disable our hooking mechanism to increase chances the dump writing won't crash
   HookLib::TrampolinePool& trampPool = HookLib::TrampolinePool::instance();
   if (&trampPool) { // need to test this in case of crash before TrampolinePool initialized
@@ -310,7 +649,9 @@ LONG WINAPI VEHandler(PEXCEPTION_POINTERS exceptionPtrs)
     trampPool.setBlock(true);
   }
 
-  CreateMiniDump(exceptionPtrs, usvfs_dump_type, usvfs_dump_path.c_str());
+  if (!createMiniDumpInProxy(exceptionPtrs)) {
+    CreateMiniDump(exceptionPtrs, usvfs_dump_type, usvfs_dump_path.c_str());
+  }
 
   return EXCEPTION_CONTINUE_SEARCH;
 }
@@ -319,19 +660,141 @@ LONG WINAPI VEHandler(PEXCEPTION_POINTERS exceptionPtrs)
 // Exported functions
 //
 
-void __cdecl InitHooks(LPVOID parameters, size_t)
+/**
+ * @brief open the configuration the parent located for us and validate the handle it
+ *        passed
+ * @return the shared parameters or nullptr if the handoff is unusable
+ */
+static usvfs::SharedParameters *connectHandoff(const usvfs::InjectionHandoff &handoff,
+                                               std::unique_ptr<ush::SharedMemoryT> &configuration)
+{
+  if (handoff.magic != usvfs::INJECTION_HANDOFF_MAGIC) {
+    return nullptr;
+  }
+  std::string instanceName(handoff.instanceName,
+                           strnlen(handoff.instanceName, sizeof(handoff.instanceName)));
+  try {
+    configuration.reset(new ush::SharedMemoryT(bip::open_only, instanceName.c_str()));
+  } catch (const bip::interprocess_exception &e) {
+    spdlog::get("usvfs")->error("failed to open configuration {}: {}", instanceName, e.what());
+    return nullptr;
+  }
+  if ((handoff.parametersHandle == 0)
+      || (handoff.parametersHandle + sizeof(usvfs::SharedParameters)
+          > configuration->get_size())) {
+    return nullptr;
+  }
+  auto *result = static_cast<usvfs::SharedParameters *>(configuration->get_address_from_handle(
+      static_cast<ush::SharedMemoryT::handle_t>(handoff.parametersHandle)));
+  if (result->instanceName != instanceName.c_str()) {
+    return nullptr;
+  }
+  return result;
+}
+
+/**
+ * @brief determine everything the exception handler needs up front
+ */
+static void prepareCrashHandling(const USVFSParameters &params)
+{
+  if (dllModule == nullptr) {
+    return;
+  }
+  usvfs_code_range = winapi::ex::getSectionRange(dllModule);
+
+  static constexpr auto USVFS_PROXY_EXE =
+#ifdef _WIN64
+    L"usvfs_proxy_x64.exe";
+#else
+    L"usvfs_proxy_x86.exe";
+#endif
+  bfs::path proxy = bfs::path(winapi::wide::getModuleFileName(dllModule)).parent_path()
+                    / USVFS_PROXY_EXE;
+  boost::system::error_code ec;
+  if (bfs::exists(proxy, ec)) {
+    usvfs_dump_proxy = proxy.wstring();
+    std::wstring command
+        = quoteArgument(usvfs_dump_proxy)
+          + L" --instance " + quoteArgument(ush::string_cast<std::wstring>(params.instanceName))
+          + L" --dump"
+          + L" --pid " + std::to_wstring(::GetCurrentProcessId())
+          + L" --type " + std::to_wstring(static_cast<int>(usvfs_dump_type))
+          + L" --path " + quoteArgument(usvfs_dump_path);
+    usvfs_dump_command_length = command.length();
+    usvfs_dump_command.assign(command.begin(), command.end());
+    usvfs_dump_command.resize(usvfs_dump_command_length + DUMP_COMMAND_RESERVE, L'\0');
+  } else {
+    spdlog::get("usvfs")->info("{} not found, crash dumps are written in-process",
+                               ush::string_cast<std::string>(proxy.wstring()));
+  }
+}
+
+static uint64_t nanosecondsSince(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start).count();
+}
+
+void __cdecl InitHooks(LPVOID parameters, size_t size)
 {
-  InitLoggingInternal(false, true);
+  auto initStart = std::chrono::steady_clock::now();
+  ON_BLOCK_EXIT([&initStart] () {
+    startupTimings.initHooksNanoseconds = nanosecondsSince(initStart);
+  });
+
+  if (spdlog::get("usvfs").get() == nullptr) {
+    // create temporary logger until we know which queue to log to
+    spdlog::create<spdlog::sinks::null_sink>("usvfs");
+  }
 
   const USVFSParameters *params = reinterpret_cast<USVFSParameters *>(parameters);
+
+  // children of connected processes only receive where to find the configuration
+  USVFSParameters handoffParams;
+  std::unique_ptr<ush::SharedMemoryT> configuration;
+  usvfs::SharedParameters *sharedParams = nullptr;
+  if (size == sizeof(usvfs::InjectionHandoff)) {
+    const auto *handoff = reinterpret_cast<const usvfs::InjectionHandoff *>(parameters);
+    auto handoffStart = std::chrono::steady_clock::now();
+    sharedParams = connectHandoff(*handoff, configuration);
+    startupTimings.attachNanoseconds = nanosecondsSince(handoffStart);
+    if (sharedParams == nullptr) {
+      InitLoggingInternal(false, true,
+                          std::string(handoff->instanceName,
+                                      strnlen(handoff->instanceName,
+                                              sizeof(handoff->instanceName))).c_str());
+      spdlog::get("usvfs")->critical("invalid injection handoff in process {}",
+                                     ::GetCurrentProcessId());
+      return;
+    }
+    handoffParams = sharedParams->makeLocal();
+    handoffParams.mappingCapacity = handoff->mappingCapacity;
+    params = &handoffParams;
+  }
+  // every instance has its own log queue so instances don't contend on one
+  InitLoggingInternal(false, true, params->instanceName);
+
   usvfs_dump_type = params->crashDumpsType;
   usvfs_dump_path = ush::string_cast<std::wstring>(params->crashDumpsPath, ush::CodePage::UTF8);
 
   SetLogLevel(params->logLevel);
+  usvfs::log::setCallSampling(params->logSampleInterval, params->logRateLimit);
+  if (params->traceDirectory[0] != '\0') {
+    usvfs::HookTrace::open(
+        ush::string_cast<std::wstring>(params->traceDirectory, ush::CodePage::UTF8));
+  }
+  usvfs::iniCache.setEnabled(params->iniCache);
+  usvfs::attributeCache.setEnabled(params->attributeCache);
+  if (params->readAheadDirectory[0] != '\0') {
+    usvfs::ReadAhead::open(
+        ush::string_cast<std::wstring>(params->readAheadDirectory, ush::CodePage::UTF8));
+  }
 
   if (exceptionHandler == nullptr) {
-    if (usvfs_dump_type != CrashDumpsType::None)
+    if (usvfs_dump_type != CrashDumpsType::None) {
+      prepareCrashHandling(*params);
       exceptionHandler = ::AddVectoredExceptionHandler(0, VEHandler);
+    }
   } else {
     spdlog::get("usvfs")->info("vectored exception handler already active");
     // how did this happen??
@@ -347,12 +810,19 @@ void __cdecl InitHooks(LPVOID parameters, size_t)
               params->crashDumpsPath);
 
   try {
-    manager = new usvfs::HookManager(*params, dllModule);
+    manager = new usvfs::HookManager(*params, dllModule, configuration.get(), sharedParams);
+    startupTimings.attachNanoseconds += manager->attachTime().count();
+    startupTimings.hookNanoseconds = manager->hookTime().count();
 
     auto context = manager->context();
+    if (params->prefaultTree) {
+      // injected processes are still suspended here, nothing can move the trees meanwhile
+      usvfs::prefault(context->redirectionTable());
+      usvfs::prefault(context->inverseTable());
+    }
     auto exePath = boost::dll::program_location();
     auto libraries = context->librariesToForceLoad(exePath.filename().c_str());
-    for (auto library : libraries) {
+    for (const auto &library : libraries) {
       if (std::experimental::filesystem::exists(library)) {
         const auto ret = LoadLibraryExW(library.c_str(), NULL, 0);
         if (ret) {
@@ -368,6 +838,12 @@ void __cdecl InitHooks(LPVOID parameters, size_t)
     spdlog::get("usvfs")
       ->info("inithooks in process {0} successful", ::GetCurrentProcessId());
 
+    if (SHMLogger::isInstantiated()) {
+      // from here on hooked threads only copy their log messages, the queue is
+      // written to in the background
+      SHMLogger::instance().startStaging();
+    }
+
   } catch (const std::exception &e) {
     spdlog::get("usvfs")->debug("failed to initialise hooks: {0}", e.what());
   }
@@ -395,7 +871,11 @@ BOOL WINAPI ConnectVFS(const USVFSParameters *params)
 
   try {
     DisconnectVFS();
+    useLogQueue(params->instanceName);
     context = new usvfs::HookContext(*params, dllModule);
+    treeGrower = new usvfs::TreeGrower({ context->redirectionTable().shmName(),
+                                         context->inverseTable().shmName() },
+                                       TREE_GROWER_INTERVAL);
 
     return TRUE;
   } catch (const std::exception &e) {
@@ -418,69 +898,207 @@ void WINAPI DisconnectVFS()
     delete manager;
     manager = nullptr;
   }
+  stopMonitoring(true);
+  if (treeGrower != nullptr) {
+    delete treeGrower;
+    treeGrower = nullptr;
+  }
+  batchTable.reset();
+  inverseTableStale = false;
+  frozenTree.reset();
+  {
+    std::lock_guard<std::mutex> lock(processesMutex);
+    processes.reset();
+  }
+  usvfs::ReadAhead::close();
+  // the callbacks read the tree
+  StopVFSProjection();
+  removeMaterializedLinks();
   if (context != nullptr) {
     spdlog::get("usvfs")->debug("context not null");
     delete context;
     context = nullptr;
     spdlog::get("usvfs")->debug("vfs unloaded");
   }
+
+  usvfs::HookTrace::close();
+
+  if (SHMLogger::isInstantiated()) {
+    // make sure nothing is left in the staging buffers when the process ends
+    SHMLogger::instance().stopStaging();
+  }
 }
 
 
-bool processStillActive(DWORD pid)
+BOOL WINAPI GetVFSProcessList(size_t *count, LPDWORD processIDs)
 {
-  HANDLE proc = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, pid);
-
-  if (proc == nullptr) {
-    return false;
+  if (count == nullptr) {
+    SetLastError(ERROR_INVALID_PARAMETER);
+    return FALSE;
   }
 
-  ON_BLOCK_EXIT([&]() {
-	  if (proc != INVALID_HANDLE_VALUE)
-		  ::CloseHandle(proc);
-  });
-
-  DWORD exitCode;
-  if (!GetExitCodeProcess(proc, &exitCode)) {
-    spdlog::get("usvfs")->warn("failed to query exit code on process {}: {}",
-                               pid, ::GetLastError());
-    return false;
+  if (context == nullptr) {
+    *count = 0;
   } else {
-    return exitCode == STILL_ACTIVE;
+    std::vector<DWORD> pids = processRegistry()->liveProcesses(*context);
+    if (processIDs != nullptr) {
+      for (size_t i = 0; (i < *count) && (i < pids.size()); ++i) {
+        processIDs[i] = pids[i];
+      }
+    }
+    *count = pids.size();
   }
+  return TRUE;
 }
 
+BOOL WINAPI EnableHookStatistics(BOOL enable)
+{
+  if (context == nullptr) {
+    SetLastError(ERROR_INVALID_FUNCTION);
+    return FALSE;
+  }
+  usvfs::HookStatsTable::setEnabled(enable != FALSE);
+  return TRUE;
+}
 
-BOOL WINAPI GetVFSProcessList(size_t *count, LPDWORD processIDs)
+BOOL WINAPI GetHookStatistics(HookStatistics *statistics, size_t *count)
 {
   if (count == nullptr) {
     SetLastError(ERROR_INVALID_PARAMETER);
     return FALSE;
   }
 
-  if (context == nullptr) {
+  if ((context == nullptr) || !usvfs::HookStatsTable::collect(statistics, count)) {
     *count = 0;
-  } else {
-    std::vector<DWORD> pids = context->registeredProcesses();
-    size_t realCount = 0;
-    for (DWORD pid : pids) {
-      if (processStillActive(pid)) {
-        if ((realCount < *count) && (processIDs != nullptr)) {
-          processIDs[realCount] = pid;
-        }
+  }
+  return TRUE;
+}
 
-        ++realCount;
-      } // else the process has already ended
+BOOL WINAPI GetContextLockStatistics(ContextLockStatistics *statistics,
+                                     ContextLockHolder *holders, size_t *count)
+{
+  if ((context == nullptr)
+      || !usvfs::HookStatsTable::collectLock(statistics, holders, count)) {
+    if (statistics != nullptr) {
+      memset(statistics, 0, sizeof(ContextLockStatistics));
+    }
+    if (count != nullptr) {
+      *count = 0;
     }
-    *count = realCount;
   }
   return TRUE;
 }
 
+BOOL WINAPI GetStartupTimings(StartupTimings *timings)
+{
+  if (timings == nullptr) {
+    SetLastError(ERROR_INVALID_PARAMETER);
+    return FALSE;
+  }
+  *timings = startupTimings;
+  return TRUE;
+}
+
+BOOL WINAPI ResetHookStatistics()
+{
+  if (context == nullptr) {
+    SetLastError(ERROR_INVALID_FUNCTION);
+    return FALSE;
+  }
+  usvfs::HookStatsTable::reset();
+  return TRUE;
+}
+
 void WINAPI ClearVirtualMappings()
 {
-  context->redirectionTable()->clear();
-  context->inverseTable()->clear();
+  stopMonitoring(false);
+  removeMaterializedLinks();
+  linkHistory.clear();
+  layerIndex.clear();
+  layerFlags.clear();
+  linkTable().clear();
+  if (!batchTable) {
+    std::lock_guard<std::mutex> lock(inverseTableMutex);
+    context->inverseTable().clear();
+    inverseTableStale = false;
+    context->updateParameters();
+  }
+}
+
+BOOL WINAPI BeginVFSBatch()
+{
+  if ((context == nullptr) || batchTable) {
+    SetLastError(ERROR_INVALID_FUNCTION);
+    return FALSE;
+  }
+
+  try {
+    std::string prefix = std::string(context->callParameters().instanceName)
+                         + "_batch" + std::to_string(::GetCurrentProcessId());
+    batchTable.reset(new usvfs::RedirectionTreeContainer(prefix + "_map", BATCH_SEGMENT_SIZE));
+    // start from the current state so links can build on existing mappings
+    batchTable->replaceWith(context->redirectionTable());
+    return TRUE;
+  } catch (const std::exception &e) {
+    spdlog::get("usvfs")->error("failed to start batch: {}", e.what());
+    batchTable.reset();
+    SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+    return FALSE;
+  }
+}
+
+BOOL WINAPI CommitVFSBatch()
+{
+  if ((context == nullptr) || !batchTable) {
+    SetLastError(ERROR_INVALID_FUNCTION);
+    return FALSE;
+  }
+
+  BOOL result = TRUE;
+  try {
+    context->redirectionTable().replaceWith(*batchTable);
+  } catch (const std::exception &e) {
+    spdlog::get("usvfs")->error("failed to commit batch: {}", e.what());
+    SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+    result = FALSE;
+  }
+  batchTable.reset();
+  inverseTableStale = true;
+  // running processes may look up the links made during the batch right away
+  if (!context->registeredProcesses().empty()) {
+    updateInverseTable();
+  }
+  context->updateParameters();
+  return result;
+}
+
+BOOL WINAPI FreezeVFS()
+{
+  if (context == nullptr) {
+    SetLastError(ERROR_INVALID_FUNCTION);
+    return FALSE;
+  }
+
+  try {
+    const usvfs::RedirectionTreeContainer &table = context->redirectionTable();
+    long generation = table.generation();
+    // hooks only look paths up in the frozen table, so chains of dummy directories
+    // can be merged
+    std::vector<char> image = ush::buildFlatTree(
+        *table.get(), generation, [](const usvfs::RedirectionTree &node) {
+          return node.data().target();
+        }, true);
+    frozenTree = ush::FlatTreeSegment::create(context->snapshotName(generation), image);
+    context->publishSnapshot(generation);
+    spdlog::get("usvfs")->info("froze redirection table generation {} ({} nodes, {} bytes)",
+                               generation, frozenTree->tree().numNodes(), image.size());
+  } catch (const std::exception &e) {
+    spdlog::get("usvfs")->error("failed to freeze redirection table: {}", e.what());
+    frozenTree.reset();
+    SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+    return FALSE;
+  }
+  return TRUE;
 }
 
 /// ensure the specified path exists. If a physical path of the same name
@@ -508,8 +1126,8 @@ bool assertPathExists(usvfs::RedirectionTreeContainer &table, LPCWSTR path)
       // that if virtual c:/foo maps to real c:/windows then creating virtual
       // c:/foo/bar will map to real c:/windows/bar
       bfs::path targetPath
-          = current->data().linkTarget.size() > 0
-                ? bfs::path(current->data().linkTarget.c_str()) / *iter
+          = current->data().hasTarget()
+                ? bfs::path(current->data().target().c_str()) / *iter
                 : *iter / "\\";
       if (is_directory(targetPath)) {
         usvfs::RedirectionTree::NodePtrT newNode = table.addDirectory(
@@ -532,27 +1150,27 @@ BOOL WINAPI VirtualLinkFile(LPCWSTR source, LPCWSTR destination,
   // TODO difference between winapi and ntdll api regarding system32 vs syswow64
   // (and other windows links?)
   try {
-    if (!assertPathExists(context->redirectionTable(), destination)) {
+    if (!assertPathExists(linkTable(), destination)) {
       SetLastError(ERROR_PATH_NOT_FOUND);
       return FALSE;
     }
 
     std::string sourceU8
         = ush::string_cast<std::string>(source, ush::CodePage::UTF8);
-    auto res = context->redirectionTable().addFile(
+    auto res = linkTable().addFile(
         bfs::path(destination), usvfs::RedirectionDataLocal(sourceU8),
         !(flags & LINKFLAG_FAILIFEXISTS));
 
-    std::string fileExt = ba::to_lower_copy(bfs::extension(sourceU8));
-    if (extensions.find(fileExt) != extensions.end()) {
+    usvfs::RedirectionTreeContainer *inverseTable = linkInverseTable();
+    if ((inverseTable != nullptr) && inverseLinked(sourceU8)) {
       std::string destinationU8
           = ush::string_cast<std::string>(destination, ush::CodePage::UTF8);
 
-      context->inverseTable().addFile(
+      inverseTable->addFile(
           bfs::path(source), usvfs::RedirectionDataLocal(destinationU8), true);
     }
 
-    context->updateParameters();
+    linksUpdated();
 
     if (res.get() == nullptr) {
       // the tree structure currently doesn't provide useful error codes but
@@ -584,17 +1202,504 @@ static usvfs::shared::TreeFlags convertRedirectionFlags(unsigned int flags)
 }
 
 
-BOOL WINAPI VirtualLinkDirectoryStatic(LPCWSTR source, LPCWSTR destination, unsigned int flags)
+/**
+ * @brief flags for a directory whose content gets linked completely
+ * @return FLAG_VIRTUALONLY if the directory doesn't exist on disk
+ */
+static usvfs::shared::TreeFlags physicalFlags(const std::wstring &destination)
 {
-  // TODO change notification not yet implemented
-  try {
-    if ((flags & LINKFLAG_FAILIFEXISTS)
-        && winapi::ex::wide::fileExists(destination)) {
-      SetLastError(ERROR_FILE_EXISTS);
-      return FALSE;
-    }
+  return winapi::ex::wide::fileExists(destination.c_str())
+      ? 0 : usvfs::shared::FLAG_VIRTUALONLY;
+}
+
+
+typedef std::vector<usvfs::shared::TreeInsertion<usvfs::RedirectionDataLocal>> LinkList;
+
+/**
+ * @brief scan the content of a directory recursively, in parallel, and list the
+ *        nodes linking it
+ * @param inverseLinks receives the inverse links of the files if not null
+ */
+static void collectDirectoryContent(LPCWSTR source, LPCWSTR destination, unsigned int flags,
+                                    LinkList &directories, LinkList &links,
+                                    LinkList *inverseLinks)
+{
+  std::wstring sourceP(source);
+  if (sourceP.length() >= MAX_PATH && !ush::startswith(sourceP.c_str(), LR"(\\?\)"))
+    sourceP = LR"(\\?\)" + sourceP;
+
+  std::wstring destinationW = std::wstring(destination) + L"\\";
+
+  usvfs::DirectoryWalker::Filter filter;
+  if (flags & LINKFLAG_FAILIFEXISTS) {
+    // subdirectories that exist at the destination are skipped, the same as linking
+    // them individually would fail
+    filter = [&destinationW] (const std::wstring &path) {
+      return !winapi::ex::wide::fileExists((destinationW + path).c_str());
+    };
+  }
+
+  auto listings = usvfs::DirectoryWalker().walk(sourceP, filter);
+
+  std::string sourceU8
+      = ush::string_cast<std::string>(source, ush::CodePage::UTF8) + "\\";
+  std::string destinationU8
+      = ush::string_cast<std::string>(destination, ush::CodePage::UTF8) + "\\";
+  usvfs::shared::TreeFlags directoryFlags
+      = usvfs::shared::FLAG_DIRECTORY | convertRedirectionFlags(flags);
+  // below a directory that doesn't exist on disk nothing does, subdirectories that
+  // passed the filter don't exist either
+  bool destinationVirtual = (flags & LINKFLAG_FAILIFEXISTS)
+                            || !winapi::ex::wide::fileExists(destination);
+
+  for (const auto &listing : listings) {
+    for (const usvfs::DirectoryWalker::Directory &directory : listing) {
+      std::string pathU8;
+      if (!directory.path.empty()) {
+        pathU8 = ush::string_cast<std::string>(directory.path, ush::CodePage::UTF8) + "\\";
+        directories.emplace_back(bfs::path(destinationW + directory.path),
+                                 usvfs::RedirectionDataLocal(sourceU8 + pathU8),
+                                 directoryFlags
+                                     | (destinationVirtual
+                                            ? usvfs::shared::FLAG_VIRTUALONLY
+                                            : physicalFlags(destinationW + directory.path)));
+      }
+
+      // the source directory is stored once per tree, the node only keeps the
+      // file name
+      std::string sourceDirectoryU8 = sourceU8 + pathU8;
+      std::string destinationDirectoryU8 = destinationU8 + pathU8;
+      for (const std::wstring &file : directory.files) {
+        std::string nameU8 = ush::string_cast<std::string>(file, ush::CodePage::UTF8);
+        links.emplace_back(bfs::path(destination) / (pathU8 + nameU8),
+                           usvfs::RedirectionDataLocal(sourceDirectoryU8, nameU8));
+
+        if ((inverseLinks != nullptr) && inverseLinked(nameU8)) {
+          inverseLinks->emplace_back(bfs::path(source) / (pathU8 + nameU8),
+                                     usvfs::RedirectionDataLocal(destinationDirectoryU8, nameU8));
+        }
+      }
+    }
+  }
+}
+
+/**
+ * @brief read the information of a file, including the volume serial and file index
+ *        that identify it
+ * @return false if the file can't be opened
+ */
+static bool fileIdentity(const std::wstring &path, BY_HANDLE_FILE_INFORMATION &info)
+{
+  HANDLE file = ::CreateFileW(path.c_str(), FILE_READ_ATTRIBUTES,
+                              FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                              nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  bool result = ::GetFileInformationByHandle(file, &info) != FALSE;
+  ::CloseHandle(file);
+  return result;
+}
+
+/**
+ * @brief remove the empty directories below and including a directory, deepest first
+ */
+static void removeEmptyDirectories(const bfs::path &directory)
+{
+  boost::system::error_code ec;
+  std::vector<bfs::path> directories{ directory };
+  for (bfs::recursive_directory_iterator iter(directory, ec), end; !ec && (iter != end);
+       iter.increment(ec)) {
+    if (bfs::is_directory(iter->status())) {
+      directories.push_back(iter->path());
+    }
+  }
+  for (auto iter = directories.rbegin(); iter != directories.rend(); ++iter) {
+    ::RemoveDirectoryW(iter->wstring().c_str());
+  }
+}
+
+/**
+ * @return the staging directory of this vfs instance on the volume of a path, empty if
+ *         it can't be created. Hard links a crashed session of the same instance left
+ *         there are removed the first time it's used, files that aren't hard links are
+ *         kept. Other instances have their own directories, those are never touched
+ */
+static std::wstring stagingDirectory(LPCWSTR path)
+{
+  std::wstring instance = ush::string_cast<std::wstring>(
+      context->callParameters().instanceName, ush::CodePage::UTF8);
+  wchar_t volume[MAX_PATH];
+  if (instance.empty() || !::GetVolumePathNameW(path, volume, MAX_PATH)) {
+    // without an instance name the cleanup would cover the shared root
+    return std::wstring();
+  }
+  std::wstring result = std::wstring(volume) + L"usvfs_staging\\" + instance;
+
+  if (stagingDirectories.insert(result).second) {
+    boost::system::error_code ec;
+    for (bfs::recursive_directory_iterator iter(bfs::path(result), ec), end;
+         !ec && (iter != end); iter.increment(ec)) {
+      BY_HANDLE_FILE_INFORMATION info;
+      if (bfs::is_regular_file(iter->status())
+          && fileIdentity(iter->path().wstring(), info) && (info.nNumberOfLinks > 1)) {
+        ::DeleteFileW(iter->path().wstring().c_str());
+      }
+    }
+    removeEmptyDirectories(bfs::path(result));
+  }
+
+  boost::system::error_code ec;
+  bfs::create_directories(bfs::path(result), ec);
+  return winapi::ex::wide::fileExists(result.c_str()) ? result : std::wstring();
+}
+
+/**
+ * @brief hard link the files of a directory link into the staging directory on the
+ *        volume of the source and point their nodes at the links, flagged with
+ *        FLAG_MATERIALIZED. Writes still go through create target and copy-on-write
+ *        like for any other node and the game directory is never touched
+ * @param links the nodes of the files, the ones that could be linked are changed
+ * @param inverseLinks inverse entries of the materialized files are removed, processes
+ *        never see the source path of those
+ */
+static void materializeLinks(LPCWSTR source, LinkList &links, LinkList *inverseLinks)
+{
+  std::wstring staging = stagingDirectory(source);
+  if (staging.empty()) {
+    spdlog::get("usvfs")->warn("no staging directory for {}, not materialized",
+                               ush::string_cast<std::string>(source, ush::CodePage::UTF8));
+    return;
+  }
+  staging += L"\\" + std::to_wstring(materializeCount++);
+
+  std::string sourceU8
+      = ush::string_cast<std::string>(source, ush::CodePage::UTF8) + "\\";
+  std::string stagingU8
+      = ush::string_cast<std::string>(staging, ush::CodePage::UTF8) + "\\";
+  std::set<std::wstring> materialized;
+  for (auto &link : links) {
+    if (link.data.linkBase.compare(0, sourceU8.size(), sourceU8) != 0) {
+      continue;
+    }
+    std::string relativeU8 = link.data.linkBase.substr(sourceU8.size());
+    std::string stagedBaseU8 = stagingU8 + relativeU8;
+    std::wstring sourcePath = ush::string_cast<std::wstring>(
+        link.data.linkBase + link.data.linkTarget, ush::CodePage::UTF8);
+    std::wstring stagedPath = ush::string_cast<std::wstring>(
+        stagedBaseU8 + link.data.linkTarget, ush::CodePage::UTF8);
+
+    boost::system::error_code ec;
+    bfs::create_directories(bfs::path(stagedPath).parent_path(), ec);
+    BY_HANDLE_FILE_INFORMATION info;
+    if (!::CreateHardLinkW(stagedPath.c_str(), sourcePath.c_str(), nullptr)) {
+      continue;
+    }
+    if (!fileIdentity(stagedPath, info)) {
+      ::DeleteFileW(stagedPath.c_str());
+      continue;
+    }
+    materializedLinks.push_back(
+        { stagedPath, info.dwVolumeSerialNumber, info.nFileIndexHigh, info.nFileIndexLow });
+    materialized.insert((bfs::path(source) / (relativeU8 + link.data.linkTarget)).wstring());
+    link.data = usvfs::RedirectionDataLocal(stagedBaseU8, link.data.linkTarget);
+    link.flags |= usvfs::shared::FLAG_MATERIALIZED;
+  }
+
+  if (inverseLinks != nullptr) {
+    inverseLinks->erase(std::remove_if(inverseLinks->begin(), inverseLinks->end(),
+                                       [&materialized] (const LinkList::value_type &link) {
+                                         return materialized.count(link.name.wstring()) != 0;
+                                       }),
+                        inverseLinks->end());
+  }
+
+  spdlog::get("usvfs")->info("materialized {} files of {} in {}", materialized.size(),
+                             ush::string_cast<std::string>(source, ush::CodePage::UTF8),
+                             ush::string_cast<std::string>(staging, ush::CodePage::UTF8));
+}
+
+/**
+ * @brief delete the hard links created by materializeLinks. A link is only deleted
+ *        if it's still the same file, anything that replaced it is left alone
+ */
+static void removeMaterializedLinks()
+{
+  for (const MaterializedLink &link : materializedLinks) {
+    BY_HANDLE_FILE_INFORMATION info;
+    if (!fileIdentity(link.path, info)
+        || (info.dwVolumeSerialNumber != link.volumeSerial)
+        || (info.nFileIndexHigh != link.indexHigh)
+        || (info.nFileIndexLow != link.indexLow)) {
+      continue;
+    }
+    if (!::DeleteFileW(link.path.c_str())) {
+      spdlog::get("usvfs")->warn("failed to remove materialized file {}: {}",
+                                 ush::string_cast<std::string>(link.path, ush::CodePage::UTF8),
+                                 ::GetLastError());
+    }
+  }
+  materializedLinks.clear();
+  materializeCount = 0;
+  for (const std::wstring &staging : stagingDirectories) {
+    removeEmptyDirectories(bfs::path(staging));
+  }
+}
+
+/**
+ * @brief link the content of a directory recursively. The source is scanned in
+ *        parallel first, the links are then added to the tables in bulk
+ */
+static void linkDirectoryContent(usvfs::RedirectionTreeContainer &table,
+                                 usvfs::RedirectionTreeContainer *inverseTable,
+                                 LPCWSTR source, LPCWSTR destination,
+                                 unsigned int flags)
+{
+  LinkList directories;
+  LinkList links;
+  LinkList inverseLinks;
+  collectDirectoryContent(source, destination, flags, directories, links,
+                          inverseTable != nullptr ? &inverseLinks : nullptr);
+  if (((flags & LINKFLAG_MATERIALIZE) != 0) && ((flags & LINKFLAG_MONITORCHANGES) == 0)) {
+    materializeLinks(source, links, inverseTable != nullptr ? &inverseLinks : nullptr);
+  }
+
+  table.addNodes(directories, (flags & LINKFLAG_CREATETARGET) != 0);
+  table.addNodes(links);
+  if (!inverseLinks.empty()) {
+    inverseTable->addNodes(inverseLinks);
+  }
+}
+
+
+/**
+ * @return the path without trailing backslashes
+ */
+static std::wstring trimmedPath(LPCWSTR path)
+{
+  std::wstring result(path);
+  while (!result.empty() && (result.back() == L'\\')) {
+    result.pop_back();
+  }
+  return result;
+}
+
+/**
+ * @brief test if a path lies below a base directory
+ * @param remainder receives the part of path after the base
+ */
+static bool splitRelativePath(const std::wstring &path, const std::wstring &base,
+                              std::wstring &remainder)
+{
+  if ((path.length() <= base.length() + 1)
+      || (path[base.length()] != L'\\')
+      || (_wcsnicmp(path.c_str(), base.c_str(), base.length()) != 0)) {
+    return false;
+  }
+  remainder = path.substr(base.length() + 1);
+  return true;
+}
+
+/**
+ * @brief link a single file or directory (including its content) of a monitored link
+ * @param relative path of the entry relative to the link
+ */
+static void linkMonitoredEntry(usvfs::RedirectionTreeContainer &table,
+                               usvfs::RedirectionTreeContainer *inverseTable,
+                               const usvfs::DirectoryLink &link, const std::wstring &relative,
+                               DWORD attributes)
+{
+  std::wstring sourcePath      = link.source + L"\\" + relative;
+  std::wstring destinationPath = link.destination + L"\\" + relative;
+
+  if (attributes & FILE_ATTRIBUTE_DIRECTORY) {
+    std::string sourceU8
+        = ush::string_cast<std::string>(sourcePath, ush::CodePage::UTF8) + "\\";
+    table.addDirectory(bfs::path(destinationPath), usvfs::RedirectionDataLocal(sourceU8),
+                       usvfs::shared::FLAG_DIRECTORY | convertRedirectionFlags(link.flags)
+                           | physicalFlags(destinationPath),
+                       (link.flags & LINKFLAG_CREATETARGET) != 0);
+    linkDirectoryContent(table, inverseTable, sourcePath.c_str(),
+                         destinationPath.c_str(), link.flags);
+  } else {
+    bfs::path sourceFile(sourcePath);
+    bfs::path destinationFile(destinationPath);
+    std::string nameU8 = sourceFile.filename().string();
+    table.addFile(destinationFile,
+                  usvfs::RedirectionDataLocal(sourceFile.parent_path().string() + "\\", nameU8),
+                  true);
+
+    if ((inverseTable != nullptr) && inverseLinked(nameU8)) {
+      inverseTable->addFile(
+          sourceFile,
+          usvfs::RedirectionDataLocal(destinationFile.parent_path().string() + "\\", nameU8),
+          true);
+    }
+  }
+}
+
+/**
+ * @brief link the entry at a virtual path from every monitored link that provides it,
+ *        in link order so the last one takes precedence
+ * @param first index of the first link to consider
+ * @param skip index of a link to leave out
+ */
+static void relinkMonitoredPath(usvfs::RedirectionTreeContainer &table,
+                                usvfs::RedirectionTreeContainer *inverseTable,
+                                const std::wstring &destinationPath, size_t first,
+                                size_t skip)
+{
+  for (size_t i = first; i < monitoredLinks.size(); ++i) {
+    const usvfs::DirectoryLink &link = monitoredLinks[i];
+    std::wstring relative;
+    if ((i == skip) || !splitRelativePath(destinationPath, link.destination, relative)) {
+      continue;
+    }
+    DWORD attributes = ::GetFileAttributesW((link.source + L"\\" + relative).c_str());
+    if (attributes != INVALID_FILE_ATTRIBUTES) {
+      linkMonitoredEntry(table, inverseTable, link, relative, attributes);
+    }
+  }
+}
+
+/**
+ * @brief remove an entry of a monitored link, unless a different link provides it
+ */
+static void unlinkMonitoredEntry(usvfs::RedirectionTreeContainer &table,
+                                 usvfs::RedirectionTreeContainer *inverseTable,
+                                 size_t id, const std::wstring &relative)
+{
+  const usvfs::DirectoryLink &link = monitoredLinks[id];
+  std::wstring sourcePath      = link.source + L"\\" + relative;
+  std::wstring destinationPath = link.destination + L"\\" + relative;
+
+  usvfs::RedirectionTree::NodePtrT node = table->findNode(bfs::path(destinationPath));
+  if (node.get() == nullptr) {
+    return;
+  }
+  std::string target = node->data().target();
+  if (!target.empty() && (target.back() == '\\')) {
+    target.pop_back();
+  }
+  if (!ba::iequals(target, ush::string_cast<std::string>(sourcePath, ush::CodePage::UTF8))) {
+    // overridden by a different link
+    return;
+  }
+
+  bool directory = node->isDirectory();
+  table.removeNode(bfs::path(destinationPath));
+  if ((inverseTable != nullptr)
+      && (directory
+          || inverseLinked(ush::string_cast<std::string>(sourcePath, ush::CodePage::UTF8)))) {
+    inverseTable->removeNode(bfs::path(sourcePath));
+  }
+
+  // links after this one can't provide the entry or they would own the node, but
+  // earlier ones may have been hidden by it
+  relinkMonitoredPath(table, inverseTable, destinationPath, 0, id);
+}
+
+/**
+ * @brief handler for the change monitor. Runs on the monitor thread and always
+ *        modifies the shared tables, even while a batch is active
+ */
+static void applyLinkChanges(int id, const std::vector<usvfs::ChangeMonitor::Change> &changes)
+{
+  std::lock_guard<std::mutex> lock(monitoredLinksMutex);
+  if ((context == nullptr) || (id < 0)
+      || (static_cast<size_t>(id) >= monitoredLinks.size())) {
+    return;
+  }
+
+  usvfs::RedirectionTreeContainer &table = context->redirectionTable();
+  usvfs::RedirectionTreeContainer *inverseTable
+      = (inverseExtensions.empty() || context->registeredProcesses().empty())
+            ? nullptr : &context->inverseTable();
+  if (inverseTable == nullptr) {
+    inverseTableStale = true;
+  } else {
+    updateInverseTable();
+  }
+  const usvfs::DirectoryLink &link = monitoredLinks[id];
+
+  for (const usvfs::ChangeMonitor::Change &change : changes) {
+    switch (change.type) {
+      case usvfs::ChangeMonitor::ChangeType::Added: {
+        DWORD attributes
+            = ::GetFileAttributesW((link.source + L"\\" + change.path).c_str());
+        if (attributes != INVALID_FILE_ATTRIBUTES) {
+          linkMonitoredEntry(table, inverseTable, link, change.path, attributes);
+          // later links have to win again where they provide the same entry
+          relinkMonitoredPath(table, inverseTable, link.destination + L"\\" + change.path,
+                              id + 1, id);
+        } // else it's already gone again, the removal is reported next
+      } break;
+      case usvfs::ChangeMonitor::ChangeType::Removed: {
+        unlinkMonitoredEntry(table, inverseTable, id, change.path);
+      } break;
+      case usvfs::ChangeMonitor::ChangeType::Rescan: {
+        // entries that were removed in the meantime stay linked until the next rebuild
+        for (size_t i = id; i < monitoredLinks.size(); ++i) {
+          linkDirectoryContent(table, inverseTable, monitoredLinks[i].source.c_str(),
+                               monitoredLinks[i].destination.c_str(),
+                               monitoredLinks[i].flags);
+        }
+      } break;
+    }
+  }
+
+  context->updateParameters();
+}
+
+/**
+ * @brief keep a recursively linked directory up to date with changes to its source
+ */
+static void monitorLink(const usvfs::DirectoryLink &link)
+{
+  std::lock_guard<std::mutex> lock(monitoredLinksMutex);
+  if (changeMonitor == nullptr) {
+    changeMonitor = new usvfs::ChangeMonitor(&applyLinkChanges);
+  }
+  int id = static_cast<int>(monitoredLinks.size());
+  monitoredLinks.push_back(link);
+
+  std::wstring watchPath(link.source);
+  if ((watchPath.length() >= MAX_PATH) && !ush::startswith(watchPath.c_str(), LR"(\\?\)")) {
+    watchPath = LR"(\\?\)" + watchPath;
+  }
+  // if this fails the link stays static, the entry is kept so ids stay in link order
+  changeMonitor->watch(id, watchPath, true);
+}
+
+/**
+ * @brief stop monitoring all links
+ */
+static void stopMonitoring(bool shutdown)
+{
+  // the handler takes the lock, so don't hold it while waiting for the monitor
+  if (changeMonitor != nullptr) {
+    if (shutdown) {
+      delete changeMonitor;
+      changeMonitor = nullptr;
+    } else {
+      changeMonitor->clear();
+    }
+  }
+  std::lock_guard<std::mutex> lock(monitoredLinksMutex);
+  monitoredLinks.clear();
+}
 
-    if (!assertPathExists(context->redirectionTable(), destination)) {
+
+BOOL WINAPI VirtualLinkDirectoryStatic(LPCWSTR source, LPCWSTR destination, unsigned int flags)
+{
+  try {
+    if ((flags & LINKFLAG_FAILIFEXISTS)
+        && winapi::ex::wide::fileExists(destination)) {
+      SetLastError(ERROR_FILE_EXISTS);
+      return FALSE;
+    }
+
+    if (!assertPathExists(linkTable(), destination)) {
       SetLastError(ERROR_PATH_NOT_FOUND);
       return FALSE;
     }
@@ -602,52 +1707,26 @@ BOOL WINAPI VirtualLinkDirectoryStatic(LPCWSTR source, LPCWSTR destination, unsi
     std::string sourceU8
         = ush::string_cast<std::string>(source, ush::CodePage::UTF8) + "\\";
 
-    context->redirectionTable().addDirectory(
+    // without the content in the tree, listings need the directory on disk
+    linkTable().addDirectory(
           destination, usvfs::RedirectionDataLocal(sourceU8),
-          usvfs::shared::FLAG_DIRECTORY | convertRedirectionFlags(flags),
+          usvfs::shared::FLAG_DIRECTORY | convertRedirectionFlags(flags)
+              | ((flags & LINKFLAG_RECURSIVE) != 0 ? physicalFlags(destination) : 0),
           (flags & LINKFLAG_CREATETARGET) != 0);
 
+    usvfs::DirectoryLink link { trimmedPath(source), trimmedPath(destination), flags };
+
     if ((flags & LINKFLAG_RECURSIVE) != 0) {
-      std::wstring sourceP(source);
-      std::wstring sourceW      = sourceP + L"\\";
-      std::wstring destinationW = std::wstring(destination) + L"\\";
-      if (sourceP.length() >= MAX_PATH && !ush::startswith(sourceP.c_str(), LR"(\\?\)"))
-        sourceP = LR"(\\?\)" + sourceP;
-
-      for (winapi::ex::wide::FileResult file :
-           winapi::ex::wide::quickFindFiles(sourceP.c_str(), L"*")) {
-        if (file.attributes & FILE_ATTRIBUTE_DIRECTORY) {
-          if ((file.fileName != L".") && (file.fileName != L"..")) {
-            VirtualLinkDirectoryStatic((sourceW + file.fileName).c_str(),
-                                       (destinationW + file.fileName).c_str(),
-                                       flags);
-          }
-        } else {
-          std::string nameU8 = ush::string_cast<std::string>(
-              file.fileName.c_str(), ush::CodePage::UTF8);
-
-          // TODO could save memory here by storing only the file name for the
-          // source and constructing the full name using the parent directory
-          context->redirectionTable().addFile(
-              bfs::path(destination) / nameU8,
-              usvfs::RedirectionDataLocal(sourceU8 + nameU8), true);
-
-          std::string fileExt = ba::to_lower_copy(bfs::extension(nameU8));
-
-          if (extensions.find(fileExt) != extensions.end()) {
-            std::string destinationU8 = ush::string_cast<std::string>(
-                                            destination, ush::CodePage::UTF8)
-                                        + "\\";
-
-            context->inverseTable().addFile(
-                bfs::path(source) / nameU8,
-                usvfs::RedirectionDataLocal(destinationU8 + nameU8), true);
-          }
-        }
+      linkDirectoryContent(linkTable(), linkInverseTable(), source, destination, flags);
+
+      if ((flags & LINKFLAG_MONITORCHANGES) != 0) {
+        monitorLink(link);
       }
     }
 
-    context->updateParameters();
+    linkHistory.push_back(link);
+
+    linksUpdated();
 
     return TRUE;
   } catch (const std::exception &e) {
@@ -659,6 +1738,553 @@ BOOL WINAPI VirtualLinkDirectoryStatic(LPCWSTR source, LPCWSTR destination, unsi
 }
 
 
+/**
+ * @brief bring the tables up to date with paths whose winning layer changed
+ */
+static void applyLayerChanges(const std::vector<ush::LayerIndex::Change> &changes)
+{
+  usvfs::RedirectionTreeContainer &table = linkTable();
+  usvfs::RedirectionTreeContainer *inverseTable = linkInverseTable();
+
+  std::vector<ush::TreeInsertion<usvfs::RedirectionDataLocal>> directories;
+  std::vector<ush::TreeInsertion<usvfs::RedirectionDataLocal>> links;
+  for (const ush::LayerIndex::Change &change : changes) {
+    bfs::path virtualPath(change.virtualPath);
+    if (change.target.empty() || change.kindChanged) {
+      table.removeNode(virtualPath);
+    }
+
+    std::string targetU8 = ush::string_cast<std::string>(change.target, ush::CodePage::UTF8);
+    if (change.directory) {
+      if (!change.target.empty()) {
+        // layers list their complete content
+        directories.emplace_back(virtualPath, usvfs::RedirectionDataLocal(targetU8 + "\\"),
+                                 ush::FLAG_DIRECTORY
+                                     | convertRedirectionFlags(layerFlags[change.layer])
+                                     | physicalFlags(change.virtualPath));
+      }
+      continue;
+    }
+
+    std::string nameU8 = virtualPath.filename().string();
+    if (!change.target.empty()) {
+      size_t separator = targetU8.find_last_of('\\');
+      links.emplace_back(virtualPath,
+                         usvfs::RedirectionDataLocal(targetU8.substr(0, separator + 1),
+                                                     targetU8.substr(separator + 1)));
+    }
+    if ((inverseTable != nullptr) && inverseLinked(nameU8)) {
+      if (!change.previousTarget.empty()) {
+        inverseTable->removeNode(bfs::path(change.previousTarget));
+      }
+      if (!change.target.empty()) {
+        inverseTable->addFile(bfs::path(change.target),
+                              usvfs::RedirectionDataLocal(
+                                  virtualPath.parent_path().string() + "\\", nameU8),
+                              true);
+      }
+    }
+  }
+
+  if (!directories.empty()) {
+    table.addNodes(directories);
+  }
+  if (!links.empty()) {
+    table.addNodes(links);
+  }
+  linksUpdated();
+}
+
+BOOL WINAPI VirtualLinkLayer(unsigned int layer, LPCWSTR source, LPCWSTR destination,
+                             unsigned int flags)
+{
+  try {
+    if (layerIndex.contains(layer)) {
+      SetLastError(ERROR_ALREADY_EXISTS);
+      return FALSE;
+    }
+
+    if (!assertPathExists(linkTable(), destination)) {
+      SetLastError(ERROR_PATH_NOT_FOUND);
+      return FALSE;
+    }
+
+    std::wstring sourceW = trimmedPath(source);
+    std::wstring walkPath(sourceW);
+    if ((walkPath.length() >= MAX_PATH) && !ush::startswith(walkPath.c_str(), LR"(\\?\)")) {
+      walkPath = LR"(\\?\)" + walkPath;
+    }
+
+    std::vector<ush::LayerIndex::Entry> entries;
+    entries.push_back(ush::LayerIndex::Entry{ std::wstring(), true });
+    for (const auto &listing : usvfs::DirectoryWalker().walk(walkPath)) {
+      for (const usvfs::DirectoryWalker::Directory &directory : listing) {
+        std::wstring prefix;
+        if (!directory.path.empty()) {
+          entries.push_back(ush::LayerIndex::Entry{ directory.path, true });
+          prefix = directory.path + L"\\";
+        }
+        for (const std::wstring &file : directory.files) {
+          entries.push_back(ush::LayerIndex::Entry{ prefix + file, false });
+        }
+      }
+    }
+
+    std::vector<ush::LayerIndex::Change> changes;
+    layerIndex.addLayer(layer, sourceW, trimmedPath(destination), entries, changes);
+    layerFlags[layer] = flags;
+    applyLayerChanges(changes);
+    spdlog::get("usvfs")->info("layer {} added with {} entries, {} paths changed", layer,
+                               entries.size(), changes.size());
+    return TRUE;
+  } catch (const std::exception &e) {
+    spdlog::get("usvfs")->error("failed to add layer {}: {}", layer, e.what());
+    SetLastError(ERROR_INVALID_DATA);
+    return FALSE;
+  }
+}
+
+BOOL WINAPI RemoveVirtualLayer(unsigned int layer)
+{
+  try {
+    std::vector<ush::LayerIndex::Change> changes;
+    if (!layerIndex.removeLayer(layer, changes)) {
+      SetLastError(ERROR_NOT_FOUND);
+      return FALSE;
+    }
+    layerFlags.erase(layer);
+    applyLayerChanges(changes);
+    spdlog::get("usvfs")->info("layer {} removed, {} paths changed", layer, changes.size());
+    return TRUE;
+  } catch (const std::exception &e) {
+    spdlog::get("usvfs")->error("failed to remove layer {}: {}", layer, e.what());
+    SetLastError(ERROR_INVALID_DATA);
+    return FALSE;
+  }
+}
+
+BOOL WINAPI SetVirtualLayerOrder(const unsigned int *layers, size_t count)
+{
+  try {
+    std::vector<uint32_t> order;
+    if (layers != nullptr) {
+      order.assign(layers, layers + count);
+    }
+    std::vector<ush::LayerIndex::Change> changes;
+    if (!layerIndex.setOrder(order, changes)) {
+      SetLastError(ERROR_INVALID_PARAMETER);
+      return FALSE;
+    }
+    applyLayerChanges(changes);
+    spdlog::get("usvfs")->info("layers reordered, {} paths changed", changes.size());
+    return TRUE;
+  } catch (const std::exception &e) {
+    spdlog::get("usvfs")->error("failed to reorder layers: {}", e.what());
+    SetLastError(ERROR_INVALID_DATA);
+    return FALSE;
+  }
+}
+
+
+/**
+ * @return true if the node data links to the same target as the local data
+ */
+static bool sameTarget(const usvfs::RedirectionData &existing,
+                       const usvfs::RedirectionDataLocal &data)
+{
+  std::string target = existing.target();
+  return (target.size() == data.linkBase.size() + data.linkTarget.size())
+         && (target.compare(0, data.linkBase.size(), data.linkBase) == 0)
+         && (target.compare(data.linkBase.size(), std::string::npos, data.linkTarget) == 0);
+}
+
+BOOL WINAPI VirtualApplyMappings(const VirtualMapping *mappings, size_t count)
+{
+  try {
+    for (size_t i = 0; i < count; ++i) {
+      if (!assertPathExists(linkTable(), mappings[i].destination)) {
+        SetLastError(ERROR_PATH_NOT_FOUND);
+        return FALSE;
+      }
+    }
+
+    usvfs::RedirectionTreeContainer *inverseTable = linkInverseTable();
+
+    // the new mappings are all in the tree
+    removeMaterializedLinks();
+
+    // the nodes a sequence of link calls would leave behind. A node that a call
+    // wouldn't overwrite is skipped if an earlier mapping listed it already,
+    // otherwise the last entry for a path wins
+    LinkList nodes;
+    LinkList inverseLinks;
+    usvfs::FoldedNameSet listed;
+    auto add = [&](const ush::TreeInsertion<usvfs::RedirectionDataLocal> &node,
+                   bool overwrite) {
+      if (listed.insert(node.name.wstring()) || overwrite) {
+        nodes.push_back(node);
+      }
+    };
+
+    std::vector<usvfs::DirectoryLink> directoryLinks;
+    for (size_t i = 0; i < count; ++i) {
+      const VirtualMapping &mapping = mappings[i];
+      std::string sourceU8
+          = ush::string_cast<std::string>(mapping.source, ush::CodePage::UTF8);
+
+      if (!mapping.directory) {
+        add(ush::TreeInsertion<usvfs::RedirectionDataLocal>(
+                bfs::path(mapping.destination), usvfs::RedirectionDataLocal(sourceU8)),
+            (mapping.flags & LINKFLAG_FAILIFEXISTS) == 0);
+        if ((inverseTable != nullptr) && inverseLinked(sourceU8)) {
+          inverseLinks.emplace_back(
+              bfs::path(mapping.source),
+              usvfs::RedirectionDataLocal(
+                  ush::string_cast<std::string>(mapping.destination, ush::CodePage::UTF8)));
+        }
+        continue;
+      }
+
+      if ((mapping.flags & LINKFLAG_FAILIFEXISTS)
+          && winapi::ex::wide::fileExists(mapping.destination)) {
+        spdlog::get("usvfs")->warn("skipping link to existing {}",
+                                   ush::string_cast<std::string>(mapping.destination,
+                                                                 ush::CodePage::UTF8));
+        continue;
+      }
+
+      bool overwrite = (mapping.flags & LINKFLAG_CREATETARGET) != 0;
+      add(ush::TreeInsertion<usvfs::RedirectionDataLocal>(
+              bfs::path(mapping.destination), usvfs::RedirectionDataLocal(sourceU8 + "\\"),
+              ush::FLAG_DIRECTORY | convertRedirectionFlags(mapping.flags)
+                  | ((mapping.flags & LINKFLAG_RECURSIVE) != 0
+                         ? physicalFlags(mapping.destination) : 0)),
+          overwrite);
+
+      if ((mapping.flags & LINKFLAG_RECURSIVE) != 0) {
+        LinkList directories;
+        LinkList links;
+        collectDirectoryContent(mapping.source, mapping.destination, mapping.flags,
+                                directories, links,
+                                inverseTable != nullptr ? &inverseLinks : nullptr);
+        for (const auto &directory : directories) {
+          add(directory, overwrite);
+        }
+        for (const auto &link : links) {
+          add(link, true);
+        }
+      }
+      directoryLinks.push_back(usvfs::DirectoryLink{
+          trimmedPath(mapping.source), trimmedPath(mapping.destination), mapping.flags });
+    }
+
+    stopMonitoring(false);
+    layerIndex.clear();
+    layerFlags.clear();
+
+    ush::TreeDiffResult result = linkTable().applyDiff(nodes, sameTarget);
+    if (inverseTable != nullptr) {
+      inverseTable->applyDiff(inverseLinks, sameTarget);
+    }
+
+    linkHistory = directoryLinks;
+    for (const usvfs::DirectoryLink &link : linkHistory) {
+      if (((link.flags & LINKFLAG_RECURSIVE) != 0)
+          && ((link.flags & LINKFLAG_MONITORCHANGES) != 0)) {
+        monitorLink(link);
+      }
+    }
+
+    linksUpdated();
+
+    spdlog::get("usvfs")->info("applied {} mappings ({} nodes): {} added, {} removed, "
+                               "{} changed", count, nodes.size(), result.added,
+                               result.removed, result.changed);
+    return TRUE;
+  } catch (const std::exception &e) {
+    spdlog::get("usvfs")->error("failed to apply mappings: {}", e.what());
+    SetLastError(ERROR_INVALID_DATA);
+    return FALSE;
+  }
+}
+
+
+BOOL WINAPI StartVFSProjection(LPCWSTR virtualPath, LPCWSTR projectionRoot)
+{
+  if ((context == nullptr) || (virtualPath == nullptr) || (projectionRoot == nullptr)) {
+    SetLastError(ERROR_INVALID_PARAMETER);
+    return FALSE;
+  }
+  StopVFSProjection();
+  try {
+    projection = new usvfs::Projection(virtualPath, projectionRoot);
+    return TRUE;
+  } catch (const ush::windows_error &e) {
+    spdlog::get("usvfs")->error("failed to start projection: {}", e.what());
+    SetLastError(e.getErrorCode());
+    return FALSE;
+  } catch (const std::exception &e) {
+    spdlog::get("usvfs")->error("failed to start projection: {}", e.what());
+    SetLastError(ERROR_INVALID_DATA);
+    return FALSE;
+  }
+}
+
+
+void WINAPI StopVFSProjection()
+{
+  if (projection != nullptr) {
+    delete projection;
+    projection = nullptr;
+  }
+}
+
+
+/**
+ * @return full paths of all nodes of a flat tree in the format used for the stamps
+ */
+static std::vector<std::string> flatTreePaths(const ush::FlatTree &tree)
+{
+  std::vector<std::string> paths(tree.numNodes());
+  // parents always precede their children in the image
+  for (uint32_t i = 1; i < tree.numNodes(); ++i) {
+    uint32_t parent = tree.parent(i);
+    paths[i] = (parent == 0) ? std::string(tree.name(i))
+                             : paths[parent] + "\\" + tree.name(i);
+  }
+  return paths;
+}
+
+/**
+ * @brief fill a table from a flat tree
+ * @param size number of bytes the tree used when it was saved
+ */
+static void loadFlatTree(usvfs::RedirectionTreeContainer &table, const ush::FlatTree &tree,
+                         uint64_t size)
+{
+  table.reserve(static_cast<size_t>(size + size / 4));
+
+  std::vector<std::string> paths = flatTreePaths(tree);
+  std::vector<ush::TreeInsertion<usvfs::RedirectionDataLocal>> nodes;
+  nodes.reserve(tree.numNodes());
+  for (uint32_t i = 1; i < tree.numNodes(); ++i) {
+    std::string target(tree.target(i));
+    size_t separator = target.find_last_of('\\');
+    // share the directory prefix of files, as linking them does
+    usvfs::RedirectionDataLocal data
+        = (!tree.isDirectory(i) && (separator != std::string::npos))
+              ? usvfs::RedirectionDataLocal(target.substr(0, separator + 1),
+                                            target.substr(separator + 1))
+              : usvfs::RedirectionDataLocal(target);
+    nodes.emplace_back(bfs::path(paths[i]), data, tree.flags(i));
+  }
+  table.addNodes(nodes);
+}
+
+/**
+ * @brief bring a linked directory up to date after it changed on disk. Entries whose
+ *        source has gone are removed, then the current content of every recursive link
+ *        covering the directory is linked again in link order. New subdirectories are
+ *        linked completely, existing ones have stamps of their own
+ */
+static void resyncDirectory(usvfs::RedirectionTreeContainer &table,
+                            usvfs::RedirectionTreeContainer *inverseTable,
+                            const std::wstring &virtualPath)
+{
+  bfs::path virtualDirectory(virtualPath);
+  std::vector<std::string> staleNames;
+  std::vector<std::string> staleTargets;
+  {
+    usvfs::RedirectionTree::NodePtrT node = table->findNode(virtualDirectory);
+    if (node.get() == nullptr) {
+      // already removed along with its parent
+      return;
+    }
+    for (auto iter = node->filesBegin(); iter != node->filesEnd(); ++iter) {
+      const usvfs::RedirectionTree *child = iter->second.get().get();
+      std::string target = child->data().target();
+      if (!target.empty()
+          && (::GetFileAttributesW(ush::string_cast<std::wstring>(
+                  target.c_str(), ush::CodePage::UTF8).c_str()) == INVALID_FILE_ATTRIBUTES)) {
+        staleNames.push_back(child->name());
+        staleTargets.push_back(target);
+      }
+    }
+  }
+
+  for (size_t i = 0; i < staleNames.size(); ++i) {
+    table.removeNode(virtualDirectory / staleNames[i]);
+    if ((inverseTable != nullptr) && inverseLinked(staleNames[i])) {
+      inverseTable->removeNode(bfs::path(staleTargets[i]));
+    }
+  }
+
+  std::string virtualU8 = ush::string_cast<std::string>(virtualPath, ush::CodePage::UTF8) + "\\";
+  // subdirectories linked by this resync, later links have to add to them as well
+  usvfs::FoldedNameSet linkedDirectories;
+
+  for (const usvfs::DirectoryLink &link : linkHistory) {
+    if ((link.flags & LINKFLAG_RECURSIVE) == 0) {
+      continue;
+    }
+    std::wstring relative;
+    std::wstring sourceDirectory;
+    if (_wcsicmp(virtualPath.c_str(), link.destination.c_str()) == 0) {
+      sourceDirectory = link.source;
+    } else if (splitRelativePath(virtualPath, link.destination, relative)) {
+      sourceDirectory = link.source + L"\\" + relative;
+    } else {
+      continue;
+    }
+
+    std::string sourceU8
+        = ush::string_cast<std::string>(sourceDirectory, ush::CodePage::UTF8) + "\\";
+    std::vector<std::wstring> subDirectories;
+    winapi::ex::wide::quickFindFiles(sourceDirectory.c_str(), L"*",
+        [&](const winapi::ex::wide::FileEntry &file) {
+      if (file.attributes & FILE_ATTRIBUTE_DIRECTORY) {
+        if ((file.fileName != L".") && (file.fileName != L"..")) {
+          subDirectories.push_back(file.fileName.to_string());
+        }
+      } else {
+        std::string nameU8 = ush::string_cast<std::string>(
+            file.fileName.data(), ush::CodePage::UTF8, file.fileName.size());
+        table.addFile(virtualDirectory / nameU8,
+                      usvfs::RedirectionDataLocal(sourceU8, nameU8), true);
+
+        if ((inverseTable != nullptr) && inverseLinked(nameU8)) {
+          inverseTable->addFile(bfs::path(sourceDirectory) / nameU8,
+                               usvfs::RedirectionDataLocal(virtualU8, nameU8), true);
+        }
+      }
+    });
+
+    for (const std::wstring &subDirectory : subDirectories) {
+      std::wstring subPath = virtualPath + L"\\" + subDirectory;
+      if (!linkedDirectories.contains(subDirectory.c_str(), subDirectory.size())
+          && (table->findNode(bfs::path(subPath)).get() != nullptr)) {
+        continue;
+      }
+      linkedDirectories.insert(subDirectory);
+      std::wstring subSource = sourceDirectory + L"\\" + subDirectory;
+      std::string subSourceU8 = ush::string_cast<std::string>(subSource, ush::CodePage::UTF8) + "\\";
+      table.addDirectory(bfs::path(subPath), usvfs::RedirectionDataLocal(subSourceU8),
+                         usvfs::shared::FLAG_DIRECTORY | convertRedirectionFlags(link.flags),
+                         (link.flags & LINKFLAG_CREATETARGET) != 0);
+      linkDirectoryContent(table, inverseTable, subSource.c_str(), subPath.c_str(),
+                           link.flags);
+    }
+  }
+}
+
+
+BOOL WINAPI SaveVFSSnapshot(LPCWSTR fileName)
+{
+  if ((context == nullptr) || (fileName == nullptr) || batchTable) {
+    SetLastError(ERROR_INVALID_FUNCTION);
+    return FALSE;
+  }
+  if (!materializedLinks.empty()) {
+    // materialized files point at links in the staging directory, those are gone
+    // once the vfs is cleared
+    spdlog::get("usvfs")->error("can't save a snapshot of a vfs with materialized files");
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return FALSE;
+  }
+
+  try {
+    updateInverseTable();
+    const usvfs::RedirectionTreeContainer &table = context->redirectionTable();
+    const usvfs::RedirectionTreeContainer &inverseTable = context->inverseTable();
+    auto getTarget = [](const usvfs::RedirectionTree &node) {
+      return node.data().target();
+    };
+    std::vector<char> image = ush::buildFlatTree(*table.get(), table.generation(), getTarget);
+    std::vector<char> inverseImage
+        = ush::buildFlatTree(*inverseTable.get(), inverseTable.generation(), getTarget);
+
+    // every directory with a source gets a stamp so changes can be detected on load
+    ush::FlatTree tree(image.data(), image.size());
+    std::vector<std::string> paths = flatTreePaths(tree);
+    std::vector<usvfs::DirectoryStamp> stamps;
+    for (uint32_t i = 1; i < tree.numNodes(); ++i) {
+      if (tree.isDirectory(i) && (*tree.target(i) != '\0')) {
+        std::wstring directory = trimmedPath(
+            ush::string_cast<std::wstring>(tree.target(i), ush::CodePage::UTF8).c_str());
+        uint64_t stamp = usvfs::VFSSnapshot::currentStamp(directory);
+        stamps.push_back(usvfs::DirectoryStamp{
+            directory, ush::string_cast<std::wstring>(paths[i], ush::CodePage::UTF8), stamp });
+      }
+    }
+
+    usvfs::VFSSnapshot::save(fileName, linkHistory, stamps, image, table.usedSize(),
+                             inverseImage, inverseTable.usedSize());
+    spdlog::get("usvfs")->info("saved snapshot {} ({} nodes, {} directories)",
+                               ush::string_cast<std::string>(fileName, ush::CodePage::UTF8),
+                               tree.numNodes(), stamps.size());
+  } catch (const std::exception &e) {
+    spdlog::get("usvfs")->error("failed to save snapshot: {}", e.what());
+    SetLastError(ERROR_WRITE_FAULT);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+BOOL WINAPI LoadVFSSnapshot(LPCWSTR fileName)
+{
+  if ((context == nullptr) || (fileName == nullptr)) {
+    SetLastError(ERROR_INVALID_FUNCTION);
+    return FALSE;
+  }
+
+  std::unique_ptr<usvfs::VFSSnapshot> snapshot = usvfs::VFSSnapshot::open(fileName);
+  if (!snapshot) {
+    SetLastError(ERROR_FILE_NOT_FOUND);
+    return FALSE;
+  }
+
+  try {
+    std::vector<const usvfs::DirectoryStamp*> changed = snapshot->changedStamps();
+
+    ClearVirtualMappings();
+    loadFlatTree(linkTable(), snapshot->table(), snapshot->tableSize());
+    if (batchTable) {
+      inverseTableStale = true;
+    } else {
+      // the saved inverse table matches the redirection table it was saved with
+      loadFlatTree(context->inverseTable(), snapshot->inverseTable(),
+                   snapshot->inverseTableSize());
+    }
+    linkHistory = snapshot->links();
+
+    if (!changed.empty()) {
+      usvfs::RedirectionTreeContainer *inverseTable = linkInverseTable();
+      for (const usvfs::DirectoryStamp *stamp : changed) {
+        resyncDirectory(linkTable(), inverseTable, stamp->virtualPath);
+      }
+    }
+
+    for (const usvfs::DirectoryLink &link : linkHistory) {
+      if (((link.flags & LINKFLAG_RECURSIVE) != 0)
+          && ((link.flags & LINKFLAG_MONITORCHANGES) != 0)) {
+        monitorLink(link);
+      }
+    }
+
+    linksUpdated();
+    spdlog::get("usvfs")->info("loaded snapshot {}, {} of {} directories changed",
+                               ush::string_cast<std::string>(fileName, ush::CodePage::UTF8),
+                               changed.size(), snapshot->stamps().size());
+  } catch (const std::exception &e) {
+    spdlog::get("usvfs")->error("failed to load snapshot: {}", e.what());
+    ClearVirtualMappings();
+    SetLastError(ERROR_INVALID_DATA);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+
 BOOL WINAPI CreateProcessHooked(LPCWSTR lpApplicationName
                                 , LPWSTR lpCommandLine
                                 , LPSECURITY_ATTRIBUTES lpProcessAttributes
@@ -675,11 +2301,21 @@ BOOL WINAPI CreateProcessHooked(LPCWSTR lpApplicationName
 
   BOOL blacklisted = context->executableBlacklisted(lpApplicationName, lpCommandLine);
 
+  if (!blacklisted) {
+    updateInverseTable();
+  }
+
+  startupTimings.createProcessNanoseconds = 0;
+  startupTimings.injectNanoseconds        = 0;
+  startupTimings.injectDLLNanoseconds     = 0;
+
+  auto createStart = std::chrono::steady_clock::now();
   BOOL res = CreateProcessW(lpApplicationName, lpCommandLine
                             , lpProcessAttributes, lpThreadAttributes
                             , bInheritHandles, flags
                             , lpEnvironment, lpCurrentDirectory
                             , lpStartupInfo, lpProcessInformation);
+  startupTimings.createProcessNanoseconds = nanosecondsSince(createStart);
   if (!res) {
     spdlog::get("usvfs")->error("failed to spawn {}", ush::string_cast<std::string>(lpCommandLine));
     return FALSE;
@@ -689,8 +2325,11 @@ BOOL WINAPI CreateProcessHooked(LPCWSTR lpApplicationName
     std::wstring applicationDirPath = winapi::wide::getModuleFileName(dllModule);
     boost::filesystem::path p(applicationDirPath);
     try {
+      usvfs::InjectionTimings timings;
       usvfs::injectProcess(p.parent_path().wstring(), context->callParameters(),
-                           *lpProcessInformation);
+                           *lpProcessInformation, context->parametersHandle(), &timings);
+      startupTimings.injectNanoseconds    = timings.totalNanoseconds;
+      startupTimings.injectDLLNanoseconds = timings.injectDLLNanoseconds;
     } catch (const std::exception &e) {
       spdlog::get("usvfs")->error("failed to inject: {}", e.what());
       logExtInfo(e, LogLevel::Error);
@@ -711,18 +2350,87 @@ BOOL WINAPI CreateProcessHooked(LPCWSTR lpApplicationName
 BOOL WINAPI CreateVFSDump(LPSTR buffer, size_t *size)
 {
   assert(size != nullptr);
-  std::ostringstream output;
-  usvfs::shared::dumpTree(output, *context->redirectionTable().get());
-  std::string str = output.str();
-  if ((buffer != NULL) && (*size > 0)) {
-    strncpy_s(buffer, *size, str.c_str(), _TRUNCATE);
-  }
-  bool success = *size >= str.length();
-  *size = str.length();
+  // copy what fits while the tree is walked, the full length is counted either way
+  size_t capacity = (buffer != NULL) ? *size : 0;
+  size_t length = 0;
+  usvfs::dumpRedirectionTree(*context->redirectionTable().get(), usvfs::DumpFormat::Text,
+                             [&] (const char *data, size_t dataSize) {
+    if (length + 1 < capacity) {
+      memcpy(buffer + length, data, std::min(dataSize, capacity - 1 - length));
+    }
+    length += dataSize;
+    return true;
+  });
+  if (capacity > 0) {
+    buffer[std::min(length, capacity - 1)] = '\0';
+  }
+  bool success = *size >= length;
+  *size = length;
   return success ? TRUE : FALSE;
 }
 
 
+BOOL WINAPI CreateVFSDumpStream(unsigned int format, VFSDumpCallback callback,
+                                LPVOID userData)
+{
+  if ((callback == nullptr) || ((format != VFSDUMP_TEXT) && (format != VFSDUMP_BINARY))) {
+    ::SetLastError(ERROR_INVALID_PARAMETER);
+    return FALSE;
+  }
+  bool completed = usvfs::dumpRedirectionTree(
+      *context->redirectionTable().get(),
+      format == VFSDUMP_BINARY ? usvfs::DumpFormat::Binary : usvfs::DumpFormat::Text,
+      [callback, userData] (const char *data, size_t size) {
+        return callback(data, size, userData) != FALSE;
+      });
+  return completed ? TRUE : FALSE;
+}
+
+
+static BOOL WINAPI writeDumpChunk(LPCSTR data, size_t size, LPVOID file)
+{
+  // chunks are at most 64kb so they always fit a single write
+  DWORD written = 0;
+  return ::WriteFile(static_cast<HANDLE>(file), data, static_cast<DWORD>(size), &written,
+                     nullptr)
+         && (written == size);
+}
+
+
+BOOL WINAPI CreateVFSDumpFile(unsigned int format, HANDLE file)
+{
+  if ((file == nullptr) || (file == INVALID_HANDLE_VALUE)) {
+    ::SetLastError(ERROR_INVALID_HANDLE);
+    return FALSE;
+  }
+  return CreateVFSDumpStream(format, &writeDumpChunk, file);
+}
+
+
+BOOL WINAPI GetVFSTreeStatistics(BOOL inverse, VFSTreeStatistics *statistics)
+{
+  if ((context == nullptr) || (statistics == nullptr)) {
+    SetLastError(ERROR_INVALID_PARAMETER);
+    return FALSE;
+  }
+  if (inverse) {
+    updateInverseTable();
+  }
+  usvfs::shared::TreeUsage usage = inverse ? context->inverseTable().usage()
+                                           : context->redirectionTable().usage();
+  statistics->directories   = usage.directories;
+  statistics->files         = usage.files;
+  statistics->nameBytes     = usage.nameBytes;
+  statistics->targetBytes   = usage.dataBytes;
+  statistics->segmentSize   = usage.segmentSize;
+  statistics->freeBytes     = usage.freeBytes;
+  statistics->overheadBytes = usage.overheadBytes;
+  statistics->growthCount   = usage.growthCount;
+  statistics->reserved      = 0;
+  return TRUE;
+}
+
+
 VOID WINAPI BlacklistExecutable(LPWSTR executableName)
 {
   context->blacklistExecutable(executableName);
@@ -747,6 +2455,29 @@ VOID WINAPI ClearLibraryForceLoads()
 }
 
 
+VOID WINAPI SetInverseTableExtensions(LPCWSTR extensions)
+{
+  std::set<std::string> result;
+  if (extensions == nullptr) {
+    result = { ".exe", ".dll" };
+  } else {
+    std::string list = ba::to_lower_copy(
+        ush::string_cast<std::string>(extensions, ush::CodePage::UTF8));
+    std::vector<std::string> items;
+    ba::split(items, list, ba::is_any_of(";"), ba::token_compress_on);
+    for (std::string &item : items) {
+      ba::trim(item);
+      if (!item.empty()) {
+        result.insert(item[0] == '.' ? item : "." + item);
+      }
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(inverseTableMutex);
+  inverseExtensions = result;
+  inverseTableStale = true;
+}
+
 VOID WINAPI PrintDebugInfo()
 {
   spdlog::get("usvfs")
@@ -809,10 +2540,12 @@ BOOL APIENTRY DllMain(HMODULE module,
   switch (reasonForCall) {
     case DLL_PROCESS_ATTACH: {
       dllModule = module;
+      ush::etw::registerProvider();
     } break;
     case DLL_PROCESS_DETACH: {
       if (exceptionHandler)
         ::RemoveVectoredExceptionHandler(exceptionHandler);
+      ush::etw::unregisterProvider();
     } break;
     case DLL_THREAD_ATTACH: {
     } break;
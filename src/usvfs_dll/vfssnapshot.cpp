@@ -0,0 +1,290 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "vfssnapshot.h"
+#include <windows_error.h>
+#include <stringcast.h>
+#include <spdlog.h>
+#include <cstring>
+
+namespace ush = usvfs::shared;
+
+namespace usvfs {
+
+namespace {
+
+struct VFSSnapshotHeader {
+  static const uint32_t MAGIC = 0x50534656; // "VFSP"
+  static const uint32_t VERSION = 1;
+
+  uint32_t magic;
+  uint32_t version;
+  uint32_t linkCount;
+  uint32_t stampCount;
+  uint32_t stringBytes;
+  uint32_t tableBytes;
+  uint32_t inverseTableBytes;
+  uint32_t checksum; // over everything following the header
+  uint64_t tableSize;
+  uint64_t inverseTableSize;
+};
+
+struct SnapshotLinkRecord {
+  uint32_t source;
+  uint32_t destination;
+  uint32_t flags;
+};
+
+struct SnapshotStampRecord {
+  uint32_t directory;
+  uint32_t virtualPath;
+  uint32_t lastWriteLow;
+  uint32_t lastWriteHigh;
+};
+
+// the sections are padded so the flat tree images stay 4-byte aligned
+size_t padded(size_t size)
+{
+  return (size + 3) & ~static_cast<size_t>(3);
+}
+
+uint32_t checksum(const char *data, size_t size)
+{
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= static_cast<uint8_t>(data[i]);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+bool readStamp(const std::wstring &directory, uint64_t &lastWrite)
+{
+  WIN32_FILE_ATTRIBUTE_DATA data;
+  if (!::GetFileAttributesExW(directory.c_str(), GetFileExInfoStandard, &data)) {
+    return false;
+  }
+  lastWrite = (static_cast<uint64_t>(data.ftLastWriteTime.dwHighDateTime) << 32)
+              | data.ftLastWriteTime.dwLowDateTime;
+  return true;
+}
+
+}
+
+
+VFSSnapshot::~VFSSnapshot()
+{
+  if (m_View != nullptr) {
+    ::UnmapViewOfFile(m_View);
+  }
+  if (m_Mapping != nullptr) {
+    ::CloseHandle(m_Mapping);
+  }
+  if (m_File != INVALID_HANDLE_VALUE) {
+    ::CloseHandle(m_File);
+  }
+}
+
+void VFSSnapshot::save(const std::wstring &fileName, const std::vector<DirectoryLink> &links,
+                       const std::vector<DirectoryStamp> &stamps,
+                       const std::vector<char> &table, uint64_t tableSize,
+                       const std::vector<char> &inverseTable, uint64_t inverseTableSize)
+{
+  std::string strings(1, '\0');
+  auto addString = [&strings](const std::wstring &value) -> uint32_t {
+    uint32_t offset = static_cast<uint32_t>(strings.size());
+    strings.append(ush::string_cast<std::string>(value, ush::CodePage::UTF8));
+    strings.push_back('\0');
+    return offset;
+  };
+
+  std::vector<SnapshotLinkRecord> linkRecords;
+  linkRecords.reserve(links.size());
+  for (const DirectoryLink &link : links) {
+    linkRecords.push_back(SnapshotLinkRecord{ addString(link.source),
+                                              addString(link.destination), link.flags });
+  }
+
+  std::vector<SnapshotStampRecord> stampRecords;
+  stampRecords.reserve(stamps.size());
+  for (const DirectoryStamp &stamp : stamps) {
+    stampRecords.push_back(SnapshotStampRecord{
+        addString(stamp.directory), addString(stamp.virtualPath),
+        static_cast<uint32_t>(stamp.lastWrite), static_cast<uint32_t>(stamp.lastWrite >> 32) });
+  }
+  strings.resize(padded(strings.size()), '\0');
+
+  VFSSnapshotHeader header;
+  header.magic             = VFSSnapshotHeader::MAGIC;
+  header.version           = VFSSnapshotHeader::VERSION;
+  header.linkCount         = static_cast<uint32_t>(linkRecords.size());
+  header.stampCount        = static_cast<uint32_t>(stampRecords.size());
+  header.stringBytes       = static_cast<uint32_t>(strings.size());
+  header.tableBytes        = static_cast<uint32_t>(padded(table.size()));
+  header.inverseTableBytes = static_cast<uint32_t>(padded(inverseTable.size()));
+  header.tableSize         = tableSize;
+  header.inverseTableSize  = inverseTableSize;
+
+  std::vector<char> payload(linkRecords.size() * sizeof(SnapshotLinkRecord)
+                            + stampRecords.size() * sizeof(SnapshotStampRecord)
+                            + header.stringBytes + header.tableBytes
+                            + header.inverseTableBytes, '\0');
+  char *pos = payload.data();
+  if (!linkRecords.empty()) {
+    memcpy(pos, linkRecords.data(), linkRecords.size() * sizeof(SnapshotLinkRecord));
+    pos += linkRecords.size() * sizeof(SnapshotLinkRecord);
+  }
+  if (!stampRecords.empty()) {
+    memcpy(pos, stampRecords.data(), stampRecords.size() * sizeof(SnapshotStampRecord));
+    pos += stampRecords.size() * sizeof(SnapshotStampRecord);
+  }
+  memcpy(pos, strings.data(), strings.size());
+  pos += header.stringBytes;
+  memcpy(pos, table.data(), table.size());
+  pos += header.tableBytes;
+  memcpy(pos, inverseTable.data(), inverseTable.size());
+  header.checksum = checksum(payload.data(), payload.size());
+
+  // written to a temporary file first so a failure doesn't leave a damaged snapshot
+  std::wstring tempName = fileName + L".tmp";
+  HANDLE file = ::CreateFileW(tempName.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+                              FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    throw ush::windows_error("failed to create snapshot file");
+  }
+
+  DWORD written = 0;
+  bool success
+      = ::WriteFile(file, &header, sizeof(header), &written, nullptr)
+        && (written == sizeof(header))
+        && ::WriteFile(file, payload.data(), static_cast<DWORD>(payload.size()), &written, nullptr)
+        && (written == payload.size());
+  DWORD error = ::GetLastError();
+  ::CloseHandle(file);
+
+  if (!success || !::MoveFileExW(tempName.c_str(), fileName.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+    if (success) {
+      error = ::GetLastError();
+    }
+    ::DeleteFileW(tempName.c_str());
+    throw ush::windows_error("failed to write snapshot file", error);
+  }
+}
+
+std::unique_ptr<VFSSnapshot> VFSSnapshot::open(const std::wstring &fileName)
+{
+  std::unique_ptr<VFSSnapshot> result(new VFSSnapshot);
+  result->m_File = ::CreateFileW(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                                 OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (result->m_File == INVALID_HANDLE_VALUE) {
+    return std::unique_ptr<VFSSnapshot>();
+  }
+
+  LARGE_INTEGER fileSize;
+  if (!::GetFileSizeEx(result->m_File, &fileSize)
+      || (fileSize.QuadPart < static_cast<LONGLONG>(sizeof(VFSSnapshotHeader)))
+      || (static_cast<ULONGLONG>(fileSize.QuadPart) > SIZE_MAX)) {
+    return std::unique_ptr<VFSSnapshot>();
+  }
+  size_t size = static_cast<size_t>(fileSize.QuadPart);
+
+  result->m_Mapping = ::CreateFileMappingW(result->m_File, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (result->m_Mapping == nullptr) {
+    return std::unique_ptr<VFSSnapshot>();
+  }
+  result->m_View = ::MapViewOfFile(result->m_Mapping, FILE_MAP_READ, 0, 0, 0);
+  if (result->m_View == nullptr) {
+    return std::unique_ptr<VFSSnapshot>();
+  }
+
+  const char *data = static_cast<const char*>(result->m_View);
+  const VFSSnapshotHeader *header = reinterpret_cast<const VFSSnapshotHeader*>(data);
+  uint64_t expected = sizeof(VFSSnapshotHeader)
+                      + static_cast<uint64_t>(header->linkCount) * sizeof(SnapshotLinkRecord)
+                      + static_cast<uint64_t>(header->stampCount) * sizeof(SnapshotStampRecord)
+                      + header->stringBytes + header->tableBytes + header->inverseTableBytes;
+  if ((header->magic != VFSSnapshotHeader::MAGIC)
+      || (header->version != VFSSnapshotHeader::VERSION)
+      || (expected != size)
+      || (checksum(data + sizeof(VFSSnapshotHeader), size - sizeof(VFSSnapshotHeader))
+          != header->checksum)) {
+    spdlog::get("usvfs")->warn("ignoring invalid snapshot {}",
+                               ush::string_cast<std::string>(fileName, ush::CodePage::UTF8));
+    return std::unique_ptr<VFSSnapshot>();
+  }
+
+  const SnapshotLinkRecord *links
+      = reinterpret_cast<const SnapshotLinkRecord*>(header + 1);
+  const SnapshotStampRecord *stamps
+      = reinterpret_cast<const SnapshotStampRecord*>(links + header->linkCount);
+  const char *strings = reinterpret_cast<const char*>(stamps + header->stampCount);
+  const char *table = strings + header->stringBytes;
+  const char *inverseTable = table + header->tableBytes;
+
+  auto getString = [strings, header](uint32_t offset) -> std::wstring {
+    if ((header->stringBytes == 0) || (offset >= header->stringBytes)) {
+      return std::wstring();
+    }
+    size_t length = strnlen(strings + offset, header->stringBytes - offset);
+    return ush::string_cast<std::wstring>(strings + offset, ush::CodePage::UTF8, length);
+  };
+
+  result->m_Links.reserve(header->linkCount);
+  for (uint32_t i = 0; i < header->linkCount; ++i) {
+    result->m_Links.push_back(DirectoryLink{ getString(links[i].source),
+                                             getString(links[i].destination),
+                                             links[i].flags });
+  }
+  result->m_Stamps.reserve(header->stampCount);
+  for (uint32_t i = 0; i < header->stampCount; ++i) {
+    result->m_Stamps.push_back(DirectoryStamp{
+        getString(stamps[i].directory), getString(stamps[i].virtualPath),
+        (static_cast<uint64_t>(stamps[i].lastWriteHigh) << 32) | stamps[i].lastWriteLow });
+  }
+
+  result->m_Table = shared::FlatTree(table, header->tableBytes);
+  result->m_InverseTable = shared::FlatTree(inverseTable, header->inverseTableBytes);
+  if (!result->m_Table.valid() || !result->m_InverseTable.valid()) {
+    return std::unique_ptr<VFSSnapshot>();
+  }
+  result->m_TableSize = header->tableSize;
+  result->m_InverseTableSize = header->inverseTableSize;
+  return result;
+}
+
+std::vector<const DirectoryStamp*> VFSSnapshot::changedStamps() const
+{
+  std::vector<const DirectoryStamp*> result;
+  for (const DirectoryStamp &stamp : m_Stamps) {
+    uint64_t lastWrite = 0;
+    if (!readStamp(stamp.directory, lastWrite) || (lastWrite != stamp.lastWrite)) {
+      result.push_back(&stamp);
+    }
+  }
+  return result;
+}
+
+uint64_t VFSSnapshot::currentStamp(const std::wstring &directory)
+{
+  uint64_t lastWrite = 0;
+  return readStamp(directory, lastWrite) ? lastWrite : 0;
+}
+
+}
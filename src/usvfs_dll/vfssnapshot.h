@@ -0,0 +1,126 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <windows_sane.h>
+#include <flattree.h>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace usvfs {
+
+/**
+ * @brief a directory link as it was made through VirtualLinkDirectoryStatic
+ */
+struct DirectoryLink {
+  std::wstring source;
+  std::wstring destination;
+  unsigned int flags;
+};
+
+/**
+ * @brief last write time of a linked source directory at the time the snapshot was
+ *        saved. The time of a directory changes whenever entries are added to it,
+ *        removed or renamed
+ */
+struct DirectoryStamp {
+  std::wstring directory;   // the real directory
+  std::wstring virtualPath; // where it's linked to
+  uint64_t lastWrite;
+};
+
+/**
+ * @brief compiled redirection tables saved to a file so they can be loaded without
+ *        scanning the source directories again. The file is memory-mapped on load and
+ *        the tables are read from it in the flat tree format.
+ *
+ * Layout: VFSSnapshotHeader, the links and stamps (fixed size records referencing the
+ * string pool), the string pool (utf-8), then the redirection and inverse table
+ * images. Everything is 32-bit offsets so snapshots are independent of the bitness of
+ * the process
+ */
+class VFSSnapshot
+{
+public:
+
+  VFSSnapshot(const VFSSnapshot&) = delete;
+  VFSSnapshot &operator=(const VFSSnapshot&) = delete;
+  ~VFSSnapshot();
+
+  /**
+   * @brief write a snapshot file, replacing an existing one
+   * @param table image of the redirection table as created by buildFlatTree
+   * @param tableSize number of bytes the redirection table used in shared memory
+   * @throw windows_error if the file can't be written
+   */
+  static void save(const std::wstring &fileName, const std::vector<DirectoryLink> &links,
+                   const std::vector<DirectoryStamp> &stamps,
+                   const std::vector<char> &table, uint64_t tableSize,
+                   const std::vector<char> &inverseTable, uint64_t inverseTableSize);
+
+  /**
+   * @return the snapshot or a null pointer if the file doesn't exist or isn't a valid
+   *         snapshot
+   */
+  static std::unique_ptr<VFSSnapshot> open(const std::wstring &fileName);
+
+  const std::vector<DirectoryLink> &links() const { return m_Links; }
+  const std::vector<DirectoryStamp> &stamps() const { return m_Stamps; }
+
+  /**
+   * @return the current last write time of a directory, 0 if it can't be read
+   */
+  static uint64_t currentStamp(const std::wstring &directory);
+
+  /**
+   * @return the stamps that don't match the current state of their directory
+   */
+  std::vector<const DirectoryStamp*> changedStamps() const;
+
+  const shared::FlatTree &table() const { return m_Table; }
+  const shared::FlatTree &inverseTable() const { return m_InverseTable; }
+
+  // number of bytes the tables used in shared memory when they were saved
+  uint64_t tableSize() const { return m_TableSize; }
+  uint64_t inverseTableSize() const { return m_InverseTableSize; }
+
+private:
+
+  VFSSnapshot() = default;
+
+private:
+
+  HANDLE m_File { INVALID_HANDLE_VALUE };
+  HANDLE m_Mapping { nullptr };
+  const void *m_View { nullptr };
+
+  std::vector<DirectoryLink> m_Links;
+  std::vector<DirectoryStamp> m_Stamps;
+  shared::FlatTree m_Table { nullptr, 0 };
+  shared::FlatTree m_InverseTable { nullptr, 0 };
+  uint64_t m_TableSize { 0 };
+  uint64_t m_InverseTableSize { 0 };
+
+};
+
+}
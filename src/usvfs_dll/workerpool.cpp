@@ -0,0 +1,131 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "workerpool.h"
+#include <windows_error.h>
+#include <spdlog.h>
+#include <algorithm>
+
+namespace ush = usvfs::shared;
+
+namespace usvfs {
+
+WorkerPool &WorkerPool::instance()
+{
+  // not destroyed on unload, joining the threads under the loader lock would hang
+  static WorkerPool *pool = new WorkerPool();
+  return *pool;
+}
+
+WorkerPool::WorkerPool()
+  : m_Wakeup(::CreateSemaphoreW(nullptr, 0, LONG_MAX, nullptr))
+{
+  if (m_Wakeup == nullptr) {
+    throw ush::windows_error("failed to create worker semaphore");
+  }
+}
+
+void WorkerPool::submit(Task task)
+{
+  Node *node = new Node{ std::move(task), m_Head.load(std::memory_order_relaxed) };
+  while (!m_Head.compare_exchange_weak(node->next, node, std::memory_order_release,
+                                       std::memory_order_relaxed)) {
+  }
+  // checked after queueing: either the threads are still running and stop() will
+  // run the task or they are gone already and get started again here
+  if (!m_Running.load(std::memory_order_acquire)) {
+    start();
+  }
+  ::ReleaseSemaphore(m_Wakeup, 1, nullptr);
+}
+
+void WorkerPool::start()
+{
+  std::lock_guard<std::mutex> lock(m_ThreadsMutex);
+  if (m_Running.load()) {
+    return;
+  }
+  // one thread per four cores but at most two, the game needs the rest
+  unsigned int count = std::min(std::max(std::thread::hardware_concurrency() / 4, 1U), 2U);
+  for (unsigned int i = 0; i < count; ++i) {
+    m_Threads.emplace_back([this] () { run(); });
+    ::SetThreadPriority(m_Threads.back().native_handle(), THREAD_PRIORITY_BELOW_NORMAL);
+  }
+  m_Running.store(true, std::memory_order_release);
+}
+
+void WorkerPool::stop()
+{
+  std::lock_guard<std::mutex> lock(m_ThreadsMutex);
+  if (m_Threads.empty()) {
+    return;
+  }
+  m_Running.store(false);
+  m_Stop.store(true);
+  ::ReleaseSemaphore(m_Wakeup, static_cast<LONG>(m_Threads.size()), nullptr);
+  for (std::thread &thread : m_Threads) {
+    thread.join();
+  }
+  m_Threads.clear();
+  m_Stop.store(false);
+}
+
+WorkerPool::Node *WorkerPool::takeAll()
+{
+  Node *node = m_Head.exchange(nullptr, std::memory_order_acquire);
+  // the list is newest first
+  Node *ordered = nullptr;
+  while (node != nullptr) {
+    Node *next = node->next;
+    node->next = ordered;
+    ordered = node;
+    node = next;
+  }
+  return ordered;
+}
+
+void WorkerPool::run()
+{
+  for (;;) {
+    ::WaitForSingleObject(m_Wakeup, INFINITE);
+    // several tasks may be taken in one go so some wakeups find nothing to do
+    bool stop = m_Stop.load();
+    for (Node *node = takeAll(); node != nullptr; node = takeAll()) {
+      while (node != nullptr) {
+        try {
+          node->task();
+        } catch (const std::exception &e) {
+          spdlog::get("usvfs")->error("background task failed: {}", e.what());
+        }
+        Node *next = node->next;
+        delete node;
+        node = next;
+      }
+      if (!stop) {
+        break;
+      }
+    }
+    if (stop) {
+      break;
+    }
+  }
+}
+
+}
@@ -0,0 +1,92 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include "dllimport.h"
+#include <windows_sane.h>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace usvfs {
+
+/**
+ * @brief the background threads of the dll, for work that doesn't have to happen on
+ *        the calling thread. The threads are only started once work is submitted.
+ *        There are never more than two and they run below normal priority, so they
+ *        don't take cpu time from the game's own threads. Tasks go onto a lock-free
+ *        list, submitting never blocks the caller while the pool is running
+ */
+class WorkerPool
+{
+public:
+
+  typedef std::function<void()> Task;
+
+  DLLEXPORT static WorkerPool &instance();
+
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool &operator=(const WorkerPool&) = delete;
+
+  /**
+   * @brief run a task on one of the background threads. Tasks run in the order they
+   *        were submitted unless several threads pick up tasks at the same time
+   */
+  DLLEXPORT void submit(Task task);
+
+  /**
+   * @brief run all submitted tasks to completion and end the threads. Tasks
+   *        submitted afterwards start them again
+   * @note must not be called from a task or under the loader lock
+   */
+  DLLEXPORT void stop();
+
+private:
+
+  struct Node {
+    Task task;
+    Node *next;
+  };
+
+  WorkerPool();
+
+  void start();
+  void run();
+
+  // take all queued tasks, oldest first
+  Node *takeAll();
+
+private:
+
+  std::atomic<Node*> m_Head{nullptr};
+  HANDLE m_Wakeup;
+
+  std::atomic<bool> m_Running{false};
+  std::atomic<bool> m_Stop{false};
+  // serializes starting and stopping the threads
+  std::mutex m_ThreadsMutex;
+  std::vector<std::thread> m_Threads;
+
+};
+
+}
@@ -27,26 +27,186 @@ along with usvfs. If not, see <http://www.gnu.org/licenses/>.
 #include <injectlib.h>
 #include <stringutils.h>
 #include <stringcast.h>
+#include <scopeguard.h>
+#include <etwprovider.h>
+#include <chrono>
 #include <string>
 #include <utility>
+#include <map>
+#include <mutex>
 
 
 namespace ush = usvfs::shared;
 
 using namespace winapi;
 
+namespace {
+
+struct InjectionPaths {
+  boost::filesystem::path dll;   // empty if the dll for our bitness wasn't found
+  boost::filesystem::path proxy; // empty if the proxy for the other bitness wasn't found
+};
+
+/**
+ * @brief locate the usvfs dll and the proxy of the other bitness next to the usvfs
+ *        binaries. The result is cached per path since in hooked processes every probe
+ *        has to go through the vfs and the files don't move while usvfs is in use
+ */
+const InjectionPaths &injectionPaths(const std::wstring &applicationPath)
+{
+  static std::mutex mutex;
+  static std::map<std::wstring, InjectionPaths> cache;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto iter = cache.find(applicationPath);
+  if (iter != cache.end()) {
+    return iter->second;
+  }
+
+  boost::filesystem::path binPath = boost::filesystem::path(applicationPath);
+  InjectionPaths paths;
+
+  static constexpr auto USVFS_DLL =
+#ifdef _WIN64
+    L"usvfs_x64.dll";
+#else
+    L"usvfs_x86.dll";
+#endif
+  boost::filesystem::path dllPath = binPath / USVFS_DLL;
+  bool dllFound = boost::filesystem::exists(dllPath);
+  // support for runing tests using a usvfs dll in lib folder (and proxy under bin):
+  if (!dllFound && binPath.filename() == L"bin") {
+    dllPath = binPath.parent_path() / L"lib" / USVFS_DLL;
+    dllFound = boost::filesystem::exists(dllPath);
+  }
+  if (dllFound) {
+    paths.dll = dllPath;
+  }
+
+  // first try platform specific proxy exe:
+  static constexpr auto USVFS_PREFERED_EXE =
+#ifdef _WIN64
+    L"usvfs_proxy_x86.exe";
+#else
+    L"usvfs_proxy_x64.exe";
+#endif
+  boost::filesystem::path exePath = binPath / USVFS_PREFERED_EXE;
+  bool exeFound = boost::filesystem::exists(exePath);
+  // support for runing tests using a usvfs dll in lib folder (and proxy under bin):
+  if (!exeFound && binPath.filename() == L"lib") {
+    exePath = binPath.parent_path() / L"bin" / USVFS_PREFERED_EXE;
+    exeFound = boost::filesystem::exists(exePath);
+  }
+  // finally fallback to old proxy naming (but only for 64bit as we don't have a 64bit proxy in this case):
+#ifdef _WIN64
+  if (!exeFound) {
+    exePath = binPath / L"usvfs_proxy.exe";
+    exeFound = boost::filesystem::exists(exePath);
+  }
+#endif
+  if (exeFound) {
+    paths.proxy = exePath;
+  }
+
+  return cache.emplace(applicationPath, paths).first->second;
+}
+
+/**
+ * @brief inject through the broker of the target's bitness, starting it if it doesn't
+ *        run yet. This is a single pipe transaction instead of a process launch per child
+ * @return true if the broker handled the request, false if the caller has to fall back
+ *         to a one-shot proxy
+ */
+bool injectThroughBroker(const boost::filesystem::path &exePath
+                         , const USVFSParameters &parameters
+                         , HANDLE processHandle
+                         , HANDLE threadHandle
+                         , bool proc64)
+{
+  std::wstring pipeName = usvfs::injectionBrokerPipe(parameters.instanceName, proc64);
+
+  usvfs::InjectionRequest request;
+  request.processId = ::GetProcessId(processHandle);
+  request.threadId
+      = threadHandle != INVALID_HANDLE_VALUE ? ::GetThreadId(threadHandle) : 0;
+
+  for (int attempt = 0; attempt < 2; ++attempt) {
+    usvfs::InjectionReply reply;
+    DWORD read = 0;
+    if (::CallNamedPipeW(pipeName.c_str(), &request, sizeof(request), &reply,
+                         sizeof(reply), &read, 5000)) {
+      if ((read != sizeof(reply)) || (reply.result == usvfs::INJECTION_FAILED)) {
+        spdlog::get("usvfs")->warn("injection broker failed to inject {}",
+                                   request.processId);
+        return false;
+      }
+      return true;
+    }
+
+    DWORD error = ::GetLastError();
+    if ((attempt > 0) || (error != ERROR_FILE_NOT_FOUND)) {
+      spdlog::get("usvfs")->warn("failed to reach injection broker: {}", error);
+      return false;
+    }
+
+    // no broker running for this instance yet. It keeps running on its own so there
+    // is nothing to wait for here except for its pipe to appear
+    process::Result broker = wide::createProcess(exePath.wstring())
+        .arg(L"--instance").arg(ush::string_cast<std::wstring>(parameters.instanceName))
+        .arg(L"--broker")();
+    if (!broker.valid) {
+      spdlog::get("usvfs")->warn("failed to start injection broker: {}", broker.errorCode);
+      return false;
+    }
+    // WaitNamedPipe fails right away while the pipe doesn't exist
+    for (int wait = 0; wait < 50; ++wait) {
+      if (::WaitNamedPipeW(pipeName.c_str(), NMPWAIT_USE_DEFAULT_WAIT)
+          || (::GetLastError() != ERROR_FILE_NOT_FOUND)
+          || (::WaitForSingleObject(broker.processInfo.hProcess, 100) != WAIT_TIMEOUT)) {
+        break;
+      }
+    }
+  }
+  return false;
+}
+
+}
+
+std::wstring usvfs::injectionBrokerPipe(const std::string &instanceName, bool x64)
+{
+  return std::wstring(L"\\\\.\\pipe\\usvfs_broker_")
+         + ush::string_cast<std::wstring>(instanceName) + (x64 ? L"_x64" : L"_x86");
+}
+
 void usvfs::injectProcess(const std::wstring &applicationPath
                           , const USVFSParameters &parameters
-                          , const PROCESS_INFORMATION &processInfo)
+                          , const PROCESS_INFORMATION &processInfo
+                          , uint64_t parametersHandle
+                          , InjectionTimings *timings)
 {
-  injectProcess(applicationPath, parameters, processInfo.hProcess, processInfo.hThread);
+  injectProcess(applicationPath, parameters, processInfo.hProcess, processInfo.hThread,
+                parametersHandle, timings);
 }
 
 void usvfs::injectProcess(const std::wstring &applicationPath
                           , const USVFSParameters &parameters
                           , HANDLE processHandle
-                          , HANDLE threadHandle)
+                          , HANDLE threadHandle
+                          , uint64_t parametersHandle
+                          , InjectionTimings *timings)
 {
+  typedef std::chrono::steady_clock Clock;
+  Clock::time_point timingStart = Clock::now();
+  Clock::duration injectDLLTime = Clock::duration::zero();
+  ON_BLOCK_EXIT([&] () {
+    if (timings != nullptr) {
+      timings->totalNanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(
+          Clock::now() - timingStart).count();
+      timings->injectDLLNanoseconds
+          = std::chrono::duration_cast<std::chrono::nanoseconds>(injectDLLTime).count();
+    }
+  });
+
   bool proc64 = false;
   bool sameBitness = false;
   {
@@ -77,68 +237,63 @@ void usvfs::injectProcess(const std::wstring &applicationPath
       }
     }
   }
+  uint64_t injectStart = ush::etw::now();
+  bool injected = false;
+  ON_BLOCK_EXIT([&] () {
+    ush::etw::processInjected(::GetProcessId(processHandle), sameBitness, injected,
+                              injectStart);
+  });
+
   boost::filesystem::path binPath = boost::filesystem::path(applicationPath);
   spdlog::get("usvfs")->info("injecting to process {} with {} bitness",
                              ::GetProcessId(processHandle), sameBitness ? "same" : "different");
 
+  const InjectionPaths &paths = injectionPaths(applicationPath);
+
   if (sameBitness) {
-    static constexpr auto USVFS_DLL =
-#ifdef _WIN64
-      L"usvfs_x64.dll";
-#else
-      L"usvfs_x86.dll";
-#endif
-    const auto& preferedDll = binPath / USVFS_DLL;
-    boost::filesystem::path dllPath = preferedDll;
-    bool dllFound = boost::filesystem::exists(dllPath);
-    // support for runing tests using a usvfs dll in lib folder (and proxy under bin):
-    if (!dllFound && binPath.filename() == L"bin") {
-      dllPath = binPath.parent_path() / L"lib" / USVFS_DLL;
-      dllFound = boost::filesystem::exists(dllPath);
-    }
-    if (!dllFound) {
+    const boost::filesystem::path &dllPath = paths.dll;
+    if (dllPath.empty()) {
       USVFS_THROW_EXCEPTION(
           file_not_found_error()
-          << ex_msg(std::string("dll missing: ")
-                    + ush::string_cast<std::string>(preferedDll.wstring()).c_str()));
+          << ex_msg(std::string("dll missing in: ")
+                    + ush::string_cast<std::string>(binPath.wstring()).c_str()));
     }
 
     spdlog::get("usvfs")->info("dll path: {}", log::wrap(dllPath.wstring()));
 
-    InjectLib::InjectDLL(processHandle, threadHandle, dllPath.c_str(),
-                         "InitHooks", &parameters, sizeof(USVFSParameters));
+    Clock::time_point injectDLLStart = Clock::now();
+    if (parametersHandle != 0) {
+      InjectionHandoff handoff = {};
+      handoff.magic            = INJECTION_HANDOFF_MAGIC;
+      handoff.mappingCapacity  = parameters.mappingCapacity;
+      handoff.parametersHandle = parametersHandle;
+      strncpy_s(handoff.instanceName, parameters.instanceName, _TRUNCATE);
+      InjectLib::InjectDLL(processHandle, threadHandle, dllPath.c_str(),
+                           "InitHooks", &handoff, sizeof(InjectionHandoff));
+    } else {
+      InjectLib::InjectDLL(processHandle, threadHandle, dllPath.c_str(),
+                           "InitHooks", &parameters, sizeof(USVFSParameters));
+    }
+    injectDLLTime = Clock::now() - injectDLLStart;
 
     spdlog::get("usvfs")->info("injection to same bitness process {} successful", ::GetProcessId(processHandle));
+    injected = true;
   } else {
-    // first try platform specific proxy exe:
-    static constexpr auto USVFS_PREFERED_EXE =
-#ifdef _WIN64
-      L"usvfs_proxy_x86.exe";
-#else
-      L"usvfs_proxy_x64.exe";
-#endif
-    const auto& preferedExe = binPath / USVFS_PREFERED_EXE;
-    boost::filesystem::path exePath = preferedExe;
-    bool exeFound = boost::filesystem::exists(exePath);
-    // support for runing tests using a usvfs dll in lib folder (and proxy under bin):
-    if (!exeFound && binPath.filename() == L"lib") {
-      exePath = binPath.parent_path() / L"bin" / USVFS_PREFERED_EXE;
-      exeFound = boost::filesystem::exists(exePath);
-    }
-    // finally fallback to old proxy naming (but only for 64bit as we don't have a 64bit proxy in this case):
-#ifdef _WIN64
-    if (!exeFound) {
-      exePath = binPath / L"usvfs_proxy.exe";
-      exeFound = boost::filesystem::exists(exePath);
-    }
-#endif
-    if (!exeFound) {
+    const boost::filesystem::path &exePath = paths.proxy;
+    if (exePath.empty()) {
       USVFS_THROW_EXCEPTION(file_not_found_error() << ex_msg(
-                                std::string("usvfs proxy not found: ")
-                                + ush::string_cast<std::string>(preferedExe.wstring())));
+                                std::string("usvfs proxy not found in: ")
+                                + ush::string_cast<std::string>(binPath.wstring())));
     }
     else
-      spdlog::get("usvfs")->info("using usvfs proxy: {}", ush::string_cast<std::string>(preferedExe.wstring()));
+      spdlog::get("usvfs")->info("using usvfs proxy: {}", ush::string_cast<std::string>(exePath.wstring()));
+
+    if (injectThroughBroker(exePath, parameters, processHandle, threadHandle, proc64)) {
+      spdlog::get("usvfs")->debug("broker injection successful");
+      injected = true;
+      return;
+    }
+
     // need to use proxy aplication to inject
     auto proxyProcess = std::move(wide::createProcess(exePath.wstring())
         .arg(L"--instance").arg(ush::string_cast<std::wstring>(parameters.instanceName))
@@ -171,7 +326,7 @@ void usvfs::injectProcess(const std::wstring &applicationPath
           } break;
         default: {
             spdlog::get("usvfs")->debug("proxy run successful");
-            // nop
+            injected = true;
           } break;
       }
     }
@@ -23,18 +23,71 @@ along with usvfs. If not, see <http://www.gnu.org/licenses/>.
 #include "usvfsparameters.h"
 #include <windows_sane.h>
 #include <string>
+#include <cstdint>
 
 namespace usvfs {
 
+/**
+ * @brief request sent to the injection broker. Fixed width since 32-bit and 64-bit
+ *        processes talk over the same pipe
+ */
+struct InjectionRequest {
+  uint32_t processId;
+  uint32_t threadId; // 0 if the broker is supposed to create a new thread
+};
+
+enum InjectionResult : uint32_t {
+  INJECTION_SUCCESS,
+  INJECTION_BLACKLISTED,
+  INJECTION_FAILED
+};
+
+struct InjectionReply {
+  uint32_t result; // one of InjectionResult
+};
+
+/**
+ * @brief what gets written into a process injected by a process that is already connected
+ *        to the vfs. Instead of the full parameters it only locates the configuration the
+ *        parent set up, the child reads all settings from there
+ */
+struct InjectionHandoff {
+  uint32_t magic; // INJECTION_HANDOFF_MAGIC
+  uint32_t mappingCapacity;
+  uint64_t parametersHandle; // offset of the SharedParameters in the configuration shm
+  char instanceName[65];
+};
+
+static const uint32_t INJECTION_HANDOFF_MAGIC = 0x53465655;
+
+/**
+ * @brief time spent injecting a process
+ */
+struct InjectionTimings {
+  uint64_t totalNanoseconds;
+  uint64_t injectDLLNanoseconds; // InjectLib::InjectDLL, 0 if a broker or proxy injected
+};
+
+/**
+ * @brief name of the pipe the long-lived injection broker (usvfs_proxy --broker) for
+ *        the specified instance and target bitness listens on
+ */
+std::wstring injectionBrokerPipe(const std::string &instanceName, bool x64);
+
 /**
  * @brief inject usvfs to a process
  * @param applicationPath
  * @param parameters
  * @param processInfo
+ * @param parametersHandle handle of the shared configuration in the configuration shm.
+ *                         If set, the child only receives an InjectionHandoff
+ * @param timings if set, receives the time the injection took
  */
 void injectProcess(const std::wstring &applicationPath
                    , const USVFSParameters &parameters
-                   , const PROCESS_INFORMATION &processInfo);
+                   , const PROCESS_INFORMATION &processInfo
+                   , uint64_t parametersHandle = 0
+                   , InjectionTimings *timings = nullptr);
 
 /**
  * @brief inject usvfs to a process
@@ -43,9 +96,14 @@ void injectProcess(const std::wstring &applicationPath
  * @param process process handle to inject to
  * @param thread main thread inside that process. This can be set to INVALID_HANDLE_VALUE in which case
  *               a new thread is created in the process
+ * @param parametersHandle handle of the shared configuration in the configuration shm.
+ *                         If set, the child only receives an InjectionHandoff
+ * @param timings if set, receives the time the injection took
  */
 void injectProcess(const std::wstring &applicationPath
                    , const USVFSParameters &parameters
-                   , HANDLE process, HANDLE thread);
+                   , HANDLE process, HANDLE thread
+                   , uint64_t parametersHandle = 0
+                   , InjectionTimings *timings = nullptr);
 
 }
@@ -26,11 +26,16 @@ along with usvfs. If not, see <http://www.gnu.org/licenses/>.
 #include <shmlogger.h>
 #include <spdlog.h>
 #include <winapi.h>
+#include <scopeguard.h>
 #include <boost/filesystem.hpp>
 #include <boost/lexical_cast.hpp>
-#include <boost/algorithm/string/predicate.hpp>
 #include <Psapi.h>
 #include <WinUser.h>
+#include <DbgHelp.h>
+#include <shellapi.h>
+#include <atomic>
+#include <thread>
+#include <vector>
 
 
 namespace bi = boost::interprocess;
@@ -71,6 +76,28 @@ T getParameter(std::vector<std::string> &arguments, const std::string &key, cons
   }
 }
 
+/**
+ * @brief read a parameter from the wide command line. argv only holds the arguments
+ *        in the ansi codepage so paths that don't fit it are lost there
+ */
+static std::wstring getWideParameter(const std::wstring &key)
+{
+  int count = 0;
+  LPWSTR *arguments = CommandLineToArgvW(GetCommandLineW(), &count);
+  if (arguments == nullptr) {
+    throw std::runtime_error("failed to parse the command line");
+  }
+  ON_BLOCK_EXIT([arguments] () { LocalFree(arguments); });
+  std::wstring option = L"--" + key;
+  for (int i = 1; i + 1 < count; ++i) {
+    if (option == arguments[i]) {
+      return arguments[i + 1];
+    }
+  }
+  throw std::runtime_error(std::string("argument missing ")
+                           + usvfs::shared::string_cast<std::string>(key));
+}
+
 static void exceptionDialog(int line, int num, ...) {
   va_list args;
   va_start(args, num);
@@ -92,6 +119,214 @@ static void exceptionDialog(int line, int num, ...) {
   va_end(args);
 }
 
+/**
+ * @brief inject to an already running process unless it's blacklisted
+ */
+static usvfs::InjectionResult injectRunning(SharedParameters *params,
+                                            uint64_t parametersHandle,
+                                            const bfs::path &binPath, int pid,
+                                            int tid,
+                                            std::shared_ptr<spdlog::logger> logger)
+{
+  HANDLE processHandle = OpenProcess(PROCESS_ALL_ACCESS, FALSE, pid);
+  if (processHandle == nullptr) {
+    logger->error("failed to open process {}: {}", pid, ::GetLastError());
+    return usvfs::INJECTION_FAILED;
+  }
+  HANDLE threadHandle = INVALID_HANDLE_VALUE;
+  if (tid != 0) {
+    threadHandle = OpenThread(THREAD_ALL_ACCESS, FALSE, tid);
+  }
+  ON_BLOCK_EXIT([&] () {
+    if (threadHandle != INVALID_HANDLE_VALUE) {
+      CloseHandle(threadHandle);
+    }
+    CloseHandle(processHandle);
+  });
+
+  TCHAR szModName[MAX_PATH];
+  if (GetModuleFileNameEx(processHandle, NULL, szModName, sizeof(szModName) / sizeof(TCHAR))) {
+    if (params->executableBlacklisted(szModName, nullptr)) {
+      logger->info("not injecting {} as application is blacklisted",
+          usvfs::shared::string_cast<std::string>(std::wstring(szModName)));
+      return usvfs::INJECTION_BLACKLISTED;
+    }
+  }
+
+  USVFSParameters par = params->makeLocal();
+  usvfs::injectProcess(binPath.wstring(), par, processHandle, threadHandle,
+                       parametersHandle);
+  return usvfs::INJECTION_SUCCESS;
+}
+
+/**
+ * @brief write a minidump of a process that crashed inside usvfs. The process is
+ *        suspended in its exception handler until this returns
+ * @param exceptionPointers address of the EXCEPTION_POINTERS in the crashed process
+ * @return 0 on success, the crashed process writes the dump itself otherwise
+ */
+static int writeDump(int pid, int tid, uint64_t exceptionPointers, CrashDumpsType type,
+                     const std::wstring &dumpPath, std::shared_ptr<spdlog::logger> logger)
+{
+  typedef BOOL (WINAPI *FuncMiniDumpWriteDump)(HANDLE process, DWORD pid, HANDLE file, MINIDUMP_TYPE dumpType,
+                                               const PMINIDUMP_EXCEPTION_INFORMATION exceptionParam,
+                                               const PMINIDUMP_USER_STREAM_INFORMATION userStreamParam,
+                                               const PMINIDUMP_CALLBACK_INFORMATION callbackParam);
+
+  HANDLE processHandle = OpenProcess(PROCESS_ALL_ACCESS, FALSE, pid);
+  if (processHandle == nullptr) {
+    logger->error("failed to open process {} for dumping: {}", pid, ::GetLastError());
+    return 1;
+  }
+  HMODULE dbgDLL = LoadLibraryW(L"dbghelp.dll");
+  ON_BLOCK_EXIT([&] () {
+    if (dbgDLL != nullptr) {
+      FreeLibrary(dbgDLL);
+    }
+    CloseHandle(processHandle);
+  });
+
+  FuncMiniDumpWriteDump funcDump = dbgDLL != nullptr
+      ? reinterpret_cast<FuncMiniDumpWriteDump>(GetProcAddress(dbgDLL, "MiniDumpWriteDump"))
+      : nullptr;
+  if (funcDump == nullptr) {
+    logger->error("MiniDumpWriteDump not available");
+    return 1;
+  }
+
+  wchar_t pname[100];
+  if (GetModuleBaseNameW(processHandle, nullptr, pname, _countof(pname)) == 0) {
+    return 1;
+  }
+  winapi::ex::wide::createPath(dumpPath.c_str());
+  // find an available name:
+  wchar_t dmpFile[MAX_PATH];
+  int count = 0;
+  _snwprintf_s(dmpFile, _TRUNCATE, L"%s\\%s-%d.dmp", dumpPath.c_str(), pname, pid);
+  while (winapi::ex::wide::fileExists(dmpFile)) {
+    if (++count > 99)
+      return 1;
+    _snwprintf_s(dmpFile, _TRUNCATE, L"%s\\%s-%d_%02d.dmp", dumpPath.c_str(), pname, pid, count);
+  }
+
+  HANDLE dumpFile = winapi::wide::createFile(dmpFile).createAlways().access(GENERIC_WRITE).share(FILE_SHARE_WRITE)();
+  if (dumpFile == INVALID_HANDLE_VALUE) {
+    logger->error("failed to create {}: {}",
+                  usvfs::shared::string_cast<std::string>(std::wstring(dmpFile)), ::GetLastError());
+    return 1;
+  }
+
+  DWORD dumpType = MiniDumpNormal | MiniDumpWithHandleData | MiniDumpWithUnloadedModules | MiniDumpWithProcessThreadData;
+  if (type == CrashDumpsType::Data)
+    dumpType |= MiniDumpWithDataSegs;
+  if (type == CrashDumpsType::Full)
+    dumpType |= MiniDumpWithFullMemory;
+
+  MINIDUMP_EXCEPTION_INFORMATION exceptionInfo;
+  exceptionInfo.ThreadId = tid;
+  exceptionInfo.ExceptionPointers = reinterpret_cast<PEXCEPTION_POINTERS>(exceptionPointers);
+  // the pointers are addresses in the crashed process
+  exceptionInfo.ClientPointers = TRUE;
+
+  BOOL success = funcDump(processHandle, pid, dumpFile, static_cast<MINIDUMP_TYPE>(dumpType),
+                          &exceptionInfo, nullptr, nullptr);
+  CloseHandle(dumpFile);
+  if (!success) {
+    logger->error("failed to write dump of process {}: {}", pid, ::GetLastError());
+    return 1;
+  }
+  logger->info("dump of process {} written to {}", pid,
+               usvfs::shared::string_cast<std::string>(std::wstring(dmpFile)));
+  return 0;
+}
+
+// the broker exits once it didn't receive a request for this long
+static const DWORD BROKER_IDLE_TIMEOUT = 60000;
+// number of requests handled concurrently
+static const int BROKER_INSTANCES = 4;
+
+/**
+ * @brief serve injection requests over a named pipe until there were none for a while.
+ *        Spares the hooked processes from starting a proxy for every child of the
+ *        other bitness
+ */
+static int runBroker(const std::string &instance, SharedParameters *params,
+                     uint64_t parametersHandle, const bfs::path &binPath,
+                     std::shared_ptr<spdlog::logger> logger)
+{
+#ifdef _WIN64
+  std::wstring pipeName = usvfs::injectionBrokerPipe(instance, true);
+#else
+  std::wstring pipeName = usvfs::injectionBrokerPipe(instance, false);
+#endif
+
+  std::vector<HANDLE> pipes;
+  for (int i = 0; i < BROKER_INSTANCES; ++i) {
+    // the first instance fails if another broker already serves this pipe
+    HANDLE pipe = CreateNamedPipeW(
+        pipeName.c_str(),
+        PIPE_ACCESS_DUPLEX | (pipes.empty() ? FILE_FLAG_FIRST_PIPE_INSTANCE : 0),
+        PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+        BROKER_INSTANCES, sizeof(usvfs::InjectionReply),
+        sizeof(usvfs::InjectionRequest), 0, nullptr);
+    if (pipe == INVALID_HANDLE_VALUE) {
+      if (pipes.empty()) {
+        logger->info("injection broker not started: {}", ::GetLastError());
+        return 1;
+      }
+      break;
+    }
+    pipes.push_back(pipe);
+  }
+  logger->info("injection broker running with {} instances", pipes.size());
+
+  HANDLE activity = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+  std::atomic<int> busy(0);
+
+  for (HANDLE pipe : pipes) {
+    std::thread([=, &busy] () {
+      for (;;) {
+        if (!ConnectNamedPipe(pipe, nullptr) && (::GetLastError() != ERROR_PIPE_CONNECTED)) {
+          logger->error("injection broker failed to accept: {}", ::GetLastError());
+          return;
+        }
+        ++busy;
+        SetEvent(activity);
+
+        usvfs::InjectionRequest request;
+        usvfs::InjectionReply reply{ usvfs::INJECTION_FAILED };
+        DWORD bytes = 0;
+        if (ReadFile(pipe, &request, sizeof(request), &bytes, nullptr)
+            && (bytes == sizeof(request))) {
+          try {
+            reply.result = injectRunning(params, parametersHandle, binPath,
+                                         request.processId, request.threadId, logger);
+          } catch (const std::exception &e) {
+            logger->error("broker injection to {} failed: {}", request.processId, e.what());
+            logExtInfo(e);
+          }
+          WriteFile(pipe, &reply, sizeof(reply), &bytes, nullptr);
+          FlushFileBuffers(pipe);
+        }
+        DisconnectNamedPipe(pipe);
+        --busy;
+      }
+    }).detach();
+  }
+
+  // idle workers stay blocked on the pipe and go away with the process
+  while ((WaitForSingleObject(activity, BROKER_IDLE_TIMEOUT) != WAIT_TIMEOUT)
+         || (busy.load() > 0)) {
+  }
+  // a client racing with the shutdown sees its transaction fail and falls back to
+  // starting a one-shot proxy
+  for (HANDLE pipe : pipes) {
+    CloseHandle(pipe);
+  }
+  logger->info("injection broker idle, exiting");
+  return 0;
+}
+
 int main(int argc, char **argv) {
   std::shared_ptr<spdlog::logger> logger;
 
@@ -100,11 +335,12 @@ int main(int argc, char **argv) {
 
   std::string instance;
   try {
-    SHMLogger::open("usvfs");
-    logger = spdlog::create<spdlog::sinks::shm_sink>("usvfs", "usvfs");
-    logger->set_pattern("%H:%M:%S.%e [%L] (proxy) %v");
-
     instance = getParameter<std::string>(arguments, "instance", true);
+
+    // log to the queue of the instance we work for
+    SHMLogger::open(instance.c_str());
+    logger = spdlog::create<spdlog::sinks::shm_sink>("usvfs", instance.c_str());
+    logger->set_pattern("%H:%M:%S.%e [%L] (proxy) %v");
   } catch (const std::exception &e) {
     if (logger.get() == nullptr) {
       exceptionDialog(__LINE__, 1, e.what());
@@ -126,12 +362,21 @@ int main(int argc, char **argv) {
         getParameter<std::string>(arguments, "executable", "", true);
     int pid = getParameter<int>(arguments, "pid", 0, true);
     int tid = getParameter<int>(arguments, "tid", 0, true);
+    bool broker = std::find(arguments.begin(), arguments.end(), "--broker") != arguments.end();
+
+    if (std::find(arguments.begin(), arguments.end(), "--dump") != arguments.end()) {
+      // started by the exception handler of a crashed process, doesn't need the vfs
+      uint64_t exceptionPointers = getParameter<uint64_t>(arguments, "exception", true);
+      int type = getParameter<int>(arguments, "type", true);
+      return writeDump(pid, tid, exceptionPointers, static_cast<CrashDumpsType>(type),
+                       getWideParameter(L"path"), logger);
+    }
 
     logger->info("instance: {}", instance);
     logger->info("exe: {}", executable);
     logger->info("pid: {}", pid);
 
-    if (executable.empty() && (pid == 0)) {
+    if (executable.empty() && (pid == 0) && !broker) {
       logger->warn("not all required settings set");
       return 1;
     }
@@ -151,35 +396,20 @@ int main(int argc, char **argv) {
       return 1;
     }
 
-    USVFSParameters par = params.first->makeLocal();
-
     boost::filesystem::path p(winapi::wide::getModuleFileName(nullptr));
+    uint64_t parametersHandle = static_cast<uint64_t>(
+        configurationSHM.get_handle_from_address(params.first));
 
-    if (executable.empty()) {
-      HANDLE processHandle = OpenProcess(PROCESS_ALL_ACCESS, FALSE, pid);
-      HANDLE threadHandle = INVALID_HANDLE_VALUE;
-      if (tid != 0) {
-        threadHandle = OpenThread(THREAD_ALL_ACCESS, FALSE, tid);
-      }
-
-      BOOL blacklisted = FALSE;
-      TCHAR szModName[MAX_PATH];
-      if (GetModuleFileNameEx(processHandle, NULL, szModName, sizeof(szModName) / sizeof(TCHAR))) {
-        for (usvfs::shared::StringT exec : params.first->processBlacklist) {
-          if (boost::algorithm::iends_with(std::wstring(szModName),
-                  "\\" + std::string(exec.data(), exec.size()))) {
-            logger->info("not injecting {} as application is blacklisted",
-                usvfs::shared::string_cast<std::string>(std::wstring(szModName)));
-            blacklisted = TRUE;
-            break;
-          }
-        }
-      }
-      if (!blacklisted) {
-        usvfs::injectProcess(p.parent_path().wstring(), par, processHandle,
-          threadHandle);
+    if (broker) {
+      return runBroker(instance, params.first, parametersHandle, p.parent_path(), logger);
+    } else if (executable.empty()) {
+      if (injectRunning(params.first, parametersHandle, p.parent_path(), pid, tid, logger)
+          == usvfs::INJECTION_FAILED) {
+        return 1;
       }
     } else {
+      USVFSParameters par = params.first->makeLocal();
+
       winapi::process::Result process =
           winapi::ansi::createProcess(executable)
               .arguments(arguments.begin(), arguments.end())
@@ -190,18 +420,14 @@ int main(int argc, char **argv) {
         return 1;
       }
 
-      BOOL blacklisted = FALSE;
-      for (usvfs::shared::StringT exec : params.first->processBlacklist) {
-        if (boost::algorithm::iends_with(executable,
-                "\\" + std::string(exec.data(), exec.size()))) {
-          logger->info("not injecting {} as application is blacklisted",
-              std::string(exec.data(), exec.size()));
-          blacklisted = TRUE;
-          break;
-        }
+      std::wstring executableW = usvfs::shared::string_cast<std::wstring>(executable);
+      BOOL blacklisted = params.first->executableBlacklisted(executableW.c_str(), nullptr);
+      if (blacklisted) {
+        logger->info("not injecting {} as application is blacklisted", executable);
       }
       if (!blacklisted) {
-        usvfs::injectProcess(p.parent_path().wstring(), par, process.processInfo);
+        usvfs::injectProcess(p.parent_path().wstring(), par, process.processInfo,
+                             parametersHandle);
       }
 
       ResumeThread(process.processInfo.hThread);
@@ -0,0 +1,338 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// launch latency of hooked processes. Starts itself, or the build of the other
+// bitness, through CreateProcessHooked over and over and reports how the time
+// is split between creating the process, injecting usvfs and the InitHooks of the
+// child, e.g.
+//   inject_benchmark_x64 --launches 500 --files 100000 --other-bitness
+// Instead of the flat synthetic tree it can link the mods test_file_operations
+// -benchmods generated, to start processes against the same setup the other
+// benchmarks use:
+//   inject_benchmark_x64 --mods <dir>
+
+#include <windows_sane.h>
+#include <usvfs.h>
+#include <winapi.h>
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace bfs = boost::filesystem;
+
+// same layout tree_benchmark uses: leaf directories with a few dozen files,
+// every level fanning out by 8
+static const size_t FILES_PER_DIRECTORY = 32;
+static const size_t DIRECTORY_FANOUT = 8;
+
+struct Options {
+  size_t launches = 200;
+  size_t files = 10000;
+  std::wstring mods; // directory of generated mods, replaces the synthetic tree
+  bool otherBitness = false;
+};
+
+struct Sample {
+  uint64_t launch;       // CreateProcessHooked as a whole
+  StartupTimings timings;
+};
+
+static std::wstring executable(bool otherBitness)
+{
+  bfs::path self(winapi::wide::getModuleFileName(nullptr));
+#if defined(_WIN64)
+  const wchar_t *other = L"inject_benchmark_x86.exe";
+#else
+  const wchar_t *other = L"inject_benchmark_x64.exe";
+#endif
+  return otherBitness ? (self.parent_path() / other).wstring() : self.wstring();
+}
+
+static std::wstring directoryPath(const std::wstring &root, size_t index, size_t levels)
+{
+  std::wstring result(root);
+  for (size_t level = 0; level < levels; ++level) {
+    result += L"\\dir" + std::to_wstring(level) + L"_"
+              + std::to_wstring(index % DIRECTORY_FANOUT);
+    index /= DIRECTORY_FANOUT;
+  }
+  return result;
+}
+
+/**
+ * link the requested number of files below the temp directory. The files don't need
+ * to exist, only the size of the trees the children attach to matters
+ */
+static bool buildTree(const bfs::path &root, size_t files)
+{
+  size_t directories = std::max<size_t>(1, files / FILES_PER_DIRECTORY);
+  size_t levels = 1;
+  for (size_t capacity = DIRECTORY_FANOUT; capacity < directories;
+       capacity *= DIRECTORY_FANOUT) {
+    ++levels;
+  }
+
+  std::wstring source = root.wstring();
+  std::wstring destination = (root / L"data").wstring();
+  if (!VirtualLinkDirectoryStatic(source.c_str(), destination.c_str(), 0)) {
+    return false;
+  }
+  std::set<std::wstring> linked;
+  for (size_t i = 0; i < files; ++i) {
+    std::wstring directory = directoryPath(destination, i / FILES_PER_DIRECTORY, levels);
+    if (linked.insert(directory).second) {
+      // parents have to be in the tree before anything can be linked below them
+      bfs::path current(destination);
+      for (const bfs::path &part : bfs::path(directory.substr(destination.size() + 1))) {
+        current /= part;
+        if (linked.insert(current.wstring()).second || (current == directory)) {
+          VirtualLinkDirectoryStatic(source.c_str(), current.wstring().c_str(), 0);
+        }
+      }
+    }
+    std::wstring file = directory + L"\\file" + std::to_wstring(i % FILES_PER_DIRECTORY)
+                        + L".dds";
+    if (!VirtualLinkFile((source + L"\\missing.dds").c_str(), file.c_str(), 0)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * link generated mods onto the data directory in the order their vfs_mappings.txt lists
+ * them. The generator only writes mapdir entries, anything else is rejected
+ */
+static bool linkMods(const bfs::path &root, const bfs::path &mods)
+{
+  FILE *file = _wfopen((mods / L"vfs_mappings.txt").wstring().c_str(), L"r");
+  if (file == nullptr) {
+    return false;
+  }
+
+  bfs::path mount = root / L"data";
+  bfs::path destination = mount;
+  bool result = true;
+  char line[1024];
+  while (result && (fgets(line, sizeof(line), file) != nullptr)) {
+    std::string text(line);
+    text.erase(text.find_last_not_of(" \t\r\n") + 1);
+    size_t start = text.find_first_not_of(" \t");
+    if ((start == std::string::npos) || (text[start] == '#')) {
+      continue;
+    }
+    if (start == 0) {
+      if (text.compare(0, 6, "mapdir") != 0) {
+        result = false;
+        break;
+      }
+      size_t relative = text.find_first_not_of(" \t", 6);
+      destination = relative == std::string::npos ? mount : mount / text.substr(relative);
+    } else {
+      bfs::path source = mods / text.substr(start);
+      result = VirtualLinkDirectoryStatic(source.wstring().c_str(),
+                                          destination.wstring().c_str(),
+                                          LINKFLAG_RECURSIVE) == TRUE;
+    }
+  }
+  fclose(file);
+  return result;
+}
+
+static bool launch(const std::wstring &exe, const bfs::path &resultFile, Sample &sample)
+{
+  std::wstring commandLine = L"\"" + exe + L"\" --child \"" + resultFile.wstring() + L"\"";
+
+  STARTUPINFOW si = { 0 };
+  si.cb = sizeof(si);
+  PROCESS_INFORMATION pi;
+
+  auto start = std::chrono::steady_clock::now();
+  if (!CreateProcessHooked(nullptr, &commandLine[0], nullptr, nullptr, FALSE, 0, nullptr,
+                           nullptr, &si, &pi)) {
+    fprintf(stderr, "failed to start %ls (%lu)\n", exe.c_str(), GetLastError());
+    return false;
+  }
+  sample.launch = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start).count();
+  GetStartupTimings(&sample.timings);
+
+  WaitForSingleObject(pi.hProcess, INFINITE);
+  DWORD exitCode = 1;
+  GetExitCodeProcess(pi.hProcess, &exitCode);
+  CloseHandle(pi.hThread);
+  CloseHandle(pi.hProcess);
+  if (exitCode != 0) {
+    fprintf(stderr, "child wasn't hooked (exit code %lu)\n", exitCode);
+    return false;
+  }
+
+  FILE *file = _wfopen(resultFile.wstring().c_str(), L"r");
+  if (file == nullptr) {
+    fprintf(stderr, "child didn't report its timings\n");
+    return false;
+  }
+  unsigned long long initHooks = 0, attach = 0, hooks = 0;
+  int read = fscanf(file, "%llu %llu %llu", &initHooks, &attach, &hooks);
+  fclose(file);
+  _wremove(resultFile.wstring().c_str());
+  sample.timings.initHooksNanoseconds = initHooks;
+  sample.timings.attachNanoseconds    = attach;
+  sample.timings.hookNanoseconds      = hooks;
+  return read == 3;
+}
+
+template <typename Field>
+static void report(const char *name, const std::vector<Sample> &samples, Field field)
+{
+  std::vector<uint64_t> values;
+  values.reserve(samples.size());
+  for (const Sample &sample : samples) {
+    values.push_back(field(sample));
+  }
+  std::sort(values.begin(), values.end());
+  auto percentile = [&values](double p) {
+    size_t index = static_cast<size_t>(p * static_cast<double>(values.size() - 1) + 0.5);
+    return static_cast<double>(values[index]) / 1000.0;
+  };
+  printf("%-16s %10.1f %10.1f %10.1f %10.1f %10.1f\n", name, percentile(0.0),
+         percentile(0.5), percentile(0.9), percentile(0.99), percentile(1.0));
+}
+
+static int runChild(const wchar_t *resultFile)
+{
+  StartupTimings timings = { 0 };
+  if (!GetStartupTimings(&timings) || (timings.initHooksNanoseconds == 0)) {
+    return 2;
+  }
+  FILE *file = _wfopen(resultFile, L"w");
+  if (file == nullptr) {
+    return 3;
+  }
+  fprintf(file, "%llu %llu %llu\n",
+          static_cast<unsigned long long>(timings.initHooksNanoseconds),
+          static_cast<unsigned long long>(timings.attachNanoseconds),
+          static_cast<unsigned long long>(timings.hookNanoseconds));
+  fclose(file);
+  return 0;
+}
+
+int wmain(int argc, wchar_t **argv)
+{
+  if ((argc == 3) && (wcscmp(argv[1], L"--child") == 0)) {
+    return runChild(argv[2]);
+  }
+
+  Options options;
+  for (int i = 1; i < argc; ++i) {
+    if ((wcscmp(argv[i], L"--launches") == 0) && (i + 1 < argc)) {
+      options.launches = static_cast<size_t>(wcstoull(argv[++i], nullptr, 10));
+    } else if ((wcscmp(argv[i], L"--files") == 0) && (i + 1 < argc)) {
+      options.files = static_cast<size_t>(wcstoull(argv[++i], nullptr, 10));
+    } else if ((wcscmp(argv[i], L"--mods") == 0) && (i + 1 < argc)) {
+      options.mods = argv[++i];
+    } else if (wcscmp(argv[i], L"--other-bitness") == 0) {
+      options.otherBitness = true;
+    } else {
+      fprintf(stderr,
+              "usage: %ls [--launches <count>] [--files <count> | --mods <dir>] "
+              "[--other-bitness]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  if (options.launches == 0) {
+    return 1;
+  }
+
+  bfs::path root = bfs::temp_directory_path()
+                   / (L"usvfs_inject_benchmark_" + std::to_wstring(GetCurrentProcessId()));
+  bfs::create_directories(root);
+
+  USVFSParameters params;
+  USVFSInitParameters(&params, "inject_benchmark", false, LogLevel::Warning,
+                      CrashDumpsType::None, "");
+  InitLogging(false);
+  if (!CreateVFS(&params)) {
+    fprintf(stderr, "failed to create the vfs\n");
+    return 1;
+  }
+
+  int result = 0;
+  if (!options.mods.empty() && !linkMods(root, options.mods)) {
+    fprintf(stderr, "failed to link the mods in %ls (%lu)\n", options.mods.c_str(),
+            GetLastError());
+    result = 1;
+  } else if (options.mods.empty() && !buildTree(root, options.files)) {
+    fprintf(stderr, "failed to link %zu files (%lu)\n", options.files, GetLastError());
+    result = 1;
+  } else {
+    std::wstring exe = executable(options.otherBitness);
+    bfs::path resultFile = root / L"timings.txt";
+    std::vector<Sample> samples;
+    samples.reserve(options.launches);
+    for (size_t i = 0; i < options.launches; ++i) {
+      Sample sample;
+      if (!launch(exe, resultFile, sample)) {
+        result = 1;
+        break;
+      }
+      samples.push_back(sample);
+    }
+
+    if (!samples.empty()) {
+      VFSTreeStatistics tree = { 0 };
+      GetVFSTreeStatistics(FALSE, &tree);
+      printf("%zu launches, %s bitness, %llu files in the tree, times in us\n",
+             samples.size(), options.otherBitness ? "other" : "same",
+             static_cast<unsigned long long>(tree.files));
+      printf("%-16s %10s %10s %10s %10s %10s\n", "phase", "min", "p50", "p90", "p99",
+             "max");
+      report("launch", samples, [](const Sample &s) { return s.launch; });
+      report("createProcess", samples,
+             [](const Sample &s) { return s.timings.createProcessNanoseconds; });
+      report("injectProcess", samples,
+             [](const Sample &s) { return s.timings.injectNanoseconds; });
+      if (!options.otherBitness) {
+        // the proxy or broker injects processes of the other bitness
+        report("InjectDLL", samples,
+               [](const Sample &s) { return s.timings.injectDLLNanoseconds; });
+      }
+      report("InitHooks", samples,
+             [](const Sample &s) { return s.timings.initHooksNanoseconds; });
+      report("tree attach", samples,
+             [](const Sample &s) { return s.timings.attachNanoseconds; });
+      report("hook install", samples,
+             [](const Sample &s) { return s.timings.hookNanoseconds; });
+    }
+  }
+
+  DisconnectVFS();
+  boost::system::error_code ec;
+  bfs::remove_all(root, ec);
+  return result;
+}
@@ -9,6 +9,16 @@
 #define PRIVATE public
 #include <directory_tree.h>
 #undef PRIVATE
+#include <flattree.h>
+#include <inifile.h>
+#include <interprocess_lock.h>
+#include <layerindex.h>
+#include <logrecord.h>
+#include <logring.h>
+#include <winapi.h>
+#include <atomic>
+#include <fstream>
+#include <thread>
 
 using namespace usvfs::shared;
 
@@ -86,6 +96,217 @@ TEST(WildcardTest, MatchWildcard)
   EXPECT_FALSE(wildcard::Match(TEXT("abc"), TEXT("b*")));
 }
 
+TEST(WildcardTest, CompiledMatcher)
+{
+  wildcard::Matcher extension("*.ESP");
+  EXPECT_TRUE(extension.match(std::string("plugin.esp")));
+  EXPECT_FALSE(extension.match(std::string("plugin.esm")));
+  EXPECT_FALSE(extension.match(std::string("esp")));
+
+  wildcard::Matcher prefix("tex*");
+  EXPECT_TRUE(prefix.match(std::string("Textures")));
+  EXPECT_FALSE(prefix.match(std::string("te")));
+
+  wildcard::Matcher literal("meshes");
+  EXPECT_TRUE(literal.match(std::string("MESHES")));
+  EXPECT_FALSE(literal.match(std::string("meshes2")));
+
+  // a trailing .* may match nothing
+  wildcard::Matcher dotStar("abc.*");
+  EXPECT_TRUE(dotStar.match(std::string("abc")));
+  EXPECT_TRUE(dotStar.match(std::string("abc.def")));
+  EXPECT_FALSE(dotStar.match(std::string("abcd")));
+
+  // dos wildcards as produced by FindFirstFile for "*." and "a?.txt"
+  wildcard::WMatcher noExtension(L"<");
+  EXPECT_TRUE(noExtension.match(std::wstring(L"readme")));
+  EXPECT_FALSE(noExtension.match(std::wstring(L"readme.txt")));
+  wildcard::WMatcher dosQm(L"a>.txt");
+  EXPECT_TRUE(dosQm.match(std::wstring(L"ab.txt")));
+  EXPECT_TRUE(dosQm.match(std::wstring(L"a.txt")));
+  EXPECT_FALSE(dosQm.match(std::wstring(L"abc.txt")));
+
+  // this used to take exponential time
+  std::string name(200, 'a');
+  wildcard::Matcher pathological("*a*a*a*a*a*a*a*a*a*a*a*a*b");
+  EXPECT_FALSE(pathological.match(name));
+  EXPECT_TRUE(pathological.match(name + "b"));
+}
+
+TEST(StringUtilsTest, FoldedCompareAcrossBlocks)
+{
+  // long enough to go through the vectorized and the scalar part
+  std::string lower = "some\\rather\\long\\path\\to\\a_file.txt";
+  std::string upper = "SOME\\RATHER\\LONG\\PATH\\TO\\A_FILE.TXT";
+  EXPECT_TRUE(foldedEquals(lower.c_str(), upper.c_str(), lower.size()));
+  EXPECT_EQ(foldedHash(lower.c_str(), lower.size()), foldedHash(upper.c_str(), upper.size()));
+  EXPECT_EQ(0, foldedCompare(lower.c_str(), lower.size(), upper.c_str(), upper.size()));
+
+  std::string folded(lower.size(), '\0');
+  foldCase(lower.c_str(), lower.size(), &folded[0]);
+  EXPECT_EQ(upper, folded);
+
+  // ordering matches _stricmp, including characters between the cases
+  std::string other = upper;
+  for (size_t i = 0; i < other.size(); ++i) {
+    other[i] = '_';
+    EXPECT_EQ(_stricmp(lower.c_str(), other.c_str()) < 0,
+              foldedCompare(lower.c_str(), lower.size(), other.c_str(), other.size()) < 0);
+    EXPECT_FALSE(foldedEquals(lower.c_str(), other.c_str(), lower.size()));
+    other[i] = upper[i];
+  }
+  EXPECT_LT(foldedCompare("abc", 3, "ABCD", 4), 0);
+}
+
+TEST(StringUtilsTest, FoldedWideNonAscii)
+{
+  std::wstring lower = L"c:\\spiele\\\u00e4\u00f6\u00fc\\datei.esp";
+  std::wstring upper = L"C:\\SPIELE\\\u00c4\u00d6\u00dc\\DATEI.ESP";
+  EXPECT_TRUE(foldedEquals(lower.c_str(), upper.c_str(), lower.size()));
+  EXPECT_EQ(foldedHash(lower.c_str(), lower.size()), foldedHash(upper.c_str(), upper.size()));
+  EXPECT_EQ(upper, to_upper(lower));
+  EXPECT_EQ(L'\u00c4', foldChar(L'\u00e4'));
+}
+
+TEST(LogRecordTest, FormatRecord)
+{
+  char record[512];
+  usvfs::log::RecordWriter writer(record, sizeof(record), LogLevel::Debug, "CreateFileW");
+  writer.addWide("lpFileName", L"C:\\Spiele\\\u00e4.esp", 15);
+  writer.addUnsigned("dwFlags", 0x80, true);
+  writer.addStatus("res", 0xC0000034);
+  writer.addNull("lpSecurity");
+  ASSERT_TRUE(usvfs::log::isRecord(writer.data(), writer.size()));
+
+  char text[1024];
+  usvfs::log::formatRecord(writer.data(), writer.size(), text, sizeof(text), false);
+  EXPECT_STREQ("CreateFileW [lpFileName=C:\\Spiele\\\xc3\xa4.esp] [dwFlags=80] "
+               "[res=err c0000034] [lpSecurity=<null>]", text);
+
+  // strings that don't fit are cut off, the record never exceeds its buffer
+  std::wstring longPath(1000, L'x');
+  usvfs::log::RecordWriter truncated(record, sizeof(record), LogLevel::Debug, "CreateFileW");
+  truncated.addWide("lpFileName", longPath.c_str(), longPath.size());
+  truncated.addSigned("res", 1);
+  EXPECT_EQ(sizeof(record), truncated.size());
+  usvfs::log::formatRecord(truncated.data(), truncated.size(), text, sizeof(text), false);
+  EXPECT_EQ(std::string("...]"), std::string(text + strlen(text) - 4));
+}
+
+TEST(LogRingTest, PushPop)
+{
+  LogRing ring("usvfs_test_logring", true);
+  LogRing producer("usvfs_test_logring", false);
+
+  char buffer[LogRing::SLOT_SIZE];
+  size_t size;
+  EXPECT_FALSE(ring.pop(buffer, size));
+
+  for (uint32_t i = 0; i < LogRing::SLOT_COUNT; ++i) {
+    std::string message = std::to_string(i);
+    EXPECT_TRUE(producer.push(message.c_str(), message.size()));
+  }
+  // full, these are counted instead
+  EXPECT_FALSE(producer.push("a", 1));
+  EXPECT_FALSE(producer.push("b", 1));
+
+  uint32_t processId, count;
+  ASSERT_TRUE(ring.takeDropped(processId, count));
+  EXPECT_EQ(GetCurrentProcessId(), processId);
+  EXPECT_EQ(2U, count);
+  EXPECT_FALSE(ring.takeDropped(processId, count));
+
+  for (uint32_t i = 0; i < LogRing::SLOT_COUNT; ++i) {
+    ASSERT_TRUE(ring.pop(buffer, size));
+    EXPECT_EQ(std::to_string(i), std::string(buffer, size));
+  }
+  EXPECT_FALSE(ring.pop(buffer, size));
+
+  // the positions wrap around
+  EXPECT_TRUE(producer.push("again", 5));
+  ASSERT_TRUE(ring.pop(buffer, size));
+  EXPECT_EQ("again", std::string(buffer, size));
+}
+
+TEST(IniFileTest, ParseValues)
+{
+  const char content[] =
+      "; comment\r\n"
+      "[General]\r\n"
+      "  Name = value with spaces  \r\n"
+      "quoted=\"  padded  \"\r\n"
+      "flag\r\n"
+      "name=duplicate\r\n"
+      "[ other ]\n"
+      "key=1\n"
+      "[general]\n"
+      "late=ignored\n";
+
+  usvfs::shared::IniFile ini;
+  ASSERT_TRUE(ini.parse(content, sizeof(content) - 1));
+
+  ASSERT_NE(nullptr, ini.value(L"GENERAL", L"name"));
+  EXPECT_EQ(L"value with spaces", *ini.value(L"GENERAL", L"name"));
+  EXPECT_EQ(L"  padded  ", *ini.value(L"general", L"quoted"));
+  EXPECT_EQ(nullptr, ini.value(L"general", L"flag"));
+  EXPECT_EQ(nullptr, ini.value(L"general", L"late"));
+  EXPECT_EQ(L"1", *ini.value(L"Other", L"key"));
+  EXPECT_EQ(nullptr, ini.value(L"missing", L"key"));
+
+  ASSERT_NE(nullptr, ini.entries(L"general"));
+  EXPECT_EQ(std::wstring(L"Name=value with spaces\0quoted=\"  padded  \"\0flag\0name=duplicate\0", 63),
+            *ini.entries(L"general"));
+  EXPECT_EQ(nullptr, ini.entries(L"missing"));
+}
+
+TEST(IniFileTest, ParseUtf16)
+{
+  const wchar_t content[] = L"\xfeff[Section]\r\nkey=\x00e4\r\n";
+
+  usvfs::shared::IniFile ini;
+  ASSERT_TRUE(ini.parse(reinterpret_cast<const char*>(content), sizeof(content) - sizeof(wchar_t)));
+  ASSERT_NE(nullptr, ini.value(L"section", L"KEY"));
+  EXPECT_EQ(L"\x00e4", *ini.value(L"section", L"KEY"));
+}
+
+TEST(LayerIndexTest, Reorder)
+{
+  LayerIndex index;
+  std::vector<LayerIndex::Change> changes;
+  ASSERT_TRUE(index.addLayer(1, LR"(M:\a)", LR"(C:\data)",
+                             { { L"", true }, { L"x.esp", false }, { L"tex", true },
+                               { LR"(tex\t.dds)", false } }, changes));
+  ASSERT_EQ(4U, changes.size());
+  EXPECT_EQ(LR"(C:\data)", changes[0].virtualPath);
+  EXPECT_EQ(LR"(M:\a\tex\t.dds)", changes[3].target);
+
+  changes.clear();
+  ASSERT_TRUE(index.addLayer(2, LR"(M:\b)", LR"(C:\data)",
+                             { { L"", true }, { L"X.esp", false }, { L"y.esp", false } },
+                             changes));
+  EXPECT_EQ(3U, changes.size());
+  EXPECT_FALSE(index.addLayer(2, LR"(M:\b)", LR"(C:\data)", {}, changes));
+
+  // only the paths both layers provide change hands
+  changes.clear();
+  ASSERT_TRUE(index.setOrder({ 2, 1 }, changes));
+  ASSERT_EQ(2U, changes.size());
+  EXPECT_EQ(LR"(M:\a)", changes[0].target);
+  EXPECT_EQ(LR"(M:\a\x.esp)", changes[1].target);
+  EXPECT_EQ(1U, changes[1].layer);
+  EXPECT_FALSE(index.setOrder({ 1 }, changes));
+
+  changes.clear();
+  ASSERT_TRUE(index.removeLayer(1, changes));
+  ASSERT_EQ(4U, changes.size());
+  EXPECT_EQ(LR"(M:\b)", changes[0].target);
+  EXPECT_EQ(LR"(C:\data\tex)", changes[1].virtualPath);
+  EXPECT_TRUE(changes[1].target.empty());
+  EXPECT_EQ(LR"(M:\b\x.esp)", changes[2].target);
+  EXPECT_TRUE(changes[3].target.empty());
+  EXPECT_EQ(3U, index.numPaths());
+}
+
 TEST(DirectoryTreeTest, SimpleTreeInit)
 {
   EXPECT_NO_THROW({
@@ -105,6 +326,167 @@ TEST(DirectoryTreeTest, FindNode)
   EXPECT_EQ(nullptr, tree->findNode(R"(C:\temp\bla\blubb)").get());
 }
 
+TEST(DirectoryTreeTest, FindNodeWide)
+{
+  shared_memory_object::remove(g_SHMName);
+  ContainerType tree(g_SHMName, 64 * 1024);
+  EXPECT_NE(nullptr, tree.addFile(R"(C:\temp\bla)", 0x42, 0, false));
+
+  std::wstring path(LR"(c:/TEMP\.\Bla\)");
+  TreeType::NodePtrT node = tree->findNode(path.c_str(), path.size());
+  ASSERT_NE(nullptr, node.get());
+  EXPECT_EQ(0x42, node->data());
+  // length limits the lookup, the remainder of the buffer is ignored
+  EXPECT_EQ("temp", tree->findNode(path.c_str(), 7)->name());
+  EXPECT_EQ(nullptr, tree->findNode(LR"(C:\temp\bla\blubb)", 17).get());
+  EXPECT_EQ(nullptr, tree->findNode(L"", 0).get());
+}
+
+TEST(DirectoryTreeTest, Generation)
+{
+  shared_memory_object::remove(g_SHMName);
+  ContainerType tree(g_SHMName, 64 * 1024);
+  long generation = tree.generation();
+  EXPECT_NE(nullptr, tree.addFile(R"(C:\temp\bla)", 0x42, 0, false));
+  EXPECT_NE(generation, tree.generation());
+
+  generation = tree.generation();
+  tree.clear();
+  EXPECT_NE(generation, tree.generation());
+}
+
+TEST(DirectoryTreeTest, ClearSwitchesSegment)
+{
+  shared_memory_object::remove(g_SHMName);
+  ContainerType tree(g_SHMName, 64 * 1024);
+  ContainerType other(g_SHMName, 64 * 1024);
+  EXPECT_NE(nullptr, tree.addFile(R"(C:\temp\bla)", 0x42, 0, false));
+  std::string previous = tree.shmName();
+
+  tree.clear();
+  EXPECT_NE(previous, tree.shmName());
+  EXPECT_EQ(nullptr, tree->findNode(R"(C:\temp\bla)").get());
+  // the other user moves on to the empty tree on its next access
+  EXPECT_EQ(nullptr, other->findNode(R"(C:\temp\bla)").get());
+  EXPECT_EQ(tree.shmName(), other.shmName());
+}
+
+TEST(DirectoryTreeTest, PrefixFilter)
+{
+  shared_memory_object::remove(g_SHMName);
+  ContainerType tree(g_SHMName, 64 * 1024);
+  EXPECT_NE(nullptr, tree.addFile(R"(C:\temp\sub\bla)", 0x42, 0, false));
+
+  std::wstring mapped(LR"(c:\TEMP\sub\other\file)");
+  EXPECT_TRUE(tree.mayContain(mapped.c_str(), mapped.size()));
+  EXPECT_TRUE(tree.mayContain(L"C:", 2));
+  std::wstring unmapped(LR"(C:\Windows\System32\kernel32.dll)");
+  EXPECT_FALSE(tree.mayContain(unmapped.c_str(), unmapped.size()));
+
+  EXPECT_TRUE(tree.mayContainRoot(PrefixFilter::rootBit("c:", 2)));
+  EXPECT_FALSE(tree.mayContainRoot(PrefixFilter::rootBit("D:", 2)));
+  EXPECT_FALSE(tree.mayContainRoot(PrefixFilter::OTHER_ROOT));
+
+  tree.clear();
+  EXPECT_FALSE(tree.mayContain(mapped.c_str(), mapped.size()));
+  EXPECT_FALSE(tree.mayContainRoot(PrefixFilter::rootBit("C:", 2)));
+}
+
+TEST(DirectoryTreeTest, ReplaceWith)
+{
+  shared_memory_object::remove(g_SHMName);
+  shared_memory_object::remove("treetest_staging_1");
+  ContainerType tree(g_SHMName, 4096);
+  EXPECT_NE(nullptr, tree.addFile(R"(C:\temp\old)", 1, 0, false));
+
+  ContainerType staging("treetest_staging", 64 * 1024);
+  for (char ch = 'a'; ch <= 'z'; ++ch) {
+    staging.addFile(std::string(R"(C:\temp\a)") + ch, ch - 'a' + 1);
+  }
+  auto generation = tree.generation();
+  tree.replaceWith(staging);
+
+  EXPECT_NE(generation, tree.generation());
+  EXPECT_EQ(nullptr, tree->findNode(R"(C:\temp\old)").get());
+  EXPECT_EQ(26, tree->findNode(R"(C:\temp\az)")->data());
+  EXPECT_NE(std::string(g_SHMName) + "_1", tree.shmName());
+}
+
+TEST(DirectoryTreeTest, FlatTree)
+{
+  shared_memory_object::remove(g_SHMName);
+  ContainerType tree(g_SHMName, 64 * 1024);
+  EXPECT_NE(nullptr, tree.addFile(R"(C:\temp\bla)", 0x42, 0, false));
+  EXPECT_NE(nullptr, tree.addFile(R"(C:\temp\sub\blubb)", 0x43, 0, false));
+
+  std::vector<char> image = buildFlatTree(*tree.get(), tree.generation(),
+      [](const TreeType &node) {
+        return node.isDirectory() ? std::string() : "D:\\target" + std::to_string(node.data());
+      });
+  FlatTree flat(image.data(), image.size());
+  ASSERT_TRUE(flat.valid());
+  EXPECT_EQ(tree.generation(), flat.generation());
+  EXPECT_EQ(6, flat.numNodes());
+
+  std::wstring path(LR"(c:/TEMP\.\Bla)");
+  uint32_t node = flat.find(path.c_str(), path.size());
+  ASSERT_NE(FlatTree::NOT_FOUND, node);
+  EXPECT_STREQ("bla", flat.name(node));
+  EXPECT_STREQ("D:\\target66", flat.target(node));
+
+  path = LR"(C:\temp\sub)";
+  node = flat.find(path.c_str(), path.size());
+  ASSERT_NE(FlatTree::NOT_FOUND, node);
+  EXPECT_TRUE(flat.isDirectory(node));
+  EXPECT_STREQ("", flat.target(node));
+  EXPECT_EQ(tree->findNode(R"(C:\temp\sub)")->path().string(), flat.path(node));
+
+  path = LR"(C:\temp\bla\blubb)";
+  EXPECT_EQ(FlatTree::NOT_FOUND, flat.find(path.c_str(), path.size()));
+  EXPECT_FALSE(FlatTree(image.data(), sizeof(FlatTreeHeader)).valid());
+}
+
+TEST(DirectoryTreeTest, FlatTreeChains)
+{
+  shared_memory_object::remove(g_SHMName);
+  ContainerType tree(g_SHMName, 64 * 1024);
+  EXPECT_NE(nullptr, tree.addFile(R"(C:\temp\bla)", 0x42, 0, false));
+  EXPECT_NE(nullptr, tree.addFile(R"(C:\temp\sub\deeper\blubb)", 0x43, 0, false));
+
+  std::vector<char> image = buildFlatTree(*tree.get(), tree.generation(),
+      [](const TreeType &node) {
+        return node.isDirectory() ? std::string() : "D:\\target" + std::to_string(node.data());
+      }, true);
+  FlatTree flat(image.data(), image.size());
+  ASSERT_TRUE(flat.valid());
+  // the root, C:\temp, bla and sub\deeper\blubb
+  EXPECT_EQ(4, flat.numNodes());
+
+  std::wstring path(LR"(c:/TEMP\.\sub\Deeper\blubb)");
+  uint32_t node = flat.find(path.c_str(), path.size());
+  ASSERT_NE(FlatTree::NOT_FOUND, node);
+  EXPECT_STREQ("D:\\target67", flat.target(node));
+  EXPECT_EQ(R"(C:\temp\sub\deeper\blubb)", flat.path(node));
+
+  path = LR"(C:\temp)";
+  node = flat.find(path.c_str(), path.size());
+  ASSERT_NE(FlatTree::NOT_FOUND, node);
+  EXPECT_EQ(tree->findNode(R"(C:\temp)")->path().string(), flat.path(node));
+
+  // directories inside a chain are only found by lookup
+  path = LR"(c:\temp\SUB)";
+  EXPECT_EQ(FlatTree::NOT_FOUND, flat.find(path.c_str(), path.size()));
+  FlatTree::Match match = flat.lookup(path.c_str(), path.size());
+  ASSERT_NE(FlatTree::NOT_FOUND, match.node);
+  EXPECT_EQ(tree->findNode(R"(C:\temp\sub)")->path().string(), flat.path(match));
+  path = L"C:";
+  match = flat.lookup(path.c_str(), path.size());
+  EXPECT_EQ(tree->findNode("C:")->path().string(), flat.path(match));
+
+  path = LR"(C:\temp\sub\other)";
+  EXPECT_EQ(FlatTree::NOT_FOUND, flat.lookup(path.c_str(), path.size()).node);
+}
+
 struct TestVisitor {
   TreeType::NodePtrT lastNode;
   bool flag40 { false };
@@ -131,6 +513,56 @@ TEST(DirectoryTreeTest, VisitPath)
   EXPECT_EQ("bla", visitor.lastNode->name());
 }
 
+TEST(DirectoryTreeTest, BorrowedTraversal)
+{
+  shared_memory_object::remove(g_SHMName);
+  ContainerType tree(g_SHMName, 64 * 1024);
+  EXPECT_NE(nullptr, tree.addFile(R"(C:\temp\bla)", 1, 0x40, false));
+
+  std::wstring path(LR"(C:\temp\bla\blubb)");
+  EXPECT_EQ(nullptr, tree->findNodeRaw(path.c_str(), path.size()));
+  const TreeType *node = tree->findNodeRaw(path.c_str(), 12);
+  ASSERT_NE(nullptr, node);
+  EXPECT_EQ(1, node->data());
+  EXPECT_EQ(tree->findNode(path.c_str(), 12).get().get(), node);
+
+  std::vector<std::string> visited;
+  bool flag40 = false;
+  tree->visitPath(path.c_str(), path.size(), [&](const TreeType &visitedNode) {
+    visited.push_back(visitedNode.name());
+    flag40 |= visitedNode.hasFlag(0x40);
+  });
+  EXPECT_EQ((std::vector<std::string>{ "C:", "temp", "bla" }), visited);
+  EXPECT_TRUE(flag40);
+}
+
+TEST(DirectoryTreeTest, ResolvePath)
+{
+  shared_memory_object::remove(g_SHMName);
+  ContainerType tree(g_SHMName, 64 * 1024);
+  EXPECT_NE(nullptr, tree.addFile(R"(C:\temp\bla)", 1, 0x40, false));
+  tree->findNode(R"(C:\temp)")->setFlag(0x40);
+
+  std::wstring path(LR"(C:\temp\bla\sub/file.txt)");
+  TreeType::PathResolution resolution = tree->resolvePath(path.c_str(), path.size(), 0x40);
+  EXPECT_EQ(nullptr, resolution.node);
+  ASSERT_NE(nullptr, resolution.flagged);
+  EXPECT_EQ("bla", resolution.flagged->name());
+  EXPECT_EQ(resolution.flagged, resolution.deepest);
+  EXPECT_EQ(std::wstring(L"sub/file.txt"),
+            std::wstring(resolution.remainder, resolution.remainderLength));
+
+  resolution = tree->resolvePath(path.c_str(), 12, 0x40);
+  ASSERT_NE(nullptr, resolution.node);
+  EXPECT_EQ(1, (*resolution.node)->data());
+  EXPECT_EQ(0U, resolution.remainderLength);
+
+  path = LR"(D:\temp)";
+  resolution = tree->resolvePath(path.c_str(), path.size(), 0x40);
+  EXPECT_EQ(nullptr, resolution.deepest);
+  EXPECT_EQ(nullptr, resolution.flagged);
+}
+
 TEST(DirectoryTreeTest, WildCardFind)
 {
   shared_memory_object::remove(g_SHMName);
@@ -158,6 +590,293 @@ TEST(DirectoryTreeTest, WildCardFind)
   });
 }
 
+TEST(DirectoryTreeTest, IndexedMatcherFind)
+{
+  shared_memory_object::remove(g_SHMName);
+  EXPECT_NO_THROW({
+    ContainerType tree(g_SHMName, 64 * 1024);
+
+    EXPECT_NE(nullptr, tree.addFile(R"(C:\data)", 1, FLAG_DIRECTORY, false));
+    EXPECT_NE(nullptr, tree.addFile(R"(C:\data\armor.DDS)", 1, 0, false));
+    EXPECT_NE(nullptr, tree.addFile(R"(C:\data\weapon.dds)", 2, 0, false));
+    EXPECT_NE(nullptr, tree.addFile(R"(C:\data\plugin.esp)", 3, 0, false));
+    EXPECT_NE(nullptr, tree.addFile(R"(C:\data\textures)", 4, FLAG_DIRECTORY, false));
+    EXPECT_NE(nullptr, tree.addFile(R"(C:\data\.textures.dds)", 5, 0, false));
+
+    auto data = tree->node("C:")->node("data");
+    ASSERT_NE(nullptr, data);
+    // extension index, the leading dot doesn't keep a name from matching
+    EXPECT_EQ(3, data->find(wildcard::Matcher("*.dds")).size());
+    EXPECT_EQ(1, data->find(wildcard::Matcher("*.ESP")).size());
+    // ordered prefix range
+    EXPECT_EQ(2, data->find(wildcard::Matcher("tex*")).size());
+    EXPECT_EQ(1, data->find(wildcard::Matcher(".tex*")).size());
+    // hashed lookup
+    EXPECT_EQ(1, data->find(wildcard::Matcher("PLUGIN.ESP")).size());
+    EXPECT_EQ(0, data->find(wildcard::Matcher("plugin")).size());
+    EXPECT_EQ(5, data->find(wildcard::Matcher("*.*")).size());
+    EXPECT_EQ(1, data->find(wildcard::Matcher("?????.dds")).size());
+  });
+}
+
+TEST(InterprocessLockTest, ExcludesWriters)
+{
+  InterprocessLock lock;
+  int counter = 0;
+  auto work = [&]() {
+    for (int i = 0; i < 10000; ++i) {
+      lock.lock("treetest_lock_event");
+      ++counter;
+      lock.unlock("treetest_lock_event");
+    }
+  };
+  std::thread first(work);
+  std::thread second(work);
+  first.join();
+  second.join();
+  EXPECT_EQ(20000, counter);
+}
+
+TEST(WinApiTest, CloneFileRace)
+{
+  wchar_t tempPath[MAX_PATH];
+  ASSERT_NE(0UL, ::GetTempPathW(MAX_PATH, tempPath));
+  std::wstring source = std::wstring(tempPath) + L"usvfs_clone_source.txt";
+  std::wstring destination = std::wstring(tempPath) + L"usvfs_clone_destination.txt";
+  ::DeleteFileW(destination.c_str());
+  { std::ofstream(source) << "usvfs"; }
+
+  // one clone wins, the other finds the finished copy
+  std::atomic<int> cloned{ 0 };
+  std::atomic<int> existed{ 0 };
+  auto work = [&]() {
+    if (winapi::ex::wide::cloneFile(source.c_str(), destination.c_str())) {
+      ++cloned;
+    } else if (::GetLastError() == ERROR_FILE_EXISTS) {
+      ++existed;
+    }
+  };
+  std::thread first(work);
+  std::thread second(work);
+  first.join();
+  second.join();
+  EXPECT_EQ(1, cloned.load());
+  EXPECT_EQ(1, existed.load());
+
+  std::string content;
+  std::getline(std::ifstream(destination), content);
+  EXPECT_EQ("usvfs", content);
+
+  ::DeleteFileW(source.c_str());
+  ::DeleteFileW(destination.c_str());
+}
+
+TEST(DirectoryTreeTest, RemoveNode)
+{
+  shared_memory_object::remove(g_SHMName);
+  ContainerType tree(g_SHMName, 4096);
+  tree.addFile(R"(C:\temp\bla)", 1, 0, false);
+
+  // grow the tree so removal has to find the node in the new segment
+  for (char ch = 'a'; ch <= 'z'; ++ch) {
+    tree.addFile(std::string(R"(C:\temp\a)") + ch, ch - 'a' + 1);
+  }
+  long generation = tree.generation();
+  EXPECT_TRUE(tree.removeNode(R"(C:\temp\bla)"));
+  EXPECT_NE(generation, tree.generation());
+  EXPECT_FALSE(tree.removeNode(R"(C:\temp\bla)"));
+  EXPECT_EQ(nullptr, tree->findNode(R"(C:\temp\bla)").get());
+  EXPECT_NE(nullptr, tree->findNode(R"(C:\temp\az)").get());
+}
+
+TEST(DirectoryTreeTest, MoveNode)
+{
+  shared_memory_object::remove(g_SHMName);
+  ContainerType tree(g_SHMName, 4096);
+  tree.addFile(R"(C:\temp\dir\a)", 1);
+  tree.addFile(R"(C:\temp\dir\sub\b)", 2);
+  tree.addFile(R"(C:\other\existing)", 3);
+
+  long generation = tree.generation();
+  auto moved = tree.moveNode(R"(C:\temp\dir)", R"(C:\other\new\Renamed)",
+                             [](int &data) { data += 10; });
+  ASSERT_NE(nullptr, moved.get());
+  EXPECT_NE(generation, tree.generation());
+  EXPECT_EQ("Renamed", moved->name());
+  EXPECT_EQ(nullptr, tree->findNode(R"(C:\temp\dir)").get());
+  EXPECT_EQ(11, tree->findNode(R"(C:\other\new\renamed\a)")->data());
+  EXPECT_EQ(12, tree->findNode(R"(C:\other\new\renamed\sub\b)")->data());
+  EXPECT_TRUE(tree->findNode(R"(C:\other\new)")->hasFlag(FLAG_DUMMY));
+  EXPECT_EQ(3, tree->findNode(R"(C:\other\existing)")->data());
+
+  // can't be moved below itself, missing sources are reported
+  EXPECT_EQ(nullptr, tree.moveNode(R"(C:\other\new)", R"(C:\other\new\renamed\x)",
+                                   [](int&) {}).get());
+  EXPECT_EQ(nullptr, tree.moveNode(R"(C:\temp\dir)", R"(C:\temp\x)", [](int&) {}).get());
+
+  // replaces the destination
+  ASSERT_NE(nullptr, tree.moveNode(R"(C:\other\new\renamed\a)", R"(C:\other\existing)",
+                                   [](int&) {}).get());
+  EXPECT_EQ(11, tree->findNode(R"(C:\other\existing)")->data());
+  EXPECT_EQ(nullptr, tree->findNode(R"(C:\other\new\renamed\a)").get());
+}
+
+TEST(DirectoryTreeTest, ApplyDiff)
+{
+  shared_memory_object::remove(g_SHMName);
+  ContainerType tree(g_SHMName, 4096);
+  tree.addFile(R"(C:\temp\kept)", 1);
+  tree.addFile(R"(C:\temp\changed)", 2);
+  tree.addFile(R"(C:\temp\dir\removed)", 3);
+
+  std::vector<TreeInsertion<int>> content;
+  content.emplace_back(R"(C:\temp\KEPT)", 1);
+  content.emplace_back(R"(C:\temp\changed)", 4);
+  for (char ch = 'a'; ch <= 'z'; ++ch) {
+    // enough to grow the tree in between
+    content.emplace_back(std::string(R"(C:\temp\new\a)") + ch, ch - 'a' + 1);
+  }
+  long generation = tree.generation();
+  TreeDiffResult result = tree.applyDiff(content, [](int lhs, int rhs) { return lhs == rhs; });
+
+  EXPECT_NE(generation, tree.generation());
+  EXPECT_EQ(27U, result.added);
+  EXPECT_EQ(1U, result.removed);
+  EXPECT_EQ(1U, result.changed);
+  EXPECT_EQ(nullptr, tree->findNode(R"(C:\temp\dir)").get());
+  EXPECT_EQ(4, tree->findNode(R"(C:\temp\changed)")->data());
+  EXPECT_EQ(26, tree->findNode(R"(C:\temp\new\az)")->data());
+  EXPECT_TRUE(tree->findNode(R"(C:\temp\new)")->hasFlag(FLAG_DUMMY));
+  EXPECT_EQ("kept", tree->findNode(R"(C:\temp\kept)")->name());
+
+  // applying the same content again changes nothing
+  result = tree.applyDiff(content, [](int lhs, int rhs) { return lhs == rhs; });
+  EXPECT_EQ(0U, result.added + result.removed + result.changed);
+}
+
+TEST(DirectoryTreeTest, CompactNodes)
+{
+  shared_memory_object::remove(g_SHMName);
+  ContainerType tree(g_SHMName, 64 * 1024);
+  tree.addFile(R"(C:\temp\dir\a)", 1);
+  tree.addFile(R"(C:\temp\dir\b)", 2);
+
+  // files don't get a child map of their own
+  auto a = tree->findNode(R"(C:\temp\dir\a)");
+  auto b = tree->findNode(R"(C:\temp\dir\b)");
+  EXPECT_EQ(a->m_Nodes, b->m_Nodes);
+  EXPECT_NE(a->m_Nodes, tree->findNode(R"(C:\temp\dir)")->m_Nodes);
+  EXPECT_EQ(tree->findNode(R"(C:\temp\dir)").get(), a->parent().get());
+
+  // nodes still referenced don't point to a removed parent
+  EXPECT_TRUE(tree.removeNode(R"(C:\temp\dir)"));
+  EXPECT_EQ(nullptr, a->parent().get());
+  EXPECT_EQ(R"(C:\temp)", tree->findNode(R"(C:\temp)")->path().string());
+}
+
+TEST(DirectoryTreeTest, PathBuffer)
+{
+  shared_memory_object::remove(g_SHMName);
+  ContainerType tree(g_SHMName, 64 * 1024);
+  tree.addFile(R"(C:\temp\sub\file)", 1);
+
+  auto node = tree->findNode(R"(C:\temp\sub\file)");
+  char buffer[MAX_PATH];
+  EXPECT_EQ(16, node->path(buffer, MAX_PATH));
+  EXPECT_STREQ(R"(C:\temp\sub\file)", buffer);
+  EXPECT_EQ(R"(C:\temp\sub\file)", node->pathString());
+  EXPECT_EQ(R"(C:\temp\sub\file)", node->path().string());
+  EXPECT_EQ(R"(C:\)", tree->findNode("C:")->pathString());
+  EXPECT_EQ("", tree->pathString());
+
+  // a buffer that's too small is left alone
+  buffer[0] = 'x';
+  EXPECT_EQ(16, node->path(buffer, 16));
+  EXPECT_EQ('x', buffer[0]);
+}
+
+TEST(DirectoryTreeTest, GrowthStep)
+{
+  // small segments double, large ones grow by a fixed step
+  EXPECT_EQ(128 * 1024, ContainerType::grownSize(64 * 1024));
+  EXPECT_EQ(32 * 1024 * 1024, ContainerType::grownSize(16 * 1024 * 1024));
+  EXPECT_EQ(96 * 1024 * 1024, ContainerType::grownSize(64 * 1024 * 1024));
+}
+
+TEST(DirectoryTreeTest, GrowIfLow)
+{
+  shared_memory_object::remove(g_SHMName);
+  ContainerType tree(g_SHMName, 64 * 1024);
+  EXPECT_FALSE(tree.growIfLow());
+
+  // writers only grow the tree once it's almost full, long after the watermark
+  for (int i = 0; tree.usage().freeBytes >= tree.usage().segmentSize / 8; ++i) {
+    tree.addFile(R"(C:\temp\file)" + std::to_string(i), i);
+  }
+  EXPECT_EQ(0, tree.growthCount());
+
+  EXPECT_TRUE(tree.growIfLow());
+  EXPECT_EQ(1, tree.growthCount());
+  EXPECT_NE(nullptr, tree->findNode(R"(C:\temp\file0)").get());
+  EXPECT_FALSE(tree.growIfLow());
+}
+
+TEST(DirectoryTreeTest, TryAddReportsOutOfSpace)
+{
+  shared_memory_object::remove(g_SHMName);
+  ContainerType tree(g_SHMName, 64 * 1024);
+  auto name = [](int index) { return R"(C:\temp\file)" + std::to_string(index); };
+
+  int count = 0;
+  TreeStatus status = TreeStatus::OK;
+  EXPECT_NO_THROW({
+    while ((status = tree.tryAddFile(name(count), count)) == TreeStatus::OK) {
+      ++count;
+    }
+  });
+  EXPECT_EQ(TreeStatus::OUT_OF_SPACE, status);
+  EXPECT_LT(0, count);
+  EXPECT_EQ(0U, tree.growthCount());
+  EXPECT_EQ(nullptr, tree->findNode(name(count)).get());
+
+  // the regular functions grow the tree instead
+  TreeType::NodePtrT node = tree.addFile(name(count), count);
+  EXPECT_LT(0U, tree.growthCount());
+  EXPECT_EQ(count, node->data());
+  EXPECT_EQ(TreeStatus::OK, tree.tryAddDirectory(R"(C:\temp\dir)", 0));
+}
+
+TEST(DirectoryTreeTest, UsageCounters)
+{
+  shared_memory_object::remove(g_SHMName);
+  ContainerType tree(g_SHMName, 4096);
+  TreeUsage empty = tree.usage();
+  EXPECT_EQ(1U, empty.directories); // the root
+  EXPECT_EQ(0U, empty.files);
+
+  tree.addFile(R"(C:\temp\bla)", 1, 0, false);
+  TreeUsage usage = tree.usage();
+  EXPECT_EQ(3U, usage.directories);
+  EXPECT_EQ(1U, usage.files);
+  // names are counted along with their folded keys
+  EXPECT_EQ(empty.nameBytes + 2 * strlen("C:tempbla"), usage.nameBytes);
+  EXPECT_LT(usage.freeBytes, usage.segmentSize);
+
+  // growing moves the tree to a new segment along with its counters
+  for (char ch = 'a'; ch <= 'z'; ++ch) {
+    tree.addFile(std::string(R"(C:\temp\a)") + ch, ch - 'a' + 1);
+  }
+  usage = tree.usage();
+  EXPECT_LT(0U, usage.growthCount);
+  EXPECT_EQ(27U, usage.files);
+  EXPECT_EQ(3U, usage.directories);
+
+  EXPECT_TRUE(tree.removeNode(R"(C:\temp\bla)"));
+  EXPECT_EQ(26U, tree.usage().files);
+  tree.clear();
+  EXPECT_EQ(0U, tree.usage().files);
+}
+
 TEST(DirectoryTreeTest, SHMAllocation)
 {
   EXPECT_NO_THROW({
@@ -0,0 +1,485 @@
+
+#include "test_benchmark.h"
+#include <test_helpers.h>
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <thread>
+#include <unordered_set>
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+
+namespace {
+
+  // the same mix of top level folders a typical mod contains
+  const wchar_t* const TOP_LEVEL[] = { L"textures", L"meshes", L"sound", L"scripts", L"interface" };
+  const wchar_t* const EXTENSIONS[] = { L".dds", L".nif", L".wav", L".pex", L".swf" };
+  // share of the files in each top level folder of a real modlist, in percent
+  const unsigned TOP_LEVEL_SHARE[] = { 45, 35, 8, 7, 5 };
+  constexpr std::size_t FILES_PER_DIRECTORY = 40;
+  constexpr std::size_t SUBDIRECTORIES = 16;
+  // generate_mods doesn't go deeper once a directory path gets this long so the paths stay
+  // below MAX_PATH with the temp directory and the mod name in front
+  constexpr std::size_t MAX_RELATIVE_DIRECTORY = 120;
+
+  const wchar_t NAME_CHARACTERS[] = L"abcdefghijklmnopqrstuvwxyz0123456789_";
+  const wchar_t MOD_CHARACTERS[] = L"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
+
+  // draws from the engine directly since the std distributions produce different numbers with
+  // every standard library while the generated layouts have to be reproducible
+  class LayoutRandom
+  {
+  public:
+    explicit LayoutRandom(unsigned seed) : m_engine(seed) {}
+
+    // 0 to count - 1
+    std::size_t below(std::size_t count) { return count > 1 ? m_engine() % count : 0; }
+
+    // most names are around the mean length, one in eight is longer by up to twice the mean
+    // like the long descriptive names some mods use
+    template <std::size_t N>
+    std::wstring name(unsigned mean, const wchar_t (&characters)[N])
+    {
+      std::size_t length = mean / 2 + below(mean + 1);
+      if (below(8) == 0)
+        length += below(2 * mean + 1);
+      length = std::max<std::size_t>(length, 3);
+
+      std::wstring result;
+      result.reserve(length);
+      for (std::size_t i = 0; i < length; ++i)
+        result += characters[below(N - 1)];
+      return result;
+    }
+
+  private:
+    std::mt19937 m_engine;
+  };
+
+  void create_file(const TestBenchmark::path& file)
+  {
+    static const char contents[] = "usvfs benchmark file\r\n";
+
+    HANDLE handle = CreateFileW(file.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (handle == INVALID_HANDLE_VALUE)
+      throw_testWinFuncFailed("CreateFileW", file.u8string().c_str());
+    DWORD written = 0;
+    BOOL res = WriteFile(handle, contents, sizeof(contents) - 1, &written, nullptr);
+    CloseHandle(handle);
+    if (!res)
+      throw_testWinFuncFailed("WriteFile", file.u8string().c_str());
+  }
+
+  uint64_t ticks()
+  {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return static_cast<uint64_t>(now.QuadPart);
+  }
+
+  double tick_frequency()
+  {
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    return static_cast<double>(frequency.QuadPart);
+  }
+
+  const char* const OPERATIONS[] = { "enumerate", "stat", "open", "read" };
+
+}
+
+void TestBenchmark::generate(const path& root, std::size_t files)
+{
+  std::size_t directories = (files + FILES_PER_DIRECTORY - 1) / FILES_PER_DIRECTORY;
+  std::size_t created = 0;
+  for (std::size_t d = 0; d < directories; ++d)
+  {
+    std::size_t top = d % _countof(TOP_LEVEL);
+    path dir = root / TOP_LEVEL[top]
+      / (L"dir" + std::to_wstring(d / SUBDIRECTORIES)) / (L"subdir" + std::to_wstring(d % SUBDIRECTORIES));
+    std::error_code ec;
+    std::experimental::filesystem::create_directories(dir, ec);
+    if (ec)
+      throw test::FuncFailed("create_directories", ec.message().c_str(), dir.u8string().c_str());
+
+    for (std::size_t f = 0; f < FILES_PER_DIRECTORY && created < files; ++f, ++created)
+      create_file(dir / (L"file" + std::to_wstring(f) + EXTENSIONS[top]));
+  }
+
+  std::fprintf(m_output, "# generated %zu files in %zu directories\n", created, directories);
+}
+
+void TestBenchmark::generate_mods(const path& root, const ModLayout& layout)
+{
+  LayoutRandom random(layout.seed);
+  const std::size_t mods = layout.mods ? layout.mods : std::max<std::size_t>(1, layout.files / FILES_PER_MOD);
+  const std::size_t fanout = std::max(layout.fanout, 1u);
+  const unsigned name_length = std::max(layout.name_length, 1u);
+
+  // mod sizes follow a power law, the order is shuffled so the big mods don't all end up at the bottom
+  std::vector<std::size_t> sizes(mods);
+  {
+    uint64_t total_weight = 0;
+    for (std::size_t i = 0; i < mods; ++i)
+      total_weight += 1000000 / (i + 1);
+    std::size_t assigned = 0;
+    for (std::size_t i = 0; i < mods; ++i) {
+      sizes[i] = static_cast<std::size_t>(layout.files * (1000000 / (i + 1)) / total_weight);
+      assigned += sizes[i];
+    }
+    for (std::size_t i = 0; assigned < layout.files; i = (i + 1) % mods, ++assigned)
+      ++sizes[i];
+    for (std::size_t i = mods - 1; i > 0; --i)
+      std::swap(sizes[i], sizes[random.below(i + 1)]);
+  }
+
+  // the directory tree all mods share, the first entries are the top level folders
+  struct Directory {
+    path relative;
+    std::vector<std::size_t> children;
+  };
+  std::vector<Directory> directories;
+  for (const wchar_t* top : TOP_LEVEL)
+    directories.push_back(Directory{ top, {} });
+
+  // walks down from a top level folder. Low child indices are picked more often so files cluster
+  // in some directories instead of spreading evenly
+  auto pick_directory = [&](std::size_t top) {
+    std::size_t current = top;
+    for (unsigned level = 0; level < layout.depth; ++level) {
+      if (random.below(4) == 0 || directories[current].relative.native().size() > MAX_RELATIVE_DIRECTORY)
+        break;
+      std::size_t slot = random.below(random.below(fanout) + 1);
+      if (slot < directories[current].children.size()) {
+        current = directories[current].children[slot];
+        continue;
+      }
+      if (directories[current].children.size() >= fanout) {
+        current = directories[current].children[random.below(fanout)];
+        continue;
+      }
+      path child = directories[current].relative / random.name(name_length, NAME_CHARACTERS);
+      bool exists = std::any_of(directories[current].children.begin(), directories[current].children.end(),
+        [&](std::size_t index) { return directories[index].relative == child; });
+      if (exists)
+        break;
+      directories.push_back(Directory{ child, {} });
+      directories[current].children.push_back(directories.size() - 1);
+      current = directories.size() - 1;
+    }
+    return current;
+  };
+
+  auto pick_top_level = [&random]() {
+    std::size_t share = random.below(100);
+    std::size_t top = 0;
+    while (top + 1 < _countof(TOP_LEVEL_SHARE) && share >= TOP_LEVEL_SHARE[top])
+      share -= TOP_LEVEL_SHARE[top++];
+    return top;
+  };
+
+  std::vector<path> provided; // relative paths of all files generated so far
+  std::unordered_set<std::wstring> known(layout.files);
+  std::vector<std::wstring> mod_names;
+  std::size_t replaced = 0;
+  for (std::size_t m = 0; m < mods; ++m)
+  {
+    wchar_t prefix[16];
+    swprintf_s(prefix, L"%04zu ", m);
+    mod_names.push_back(prefix + random.name(name_length, MOD_CHARACTERS));
+    const path mod = root / mod_names.back();
+
+    std::unordered_set<std::wstring> in_mod;
+    std::unordered_set<std::wstring> created;
+    for (std::size_t f = 0; f < sizes[m]; ++f)
+    {
+      path relative;
+      if (!provided.empty() && random.below(100) < layout.overlap) {
+        relative = provided[random.below(provided.size())];
+        if (in_mod.insert(relative.native()).second)
+          ++replaced;
+        else
+          relative.clear();
+      }
+      if (relative.empty()) {
+        std::size_t top = pick_top_level();
+        do {
+          relative = directories[pick_directory(top)].relative
+            / (random.name(name_length, NAME_CHARACTERS) + EXTENSIONS[top]);
+        } while (!known.insert(relative.native()).second);
+        provided.push_back(relative);
+        in_mod.insert(relative.native());
+      }
+
+      path file = mod / relative;
+      if (created.insert(relative.parent_path().native()).second) {
+        std::error_code ec;
+        std::experimental::filesystem::create_directories(file.parent_path(), ec);
+        if (ec)
+          throw test::FuncFailed("create_directories", ec.message().c_str(), file.parent_path().u8string().c_str());
+      }
+      create_file(file);
+    }
+  }
+
+  const path mapping = root / MODS_MAPPING;
+  test::ScopedFILE out;
+  errno_t err = _wfopen_s(out, mapping.c_str(), L"wt");
+  if (err || !out)
+    throw_testWinFuncFailed("_wfopen_s", mapping.u8string().c_str(), err);
+  std::fprintf(out, "# %zu files in %zu mods, overlap %u%%, depth %u, fan-out %zu, name length %u, seed %u\n",
+    layout.files, mods, layout.overlap, layout.depth, fanout, name_length, layout.seed);
+  std::fprintf(out, "# every mod is linked with VirtualLinkDirectoryStatic(<mod>, <mount>, LINKFLAG_RECURSIVE), later mods win\n");
+  std::fprintf(out, "mapdir\n");
+  for (const auto& name : mod_names)
+    std::fprintf(out, "  %s\n", path(name).u8string().c_str());
+
+  std::fprintf(m_output, "# generated %zu files in %zu mods (%zu unique paths, %zu replaced, %zu directories)\n",
+    layout.files, mods, provided.size(), replaced, directories.size());
+}
+
+void TestBenchmark::collect(const path& directory, std::vector<path>& directories, std::vector<path>& files)
+{
+  directories.push_back(directory);
+
+  WIN32_FIND_DATAW fd;
+  HANDLE search = FindFirstFileExW((directory / L"*").c_str(), FindExInfoBasic, &fd, FindExSearchNameMatch, nullptr, FIND_FIRST_EX_LARGE_FETCH);
+  if (search == INVALID_HANDLE_VALUE)
+    throw_testWinFuncFailed("FindFirstFileExW", directory.u8string().c_str());
+
+  std::vector<path> recurse;
+  do {
+    if (wcscmp(fd.cFileName, L".") == 0 || wcscmp(fd.cFileName, L"..") == 0)
+      continue;
+    if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+      recurse.push_back(directory / fd.cFileName);
+    else
+      files.push_back(directory / fd.cFileName);
+  } while (FindNextFileW(search, &fd));
+  FindClose(search);
+
+  for (const auto& r : recurse)
+    collect(r, directories, files);
+}
+
+//static
+void TestBenchmark::wait_for_start(const std::string& sync)
+{
+  HANDLE ready = OpenSemaphoreA(SEMAPHORE_MODIFY_STATE, FALSE, ready_semaphore(sync).c_str());
+  if (!ready)
+    throw_testWinFuncFailed("OpenSemaphoreA", ready_semaphore(sync).c_str());
+  HANDLE go = OpenEventA(SYNCHRONIZE, FALSE, go_event(sync).c_str());
+  if (!go) {
+    test::WinFuncFailedGenerator failed;
+    CloseHandle(ready);
+    throw failed("OpenEventA", go_event(sync).c_str());
+  }
+
+  ReleaseSemaphore(ready, 1, nullptr);
+  WaitForSingleObject(go, INFINITE);
+  CloseHandle(go);
+  CloseHandle(ready);
+}
+
+//static
+void TestBenchmark::workload(const std::vector<path>& directories, const std::vector<path>& files,
+  unsigned passes, std::size_t offset, ThreadSamples& samples)
+{
+  samples.enumerate.reserve(directories.size() * passes);
+  samples.stat.reserve(files.size() * passes);
+  samples.open.reserve(files.size() * passes);
+  samples.read.reserve(files.size() * passes);
+
+  char buffer[4096];
+  for (unsigned pass = 0; pass < passes; ++pass)
+  {
+    for (std::size_t i = 0; i < directories.size(); ++i)
+    {
+      const path& dir = directories[(i + offset) % directories.size()];
+      uint64_t start = ticks();
+      WIN32_FIND_DATAW fd;
+      HANDLE search = FindFirstFileExW((dir / L"*").c_str(), FindExInfoBasic, &fd, FindExSearchNameMatch, nullptr, FIND_FIRST_EX_LARGE_FETCH);
+      if (search == INVALID_HANDLE_VALUE)
+        throw_testWinFuncFailed("FindFirstFileExW", dir.u8string().c_str());
+      while (FindNextFileW(search, &fd)) {}
+      FindClose(search);
+      samples.enumerate.push_back(ticks() - start);
+    }
+
+    for (std::size_t i = 0; i < files.size(); ++i)
+    {
+      const path& file = files[(i + offset) % files.size()];
+      uint64_t start = ticks();
+      WIN32_FILE_ATTRIBUTE_DATA data;
+      if (!GetFileAttributesExW(file.c_str(), GetFileExInfoStandard, &data))
+        throw_testWinFuncFailed("GetFileAttributesExW", file.u8string().c_str());
+      samples.stat.push_back(ticks() - start);
+    }
+
+    for (std::size_t i = 0; i < files.size(); ++i)
+    {
+      const path& file = files[(i + offset) % files.size()];
+      uint64_t start = ticks();
+      HANDLE handle = CreateFileW(file.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+      if (handle == INVALID_HANDLE_VALUE)
+        throw_testWinFuncFailed("CreateFileW", file.u8string().c_str());
+      CloseHandle(handle);
+      samples.open.push_back(ticks() - start);
+    }
+
+    for (std::size_t i = 0; i < files.size(); ++i)
+    {
+      const path& file = files[(i + offset) % files.size()];
+      uint64_t start = ticks();
+      HANDLE handle = CreateFileW(file.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+      if (handle == INVALID_HANDLE_VALUE)
+        throw_testWinFuncFailed("CreateFileW", file.u8string().c_str());
+      DWORD got = 0;
+      while (ReadFile(handle, buffer, sizeof(buffer), &got, nullptr) && got) {}
+      CloseHandle(handle);
+      samples.read.push_back(ticks() - start);
+    }
+  }
+}
+
+TestBenchmark::Results TestBenchmark::run(const path& root, unsigned passes, unsigned threads, const std::string& sync)
+{
+  std::vector<path> directories;
+  std::vector<path> files;
+  collect(root, directories, files);
+  if (files.empty())
+    throw test::FuncFailed("TestBenchmark::run", "no files found", root.u8string().c_str());
+  if (threads == 0)
+    threads = 1;
+
+  std::fprintf(m_output, "# benchmarking %zu files in %zu directories, %u passes on %u threads\n",
+    files.size(), directories.size(), passes, threads);
+
+  if (!sync.empty())
+    wait_for_start(sync);
+
+  std::vector<ThreadSamples> samples(threads);
+  std::vector<std::exception_ptr> errors(threads);
+  uint64_t total_start = ticks();
+  {
+    std::vector<std::thread> workers;
+    for (unsigned t = 1; t < threads; ++t)
+      workers.emplace_back([&, t]() {
+        try {
+          workload(directories, files, passes, files.size() * t / threads, samples[t]);
+        }
+        catch (...) {
+          errors[t] = std::current_exception();
+        }
+      });
+    try {
+      workload(directories, files, passes, 0, samples[0]);
+    }
+    catch (...) {
+      errors[0] = std::current_exception();
+    }
+    for (auto& worker : workers)
+      worker.join();
+  }
+  uint64_t total = ticks() - total_start;
+
+  for (const auto& error : errors)
+    if (error)
+      std::rethrow_exception(error);
+
+  Samples enumerate, stat, open, read;
+  for (auto& s : samples) {
+    enumerate.insert(enumerate.end(), s.enumerate.begin(), s.enumerate.end());
+    stat.insert(stat.end(), s.stat.begin(), s.stat.end());
+    open.insert(open.end(), s.open.begin(), s.open.end());
+    read.insert(read.end(), s.read.begin(), s.read.end());
+  }
+
+  Results results;
+  results["enumerate"] = summarize(enumerate);
+  results["stat"] = summarize(stat);
+  results["open"] = summarize(open);
+  results["read"] = summarize(read);
+
+  Result& all = results["total"];
+  for (const char* op : OPERATIONS)
+    all.count += results[op].count;
+  all.seconds = total / tick_frequency();
+  return results;
+}
+
+TestBenchmark::Result TestBenchmark::summarize(Samples& samples)
+{
+  Result result;
+  if (samples.empty())
+    return result;
+
+  double frequency = tick_frequency();
+  uint64_t sum = 0;
+  for (auto s : samples)
+    sum += s;
+
+  std::sort(samples.begin(), samples.end());
+  result.count = samples.size();
+  result.seconds = sum / frequency;
+  result.p50_us = samples[samples.size() / 2] * 1e6 / frequency;
+  result.p99_us = samples[std::min(samples.size() - 1, samples.size() * 99 / 100)] * 1e6 / frequency;
+  return result;
+}
+
+void TestBenchmark::print(const Results& results, const Results* baseline)
+{
+  std::fprintf(m_output, "%-10s %10s %14s %10s %10s%s\n", "operation", "count", "ops/s", "p50 us", "p99 us",
+    baseline ? "   overhead p50 / p99 / throughput" : "");
+  for (const auto& entry : results)
+  {
+    const Result& r = entry.second;
+    std::fprintf(m_output, "%-10s %10llu %14.1f %10.2f %10.2f", entry.first.c_str(),
+      static_cast<unsigned long long>(r.count), r.ops_per_second(), r.p50_us, r.p99_us);
+    if (baseline) {
+      auto base = baseline->find(entry.first);
+      if (base != baseline->end() && r.ops_per_second() > 0) {
+        // the total only has a meaningful throughput
+        if (base->second.p50_us > 0 && base->second.p99_us > 0)
+          std::fprintf(m_output, "   %6.2fx / %6.2fx", r.p50_us / base->second.p50_us, r.p99_us / base->second.p99_us);
+        else
+          std::fprintf(m_output, "   %7s / %7s", "-", "-");
+        std::fprintf(m_output, " / %6.2fx", base->second.ops_per_second() / r.ops_per_second());
+      }
+    }
+    std::fprintf(m_output, "\n");
+  }
+}
+
+//static
+void TestBenchmark::save(const path& file, const Results& results)
+{
+  test::ScopedFILE out;
+  errno_t err = _wfopen_s(out, file.c_str(), L"wt");
+  if (err || !out)
+    throw_testWinFuncFailed("_wfopen_s", file.u8string().c_str(), err);
+  for (const auto& entry : results)
+    std::fprintf(out, "%s %llu %.9f %.4f %.4f\n", entry.first.c_str(),
+      static_cast<unsigned long long>(entry.second.count), entry.second.seconds, entry.second.p50_us, entry.second.p99_us);
+}
+
+//static
+TestBenchmark::Results TestBenchmark::load(const path& file)
+{
+  test::ScopedFILE in;
+  errno_t err = _wfopen_s(in, file.c_str(), L"rt");
+  if (err || !in)
+    throw_testWinFuncFailed("_wfopen_s", file.u8string().c_str(), err);
+
+  Results results;
+  char name[64];
+  unsigned long long count;
+  Result r;
+  while (std::fscanf(in, "%63s %llu %lf %lf %lf", name, &count, &r.seconds, &r.p50_us, &r.p99_us) == 5)
+  {
+    r.count = count;
+    results[name] = r;
+  }
+  return results;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "test_filesystem.h"
+#include <cstdint>
+#include <exception>
+#include <map>
+#include <string>
+#include <vector>
+
+// Replays an open/stat/enumerate/read workload over a directory tree and reports throughput
+// and latency percentiles per operation. Calls go straight to the Win32 API (nothing is printed
+// per call) so that the measured time is dominated by the (possibly hooked) file system calls.
+class TestBenchmark
+{
+public:
+  typedef TestFileSystem::path path;
+  typedef std::FILE FILE;
+
+  struct Result {
+    uint64_t count = 0;
+    double seconds = 0.0;
+    double p50_us = 0.0;
+    double p99_us = 0.0;
+
+    double ops_per_second() const { return seconds > 0.0 ? count / seconds : 0.0; }
+  };
+  typedef std::map<std::string, Result> Results;
+
+  // settings of generate_mods. The defaults resemble a large modlist: a few huge texture and mesh
+  // mods, many small ones and part of the files of every mod replacing files of earlier mods
+  struct ModLayout {
+    std::size_t files = 10000;  // files of all mods together, the replaced ones included
+    std::size_t mods = 0;       // 0 for one mod per FILES_PER_MOD files
+    unsigned overlap = 15;      // percentage of the files of a mod which replace a file of an earlier mod
+    unsigned depth = 5;         // maximum directory depth below the top level folders
+    unsigned fanout = 12;       // maximum number of subdirectories of a directory
+    unsigned name_length = 12;  // average length of mod, directory and file names
+    unsigned seed = 1;
+  };
+  static constexpr std::size_t FILES_PER_MOD = 500;
+  static constexpr auto MODS_MAPPING = L"vfs_mappings.txt";
+
+  TestBenchmark(FILE* output) : m_output(output) {}
+
+  // creates a synthetic mod layout with the given number of files under root
+  // (directories fan out like a game data directory: textures\dirN\subdirM\fileK.dds, ...)
+  void generate(const path& root, std::size_t files);
+
+  // creates the mods of the given layout under root, named so they sort in priority order, and
+  // root\MODS_MAPPING listing them in the format of usvfs_test -mapping. Every entry of that file
+  // stands for VirtualLinkDirectoryStatic(root\<mod>, <mount>, LINKFLAG_RECURSIVE), in order.
+  // The same layout always produces the same files, on any machine
+  void generate_mods(const path& root, const ModLayout& layout);
+
+  // runs the given number of passes of the workload over all files found under root, on the
+  // given number of threads at once. If sync is not empty the workload only starts once the
+  // controlling process signals it (see wait_for_start)
+  Results run(const path& root, unsigned passes, unsigned threads = 1, const std::string& sync = std::string());
+
+  void print(const Results& results, const Results* baseline = nullptr);
+
+  static void save(const path& file, const Results& results);
+  static Results load(const path& file);
+
+  // names of the objects used to start the workload of several processes at the same time:
+  // every process releases the <sync>_ready semaphore once it is set up and then waits for
+  // the <sync>_go event
+  static std::string ready_semaphore(const std::string& sync) { return sync + "_ready"; }
+  static std::string go_event(const std::string& sync) { return sync + "_go"; }
+
+private:
+  typedef std::vector<uint64_t> Samples;
+
+  struct ThreadSamples {
+    Samples enumerate, stat, open, read;
+  };
+
+  // one thread's share of the workload, starting at offset so the threads don't walk the files
+  // in lockstep
+  static void workload(const std::vector<path>& directories, const std::vector<path>& files,
+    unsigned passes, std::size_t offset, ThreadSamples& samples);
+  static void wait_for_start(const std::string& sync);
+
+  void collect(const path& directory, std::vector<path>& directories, std::vector<path>& files);
+  Result summarize(Samples& samples);
+
+  FILE* m_output;
+};
@@ -1,10 +1,12 @@
 #include <cstdio>
 #include <stdexcept>
+#include <cstdlib>
 #include <winapi.h>
 #include <fmt/format.h>
 #include <test_helpers.h>
 #include "test_ntapi.h"
 #include "test_w32api.h"
+#include "test_benchmark.h"
 
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
@@ -35,6 +37,9 @@ void print_usage(const char* myname) {
   fprintf(stderr, " -moveover <src> <dst> : moves the given file (replacing existing destination; not supported by ntapi).\n");
   fprintf(stderr, " -deletemove <src> <dst> : shorthand for -delete <dst> -move <src> <dst>.\n");
   fprintf(stderr, " -debug              : shows a message box and wait for a debugger to connect.\n");
+  fprintf(stderr, " -benchgen <dir> <files> : creates a synthetic mod layout with the given number of files under dir.\n");
+  fprintf(stderr, " -benchmods <dir> <files> : creates mods with the given number of files in total under dir along with dir\\vfs_mappings.txt to link them.\n");
+  fprintf(stderr, " -bench <dir> <passes> : replays an enumerate/stat/open/read workload over all files under dir and outputs throughput and p50/p99 latencies.\n");
   fprintf(stderr, "\nsupported options:\n");
   fprintf(stderr, " -out <file>         : file to log output to (use \"-\" for the stdout; otherwise path to output should exist).\n");
   fprintf(stderr, " -out+ <file>        : similar to -out but appends the file instead of overwriting it.\n");
@@ -45,6 +50,16 @@ void print_usage(const char* myname) {
   fprintf(stderr, " -basedir <dir>      : any paths under the basedir will outputed in a relative manner (default is current directory).\n");
   fprintf(stderr, " -w32api             : use regular Win32 API for file access (default).\n");
   fprintf(stderr, " -ntapi              : use lower level ntdll functions for file access.\n");
+  fprintf(stderr, " -benchsave <file>   : saves the results of the following -bench commands to file (to be used as a baseline).\n");
+  fprintf(stderr, " -benchbase <file>   : compares the results of the following -bench commands to the baseline saved in file.\n");
+  fprintf(stderr, " -benchthreads <n>   : runs the workload of the following -bench commands on n threads at once (default is 1).\n");
+  fprintf(stderr, " -benchsync <name>   : the following -bench commands signal the <name>_ready semaphore when set up and wait for the <name>_go event before starting.\n");
+  fprintf(stderr, " -benchmodcount <n>  : number of mods the following -benchmods commands create (default is one per 500 files).\n");
+  fprintf(stderr, " -benchoverlap <n>   : percentage of the files of a mod which replace files of earlier mods (default is 15).\n");
+  fprintf(stderr, " -benchdepth <n>     : maximum directory depth below the top level folders of the mods (default is 5).\n");
+  fprintf(stderr, " -benchfanout <n>    : maximum number of subdirectories of a directory (default is 12).\n");
+  fprintf(stderr, " -benchnamelen <n>   : average length of mod, directory and file names (default is 12).\n");
+  fprintf(stderr, " -benchseed <n>      : seed of the following -benchmods commands, the same settings and seed produce the same mods (default is 1).\n");
 }
 
 class CommandExecuter
@@ -187,6 +202,63 @@ public:
     m_api->rename_file(m_api->real_path(source), m_api->real_path(destination), replace_existing, allow_copy);
   }
 
+  void set_benchmark_save(const char* file)
+  {
+    m_bench_save = file;
+  }
+
+  void set_benchmark_baseline(const char* file)
+  {
+    m_bench_baseline = TestBenchmark::load(file);
+    m_has_bench_baseline = true;
+  }
+
+  void set_benchmark_threads(const char* threads)
+  {
+    m_bench_threads = static_cast<unsigned>(std::strtoul(threads, nullptr, 10));
+  }
+
+  void set_benchmark_sync(const char* name)
+  {
+    m_bench_sync = name;
+  }
+
+  TestBenchmark::ModLayout& benchmark_layout()
+  {
+    return m_bench_layout;
+  }
+
+  void benchmark_generate(const char* dir, const char* files)
+  {
+    if (debug_pending()) __debugbreak();
+
+    TestBenchmark(m_output).generate(m_api->real_path(dir), std::strtoul(files, nullptr, 10));
+  }
+
+  void benchmark_generate_mods(const char* dir, const char* files)
+  {
+    if (debug_pending()) __debugbreak();
+
+    TestBenchmark::ModLayout layout = m_bench_layout;
+    layout.files = std::strtoull(files, nullptr, 10);
+    TestBenchmark(m_output).generate_mods(m_api->real_path(dir), layout);
+  }
+
+  void benchmark(const char* dir, const char* passes)
+  {
+    if (debug_pending()) __debugbreak();
+
+    const auto& real = m_api->real_path(dir);
+    fprintf(m_output, ">> Benchmarking {%s}:\n", m_api->relative_path(real).u8string().c_str());
+
+    TestBenchmark bench(m_output);
+    unsigned count = static_cast<unsigned>(std::strtoul(passes, nullptr, 10));
+    const auto& results = bench.run(real, count ? count : 1, m_bench_threads, m_bench_sync);
+    bench.print(results, m_has_bench_baseline ? &m_bench_baseline : nullptr);
+    if (!m_bench_save.empty())
+      TestBenchmark::save(m_bench_save, results);
+  }
+
   void debug()
   {
     m_debug_pending = true;
@@ -283,6 +355,13 @@ private:
   bool m_recursive = false;
   bool m_debug_pending = false;
 
+  TestFileSystem::path m_bench_save;
+  TestBenchmark::Results m_bench_baseline;
+  bool m_has_bench_baseline = false;
+  unsigned m_bench_threads = 1;
+  std::string m_bench_sync;
+  TestBenchmark::ModLayout m_bench_layout;
+
   TestFileSystem* m_api;
   static TestW32Api w32api;
   static TestNtApi ntapi;
@@ -355,6 +434,26 @@ int main(int argc, char *argv[])
         executer.set_ntapi(false);
       else if (strcmp(argv[ai], "-ntapi") == 0)
         executer.set_ntapi(true);
+      else if (strcmp(argv[ai], "-benchsave") == 0 && verify_args_exist("-benchsave", 1, ai, argc))
+        executer.set_benchmark_save(argv[++ai]);
+      else if (strcmp(argv[ai], "-benchbase") == 0 && verify_args_exist("-benchbase", 1, ai, argc))
+        executer.set_benchmark_baseline(argv[++ai]);
+      else if (strcmp(argv[ai], "-benchthreads") == 0 && verify_args_exist("-benchthreads", 1, ai, argc))
+        executer.set_benchmark_threads(argv[++ai]);
+      else if (strcmp(argv[ai], "-benchsync") == 0 && verify_args_exist("-benchsync", 1, ai, argc))
+        executer.set_benchmark_sync(argv[++ai]);
+      else if (strcmp(argv[ai], "-benchmodcount") == 0 && verify_args_exist("-benchmodcount", 1, ai, argc))
+        executer.benchmark_layout().mods = std::strtoull(argv[++ai], nullptr, 10);
+      else if (strcmp(argv[ai], "-benchoverlap") == 0 && verify_args_exist("-benchoverlap", 1, ai, argc))
+        executer.benchmark_layout().overlap = std::strtoul(argv[++ai], nullptr, 10);
+      else if (strcmp(argv[ai], "-benchdepth") == 0 && verify_args_exist("-benchdepth", 1, ai, argc))
+        executer.benchmark_layout().depth = std::strtoul(argv[++ai], nullptr, 10);
+      else if (strcmp(argv[ai], "-benchfanout") == 0 && verify_args_exist("-benchfanout", 1, ai, argc))
+        executer.benchmark_layout().fanout = std::strtoul(argv[++ai], nullptr, 10);
+      else if (strcmp(argv[ai], "-benchnamelen") == 0 && verify_args_exist("-benchnamelen", 1, ai, argc))
+        executer.benchmark_layout().name_length = std::strtoul(argv[++ai], nullptr, 10);
+      else if (strcmp(argv[ai], "-benchseed") == 0 && verify_args_exist("-benchseed", 1, ai, argc))
+        executer.benchmark_layout().seed = std::strtoul(argv[++ai], nullptr, 10);
       // commands:
       else if ((strcmp(argv[ai], "-list") == 0
         || strcmp(argv[ai], "-listcontents") == 0)
@@ -418,6 +517,21 @@ int main(int argc, char *argv[])
         ++++ai;
         found_commands = true;
       }
+      else if (strcmp(argv[ai], "-benchgen") == 0 && verify_args_exist("-benchgen", 2, ai, argc)) {
+        executer.benchmark_generate(argv[ai + 1], argv[ai + 2]);
+        ++++ai;
+        found_commands = true;
+      }
+      else if (strcmp(argv[ai], "-benchmods") == 0 && verify_args_exist("-benchmods", 2, ai, argc)) {
+        executer.benchmark_generate_mods(argv[ai + 1], argv[ai + 2]);
+        ++++ai;
+        found_commands = true;
+      }
+      else if (strcmp(argv[ai], "-bench") == 0 && verify_args_exist("-bench", 2, ai, argc)) {
+        executer.benchmark(argv[ai + 1], argv[ai + 2]);
+        ++++ai;
+        found_commands = true;
+      }
       else if (strcmp(argv[ai], "-debug") == 0) {
         executer.debug();
       }
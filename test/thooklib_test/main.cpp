@@ -1,4 +1,8 @@
 #include <iostream>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <intrin.h>
 #include <gtest/gtest.h>
 #include <hooklib.h>
 #include <ttrampolinepool.h>
@@ -227,6 +231,243 @@ TEST_F(HookingTest, Threading)
   RemoveHook(hook);
 }
 
+TEST_F(HookingTest, TrampolineOverhead)
+{
+  // compare a call through the trampoline with a direct call of the replacement
+  // function. This doesn't fail on timing, the numbers are for comparing
+  // trampoline variants
+  static const int NUM_CALLS = 1000000;
+
+  HMODULE k32Mod = GetModuleHandleA("kernel32.dll");
+  HOOKHANDLE hook = InstallHook(k32Mod, "GetFileAttributesA", THGetFileAttributesA_1);
+  if (hook == INVALID_HOOK) {
+    k32Mod = GetModuleHandleA("kernelbase.dll");
+    hook = InstallHook(k32Mod, "GetFileAttributesA", THGetFileAttributesA_1);
+  }
+  ASSERT_NE(INVALID_HOOK, hook);
+
+  // through pointers so the calls can't be inlined
+  DWORD (WINAPI * volatile hooked)(LPCSTR) = &GetFileAttributesA;
+  DWORD (WINAPI * volatile direct)(LPCSTR) = &THGetFileAttributesA_1;
+
+  auto start = std::chrono::high_resolution_clock::now();
+  for (int i = 0; i < NUM_CALLS; ++i) {
+    direct(INVALID_FILENAME.c_str());
+  }
+  auto directTime = std::chrono::high_resolution_clock::now() - start;
+
+  start = std::chrono::high_resolution_clock::now();
+  DWORD result = 0;
+  for (int i = 0; i < NUM_CALLS; ++i) {
+    result = hooked(INVALID_FILENAME.c_str());
+  }
+  auto hookedTime = std::chrono::high_resolution_clock::now() - start;
+  RemoveHook(hook);
+
+  EXPECT_EQ(0x42, result);
+  logger()->info("direct call {} ns, through trampoline {} ns",
+                 std::chrono::duration_cast<std::chrono::nanoseconds>(directTime).count() / NUM_CALLS,
+                 std::chrono::duration_cast<std::chrono::nanoseconds>(hookedTime).count() / NUM_CALLS);
+}
+
+typedef int (WINAPI *IncrementFunc)(int);
+
+///
+/// generates trivial int WINAPI(int) functions returning the argument plus one. Unlike
+/// compiled functions the bytes around the function start are known, so the hook type
+/// HookLib picks for them is the same on every build: with nops in front the hook uses
+/// that space for its jump, with int3 in front the start of the function is overwritten
+///
+class IncrementFunctions {
+public:
+  IncrementFunctions()
+    : m_Code(static_cast<uint8_t*>(VirtualAlloc(nullptr, 4096, MEM_COMMIT | MEM_RESERVE,
+                                                PAGE_EXECUTE_READWRITE)))
+  {
+  }
+
+  ~IncrementFunctions() {
+    VirtualFree(m_Code, 0, MEM_RELEASE);
+  }
+
+  IncrementFunc create(uint8_t padding) {
+#if BOOST_ARCH_X86_64
+    static const uint8_t body[] = { 0x8D, 0x41, 0x01,          // lea eax, [rcx + 1]
+                                    0x90, 0x90,                // room for the 5-byte jump
+                                    0xC3 };                    // ret
+#else
+    static const uint8_t body[] = { 0x8B, 0x44, 0x24, 0x04,    // mov eax, [esp + 4]
+                                    0x40,                      // inc eax
+                                    0xC2, 0x04, 0x00 };        // ret 4
+#endif
+    memset(m_Code + m_Offset, padding, 16);
+    uint8_t *function = m_Code + m_Offset + 16;
+    memcpy(function, body, sizeof(body));
+    memset(function + sizeof(body), 0xCC, 16 - sizeof(body));
+    m_Offset += 32;
+    FlushInstructionCache(GetCurrentProcess(), function, sizeof(body));
+    return reinterpret_cast<IncrementFunc>(function);
+  }
+
+private:
+  uint8_t *m_Code;
+  size_t m_Offset{0};
+};
+
+static volatile int benchmarkSink = 0;
+
+///
+/// \return the cycles a call of the function takes, the best of several rounds since
+///         the first round also pays for cache misses
+///
+static double cyclesPerCall(IncrementFunc function)
+{
+  static const int NUM_CALLS = 1000000;
+  static const int NUM_ROUNDS = 5;
+
+  // through a volatile pointer so the call can't be inlined
+  IncrementFunc volatile target = function;
+  double best = 0.0;
+  for (int round = 0; round < NUM_ROUNDS; ++round) {
+    int sum = 0;
+    unsigned __int64 start = __rdtsc();
+    for (int i = 0; i < NUM_CALLS; ++i) {
+      sum += target(i);
+    }
+    double cycles = static_cast<double>(__rdtsc() - start) / NUM_CALLS;
+    benchmarkSink = sum;
+    if ((round == 0) || (cycles < best)) {
+      best = cycles;
+    }
+  }
+  return best;
+}
+
+static const char *platformName()
+{
+#if BOOST_ARCH_X86_64
+  return "x64";
+#else
+  return "x86";
+#endif
+}
+
+TEST_F(HookingTest, CallOverheadPerHookType)
+{
+  // cycles per call through every kind of detour HookLib creates, compared to a call
+  // of the unhooked function. "barrier closed" is the same call with hooks suppressed
+  // on the thread, so it pays for the barrier but skips the replacement function.
+  // This doesn't fail on timing, the numbers are for comparing trampoline variants
+  IncrementFunctions functions;
+  IncrementFunc jumpSpace = functions.create(0x90);
+  IncrementFunc overwrite = functions.create(0xCC);
+  IncrementFunc stubbed = functions.create(0xCC);
+
+  ASSERT_EQ(42, jumpSpace(41));
+  double direct = cyclesPerCall(jumpSpace);
+  logger()->info("[{}] direct call: {:.1f} cycles", platformName(), direct);
+
+  auto measure = [](const char *name, HOOKHANDLE hook, IncrementFunc function, int expected) {
+    EXPECT_EQ(expected, function(40));
+    double open = cyclesPerCall(function);
+    SuppressThreadHooks(true);
+    EXPECT_EQ(41, function(40));
+    double closed = cyclesPerCall(function);
+    SuppressThreadHooks(false);
+    logger()->info("[{}] {} ({}): {:.1f} cycles, barrier closed {:.1f} cycles",
+                   platformName(), name, GetHookType(hook), open, closed);
+  };
+
+  HOOKHANDLE first = InstallHook(jumpSpace, THIncrement_1);
+  ASSERT_NE(INVALID_HOOK, first);
+  measure("jump space", first, jumpSpace, 42);
+
+  // a second hook on the same function chains to the first
+  HOOKHANDLE chained = InstallHook(jumpSpace, THIncrement_2);
+  ASSERT_NE(INVALID_HOOK, chained);
+  measure("chain", chained, jumpSpace, 43);
+  RemoveHook(chained);
+  RemoveHook(first);
+
+  HOOKHANDLE disasm = InstallHook(overwrite, THIncrement_1);
+  ASSERT_NE(INVALID_HOOK, disasm);
+  measure("disasm", disasm, overwrite, 42);
+  RemoveHook(disasm);
+
+  // stubs have no barrier, they call the stub and continue with the original function
+  HOOKHANDLE stub = InstallStub(stubbed, THIncrementStub);
+  ASSERT_NE(INVALID_HOOK, stub);
+  EXPECT_EQ(41, stubbed(40));
+  logger()->info("[{}] stub without barrier ({}): {:.1f} cycles",
+                 platformName(), GetHookType(stub), cyclesPerCall(stubbed));
+  RemoveHook(stub);
+
+  EXPECT_EQ(41, jumpSpace(40));
+  EXPECT_EQ(41, overwrite(40));
+  EXPECT_EQ(41, stubbed(40));
+}
+
+TEST_F(HookingTest, SuppressionSkipsOnlySuppressibleHooks)
+{
+  IncrementFunctions functions;
+  IncrementFunc suppressible = functions.create(0x90);
+  IncrementFunc unsuppressible = functions.create(0x90);
+
+  HOOKHANDLE first = InstallHook(suppressible, THIncrement_1);
+  HOOKHANDLE second = InstallHook(unsuppressible, THIncrement_1, nullptr, false);
+  ASSERT_NE(INVALID_HOOK, first);
+  ASSERT_NE(INVALID_HOOK, second);
+
+  SuppressThreadHooks(true);
+  EXPECT_EQ(41, suppressible(40));
+  EXPECT_EQ(42, unsuppressible(40));
+  SuppressThreadHooks(false);
+  EXPECT_EQ(42, suppressible(40));
+
+  RemoveHook(second);
+  RemoveHook(first);
+}
+
+TEST_F(HookingTest, LazyHookResolvesConcurrently)
+{
+  // two threads make the first call of a lazily hooked function at the same time, so
+  // both go through the placeholder and the resolver while the jump is redirected.
+  // Both variants are covered, the jump in the space in front of the function and the
+  // overwritten function start whose moved code is taken from the copy
+  static const int ROUNDS = 16;
+  static const int CALLS = 10000;
+
+  IncrementFunctions functions;
+  for (int round = 0; round < ROUNDS; ++round) {
+    for (uint8_t padding : { static_cast<uint8_t>(0x90), static_cast<uint8_t>(0xCC) }) {
+      IncrementFunc function = functions.create(padding);
+      HOOKHANDLE hook = InstallLazyHook(function, THIncrement_1);
+      ASSERT_NE(INVALID_HOOK, hook);
+
+      std::atomic<bool> go{false};
+      std::atomic<int> wrong{0};
+      auto work = [&]() {
+        while (!go.load()) {
+        }
+        for (int i = 0; i < CALLS; ++i) {
+          if (function(40) != 42) {
+            ++wrong;
+          }
+        }
+      };
+      std::thread first(work);
+      std::thread second(work);
+      go = true;
+      first.join();
+      second.join();
+
+      EXPECT_EQ(0, wrong.load());
+      RemoveHook(hook);
+      EXPECT_EQ(41, function(40));
+    }
+  }
+}
+
 int main(int argc, char **argv) {
   auto logger = spdlog::stdout_logger_mt("usvfs");
   logger->set_level(spdlog::level::warn);
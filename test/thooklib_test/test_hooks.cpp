@@ -44,3 +44,26 @@ HANDLE WINAPI THCreateFileW_1(LPCWSTR lpFileName,
   }
 }
 
+
+
+DWORD WINAPI THGetFileAttributesA_1(LPCSTR)
+{
+  return 0x42;
+}
+
+
+int WINAPI THIncrement_1(int value)
+{
+  return value + 2;
+}
+
+
+int WINAPI THIncrement_2(int value)
+{
+  return value + 3;
+}
+
+
+void __cdecl THIncrementStub(LPVOID)
+{
+}
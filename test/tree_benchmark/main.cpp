@@ -0,0 +1,236 @@
+/*
+Userspace Virtual Filesystem
+
+Copyright (C) 2015 Sebastian Herbord. All rights reserved.
+
+This file is part of usvfs.
+
+usvfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+usvfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with usvfs. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// micro-benchmarks for the redirection tree. Run without arguments for the
+// default tree sizes or pass node counts on the command line, e.g.
+//   tree_benchmark_x64 1000 100000
+
+#include <windows_sane.h>
+#include <shared_memory.h>
+#include <directory_tree.h>
+#include <spdlog.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace usvfs::shared;
+
+typedef DirectoryTree<int> TreeType;
+typedef TreeContainer<TreeType> ContainerType;
+
+template<>
+struct usvfs::shared::SHMDataCreator<int, int> {
+  static int create(int source, const VoidAllocatorT&) {
+    return source;
+  }
+};
+
+template <> inline int usvfs::shared::createDataEmpty<int>(const typename VoidAllocatorT&)
+{
+  return 0;
+}
+
+template <> inline void usvfs::shared::dataAssign<int>(int &destination, const int &source)
+{
+  destination = source;
+}
+
+
+// matches the estimate hookcontext.cpp uses to size the redirection tree
+static const size_t BYTES_PER_NODE = 384;
+
+// leaf directories hold this many files and every directory level fans out by
+// DIRECTORY_FANOUT, similar to the data directory of a modded game
+// (meshes\architecture\whiterun\...)
+static const size_t FILES_PER_DIRECTORY = 32;
+static const size_t DIRECTORY_FANOUT = 8;
+
+static const char ROOT[] = R"(C:\games\skyrim\data)";
+
+static volatile size_t s_Sink = 0;
+
+static size_t segmentSize(size_t nodes)
+{
+  size_t size = 65536;
+  while (size < nodes * BYTES_PER_NODE) {
+    size *= 2;
+  }
+  return size;
+}
+
+static std::string directoryPath(size_t index, size_t levels)
+{
+  std::string result(ROOT);
+  for (size_t level = 0; level < levels; ++level) {
+    result += "\\dir" + std::to_string(level) + "_" + std::to_string(index % DIRECTORY_FANOUT);
+    index /= DIRECTORY_FANOUT;
+  }
+  return result;
+}
+
+static std::vector<std::string> makePaths(size_t count)
+{
+  size_t directories = std::max<size_t>(1, count / FILES_PER_DIRECTORY);
+  size_t levels = 1;
+  for (size_t capacity = DIRECTORY_FANOUT; capacity < directories; capacity *= DIRECTORY_FANOUT) {
+    ++levels;
+  }
+
+  std::vector<std::string> result;
+  result.reserve(count);
+  for (size_t i = 0; i < count; ++i) {
+    result.push_back(directoryPath(i / FILES_PER_DIRECTORY, levels)
+                     + "\\file" + std::to_string(i % FILES_PER_DIRECTORY) + ".dds");
+  }
+  return result;
+}
+
+template <typename Function>
+static void measure(const char *name, size_t nodes, size_t operations, Function function)
+{
+  auto start = std::chrono::steady_clock::now();
+  function();
+  auto end = std::chrono::steady_clock::now();
+  double nanoseconds = static_cast<double>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+  printf("%-28s %10zu %12.1f ns/op %10zu ops\n", name, nodes,
+         nanoseconds / static_cast<double>(operations), operations);
+}
+
+// shared memory taken per node of the tree, directories included
+static void reportSize(const char *name, const ContainerType &tree, size_t nodes)
+{
+  TreeUsage usage = tree.usage();
+  double treeNodes = static_cast<double>(usage.directories + usage.files);
+  printf("%-28s %10zu %12.1f bytes/node %7.1f of that overhead\n", name, nodes,
+         static_cast<double>(usage.segmentSize - usage.freeBytes) / treeNodes,
+         static_cast<double>(usage.overheadBytes) / treeNodes);
+}
+
+static void fill(ContainerType &tree, const std::vector<std::string> &paths)
+{
+  for (size_t i = 0; i < paths.size(); ++i) {
+    tree.addFile(paths[i], static_cast<int>(i));
+  }
+}
+
+static void runBenchmarks(size_t nodes)
+{
+  std::vector<std::string> paths = makePaths(nodes);
+  std::string prefix = "usvfs_benchmark_" + std::to_string(nodes) + "_";
+
+  // the lookups pick random existing paths so caches behave like in a real session
+  static const size_t LOOKUPS = 200000;
+  std::mt19937 random(42);
+  std::uniform_int_distribution<size_t> pick(0, paths.size() - 1);
+  std::vector<std::wstring> lookups;
+  lookups.reserve(LOOKUPS);
+  for (size_t i = 0; i < LOOKUPS; ++i) {
+    const std::string &path = paths[pick(random)];
+    lookups.push_back(std::wstring(path.begin(), path.end()));
+  }
+
+  {
+    ContainerType tree(prefix + "presized", segmentSize(nodes));
+    measure("addFile (presized)", nodes, nodes, [&]() { fill(tree, paths); });
+    reportSize("segment usage", tree, nodes);
+  }
+
+  ContainerType tree(prefix + "grown", 65536);
+  measure("addFile (growing)", nodes, nodes, [&]() { fill(tree, paths); });
+
+  measure("findNode (path)", nodes, lookups.size(), [&]() {
+    for (const std::wstring &path : lookups) {
+      s_Sink += tree->findNode(fs::path(path)).get() != nullptr;
+    }
+  });
+
+  measure("findNodeRaw (wide)", nodes, lookups.size(), [&]() {
+    for (const std::wstring &path : lookups) {
+      s_Sink += tree->findNodeRaw(path.c_str(), path.size()) != nullptr;
+    }
+  });
+
+  measure("visitPath", nodes, lookups.size(), [&]() {
+    for (const std::wstring &path : lookups) {
+      size_t visited = 0;
+      tree->visitPath(path.c_str(), path.size(),
+                      [&visited](const TreeType&) { ++visited; });
+      s_Sink += visited;
+    }
+  });
+
+  // wildcard searches within leaf directories, as NtQueryDirectoryFile does
+  static const size_t SEARCHES = 20000;
+  std::vector<TreeType::NodePtrT> directories;
+  for (size_t i = 0; i < SEARCHES; ++i) {
+    const std::string &path = paths[pick(random)];
+    directories.push_back(tree->findNode(fs::path(path).parent_path()));
+  }
+  measure("find (file1*.dds)", nodes, directories.size(), [&]() {
+    for (const TreeType::NodePtrT &directory : directories) {
+      s_Sink += directory->find("file1*.dds").size();
+    }
+  });
+  measure("find (*)", nodes, directories.size(), [&]() {
+    for (const TreeType::NodePtrT &directory : directories) {
+      s_Sink += directory->find("*").size();
+    }
+  });
+  directories.clear();
+
+  // moving to a larger segment copies the whole tree like growth does
+  ContainerType copy(prefix + "copy", 65536);
+  fill(copy, paths);
+  size_t copySize = segmentSize(nodes) * 2;
+  measure("reserve (copyTree)", nodes, nodes, [&]() { copy.reserve(copySize); });
+}
+
+int main(int argc, char **argv)
+{
+  auto logger = spdlog::stdout_logger_mt("usvfs");
+  logger->set_level(spdlog::level::warn);
+
+  std::vector<size_t> sizes;
+  for (int i = 1; i < argc; ++i) {
+    sizes.push_back(static_cast<size_t>(strtoull(argv[i], nullptr, 10)));
+  }
+  if (sizes.empty()) {
+#if defined(_WIN64)
+    sizes = { 1000, 100000, 1000000 };
+#else
+    // a million nodes don't fit the address space of a 32-bit process twice over
+    sizes = { 1000, 100000 };
+#endif
+  }
+
+  printf("%-28s %10s %18s\n", "benchmark", "nodes", "time");
+  for (size_t nodes : sizes) {
+    if (nodes > 0) {
+      runBenchmarks(nodes);
+    }
+  }
+  return 0;
+}
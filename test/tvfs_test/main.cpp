@@ -26,6 +26,8 @@ along with usvfs. If not, see <http://www.gnu.org/licenses/>.
 #include <gtest/gtest.h>
 
 #include <fstream>
+#include <algorithm>
+#include <vector>
 #pragma warning (pop)
 
 
@@ -40,6 +42,10 @@ along with usvfs. If not, see <http://www.gnu.org/licenses/>.
 #include <stringcast.h>
 #include <hooks/kernel32.h>
 #include <hooks/ntdll.h>
+#include <maptracker.h>
+#include <pathpool.h>
+#include <foldednameset.h>
+#include <readahead.h>
 #include <usvfs.h>
 #include <logging.h>
 
@@ -160,6 +166,51 @@ TEST_F(USVFSTest, CanResizeRedirectiontree)
   });
 }
 
+TEST_F(USVFSTest, SharedLinkBaseSurvivesResize)
+{
+  using usvfs::shared::MissingThrow;
+  EXPECT_NO_THROW({
+      usvfs::RedirectionTreeContainer container("treetest_shm", 1024);
+      for (char i = 'a'; i <= 'z'; ++i) {
+        for (char j = 'a'; j <= 'z'; ++j) {
+          std::string name = std::string(R"(C:\temp\)") + i + j;
+          container.addFile(name, usvfs::RedirectionDataLocal(R"(D:\mods\)", name.substr(8)), false);
+        }
+      }
+
+      const auto &first = container->node("C:")->node("temp")->node("aa", MissingThrow)->data();
+      const auto &last = container->node("C:")->node("temp")->node("zz", MissingThrow)->data();
+      EXPECT_TRUE(first.hasTarget());
+      EXPECT_EQ(R"(D:\mods\aa)", first.target());
+      EXPECT_EQ(R"(D:\mods\zz)", last.target());
+      EXPECT_EQ("zz", last.linkTarget);
+      // the prefix is stored only once
+      EXPECT_EQ(first.linkBase.get(), last.linkBase.get());
+  });
+}
+
+TEST_F(USVFSTest, WideTargetSurvivesResize)
+{
+  using usvfs::shared::MissingThrow;
+  EXPECT_NO_THROW({
+      usvfs::RedirectionTreeContainer container("treetest_shm", 1024);
+      container.addFile(R"(C:\temp\single)", usvfs::RedirectionDataLocal(u8"D:\\m\u00f6ds\\single"), false);
+      for (char i = 'a'; i <= 'z'; ++i) {
+        for (char j = 'a'; j <= 'z'; ++j) {
+          std::string name = std::string(R"(C:\temp\)") + i + j;
+          container.addFile(name, usvfs::RedirectionDataLocal(u8"D:\\m\u00f6ds\\", name.substr(8)), false);
+        }
+      }
+
+      const auto &single = container->node("C:")->node("temp")->node("single", MissingThrow)->data();
+      const auto &last = container->node("C:")->node("temp")->node("zz", MissingThrow)->data();
+      EXPECT_EQ(std::wstring(L"D:\\m\u00f6ds\\single"), single.wideTarget());
+      EXPECT_EQ(std::wstring(L"D:\\m\u00f6ds\\zz"), last.wideTarget());
+      EXPECT_EQ(ush::string_cast<std::wstring>(last.target().c_str(), ush::CodePage::UTF8),
+                last.wideTarget());
+  });
+}
+
 /*
 TEST_F(USVFSTest, CreateFileHookReportsCorrectErrorOnMissingFile)
 {
@@ -317,6 +368,303 @@ TEST_F(USVFSTest, NtQueryDirectoryFileFindsVirtualFile)
   EXPECT_EQ(0, wcscmp(info->FileName, L"np.exe"));
 }
 
+TEST_F(USVFSTest, NtQueryDirectoryFileRestartScanReplaysListing)
+{
+  USVFSParameters params;
+  USVFSInitParameters(&params, "usvfs_test", true, LogLevel::Debug, CrashDumpsType::None, "");
+  std::unique_ptr<usvfs::HookContext> ctx(CreateHookContext(params, ::GetModuleHandle(nullptr)));
+  usvfs::RedirectionTreeContainer &tree = ctx->redirectionTable();
+
+  tree.addFile("C:\\np.exe", usvfs::RedirectionDataLocal(REAL_FILEA));
+
+  HANDLE hdl = CreateFileW(L"C:\\"
+                             , GENERIC_READ
+                             , FILE_SHARE_READ | FILE_SHARE_WRITE
+                             , nullptr
+                             , OPEN_EXISTING
+                             , FILE_ATTRIBUTE_NORMAL | FILE_FLAG_BACKUP_SEMANTICS
+                             , nullptr);
+
+  IO_STATUS_BLOCK status;
+  char buffer[1024];
+
+  usvfs::UnicodeString fileName(L"np.exe");
+
+  auto query = [&](BOOLEAN restart) {
+    return usvfs::hook_NtQueryDirectoryFile(hdl, nullptr, nullptr, nullptr,
+                                            &status, buffer, 1024,
+                                            FileDirectoryInformation, TRUE,
+                                            static_cast<PUNICODE_STRING>(fileName),
+                                            restart);
+  };
+
+  EXPECT_EQ(STATUS_SUCCESS, query(TRUE));
+  EXPECT_EQ(STATUS_NO_MORE_FILES, query(FALSE));
+  EXPECT_EQ(STATUS_SUCCESS, query(TRUE));
+
+  FILE_DIRECTORY_INFORMATION *info = reinterpret_cast<FILE_DIRECTORY_INFORMATION*>(buffer);
+  EXPECT_EQ(0UL, info->NextEntryOffset);
+  EXPECT_EQ(std::wstring(L"np.exe"),
+            std::wstring(info->FileName, info->FileNameLength / sizeof(WCHAR)));
+
+  ::CloseHandle(hdl);
+}
+
+TEST_F(USVFSTestAuto, HookStatisticsCountCallsWhenEnabled)
+{
+  EXPECT_EQ(TRUE, ResetHookStatistics());
+  usvfs::hook_GetFileAttributesW(REAL_FILEW);
+
+  EXPECT_EQ(TRUE, EnableHookStatistics(TRUE));
+  usvfs::hook_GetFileAttributesW(REAL_FILEW);
+  usvfs::hook_GetFileAttributesW(REAL_FILEW);
+  EXPECT_EQ(TRUE, EnableHookStatistics(FALSE));
+
+  size_t count = 0;
+  EXPECT_EQ(TRUE, GetHookStatistics(nullptr, &count));
+  ASSERT_LT(0U, count);
+  std::vector<HookStatistics> stats(count);
+  EXPECT_EQ(TRUE, GetHookStatistics(stats.data(), &count));
+
+  auto iter = std::find_if(stats.begin(), stats.end(),
+                           [](const HookStatistics &entry) {
+                             return strcmp(entry.name, "GetFileAttributesW") == 0;
+                           });
+  ASSERT_NE(stats.end(), iter);
+  // only the calls made while enabled are counted
+  EXPECT_EQ(2, iter->calls);
+  EXPECT_EQ(0, iter->redirected);
+  EXPECT_LE(iter->realNanoseconds, iter->hookNanoseconds);
+  uint64_t bucketed = 0;
+  for (uint64_t calls : iter->latency) {
+    bucketed += calls;
+  }
+  EXPECT_EQ(2, bucketed);
+}
+
+TEST_F(USVFSTestAuto, ContextLockStatisticsCountAcquisitions)
+{
+  EXPECT_EQ(TRUE, ResetHookStatistics());
+  EXPECT_EQ(TRUE, EnableHookStatistics(TRUE));
+  usvfs::hook_GetFileAttributesW(REAL_FILEW);
+  EXPECT_EQ(TRUE, EnableHookStatistics(FALSE));
+
+  ContextLockStatistics stats;
+  size_t count = 0;
+  EXPECT_EQ(TRUE, GetContextLockStatistics(&stats, nullptr, &count));
+  EXPECT_LT(0U, stats.sharedAcquisitions);
+  // a single thread never waits
+  EXPECT_EQ(0, stats.contendedShared + stats.contendedExclusive);
+  EXPECT_EQ(0, stats.waitNanoseconds);
+  EXPECT_EQ(0, count);
+}
+
+TEST(MapTrackerTest, CaseInsensitiveLookup)
+{
+  usvfs::MapTracker tracker;
+  EXPECT_TRUE(tracker.empty());
+  EXPECT_EQ(L"", tracker.lookup(L"C:\\temp\\file.txt"));
+
+  tracker.insert(L"C:\\Temp\\File.txt", L"D:\\mods\\file.txt");
+  EXPECT_FALSE(tracker.empty());
+  EXPECT_TRUE(tracker.contains(L"c:\\TEMP\\file.TXT"));
+  EXPECT_FALSE(tracker.contains(L"c:\\TEMP\\file.TX"));
+
+  // lookups of a substring don't need a temporary key
+  const wchar_t *longer = L"C:\\temp\\file.txt.bak";
+  EXPECT_EQ(L"D:\\mods\\file.txt", tracker.lookup(longer, 16));
+
+  tracker.insert(L"c:\\temp\\file.txt", L"E:\\other.txt");
+  EXPECT_EQ(L"E:\\other.txt", tracker.lookup(L"C:\\TEMP\\FILE.TXT"));
+  EXPECT_TRUE(tracker.erase(L"C:\\temp\\FILE.txt"));
+  EXPECT_FALSE(tracker.erase(L"C:\\temp\\FILE.txt"));
+  EXPECT_TRUE(tracker.empty());
+}
+
+TEST(PathPoolTest, InternSharesPaths)
+{
+  usvfs::PathPool pool;
+  EXPECT_TRUE(pool.intern(L"").empty());
+  EXPECT_EQ(0U, pool.intern(nullptr).id());
+
+  usvfs::PathPool::Ref first = pool.intern(L"C:\\Temp\\File.txt");
+  usvfs::PathPool::Ref second = pool.intern(std::wstring(L"C:\\Temp\\File.txt"));
+  EXPECT_TRUE(first == second);
+  EXPECT_EQ(first.id(), second.id());
+  EXPECT_EQ(1U, pool.size());
+  EXPECT_EQ(std::wstring(L"C:\\Temp\\File.txt"), first.str());
+
+  // spellings are kept, they only share the folded hash
+  usvfs::PathPool::Ref other = pool.intern(L"c:\\temp\\file.TXT");
+  EXPECT_TRUE(first != other);
+  EXPECT_EQ(first.hash(), other.hash());
+  EXPECT_TRUE(first.foldedEquals(other.c_str(), other.size()));
+  EXPECT_EQ(2U, pool.size());
+
+  // the path is freed with its last reference
+  first = usvfs::PathPool::Ref();
+  EXPECT_EQ(2U, pool.size());
+  second = usvfs::PathPool::Ref();
+  EXPECT_EQ(1U, pool.size());
+  other = usvfs::PathPool::Ref();
+  EXPECT_EQ(0U, pool.size());
+}
+
+TEST(FoldedNameSetTest, InsertIsCaseInsensitive)
+{
+  usvfs::FoldedNameSet names;
+  EXPECT_TRUE(names.empty());
+  EXPECT_TRUE(names.insert(L"Textures"));
+  EXPECT_FALSE(names.insert(L"TEXTURES"));
+  EXPECT_TRUE(names.contains(L"textures"));
+  EXPECT_FALSE(names.contains(L"texture"));
+
+  // names are copied, so the source buffer may be reused
+  wchar_t buffer[] = L"meshes.bsa";
+  EXPECT_TRUE(names.insert(buffer, 6));
+  buffer[0] = L'x';
+  EXPECT_TRUE(names.contains(L"MESHES"));
+  EXPECT_FALSE(names.contains(L"meshes.bsa"));
+
+  // growing the table and the arena keeps every name
+  for (int i = 0; i < 5000; ++i) {
+    EXPECT_TRUE(names.insert(L"file" + std::to_wstring(i) + L".dds"));
+  }
+  EXPECT_EQ(5002U, names.size());
+  EXPECT_TRUE(names.contains(L"FILE4999.DDS"));
+
+  usvfs::FoldedNameSet copy(names);
+  names.clear();
+  EXPECT_TRUE(names.empty());
+  EXPECT_FALSE(names.contains(L"file1.dds"));
+  EXPECT_TRUE(copy.contains(L"file1.dds"));
+  EXPECT_FALSE(copy.insert(L"File1.DDS"));
+  EXPECT_TRUE(names.insert(L"file1.dds"));
+}
+
+TEST(ShardedHandleMapTest, InsertFindErase)
+{
+  usvfs::ShardedHandleMap<std::wstring> map;
+  HANDLE first = reinterpret_cast<HANDLE>(0x104);
+  HANDLE second = reinterpret_cast<HANDLE>(0x108);
+  std::wstring value;
+
+  EXPECT_TRUE(map.empty());
+  EXPECT_FALSE(map.find(first, value));
+  EXPECT_FALSE(map.erase(first));
+
+  map.insert(first, L"C:\\first");
+  map.insert(second, L"C:\\second");
+  map.insert(first, L"C:\\replaced");
+  EXPECT_TRUE(map.find(first, value));
+  EXPECT_EQ(L"C:\\replaced", value);
+
+  EXPECT_TRUE(map.erase(first, &value));
+  EXPECT_EQ(L"C:\\replaced", value);
+  EXPECT_FALSE(map.find(first, value));
+  EXPECT_FALSE(map.empty());
+  EXPECT_TRUE(map.erase(second));
+  EXPECT_TRUE(map.empty());
+}
+
+TEST(RerouteCacheTest, FoldsCaseAndGeneration)
+{
+  usvfs::RerouteCache cache;
+  const wchar_t *path = LR"(C:\Game\Data\Textures.bsa)";
+  const wchar_t *upper = LR"(C:\GAME\DATA\TEXTURES.BSA)";
+  bool rerouted = false;
+  std::wstring toPath;
+
+  EXPECT_FALSE(cache.lookup(path, wcslen(path), 1, rerouted, toPath));
+  cache.insert(path, wcslen(path), 1, true, LR"(C:\Mods\Textures.bsa)");
+  EXPECT_TRUE(cache.lookup(upper, wcslen(upper), 1, rerouted, toPath));
+  EXPECT_TRUE(rerouted);
+  EXPECT_EQ(LR"(C:\Mods\Textures.bsa)", toPath);
+  // entries of an older generation don't count
+  EXPECT_FALSE(cache.lookup(path, wcslen(path), 2, rerouted, toPath));
+
+  // filling the cache doesn't drop unrelated entries
+  for (int i = 0; i < 2 * static_cast<int>(usvfs::RerouteCache::MAX_ENTRIES); ++i) {
+    std::wstring other = L"C:\\Other\\" + std::to_wstring(i);
+    cache.insert(other.c_str(), other.size(), 1, false);
+  }
+  std::wstring last = L"C:\\Other\\" + std::to_wstring(2 * usvfs::RerouteCache::MAX_ENTRIES - 1);
+  EXPECT_TRUE(cache.lookup(last.c_str(), last.size(), 1, rerouted, toPath));
+  EXPECT_FALSE(rerouted);
+}
+
+TEST(WorkerPoolTest, StopRunsAllTasks)
+{
+  usvfs::WorkerPool &pool = usvfs::WorkerPool::instance();
+  std::atomic<int> done{0};
+  for (int i = 0; i < 100; ++i) {
+    pool.submit([&done] () { ++done; });
+  }
+  pool.stop();
+  EXPECT_EQ(100, done.load());
+
+  // the threads are started again
+  pool.submit([&done] () { ++done; });
+  pool.stop();
+  EXPECT_EQ(101, done.load());
+}
+
+TEST(ReadAheadTest, ProfileRoundTrip)
+{
+  std::vector<std::wstring> paths { L"\\\\?\\C:\\mods\\a\\textures.bsa",
+                                    L"\\\\?\\C:\\mods\\b\\\u00e9t\u00e9.esp" };
+  std::vector<std::wstring> parsed
+      = usvfs::ReadAhead::parseProfile(usvfs::ReadAhead::serializeProfile(paths));
+  EXPECT_EQ(paths, parsed);
+
+  // profiles edited by hand may use windows line endings and contain blank lines
+  parsed = usvfs::ReadAhead::parseProfile("C:\\a.esp\r\n\r\nC:\\b.esp");
+  ASSERT_EQ(2, parsed.size());
+  EXPECT_EQ(L"C:\\a.esp", parsed[0]);
+  EXPECT_EQ(L"C:\\b.esp", parsed[1]);
+}
+
+TEST(SHMLoggerTest, RenameKeepsPendingMessages)
+{
+  SHMLogger &logger = SHMLogger::create("usvfs_test_default");
+  logger.send("first", 5, 0);
+  logger.send("second", 6, 0);
+
+  SHMLogger &renamed = SHMLogger::rename("usvfs_test_instance");
+  // writers of the new queue reach the same reader
+  usvfs::shared::LogRing producer("__shm_sink_usvfs_test_instance", false);
+  EXPECT_TRUE(producer.push("third", 5));
+
+  char buffer[SHMLogger::MESSAGE_SIZE];
+  ASSERT_TRUE(renamed.tryGet(buffer, sizeof(buffer)));
+  EXPECT_STREQ("first", buffer);
+  ASSERT_TRUE(renamed.tryGet(buffer, sizeof(buffer)));
+  EXPECT_STREQ("second", buffer);
+  ASSERT_TRUE(renamed.tryGet(buffer, sizeof(buffer)));
+  EXPECT_STREQ("third", buffer);
+  EXPECT_FALSE(renamed.tryGet(buffer, sizeof(buffer)));
+
+  SHMLogger::free();
+}
+
+DATA_ID(FirstTestData);
+DATA_ID(SecondTestData);
+
+TEST_F(USVFSTest, CustomDataSlotsAreSeparate)
+{
+  USVFSParameters params;
+  USVFSInitParameters(&params, "usvfs_test", true, LogLevel::Debug, CrashDumpsType::None, "");
+  std::unique_ptr<usvfs::HookContext> ctx(CreateHookContext(params, ::GetModuleHandle(nullptr)));
+
+  ctx->customData<int, FirstTestData>() = 42;
+  EXPECT_EQ(0, (ctx->customData<int, SecondTestData>()));
+  EXPECT_EQ(42, (ctx->customData<int, FirstTestData>()));
+
+  ctx->customData<std::wstring, SecondTestData>() = L"second";
+  EXPECT_EQ(L"second", (ctx->customData<std::wstring, SecondTestData>()));
+  EXPECT_EQ(0, (ctx->customData<int, SecondTestData>()));
+}
+
 TEST_F(USVFSTestAuto, CannotCreateLinkToFileInNonexistantDirectory)
 {
   EXPECT_EQ(FALSE, VirtualLinkFile(REAL_FILEW, L"c:/this_directory_shouldnt_exist/np.exe", FALSE));
@@ -338,6 +686,145 @@ TEST_F(USVFSTestAuto, CanCreateMultipleLinks)
   EXPECT_NE(0UL, usvfs::hook_GetFileAttributesW(outDirCanonizeTest) & FILE_ATTRIBUTE_DIRECTORY);
 }
 
+static BOOL WINAPI appendDump(LPCSTR data, size_t size, LPVOID userData)
+{
+  static_cast<std::string*>(userData)->append(data, size);
+  return TRUE;
+}
+
+TEST_F(USVFSTestAuto, StreamedDumpMatchesVFSDump)
+{
+  EXPECT_EQ(TRUE, VirtualLinkFile(REAL_FILEW, LR"(C:\np.exe)", 0));
+
+  size_t size = 0;
+  EXPECT_EQ(FALSE, CreateVFSDump(nullptr, &size));
+  std::string dump(size + 1, '\0');
+  EXPECT_EQ(TRUE, CreateVFSDump(&dump[0], &size));
+  dump.resize(size);
+  EXPECT_NE(std::string::npos, dump.find("np.exe -> "));
+
+  std::string streamed;
+  EXPECT_EQ(TRUE, CreateVFSDumpStream(VFSDUMP_TEXT, &appendDump, &streamed));
+  EXPECT_EQ(dump, streamed);
+
+  std::string binary;
+  EXPECT_EQ(TRUE, CreateVFSDumpStream(VFSDUMP_BINARY, &appendDump, &binary));
+  ASSERT_LT(8U, binary.size());
+  EXPECT_EQ(std::string("USVD"), binary.substr(0, 4));
+  EXPECT_NE(std::string::npos, binary.find("np.exe"));
+
+  EXPECT_EQ(FALSE, CreateVFSDumpStream(42, &appendDump, &binary));
+}
+
+// polls the dump of the redirection table until it does or doesn't contain a string
+static bool waitForDump(const std::string &text, bool contained)
+{
+  for (int i = 0; i < 50; ++i) {
+    size_t size = 0;
+    CreateVFSDump(nullptr, &size);
+    std::string dump(size + 1, '\0');
+    CreateVFSDump(&dump[0], &size);
+    if ((dump.find(text) != std::string::npos) == contained) {
+      return true;
+    }
+    ::Sleep(100);
+  }
+  return false;
+}
+
+TEST_F(USVFSTestAuto, MonitoredLinkFollowsSourceChanges)
+{
+  wchar_t tempPath[MAX_PATH];
+  ASSERT_NE(0UL, ::GetTempPathW(MAX_PATH, tempPath));
+  std::wstring source = std::wstring(tempPath) + L"usvfs_monitor_test";
+  std::wstring newFile = source + LR"(\new.txt)";
+  ::CreateDirectoryW(source.c_str(), nullptr);
+  ::DeleteFileW(newFile.c_str());
+
+  static LPCWSTR outDir = LR"(C:\usvfs_monitor_test)";
+  EXPECT_EQ(TRUE, VirtualLinkDirectoryStatic(source.c_str(), outDir,
+                                             LINKFLAG_RECURSIVE | LINKFLAG_MONITORCHANGES));
+  EXPECT_TRUE(waitForDump("new.txt", false));
+
+  // the file is added to the table without linking again
+  { std::ofstream(newFile) << "usvfs"; }
+  EXPECT_TRUE(waitForDump("new.txt", true));
+
+  ::DeleteFileW(newFile.c_str());
+  EXPECT_TRUE(waitForDump("new.txt", false));
+
+  ClearVirtualMappings();
+  ::RemoveDirectoryW(source.c_str());
+}
+
+TEST_F(USVFSTestAuto, SnapshotRestoresLinksAndPicksUpChanges)
+{
+  wchar_t tempPath[MAX_PATH];
+  ASSERT_NE(0UL, ::GetTempPathW(MAX_PATH, tempPath));
+  std::wstring source = std::wstring(tempPath) + L"usvfs_snapshot_test";
+  std::wstring snapshot = std::wstring(tempPath) + L"usvfs_snapshot_test.bin";
+  std::wstring oldFile = source + LR"(\old.txt)";
+  std::wstring newFile = source + LR"(\new.txt)";
+  ::CreateDirectoryW(source.c_str(), nullptr);
+  ::DeleteFileW(newFile.c_str());
+  { std::ofstream(oldFile) << "usvfs"; }
+
+  EXPECT_EQ(TRUE, VirtualLinkDirectoryStatic(source.c_str(), LR"(C:\usvfs_snapshot_test)",
+                                             LINKFLAG_RECURSIVE));
+  EXPECT_EQ(TRUE, SaveVFSSnapshot(snapshot.c_str()));
+  ClearVirtualMappings();
+  EXPECT_TRUE(waitForDump("old.txt", false));
+
+  // the directory changed after saving, so loading has to rescan it
+  ::Sleep(50);
+  { std::ofstream(newFile) << "usvfs"; }
+  EXPECT_EQ(TRUE, LoadVFSSnapshot(snapshot.c_str()));
+  EXPECT_TRUE(waitForDump("old.txt", true));
+  EXPECT_TRUE(waitForDump("new.txt", true));
+
+  EXPECT_EQ(FALSE, LoadVFSSnapshot((snapshot + L".missing").c_str()));
+
+  ClearVirtualMappings();
+  ::DeleteFileW(snapshot.c_str());
+  ::DeleteFileW(oldFile.c_str());
+  ::DeleteFileW(newFile.c_str());
+  ::RemoveDirectoryW(source.c_str());
+}
+
+TEST_F(USVFSTestAuto, MaterializedFilesAreHardLinked)
+{
+  wchar_t tempPath[MAX_PATH];
+  ASSERT_NE(0UL, ::GetTempPathW(MAX_PATH, tempPath));
+  std::wstring source = std::wstring(tempPath) + L"usvfs_materialize_source";
+  std::wstring destination = std::wstring(tempPath) + L"usvfs_materialize_destination";
+  std::wstring sourceFile = source + LR"(\materialized.txt)";
+  std::wstring destinationFile = destination + LR"(\materialized.txt)";
+  ::CreateDirectoryW(source.c_str(), nullptr);
+  ::CreateDirectoryW(destination.c_str(), nullptr);
+  { std::ofstream(sourceFile) << "usvfs"; }
+
+  wchar_t volume[MAX_PATH];
+  ASSERT_TRUE(::GetVolumePathNameW(source.c_str(), volume, MAX_PATH));
+  std::wstring stagedFile = std::wstring(volume)
+                            + LR"(usvfs_staging\usvfs_test_fixture\0\materialized.txt)";
+
+  EXPECT_EQ(TRUE, VirtualLinkDirectoryStatic(source.c_str(), destination.c_str(),
+                                             LINKFLAG_RECURSIVE | LINKFLAG_MATERIALIZE));
+  // the link is in the staging directory and the tree points at it, the destination
+  // directory stays untouched
+  EXPECT_EQ(INVALID_FILE_ATTRIBUTES, ::GetFileAttributesW(destinationFile.c_str()));
+  EXPECT_NE(INVALID_FILE_ATTRIBUTES, ::GetFileAttributesW(stagedFile.c_str()));
+  EXPECT_TRUE(waitForDump("materialized.txt", true));
+
+  ClearVirtualMappings();
+  EXPECT_EQ(INVALID_FILE_ATTRIBUTES, ::GetFileAttributesW(stagedFile.c_str()));
+  EXPECT_NE(INVALID_FILE_ATTRIBUTES, ::GetFileAttributesW(sourceFile.c_str()));
+
+  ::DeleteFileW(sourceFile.c_str());
+  ::RemoveDirectoryW(source.c_str());
+  ::RemoveDirectoryW(destination.c_str());
+}
+
 int main(int argc, char **argv) {
   using namespace test;
 
@@ -0,0 +1,30 @@
+
+#include "usvfs_benchmark_test.h"
+
+const char* usvfs_benchmark_test::scenario_name()
+{
+  return SCENARIO_NAME;
+}
+
+void usvfs_benchmark_test::scenario_prepare()
+{
+  // the layout has to exist before the mappings are applied since linking a directory
+  // only picks up the files which exist at that point
+  ops_benchgen(LR"(mod\data)", bench_files(FILES));
+}
+
+bool usvfs_benchmark_test::scenario_run()
+{
+  const path& baseline = options().temp / BASELINE_FILE;
+
+  ops_bench(LR"(mod\data)", PASSES, false, L"-benchsave " + baseline.wstring());
+  ops_bench(LR"(data)", PASSES, true, L"-benchbase " + baseline.wstring());
+
+  return true;
+}
+
+bool usvfs_benchmark_test::scenario_postmortem()
+{
+  // timings differ between every run so there is no golden output to compare with
+  return false;
+}
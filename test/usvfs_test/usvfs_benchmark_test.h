@@ -0,0 +1,22 @@
+#pragma once
+
+#include "usvfs_test_base.h"
+
+// Replays the test_file_operations benchmark workload over a synthetic mod layout, first unhooked
+// over the source directory (baseline) and then hooked over the mount, so the per call overhead of
+// the hooks can be compared between releases.
+class usvfs_benchmark_test : public usvfs_test_base
+{
+public:
+  static constexpr auto SCENARIO_NAME = "benchmark";
+  static constexpr std::size_t FILES = 100000;
+  static constexpr unsigned PASSES = 3;
+  static constexpr auto BASELINE_FILE = L"benchmark_baseline.txt";
+
+  usvfs_benchmark_test(const usvfs_test_options& options) : usvfs_test_base(options) {}
+
+  virtual const char* scenario_name();
+  virtual bool scenario_run();
+  virtual void scenario_prepare();
+  virtual bool scenario_postmortem();
+};
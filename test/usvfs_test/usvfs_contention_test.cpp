@@ -0,0 +1,86 @@
+#include "usvfs_contention_test.h"
+#include <algorithm>
+#include <cstdio>
+
+const char* usvfs_contention_test::scenario_name()
+{
+  return SCENARIO_NAME;
+}
+
+void usvfs_contention_test::scenario_prepare()
+{
+  // the layout has to exist before the mappings are applied since linking a directory
+  // only picks up the files which exist at that point
+  ops_benchgen(LR"(mod\data)", bench_files(FILES));
+}
+
+bool usvfs_contention_test::scenario_run()
+{
+  std::vector<std::pair<std::string, Results>> rows;
+
+  for (unsigned processes = 1; processes <= MAX_PROCESSES; processes *= 2)
+    for (unsigned threads = 1; threads <= MAX_THREADS; threads *= 2)
+    {
+      std::vector<path> files;
+      std::vector<wstring> args;
+      for (unsigned i = 0; i < processes; ++i) {
+        files.push_back(options().temp / (L"contention_" + std::to_wstring(processes) + L"x"
+          + std::to_wstring(threads) + L"_" + std::to_wstring(i) + L".txt"));
+        args.push_back(L"-benchthreads " + std::to_wstring(threads) + L" -benchsave " + files.back().wstring());
+      }
+
+      ops_bench_parallel(LR"(data)", PASSES, args);
+
+      Results merged;
+      for (const auto& file : files)
+        merge(file, processes, merged);
+      rows.emplace_back(std::to_string(processes) + "x" + std::to_string(threads), merged);
+    }
+
+  const auto& log = output();
+  std::fprintf(log, "%-11s %14s %10s %10s %10s %10s %10s %10s\n", "procs x thr", "total ops/s",
+    "stat p50", "stat p99", "open p50", "open p99", "enum p50", "enum p99");
+  for (const auto& row : rows)
+  {
+    const Results& r = row.second;
+    auto get = [&r](const char* op) {
+      auto iter = r.find(op);
+      return iter != r.end() ? iter->second : Result();
+    };
+    std::fprintf(log, "%-11s %14.1f %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f\n", row.first.c_str(),
+      get("total").ops_per_second, get("stat").p50_us, get("stat").p99_us,
+      get("open").p50_us, get("open").p99_us, get("enumerate").p50_us, get("enumerate").p99_us);
+  }
+  std::fprintf(log, "(latencies in us, p50 averaged over the processes, p99 of the slowest process)\n");
+
+  return true;
+}
+
+bool usvfs_contention_test::scenario_postmortem()
+{
+  // timings differ between every run so there is no golden output to compare with
+  return false;
+}
+
+//static
+void usvfs_contention_test::merge(const path& file, unsigned processes, Results& merged)
+{
+  test::ScopedFILE in;
+  errno_t err = _wfopen_s(in, file.c_str(), L"rt");
+  if (err || !in)
+    throw_testWinFuncFailed("_wfopen_s", file.u8string().c_str(), err);
+
+  // same format as TestBenchmark::save. Only the total has a meaningful throughput, for the
+  // single operations seconds is the time spent in those calls
+  char name[64];
+  unsigned long long count;
+  double seconds, p50, p99;
+  while (std::fscanf(in, "%63s %llu %lf %lf %lf", name, &count, &seconds, &p50, &p99) == 5)
+  {
+    Result& r = merged[name];
+    if (seconds > 0.0)
+      r.ops_per_second += count / seconds;
+    r.p50_us += p50 / processes;
+    r.p99_us = std::max(r.p99_us, p99);
+  }
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "usvfs_test_base.h"
+#include <map>
+#include <string>
+
+// Runs the test_file_operations benchmark workload in N hooked processes with M threads each, all
+// working on the same mount at once, and reports how aggregate throughput and tail latency develop
+// as N and M grow. This is what shows whether the locks shared between hooked processes scale.
+class usvfs_contention_test : public usvfs_test_base
+{
+public:
+  static constexpr auto SCENARIO_NAME = "contention";
+  static constexpr std::size_t FILES = 20000;
+  static constexpr unsigned PASSES = 1;
+  static constexpr unsigned MAX_PROCESSES = 8;
+  static constexpr unsigned MAX_THREADS = 8;
+
+  usvfs_contention_test(const usvfs_test_options& options) : usvfs_test_base(options) {}
+
+  virtual const char* scenario_name();
+  virtual bool scenario_run();
+  virtual void scenario_prepare();
+  virtual bool scenario_postmortem();
+
+private:
+  struct Result {
+    double ops_per_second = 0.0;
+    double p50_us = 0.0;
+    double p99_us = 0.0;
+  };
+  typedef std::map<std::string, Result> Results;
+
+  // reads a result saved by test_file_operations -benchsave and adds it to merged: throughput adds
+  // up, p50 is averaged over the processes and p99 is the one of the slowest process
+  static void merge(const path& file, unsigned processes, Results& merged);
+};
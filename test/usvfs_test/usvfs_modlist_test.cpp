@@ -0,0 +1,31 @@
+#include "usvfs_modlist_test.h"
+
+const char* usvfs_modlist_test::scenario_name()
+{
+  return SCENARIO_NAME;
+}
+
+void usvfs_modlist_test::scenario_prepare()
+{
+  ops_benchmods(MODS_DIR, bench_files(FILES));
+}
+
+usvfs_test_base::path usvfs_modlist_test::scenario_mapping()
+{
+  // written by test_file_operations -benchmods next to the mods
+  return options().source / MODS_DIR / L"vfs_mappings.txt";
+}
+
+bool usvfs_modlist_test::scenario_run()
+{
+  // the mods are linked onto the root of the mount
+  ops_bench(LR"(.)", PASSES, true);
+
+  return true;
+}
+
+bool usvfs_modlist_test::scenario_postmortem()
+{
+  // timings differ between every run so there is no golden output to compare with
+  return false;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "usvfs_test_base.h"
+
+// Runs the test_file_operations benchmark workload over the mount of a generated modlist (see
+// TestBenchmark::generate_mods): mods of power law sizes overlaid on each other, some replacing the
+// files of earlier ones. The layout only depends on the number of files (-benchfiles), so runs with
+// the same count work on identical setups, e.g. 10000, 100000 and 1000000 files.
+class usvfs_modlist_test : public usvfs_test_base
+{
+public:
+  static constexpr auto SCENARIO_NAME = "modlist";
+  static constexpr std::size_t FILES = 10000;
+  static constexpr unsigned PASSES = 1;
+  static constexpr auto MODS_DIR = L"mods";
+
+  usvfs_modlist_test(const usvfs_test_options& options) : usvfs_test_base(options) {}
+
+  virtual const char* scenario_name();
+  virtual bool scenario_run();
+  virtual void scenario_prepare();
+  virtual path scenario_mapping();
+  virtual bool scenario_postmortem();
+};
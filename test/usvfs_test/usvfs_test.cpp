@@ -4,6 +4,9 @@
 #include <winapi.h>
 #include <stringcast.h>
 #include "usvfs_basic_test.h"
+#include "usvfs_benchmark_test.h"
+#include "usvfs_contention_test.h"
+#include "usvfs_modlist_test.h"
 
 void print_usage(const std::wstring& exe_name, const std::wstring& test_name) {
   using namespace std;
@@ -20,6 +23,7 @@ void print_usage(const std::wstring& exe_name, const std::wstring& test_name) {
   wcerr << " -source <dir>    : source dir (default is <temp dir>\\source)." << endl;
   wcerr << " -out <file>      : output file (default is <temp dir>\\<scenario>_<label>.log)." << endl;
   wcerr << " -usvfslog <file> : output file (default is <temp dir>\\<scenario>_<label>_usvfs.log)." << endl;
+  wcerr << " -benchfiles <n>  : number of files the benchmark scenarios generate (default depends on the scenario)." << endl;
   wcerr << " -forcetemprecursivedelete : decimate temp dir even if doesn't look like a temp dir." << endl;
   wcerr << endl;
   wcerr << "note: if <label> is ommited the current platform (x86/x64) is used." << endl;
@@ -33,6 +37,12 @@ usvfs_test_base* find_scenario(const std::string& scenario, const usvfs_test_opt
 {
   if (scenario == usvfs_basic_test::SCENARIO_NAME)
     return new usvfs_basic_test(options);
+  else if (scenario == usvfs_benchmark_test::SCENARIO_NAME)
+    return new usvfs_benchmark_test(options);
+  else if (scenario == usvfs_contention_test::SCENARIO_NAME)
+    return new usvfs_contention_test(options);
+  else if (scenario == usvfs_modlist_test::SCENARIO_NAME)
+    return new usvfs_modlist_test(options);
   else
     return nullptr;
 }
@@ -161,6 +171,11 @@ int wmain(int argc, wchar_t *argv[])
         return 1;
       options.usvfs_log = argv[++ai];
     }
+    else if (wcscmp(argv[ai], L"-benchfiles") == 0) {
+      if (!verify_args_exist(L"-benchfiles", 1, ai, argc))
+        return 1;
+      options.bench_files = static_cast<std::size_t>(wcstoull(argv[++ai], nullptr, 10));
+    }
     else if (wcscmp(argv[ai], L"-forcetemprecursivedelete") == 0)
       options.force_temp_cleanup = true;
     else if (argv[ai][0] == '-') {
@@ -174,7 +174,8 @@ public:
     fprintf(log, "\n");
   }
 
-  static DWORD spawn(wchar_t* commandline)
+  // starts the process without waiting for it, the caller has to close the returned process handle
+  static HANDLE spawn_async(wchar_t* commandline, bool hooked = true)
   {
     using namespace usvfs::shared;
 
@@ -182,39 +183,62 @@ public:
     si.cb = sizeof(si);
     PROCESS_INFORMATION pi{ 0 };
 
-    if (!CreateProcessHooked(NULL, commandline, NULL, NULL, FALSE, 0, NULL, NULL, &si, &pi))
-      throw_testWinFuncFailed("CreateProcessHooked", string_cast<std::string>(commandline, CodePage::UTF8).c_str());
+    if (hooked) {
+      if (!CreateProcessHooked(NULL, commandline, NULL, NULL, FALSE, 0, NULL, NULL, &si, &pi))
+        throw_testWinFuncFailed("CreateProcessHooked", string_cast<std::string>(commandline, CodePage::UTF8).c_str());
+    }
+    else if (!CreateProcessW(NULL, commandline, NULL, NULL, FALSE, 0, NULL, NULL, &si, &pi))
+      throw_testWinFuncFailed("CreateProcessW", string_cast<std::string>(commandline, CodePage::UTF8).c_str());
+
+    CloseHandle(pi.hThread);
+    return pi.hProcess;
+  }
 
-    WaitForSingleObject(pi.hProcess, INFINITE);
+  // waits for the process to end and closes its handle
+  static DWORD wait_exit(HANDLE process)
+  {
+    WaitForSingleObject(process, INFINITE);
 
     DWORD exit = 99;
-    if (!GetExitCodeProcess(pi.hProcess, &exit))
+    if (!GetExitCodeProcess(process, &exit))
     {
       test::WinFuncFailedGenerator failed;
-      CloseHandle(pi.hProcess);
-      CloseHandle(pi.hThread);
+      CloseHandle(process);
       throw failed("GetExitCodeProcess");
     }
 
-    CloseHandle(pi.hProcess);
-    CloseHandle(pi.hThread);
+    CloseHandle(process);
 
     return exit;
   }
 
+  static DWORD spawn(wchar_t* commandline, bool hooked = true)
+  {
+    return wait_exit(spawn_async(commandline, hooked));
+  }
+
   void usvfs_logger()
   {
     fprintf(m_usvfs_log, "usvfs_test usvfs logger started:\n");
     fflush(m_usvfs_log);
 
-    constexpr size_t size = 1024;
-    char buf[size + 1]{ 0 };
+    constexpr size_t size = 64 * 1024;
+    std::vector<char> buf(size, '\0');
+    auto writeBatch = [&]() {
+      size_t count = GetLogMessagesBatch(buf.data(), size, false);
+      const char *message = buf.data();
+      for (size_t i = 0; i < count; ++i) {
+        size_t length = strlen(message);
+        fwrite(message, 1, length, m_usvfs_log);
+        fwrite("\n", 1, 1, m_usvfs_log);
+        message += length + 1;
+      }
+      return count > 0;
+    };
     int noLogCycles = 0;
     std::chrono::milliseconds wait_for;
     do {
-      if (GetLogMessages(buf, size, false)) {
-        fwrite(buf, 1, strlen(buf), m_usvfs_log);
-        fwrite("\n", 1, 1, m_usvfs_log);
+      if (writeBatch()) {
         fflush(m_usvfs_log);
         noLogCycles = 0;
       }
@@ -226,9 +250,7 @@ public:
         wait_for = std::chrono::milliseconds(0);
     } while (m_exit_future.wait_for(wait_for) == std::future_status::timeout);
 
-    while (GetLogMessages(buf, size, false)) {
-      fwrite(buf, 1, strlen(buf), m_usvfs_log);
-      fwrite("\n", 1, 1, m_usvfs_log);
+    while (writeBatch()) {
     }
 
     fprintf(m_usvfs_log, "usvfs log closed.\n");
@@ -666,6 +688,11 @@ int usvfs_test_base::run_impl(const std::wstring& exe_name)
     cleanup_temp();
     log_settings(exe_name);
     copy_fixture();
+    scenario_prepare();
+
+    const path& generated_mapping = scenario_mapping();
+    if (!generated_mapping.empty())
+      mappings = mappings_reader(m_o.mount, generated_mapping.parent_path()).read(generated_mapping);
 
     usvfs_connector usvfs(m_o);
     {
@@ -686,7 +713,7 @@ int usvfs_test_base::run_impl(const std::wstring& exe_name)
     if (!res)
       return 7;
 
-    if (!postmortem_check())
+    if (scenario_postmortem() && !postmortem_check())
       return 8;
 
     return 0;
@@ -796,26 +823,122 @@ void usvfs_test_base::ops_deleterename(const path& src_rel_path, const path& des
   run_ops(should_succeed, command, src_rel_path, additional_args, wstring(), dest_rel_path);
 }
 
+void usvfs_test_base::ops_benchgen(const path& source_rel_path, std::size_t files, bool should_succeed, const wstring& additional_args)
+{
+  run_ops(should_succeed, L"-benchgen", source_rel_path, additional_args, std::to_wstring(files), path(), false);
+}
+
+void usvfs_test_base::ops_benchmods(const path& source_rel_path, std::size_t files, bool should_succeed, const wstring& additional_args)
+{
+  run_ops(should_succeed, L"-benchmods", source_rel_path, additional_args, std::to_wstring(files), path(), false);
+}
+
+void usvfs_test_base::ops_bench(const path& rel_path, unsigned passes, bool hooked, bool should_succeed, const wstring& additional_args)
+{
+  run_ops(should_succeed, L"-bench", rel_path, additional_args, std::to_wstring(passes), path(), hooked);
+}
+
+
+void usvfs_test_base::ops_bench_parallel(const path& rel_path, unsigned passes, const std::vector<wstring>& process_args, bool should_succeed)
+{
+  using namespace usvfs::shared;
+
+  // the processes only start the workload once all of them are set up, otherwise the first ones
+  // would be done before the last ones are even launched
+  std::string sync = "usvfs_test_bench_" + std::to_string(GetCurrentProcessId());
+  HANDLE ready = CreateSemaphoreA(nullptr, 0, static_cast<LONG>(process_args.size()), (sync + "_ready").c_str());
+  if (!ready)
+    throw_testWinFuncFailed("CreateSemaphoreA", (sync + "_ready").c_str());
+  HANDLE go = CreateEventA(nullptr, TRUE, FALSE, (sync + "_go").c_str());
+  if (!go) {
+    test::WinFuncFailedGenerator failed;
+    CloseHandle(ready);
+    throw failed("CreateEventA", (sync + "_go").c_str());
+  }
+
+  std::vector<HANDLE> processes;
+  std::vector<std::string> commandlogs;
+  try {
+    for (const auto& args : process_args) {
+      wstring commandline;
+      std::string commandlog;
+      ops_commandline(L"-bench", rel_path, L"-benchsync " + string_cast<wstring>(sync) + L" " + args,
+        std::to_wstring(passes), path(), true, commandline, commandlog);
+      fprintf(output(), "Spawning (parallel): %s\n", commandlog.c_str());
+      processes.push_back(usvfs_connector::spawn_async(&commandline[0]));
+      commandlogs.push_back(commandlog);
+    }
+
+    // a process which fails before it is set up would never signal so stop waiting when one ends
+    for (std::size_t waiting = processes.size(); waiting > 0;) {
+      if (WaitForSingleObject(ready, 100) == WAIT_OBJECT_0)
+        --waiting;
+      else if (WaitForMultipleObjects(static_cast<DWORD>(processes.size()), processes.data(), FALSE, 0) < WAIT_OBJECT_0 + processes.size())
+        break;
+    }
+  }
+  catch (...) {
+    SetEvent(go);
+    for (HANDLE process : processes)
+      usvfs_connector::wait_exit(process);
+    CloseHandle(go);
+    CloseHandle(ready);
+    throw;
+  }
+  SetEvent(go);
+
+  std::vector<DWORD> results;
+  for (HANDLE process : processes)
+    results.push_back(usvfs_connector::wait_exit(process));
+  fprintf(output(), "\n");
+  CloseHandle(go);
+  CloseHandle(ready);
+
+  for (std::size_t i = 0; i < results.size(); ++i) {
+    bool success = results[i] == 0;
+    if (success != should_succeed)
+      throw test::FuncFailed("ops_bench_parallel", success ? "succeeded" : "failed", commandlogs[i].c_str(), results[i]);
+  }
+}
+
 
-void usvfs_test_base::run_ops(bool should_succeed, const wstring& preargs, const path& rel_path, const wstring& additional_args, const wstring& postargs, const path& rel_path2)
+void usvfs_test_base::run_ops(bool should_succeed, const wstring& preargs, const path& rel_path, const wstring& additional_args, const wstring& postargs, const path& rel_path2, bool hooked)
+{
+  wstring commandline;
+  std::string commandlog;
+  ops_commandline(preargs, rel_path, additional_args, postargs, rel_path2, hooked, commandline, commandlog);
+
+  fprintf(output(), "Spawning%s: %s\n", hooked ? "" : " (unhooked)", commandlog.c_str());
+  auto res = usvfs_connector::spawn(&commandline[0], hooked);
+  fprintf(output(), "\n");
+
+  bool success = res == 0;
+  if (success != should_succeed)
+    throw test::FuncFailed("run_ops", success ? "succeeded" : "failed", commandlog.c_str(), res);
+}
+
+void usvfs_test_base::ops_commandline(const wstring& preargs, const path& rel_path, const wstring& additional_args, const wstring& postargs, const path& rel_path2, bool hooked, wstring& commandline, std::string& commandlog)
 {
   using namespace usvfs::shared;
   using string = std::string;
-  using wstring = wstring;
 
-  string commandlog = test::path(m_o.opsexe).filename().u8string();
-  wstring commandline = m_o.opsexe;
+  commandlog = test::path(m_o.opsexe).filename().u8string();
+  commandline = m_o.opsexe;
   if (commandline.find(' ') != wstring::npos && commandline.find('"') == wstring::npos) {
     commandline = L"\"" + commandline + L"\"";
     commandlog = "\"" + commandlog + "\"";
   }
 
-  if (!m_o.mount.empty())
+  // unhooked processes can't see the mount so their paths are relative to the source directory
+  const path& base = hooked ? m_o.mount : m_o.source;
+  const char* base_label = hooked ? MOUNT_LABEL : SOURCE_LABEL;
+
+  if (!base.empty())
   {
     commandline += L" -basedir ";
-    commandline += m_o.mount;
+    commandline += base;
     commandlog += " -basedir ";
-    commandlog += m_o.mount.filename().u8string();
+    commandlog += base.filename().u8string();
   }
 
   if (!m_o.ops_options.empty()) {
@@ -846,16 +969,16 @@ void usvfs_test_base::run_ops(bool should_succeed, const wstring& preargs, const
 
   if (!rel_path.empty()) {
     commandline += L" ";
-    commandline += m_o.mount / rel_path;
+    commandline += base / rel_path;
     commandlog += " ";
-    commandlog += MOUNT_LABEL + rel_path.u8string();
+    commandlog += base_label + rel_path.u8string();
   }
 
   if (!rel_path2.empty()) {
     commandline += L" ";
-    commandline += m_o.mount / rel_path2;
+    commandline += base / rel_path2;
     commandlog += " ";
-    commandlog += MOUNT_LABEL + rel_path2.u8string();
+    commandlog += base_label + rel_path2.u8string();
   }
 
   if (!postargs.empty()) {
@@ -864,14 +987,6 @@ void usvfs_test_base::run_ops(bool should_succeed, const wstring& preargs, const
     commandlog += " ";
     commandlog += string_cast<string>(postargs, CodePage::UTF8);
   }
-
-  fprintf(output(), "Spawning: %s\n", commandlog.c_str());
-  auto res = usvfs_connector::spawn(&commandline[0]);
-  fprintf(output(), "\n");
-
-  bool success = res == 0;
-  if (success != should_succeed)
-    throw test::FuncFailed("run_ops", success ? "succeeded" : "failed", commandlog.c_str(), res);
 }
 
 std::string usvfs_test_base::mount_contents(const path& rel_path)
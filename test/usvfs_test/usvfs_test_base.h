@@ -3,6 +3,7 @@
 #include <test_helpers.h>
 #include <filesystem>
 #include <string>
+#include <vector>
 
 class usvfs_test_options {
 public:
@@ -28,6 +29,7 @@ public:
   path output;
   path usvfs_log;
   std::wstring ops_options;
+  std::size_t bench_files = 0; // files the benchmark scenarios generate, 0 for their own default
   bool temp_cleanup = false;
   bool force_temp_cleanup = false;
 };
@@ -55,6 +57,16 @@ public:
   virtual const char* scenario_name() = 0;
   virtual bool scenario_run() = 0;
 
+  // called after the fixture is copied but before the VFS is connected and the mappings are applied
+  virtual void scenario_prepare() {}
+
+  // scenarios which don't produce a deterministic result (i.e. benchmarks) can skip the postmortem check
+  virtual bool scenario_postmortem() { return true; }
+
+  // scenarios which generate their mappings in scenario_prepare return the generated file here, it
+  // is applied instead of the mapping of the options. Its sources are relative to its own directory
+  virtual path scenario_mapping() { return path(); }
+
   // helpers for derived scenarios:
 
   virtual void ops_list(const path& rel_path, bool recursive, bool with_contents, bool should_succeed = true, const wstring& additional_args = wstring());
@@ -68,6 +80,17 @@ public:
   virtual void ops_rename(const path& src_rel_path, const path& dest_rel_path, bool replace, bool allow_copy = false, bool should_succeed = true, const wstring& additional_args = wstring());
   virtual void ops_deleterename(const path& src_rel_path, const path& dest_rel_path, bool allow_copy = false, bool should_succeed = true, const wstring& additional_args = wstring());
 
+  // generates a synthetic layout under the source directory (without hooking)
+  virtual void ops_benchgen(const path& source_rel_path, std::size_t files, bool should_succeed = true, const wstring& additional_args = wstring());
+  // generates synthetic mods under the source directory (without hooking) along with the mapping file
+  // linking them (see TestBenchmark::generate_mods)
+  virtual void ops_benchmods(const path& source_rel_path, std::size_t files, bool should_succeed = true, const wstring& additional_args = wstring());
+  // runs the benchmark workload either hooked over a mount path or unhooked over a source path
+  virtual void ops_bench(const path& rel_path, unsigned passes, bool hooked, bool should_succeed = true, const wstring& additional_args = wstring());
+  // runs the benchmark workload in one hooked process per entry of process_args (the additional
+  // arguments of that process) at the same time
+  virtual void ops_bench_parallel(const path& rel_path, unsigned passes, const std::vector<wstring>& process_args, bool should_succeed = true);
+
   virtual std::string mount_contents(const path& rel_path);
   virtual void verify_mount_contents(const path& rel_path, const char* contents);
   virtual void verify_mount_existance(const path& rel_path, bool exists = true, bool is_dir = false);
@@ -75,6 +98,12 @@ public:
   virtual void verify_source_contents(const path& rel_path, const char* contents);
   virtual void verify_source_existance(const path& rel_path, bool exists = true, bool is_dir = false);
 
+protected:
+  const usvfs_test_options& options() const { return m_o; }
+
+  // number of files a benchmark scenario should generate, -benchfiles overrides its default
+  std::size_t bench_files(std::size_t scenario_default) const { return m_o.bench_files ? m_o.bench_files : scenario_default; }
+
 private:
   int run_impl(const std::wstring& exe_name);
   void log_settings(const std::wstring& exe_name);
@@ -85,7 +114,8 @@ private:
   void clean_output();
 
   test::ScopedFILE output();
-  void run_ops(bool should_succeed, const wstring& preargs, const path& rel_path, const wstring& additional_args, const wstring& postargs = wstring(), const path& rel_path2 = path());
+  void ops_commandline(const wstring& preargs, const path& rel_path, const wstring& additional_args, const wstring& postargs, const path& rel_path2, bool hooked, wstring& commandline, std::string& commandlog);
+  void run_ops(bool should_succeed, const wstring& preargs, const path& rel_path, const wstring& additional_args, const wstring& postargs = wstring(), const path& rel_path2 = path(), bool hooked = true);
   bool verify_contents(const path& file, const char* contents);
 
   const usvfs_test_options& m_o;